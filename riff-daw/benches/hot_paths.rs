@@ -0,0 +1,343 @@
+//! Benchmarks for the event, mixing and serialisation hot paths, run with `cargo bench`. The projects are generated -
+//! set RIFF_DAW_BENCH_PROJECT_SIZE to tracks x riffs per track x notes per riff x riff refs per track (e.g. 64x8x512x64)
+//! to add a size of your own to the built in ones.
+
+use std::io::Cursor;
+use std::sync::{Arc, Mutex, mpsc::channel};
+
+use criterion::{BenchmarkId, black_box, Criterion, criterion_group, criterion_main, Throughput};
+use rb::{RB, RbProducer, SpscRb};
+use uuid::Uuid;
+use vst::api::{SmpteFrameRate, TimeInfo};
+
+use riff_daw::audio::Audio;
+use riff_daw::constants::{BUILT_IN, BUILT_IN_TEST_EFFECT, BUILT_IN_TEST_INSTRUMENT};
+use riff_daw::domain::{AudioConsumerDetails, AudioPlugin, EventBlocks, InstrumentTrack, Note, Project, Riff, RiffReference, TrackBackgroundProcessorHelper, TrackBackgroundProcessorMode, Track, TrackEvent, TrackType};
+use riff_daw::event::GeneralTrackType;
+use riff_daw::headless::{HeadlessRenderer, HeadlessRenderJob};
+use riff_daw::project_file::ProjectFile;
+use riff_daw::render::WaveFileWriter;
+use riff_daw::sample_stream::SampleStreamer;
+use riff_daw::state::DAWState;
+use riff_daw::utils::DAWUtils;
+
+const TEMPO: f64 = 140.0;
+const SAMPLE_RATE: f64 = 44100.0;
+const BLOCK_SIZE: f64 = 1024.0;
+const RIFF_LENGTH_IN_BEATS: f64 = 16.0;
+
+#[derive(Clone, Copy)]
+struct ProjectSize {
+    tracks: usize,
+    riffs_per_track: usize,
+    notes_per_riff: usize,
+    riff_refs_per_track: usize,
+}
+
+impl ProjectSize {
+    fn name(&self) -> String {
+        format!("{}x{}x{}x{}", self.tracks, self.riffs_per_track, self.notes_per_riff, self.riff_refs_per_track)
+    }
+
+    fn song_length_in_beats(&self) -> f64 {
+        self.riff_refs_per_track.max(1) as f64 * RIFF_LENGTH_IN_BEATS
+    }
+
+    fn from_environment() -> Option<Self> {
+        let size = std::env::var("RIFF_DAW_BENCH_PROJECT_SIZE").ok()?;
+        let dimensions: Vec<usize> = size.split('x').filter_map(|dimension| dimension.trim().parse().ok()).collect();
+        match dimensions.as_slice() {
+            [tracks, riffs_per_track, notes_per_riff, riff_refs_per_track] => Some(Self {
+                tracks: *tracks,
+                riffs_per_track: (*riffs_per_track).max(1),
+                notes_per_riff: *notes_per_riff,
+                riff_refs_per_track: *riff_refs_per_track,
+            }),
+            _ => None,
+        }
+    }
+}
+
+fn project_sizes() -> Vec<ProjectSize> {
+    let mut project_sizes = vec![
+        ProjectSize { tracks: 4, riffs_per_track: 4, notes_per_riff: 64, riff_refs_per_track: 16 },
+        ProjectSize { tracks: 16, riffs_per_track: 8, notes_per_riff: 256, riff_refs_per_track: 32 },
+    ];
+    if let Some(project_size) = ProjectSize::from_environment() {
+        project_sizes.push(project_size);
+    }
+    project_sizes
+}
+
+/// Instrument tracks of riffs filled with evenly spaced notes, played one after another along the song. Each track plays
+/// the built in test instrument through the built in test effect.
+fn generate_project(project_size: &ProjectSize) -> Project {
+    let mut project = Project::new();
+    let song = project.song_mut();
+    song.set_tempo(TEMPO);
+    song.set_length_in_beats(project_size.song_length_in_beats() as u64);
+
+    for track_index in 0..project_size.tracks {
+        let mut track = InstrumentTrack::new();
+        track.set_name(format!("Track {}", track_index + 1));
+        track.set_instrument(AudioPlugin::new_with_uuid(Uuid::new_v4(), BUILT_IN_TEST_INSTRUMENT.to_string(), BUILT_IN_TEST_INSTRUMENT.to_string(), None, BUILT_IN.to_string()));
+        track.effects_mut().push(AudioPlugin::new_with_uuid(Uuid::new_v4(), BUILT_IN_TEST_EFFECT.to_string(), BUILT_IN_TEST_EFFECT.to_string(), None, BUILT_IN.to_string()));
+
+        for riff_index in 0..project_size.riffs_per_track {
+            let mut riff = Riff::new_with_name_and_length(Uuid::new_v4(), format!("Riff {}", riff_index + 1), RIFF_LENGTH_IN_BEATS);
+            for note_index in 0..project_size.notes_per_riff {
+                let position = note_index as f64 * RIFF_LENGTH_IN_BEATS / project_size.notes_per_riff as f64;
+                let note = 36 + ((track_index * 7 + riff_index * 3 + note_index * 5) % 48) as i32;
+                riff.events_mut().push(TrackEvent::Note(Note::new_with_params(position, note, 100, 0.25)));
+            }
+            track.riffs_mut().push(riff);
+        }
+
+        // skip the empty riff every track starts with
+        let riff_uuids: Vec<String> = track.riffs().iter().skip(1).map(|riff| riff.uuid().to_string()).collect();
+        for riff_ref_index in 0..project_size.riff_refs_per_track {
+            let riff_uuid = riff_uuids[riff_ref_index % riff_uuids.len()].clone();
+            track.riff_refs_mut().push(RiffReference::new(riff_uuid, riff_ref_index as f64 * RIFF_LENGTH_IN_BEATS));
+        }
+
+        song.add_track(TrackType::InstrumentTrack(track));
+    }
+
+    project
+}
+
+fn track_event_blocks(project: &Project, project_size: &ProjectSize) -> Vec<EventBlocks<TrackEvent>> {
+    project.song().tracks().iter().map(|track| {
+        DAWUtils::convert_to_event_blocks(&vec![], track.riffs(), track.riff_refs(), TEMPO, BLOCK_SIZE, SAMPLE_RATE, project_size.song_length_in_beats(), 0).0
+    }).collect()
+}
+
+/// The busiest block of the first track.
+fn busiest_block(event_blocks: &EventBlocks<TrackEvent>) -> Vec<TrackEvent> {
+    event_blocks.iter().max_by_key(|block| block.len()).map(|block| block.to_vec()).unwrap_or_default()
+}
+
+fn event_conversion(criterion: &mut Criterion) {
+    let mut group = criterion.benchmark_group("event conversion");
+    for project_size in project_sizes() {
+        let project = generate_project(&project_size);
+        let events = (project_size.tracks * project_size.notes_per_riff * project_size.riff_refs_per_track) as u64;
+        group.throughput(Throughput::Elements(events));
+
+        group.bench_with_input(BenchmarkId::new("convert_to_event_blocks", project_size.name()), &project, |bencher, project| {
+            bencher.iter(|| track_event_blocks(black_box(project), &project_size));
+        });
+        group.bench_with_input(BenchmarkId::new("extract_riff_ref_events", project_size.name()), &project, |bencher, project| {
+            bencher.iter(|| {
+                for track in project.song().tracks().iter() {
+                    black_box(DAWUtils::extract_riff_ref_events(track.riffs(), track.riff_refs(), TEMPO, SAMPLE_RATE, 0));
+                }
+            });
+        });
+    }
+    group.finish();
+
+    let mut group = criterion.benchmark_group("plugin event conversion");
+    for project_size in project_sizes() {
+        let project = generate_project(&project_size);
+        let event_blocks = track_event_blocks(&project, &project_size);
+        let block = busiest_block(&event_blocks[0]);
+        group.throughput(Throughput::Elements(block.len() as u64));
+
+        group.bench_with_input(BenchmarkId::new("to_vst", project_size.name()), &block, |bencher, block| {
+            bencher.iter(|| DAWUtils::convert_events_with_timing_in_frames_to_vst(black_box(block), 0));
+        });
+        group.bench_with_input(BenchmarkId::new("to_clap", project_size.name()), &block, |bencher, block| {
+            bencher.iter(|| DAWUtils::convert_events_with_timing_in_frames_to_clap(black_box(block), 0));
+        });
+    }
+    group.finish();
+}
+
+fn time_info() -> TimeInfo {
+    TimeInfo {
+        sample_pos: 0.0,
+        sample_rate: SAMPLE_RATE,
+        nanoseconds: 0.0,
+        ppq_pos: 0.0,
+        tempo: TEMPO,
+        bar_start_pos: 0.0,
+        cycle_start_pos: 0.0,
+        cycle_end_pos: 0.0,
+        time_sig_numerator: 4,
+        time_sig_denominator: 4,
+        smpte_offset: 0,
+        smpte_frame_rate: SmpteFrameRate::Smpte24fps,
+        samples_to_next_clock: 0,
+        flags: 3,
+    }
+}
+
+fn track_processor_events(criterion: &mut Criterion) {
+    let mut group = criterion.benchmark_group("track processor events");
+    for project_size in project_sizes() {
+        let project = generate_project(&project_size);
+        let event_blocks = track_event_blocks(&project, &project_size).remove(0);
+        let number_of_blocks = event_blocks.len();
+        group.throughput(Throughput::Elements(number_of_blocks as u64));
+
+        // the channels are kept alive for as long as the helper is used
+        let (tx_audio, _rx_audio) = crossbeam_channel::unbounded();
+        let (_tx_vst_thread, rx_vst_thread) = channel();
+        let (tx_from_vst_thread, _rx_from_vst_thread) = crossbeam_channel::unbounded();
+        let mut track_background_processor_helper = TrackBackgroundProcessorHelper::new(
+            Uuid::new_v4().to_string(),
+            tx_audio,
+            rx_vst_thread,
+            tx_from_vst_thread,
+            Arc::new(Mutex::new(TrackBackgroundProcessorMode::AudioOut)),
+            1.0,
+            0.0,
+            GeneralTrackType::InstrumentTrack,
+            Arc::new(parking_lot::RwLock::new(time_info())),
+        );
+        track_background_processor_helper.block_size = BLOCK_SIZE as usize;
+        track_background_processor_helper.track_event_blocks = Some(event_blocks);
+        track_background_processor_helper.play = true;
+
+        group.bench_function(BenchmarkId::new("process_events for the song", project_size.name()), |bencher| {
+            bencher.iter(|| {
+                track_background_processor_helper.block_index = 0;
+                track_background_processor_helper.playing_notes.clear();
+                for _ in 0..number_of_blocks {
+                    black_box(track_background_processor_helper.process_events());
+                }
+            });
+        });
+    }
+    group.finish();
+}
+
+fn audio_mix(criterion: &mut Criterion) {
+    let mut group = criterion.benchmark_group("audio layer mix");
+    let frames = BLOCK_SIZE as usize;
+    for tracks in [4_usize, 32, 128] {
+        group.throughput(Throughput::Elements((tracks * frames) as u64));
+
+        let ring_buffers: Vec<(SpscRb<f32>, SpscRb<f32>)> = (0..tracks).map(|_| (SpscRb::new(frames * 2), SpscRb::new(frames * 2))).collect();
+        let mut audio_consumers: Vec<Option<AudioConsumerDetails<f32>>> = ring_buffers.iter()
+            .map(|(left, right)| Some(AudioConsumerDetails::new(Uuid::new_v4().to_string(), left.consumer(), right.consumer())))
+            .collect();
+        let producers: Vec<_> = ring_buffers.iter().map(|(left, right)| (left.producer(), right.producer())).collect();
+        let track_audio: Vec<f32> = (0..frames).map(|frame| (frame as f32 / frames as f32) - 0.5).collect();
+        let mut out_left = vec![0.0_f32; frames];
+        let mut out_right = vec![0.0_f32; frames];
+        let mut audio_buffer_left = vec![0.0_f32; frames];
+        let mut audio_buffer_right = vec![0.0_f32; frames];
+
+        group.bench_function(BenchmarkId::new("mix_audio_consumers", tracks), |bencher| {
+            bencher.iter(|| {
+                // what the track processing tasks would have written for the period
+                for (producer_left, producer_right) in producers.iter() {
+                    let _ = producer_left.write(&track_audio);
+                    let _ = producer_right.write(&track_audio);
+                }
+                out_left.fill(0.0);
+                out_right.fill(0.0);
+                Audio::mix_audio_consumers(&mut audio_consumers, frames, &mut out_left, &mut out_right, &mut audio_buffer_left, &mut audio_buffer_right, 0.5, 0.5);
+                black_box((out_left[frames - 1], out_right[frames - 1]))
+            });
+        });
+    }
+    group.finish();
+}
+
+fn project_serialisation(criterion: &mut Criterion) {
+    let mut group = criterion.benchmark_group("project save and load");
+    group.sample_size(20);
+    for project_size in project_sizes() {
+        let project = generate_project(&project_size);
+        let json = serde_json::to_string_pretty(&project).unwrap();
+        let mut binary = Cursor::new(vec![]);
+        ProjectFile::write_sections(&mut binary, &ProjectFile::sections(&project).unwrap()).unwrap();
+        let binary = binary.into_inner();
+
+        group.bench_with_input(BenchmarkId::new("save json", project_size.name()), &project, |bencher, project| {
+            bencher.iter(|| serde_json::to_string_pretty(black_box(project)).unwrap());
+        });
+        group.bench_with_input(BenchmarkId::new("load json", project_size.name()), &json, |bencher, json| {
+            bencher.iter(|| serde_json::from_str::<Project>(black_box(json)).unwrap());
+        });
+        group.bench_with_input(BenchmarkId::new("save project file", project_size.name()), &project, |bencher, project| {
+            bencher.iter(|| {
+                let mut writer = Cursor::new(Vec::with_capacity(binary.len()));
+                ProjectFile::write_sections(&mut writer, &ProjectFile::sections(black_box(project)).unwrap()).unwrap();
+                writer
+            });
+        });
+        group.bench_with_input(BenchmarkId::new("load project file", project_size.name()), &binary, |bencher, binary| {
+            bencher.iter(|| ProjectFile::from_reader(Cursor::new(black_box(binary.as_slice()))).unwrap().read_project().unwrap());
+        });
+    }
+    group.finish();
+}
+
+fn sample_resampling(criterion: &mut Criterion) {
+    let mut group = criterion.benchmark_group("sample resampling");
+    group.sample_size(10);
+    let bench_directory = std::env::temp_dir().join(format!("riff-daw-bench-{}", std::process::id()));
+    let _ = std::fs::create_dir_all(&bench_directory);
+
+    let seconds = 10;
+    let source_path = bench_directory.join("source.wav");
+    {
+        let frames = seconds * SAMPLE_RATE as usize;
+        let left: Vec<f32> = (0..frames).map(|frame| (frame as f32 * 440.0 * std::f32::consts::TAU / SAMPLE_RATE as f32).sin() * 0.5).collect();
+        let mut wave_file_writer = WaveFileWriter::create(source_path.clone(), SAMPLE_RATE as u32).unwrap();
+        wave_file_writer.write_block(&left, &left).unwrap();
+        wave_file_writer.finish().unwrap();
+    }
+    group.throughput(Throughput::Elements((seconds * SAMPLE_RATE as usize) as u64));
+
+    for to_sample_rate in [48000_u32, 96000] {
+        let resampled_path = bench_directory.join(format!("resampled_{}.wav", to_sample_rate));
+        group.bench_function(BenchmarkId::new("resample 10s stereo from 44100", to_sample_rate), |bencher| {
+            bencher.iter(|| {
+                let source_file = sndfile::OpenOptions::ReadOnly(sndfile::ReadOptions::Auto).from_path(&source_path).unwrap();
+                SampleStreamer::resample(source_file, to_sample_rate, resampled_path.clone()).unwrap();
+            });
+        });
+    }
+    group.finish();
+    let _ = std::fs::remove_dir_all(&bench_directory);
+}
+
+/// The headless renderer from loading the project file to the finished wave file - the tracks are started, sent the
+/// song and processed block by block by the track processing scheduler in offline cycles, mixed and written out. The
+/// generated tracks play the built in test instrument and effect so this measures the engine with instrument and effect
+/// processing but without the cost of any third party plugin.
+fn headless_render(criterion: &mut Criterion) {
+    let mut group = criterion.benchmark_group("headless render");
+    group.sample_size(10);
+    let bench_directory = std::env::temp_dir().join(format!("riff-daw-bench-render-{}", std::process::id()));
+    let _ = std::fs::create_dir_all(&bench_directory);
+    let track_processing_workers = std::thread::available_parallelism().map(|cores| cores.get()).unwrap_or(1);
+
+    for project_size in project_sizes() {
+        let project_path = bench_directory.join(format!("{}.fdaw", project_size.name()));
+        DAWState::write_project_to_file(project_path.to_str().unwrap(), &generate_project(&project_size)).unwrap();
+        let job = HeadlessRenderJob {
+            project_path,
+            output_path: bench_directory.join(format!("{}.wav", project_size.name())),
+            stems_directory: None,
+        };
+        let song_length_in_frames = project_size.song_length_in_beats() / TEMPO * 60.0 * SAMPLE_RATE;
+        group.throughput(Throughput::Elements((song_length_in_frames as u64) * project_size.tracks as u64));
+
+        // one renderer per size as each has its own scheduler and track threads
+        let mut headless_renderer = HeadlessRenderer::new(BLOCK_SIZE as usize, SAMPLE_RATE, track_processing_workers);
+        group.bench_with_input(BenchmarkId::new("render song", project_size.name()), &job, |bencher, job| {
+            bencher.iter(|| headless_renderer.render(black_box(job), None).unwrap());
+        });
+    }
+    group.finish();
+    let _ = std::fs::remove_dir_all(&bench_directory);
+}
+
+criterion_group!(benches, event_conversion, track_processor_events, audio_mix, project_serialisation, sample_resampling, headless_render);
+criterion_main!(benches);
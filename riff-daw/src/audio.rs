@@ -1,15 +1,29 @@
+use std::collections::VecDeque;
 use std::convert::From;
 use std::sync::{Arc, Mutex};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::time::{Duration, Instant};
 
-use jack::{AudioOut, Client, ClientStatus, Control, Frames, MidiIn, MidiOut, NotificationHandler, Port, PortId, ProcessHandler, ProcessScope, RawMidi};
-use rb::RbConsumer;
+use jack::{AudioOut, Client, ClientStatus, Control, Frames, LatencyType, MidiIn, MidiOut, NotificationHandler, Port, PortId, ProcessHandler, ProcessScope, RawMidi};
+use rb::{RbConsumer, RbProducer};
 use vst::api::{TimeInfo, TimeInfoFlags};
 use vst::event::MidiEvent;
 
-use crate::{AudioConsumerDetails, AudioLayerInwardEvent, AudioLayerOutwardEvent, DAWUtils, MidiConsumerDetails, SampleData, TrackBackgroundProcessorMode};
+use crate::{AudioConsumerDetails, AudioLayerInwardEvent, AudioLayerOutwardEvent, DAWUtils, LiveMidiProducerDetails, MidiConsumerDetails, SampleData, TrackBackgroundProcessorMode};
+use crate::constants::{AUDIO_LAYER_COMMANDS_PER_CYCLE, AUDIO_LAYER_RETIRED_ITEM_DROP_THREAD_NAME, AUDIO_LAYER_RETIRED_ITEM_QUEUE_CAPACITY, MAX_BLOCK_SIZE};
+use crate::dsp;
+use crate::event::{AudioLayerProblem, AudioLayerRetiredItem};
+use crate::rt_alloc_check;
+use crate::scheduler::TrackProcessingScheduler;
+use crate::telemetry::telemetry;
 
 const MAX_MIDI: usize = 3;
 
+// consumer slots are allocated up front so adding a track never grows a vector on the jack thread
+const MAX_AUDIO_CONSUMERS: usize = 256;
+const MAX_MIDI_CONSUMERS: usize = 256;
+const MAX_LIVE_MIDI_PRODUCERS: usize = 256;
+
 
 const CHANNELS: usize = 2;
 const FRAMES: u32 = 64;
@@ -49,12 +63,14 @@ impl std::fmt::Debug for MidiCopy {
 
 pub struct JackNotificationHandler {
     jack_midi_sender: crossbeam_channel::Sender<AudioLayerOutwardEvent>,
+    delay_compensation_latency: Arc<AtomicUsize>, // the latency the tracks' delay compensation adds to the master outputs
 }
 
 impl JackNotificationHandler {
-    pub fn new(jack_midi_sender: crossbeam_channel::Sender<AudioLayerOutwardEvent>) -> Self {
+    pub fn new(jack_midi_sender: crossbeam_channel::Sender<AudioLayerOutwardEvent>, delay_compensation_latency: Arc<AtomicUsize>) -> Self {
         JackNotificationHandler {
             jack_midi_sender,
+            delay_compensation_latency,
         }
     }
 
@@ -88,6 +104,18 @@ impl NotificationHandler for JackNotificationHandler {
         }
     }
 
+    /// Jack only lets port latencies be set from here - the state asks jack to call this when the latency changes.
+    fn latency(&mut self, client: &Client, mode: LatencyType) {
+        if let LatencyType::Capture = mode {
+            let latency = self.delay_compensation_latency.load(Ordering::Relaxed) as u32;
+            for port_name in ["DAW:out_l", "DAW:out_r"].iter() {
+                if let Some(port) = client.port_by_name(port_name) {
+                    port.set_latency_range(LatencyType::Capture, (latency, latency));
+                }
+            }
+        }
+    }
+
     fn freewheel(&mut self, _: &Client, is_enabled: bool) {
         println!(
             "JACK: freewheel mode is {}",
@@ -191,21 +219,79 @@ impl NotificationHandler for JackNotificationHandler {
 
     fn xrun(&mut self, _: &Client) -> Control {
         println!("JACK: under run occurred");
+        telemetry().xruns.record();
         Control::Continue
     }
 }
 
+/// Ships what the jack process callback has finished with to the drop thread. While the queue is full items wait in a
+/// preallocated backlog, in order, and only when that is full too is an item leaked - it is never freed on the jack thread.
+struct RetiredItems {
+    tx_retired: crossbeam_channel::Sender<AudioLayerRetiredItem>,
+    backlog: VecDeque<AudioLayerRetiredItem>,
+    leaked: bool,
+}
+
+impl RetiredItems {
+    fn new(tx_retired: crossbeam_channel::Sender<AudioLayerRetiredItem>) -> Self {
+        Self {
+            tx_retired,
+            backlog: VecDeque::with_capacity(AUDIO_LAYER_RETIRED_ITEM_QUEUE_CAPACITY),
+            leaked: false,
+        }
+    }
+
+    fn retire(&mut self, retired_item: AudioLayerRetiredItem) {
+        self.flush();
+        let retired_item = if self.backlog.is_empty() {
+            match self.tx_retired.try_send(retired_item) {
+                Ok(_) => return,
+                Err(error) => error.into_inner(),
+            }
+        }
+        else {
+            retired_item
+        };
+
+        if self.backlog.len() < self.backlog.capacity() {
+            self.backlog.push_back(retired_item);
+        }
+        else {
+            std::mem::forget(retired_item);
+            self.leaked = true;
+        }
+    }
+
+    fn flush(&mut self) {
+        while let Some(retired_item) = self.backlog.pop_front() {
+            if let Err(error) = self.tx_retired.try_send(retired_item) {
+                self.backlog.push_front(error.into_inner());
+                break;
+            }
+        }
+    }
+
+    /// Whether an item has been leaked since this was last asked.
+    fn take_leaked(&mut self) -> bool {
+        std::mem::take(&mut self.leaked)
+    }
+}
+
 pub struct Audio {
-    audio_buffer_right: [f32; 1024],
-    audio_buffer_left: [f32; 1024],
+    audio_buffer_right: Vec<f32>,
+    audio_buffer_left: Vec<f32>,
     jack_midi_buffer: [(u32, u8, u8, u8, bool); 1024],
     out_l: Port<AudioOut>,
     out_r: Port<AudioOut>,
     midi_out: Port<MidiOut>,
     midi_in: Port<MidiIn>,
     midi_control_in: Port<MidiIn>,
-    audio_consumers: Vec<AudioConsumerDetails<f32>>,
-    midi_consumers: Vec<MidiConsumerDetails<(u32, u8, u8, u8, bool)>>,
+    audio_consumers: Vec<Option<AudioConsumerDetails<f32>>>,
+    midi_consumers: Vec<Option<MidiConsumerDetails<(u32, u8, u8, u8, bool)>>>,
+    live_midi_producers: Vec<Option<LiveMidiProducerDetails>>,
+    live_midi_input_track_uuid: Option<String>,
+    live_midi_input_channel: u8,
+    live_midi_input_slot: Option<usize>, // index into live_midi_producers for the selected track
     play: bool,
     block: i32,
     blocks_total: i32,
@@ -214,11 +300,9 @@ pub struct Audio {
     tempo: f64,
     block_size: f64,
     frames_per_beat: u32,
-    low_priority_processing_delay_counter: i32,
     process_producers: bool,
     master_volume: f32,
     master_pan: f32,
-    low_priority_processing_delay_count: i32,
     rx_to_audio: crossbeam_channel::Receiver<AudioLayerInwardEvent>,
     jack_midi_sender: crossbeam_channel::Sender<AudioLayerOutwardEvent>,
     coast: Arc<Mutex<TrackBackgroundProcessorMode>>,
@@ -227,6 +311,8 @@ pub struct Audio {
     preview_sample: Option<SampleData>,
     preview_sample_current_frame: i32,
     vst_host_time_info: Arc<parking_lot::RwLock<TimeInfo>>,
+    retired_items: RetiredItems,
+    track_processing_scheduler: Arc<TrackProcessingScheduler>,
 }
 
 impl Audio {
@@ -235,31 +321,34 @@ impl Audio {
                jack_midi_sender: crossbeam_channel::Sender<AudioLayerOutwardEvent>,
                coast: Arc<Mutex<TrackBackgroundProcessorMode>>,
                vst_host_time_info: Arc<parking_lot::RwLock<TimeInfo>>,
+               track_processing_scheduler: Arc<TrackProcessingScheduler>,
     ) -> Self {
         Audio {
-            audio_buffer_right: [0.0f32; 1024],
-            audio_buffer_left: [0.0f32; 1024],
+            audio_buffer_right: vec![0.0f32; MAX_BLOCK_SIZE],
+            audio_buffer_left: vec![0.0f32; MAX_BLOCK_SIZE],
             jack_midi_buffer: [(0, 0, 0, 0, false); 1024],
             out_l: client.register_port("out_l", AudioOut::default()).unwrap(),
             out_r: client.register_port("out_r", AudioOut::default()).unwrap(),
             midi_out: client.register_port("midi_out", MidiOut::default()).unwrap(),
             midi_in: client.register_port("midi_in", MidiIn::default()).unwrap(),
             midi_control_in: client.register_port("midi_control_in", MidiIn::default()).unwrap(),
-            audio_consumers: vec![],
-            midi_consumers: vec![],
+            audio_consumers: Audio::consumer_slots(MAX_AUDIO_CONSUMERS, vec![]),
+            midi_consumers: Audio::consumer_slots(MAX_MIDI_CONSUMERS, vec![]),
+            live_midi_producers: Audio::consumer_slots(MAX_LIVE_MIDI_PRODUCERS, vec![]),
+            live_midi_input_track_uuid: None,
+            live_midi_input_channel: 0,
+            live_midi_input_slot: None,
             play: false,
             block: -1,
             blocks_total: 0,
             play_position_in_frames: 0,
-            sample_rate_in_frames: 44100.0,
+            sample_rate_in_frames: client.sample_rate() as f64,
             tempo: 140.0,
-            block_size: 1024.0,
-            frames_per_beat: Audio::frames_per_beat_calc(44100.0, 140.0),
-            low_priority_processing_delay_counter: 0,
+            block_size: client.buffer_size() as f64,
+            frames_per_beat: Audio::frames_per_beat_calc(client.sample_rate() as f64, 140.0),
             process_producers: true,
             master_volume: 1.0,
             master_pan: 0.0,
-            low_priority_processing_delay_count: 5,
             rx_to_audio,
             jack_midi_sender,
             coast,
@@ -268,6 +357,8 @@ impl Audio {
             preview_sample: None,
             preview_sample_current_frame: 0,
             vst_host_time_info,
+            retired_items: RetiredItems::new(Audio::start_retired_item_drop_thread()),
+            track_processing_scheduler,
         }
     }
 
@@ -277,32 +368,38 @@ impl Audio {
                               coast: Arc<Mutex<TrackBackgroundProcessorMode>>,
                               audio_consumers: Vec<AudioConsumerDetails<f32>>,
                               midi_consumers: Vec<MidiConsumerDetails<(u32, u8, u8, u8, bool)>>,
+                              live_midi_producers: Vec<LiveMidiProducerDetails>,
+                              live_midi_input_track: (Option<String>, u8), // track uuid, midi channel
                               vst_host_time_info: Arc<parking_lot::RwLock<TimeInfo>>,
+                              track_processing_scheduler: Arc<TrackProcessingScheduler>,
     ) -> Self {
-        Audio {
-            audio_buffer_right: [0.0f32; 1024],
-            audio_buffer_left: [0.0f32; 1024],
+        let (live_midi_input_track_uuid, live_midi_input_channel) = live_midi_input_track;
+        let mut audio = Audio {
+            audio_buffer_right: vec![0.0f32; MAX_BLOCK_SIZE],
+            audio_buffer_left: vec![0.0f32; MAX_BLOCK_SIZE],
             jack_midi_buffer: [(0, 0, 0, 0, false); 1024],
             out_l: client.register_port("out_l", AudioOut::default()).unwrap(),
             out_r: client.register_port("out_r", AudioOut::default()).unwrap(),
             midi_out: client.register_port("midi_out", MidiOut::default()).unwrap(),
             midi_in: client.register_port("midi_in", MidiIn::default()).unwrap(),
             midi_control_in: client.register_port("midi_control_in", MidiIn::default()).unwrap(),
-            audio_consumers,
-            midi_consumers,
+            audio_consumers: Audio::consumer_slots(MAX_AUDIO_CONSUMERS, audio_consumers),
+            midi_consumers: Audio::consumer_slots(MAX_MIDI_CONSUMERS, midi_consumers),
+            live_midi_producers: Audio::consumer_slots(MAX_LIVE_MIDI_PRODUCERS, live_midi_producers),
+            live_midi_input_track_uuid,
+            live_midi_input_channel,
+            live_midi_input_slot: None,
             play: false,
             block: -1,
             blocks_total: 0,
             play_position_in_frames: 0,
-            sample_rate_in_frames: 44100.0,
+            sample_rate_in_frames: client.sample_rate() as f64,
             tempo: 140.0,
-            block_size: 1024.0,
-            frames_per_beat: Audio::frames_per_beat_calc(44100.0, 140.0),
-            low_priority_processing_delay_counter: 0,
+            block_size: client.buffer_size() as f64,
+            frames_per_beat: Audio::frames_per_beat_calc(client.sample_rate() as f64, 140.0),
             process_producers: true,
             master_volume: 1.0,
             master_pan: 0.5,
-            low_priority_processing_delay_count: 5,
             rx_to_audio,
             jack_midi_sender,
             coast,
@@ -311,23 +408,117 @@ impl Audio {
             preview_sample: None,
             preview_sample_current_frame: 0,
             vst_host_time_info,
-        }
+            retired_items: RetiredItems::new(Audio::start_retired_item_drop_thread()),
+            track_processing_scheduler,
+        };
+        audio.find_live_midi_input_slot();
+        audio
     }
 
     pub fn frames_per_beat_calc(sample_rate_in_frames: f64, tempo: f64) -> u32 {
         (sample_rate_in_frames / tempo * 60.0) as u32
     }
 
+    fn consumer_slots<T>(capacity: usize, consumers: Vec<T>) -> Vec<Option<T>> {
+        let mut slots: Vec<Option<T>> = Vec::with_capacity(capacity.max(consumers.len()));
+        for consumer in consumers {
+            slots.push(Some(consumer));
+        }
+        while slots.len() < slots.capacity() {
+            slots.push(None);
+        }
+        slots
+    }
+
+    /// Starts the thread that drops whatever the jack process callback has finished with. It also reports any heap activity
+    /// seen on the jack thread when built with the rt_alloc_check feature. The thread exits when the Audio instance is dropped.
+    fn start_retired_item_drop_thread() -> crossbeam_channel::Sender<AudioLayerRetiredItem> {
+        let (tx_retired, rx_retired) = crossbeam_channel::bounded::<AudioLayerRetiredItem>(AUDIO_LAYER_RETIRED_ITEM_QUEUE_CAPACITY);
+        let _ = std::thread::Builder::new().name(AUDIO_LAYER_RETIRED_ITEM_DROP_THREAD_NAME.to_string()).spawn(move || {
+            loop {
+                match rx_retired.recv_timeout(Duration::from_secs(1)) {
+                    Ok(retired_item) => drop(retired_item),
+                    Err(crossbeam_channel::RecvTimeoutError::Timeout) => (),
+                    Err(crossbeam_channel::RecvTimeoutError::Disconnected) => break,
+                }
+
+                let real_time_allocations = rt_alloc_check::take_real_time_allocation_count();
+                if real_time_allocations > 0 {
+                    println!("Audio: {} heap allocations/frees detected on the jack thread", real_time_allocations);
+                }
+            }
+        });
+        tx_retired
+    }
+
+    fn retire(&mut self, retired_item: AudioLayerRetiredItem) {
+        self.retired_items.retire(retired_item);
+    }
+
+    /// Hand a consumer or producer there is no free slot for back to the gui to report and drop.
+    fn reject(&mut self, rejected_item: AudioLayerRetiredItem) {
+        if let Err(error) = self.jack_midi_sender.try_send(AudioLayerOutwardEvent::Problem(AudioLayerProblem::NoFreeSlot(rejected_item))) {
+            if let AudioLayerOutwardEvent::Problem(AudioLayerProblem::NoFreeSlot(rejected_item)) = error.into_inner() {
+                self.retire(rejected_item);
+            }
+        }
+    }
+
+    fn find_live_midi_input_slot(&mut self) {
+        self.live_midi_input_slot = match &self.live_midi_input_track_uuid {
+            Some(track_uuid) => self.live_midi_producers.iter().position(|slot| slot.as_ref().map_or(false, |producer_detail| producer_detail.track_uuid() == track_uuid)),
+            None => None,
+        };
+    }
+
+    /// Handle the commands that have arrived - up to a budget each cycle so that a burst of them (e.g. loading a project)
+    /// is spread over a few cycles rather than holding up this one.
     fn handle_inward_events(&mut self, _client: &Client) {
-        match self.rx_to_audio.try_recv() {
-            Ok(event) => match event {
+        for _ in 0..AUDIO_LAYER_COMMANDS_PER_CYCLE {
+            let event = match self.rx_to_audio.try_recv() {
+                Ok(event) => event,
+                Err(_) => break,
+            };
+            match event {
                 AudioLayerInwardEvent::NewAudioConsumer(audio_consumer_detail) => {
-                    self.audio_consumers.push(audio_consumer_detail);
-                    // println!("*************Added an audio consumer: {}", self.audio_consumers.len());
+                    if let Some(slot) = self.audio_consumers.iter_mut().find(|slot| slot.is_none()) {
+                        *slot = Some(audio_consumer_detail);
+                    }
+                    else {
+                        self.reject(AudioLayerRetiredItem::AudioConsumer(audio_consumer_detail));
+                    }
                 }
                 AudioLayerInwardEvent::NewMidiConsumer(midi_consumer_detail) => {
-                    self.midi_consumers.push(midi_consumer_detail);
-                    println!("*************Added a midi consumer: {}", self.midi_consumers.len());
+                    if let Some(slot) = self.midi_consumers.iter_mut().find(|slot| slot.is_none()) {
+                        *slot = Some(midi_consumer_detail);
+                    }
+                    else {
+                        self.reject(AudioLayerRetiredItem::MidiConsumer(midi_consumer_detail));
+                    }
+                }
+                AudioLayerInwardEvent::NewLiveMidiProducer(live_midi_producer_detail) => {
+                    // a restarted track processor replaces its previous producer
+                    for slot in self.live_midi_producers.iter_mut() {
+                        if slot.as_ref().map_or(false, |producer_detail| producer_detail.track_uuid() == live_midi_producer_detail.track_uuid()) {
+                            if let Some(producer_detail) = slot.take() {
+                                self.retired_items.retire(AudioLayerRetiredItem::LiveMidiProducer(producer_detail));
+                            }
+                        }
+                    }
+                    if let Some(slot) = self.live_midi_producers.iter_mut().find(|slot| slot.is_none()) {
+                        *slot = Some(live_midi_producer_detail);
+                    }
+                    else {
+                        self.reject(AudioLayerRetiredItem::LiveMidiProducer(live_midi_producer_detail));
+                    }
+                    self.find_live_midi_input_slot();
+                }
+                AudioLayerInwardEvent::LiveMidiInputTrack(track_uuid, midi_channel) => {
+                    if let Some(previous_track_uuid) = std::mem::replace(&mut self.live_midi_input_track_uuid, track_uuid) {
+                        self.retire(AudioLayerRetiredItem::TrackUuid(previous_track_uuid));
+                    }
+                    self.live_midi_input_channel = midi_channel;
+                    self.find_live_midi_input_slot();
                 }
                 AudioLayerInwardEvent::Play(start_play, number_of_blocks, start_block) => {
                     // info!(root_logger, "*************Jack start play received: number_of_blocks={}", number_of_blocks);
@@ -353,14 +544,6 @@ impl Audio {
                     self.tempo = new_tempo;
                     self.frames_per_beat = Audio::frames_per_beat_calc(self.sample_rate_in_frames, self.tempo);
                 }
-                AudioLayerInwardEvent::SampleRate(new_sample_rate) => {
-                    self.sample_rate_in_frames = new_sample_rate;
-                    self.frames_per_beat = Audio::frames_per_beat_calc(self.sample_rate_in_frames, self.tempo);
-                }
-                AudioLayerInwardEvent::BlockSize(new_block_size) => {
-                    self.block_size = new_block_size;
-                    self.frames_per_beat = Audio::frames_per_beat_calc(self.sample_rate_in_frames, self.tempo);
-                }
                 AudioLayerInwardEvent::Volume(volume) => {
                     self.master_volume = volume;
                 }
@@ -371,26 +554,55 @@ impl Audio {
                     self.keep_alive = false;
                 }
                 AudioLayerInwardEvent::RemoveTrack(track_uuid) => {
-                    self.audio_consumers.retain(|consumer_detail| *consumer_detail.track_id() != track_uuid);
-                    self.midi_consumers.retain(|consumer_detail| *consumer_detail.track_uuid() != track_uuid);
+                    for slot in self.audio_consumers.iter_mut() {
+                        if slot.as_ref().map_or(false, |consumer_detail| *consumer_detail.track_id() == track_uuid) {
+                            if let Some(consumer_detail) = slot.take() {
+                                self.retired_items.retire(AudioLayerRetiredItem::AudioConsumer(consumer_detail));
+                            }
+                        }
+                    }
+                    for slot in self.midi_consumers.iter_mut() {
+                        if slot.as_ref().map_or(false, |consumer_detail| *consumer_detail.track_uuid() == track_uuid) {
+                            if let Some(consumer_detail) = slot.take() {
+                                self.retired_items.retire(AudioLayerRetiredItem::MidiConsumer(consumer_detail));
+                            }
+                        }
+                    }
+                    for slot in self.live_midi_producers.iter_mut() {
+                        if slot.as_ref().map_or(false, |producer_detail| *producer_detail.track_uuid() == track_uuid) {
+                            if let Some(producer_detail) = slot.take() {
+                                self.retired_items.retire(AudioLayerRetiredItem::LiveMidiProducer(producer_detail));
+                            }
+                        }
+                    }
+                    self.find_live_midi_input_slot();
+                    self.retire(AudioLayerRetiredItem::TrackUuid(track_uuid));
                 }
                 AudioLayerInwardEvent::NewMidiOutPortForTrack(track_uuid, midi_out_port) => {
-                    println!("Jack layer received: AudioLayerInwardEvent::NewMidiOutPortForTrack");
-                    if let Some(midi_consumer_details) = self.midi_consumers.iter_mut().find(|midi_consumer_details| midi_consumer_details.track_uuid().clone() == track_uuid.clone()) {
-                        midi_consumer_details.set_midi_out_port(Some(midi_out_port));
+                    if let Some(midi_consumer_details) = self.midi_consumers.iter_mut().flatten().find(|midi_consumer_details| *midi_consumer_details.track_uuid() == track_uuid) {
+                        if let Some(previous_midi_out_port) = midi_consumer_details.replace_midi_out_port(Some(midi_out_port)) {
+                            self.retired_items.retire(AudioLayerRetiredItem::MidiOutPort(previous_midi_out_port));
+                        }
                     }
                     else {
                         // show an error message dialogue??
-                        println!("Failed to add a midi out port for track={}", track_uuid.as_str());
+                        self.retire(AudioLayerRetiredItem::MidiOutPort(midi_out_port));
                     }
+                    self.retire(AudioLayerRetiredItem::TrackUuid(track_uuid));
                 }
-                AudioLayerInwardEvent::PreviewSample(file_name) => {
-                    println!("Audio layer received preview sample: file name = {}", file_name);
-                    self.preview_sample = Some(SampleData::new(file_name, self.sample_rate_in_frames as i32));
+                AudioLayerInwardEvent::PreviewSample(sample) => {
+                    if let Some(previous_sample) = self.preview_sample.replace(sample) {
+                        self.retire(AudioLayerRetiredItem::Sample(previous_sample));
+                    }
                     self.preview_sample_current_frame = 0;
                 }
-            },
-            Err(_) => (),
+            }
+        }
+
+        // anything still waiting for room in the retired item queue
+        self.retired_items.flush();
+        if self.retired_items.take_leaked() {
+            let _ = self.jack_midi_sender.try_send(AudioLayerOutwardEvent::Problem(AudioLayerProblem::RetiredItemLeaked));
         }
     }
 
@@ -411,118 +623,81 @@ impl Audio {
     }
 
     fn process_audio(&mut self, process_scope: &ProcessScope) {
-        let frames_written = self.block_size() as usize;
-        let mut number_of_consumers = self.audio_consumers.len() as f32;
+        let frames_written = (process_scope.n_frames() as usize).min(MAX_BLOCK_SIZE);
+        let mut number_of_consumers = self.audio_consumers.iter().flatten().count() as f32;
         let (left_pan, right_pan) = DAWUtils::constant_power_stereo_pan(self.master_pan);
-        let mut master_channel_left_level: f32 = 0.0;
-        let mut master_channel_right_level: f32 = 0.0;
 
         if self.preview_sample().is_some() {
             number_of_consumers += 1.0;
         }
 
-        {
+        let (master_channel_left_level, master_channel_right_level) = {
             let out_left = self.out_l.as_mut_slice(process_scope);
             let out_right = self.out_r.as_mut_slice(process_scope);
 
-            for index in 0..self.audio_consumers.len() {
-                match self.audio_consumers.get_mut(index) {
-                    Some(consumer) => {
-                        let consumer_right = consumer.consumer_right_mut();
-                        match consumer_right.read(&mut self.audio_buffer_right) {
-                            Ok(read) => if read > 0 {
-                                let mut count = 0;
-                                for x in out_right.iter_mut() {
-                                    if count < read {
-                                        // info!(root_logger, "consumer_right index {}: {}", index, buffer_right[count]);
-                                        *x += (self.audio_buffer_right[count]) as f32 * self.master_volume * 2.0 * right_pan;
-                                        // print!("{} ", buffer_right[count]);
-                                        if *x > master_channel_right_level {
-                                            master_channel_right_level += *x;
-                                        }
-                                        count += 1;
-                                    } else {
-                                        break;
-                                    }
-                                }
-                            },
-                            Err(_) => (), //info!(root_logger, "Problem reading from consumer right channel!"),
-                        }
-                        let consumer_left = consumer.consumer_left_mut();
-                        match consumer_left.read(&mut self.audio_buffer_left) {
-                            Ok(read) => if read > 0 {
-                                let mut count = 0;
-                                for x in out_left.iter_mut() {
-                                    if count < read {
-                                        *x += (self.audio_buffer_left[count]) as f32 * self.master_volume * 2.0 * left_pan;
-                                        // print!("{} ", buffer_left[count]);
-                                        if *x > master_channel_left_level {
-                                            master_channel_left_level += *x;
-                                        }
-                                        count += 1;
-                                    } else {
-                                        break;
-                                    }
-                                }
-                            },
-                            Err(_) => (), //info!(root_logger, "Problem reading from consumer left channel!"),
-                        }
-                    }
-                    None => (), //info!(root_logger, "Problem getting consumer detail from consumers"),
-                }
-            }
-        }
+            Audio::mix_audio_consumers(&mut self.audio_consumers, frames_written, out_left, out_right, &mut self.audio_buffer_left, &mut self.audio_buffer_right, self.master_volume * 2.0 * left_pan, self.master_volume * 2.0 * right_pan);
+
+            (dsp::peak(&out_left[..frames_written.min(out_left.len())]), dsp::peak(&out_right[..frames_written.min(out_right.len())]))
+        };
 
         let _ = self.jack_midi_sender.try_send(AudioLayerOutwardEvent::MasterChannelLevels(master_channel_left_level, master_channel_right_level));
 
         self.process_preview_sample(process_scope, frames_written, &mut number_of_consumers, left_pan, right_pan)
     }
 
-    fn process_preview_sample(&mut self, process_scope: &ProcessScope, frames_written: usize, number_of_consumers: &mut f32, left_pan: f32, right_pan: f32) {
-        let preview_sample_current_frame = self.preview_sample_current_frame() as usize;
-        let sample_channels = if let Some(sample) = self.preview_sample_mut() {
-            sample.channels() as usize
-        } else {
-            0
-        };
-        let sample_length = if let Some(sample) = self.preview_sample_mut() {
-            sample.samples().len()
-        } else {
-            0
-        };
-        let mut left_samples: Vec<f32> = vec![];
-        let mut right_samples: Vec<f32> = vec![];
-        if let Some(sample) = self.preview_sample_mut() {
-            for frame in 0..frames_written {
-                let left_channel_sample_index = (frame + preview_sample_current_frame) * sample_channels;
-                let right_channel_sample_index = left_channel_sample_index + 1;
-
-                if left_channel_sample_index < sample_length {
-                    if sample.channels() == 1 {
-                        left_samples.push(*sample.samples().get(left_channel_sample_index).unwrap());
-                        right_samples.push(*sample.samples().get(left_channel_sample_index).unwrap());
-                    } else {
-                        left_samples.push(*sample.samples().get(left_channel_sample_index).unwrap());
-                        right_samples.push(*sample.samples().get(right_channel_sample_index).unwrap());
-                    }
+    /// Read a period from each track's ring buffers and mix it into the outputs. A track that doesn't have the whole
+    /// period ready has an underrun counted against it.
+    pub fn mix_audio_consumers(audio_consumers: &mut [Option<AudioConsumerDetails<f32>>],
+                               frames: usize,
+                               out_left: &mut [f32],
+                               out_right: &mut [f32],
+                               audio_buffer_left: &mut [f32],
+                               audio_buffer_right: &mut [f32],
+                               left_gain: f32,
+                               right_gain: f32,
+    ) {
+        for consumer in audio_consumers.iter_mut().flatten() {
+            let consumer_right = consumer.consumer_right_mut();
+            match consumer_right.read(&mut audio_buffer_right[..frames]) {
+                Ok(read) => dsp::mix_accumulate(out_right, &audio_buffer_right[..read], right_gain),
+                Err(_) => (), //info!(root_logger, "Problem reading from consumer right channel!"),
+            }
+            let consumer_left = consumer.consumer_left_mut();
+            let read = match consumer_left.read(&mut audio_buffer_left[..frames]) {
+                Ok(read) => {
+                    dsp::mix_accumulate(out_left, &audio_buffer_left[..read], left_gain);
+                    read
+                }
+                Err(_) => 0, //info!(root_logger, "Problem reading from consumer left channel!"),
+            };
+            // the track didn't have the whole period ready
+            if read < frames {
+                if let Some(telemetry) = consumer.telemetry() {
+                    telemetry.underruns.fetch_add(1, Ordering::Relaxed);
                 }
             }
         }
+    }
 
-        self.set_preview_sample_current_frame(self.preview_sample_current_frame() + frames_written as i32);
+    fn process_preview_sample(&mut self, process_scope: &ProcessScope, frames_written: usize, number_of_consumers: &mut f32, left_pan: f32, right_pan: f32) {
+        let preview_sample_current_frame = self.preview_sample_current_frame as usize;
+        let master_volume = self.master_volume;
 
-        let mut frame: usize = 0;
-        let out_left = self.out_l.as_mut_slice(process_scope);
-        let out_right = self.out_r.as_mut_slice(process_scope);
-        for left_sample in left_samples.iter() {
-            out_left[frame] += (*left_sample / *number_of_consumers) as f32 * self.master_volume * 2.0 * left_pan;
-            out_right[frame] += (*right_samples.get(frame).unwrap() / *number_of_consumers) as f32 * self.master_volume * 2.0 * right_pan;
-            frame += 1;
+        // mix straight into the jack buffers - no per cycle buffers
+        if let Some(sample) = &self.preview_sample {
+            let out_left = self.out_l.as_mut_slice(process_scope);
+            let out_right = self.out_r.as_mut_slice(process_scope);
+            let frames = frames_written.min(out_left.len()).min(out_right.len());
+            let number_of_consumers = *number_of_consumers;
+
+            sample.mix_into(preview_sample_current_frame, &mut out_left[..frames], &mut out_right[..frames], master_volume * 2.0 * left_pan / number_of_consumers, master_volume * 2.0 * right_pan / number_of_consumers);
         }
+
+        self.set_preview_sample_current_frame(self.preview_sample_current_frame() + frames_written as i32);
     }
 
     fn process_midi_out(&mut self, process_scope: &ProcessScope) {
-        for midi_consumer_detail in self.midi_consumers.iter_mut() {
+        for midi_consumer_detail in self.midi_consumers.iter_mut().flatten() {
             let consumer_midi = midi_consumer_detail.consumer_mut();
             match consumer_midi.read(&mut self.jack_midi_buffer) {
                 Ok(read) => if read > 0 {
@@ -548,13 +723,27 @@ impl Audio {
         }
     }
 
+    /// Write a live midi channel message straight to the selected track at its frame within the period.
+    fn write_live_midi(&mut self, time: Frames, bytes: &[u8]) {
+        if let Some(Some(producer_detail)) = self.live_midi_input_slot.and_then(|index| self.live_midi_producers.get_mut(index)) {
+            let status = (bytes[0] & 0xF0) | (self.live_midi_input_channel & 0x0F);
+            // if the track has fallen behind the event is dropped rather than blocking the jack thread
+            let _ = producer_detail.producer_mut().write(&[(time, status, bytes[1], bytes[2])]);
+        }
+    }
+
     fn process_midi_in(&mut self, process_scope: &ProcessScope) {
         let midi_in_data = self.midi_in.iter(process_scope);
         for event in midi_in_data {
             let mut delta_frames = 0;
 
+            // channel messages are played live - the gui thread only sees them to record them
+            if event.bytes.len() >= 3 && 128 <= event.bytes[0] && event.bytes[0] <= 239 {
+                self.write_live_midi(event.time, event.bytes);
+            }
+
             if self.play && self.block > -1 {
-                delta_frames = self.block * 1024 + event.time as i32;
+                delta_frames = self.block * self.block_size as i32 + event.time as i32;
             }
 
             if event.bytes.len() >= 3 && 144 <= event.bytes[0] && event.bytes[0] <= 159 { // note on
@@ -624,7 +813,7 @@ impl Audio {
             let mut delta_frames = 0;
 
             if self.play && self.block > -1 {
-                delta_frames = self.block * 1024 + event.time as i32;
+                delta_frames = self.block * self.block_size as i32 + event.time as i32;
             }
 
             if event.bytes.len() >= 3 && 144 <= event.bytes[0] && event.bytes[0] <= 159 { // note on
@@ -676,7 +865,7 @@ impl Audio {
                 self.play_position_in_frames = 0;
             } else {
                 self.block += 1;
-                self.play_position_in_frames += 1024;
+                self.play_position_in_frames += self.block_size as u32;
             }
 
             {
@@ -693,7 +882,7 @@ impl Audio {
                 time_info.ppq_pos = ppq_pos;
             }
 
-            if self.play_position_in_frames % self.frames_per_beat < 1024 {
+            if self.play_position_in_frames % self.frames_per_beat < self.block_size as u32 {
                 let _ = self.jack_midi_sender.try_send(AudioLayerOutwardEvent::PlayPositionInFrames(self.play_position_in_frames));
             }
         }
@@ -730,26 +919,33 @@ impl Audio {
         };
     }
 
-    fn update_low_priority_processing_delay_counter(&mut self) {
-        if self.low_priority_processing_delay_counter > self.low_priority_processing_delay_count {
-            self.low_priority_processing_delay_counter = 0;
-        } else {
-            self.low_priority_processing_delay_counter += 1;
-        }
-    }
-
     pub fn custom_midi_out_ports(&mut self) -> &mut Vec<Port<MidiOut>> {
         &mut self.custom_midi_out_ports
     }
 
     pub fn get_all_audio_consumers(&mut self) -> Vec<AudioConsumerDetails<f32>> {
         let mut consumers = vec![];
-        for _ in 0..self.audio_consumers.len() {
-            consumers.push(self.audio_consumers.remove(0));
+        for slot in self.audio_consumers.iter_mut() {
+            if let Some(consumer) = slot.take() {
+                consumers.push(consumer);
+            }
         }
         consumers
     }
 
+    /// The tracks only send their live midi producers once so a restarted audio layer takes them over from this one.
+    pub fn get_all_live_midi_producers(&mut self) -> Vec<LiveMidiProducerDetails> {
+        self.live_midi_input_slot = None;
+        self.live_midi_producers.iter_mut().filter_map(|slot| slot.take()).collect()
+    }
+
+    /// The track live midi in is played on and its midi channel - taken so that a restarted audio layer carries on
+    /// with them.
+    pub fn take_live_midi_input_track(&mut self) -> (Option<String>, u8) {
+        self.live_midi_input_slot = None;
+        (self.live_midi_input_track_uuid.take(), self.live_midi_input_channel)
+    }
+
     pub fn preview_sample(&self) -> &Option<SampleData> {
         &self.preview_sample
     }
@@ -777,14 +973,34 @@ impl Audio {
     pub fn block_size(&self) -> f64 {
         self.block_size
     }
+
+    /// Pick up a new jack block size and/or sample rate and let the rest of the application know about it.
+    fn set_audio_format(&mut self, block_size: f64, sample_rate: f64) {
+        self.block_size = block_size;
+        self.sample_rate_in_frames = sample_rate;
+        self.frames_per_beat = Audio::frames_per_beat_calc(self.sample_rate_in_frames, self.tempo);
+        self.vst_host_time_info.write().sample_rate = sample_rate;
+
+        match self.jack_midi_sender.try_send(AudioLayerOutwardEvent::AudioFormat(block_size as usize, sample_rate)) {
+            Ok(_) => (),
+            Err(_) => (), // called from the process callback so there is nothing to be done but wait for the next change
+        }
+    }
 }
 
 impl ProcessHandler for Audio {
     fn process(&mut self, client: &Client, process_scope: &ProcessScope) -> Control {
-        if self.low_priority_processing_delay_counter >= self.low_priority_processing_delay_count {
-            self.handle_inward_events(client.clone());
+        rt_alloc_check::enter_real_time_section();
+        let callback_start = Instant::now();
+
+        // jack only tells the notification handler about sample rate changes
+        let sample_rate = client.sample_rate() as f64;
+        if sample_rate != self.sample_rate_in_frames {
+            self.set_audio_format(self.block_size, sample_rate);
         }
 
+        self.handle_inward_events(client);
+
         self.zero_jack_buffers(process_scope);
 
         if self.process_producers {
@@ -796,7 +1012,12 @@ impl ProcessHandler for Audio {
         }
 
         self.check_for_coast();
-        self.update_low_priority_processing_delay_counter();
+
+        // the track ring buffers have just been drained so get the tracks processing the next blocks
+        self.track_processing_scheduler.wake();
+
+        telemetry().record_jack_callback(callback_start.elapsed(), process_scope.n_frames(), self.sample_rate_in_frames);
+        rt_alloc_check::exit_real_time_section();
 
         if self.keep_alive {
             Control::Continue
@@ -805,6 +1026,12 @@ impl ProcessHandler for Audio {
             Control::Quit
         }
     }
+
+    /// Jack may call this from the process thread so nothing is printed - the gui thread logs the new format.
+    fn buffer_size(&mut self, client: &Client, size: Frames) -> Control {
+        self.set_audio_format((size as usize).min(MAX_BLOCK_SIZE) as f64, client.sample_rate() as f64);
+        Control::Continue
+    }
 }
 
 #[cfg(test)]
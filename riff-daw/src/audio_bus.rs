@@ -0,0 +1,210 @@
+use std::collections::HashMap;
+use std::sync::Arc;
+use std::sync::atomic::{AtomicU32, AtomicU64, AtomicUsize, fence, Ordering};
+
+use crate::constants::{AUDIO_BUS_BLOCKS, MAX_BLOCK_SIZE};
+use crate::delay_compensation::StereoDelayLine;
+use crate::dsp;
+
+struct AudioBusSlot {
+    block: AtomicU64, // the number of the block held - 0 while empty or being written
+    frames: AtomicUsize,
+    left: Box<[AtomicU32]>,  // MAX_BLOCK_SIZE f32 bits
+    right: Box<[AtomicU32]>, // MAX_BLOCK_SIZE f32 bits
+}
+
+impl AudioBusSlot {
+    fn new() -> Self {
+        Self {
+            block: AtomicU64::new(0),
+            frames: AtomicUsize::new(0),
+            left: (0..MAX_BLOCK_SIZE).map(|_| AtomicU32::new(0)).collect(),
+            right: (0..MAX_BLOCK_SIZE).map(|_| AtomicU32::new(0)).collect(),
+        }
+    }
+}
+
+/// A track's audio for the tracks it is routed to. The track writes each block it processes once and every track its
+/// audio is routed to reads it through its own AudioBusReceiver, so a block is handed over even when the destination
+/// is processed in a later cycle than the source - coasting tracks keep their own time and a track is skipped in a cycle
+/// when its ring buffer is full. A receiver is never more than a block behind the source - older blocks are dropped -
+/// and a block is never read twice. There are no locks, a slot being overwritten while it is read is detected and
+/// reads as silence. Never allocates after it is created.
+pub struct AudioBus {
+    written: AtomicU64, // the number of the last block written - only ever stored by the source track
+    slots: Box<[AudioBusSlot]>,
+}
+
+impl AudioBus {
+    fn new() -> Self {
+        Self {
+            written: AtomicU64::new(0),
+            slots: (0..AUDIO_BUS_BLOCKS).map(|_| AudioBusSlot::new()).collect(),
+        }
+    }
+
+    /// Only ever called by the source track.
+    pub fn write(&self, left: &[f32], right: &[f32]) {
+        let block = self.written.load(Ordering::Relaxed) + 1;
+        let slot = &self.slots[block as usize % self.slots.len()];
+        let frames = left.len().min(right.len()).min(MAX_BLOCK_SIZE);
+
+        slot.block.store(0, Ordering::Relaxed);
+        fence(Ordering::Release);
+        for (sample, value) in slot.left[..frames].iter().zip(left.iter()) {
+            sample.store(value.to_bits(), Ordering::Relaxed);
+        }
+        for (sample, value) in slot.right[..frames].iter().zip(right.iter()) {
+            sample.store(value.to_bits(), Ordering::Relaxed);
+        }
+        slot.frames.store(frames, Ordering::Relaxed);
+        slot.block.store(block, Ordering::Release);
+        self.written.store(block, Ordering::Release);
+    }
+}
+
+/// A routed track's read only end of a source track's bus. Create it on the gui side and send it to the track - it
+/// holds the block copied off the bus.
+pub struct AudioBusReceiver {
+    bus: Arc<AudioBus>,
+    next_block: u64,
+    left: Vec<f32>,  // MAX_BLOCK_SIZE long
+    right: Vec<f32>, // MAX_BLOCK_SIZE long
+}
+
+impl AudioBusReceiver {
+    pub fn new(bus: Arc<AudioBus>) -> Self {
+        Self {
+            bus,
+            next_block: 0,
+            left: vec![0.0; MAX_BLOCK_SIZE],
+            right: vec![0.0; MAX_BLOCK_SIZE],
+        }
+    }
+
+    /// Sum the next block the source wrote into the destination through the route's delay line - nothing if the source
+    /// has not written one since the last call.
+    pub fn mix_into(&mut self, left: &mut [f32], right: &mut [f32], delay_line: Option<&mut StereoDelayLine>) {
+        let frames = self.receive().min(left.len()).min(right.len());
+        let (block_left, block_right) = (&self.left[..frames], &self.right[..frames]);
+        match delay_line {
+            Some(delay_line) => {
+                delay_line.left.process_accumulate(block_left, &mut left[..frames]);
+                delay_line.right.process_accumulate(block_right, &mut right[..frames]);
+            }
+            None => {
+                dsp::mix_accumulate(&mut left[..frames], block_left, 1.0);
+                dsp::mix_accumulate(&mut right[..frames], block_right, 1.0);
+            }
+        }
+    }
+
+    /// Copy the next block off the bus and return its length - 0 if there is nothing new or it was overwritten mid copy.
+    fn receive(&mut self) -> usize {
+        let written = self.bus.written.load(Ordering::Acquire);
+        if written < self.next_block.max(1) {
+            return 0;
+        }
+        let block = self.next_block.max(written.saturating_sub(1)).max(1);
+        self.next_block = block + 1;
+
+        let slot = &self.bus.slots[block as usize % self.bus.slots.len()];
+        if slot.block.load(Ordering::Acquire) != block {
+            return 0;
+        }
+        let frames = slot.frames.load(Ordering::Relaxed).min(MAX_BLOCK_SIZE);
+        for (value, sample) in self.left[..frames].iter_mut().zip(slot.left.iter()) {
+            *value = f32::from_bits(sample.load(Ordering::Relaxed));
+        }
+        for (value, sample) in self.right[..frames].iter_mut().zip(slot.right.iter()) {
+            *value = f32::from_bits(sample.load(Ordering::Relaxed));
+        }
+        fence(Ordering::Acquire);
+        if slot.block.load(Ordering::Relaxed) != block {
+            return 0;
+        }
+        frames
+    }
+}
+
+/// The audio buses of the tracks that route audio to other tracks - owned by the track processing scheduler.
+#[derive(Default)]
+pub struct AudioBuses {
+    buses: parking_lot::Mutex<HashMap<String, Arc<AudioBus>>>, // by source track uuid
+}
+
+impl AudioBuses {
+    /// The track's bus - created the first time it is asked for so call this from the gui side, not a track.
+    pub fn bus(&self, track_uuid: &str) -> Arc<AudioBus> {
+        self.buses.lock().entry(track_uuid.to_string()).or_insert_with(|| Arc::new(AudioBus::new())).clone()
+    }
+
+    pub fn remove_bus(&self, track_uuid: &str) {
+        self.buses.lock().remove(track_uuid);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use crate::audio_bus::{AudioBuses, AudioBusReceiver};
+    use crate::delay_compensation::StereoDelayLine;
+
+    #[test]
+    fn routes_fan_in_and_hand_each_block_over_once() {
+        let audio_buses = AudioBuses::default();
+        let drums = audio_buses.bus("drums");
+        let bass = audio_buses.bus("bass");
+        let mut drums_receiver = AudioBusReceiver::new(drums.clone());
+        let mut bass_receiver = AudioBusReceiver::new(bass.clone());
+        let mut left = [0.0; 4];
+        let mut right = [0.0; 4];
+
+        drums.write(&[1.0; 4], &[2.0; 4]);
+        bass.write(&[0.5; 4], &[0.25; 4]);
+        let mut delay_line = StereoDelayLine::default();
+        delay_line.set_delay(2);
+        drums_receiver.mix_into(&mut left, &mut right, None);
+        bass_receiver.mix_into(&mut left, &mut right, Some(&mut delay_line));
+        assert_eq!([1.0, 1.0, 1.5, 1.5], left);
+        assert_eq!([2.0, 2.0, 2.25, 2.25], right);
+
+        // the source was not processed again so there is nothing new
+        let mut left = [0.0; 4];
+        let mut right = [0.0; 4];
+        drums_receiver.mix_into(&mut left, &mut right, None);
+        assert_eq!([0.0; 4], left);
+        assert!(std::sync::Arc::ptr_eq(&drums, &audio_buses.bus("drums")));
+    }
+
+    #[test]
+    fn a_destination_processed_in_a_later_cycle_still_gets_the_block() {
+        let audio_buses = AudioBuses::default();
+        let drums = audio_buses.bus("drums");
+        let mut receiver = AudioBusReceiver::new(drums.clone());
+        let mut left = [0.0; 2];
+        let mut right = [0.0; 2];
+
+        // the destination is skipped while the source writes two blocks - it picks them up in order a block behind
+        drums.write(&[1.0; 2], &[1.0; 2]);
+        drums.write(&[2.0; 2], &[2.0; 2]);
+        receiver.mix_into(&mut left, &mut right, None);
+        assert_eq!([1.0; 2], left);
+        drums.write(&[3.0; 2], &[3.0; 2]);
+        let mut left = [0.0; 2];
+        receiver.mix_into(&mut left, &mut right, None);
+        assert_eq!([2.0; 2], left);
+
+        // never more than a block behind - anything older is dropped
+        drums.write(&[4.0; 2], &[4.0; 2]);
+        drums.write(&[5.0; 2], &[5.0; 2]);
+        let mut left = [0.0; 2];
+        receiver.mix_into(&mut left, &mut right, None);
+        assert_eq!([4.0; 2], left);
+        let mut left = [0.0; 2];
+        receiver.mix_into(&mut left, &mut right, None);
+        assert_eq!([5.0; 2], left);
+        let mut left = [0.0; 2];
+        receiver.mix_into(&mut left, &mut right, None);
+        assert_eq!([0.0; 2], left);
+    }
+}
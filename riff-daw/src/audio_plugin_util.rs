@@ -1,7 +1,10 @@
 use std::{collections::HashMap, sync::{Arc, mpsc::Sender, Mutex}};
+use std::fs::File;
+use std::io::Read;
 use std::{path::Path};
 use std::path::PathBuf;
-use std::process::{Command};
+use std::process::{Command, Stdio};
+use std::time::{Duration, Instant, UNIX_EPOCH};
 
 use pathsearch::find_executable_in_path;
 
@@ -9,7 +12,7 @@ use simple_clap_host_helper_lib::{plugin::{instance::process::{AudioBuffers, Out
 use vst::{host::{PluginInstance, PluginLoader}, plugin::Category, plugin::Plugin};
 use vst::api::TimeInfo;
 
-use crate::{domain::{VstHost}, event::AudioPluginHostOutwardEvent, constants::{VST24_CHECKER_EXECUTABLE_NAME, CLAP_CHECKER_EXECUTABLE_NAME}};
+use crate::{domain::{PluginDatabase, PluginDatabaseEntry, PluginScanStatus, VstHost}, event::AudioPluginHostOutwardEvent, constants::{VST24_CHECKER_EXECUTABLE_NAME, CLAP_CHECKER_EXECUTABLE_NAME, PLUGIN_SCAN_MAX_PARALLEL_CHECKERS, PLUGIN_SCAN_THREAD_NAME, PLUGIN_SCAN_TIMEOUT_IN_SECONDS}};
 
 pub fn create_vst24_audio_plugin(
     vst24_plugin_loaders: Arc<Mutex<HashMap<String, PluginLoader<VstHost>>>>,
@@ -20,6 +23,8 @@ pub fn create_vst24_audio_plugin(
     sender: Sender<AudioPluginHostOutwardEvent>,
     instrument: bool,
     vst_host_time_info: Arc<parking_lot::RwLock<TimeInfo>>,
+    block_size: usize,
+    sample_rate: f64,
 ) -> (Arc<Mutex<VstHost>>, PluginInstance) {
     let mut path_buf = PathBuf::new();
     let mut path = Path::new(library_path.clone());
@@ -36,6 +41,9 @@ pub fn create_vst24_audio_plugin(
         vst_plugin_uuid, 
         instrument, 
         vst_host_time_info)));
+    if let Ok(mut vst_host) = host.lock() {
+        vst_host.set_audio_format(block_size, sample_rate);
+    }
 
     if !path.exists() || !path.is_file() {
         if let Ok(vst_path) = std::env::var("VST_PATH") {
@@ -182,8 +190,8 @@ pub fn create_vst24_audio_plugin(
                 },
             }
 
-            instance.set_sample_rate(44100.0);
-            instance.set_block_size(1024);
+            instance.set_sample_rate(sample_rate as f32);
+            instance.set_block_size(block_size as i64);
 
             let presets = instance.get_parameter_object();
             for index in 0..info.presets {
@@ -211,6 +219,8 @@ pub fn create_vst24_audio_plugin(
     clap_plugin_id: Option<String>,
     _sender: Sender<AudioPluginHostOutwardEvent>,
     _instrument: bool,   
+    block_size: usize,
+    sample_rate: f64,
  ) -> (simple_clap_host_helper_lib::plugin::instance::Plugin, ProcessData, crossbeam_channel::Receiver<DAWCallback>) {
     let path = Path::new(audio_plugin_path.clone());
 
@@ -249,42 +259,9 @@ pub fn create_vst24_audio_plugin(
             
                 let _ = plugin.init();
             
-                let audio_ports_config = match plugin.get_extension::<AudioPorts>() {
-                    Some(audio_ports) => if let Ok(config) = audio_ports.config(&plugin) {
-                        config
-                    }
-                    else {
-                        panic!("Error while querying 'audio-ports' IO configuration");
-                    }
-                    None => {
-                        panic!("No 'audio-ports' found");
-                    }
-                };
-            
                 // // host.handle_callbacks_once();
             
-                let process_config = ProcessConfig {
-                    sample_rate: 44_100.0,
-                    tempo: 140.0,
-                    time_sig_numerator: 4,
-                    time_sig_denominator: 4,
-                };
-            
-                let (input_buffers, output_buffers) = audio_ports_config.create_buffers(1024);
-                let audio_buffers = if let Ok(buffers) = OutOfPlaceAudioBuffers::new(
-                    input_buffers,
-                    output_buffers,
-                ) {
-                    AudioBuffers::OutOfPlace(buffers)
-                }
-                else {
-                    panic!("Couldn't allocate audio buffers.");
-                };
-            
-                let _ = plugin.activate(44100.0, 1, 1024);
-                let _ = plugin.start_processing();
-            
-                let process_data = ProcessData::new(audio_buffers, process_config);
+                let process_data = activate_clap_audio_plugin(&plugin, block_size, sample_rate);
             
                 return (plugin, process_data, host_receiver);
             }
@@ -296,111 +273,341 @@ pub fn create_vst24_audio_plugin(
     }
 }
 
-pub fn scan_for_audio_plugins(vst_path: String, clap_path: String) -> (HashMap<String, String>, HashMap<String, String>) {
-    let mut instrument_audio_plugins: HashMap<String, String> = HashMap::new();
-    let mut effect_audio_plugins: HashMap<String, String> = HashMap::new();
+/// Activate a clap plugin for the given block size and sample rate and create the process data to match.
+pub fn activate_clap_audio_plugin(
+    plugin: &simple_clap_host_helper_lib::plugin::instance::Plugin,
+    block_size: usize,
+    sample_rate: f64,
+) -> ProcessData {
+    let audio_ports_config = match plugin.get_extension::<AudioPorts>() {
+        Some(audio_ports) => if let Ok(config) = audio_ports.config(plugin) {
+            config
+        }
+        else {
+            panic!("Error while querying 'audio-ports' IO configuration");
+        }
+        None => {
+            panic!("No 'audio-ports' found");
+        }
+    };
+
+    let process_config = ProcessConfig {
+        sample_rate,
+        tempo: 140.0,
+        time_sig_numerator: 4,
+        time_sig_denominator: 4,
+    };
+
+    let (input_buffers, output_buffers) = audio_ports_config.create_buffers(block_size);
+    let audio_buffers = if let Ok(buffers) = OutOfPlaceAudioBuffers::new(
+        input_buffers,
+        output_buffers,
+    ) {
+        AudioBuffers::OutOfPlace(buffers)
+    }
+    else {
+        panic!("Couldn't allocate audio buffers.");
+    };
 
+    let _ = plugin.activate(sample_rate, 1, block_size);
+    let _ = plugin.start_processing();
+
+    ProcessData::new(audio_buffers, process_config)
+}
+
+
+struct PluginScanJob {
+    checker: PathBuf,
+    path: String,
+    modified: u64,
+    size: u64,
+    previous_hash: Option<u64>,
+}
+
+enum PluginScanResult {
+    Unchanged(u64, u64), // modified, size - the contents still match the database
+    Checked(PluginDatabaseEntry),
+}
+
+/// Scan the vst and clap directories for plugins. Binaries whose modification time and size match the database (or
+/// failing that whose contents still hash the same) are not checked again. The checkers run in parallel, a checker that
+/// hangs is killed and crashed, timed out and blacklisted binaries are skipped until they change.
+pub fn scan_for_audio_plugins(vst_path: String, clap_path: String, plugin_database: &mut PluginDatabase) -> (HashMap<String, String>, HashMap<String, String>) {
+    let mut plugin_binaries = vec![];
     if let Some(vst24_checker) = find_executable_in_path(VST24_CHECKER_EXECUTABLE_NAME) {
-        if let Some(vst24_checker) = vst24_checker.to_str() {
-            scan_for_audio_plugins_of_type(vst24_checker, vst_path.as_str(), &mut instrument_audio_plugins, &mut effect_audio_plugins);
-        }
+        plugin_binaries.extend(find_audio_plugin_binaries(vst_path.as_str()).into_iter().map(|path| (vst24_checker.clone(), path)));
     }
-    
     if let Some(clap_checker) = find_executable_in_path(CLAP_CHECKER_EXECUTABLE_NAME) {
-        if let Some(clap_checker) = clap_checker.to_str() {
-            scan_for_audio_plugins_of_type(clap_checker, clap_path.as_str(), &mut instrument_audio_plugins, &mut effect_audio_plugins);
+        plugin_binaries.extend(find_audio_plugin_binaries(clap_path.as_str()).into_iter().map(|path| (clap_checker.clone(), path)));
+    }
+
+    // forget binaries that have been removed
+    plugin_database.entries.retain(|path, _| Path::new(path).exists());
+
+    let mut scan_jobs = vec![];
+    for (checker, path) in plugin_binaries.into_iter() {
+        if let Some((modified, size)) = audio_plugin_binary_modified_and_size(path.as_str()) {
+            match plugin_database.entries.get(&path) {
+                Some(entry) if entry.status == PluginScanStatus::Blacklisted => (),
+                Some(entry) if entry.modified == modified && entry.size == size => (),
+                entry => {
+                    let previous_hash = entry.map(|entry| entry.hash);
+                    scan_jobs.push(PluginScanJob { checker, path, modified, size, previous_hash });
+                }
+            }
         }
     }
+    println!("Plugin scan: {} binaries known, {} new or changed.", plugin_database.entries.len(), scan_jobs.len());
+
+    // checkers spend a good part of their time loading libraries so run a couple per core
+    let workers = (std::thread::available_parallelism().map(|parallelism| parallelism.get()).unwrap_or(1) * 2).min(PLUGIN_SCAN_MAX_PARALLEL_CHECKERS).min(scan_jobs.len());
+    let scan_jobs = Mutex::new(scan_jobs);
+    let scan_results = Mutex::new(vec![]);
+    std::thread::scope(|scope| {
+        for _ in 0..workers {
+            let worker = std::thread::Builder::new().name(PLUGIN_SCAN_THREAD_NAME.to_string()).spawn_scoped(scope, || {
+                loop {
+                    let scan_job = match scan_jobs.lock() {
+                        Ok(mut scan_jobs) => scan_jobs.pop(),
+                        Err(_) => None,
+                    };
+                    match scan_job {
+                        Some(scan_job) => if let Some(scan_result) = scan_audio_plugin_binary(&scan_job) {
+                            if let Ok(mut scan_results) = scan_results.lock() {
+                                scan_results.push((scan_job.path, scan_result));
+                            }
+                        }
+                        None => break,
+                    }
+                }
+            });
+            if let Err(error) = worker {
+                println!("Couldn't start a plugin scanner thread: {}", error);
+            }
+        }
+    });
+
+    if let Ok(scan_results) = scan_results.into_inner() {
+        for (path, scan_result) in scan_results.into_iter() {
+            match scan_result {
+                PluginScanResult::Unchanged(modified, size) => if let Some(entry) = plugin_database.entries.get_mut(&path) {
+                    entry.modified = modified;
+                    entry.size = size;
+                }
+                PluginScanResult::Checked(entry) => {
+                    if entry.status != PluginScanStatus::Scanned {
+                        println!("Plugin scan: {} {:?} - it will be skipped until it changes.", path, entry.status);
+                    }
+                    plugin_database.entries.insert(path, entry);
+                }
+            }
+        }
+    }
+
+    let mut instrument_audio_plugins: HashMap<String, String> = HashMap::new();
+    let mut effect_audio_plugins: HashMap<String, String> = HashMap::new();
+    for entry in plugin_database.entries.values().filter(|entry| entry.status == PluginScanStatus::Scanned) {
+        instrument_audio_plugins.extend(entry.instrument_plugins.iter().map(|(id, name)| (id.clone(), name.clone())));
+        effect_audio_plugins.extend(entry.effect_plugins.iter().map(|(id, name)| (id.clone(), name.clone())));
+    }
 
     (instrument_audio_plugins, effect_audio_plugins)
 }
 
-fn scan_for_audio_plugins_of_type(
-    audio_plugin_checker: &str, 
-    shared_library_path: &str, 
-    instrument_audio_plugins: &mut HashMap<String, String>, 
-    effect_audio_plugins: &mut HashMap<String, String>
-) {
+fn find_audio_plugin_binaries(shared_library_path: &str) -> Vec<String> {
+    let mut plugin_binaries = vec![];
     if let Ok(read_dir) = std::fs::read_dir(shared_library_path) {
-        for dir_entry in read_dir {
-            if let Ok(entry) = dir_entry {
-                if let Ok(file_type) = entry.file_type() {
-                    if file_type.is_file() || file_type.is_symlink() {
-                        if let Some(path) = entry.path().to_str() {
-                            if path.ends_with(".so") || path.ends_with(".clap") {
-                                println!("Found shared library: {}", path);
-                                let plugin_path = path.to_string();
-
-                                if let Ok(output) = Command::new(audio_plugin_checker)
-                                    .arg(format!("\"{}\"", plugin_path.as_str()))
-                                    .output() {
-                                    if let Ok(command_output) = std::str::from_utf8(&output.stdout) {
-                                        println!("{}", command_output);
-                                        if command_output.contains("##########") {
-                                            for line in command_output.lines() {
-                                                if line.starts_with("##########") {
-                                                    let adjusted_line = line.replace("##########", "");
-                                                    let elements = adjusted_line.split(':').collect::<Vec<&str>>();
-                                                    let plugin_name = match elements.first() {
-                                                        Some(plugin_name) => *plugin_name,
-                                                        None => "unknown",
-                                                    };
-                                                    let library_path = match elements.get(1) {
-                                                        Some(path) => *path,
-                                                        None => "",
-                                                    };
-                                                    let plugin_id = match elements.get(2) {
-                                                        Some(id) => *id,
-                                                        None => "",
-                                                    };
-                                                    let plugin_category = match elements.get(3) {
-                                                        Some(category) => (*category).parse::<isize>().unwrap_or(0),
-                                                        None => 0,
-                                                    };
-                                                    let plugin_type = match elements.get(4) {
-                                                        Some(plugin_type) => *plugin_type,
-                                                        None => "unknown",
-                                                    };
-
-
-                                                    if !plugin_name.is_empty() &&
-                                                        !library_path.is_empty() {
-                                                        let id = format!("{}:{}:{}", library_path, plugin_id, plugin_type);
-                                                        let plugin_name = format!("{} ({})", plugin_name, plugin_type);
-
-                                                        match plugin_category {
-                                                            // unknown
-                                                            0 => {
-                                                                effect_audio_plugins.insert(id, plugin_name);
-                                                            }
-                                                            // effect
-                                                            1 => {
-                                                                effect_audio_plugins.insert(id, plugin_name);
-                                                            }
-                                                            // instrument
-                                                            2 => {
-                                                                instrument_audio_plugins.insert(id, plugin_name);
-                                                            }
-                                                            // generator
-                                                            11 => {
-                                                                instrument_audio_plugins.insert(id, plugin_name);
-                                                            }
-                                                            _ => {}
-                                                        }
-                                                    }
-                                                }
-                                            }
-                                        }
-                                    }
-                                    else {
-                                        println!("Couldn't process command output.");
-                                    }
-                                }
-                            }
+        for entry in read_dir.flatten() {
+            if let Ok(file_type) = entry.file_type() {
+                if file_type.is_file() || file_type.is_symlink() {
+                    if let Some(path) = entry.path().to_str() {
+                        if path.ends_with(".so") || path.ends_with(".clap") {
+                            plugin_binaries.push(path.to_string());
                         }
                     }
                 }
             }
         }
     }
+    plugin_binaries
+}
+
+fn audio_plugin_binary_modified_and_size(path: &str) -> Option<(u64, u64)> {
+    let metadata = std::fs::metadata(path).ok()?;
+    let modified = metadata.modified().ok()?.duration_since(UNIX_EPOCH).map(|duration| duration.as_secs()).unwrap_or(0);
+    Some((modified, metadata.len()))
+}
+
+/// fnv-1a - stable across builds unlike the std hasher so it can be stored.
+fn hash_audio_plugin_binary(path: &str) -> Option<u64> {
+    let mut file = File::open(path).ok()?;
+    let mut buffer = vec![0_u8; 64 * 1024];
+    let mut hash: u64 = 0xcbf29ce484222325;
+    loop {
+        let read = file.read(&mut buffer).ok()?;
+        if read == 0 {
+            break;
+        }
+        for byte in buffer[..read].iter() {
+            hash ^= *byte as u64;
+            hash = hash.wrapping_mul(0x100000001b3);
+        }
+    }
+    Some(hash)
+}
+
+fn scan_audio_plugin_binary(scan_job: &PluginScanJob) -> Option<PluginScanResult> {
+    let hash = hash_audio_plugin_binary(scan_job.path.as_str())?;
+    if scan_job.previous_hash == Some(hash) {
+        return Some(PluginScanResult::Unchanged(scan_job.modified, scan_job.size));
+    }
+
+    println!("Checking shared library: {}", scan_job.path);
+    let (mut status, output) = run_audio_plugin_checker(scan_job.checker.as_path(), scan_job.path.as_str());
+    let mut instrument_plugins = HashMap::new();
+    let mut effect_plugins = HashMap::new();
+    parse_audio_plugin_checker_output(output.as_str(), &mut instrument_plugins, &mut effect_plugins);
+
+    // some plugins crash on the way out after they've been described
+    if status == PluginScanStatus::Crashed && !(instrument_plugins.is_empty() && effect_plugins.is_empty()) {
+        status = PluginScanStatus::Scanned;
+    }
+
+    Some(PluginScanResult::Checked(PluginDatabaseEntry {
+        modified: scan_job.modified,
+        size: scan_job.size,
+        hash,
+        status,
+        instrument_plugins,
+        effect_plugins,
+    }))
+}
+
+fn run_audio_plugin_checker(audio_plugin_checker: &Path, plugin_path: &str) -> (PluginScanStatus, String) {
+    let mut child = match Command::new(audio_plugin_checker)
+        .arg(format!("\"{}\"", plugin_path))
+        .stdin(Stdio::null())
+        .stdout(Stdio::piped())
+        .spawn() {
+        Ok(child) => child,
+        Err(error) => {
+            println!("Couldn't run the plugin checker for {}: {}", plugin_path, error);
+            return (PluginScanStatus::Crashed, String::new());
+        }
+    };
+
+    // drain the output as it comes so that a chatty checker can't fill the pipe and stall
+    let output_reader = child.stdout.take().map(|mut stdout| std::thread::spawn(move || {
+        let mut output = vec![];
+        let _ = stdout.read_to_end(&mut output);
+        output
+    }));
+
+    let started = Instant::now();
+    let status = loop {
+        match child.try_wait() {
+            Ok(Some(exit_status)) => break if exit_status.success() { PluginScanStatus::Scanned } else { PluginScanStatus::Crashed },
+            Ok(None) => {
+                if started.elapsed() >= Duration::from_secs(PLUGIN_SCAN_TIMEOUT_IN_SECONDS) {
+                    let _ = child.kill();
+                    let _ = child.wait();
+                    break PluginScanStatus::TimedOut;
+                }
+                std::thread::sleep(Duration::from_millis(20));
+            }
+            Err(_) => {
+                let _ = child.kill();
+                let _ = child.wait();
+                break PluginScanStatus::Crashed;
+            }
+        }
+    };
+
+    // anything the killed checker started might still hold the pipe open so don't wait for its output
+    if status == PluginScanStatus::TimedOut {
+        return (status, String::new());
+    }
+    let output = output_reader.and_then(|output_reader| output_reader.join().ok()).unwrap_or_default();
+    (status, String::from_utf8_lossy(&output).to_string())
+}
+
+/// The checkers describe each plugin on a line: ##########name:library path:id:category:type
+fn parse_audio_plugin_checker_output(
+    command_output: &str,
+    instrument_audio_plugins: &mut HashMap<String, String>,
+    effect_audio_plugins: &mut HashMap<String, String>
+) {
+    for line in command_output.lines() {
+        if line.starts_with("##########") {
+            let adjusted_line = line.replace("##########", "");
+            let elements = adjusted_line.split(':').collect::<Vec<&str>>();
+            let plugin_name = match elements.first() {
+                Some(plugin_name) => *plugin_name,
+                None => "unknown",
+            };
+            let library_path = match elements.get(1) {
+                Some(path) => *path,
+                None => "",
+            };
+            let plugin_id = match elements.get(2) {
+                Some(id) => *id,
+                None => "",
+            };
+            let plugin_category = match elements.get(3) {
+                Some(category) => (*category).parse::<isize>().unwrap_or(0),
+                None => 0,
+            };
+            let plugin_type = match elements.get(4) {
+                Some(plugin_type) => *plugin_type,
+                None => "unknown",
+            };
+
+            if !plugin_name.is_empty() &&
+                !library_path.is_empty() {
+                let id = format!("{}:{}:{}", library_path, plugin_id, plugin_type);
+                let plugin_name = format!("{} ({})", plugin_name, plugin_type);
+
+                match plugin_category {
+                    // unknown
+                    0 => {
+                        effect_audio_plugins.insert(id, plugin_name);
+                    }
+                    // effect
+                    1 => {
+                        effect_audio_plugins.insert(id, plugin_name);
+                    }
+                    // instrument
+                    2 => {
+                        instrument_audio_plugins.insert(id, plugin_name);
+                    }
+                    // generator
+                    11 => {
+                        instrument_audio_plugins.insert(id, plugin_name);
+                    }
+                    _ => {}
+                }
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::collections::HashMap;
+
+    use crate::audio_plugin_util::parse_audio_plugin_checker_output;
+
+    #[test]
+    fn checker_output_is_split_into_instruments_and_effects() {
+        let output = "Loading...\n##########Synth:/plugins/synth.so:1234:2:VST24\n##########Reverb:/plugins/fx.clap:com.fx.reverb:1:CLAP\nDone.\n";
+        let mut instrument_plugins = HashMap::new();
+        let mut effect_plugins = HashMap::new();
+
+        parse_audio_plugin_checker_output(output, &mut instrument_plugins, &mut effect_plugins);
+
+        assert_eq!(Some(&"Synth (VST24)".to_string()), instrument_plugins.get("/plugins/synth.so:1234:VST24"));
+        assert_eq!(Some(&"Reverb (CLAP)".to_string()), effect_plugins.get("/plugins/fx.clap:com.fx.reverb:CLAP"));
+        assert_eq!(1, instrument_plugins.len());
+        assert_eq!(1, effect_plugins.len());
+    }
 }
@@ -0,0 +1,177 @@
+use std::cmp::Ordering;
+use std::collections::HashMap;
+
+use uuid::Uuid;
+
+use crate::constants::{AUTOMATION_RAMP_FRAMES, AUTOMATION_SUB_BLOCK_FRAMES};
+use crate::domain::{DAWItemPosition, PluginParameter};
+
+/// The plugin parameter changes for the block being processed with positions relative to the start of the block.
+/// Changes are thinned to at most one per parameter every AUTOMATION_SUB_BLOCK_FRAMES frames so that dense automation
+/// doesn't flood the plugin event queues or split vst24 blocks into tiny pieces. With ramping on each change is spread
+/// over AUTOMATION_RAMP_FRAMES in sub block steps rather than jumping.
+#[derive(Default)]
+pub struct ParameterAutomation {
+    pub ramping: bool,
+    changes: Vec<PluginParameter>,
+    ramped_changes: Vec<PluginParameter>,
+    values: HashMap<(Uuid, i32), f32>, // (plugin uuid, parameter index), last value sent
+}
+
+impl ParameterAutomation {
+    /// Replace the changes with this block's - the positions are absolute frames.
+    pub fn set_block_changes(&mut self, changes: &[PluginParameter], block_start_frame: f64, block_size: usize) {
+        self.changes.clear();
+        for change in changes.iter() {
+            let mut change = *change;
+            change.set_position((change.position() - block_start_frame).max(0.0).min(block_size.saturating_sub(1) as f64));
+            self.changes.push(change);
+        }
+        self.changes.sort_by(|a, b| a.position().partial_cmp(&b.position()).unwrap_or(Ordering::Equal));
+        thin_parameter_changes(&mut self.changes, AUTOMATION_SUB_BLOCK_FRAMES);
+
+        if self.ramping {
+            ramp_parameter_changes(&self.changes, &mut self.ramped_changes, &self.values, block_size, AUTOMATION_SUB_BLOCK_FRAMES, AUTOMATION_RAMP_FRAMES);
+        }
+        else {
+            self.ramped_changes.clear();
+        }
+        for change in self.changes.iter() {
+            self.values.insert((change.plugin_uuid, change.index), change.value());
+        }
+    }
+
+    pub fn clear(&mut self) {
+        self.changes.clear();
+        self.ramped_changes.clear();
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.changes.is_empty()
+    }
+
+    /// The changes to send, ordered by position.
+    pub fn changes(&self) -> &[PluginParameter] {
+        if self.ramping {
+            &self.ramped_changes
+        }
+        else {
+            &self.changes
+        }
+    }
+
+    pub fn plugin_changes<'a>(&'a self, plugin_uuid: &'a Uuid) -> impl Iterator<Item = &'a PluginParameter> + 'a {
+        self.changes().iter().filter(move |change| change.plugin_uuid == *plugin_uuid)
+    }
+}
+
+/// Keep only the last change to each parameter within each granule and move it to the start of the granule.
+/// The changes must be ordered by position.
+pub fn thin_parameter_changes(changes: &mut Vec<PluginParameter>, granularity: usize) {
+    let granularity = granularity.max(1);
+    let mut index = 0;
+    while index < changes.len() {
+        let change = changes[index];
+        let granule = change.position() as usize / granularity;
+        let superseded = changes[index + 1..].iter()
+            .take_while(|later_change| later_change.position() as usize / granularity == granule)
+            .any(|later_change| later_change.plugin_uuid == change.plugin_uuid && later_change.index == change.index);
+
+        if superseded {
+            changes.remove(index);
+        }
+        else {
+            changes[index].set_position((granule * granularity) as f64);
+            index += 1;
+        }
+    }
+}
+
+/// Spread each change to a parameter with a known previous value over ramp_frames in granularity steps. A ramp is
+/// shortened so that it finishes before the next change to the same parameter and within the block.
+pub fn ramp_parameter_changes(
+    changes: &[PluginParameter],
+    ramped_changes: &mut Vec<PluginParameter>,
+    values: &HashMap<(Uuid, i32), f32>,
+    block_size: usize,
+    granularity: usize,
+    ramp_frames: usize,
+) {
+    let granularity = granularity.max(1);
+    let mut previous_values: Vec<(Uuid, i32, f32)> = vec![];
+    ramped_changes.clear();
+
+    for (index, change) in changes.iter().enumerate() {
+        let start = change.position() as usize;
+        let next_change_start = changes[index + 1..].iter()
+            .find(|later_change| later_change.plugin_uuid == change.plugin_uuid && later_change.index == change.index)
+            .map(|later_change| later_change.position() as usize)
+            .unwrap_or(block_size);
+        let steps = ((start + ramp_frames).min(next_change_start).min(block_size).saturating_sub(start)) / granularity;
+        let previous_value = previous_values.iter()
+            .rev()
+            .find(|(plugin_uuid, parameter_index, _)| *plugin_uuid == change.plugin_uuid && *parameter_index == change.index)
+            .map(|(_, _, value)| *value)
+            .or_else(|| values.get(&(change.plugin_uuid, change.index)).copied());
+
+        match previous_value {
+            Some(previous_value) if steps > 1 => {
+                for step in 1..=steps {
+                    let mut ramp_change = *change;
+                    ramp_change.set_position((start + (step - 1) * granularity) as f64);
+                    ramp_change.set_value(previous_value + (change.value() - previous_value) * step as f32 / steps as f32);
+                    ramped_changes.push(ramp_change);
+                }
+            }
+            _ => ramped_changes.push(*change),
+        }
+        previous_values.push((change.plugin_uuid, change.index, change.value()));
+    }
+
+    // each parameter's steps are at distinct positions so an unstable sort keeps them in order
+    ramped_changes.sort_unstable_by(|a, b| a.position().partial_cmp(&b.position()).unwrap_or(Ordering::Equal));
+}
+
+#[cfg(test)]
+mod tests {
+    use std::collections::HashMap;
+
+    use uuid::Uuid;
+
+    use crate::automation::{ramp_parameter_changes, thin_parameter_changes};
+    use crate::domain::{DAWItemPosition, PluginParameter};
+
+    fn parameter(plugin_uuid: Uuid, index: i32, position: f64, value: f32) -> PluginParameter {
+        PluginParameter { index, position, value, instrument: false, plugin_uuid }
+    }
+
+    #[test]
+    fn thinning_keeps_the_last_change_per_parameter_in_each_granule() {
+        let plugin_uuid = Uuid::new_v4();
+        let mut changes = vec![
+            parameter(plugin_uuid, 0, 1.0, 0.1),
+            parameter(plugin_uuid, 1, 2.0, 0.5),
+            parameter(plugin_uuid, 0, 3.0, 0.2),
+            parameter(plugin_uuid, 0, 40.0, 0.3),
+        ];
+
+        thin_parameter_changes(&mut changes, 32);
+
+        let thinned: Vec<(i32, f64, f32)> = changes.iter().map(|change| (change.index, change.position(), change.value())).collect();
+        assert_eq!(vec![(1, 0.0, 0.5), (0, 0.0, 0.2), (0, 32.0, 0.3)], thinned);
+    }
+
+    #[test]
+    fn ramping_reaches_the_target_before_the_next_change() {
+        let plugin_uuid = Uuid::new_v4();
+        let changes = vec![parameter(plugin_uuid, 0, 0.0, 1.0), parameter(plugin_uuid, 0, 64.0, 0.0)];
+        let mut values = HashMap::new();
+        values.insert((plugin_uuid, 0), 0.0);
+        let mut ramped_changes = vec![];
+
+        ramp_parameter_changes(&changes, &mut ramped_changes, &values, 1024, 32, 128);
+
+        let ramped: Vec<(f64, f32)> = ramped_changes.iter().map(|change| (change.position(), change.value())).collect();
+        assert_eq!(vec![(0.0, 0.5), (32.0, 1.0), (64.0, 0.75), (96.0, 0.5), (128.0, 0.25), (160.0, 0.0)], ramped);
+    }
+}
@@ -0,0 +1,279 @@
+use std::collections::HashMap;
+use std::collections::hash_map::DefaultHasher;
+use std::fs::OpenOptions;
+use std::hash::{Hash, Hasher};
+use std::io::{Cursor, Read, Write};
+use std::path::{Path, PathBuf};
+
+use log::*;
+use serde::{Deserialize, Serialize};
+
+use crate::domain::Project;
+use crate::project_file::{ProjectFile, ProjectFileChunkType, ProjectFileSection};
+
+const AUTOSAVE_JOURNAL_ENTRIES_PER_CHECKPOINT: usize = 12;
+const AUTOSAVE_CHECKPOINTS_KEPT: usize = 3;
+const AUTOSAVE_CHECKPOINT_MARKER: &str = "_checkpoint_";
+const AUTOSAVE_CHECKPOINT_EXTENSION: &str = ".fdaw.xz";
+const AUTOSAVE_JOURNAL_EXTENSION: &str = ".journal";
+
+#[derive(Serialize, Deserialize)]
+struct AutosaveJournalSection {
+    chunk_type: ProjectFileChunkType,
+    key: String,
+    length: Option<u64>, // None when the section has not changed since the previous autosave
+}
+
+/// Incrementally autosaves a project next to its file. A full checkpoint (an xz compressed project file) is written
+/// every AUTOSAVE_JOURNAL_ENTRIES_PER_CHECKPOINT autosaves, in between only the sections that have changed are appended
+/// to the checkpoint's journal. Each journal entry lists all the sections in the project at the time so that removed
+/// tracks and plugins are dropped on recovery. Only the last AUTOSAVE_CHECKPOINTS_KEPT checkpoints are kept.
+///
+/// Only a copy of the project is taken under the state lock - everything else (splitting it into sections, hashing,
+/// compression and io) happens on the autosave thread.
+pub struct Autosaver {
+    checkpoint_path: Option<PathBuf>,
+    project_path: Option<String>,
+    section_hashes: HashMap<(ProjectFileChunkType, String), u64>,
+    journal_entries: usize,
+}
+
+impl Autosaver {
+    pub fn new() -> Self {
+        Self {
+            checkpoint_path: None,
+            project_path: None,
+            section_hashes: HashMap::new(),
+            journal_entries: 0,
+        }
+    }
+
+    pub fn autosave(&mut self, project_path: Option<String>, project: &Project) -> anyhow::Result<()> {
+        let sections = ProjectFile::sections(project)?;
+
+        // a different project means starting again with a new checkpoint
+        if self.project_path != project_path {
+            self.checkpoint_path = None;
+            self.project_path = project_path.clone();
+        }
+
+        let section_hashes: HashMap<(ProjectFileChunkType, String), u64> = sections.iter().map(|section| {
+            let mut hasher = DefaultHasher::new();
+            section.data.hash(&mut hasher);
+            ((section.chunk_type, section.key.clone()), hasher.finish())
+        }).collect();
+
+        match &self.checkpoint_path {
+            Some(checkpoint_path) if self.journal_entries < AUTOSAVE_JOURNAL_ENTRIES_PER_CHECKPOINT => {
+                if section_hashes == self.section_hashes {
+                    info!("Autosave: nothing has changed.");
+                    return Ok(());
+                }
+                let journal_path = Autosaver::journal_path(checkpoint_path);
+                self.append_journal_entry(journal_path.as_path(), &sections, &section_hashes)?;
+                self.journal_entries += 1;
+                info!("Autosave: appended to journal: {:?}", journal_path);
+            }
+            _ => {
+                let base_path = project_path.unwrap_or_else(|| "/tmp/unknown".to_string());
+                let checkpoint_path = PathBuf::from(format!("{}{}{}{}", base_path, AUTOSAVE_CHECKPOINT_MARKER, chrono::offset::Local::now().format("%Y%m%d%H%M%S"), AUTOSAVE_CHECKPOINT_EXTENSION));
+                Autosaver::write_checkpoint(checkpoint_path.as_path(), &sections)?;
+                info!("Autosave: wrote checkpoint: {:?}", checkpoint_path);
+                Autosaver::prune_checkpoints(base_path.as_str());
+                self.checkpoint_path = Some(checkpoint_path);
+                self.journal_entries = 0;
+            }
+        }
+
+        self.section_hashes = section_hashes;
+        Ok(())
+    }
+
+    /// Rebuild the project from a checkpoint and its journal.
+    pub fn recover(checkpoint_path: &str) -> anyhow::Result<Project> {
+        let checkpoint = lzma::decompress(std::fs::read(checkpoint_path)?.as_slice())?;
+        let mut sections = ProjectFile::from_reader(Cursor::new(checkpoint))?.read_sections()?;
+
+        let journal_path = Autosaver::journal_path(Path::new(checkpoint_path));
+        if let Ok(journal) = std::fs::read(journal_path) {
+            let mut journal = Cursor::new(journal);
+            // a torn entry at the end from a crash mid write is ignored
+            while let Some(entry) = Autosaver::read_journal_entry(&mut journal) {
+                sections = Autosaver::apply_journal_entry(sections, entry)?;
+            }
+        }
+
+        let mut project_file_data = Cursor::new(vec![]);
+        ProjectFile::write_sections(&mut project_file_data, &sections)?;
+        project_file_data.set_position(0);
+        ProjectFile::from_reader(project_file_data)?.read_project()
+    }
+
+    pub fn is_checkpoint(path: &str) -> bool {
+        path.contains(AUTOSAVE_CHECKPOINT_MARKER) && path.ends_with(AUTOSAVE_CHECKPOINT_EXTENSION)
+    }
+
+    /// The project file a checkpoint was autosaved from - checkpoints of a recovered checkpoint are unwound too.
+    pub fn project_path_for_checkpoint(checkpoint_path: &str) -> Option<String> {
+        let mut project_path = checkpoint_path;
+        while Autosaver::is_checkpoint(project_path) {
+            project_path = &project_path[..project_path.rfind(AUTOSAVE_CHECKPOINT_MARKER)?];
+        }
+        if project_path.is_empty() || project_path == checkpoint_path {
+            None
+        }
+        else {
+            Some(project_path.to_string())
+        }
+    }
+
+    fn write_checkpoint(checkpoint_path: &Path, sections: &[ProjectFileSection]) -> anyhow::Result<()> {
+        let mut project_file_data = Cursor::new(vec![]);
+        ProjectFile::write_sections(&mut project_file_data, sections)?;
+        let compressed = lzma::compress(project_file_data.get_ref().as_slice(), 6)?;
+        std::fs::write(checkpoint_path, compressed)?;
+        Ok(())
+    }
+
+    /// Entry: length: u64 | xz compressed (index length: u32 | index | changed section data...)
+    fn append_journal_entry(&self, journal_path: &Path, sections: &[ProjectFileSection], section_hashes: &HashMap<(ProjectFileChunkType, String), u64>) -> anyhow::Result<()> {
+        let mut index = vec![];
+        let mut data = vec![];
+        for section in sections.iter() {
+            let section_key = (section.chunk_type, section.key.clone());
+            let changed = self.section_hashes.get(&section_key) != section_hashes.get(&section_key);
+            index.push(AutosaveJournalSection {
+                chunk_type: section.chunk_type,
+                key: section.key.clone(),
+                length: if changed { Some(section.data.len() as u64) } else { None },
+            });
+            if changed {
+                data.extend_from_slice(section.data.as_slice());
+            }
+        }
+
+        let index = serde_json::to_vec(&index)?;
+        let mut entry = Vec::with_capacity(4 + index.len() + data.len());
+        entry.extend_from_slice(&(index.len() as u32).to_le_bytes());
+        entry.extend_from_slice(index.as_slice());
+        entry.extend_from_slice(data.as_slice());
+        let compressed = lzma::compress(entry.as_slice(), 6)?;
+
+        let mut journal = OpenOptions::new().create(true).append(true).open(journal_path)?;
+        journal.write_all(&(compressed.len() as u64).to_le_bytes())?;
+        journal.write_all(compressed.as_slice())?;
+        journal.flush()?;
+        Ok(())
+    }
+
+    fn read_journal_entry(journal: &mut Cursor<Vec<u8>>) -> Option<Vec<u8>> {
+        let mut length = [0_u8; 8];
+        journal.read_exact(&mut length).ok()?;
+        let length = u64::from_le_bytes(length);
+        if length > journal.get_ref().len() as u64 - journal.position() {
+            return None;
+        }
+        let mut compressed = vec![0_u8; length as usize];
+        journal.read_exact(compressed.as_mut_slice()).ok()?;
+        lzma::decompress(compressed.as_slice()).ok()
+    }
+
+    fn apply_journal_entry(sections: Vec<ProjectFileSection>, entry: Vec<u8>) -> anyhow::Result<Vec<ProjectFileSection>> {
+        if entry.len() < 4 {
+            return Err(anyhow::anyhow!("journal entry too short"));
+        }
+        let index_length = u32::from_le_bytes([entry[0], entry[1], entry[2], entry[3]]) as usize;
+        let index: Vec<AutosaveJournalSection> = serde_json::from_slice(entry.get(4..4 + index_length).ok_or_else(|| anyhow::anyhow!("journal entry index truncated"))?)?;
+        let mut previous_sections: HashMap<(ProjectFileChunkType, String), ProjectFileSection> = sections.into_iter().map(|section| ((section.chunk_type, section.key.clone()), section)).collect();
+        let mut data_offset = 4 + index_length;
+        let mut updated_sections = vec![];
+
+        for journal_section in index.into_iter() {
+            match journal_section.length {
+                Some(length) => {
+                    let data = entry.get(data_offset..data_offset + length as usize).ok_or_else(|| anyhow::anyhow!("journal entry data truncated"))?;
+                    data_offset += length as usize;
+                    updated_sections.push(ProjectFileSection { chunk_type: journal_section.chunk_type, key: journal_section.key, data: data.to_vec() });
+                }
+                None => if let Some(section) = previous_sections.remove(&(journal_section.chunk_type, journal_section.key)) {
+                    updated_sections.push(section);
+                }
+            }
+        }
+
+        Ok(updated_sections)
+    }
+
+    fn journal_path(checkpoint_path: &Path) -> PathBuf {
+        let checkpoint_path = checkpoint_path.to_string_lossy();
+        PathBuf::from(format!("{}{}", checkpoint_path.trim_end_matches(AUTOSAVE_CHECKPOINT_EXTENSION), AUTOSAVE_JOURNAL_EXTENSION))
+    }
+
+    /// Delete all but the newest AUTOSAVE_CHECKPOINTS_KEPT checkpoints (and their journals) for the project.
+    fn prune_checkpoints(base_path: &str) {
+        let base_path = Path::new(base_path);
+        let directory = match base_path.parent() {
+            Some(directory) if !directory.as_os_str().is_empty() => directory.to_path_buf(),
+            _ => PathBuf::from("."),
+        };
+        let checkpoint_prefix = format!("{}{}", base_path.file_name().map(|file_name| file_name.to_string_lossy().to_string()).unwrap_or_default(), AUTOSAVE_CHECKPOINT_MARKER);
+
+        if let Ok(entries) = std::fs::read_dir(directory) {
+            let mut checkpoint_paths: Vec<PathBuf> = entries.flatten()
+                .map(|entry| entry.path())
+                .filter(|path| path.file_name().map(|file_name| {
+                    let file_name = file_name.to_string_lossy();
+                    file_name.starts_with(checkpoint_prefix.as_str()) && file_name.ends_with(AUTOSAVE_CHECKPOINT_EXTENSION)
+                }).unwrap_or(false))
+                .collect();
+            // the timestamps sort in date order
+            checkpoint_paths.sort();
+
+            let number_to_remove = checkpoint_paths.len().saturating_sub(AUTOSAVE_CHECKPOINTS_KEPT);
+            for checkpoint_path in checkpoint_paths.iter().take(number_to_remove) {
+                info!("Autosave: removing old checkpoint: {:?}", checkpoint_path);
+                let _ = std::fs::remove_file(checkpoint_path);
+                let _ = std::fs::remove_file(Autosaver::journal_path(checkpoint_path));
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use crate::autosave::Autosaver;
+    use crate::domain::Project;
+
+    #[test]
+    fn autosave_journals_changes_and_recovers_them() {
+        let directory = std::env::temp_dir().join(format!("riff_daw_autosave_test_{}", std::process::id()));
+        let _ = std::fs::create_dir_all(&directory);
+        let project_path = directory.join("song.fdaw").to_str().unwrap().to_string();
+        let mut project: Project = serde_json::from_str(include_str!("../test_data/test.fdaw")).unwrap();
+        let mut autosaver = Autosaver::new();
+
+        autosaver.autosave(Some(project_path.clone()), &project).unwrap();
+        let checkpoint_path = autosaver.checkpoint_path.clone().unwrap();
+        let checkpoint_length = std::fs::metadata(&checkpoint_path).unwrap().len();
+
+        project.song_mut().set_tempo(97.0);
+        autosaver.autosave(Some(project_path.clone()), &project).unwrap();
+        // unchanged - nothing is written
+        autosaver.autosave(Some(project_path), &project).unwrap();
+
+        let journal_length = std::fs::metadata(Autosaver::journal_path(&checkpoint_path)).unwrap().len();
+        let recovered = Autosaver::recover(checkpoint_path.to_str().unwrap()).unwrap();
+        let _ = std::fs::remove_dir_all(&directory);
+
+        assert_eq!(1, autosaver.journal_entries);
+        assert!(journal_length < checkpoint_length);
+        assert_eq!(serde_json::to_value(&project).unwrap(), serde_json::to_value(&recovered).unwrap());
+    }
+
+    #[test]
+    fn checkpoint_maps_back_to_its_project() {
+        assert_eq!(Some("/songs/song.fdaw".to_string()), Autosaver::project_path_for_checkpoint("/songs/song.fdaw_checkpoint_20240101120000.fdaw.xz"));
+        assert_eq!(Some("/songs/song.fdaw".to_string()), Autosaver::project_path_for_checkpoint("/songs/song.fdaw_checkpoint_20240101120000.fdaw.xz_checkpoint_20240101130000.fdaw.xz"));
+        assert_eq!(None, Autosaver::project_path_for_checkpoint("/songs/song.fdaw"));
+    }
+}
@@ -0,0 +1,337 @@
+use std::f64::consts::TAU;
+use std::sync::mpsc::{channel, Receiver};
+
+use uuid::Uuid;
+use vst::buffer::AudioBuffer;
+
+use crate::constants::{BUILT_IN_PLUGIN_MAX_EVENTS, BUILT_IN_TEST_EFFECT, BUILT_IN_TEST_INSTRUMENT};
+use crate::domain::{BackgroundProcessorAudioPlugin, DAWItemPosition, TrackEvent};
+use crate::event::AudioPluginHostOutwardEvent;
+
+const TEST_INSTRUMENT_VOICES: usize = 16;
+const TEST_INSTRUMENT_RELEASE_IN_SECONDS: f64 = 0.05;
+const TEST_EFFECT_CUTOFF_IN_HZ: f64 = 2000.0;
+
+#[derive(Clone, Copy, Default)]
+struct TestInstrumentVoice {
+    note: i32,
+    phase: f64,       // 0.0 to 1.0
+    phase_step: f64,  // per frame
+    level: f32,       // peak level from the note on velocity
+    envelope: f32,    // 0.0 to 1.0
+    releasing: bool,
+    active: bool,
+}
+
+/// A small polyphonic sine synth built into the DAW so that the render path can be driven, measured and checked without
+/// any third party plugins. Plays the note on and note off events of a block - positions are frames within the block.
+/// Never allocates after it is created.
+pub struct TestInstrument {
+    sample_rate: f64,
+    voices: [TestInstrumentVoice; TEST_INSTRUMENT_VOICES],
+}
+
+impl TestInstrument {
+    pub fn new(sample_rate: f64) -> Self {
+        Self {
+            sample_rate,
+            voices: [TestInstrumentVoice::default(); TEST_INSTRUMENT_VOICES],
+        }
+    }
+
+    pub fn active_voices(&self) -> usize {
+        self.voices.iter().filter(|voice| voice.active).count()
+    }
+
+    /// Replace the contents of left and right with the block's audio. Events before the frame already reached are
+    /// played from there.
+    pub fn process(&mut self, events: &[TrackEvent], left: &mut [f32], right: &mut [f32]) {
+        let frames = left.len().min(right.len());
+        left[..frames].fill(0.0);
+        right[..frames].fill(0.0);
+
+        let mut start = 0;
+        for event in events.iter() {
+            let event_frame = (event.position().max(0.0) as usize).min(frames);
+            if event_frame > start {
+                self.render(&mut left[start..event_frame], &mut right[start..event_frame]);
+                start = event_frame;
+            }
+            match event {
+                TrackEvent::NoteOn(note_on) => self.note_on(note_on.note(), note_on.velocity()),
+                TrackEvent::NoteOff(note_off) => self.note_off(note_off.note()),
+                _ => (),
+            }
+        }
+        if frames > start {
+            self.render(&mut left[start..frames], &mut right[start..frames]);
+        }
+    }
+
+    fn note_on(&mut self, note: i32, velocity: i32) {
+        // take a free voice or steal the quietest
+        let voice_index = match self.voices.iter().position(|voice| !voice.active) {
+            Some(voice_index) => voice_index,
+            None => self.voices.iter().enumerate()
+                .min_by(|(_, a), (_, b)| (a.level * a.envelope).partial_cmp(&(b.level * b.envelope)).unwrap_or(std::cmp::Ordering::Equal))
+                .map_or(0, |(voice_index, _)| voice_index),
+        };
+        let frequency = 440.0 * 2.0_f64.powf((note as f64 - 69.0) / 12.0);
+        self.voices[voice_index] = TestInstrumentVoice {
+            note,
+            phase: 0.0,
+            phase_step: frequency / self.sample_rate,
+            level: velocity.clamp(0, 127) as f32 / 127.0 * 0.25,
+            envelope: 1.0,
+            releasing: false,
+            active: true,
+        };
+    }
+
+    fn note_off(&mut self, note: i32) {
+        for voice in self.voices.iter_mut().filter(|voice| voice.active && !voice.releasing && voice.note == note) {
+            voice.releasing = true;
+        }
+    }
+
+    fn stop_all_notes(&mut self) {
+        for voice in self.voices.iter_mut() {
+            voice.active = false;
+        }
+    }
+
+    fn render(&mut self, left: &mut [f32], right: &mut [f32]) {
+        let release_step = (1.0 / (TEST_INSTRUMENT_RELEASE_IN_SECONDS * self.sample_rate)) as f32;
+        for voice in self.voices.iter_mut().filter(|voice| voice.active) {
+            for (left, right) in left.iter_mut().zip(right.iter_mut()) {
+                let sample = (voice.phase * TAU).sin() as f32 * voice.level * voice.envelope;
+                *left += sample;
+                *right += sample;
+                voice.phase = (voice.phase + voice.phase_step).fract();
+                if voice.releasing {
+                    voice.envelope -= release_step;
+                    if voice.envelope <= 0.0 {
+                        voice.active = false;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+}
+
+/// A one pole low pass filter built into the DAW to stand in for an effect plugin alongside the test instrument.
+pub struct TestEffect {
+    coefficient: f32,
+    previous: [f32; 2], // left, right
+}
+
+impl TestEffect {
+    pub fn new(sample_rate: f64) -> Self {
+        let mut test_effect = Self { coefficient: 0.0, previous: [0.0; 2] };
+        test_effect.set_sample_rate(sample_rate);
+        test_effect
+    }
+
+    fn set_sample_rate(&mut self, sample_rate: f64) {
+        self.coefficient = (1.0 - (-TAU * TEST_EFFECT_CUTOFF_IN_HZ / sample_rate.max(1.0)).exp()) as f32;
+    }
+
+    /// Filter the input channels into the output channels.
+    pub fn process(&mut self, left_in: &[f32], right_in: &[f32], left_out: &mut [f32], right_out: &mut [f32]) {
+        for (channel, (input, output)) in [(left_in, left_out), (right_in, right_out)].into_iter().enumerate() {
+            let mut previous = self.previous[channel];
+            for (input, output) in input.iter().zip(output.iter_mut()) {
+                previous += (input - previous) * self.coefficient;
+                *output = previous;
+            }
+            self.previous[channel] = previous;
+        }
+    }
+}
+
+pub enum BuiltInAudioPlugin {
+    TestInstrument(TestInstrument),
+    TestEffect(TestEffect),
+}
+
+/// A track's handle on one of the plugins built into the DAW - picked by library path with the BUILT_IN plugin type.
+/// They have no editor, parameters or presets and run in process so they can't be sandboxed.
+pub struct BackgroundProcessorBuiltInAudioPlugin {
+    uuid: Uuid,
+    name: String,
+    plugin: BuiltInAudioPlugin,
+    events: Vec<TrackEvent>, // queued for the next block
+    xid: Option<u32>,
+    rx_from_host: Receiver<AudioPluginHostOutwardEvent>,
+    tempo: f64,
+    sample_rate: f64,
+}
+
+impl BackgroundProcessorBuiltInAudioPlugin {
+    /// None if there is no built in plugin with the library path.
+    pub fn new_with_uuid(uuid: Uuid, library_path: &str, sample_rate: f64) -> Option<Self> {
+        let plugin = match library_path {
+            BUILT_IN_TEST_INSTRUMENT => BuiltInAudioPlugin::TestInstrument(TestInstrument::new(sample_rate)),
+            BUILT_IN_TEST_EFFECT => BuiltInAudioPlugin::TestEffect(TestEffect::new(sample_rate)),
+            _ => return None,
+        };
+        // nothing is ever sent from a built in plugin
+        let (_, rx_from_host) = channel::<AudioPluginHostOutwardEvent>();
+
+        Some(Self {
+            uuid,
+            name: library_path.to_string(),
+            plugin,
+            events: Vec::with_capacity(BUILT_IN_PLUGIN_MAX_EVENTS),
+            xid: None,
+            rx_from_host,
+            tempo: 140.0,
+            sample_rate,
+        })
+    }
+
+    /// Queue events for the next block - any beyond BUILT_IN_PLUGIN_MAX_EVENTS are dropped rather than allocate.
+    pub fn process_events(&mut self, events: &[TrackEvent]) {
+        let room = self.events.capacity() - self.events.len();
+        self.events.extend_from_slice(&events[..events.len().min(room)]);
+    }
+
+    pub fn process(&mut self, audio_buffer: &mut AudioBuffer<f32>) {
+        let (inputs, outputs) = audio_buffer.split();
+        if outputs.len() < 2 {
+            self.events.clear();
+            return;
+        }
+        let (mut left_outputs, mut right_outputs) = outputs.split_at_mut(1);
+        match &mut self.plugin {
+            BuiltInAudioPlugin::TestInstrument(test_instrument) => test_instrument.process(self.events.as_slice(), left_outputs.get_mut(0), right_outputs.get_mut(0)),
+            BuiltInAudioPlugin::TestEffect(test_effect) => if inputs.len() >= 2 {
+                test_effect.process(inputs.get(0), inputs.get(1), left_outputs.get_mut(0), right_outputs.get_mut(0));
+            },
+        }
+        self.events.clear();
+    }
+}
+
+impl BackgroundProcessorAudioPlugin for BackgroundProcessorBuiltInAudioPlugin {
+    fn uuid(&self) -> Uuid {
+        self.uuid
+    }
+
+    fn uuid_mut(&mut self) -> Uuid {
+        self.uuid
+    }
+
+    fn name(&self) -> String {
+        self.name.clone()
+    }
+
+    fn xid(&self) -> Option<u32> {
+        self.xid
+    }
+
+    fn set_xid(&mut self, xid: Option<u32>) {
+        self.xid = xid;
+    }
+
+    fn xid_mut(&mut self) -> &mut Option<u32> {
+        &mut self.xid
+    }
+
+    fn get_window_size(&self) -> (i32, i32) {
+        (0, 0)
+    }
+
+    fn rx_from_host(&self) -> &Receiver<AudioPluginHostOutwardEvent> {
+        &self.rx_from_host
+    }
+
+    fn rx_from_host_mut(&mut self) -> &mut Receiver<AudioPluginHostOutwardEvent> {
+        &mut self.rx_from_host
+    }
+
+    fn set_tempo(&mut self, tempo: f64) {
+        self.tempo = tempo;
+    }
+
+    fn tempo(&self) -> f64 {
+        self.tempo
+    }
+
+    fn stop_processing(&mut self) {
+        self.events.clear();
+        if let BuiltInAudioPlugin::TestInstrument(test_instrument) = &mut self.plugin {
+            test_instrument.stop_all_notes();
+        }
+    }
+
+    fn shutdown(&mut self) {
+        self.stop_processing();
+    }
+
+    fn preset_data(&mut self) -> String {
+        String::new()
+    }
+
+    fn set_preset_data(&mut self, _data: String) {}
+
+    fn sample_rate(&self) -> f64 {
+        self.sample_rate
+    }
+
+    fn set_sample_rate(&mut self, sample_rate: f64) {
+        self.sample_rate = sample_rate;
+        match &mut self.plugin {
+            BuiltInAudioPlugin::TestInstrument(test_instrument) => test_instrument.sample_rate = sample_rate,
+            BuiltInAudioPlugin::TestEffect(test_effect) => test_effect.set_sample_rate(sample_rate),
+        }
+    }
+
+    fn set_audio_format(&mut self, _block_size: usize, sample_rate: f64) {
+        self.set_sample_rate(sample_rate);
+    }
+
+    fn latency(&self) -> usize {
+        0
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use crate::built_in_plugin::{TestEffect, TestInstrument};
+    use crate::domain::{NoteOff, NoteOn, TrackEvent};
+
+    #[test]
+    fn plays_from_the_note_on_frame_and_releases_after_the_note_off() {
+        let mut test_instrument = TestInstrument::new(44100.0);
+        let mut left = vec![1.0; 1024];
+        let mut right = vec![1.0; 1024];
+
+        test_instrument.process(&[TrackEvent::NoteOn(NoteOn::new_with_params(512.0, 69, 127))], &mut left, &mut right);
+        assert!(left[..512].iter().all(|sample| *sample == 0.0));
+        assert!(left[512..].iter().any(|sample| *sample != 0.0));
+        assert_eq!(left, right);
+        assert_eq!(1, test_instrument.active_voices());
+
+        test_instrument.process(&[TrackEvent::NoteOff(NoteOff::new_with_params(0.0, 69, 0))], &mut left, &mut right);
+        for _ in 0..4 {
+            test_instrument.process(&[], &mut left, &mut right);
+        }
+        assert_eq!(0, test_instrument.active_voices());
+        assert!(left.iter().all(|sample| *sample == 0.0));
+    }
+
+    #[test]
+    fn test_effect_passes_low_frequencies_and_settles_on_a_constant_input() {
+        let mut test_effect = TestEffect::new(44100.0);
+        let input = vec![0.5_f32; 4096];
+        let mut left = vec![0.0; 4096];
+        let mut right = vec![0.0; 4096];
+
+        test_effect.process(&input, &input, &mut left, &mut right);
+        assert!(left[0] > 0.0 && left[0] < 0.5);
+        assert!((left[4095] - 0.5).abs() < 0.001);
+        assert_eq!(left, right);
+    }
+}
@@ -6,6 +6,26 @@ pub const VST_PATH_ENVIRONMENT_VARIABLE_NAME: &str = "VST_PATH";
 pub const CLAP: &str = "CLAP";
 pub const CLAP_CHECKER_EXECUTABLE_NAME: &str = "clap_checker";
 pub const CLAP_PATH_ENVIRONMENT_VARIABLE_NAME: &str = "CLAP_PATH";
+// plugins built into the DAW - the plugin type and the library path naming each of them
+pub const BUILT_IN: &str = "BUILTIN";
+pub const BUILT_IN_TEST_INSTRUMENT: &str = "riff-daw test instrument";
+pub const BUILT_IN_TEST_EFFECT: &str = "riff-daw test effect";
+pub const BUILT_IN_PLUGIN_MAX_EVENTS: usize = 1024; // per block
+// plugin checkers run in parallel and a checker that hangs is killed
+pub const PLUGIN_SCAN_MAX_PARALLEL_CHECKERS: usize = 8;
+pub const PLUGIN_SCAN_TIMEOUT_IN_SECONDS: u64 = 30;
+pub const PLUGIN_SCAN_THREAD_NAME: &str = "DAW plugin scanner";
+// sandboxed plugins run in a child process - this executable started with this argument or a bridge host
+pub const PLUGIN_SANDBOX_ARGUMENT: &str = "--plugin-sandbox";
+pub const PLUGIN_SANDBOX_ACCEPT_THREAD_NAME: &str = "DAW plugin sandbox accept";
+pub const PLUGIN_SANDBOX_INPUT_CHANNELS: usize = 4; // main and side chain stereo pairs
+pub const PLUGIN_SANDBOX_OUTPUT_CHANNELS: usize = 2;
+pub const PLUGIN_SANDBOX_MAX_MIDI_EVENTS: usize = 1024;
+pub const PLUGIN_SANDBOX_MAX_PARAMETER_CHANGES: usize = 1024;
+// a sandbox that takes longer than this over a block is treated as hung and the plugin is silenced
+pub const PLUGIN_SANDBOX_BLOCK_TIMEOUT_IN_MILLISECONDS: u64 = 250;
+pub const PLUGIN_SANDBOX_REQUEST_TIMEOUT_IN_SECONDS: u64 = 10;
+pub const PLUGIN_SANDBOX_IDLE_INTERVAL_IN_MILLISECONDS: u64 = 5;
 
 pub const TRACK_VIEW_TRACK_PANEL_HEIGHT: i32 = 19;
 pub const RIFF_SET_VIEW_TRACK_PANEL_HEIGHT: i32 = 51;
@@ -18,6 +38,73 @@ pub const CONFIGURATION_FILE_NAME: &str = "riff-daw.conf";
 
 
 pub const LUA_GLOBAL_STATE: &str = "state";
+pub const LUA_SCRIPT_THREAD_NAME: &str = "DAW lua script runner";
 
 pub const DAW_AUTO_SAVE_THREAD_NAME: &str = "DAW autosave";
+pub const STEM_WRITER_THREAD_NAME: &str = "DAW stem writer";
+pub const SAMPLE_STREAMER_THREAD_NAME: &str = "DAW sample streamer";
+pub const WAVEFORM_PEAK_BUILDER_THREAD_NAME: &str = "DAW waveform peak builder";
 
+// jack drives the actual block size and sample rate - these are only used until it reports them
+pub const DEFAULT_BLOCK_SIZE: usize = 1024;
+pub const DEFAULT_SAMPLE_RATE: f64 = 44100.0;
+pub const MAX_BLOCK_SIZE: usize = 4096;
+// room for a block being read by jack and the next one being written
+pub const TRACK_RING_BUFFER_CAPACITY: usize = MAX_BLOCK_SIZE * 2;
+// an offline render reads each track's block as soon as the cycle that processed it has finished
+pub const TRACK_RENDER_RING_BUFFER_CAPACITY: usize = MAX_BLOCK_SIZE * 2;
+// live midi written by the jack process callback straight into the selected track - (frame within the period, midi bytes)
+pub const LIVE_MIDI_RING_BUFFER_CAPACITY: usize = 256;
+// blocks kept on a track's audio bus - the block a routed track is reading, the one after it and one being written
+pub const AUDIO_BUS_BLOCKS: usize = 3;
+
+
+pub const AUDIO_LAYER_COMMAND_QUEUE_CAPACITY: usize = 1024;
+pub const AUDIO_LAYER_RETIRED_ITEM_QUEUE_CAPACITY: usize = 1024;
+pub const AUDIO_LAYER_COMMANDS_PER_CYCLE: usize = 64;
+pub const AUDIO_LAYER_RETIRED_ITEM_DROP_THREAD_NAME: &str = "DAW audio retired item drop";
+
+pub const TRACK_PROCESSING_COORDINATOR_THREAD_NAME: &str = "DAW track processing coordinator";
+pub const TRACK_PROCESSING_WORKER_THREAD_NAME: &str = "DAW track processing worker";
+pub const TRACK_PROCESSING_WORKER_COMMAND_QUEUE_CAPACITY: usize = 1024;
+
+pub const AUTOSAVE_INTERVAL_IN_SECONDS: u64 = 300;
+pub const AUTOSAVE_PRESET_DATA_WAIT_IN_SECONDS: u64 = 2;
+
+// automation is thinned to one change per parameter in each sub block and vst24 plugins are only split at sub block boundaries
+pub const AUTOMATION_SUB_BLOCK_FRAMES: usize = 32;
+pub const AUTOMATION_RAMP_FRAMES: usize = 128;
+
+pub const GUI_PUMP_WATCHER_THREAD_NAME: &str = "DAW gui pump watcher";
+// play position and level meter updates are applied at most this often - roughly the display refresh rate
+pub const GUI_REFRESH_INTERVAL_IN_MILLISECONDS: u64 = 16;
+// the watcher picks up added and removed tracks at least this often
+pub const GUI_PUMP_WATCH_REFRESH_INTERVAL_IN_MILLISECONDS: u64 = 250;
+// hand back to gtk after this many events so that drawing keeps up while events are flooding in
+pub const GUI_PUMP_MAX_EVENTS_PER_WAKE: usize = 256;
+pub const PROGRESS_BAR_PULSE_INTERVAL_IN_MILLISECONDS: u64 = 100;
+
+// cached grid layers cover this much more than the visible part of the canvas so that small scrolls don't redraw them
+pub const GRID_LAYER_CACHE_MARGIN_IN_PIXELS: f64 = 256.0;
+
+// undo history is evicted oldest first once the recorded edits take up more than this
+pub const HISTORY_MEMORY_CAP_IN_BYTES: usize = 16 * 1024 * 1024;
+// repeated nudges and drags of the same notes within this long of each other are undone as one edit
+pub const HISTORY_COALESCE_INTERVAL_IN_MILLISECONDS: u64 = 1000;
+
+pub const PLAYBACK_SCHEDULE_COMPILER_THREAD_NAME: &str = "DAW playback schedule compiler";
+// riff sequences and arrangements are laid out in a passage this long - also what a missing riff set plays for
+pub const RIFF_SEQUENCE_LENGTH_IN_BEATS: f64 = 400.0;
+
+pub const TELEMETRY_EXPORT_THREAD_NAME: &str = "DAW telemetry export";
+// the dsp load shown in the mixer blades is refreshed this often - slow enough to read
+pub const MIXER_BLADE_TELEMETRY_REFRESH_INTERVAL_IN_MILLISECONDS: u64 = 500;
+
+// started with this argument to render projects to wave files without the gui or jack - see headless.rs
+pub const HEADLESS_RENDER_ARGUMENT: &str = "render";
+pub const HEADLESS_RENDER_THREAD_NAME: &str = "DAW headless render";
+pub const HEADLESS_AUDIO_BACKEND_THREAD_NAME: &str = "DAW headless audio backend";
+// the stand in for jack wakes the track processing scheduler this often - much faster than a jack period
+pub const HEADLESS_AUDIO_BACKEND_WAKE_INTERVAL_IN_MILLISECONDS: u64 = 1;
+// how long the tracks of a loaded project have to load their plugins before the render starts anyway
+pub const HEADLESS_RENDER_TRACK_READY_TIMEOUT_IN_SECONDS: u64 = 60;
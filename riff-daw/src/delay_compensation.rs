@@ -0,0 +1,329 @@
+use std::collections::{HashMap, HashSet};
+
+use crate::domain::{AudioRouting, AudioRoutingNodeType};
+use crate::dsp;
+
+/// The latency in frames reported by a track's plugins.
+#[derive(Clone, PartialEq, Eq, Default, Debug)]
+pub struct TrackPluginLatency {
+    pub instrument: usize,
+    pub effects: Vec<(String, usize)>, // effect uuid, latency - in processing order
+}
+
+impl TrackPluginLatency {
+    pub fn total(&self) -> usize {
+        self.instrument + self.effects.iter().map(|(_, latency)| *latency).sum::<usize>()
+    }
+}
+
+/// The delays a track applies so that everything lines up:
+///  - input delay: after the instrument (or the routed track input) so that audio routed into effects is not early
+///  - output delay: on the way to the master bus so that all tracks end up with the same overall latency
+///  - routing delays: on audio routed into the track that would otherwise arrive early
+#[derive(Clone, PartialEq, Eq, Default, Debug)]
+pub struct TrackDelayCompensation {
+    pub input_delay: usize,
+    pub output_delay: usize,
+    pub routing_delays: HashMap<String, usize>, // audio routing uuid, delay
+}
+
+/// Works out the delay compensation for every track from the plugin latencies summed along the audio routings.
+/// Returns the overall latency (the latency of the longest path to the master bus) and each track's compensation.
+pub fn calculate_delay_compensation(
+    track_uuids: &[String],
+    track_plugin_latencies: &HashMap<String, TrackPluginLatency>,
+    audio_routings: &[AudioRouting],
+) -> (usize, HashMap<String, TrackDelayCompensation>) {
+    let mut calculator = DelayCompensationCalculator {
+        track_plugin_latencies,
+        inward_routings: HashMap::new(),
+        track_latencies: HashMap::new(),
+        track_delay_compensation: HashMap::new(),
+        visiting: HashSet::new(),
+    };
+    for audio_routing in audio_routings.iter() {
+        calculator.inward_routings.entry(routing_node_track_uuid(&audio_routing.destination).to_string()).or_insert_with(Vec::new).push(audio_routing);
+    }
+
+    let track_latencies: Vec<usize> = track_uuids.iter().map(|track_uuid| calculator.track_latency(track_uuid)).collect();
+    let latency = track_latencies.iter().copied().max().unwrap_or(0);
+    let mut track_delay_compensation = calculator.track_delay_compensation;
+    for (track_uuid, track_latency) in track_uuids.iter().zip(track_latencies.iter()) {
+        if let Some(compensation) = track_delay_compensation.get_mut(track_uuid) {
+            compensation.output_delay = latency - *track_latency;
+        }
+    }
+    track_delay_compensation.retain(|track_uuid, _| track_uuids.contains(track_uuid));
+
+    (latency, track_delay_compensation)
+}
+
+struct DelayCompensationCalculator<'a> {
+    track_plugin_latencies: &'a HashMap<String, TrackPluginLatency>,
+    inward_routings: HashMap<String, Vec<&'a AudioRouting>>,
+    track_latencies: HashMap<String, usize>,
+    track_delay_compensation: HashMap<String, TrackDelayCompensation>,
+    visiting: HashSet<String>,
+}
+
+impl<'a> DelayCompensationCalculator<'a> {
+    /// The latency of the track's output including everything routed into it.
+    fn track_latency(&mut self, track_uuid: &str) -> usize {
+        if let Some(track_latency) = self.track_latencies.get(track_uuid) {
+            return *track_latency;
+        }
+        // a routing cycle - it can't be compensated so don't let it add anything
+        if !self.visiting.insert(track_uuid.to_string()) {
+            return 0;
+        }
+
+        let plugin_latency = self.track_plugin_latencies.get(track_uuid).cloned().unwrap_or_default();
+        let inward_routings = self.inward_routings.get(track_uuid).cloned().unwrap_or_default();
+        let mut track_inputs = vec![];  // routing uuid, source latency
+        let mut effect_inputs = vec![]; // routing uuid, latency of the track's own audio before the effect, source latency
+
+        for audio_routing in inward_routings.into_iter() {
+            let source_latency = self.track_latency(routing_node_track_uuid(&audio_routing.source));
+            match &audio_routing.destination {
+                AudioRoutingNodeType::Track(_) => track_inputs.push((audio_routing.uuid(), source_latency)),
+                AudioRoutingNodeType::Effect(_, effect_uuid, _, _) => {
+                    if let Some(position) = plugin_latency.effects.iter().position(|(uuid, _)| uuid == effect_uuid) {
+                        let latency_before_effect = plugin_latency.effects[..position].iter().map(|(_, latency)| *latency).sum::<usize>();
+                        effect_inputs.push((audio_routing.uuid(), latency_before_effect, source_latency));
+                    }
+                }
+                AudioRoutingNodeType::Instrument(_, _, _, _) => (), // not processed
+            }
+        }
+
+        let track_input_latency = track_inputs.iter().map(|(_, source_latency)| *source_latency).max().unwrap_or(0);
+        let instrument_output_latency = track_input_latency + plugin_latency.instrument;
+        let input_delay = effect_inputs.iter()
+            .map(|(_, latency_before_effect, source_latency)| source_latency.saturating_sub(instrument_output_latency + latency_before_effect))
+            .max()
+            .unwrap_or(0);
+
+        let mut routing_delays = HashMap::new();
+        for (routing_uuid, source_latency) in track_inputs.into_iter() {
+            routing_delays.insert(routing_uuid, track_input_latency - source_latency);
+        }
+        for (routing_uuid, latency_before_effect, source_latency) in effect_inputs.into_iter() {
+            routing_delays.insert(routing_uuid, instrument_output_latency + input_delay + latency_before_effect - source_latency);
+        }
+
+        let track_latency = instrument_output_latency + input_delay + (plugin_latency.total() - plugin_latency.instrument);
+        self.track_latencies.insert(track_uuid.to_string(), track_latency);
+        self.track_delay_compensation.insert(track_uuid.to_string(), TrackDelayCompensation { input_delay, output_delay: 0, routing_delays });
+        self.visiting.remove(track_uuid);
+
+        track_latency
+    }
+}
+
+fn routing_node_track_uuid(routing_node: &AudioRoutingNodeType) -> &str {
+    match routing_node {
+        AudioRoutingNodeType::Track(track_uuid) => track_uuid,
+        AudioRoutingNodeType::Instrument(track_uuid, _, _, _) => track_uuid,
+        AudioRoutingNodeType::Effect(track_uuid, _, _, _) => track_uuid,
+    }
+}
+
+/// A fixed delay. The buffer is allocated when the delay is set so processing never allocates.
+#[derive(Default)]
+pub struct DelayLine {
+    buffer: Vec<f32>,
+    position: usize,
+}
+
+impl DelayLine {
+    pub fn new(delay: usize) -> Self {
+        Self {
+            buffer: vec![0.0; delay],
+            position: 0,
+        }
+    }
+
+    /// Allocates if the delay changes - not for a track's worker.
+    pub fn set_delay(&mut self, delay: usize) {
+        if delay != self.buffer.len() {
+            self.buffer = vec![0.0; delay];
+            self.position = 0;
+        }
+    }
+
+    pub fn delay(&self) -> usize {
+        self.buffer.len()
+    }
+
+    /// Delay the block in place.
+    pub fn process(&mut self, block: &mut [f32]) {
+        let delay = self.buffer.len();
+        if delay == 0 {
+            return;
+        }
+
+        let mut offset = 0;
+        while offset < block.len() {
+            let run = (block.len() - offset).min(delay - self.position);
+            block[offset..offset + run].swap_with_slice(&mut self.buffer[self.position..self.position + run]);
+            offset += run;
+            self.position += run;
+            if self.position == delay {
+                self.position = 0;
+            }
+        }
+    }
+
+    /// Delay the source and sum it into the destination - the source is left as it is.
+    pub fn process_accumulate(&mut self, source: &[f32], destination: &mut [f32]) {
+        let frames = source.len().min(destination.len());
+        let delay = self.buffer.len();
+        if delay == 0 {
+            dsp::mix_accumulate(&mut destination[..frames], &source[..frames], 1.0);
+            return;
+        }
+
+        let mut offset = 0;
+        while offset < frames {
+            let run = (frames - offset).min(delay - self.position);
+            dsp::mix_accumulate(&mut destination[offset..offset + run], &self.buffer[self.position..self.position + run], 1.0);
+            self.buffer[self.position..self.position + run].copy_from_slice(&source[offset..offset + run]);
+            offset += run;
+            self.position += run;
+            if self.position == delay {
+                self.position = 0;
+            }
+        }
+    }
+}
+
+#[derive(Default)]
+pub struct StereoDelayLine {
+    pub left: DelayLine,
+    pub right: DelayLine,
+}
+
+impl StereoDelayLine {
+    pub fn new(delay: usize) -> Self {
+        Self {
+            left: DelayLine::new(delay),
+            right: DelayLine::new(delay),
+        }
+    }
+
+    /// Allocates if the delay changes - not for a track's worker.
+    pub fn set_delay(&mut self, delay: usize) {
+        self.left.set_delay(delay);
+        self.right.set_delay(delay);
+    }
+
+    pub fn delay(&self) -> usize {
+        self.left.delay()
+    }
+}
+
+/// The delay lines for a track's delay compensation.
+#[derive(Default)]
+pub struct TrackDelayCompensator {
+    pub input: StereoDelayLine,
+    pub output: StereoDelayLine,
+    pub routings: HashMap<String, StereoDelayLine>, // audio routing uuid
+}
+
+impl TrackDelayCompensator {
+    /// The delay lines for the compensation - built on the gui side and sent to the track as building them allocates.
+    pub fn new(track_delay_compensation: &TrackDelayCompensation) -> Self {
+        Self {
+            input: StereoDelayLine::new(track_delay_compensation.input_delay),
+            output: StereoDelayLine::new(track_delay_compensation.output_delay),
+            routings: track_delay_compensation.routing_delays.iter()
+                .map(|(routing_uuid, delay)| (routing_uuid.clone(), StereoDelayLine::new(*delay)))
+                .collect(),
+        }
+    }
+
+    /// Switch to the replacement's delay lines and return the ones replaced. Delay lines whose delay has not changed are
+    /// kept so that the audio in them carries on. Does not allocate or free - drop what is returned off the track's worker.
+    pub fn replace(&mut self, mut replacement: TrackDelayCompensator) -> TrackDelayCompensator {
+        if replacement.input.delay() == self.input.delay() {
+            std::mem::swap(&mut replacement.input, &mut self.input);
+        }
+        if replacement.output.delay() == self.output.delay() {
+            std::mem::swap(&mut replacement.output, &mut self.output);
+        }
+        for (routing_uuid, delay_line) in replacement.routings.iter_mut() {
+            if let Some(current_delay_line) = self.routings.get_mut(routing_uuid) {
+                if current_delay_line.delay() == delay_line.delay() {
+                    std::mem::swap(current_delay_line, delay_line);
+                }
+            }
+        }
+        std::mem::replace(self, replacement)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::collections::HashMap;
+
+    use crate::delay_compensation::{calculate_delay_compensation, DelayLine, TrackDelayCompensation, TrackDelayCompensator, TrackPluginLatency};
+    use crate::domain::{AudioRouting, AudioRoutingNodeType};
+
+    #[test]
+    fn delay_line_delays_across_blocks() {
+        let mut delay_line = DelayLine::default();
+        delay_line.set_delay(3);
+
+        let mut first_block = [1.0, 2.0, 3.0, 4.0, 5.0];
+        let mut second_block = [6.0, 7.0];
+        delay_line.process(&mut first_block);
+        delay_line.process(&mut second_block);
+
+        assert_eq!([0.0, 0.0, 0.0, 1.0, 2.0], first_block);
+        assert_eq!([3.0, 4.0], second_block);
+    }
+
+    #[test]
+    fn replacing_the_delay_lines_keeps_the_audio_in_the_unchanged_ones() {
+        let mut track_delay_compensation = TrackDelayCompensation { input_delay: 2, output_delay: 1, routing_delays: HashMap::new() };
+        let mut compensator = TrackDelayCompensator::new(&track_delay_compensation);
+        let mut block = [1.0, 2.0];
+        compensator.input.left.process(&mut block);
+
+        track_delay_compensation.output_delay = 3;
+        track_delay_compensation.routing_delays.insert("side chain".to_string(), 4);
+        let replaced = compensator.replace(TrackDelayCompensator::new(&track_delay_compensation));
+
+        let mut block = [0.0, 0.0];
+        compensator.input.left.process(&mut block);
+        assert_eq!([1.0, 2.0], block);
+        assert_eq!(3, compensator.output.delay());
+        assert_eq!(Some(4), compensator.routings.get("side chain").map(|delay_line| delay_line.delay()));
+        assert_eq!(1, replaced.output.delay());
+    }
+
+    #[test]
+    fn shorter_paths_are_delayed_to_match_the_longest() {
+        let track_uuids = vec!["lead".to_string(), "drums".to_string(), "bass".to_string()];
+        let mut track_plugin_latencies = HashMap::new();
+        // lead has a 64 frame look ahead compressor after a 16 frame effect
+        track_plugin_latencies.insert("lead".to_string(), TrackPluginLatency { instrument: 0, effects: vec![("eq".to_string(), 16), ("compressor".to_string(), 64)] });
+        // drums have a 256 frame linear phase eq and are routed into the lead compressor's side chain
+        track_plugin_latencies.insert("drums".to_string(), TrackPluginLatency { instrument: 0, effects: vec![("linear phase eq".to_string(), 256)] });
+        let side_chain = AudioRouting::new(
+            "side chain".to_string(),
+            AudioRoutingNodeType::Track("drums".to_string()),
+            AudioRoutingNodeType::Effect("lead".to_string(), "compressor".to_string(), 2, 3),
+        );
+
+        let (latency, track_delay_compensation) = calculate_delay_compensation(&track_uuids, &track_plugin_latencies, &[side_chain.clone()]);
+
+        // the lead is held back after its instrument so its audio reaches the compressor with the drums
+        assert_eq!(256 - 16, track_delay_compensation["lead"].input_delay);
+        assert_eq!(0, track_delay_compensation["lead"].routing_delays[&side_chain.uuid()]);
+        assert_eq!(256 + 64, latency);
+        assert_eq!(0, track_delay_compensation["lead"].output_delay);
+        assert_eq!(64, track_delay_compensation["drums"].output_delay);
+        assert_eq!(latency, track_delay_compensation["bass"].output_delay);
+    }
+}
@@ -1,23 +1,19 @@
-use std::{collections::HashMap, sync::{Arc, mpsc::{channel, Receiver, Sender}, Mutex}, time::Duration};
+use std::{collections::HashMap, sync::{Arc, atomic::AtomicU64, mpsc::{channel, Receiver, Sender}, Mutex, OnceLock}, time::{Duration, Instant}};
 use std::default::Default;
 use std::io::prelude::*;
-use std::thread;
 
-use clap_sys::{ext::{gui::{clap_window, CLAP_WINDOW_API_X11, clap_window_handle}}, process::clap_process};
+use clap_sys::{ext::{gui::{clap_window, CLAP_WINDOW_API_X11, clap_window_handle}, latency::{CLAP_EXT_LATENCY, clap_plugin_latency}}, process::clap_process};
 use jack::{MidiOut, Port};
 use log::*;
 use mlua::prelude::LuaUserData;
-use rb::{Consumer, Producer, RB, RbConsumer, RbProducer, SpscRb};
-use samplerate_rs::{convert, ConverterType};
+use rb::{Consumer, Producer, RB, RbConsumer, RbInspector, RbProducer, SpscRb};
 use serde::{Deserialize, Serialize};
 use simple_clap_host_helper_lib::{host::DAWCallback, plugin::{ext::{posix_fd_support::PosixFDSupport, timer_support::TimerSupport}, ext::params::Params, instance::process::ProcessData, library::PluginLibrary}};
-use sndfile::*;
 use strum_macros::EnumString;
-use thread_priority::*;
 use uuid::Uuid;
 use vst::{api::{TimeInfo, TimeInfoFlags}, buffer::{AudioBuffer, SendEventBuffer}, editor::Editor, event::MidiEvent, host::{Host, HostBuffer, PluginInstance, PluginLoader}, plugin::{HostCanDo, Plugin}};
 
-use crate::{audio_plugin_util::*, constants::{CLAP, VST24, CONFIGURATION_FILE_NAME}, DAWUtils, event::{AudioLayerInwardEvent, AudioPluginHostOutwardEvent, TrackBackgroundProcessorInwardEvent, TrackBackgroundProcessorOutwardEvent}, GeneralTrackType};
+use crate::{audio_bus::{AudioBus, AudioBusReceiver}, audio_plugin_util::*, automation::ParameterAutomation, built_in_plugin::BackgroundProcessorBuiltInAudioPlugin, constants::{BUILT_IN, CLAP, VST24, CONFIGURATION_FILE_NAME, DEFAULT_BLOCK_SIZE, DEFAULT_SAMPLE_RATE, LIVE_MIDI_RING_BUFFER_CAPACITY, TRACK_RENDER_RING_BUFFER_CAPACITY, TRACK_RING_BUFFER_CAPACITY}, DAWUtils, delay_compensation::{StereoDelayLine, TrackDelayCompensator, TrackPluginLatency}, dsp, event::{AudioLayerInwardEvent, AudioPluginHostOutwardEvent, TrackBackgroundProcessorInwardEvent, TrackBackgroundProcessorOutwardEvent}, GeneralTrackType, plugin_sandbox::BackgroundProcessorSandboxedAudioPlugin, riff_event_store::RiffEventStore, sample_stream::{SampleStream, SampleStreamer}, utils::StableHasher, scheduler::{TrackProcessingCycle, TrackProcessingScheduler, TrackProcessingTask, TrackProcessingTaskStatus}, telemetry::{TelemetryConfiguration, TrackTelemetry, TrackTelemetryRecorder}};
 
 extern {
     fn gdk_x11_window_get_xid(window: gdk::Window) -> u32;
@@ -103,7 +99,27 @@ impl DAWItemLength for TrackEvent {
     }
 }
 
-#[derive(Serialize, Deserialize)]
+/// Turn a three byte midi channel message into a track event - a note on with no velocity is a note off.
+pub fn track_event_from_midi_bytes(position: f64, data: [u8; 3]) -> Option<TrackEvent> {
+    let channel = (data[0] & 0x0F) as u16;
+    match data[0] & 0xF0 {
+        0x90 if data[2] > 0 => {
+            let mut note_on = NoteOn::new_with_params(position, data[1] as i32, data[2] as i32);
+            note_on.set_channel(channel);
+            Some(TrackEvent::NoteOn(note_on))
+        }
+        0x80 | 0x90 => {
+            let mut note_off = NoteOff::new_with_params(position, data[1] as i32, data[2] as i32);
+            note_off.set_channel(channel);
+            Some(TrackEvent::NoteOff(note_off))
+        }
+        0xB0 => Some(TrackEvent::Controller(Controller::new(position, data[1] as i32, data[2] as i32))),
+        0xE0 => Some(TrackEvent::PitchBend(PitchBend::new_from_midi_bytes(position, data[1], data[2]))),
+        _ => None,
+    }
+}
+
+#[derive(Clone, Serialize, Deserialize)]
 pub enum TrackType {
     InstrumentTrack(InstrumentTrack),
     AudioTrack(AudioTrack),
@@ -250,16 +266,17 @@ impl Track for TrackType {
     fn start_background_processing(&self,
                                    tx_audio: crossbeam_channel::Sender<AudioLayerInwardEvent>,
                                    rx_vst_thread: Receiver<TrackBackgroundProcessorInwardEvent>,
-                                   tx_vst_thread: Sender<TrackBackgroundProcessorOutwardEvent>,
+                                   tx_vst_thread: crossbeam_channel::Sender<TrackBackgroundProcessorOutwardEvent>,
                                    track_thread_coast: Arc<Mutex<TrackBackgroundProcessorMode>>,
                                    volume: f32,
                                    pan: f32,
                                    vst_host_time_info: Arc<parking_lot::RwLock<TimeInfo>>,
+                                   track_processing_scheduler: Arc<TrackProcessingScheduler>,
     ) {
         match self {
-            TrackType::InstrumentTrack(track) => track.start_background_processing(tx_audio, rx_vst_thread, tx_vst_thread, track_thread_coast, volume, pan, vst_host_time_info),
-            TrackType::AudioTrack(track) => track.start_background_processing(tx_audio, rx_vst_thread, tx_vst_thread, track_thread_coast, volume, pan, vst_host_time_info),
-            TrackType::MidiTrack(track) => track.start_background_processing(tx_audio, rx_vst_thread, tx_vst_thread, track_thread_coast, volume, pan, vst_host_time_info),
+            TrackType::InstrumentTrack(track) => track.start_background_processing(tx_audio, rx_vst_thread, tx_vst_thread, track_thread_coast, volume, pan, vst_host_time_info, track_processing_scheduler),
+            TrackType::AudioTrack(track) => track.start_background_processing(tx_audio, rx_vst_thread, tx_vst_thread, track_thread_coast, volume, pan, vst_host_time_info, track_processing_scheduler),
+            TrackType::MidiTrack(track) => track.start_background_processing(tx_audio, rx_vst_thread, tx_vst_thread, track_thread_coast, volume, pan, vst_host_time_info, track_processing_scheduler),
         }
     }
 
@@ -907,58 +924,45 @@ impl Sample {
     }
 }
 
+/// A shared handle to a streamed sample - cloning it does not copy the sample.
 #[derive(Clone)]
 pub struct SampleData {
     uuid: Uuid,
-    channels: i32,
-    samples: Vec<f32>,
+    stream: Arc<SampleStream>,
 }
 
 impl SampleData {
-    pub fn new(wav_file_name: String, sample_rate: i32) -> Self {
-        let (channels, samples) = SampleData::load_data(wav_file_name, sample_rate);
+    pub fn new(wav_file_name: String, sample_rate: i32, sample_streamer: &SampleStreamer) -> Self {
         Self {
             uuid: Uuid::new_v4(),
-            channels,
-            samples,
+            stream: sample_streamer.open(wav_file_name, sample_rate),
         }
     }
 
-    pub fn new_with_uuid(uuid: String, wav_file_name: String, sample_rate: i32) -> Self {
-        let (channels, samples) = SampleData::load_data(wav_file_name, sample_rate);
+    pub fn new_with_uuid(uuid: String, wav_file_name: String, sample_rate: i32, sample_streamer: &SampleStreamer) -> Self {
         Self {
             uuid: Uuid::parse_str(uuid.as_str()).unwrap(),
-            channels,
-            samples,
+            stream: sample_streamer.open(wav_file_name, sample_rate),
         }
     }
 
-    pub fn load_data(wav_file_name: String, sample_rate: i32) -> (i32, Vec<f32>) {
-        if let Ok(mut wav_file) = sndfile::OpenOptions::ReadOnly(ReadOptions::Auto).from_path(wav_file_name.as_str()) {
-            if let Ok(wav_data) = wav_file.read_all_to_vec() {
-                if wav_file.get_samplerate() != sample_rate as usize {
-                    let resampled_data = convert(wav_file.get_samplerate() as u32, sample_rate as u32, 1, ConverterType::SincBestQuality, &wav_data).unwrap();
-                    (wav_file.get_channels() as i32, resampled_data)
-                }
-                else {
-                    (wav_file.get_channels() as i32, wav_data)
-                }
-            }
-            else {
-                (2, vec![])
-            }
-        }
-        else {
-            (2, vec![])
-        }
+    /// Zero until the sample streamer has opened the file.
+    pub fn channels(&self) -> i32 {
+        self.stream.channels() as i32
     }
 
-    pub fn channels(&self) -> i32 {
-        self.channels
+    pub fn length_in_frames(&self) -> usize {
+        self.stream.length_in_frames()
     }
 
-    pub fn samples(&self) -> &Vec<f32> {
-        &self.samples
+    /// See SampleStream::for_each_stereo_frame.
+    pub fn for_each_stereo_frame<F: FnMut(usize, f32, f32)>(&self, start_frame: usize, frames: usize, frame_handler: F) {
+        self.stream.for_each_stereo_frame(start_frame, frames, frame_handler);
+    }
+
+    /// See SampleStream::mix_into.
+    pub fn mix_into(&self, start_frame: usize, out_left: &mut [f32], out_right: &mut [f32], left_gain: f32, right_gain: f32) {
+        self.stream.mix_into(start_frame, out_left, out_right, left_gain, right_gain);
     }
 
     pub fn uuid(&self) -> Uuid {
@@ -978,8 +982,14 @@ pub struct Riff {
 	length: f64,
     colour: Option<(f64, f64, f64, f64)>, // rgba
 	events: Vec<TrackEvent>,
+    #[serde(skip)]
+    event_store: OnceLock<RiffEventStore>, // built from the events when first read after they change
+    #[serde(skip, default = "Riff::next_version")]
+    version: u64, // changes whenever the events or length might have
 }
 
+static NEXT_RIFF_VERSION: AtomicU64 = AtomicU64::new(1);
+
 impl DAWItemID for Riff {
     fn id(&self) -> String {
         self.uuid().to_string()
@@ -1012,6 +1022,7 @@ impl DAWItemLength for Riff {
 
     fn set_length(&mut self, length: f64) {
         self.length = length;
+        self.version = Riff::next_version();
     }
 }
 
@@ -1034,14 +1045,32 @@ impl Riff {
             length,
             colour: None,
             events: vec![],
+            event_store: OnceLock::new(),
+            version: Riff::next_version(),
         }
     }
 
+    /// A version unique across all riffs - riffs with the same uuid and version have the same events and length.
+    fn next_version() -> u64 {
+        NEXT_RIFF_VERSION.fetch_add(1, std::sync::atomic::Ordering::Relaxed)
+    }
+
+    pub fn version(&self) -> u64 {
+        self.version
+    }
+
     /// Get a mutable reference to the pattern's events.
     pub fn events_mut(&mut self) -> &mut Vec<TrackEvent> {
+        self.event_store = OnceLock::new();
+        self.version = Riff::next_version();
         &mut self.events
     }
 
+    /// The riff's events in sorted columns by kind for range queries.
+    pub fn event_store(&self) -> &RiffEventStore {
+        self.event_store.get_or_init(|| RiffEventStore::new(&self.events))
+    }
+
     pub(crate) fn colour(&self) -> &Option<(f64, f64, f64, f64)> {
         &self.colour
     }
@@ -1163,6 +1192,11 @@ impl RiffReference {
         self.linked_to.clone()
     }
 
+    /// The linked riff's uuid without cloning it.
+    pub fn linked_to_str(&self) -> &str {
+        self.linked_to.as_str()
+    }
+
     pub fn uuid(&self) -> Uuid {
         self.uuid
     }
@@ -1539,6 +1573,8 @@ pub struct VstHost {
     ppq_pos: f64,
     sample_position: f64,
     tempo: f64,
+    block_size: usize,
+    sample_rate: f64,
     track_event_outward_routings: HashMap<String, TrackEventRouting>,
     track_event_outward_ring_buffers: HashMap<String, SpscRb<TrackEvent>>,
     track_event_outward_producers: HashMap<String, Producer<TrackEvent>>,
@@ -1564,6 +1600,8 @@ impl VstHost {
             ppq_pos: 0.0,
             sample_position: 0.0,
             tempo: 140.0,
+            block_size: DEFAULT_BLOCK_SIZE,
+            sample_rate: DEFAULT_SAMPLE_RATE,
             track_event_outward_routings: HashMap::new(),
             track_event_outward_ring_buffers: HashMap::new(),
             track_event_outward_producers: HashMap::new(),
@@ -1625,6 +1663,11 @@ impl VstHost {
     pub fn tempo(&self) -> f64 {
         self.tempo
     }
+
+    pub fn set_audio_format(&mut self, block_size: usize, sample_rate: f64) {
+        self.block_size = block_size;
+        self.sample_rate = sample_rate;
+    }
 }
 
 impl Host for VstHost {
@@ -1696,7 +1739,7 @@ impl Host for VstHost {
 
         let time_info = TimeInfo {
             sample_pos: self.sample_position,
-            sample_rate: 44100.0,
+            sample_rate: self.sample_rate,
             nanoseconds: 0.0,
             ppq_pos: self.ppq_pos,
             tempo: self.tempo,
@@ -1715,7 +1758,7 @@ impl Host for VstHost {
 
     fn get_block_size(&self) -> isize {
         info!("Vst plugin asked for host block size.");
-        1024
+        self.block_size as isize
     }
 
     fn update_display(&self) {
@@ -1861,6 +1904,93 @@ impl PluginParameter {
     }
 }
 
+/// Events bucketed into fixed size blocks. All the events live in one flat vector ordered by position and
+/// each block is a (start, end) offset range into it, so a passage costs two allocations rather than one per block.
+#[derive(Debug, Clone, Default)]
+pub struct EventBlocks<T> {
+    events: Vec<T>,
+    block_ranges: Vec<(usize, usize)>,
+}
+
+impl<T> EventBlocks<T> {
+    pub fn new(events: Vec<T>, block_ranges: Vec<(usize, usize)>) -> Self {
+        Self {
+            events,
+            block_ranges,
+        }
+    }
+
+    /// Get the number of blocks.
+    #[must_use]
+    pub fn len(&self) -> usize {
+        self.block_ranges.len()
+    }
+
+    /// Returns true if there are no blocks.
+    #[must_use]
+    pub fn is_empty(&self) -> bool {
+        self.block_ranges.is_empty()
+    }
+
+    /// Get the events in the given block.
+    #[must_use]
+    pub fn get(&self, block_index: usize) -> Option<&[T]> {
+        self.block_ranges.get(block_index).map(|(start, end)| &self.events[*start..*end])
+    }
+
+    /// Iterate over the blocks in order.
+    pub fn iter(&self) -> impl Iterator<Item = &[T]> {
+        self.block_ranges.iter().map(move |(start, end)| &self.events[*start..*end])
+    }
+
+    /// Get a reference to all the events across all blocks.
+    #[must_use]
+    pub fn events(&self) -> &[T] {
+        self.events.as_ref()
+    }
+
+    /// Get a reference to the block offset ranges.
+    #[must_use]
+    pub fn block_ranges(&self) -> &[(usize, usize)] {
+        self.block_ranges.as_ref()
+    }
+
+    /// Get the total number of events across all blocks.
+    #[must_use]
+    pub fn event_count(&self) -> usize {
+        self.events.len()
+    }
+
+    /// Replace the blocks starting at start_block with the replacement blocks. Replacement blocks that would
+    /// fall past the last block are ignored - the number of blocks never changes.
+    pub fn replace_blocks(&mut self, start_block: usize, replacement: EventBlocks<T>) {
+        if start_block >= self.block_ranges.len() || replacement.is_empty() {
+            return;
+        }
+
+        let end_block = (start_block + replacement.len()).min(self.block_ranges.len());
+        let replaced_blocks = end_block - start_block;
+        let events_start = self.block_ranges[start_block].0;
+        let events_end = self.block_ranges[end_block - 1].1;
+        let replacement_events_end = replacement.block_ranges[replaced_blocks - 1].1;
+
+        let EventBlocks { events: mut replacement_events, block_ranges: replacement_block_ranges } = replacement;
+        replacement_events.truncate(replacement_events_end);
+        let replacement_event_count = replacement_events.len();
+        self.events.splice(events_start..events_end, replacement_events);
+
+        for (index, (start, end)) in replacement_block_ranges.into_iter().take(replaced_blocks).enumerate() {
+            self.block_ranges[start_block + index] = (events_start + start, events_start + end);
+        }
+
+        let removed_event_count = events_end - events_start;
+        for block_range in self.block_ranges[end_block..].iter_mut() {
+            block_range.0 = block_range.0 + replacement_event_count - removed_event_count;
+            block_range.1 = block_range.1 + replacement_event_count - removed_event_count;
+        }
+    }
+}
+
 pub trait BackgroundProcessorAudioPlugin {
     fn uuid(&self) -> Uuid;
     fn uuid_mut(&mut self) -> Uuid;
@@ -1886,11 +2016,19 @@ pub trait BackgroundProcessorAudioPlugin {
 
     fn sample_rate(&self) -> f64;
     fn set_sample_rate(&mut self, sample_rate: f64);
+
+    /// Re-initialise the plugin for a new block size and sample rate.
+    fn set_audio_format(&mut self, block_size: usize, sample_rate: f64);
+
+    /// The processing latency the plugin reports in frames.
+    fn latency(&self) -> usize;
 }
 pub enum BackgroundProcessorAudioPluginType {
     Vst24(BackgroundProcessorVst24AudioPlugin),
     Vst3,
     Clap(BackgroundProcessorClapAudioPlugin),
+    Sandboxed(BackgroundProcessorSandboxedAudioPlugin), // a vst24 or clap plugin running in a sandbox process
+    BuiltIn(BackgroundProcessorBuiltInAudioPlugin), // a plugin built into the DAW
 }
 
 impl BackgroundProcessorAudioPlugin for BackgroundProcessorAudioPluginType {
@@ -1903,6 +2041,12 @@ impl BackgroundProcessorAudioPlugin for BackgroundProcessorAudioPluginType {
             BackgroundProcessorAudioPluginType::Clap(clap_plugin) => {
                 clap_plugin.uuid()
             }
+            BackgroundProcessorAudioPluginType::Sandboxed(sandboxed_plugin) => {
+                sandboxed_plugin.uuid()
+            }
+            BackgroundProcessorAudioPluginType::BuiltIn(built_in_plugin) => {
+                built_in_plugin.uuid()
+            }
         }
     }
 
@@ -1915,6 +2059,12 @@ impl BackgroundProcessorAudioPlugin for BackgroundProcessorAudioPluginType {
             BackgroundProcessorAudioPluginType::Clap(clap_plugin) => {
                 clap_plugin.uuid_mut()
             }
+            BackgroundProcessorAudioPluginType::Sandboxed(sandboxed_plugin) => {
+                sandboxed_plugin.uuid_mut()
+            }
+            BackgroundProcessorAudioPluginType::BuiltIn(built_in_plugin) => {
+                built_in_plugin.uuid_mut()
+            }
         }
     }
 
@@ -1927,6 +2077,12 @@ impl BackgroundProcessorAudioPlugin for BackgroundProcessorAudioPluginType {
             BackgroundProcessorAudioPluginType::Clap(clap_plugin) => {
                 clap_plugin.xid()
             }
+            BackgroundProcessorAudioPluginType::Sandboxed(sandboxed_plugin) => {
+                sandboxed_plugin.xid()
+            }
+            BackgroundProcessorAudioPluginType::BuiltIn(built_in_plugin) => {
+                built_in_plugin.xid()
+            }
         }
     }
 
@@ -1939,6 +2095,12 @@ impl BackgroundProcessorAudioPlugin for BackgroundProcessorAudioPluginType {
             BackgroundProcessorAudioPluginType::Clap(clap_plugin) => {
                 clap_plugin.set_xid(xid);
             }
+            BackgroundProcessorAudioPluginType::Sandboxed(sandboxed_plugin) => {
+                sandboxed_plugin.set_xid(xid);
+            }
+            BackgroundProcessorAudioPluginType::BuiltIn(built_in_plugin) => {
+                built_in_plugin.set_xid(xid);
+            }
         }
     }
 
@@ -1951,6 +2113,12 @@ impl BackgroundProcessorAudioPlugin for BackgroundProcessorAudioPluginType {
             BackgroundProcessorAudioPluginType::Clap(clap_plugin) => {
                 clap_plugin.xid_mut()
             }
+            BackgroundProcessorAudioPluginType::Sandboxed(sandboxed_plugin) => {
+                sandboxed_plugin.xid_mut()
+            }
+            BackgroundProcessorAudioPluginType::BuiltIn(built_in_plugin) => {
+                built_in_plugin.xid_mut()
+            }
         }
     }
 
@@ -1963,6 +2131,12 @@ impl BackgroundProcessorAudioPlugin for BackgroundProcessorAudioPluginType {
             BackgroundProcessorAudioPluginType::Clap(clap_plugin) => {
                 clap_plugin.rx_from_host()
             }
+            BackgroundProcessorAudioPluginType::Sandboxed(sandboxed_plugin) => {
+                sandboxed_plugin.rx_from_host()
+            }
+            BackgroundProcessorAudioPluginType::BuiltIn(built_in_plugin) => {
+                built_in_plugin.rx_from_host()
+            }
         }
     }
 
@@ -1975,6 +2149,12 @@ impl BackgroundProcessorAudioPlugin for BackgroundProcessorAudioPluginType {
             BackgroundProcessorAudioPluginType::Clap(clap_plugin) => {
                 clap_plugin.rx_from_host_mut()
             }
+            BackgroundProcessorAudioPluginType::Sandboxed(sandboxed_plugin) => {
+                sandboxed_plugin.rx_from_host_mut()
+            }
+            BackgroundProcessorAudioPluginType::BuiltIn(built_in_plugin) => {
+                built_in_plugin.rx_from_host_mut()
+            }
         }
     }
 
@@ -1987,6 +2167,12 @@ impl BackgroundProcessorAudioPlugin for BackgroundProcessorAudioPluginType {
             BackgroundProcessorAudioPluginType::Clap(clap_plugin) => {
                 clap_plugin.stop_processing();
             }
+            BackgroundProcessorAudioPluginType::Sandboxed(sandboxed_plugin) => {
+                sandboxed_plugin.stop_processing();
+            }
+            BackgroundProcessorAudioPluginType::BuiltIn(built_in_plugin) => {
+                built_in_plugin.stop_processing();
+            }
         }
     }
 
@@ -1999,6 +2185,12 @@ impl BackgroundProcessorAudioPlugin for BackgroundProcessorAudioPluginType {
             BackgroundProcessorAudioPluginType::Clap(clap_plugin) => {
                 clap_plugin.shutdown();
             }
+            BackgroundProcessorAudioPluginType::Sandboxed(sandboxed_plugin) => {
+                sandboxed_plugin.shutdown();
+            }
+            BackgroundProcessorAudioPluginType::BuiltIn(built_in_plugin) => {
+                built_in_plugin.shutdown();
+            }
         }
     }
 
@@ -2011,6 +2203,12 @@ impl BackgroundProcessorAudioPlugin for BackgroundProcessorAudioPluginType {
             BackgroundProcessorAudioPluginType::Clap(clap_plugin) => {
                 clap_plugin.set_tempo(tempo);
             }
+            BackgroundProcessorAudioPluginType::Sandboxed(sandboxed_plugin) => {
+                sandboxed_plugin.set_tempo(tempo);
+            }
+            BackgroundProcessorAudioPluginType::BuiltIn(built_in_plugin) => {
+                built_in_plugin.set_tempo(tempo);
+            }
         }
     }
 
@@ -2023,6 +2221,12 @@ impl BackgroundProcessorAudioPlugin for BackgroundProcessorAudioPluginType {
             BackgroundProcessorAudioPluginType::Clap(clap_plugin) => {
                 clap_plugin.preset_data()
             }
+            BackgroundProcessorAudioPluginType::Sandboxed(sandboxed_plugin) => {
+                sandboxed_plugin.preset_data()
+            }
+            BackgroundProcessorAudioPluginType::BuiltIn(built_in_plugin) => {
+                built_in_plugin.preset_data()
+            }
         }
     }
 
@@ -2035,6 +2239,12 @@ impl BackgroundProcessorAudioPlugin for BackgroundProcessorAudioPluginType {
             BackgroundProcessorAudioPluginType::Clap(clap_plugin) => {
                 clap_plugin.set_preset_data(data);
             }
+            BackgroundProcessorAudioPluginType::Sandboxed(sandboxed_plugin) => {
+                sandboxed_plugin.set_preset_data(data);
+            }
+            BackgroundProcessorAudioPluginType::BuiltIn(built_in_plugin) => {
+                built_in_plugin.set_preset_data(data);
+            }
         }
     }
 
@@ -2047,6 +2257,12 @@ impl BackgroundProcessorAudioPlugin for BackgroundProcessorAudioPluginType {
             BackgroundProcessorAudioPluginType::Clap(clap_plugin) => {
                 clap_plugin.get_window_size()
             }
+            BackgroundProcessorAudioPluginType::Sandboxed(sandboxed_plugin) => {
+                sandboxed_plugin.get_window_size()
+            }
+            BackgroundProcessorAudioPluginType::BuiltIn(built_in_plugin) => {
+                built_in_plugin.get_window_size()
+            }
         }
     }
 
@@ -2059,6 +2275,12 @@ impl BackgroundProcessorAudioPlugin for BackgroundProcessorAudioPluginType {
             BackgroundProcessorAudioPluginType::Clap(clap_plugin) => {
                 clap_plugin.name()
             }
+            BackgroundProcessorAudioPluginType::Sandboxed(sandboxed_plugin) => {
+                sandboxed_plugin.name()
+            }
+            BackgroundProcessorAudioPluginType::BuiltIn(built_in_plugin) => {
+                built_in_plugin.name()
+            }
         }
     }
 
@@ -2071,6 +2293,12 @@ impl BackgroundProcessorAudioPlugin for BackgroundProcessorAudioPluginType {
             BackgroundProcessorAudioPluginType::Clap(clap_plugin) => {
                 clap_plugin.tempo()
             }
+            BackgroundProcessorAudioPluginType::Sandboxed(sandboxed_plugin) => {
+                sandboxed_plugin.tempo()
+            }
+            BackgroundProcessorAudioPluginType::BuiltIn(built_in_plugin) => {
+                built_in_plugin.tempo()
+            }
         }
     }
 
@@ -2083,6 +2311,12 @@ impl BackgroundProcessorAudioPlugin for BackgroundProcessorAudioPluginType {
             BackgroundProcessorAudioPluginType::Clap(clap_plugin) => {
                 clap_plugin.sample_rate()
             }
+            BackgroundProcessorAudioPluginType::Sandboxed(sandboxed_plugin) => {
+                sandboxed_plugin.sample_rate()
+            }
+            BackgroundProcessorAudioPluginType::BuiltIn(built_in_plugin) => {
+                built_in_plugin.sample_rate()
+            }
         }
     }
 
@@ -2095,6 +2329,48 @@ impl BackgroundProcessorAudioPlugin for BackgroundProcessorAudioPluginType {
             BackgroundProcessorAudioPluginType::Clap(clap_plugin) => {
                 clap_plugin.set_sample_rate(sample_rate);
             }
+            BackgroundProcessorAudioPluginType::Sandboxed(sandboxed_plugin) => {
+                sandboxed_plugin.set_sample_rate(sample_rate);
+            }
+            BackgroundProcessorAudioPluginType::BuiltIn(built_in_plugin) => {
+                built_in_plugin.set_sample_rate(sample_rate);
+            }
+        }
+    }
+
+    fn set_audio_format(&mut self, block_size: usize, sample_rate: f64) {
+        match self {
+            BackgroundProcessorAudioPluginType::Vst24(vst24_plugin) => {
+                vst24_plugin.set_audio_format(block_size, sample_rate);
+            }
+            BackgroundProcessorAudioPluginType::Vst3 => {}
+            BackgroundProcessorAudioPluginType::Clap(clap_plugin) => {
+                clap_plugin.set_audio_format(block_size, sample_rate);
+            }
+            BackgroundProcessorAudioPluginType::Sandboxed(sandboxed_plugin) => {
+                sandboxed_plugin.set_audio_format(block_size, sample_rate);
+            }
+            BackgroundProcessorAudioPluginType::BuiltIn(built_in_plugin) => {
+                built_in_plugin.set_audio_format(block_size, sample_rate);
+            }
+        }
+    }
+
+    fn latency(&self) -> usize {
+        match self {
+            BackgroundProcessorAudioPluginType::Vst24(vst24_plugin) => {
+                vst24_plugin.latency()
+            }
+            BackgroundProcessorAudioPluginType::Vst3 => 0,
+            BackgroundProcessorAudioPluginType::Clap(clap_plugin) => {
+                clap_plugin.latency()
+            }
+            BackgroundProcessorAudioPluginType::Sandboxed(sandboxed_plugin) => {
+                sandboxed_plugin.latency()
+            }
+            BackgroundProcessorAudioPluginType::BuiltIn(built_in_plugin) => {
+                built_in_plugin.latency()
+            }
         }
     }
 }
@@ -2213,6 +2489,25 @@ impl BackgroundProcessorAudioPlugin for BackgroundProcessorVst24AudioPlugin {
         self.sample_rate = sample_rate;
         self.vst_plugin_instance_mut().set_sample_rate(sample_rate as f32);
     }
+
+    fn set_audio_format(&mut self, block_size: usize, sample_rate: f64) {
+        self.sample_rate = sample_rate;
+        if let Ok(mut vst_host) = self.host().lock() {
+            vst_host.set_audio_format(block_size, sample_rate);
+        }
+        // vst 2.4 only allows the block size and sample rate to be changed while suspended
+        let vst_plugin_instance = self.vst_plugin_instance_mut();
+        vst_plugin_instance.stop_process();
+        vst_plugin_instance.suspend();
+        vst_plugin_instance.set_sample_rate(sample_rate as f32);
+        vst_plugin_instance.set_block_size(block_size as i64);
+        vst_plugin_instance.resume();
+        vst_plugin_instance.start_process();
+    }
+
+    fn latency(&self) -> usize {
+        self.vst_plugin_instance.get_info().initial_delay.max(0) as usize
+    }
 }
 
 impl BackgroundProcessorVst24AudioPlugin {
@@ -2223,9 +2518,11 @@ impl BackgroundProcessorVst24AudioPlugin {
         sub_plugin_id: Option<String>,
         library_path: String,
         vst_host_time_info: Arc<parking_lot::RwLock<TimeInfo>>,
+        block_size: usize,
+        sample_rate: f64,
     ) -> Self {
         let (tx_from_vst_host, rx_from_host) = channel::<AudioPluginHostOutwardEvent>();
-        let (host, mut vst_plugin_instance) = create_vst24_audio_plugin(
+        let (host, vst_plugin_instance) = create_vst24_audio_plugin(
             vst_plugin_loaders,
             library_path.as_str(),
             track_uuid,
@@ -2234,10 +2531,10 @@ impl BackgroundProcessorVst24AudioPlugin {
             tx_from_vst_host,
             false,
             vst_host_time_info.clone(),
+            block_size,
+            sample_rate,
         );
         let midi_sender = SendEventBuffer::new(1);
-        vst_plugin_instance.set_sample_rate(44100.0);
-        vst_plugin_instance.set_block_size(1024);
         // let vst_editor = vst_plugin_instance.get_editor();
         Self {
             uuid,
@@ -2248,7 +2545,7 @@ impl BackgroundProcessorVst24AudioPlugin {
             rx_from_host,
             editor: None,
             vst_host_time_info,
-            sample_rate: 44100.0,
+            sample_rate,
         }
     }
 
@@ -2326,6 +2623,7 @@ pub struct BackgroundProcessorClapAudioPlugin {
     host_receiver: crossbeam_channel::Receiver<DAWCallback>,
     tempo: f64,
     sample_rate: f64,
+    block_size: usize,
 }
 
 impl BackgroundProcessorAudioPlugin for BackgroundProcessorClapAudioPlugin {
@@ -2469,6 +2767,29 @@ impl BackgroundProcessorAudioPlugin for BackgroundProcessorClapAudioPlugin {
     fn set_sample_rate(&mut self, sample_rate: f64) {
         self.sample_rate = sample_rate;
     }
+
+    fn set_audio_format(&mut self, block_size: usize, sample_rate: f64) {
+        self.block_size = block_size;
+        self.sample_rate = sample_rate;
+        // clap plugins have to be deactivated to change the block size or sample rate and the process buffers have to match
+        self.plugin.stop_processing();
+        self.plugin.deactivate();
+        self.process_data = activate_clap_audio_plugin(&self.plugin, block_size, sample_rate);
+    }
+
+    fn latency(&self) -> usize {
+        unsafe {
+            if let Some(get_extension) = self.plugin.get_extension {
+                let latency_extension = get_extension((&self.plugin).as_ptr(), CLAP_EXT_LATENCY.as_ptr()) as *const clap_plugin_latency;
+                if !latency_extension.is_null() {
+                    if let Some(get_latency) = (*latency_extension).get {
+                        return get_latency((&self.plugin).as_ptr()) as usize;
+                    }
+                }
+            }
+        }
+        0
+    }
 }
 
 impl BackgroundProcessorClapAudioPlugin {
@@ -2478,6 +2799,8 @@ impl BackgroundProcessorClapAudioPlugin {
         uuid: Uuid,
         sub_plugin_id: Option<String>,
         library_path: String,
+        block_size: usize,
+        sample_rate: f64,
     ) -> Self {
         let (tx_from_clap_host, rx_from_host) = channel::<AudioPluginHostOutwardEvent>();
         let (plugin, process_data, host_receiver) = create_clap_audio_plugin(
@@ -2488,6 +2811,8 @@ impl BackgroundProcessorClapAudioPlugin {
             sub_plugin_id, 
             tx_from_clap_host, 
             false,
+            block_size,
+            sample_rate,
         );
         Self {
             uuid,
@@ -2497,7 +2822,8 @@ impl BackgroundProcessorClapAudioPlugin {
             process_data,
             host_receiver,
             tempo: 140.0,
-            sample_rate: 44100.0,
+            sample_rate,
+            block_size,
         }
     }
 
@@ -2508,6 +2834,26 @@ impl BackgroundProcessorClapAudioPlugin {
         }
     }
 
+    /// Get a reference to the clap plugin.
+    pub fn plugin(&self) -> &simple_clap_host_helper_lib::plugin::instance::Plugin {
+        &self.plugin
+    }
+
+    /// Get a reference to the clap plugin's host callback receiver.
+    pub fn host_receiver(&self) -> &crossbeam_channel::Receiver<DAWCallback> {
+        &self.host_receiver
+    }
+
+    /// Queue this block's parameter changes as in block param value events - clap input events have to be in time order.
+    pub fn process_parameter_changes<'a>(&self, changes: impl Iterator<Item = &'a PluginParameter>) {
+        let parameter_events = DAWUtils::convert_parameter_changes_to_clap(changes);
+        if !parameter_events.is_empty() {
+            let mut input_events = self.process_data.input_events.events.lock();
+            input_events.extend(parameter_events);
+            input_events.sort_by_key(|event| DAWUtils::clap_event_time(event));
+        }
+    }
+
     pub fn process(&mut self, background_processor_buffer: &mut AudioBuffer<f32>, uses_input: bool) {
         unsafe {
             if let Some(process) = self.plugin.process {
@@ -2523,14 +2869,14 @@ impl BackgroundProcessorClapAudioPlugin {
                     
                     {
                         let channel1 = &mut channel[0];
-                        for index in 0..1024 {
+                        for index in 0..self.block_size {
                             channel1[index] = background_processor_left_channel[index];
                         }
                     }
 
                     {
                         let channel2 = &mut channel[1];
-                        for index in 0..1024 {
+                        for index in 0..self.block_size {
                             channel2[index] = background_processor_right_channel[index];
                         }
                     }
@@ -2568,14 +2914,14 @@ impl BackgroundProcessorClapAudioPlugin {
                 let (_, mut outputs) = background_processor_buffer.split();
                 let background_processor_left_channel = outputs.get_mut(0);
                 let background_processor_right_channel = outputs.get_mut(1);
-                for index in 0..1024 {
+                for index in 0..self.block_size {
                     background_processor_left_channel[index] = channel1[index];
                     background_processor_right_channel[index] = channel2[index];
                 }
             }
 
             self.process_data.clear_events();
-            self.process_data.advance_transport(1024);
+            self.process_data.advance_transport(self.block_size as u32);
         }
     }
 }
@@ -2595,7 +2941,7 @@ pub enum AudioPluginCategory {
     MidiGenerator
 }
 
-#[derive(Serialize, Deserialize)]
+#[derive(Clone, Serialize, Deserialize)]
 pub struct AudioPlugin {
     uuid: Uuid,
 	name: String,
@@ -2733,7 +3079,7 @@ impl AudioPlugin {
     }
 }
 
-#[derive(PartialEq, Eq)]
+#[derive(PartialEq, Eq, Clone, Copy)]
 pub enum TrackBackgroundProcessorMode {
     AudioOut,
     Coast,
@@ -2744,16 +3090,24 @@ pub struct TrackBackgroundProcessorHelper {
     pub track_uuid: String,
     pub vst_event_blocks: Option<Vec<Vec<MidiEvent>>>,
     pub vst_event_blocks_transition_to: Option<Vec<Vec<MidiEvent>>>,
-    pub track_event_blocks: Option<Vec<Vec<TrackEvent>>>,
-    pub track_event_blocks_transition_to: Option<Vec<Vec<TrackEvent>>>,
-    pub param_event_blocks: Option<Vec<Vec<PluginParameter>>>,
+    pub track_event_blocks: Option<EventBlocks<TrackEvent>>,
+    pub track_event_blocks_transition_to: Option<EventBlocks<TrackEvent>>,
+    pub param_event_blocks: Option<EventBlocks<PluginParameter>>,
     pub audio_plugin_immediate_events: Vec<TrackEvent>,
     pub jack_midi_out_immediate_events: Vec<MidiEvent>,
+    pub live_midi_ring_buffer: SpscRb<(u32, u8, u8, u8)>,
+    pub live_midi_consumer: Consumer<(u32, u8, u8, u8)>,
+    pub live_midi_buffer: [(u32, u8, u8, u8); LIVE_MIDI_RING_BUFFER_CAPACITY],
     pub block_index: i32,
     pub play: bool,
+    pub render_waiting_for_play: bool, // render output is held back until play so that every track starts on the same block
     pub mute: bool,
     pub midi_sender: SendEventBuffer,
-    pub instrument_plugin_initial_delay: i32,
+    pub instrument_vst_midi_events: Vec<MidiEvent>,
+    pub parameter_automation: ParameterAutomation,
+    pub plugin_sandbox: PluginSandboxConfiguration,
+    pub plugin_latency: TrackPluginLatency,
+    pub delay_compensator: TrackDelayCompensator,
     pub instrument_plugin_instances: Vec<BackgroundProcessorAudioPluginType>,
     pub request_preset_data: bool,
     pub play_loop_on: bool,
@@ -2767,7 +3121,7 @@ pub struct TrackBackgroundProcessorHelper {
     pub request_effect_params_for_uuid: String,
     pub tx_audio: crossbeam_channel::Sender<AudioLayerInwardEvent>,
     pub rx_vst_thread: Receiver<TrackBackgroundProcessorInwardEvent>,
-    pub tx_vst_thread: Sender<TrackBackgroundProcessorOutwardEvent>,
+    pub tx_vst_thread: crossbeam_channel::Sender<TrackBackgroundProcessorOutwardEvent>,
     pub track_thread_coast: Arc<Mutex<TrackBackgroundProcessorMode>>,
     pub keep_alive: bool,
     pub jack_midi_out_buffer: [(u32, u8, u8, u8, bool); 1024],
@@ -2776,6 +3130,9 @@ pub struct TrackBackgroundProcessorHelper {
     sample: Option<SampleData>, // might need sample references - each is tied to a midi note number and started and stopped by note on and off messages
     pub sample_current_frame: i32,
     pub sample_is_playing: bool,
+    frozen_audio: Option<SampleData>, // the rendered instrument and effects of a frozen track
+    frozen_audio_output_delay: usize, // the output delay compensation rendered into the frozen audio
+    pub telemetry: TrackTelemetryRecorder,
     pub track_type: GeneralTrackType,
     pub vst_host_time_info: Arc<parking_lot::RwLock<TimeInfo>>,
     pub track_events_inward_routings: HashMap<String, TrackEventRouting>,
@@ -2785,23 +3142,36 @@ pub struct TrackBackgroundProcessorHelper {
     pub track_events_outward_producers: HashMap<String, Producer<TrackEvent>>,
 
     pub audio_inward_routings: HashMap<String, AudioRouting>,
-    pub audio_inward_consumers: HashMap<String, (Consumer<f32>, Consumer<f32>)>,
+    pub audio_inward_buses: HashMap<String, AudioBusReceiver>, // by audio routing uuid - reads the source track's bus
     pub audio_outward_routings: HashMap<String, AudioRouting>,
-    pub audio_outward_ring_buffers: HashMap<String, (SpscRb<f32>, SpscRb<f32>)>,
-    pub audio_outward_producers: HashMap<String, (Producer<f32>, Producer<f32>)>,
+    pub audio_outward_bus: Option<Arc<AudioBus>>, // written while there are outward routings
+    source_track_uuids_changed: bool, // the inward routings have changed since the scheduler last asked
+
+    pub block_size: usize,
+    pub sample_rate: f64,
+    pub tempo: f64,
 }
 
 impl TrackBackgroundProcessorHelper {
     pub fn new(track_uuid: String,
                tx_audio: crossbeam_channel::Sender<AudioLayerInwardEvent>,
                rx_vst_thread: Receiver<TrackBackgroundProcessorInwardEvent>,
-               tx_vst_thread: Sender<TrackBackgroundProcessorOutwardEvent>,
+               tx_vst_thread: crossbeam_channel::Sender<TrackBackgroundProcessorOutwardEvent>,
                track_thread_coast: Arc<Mutex<TrackBackgroundProcessorMode>>,
                volume: f32,
                pan: f32,
                track_type: GeneralTrackType,
                vst_host_time_info: Arc<parking_lot::RwLock<TimeInfo>>,
     ) -> Self {
+        // live midi in goes straight from the jack process callback to the track without passing through the gui thread
+        let live_midi_ring_buffer: SpscRb<(u32, u8, u8, u8)> = SpscRb::new(LIVE_MIDI_RING_BUFFER_CAPACITY);
+        let live_midi_producer_details = LiveMidiProducerDetails::new(track_uuid.clone(), live_midi_ring_buffer.producer());
+        match tx_audio.try_send(AudioLayerInwardEvent::NewLiveMidiProducer(live_midi_producer_details)) {
+            Ok(_) => (),
+            Err(_) => error!("Track background processor could not send the live midi producer to the audio layer."),
+        }
+        let telemetry = TrackTelemetryRecorder::new(track_uuid.as_str());
+
         Self {
             track_uuid,
             vst_event_blocks: None,
@@ -2811,11 +3181,19 @@ impl TrackBackgroundProcessorHelper {
             param_event_blocks: None,
             audio_plugin_immediate_events: vec![],
             jack_midi_out_immediate_events: vec![],
+            live_midi_consumer: live_midi_ring_buffer.consumer(),
+            live_midi_ring_buffer,
+            live_midi_buffer: [(0, 0, 0, 0); LIVE_MIDI_RING_BUFFER_CAPACITY],
             block_index: 0,
             play: false,
+            render_waiting_for_play: true,
             mute: false,
             midi_sender: SendEventBuffer::new(1024),
-            instrument_plugin_initial_delay: 0,
+            instrument_vst_midi_events: vec![],
+            parameter_automation: ParameterAutomation::default(),
+            plugin_sandbox: PluginSandboxConfiguration::default(),
+            plugin_latency: TrackPluginLatency::default(),
+            delay_compensator: TrackDelayCompensator::default(),
             instrument_plugin_instances: vec![],
             request_preset_data: false,
             play_loop_on: false,
@@ -2838,6 +3216,9 @@ impl TrackBackgroundProcessorHelper {
             sample: None,
             sample_current_frame: 0,
             sample_is_playing: false,
+            frozen_audio: None,
+            frozen_audio_output_delay: 0,
+            telemetry,
             track_type,
             vst_host_time_info,
             track_events_inward_routings: HashMap::new(),
@@ -2846,10 +3227,13 @@ impl TrackBackgroundProcessorHelper {
             track_events_outward_ring_buffers: HashMap::new(),
             track_events_outward_producers: HashMap::new(),
             audio_inward_routings: HashMap::new(),
-            audio_inward_consumers: HashMap::new(),
+            audio_inward_buses: HashMap::new(),
             audio_outward_routings: HashMap::new(),
-            audio_outward_ring_buffers: HashMap::new(),
-            audio_outward_producers: HashMap::new(),
+            audio_outward_bus: None,
+            source_track_uuids_changed: true,
+            block_size: DEFAULT_BLOCK_SIZE,
+            sample_rate: DEFAULT_SAMPLE_RATE,
+            tempo: 140.0,
         }
     }
 
@@ -2857,11 +3241,7 @@ impl TrackBackgroundProcessorHelper {
         match self.rx_vst_thread.try_recv() {
             Ok(message) => match message {
                 TrackBackgroundProcessorInwardEvent::SetEvents((event_blocks, param_event_blocks), transition_to) => {
-                    let mut event_count = 0;
-                    for event_block in event_blocks.iter() {
-                        event_count += event_block.len();
-                    }
-                    info!("Received Audio Plugin ThreadEvent::SetEvents(event_blocks): event block count={}, event count={}", event_blocks.len(), event_count);
+                    info!("Received Audio Plugin ThreadEvent::SetEvents(event_blocks): event block count={}, event count={}", event_blocks.len(), event_blocks.event_count());
                     if self.track_event_blocks.is_none() {
                         self.track_event_blocks = Some(event_blocks);
                     }
@@ -2873,6 +3253,15 @@ impl TrackBackgroundProcessorHelper {
                     }
                     self.param_event_blocks = Some(param_event_blocks);
                 },
+                TrackBackgroundProcessorInwardEvent::ReplaceEventBlocks(start_block, (event_blocks, param_event_blocks)) => {
+                    info!("Received Audio Plugin ThreadEvent::ReplaceEventBlocks: start block={}, event block count={}, event count={}", start_block, event_blocks.len(), event_blocks.event_count());
+                    if let Some(track_event_blocks) = self.track_event_blocks.as_mut() {
+                        track_event_blocks.replace_blocks(start_block, event_blocks);
+                    }
+                    if let Some(track_param_event_blocks) = self.param_event_blocks.as_mut() {
+                        track_param_event_blocks.replace_blocks(start_block, param_event_blocks);
+                    }
+                },
                 TrackBackgroundProcessorInwardEvent::Play(start_at_block_number) => {
                     match std::thread::current().name() {
                         Some(thread_name) => {
@@ -2881,6 +3270,7 @@ impl TrackBackgroundProcessorHelper {
                         None => (),
                     };
                     self.play = true;
+                    self.render_waiting_for_play = false;
                     self.block_index = start_at_block_number;
 
                     self.stop_all_playing_notes();
@@ -2951,8 +3341,31 @@ impl TrackBackgroundProcessorHelper {
                 },
                 TrackBackgroundProcessorInwardEvent::AddEffect(vst24_plugin_loaders, clap_plugin_loaders, uuid, effect_details) => {
                     let (sub_plugin_id, library_path, plugin_type) = get_plugin_details(effect_details);
+                    let built_in_plugin_instance = if plugin_type == BUILT_IN {
+                        BackgroundProcessorBuiltInAudioPlugin::new_with_uuid(uuid, library_path.as_str(), self.sample_rate)
+                    }
+                    else {
+                        None
+                    };
 
-                    let plugin_instance: BackgroundProcessorAudioPluginType = if plugin_type == VST24 {
+                    let plugin_instance: BackgroundProcessorAudioPluginType = if let Some(built_in_plugin_instance) = built_in_plugin_instance {
+                        BackgroundProcessorAudioPluginType::BuiltIn(built_in_plugin_instance)
+                    }
+                    else if let Some(host_executable) = self.plugin_sandbox.host_executable(library_path.as_str()) {
+                        let sandboxed_plugin_instance = BackgroundProcessorSandboxedAudioPlugin::new_with_uuid(
+                            self.track_uuid.clone(),
+                            uuid,
+                            sub_plugin_id,
+                            library_path,
+                            plugin_type,
+                            false,
+                            host_executable,
+                            self.block_size,
+                            self.sample_rate,
+                        );
+                        BackgroundProcessorAudioPluginType::Sandboxed(sandboxed_plugin_instance)
+                    }
+                    else if plugin_type == VST24 {
                         let vst_plugin_instance = BackgroundProcessorVst24AudioPlugin::new_with_uuid(
                             vst24_plugin_loaders,
                             self.track_uuid.clone(),
@@ -2960,6 +3373,8 @@ impl TrackBackgroundProcessorHelper {
                             sub_plugin_id,
                             library_path,
                             self.vst_host_time_info.clone(),
+                            self.block_size,
+                            self.sample_rate,
                         );
 
                         BackgroundProcessorAudioPluginType::Vst24(vst_plugin_instance)
@@ -2970,7 +3385,9 @@ impl TrackBackgroundProcessorHelper {
                             self.track_uuid.clone(), 
                             uuid, 
                             sub_plugin_id, 
-                            library_path
+                            library_path,
+                            self.block_size,
+                            self.sample_rate,
                         );
                         BackgroundProcessorAudioPluginType::Clap(clap_plugin_instance)
                     }
@@ -2978,10 +3395,12 @@ impl TrackBackgroundProcessorHelper {
                         BackgroundProcessorAudioPluginType::Vst3
                     };
 
+                    self.telemetry.add_plugin(plugin_instance.uuid());
                     self.effect_plugin_instances.push(plugin_instance);
                     self.request_effect_params = true;
                     self.request_effect_params_for_uuid.clear();
                     self.request_effect_params_for_uuid.push_str(uuid.to_string().as_str());
+                    self.update_plugin_latency();
                 }
                 TrackBackgroundProcessorInwardEvent::DeleteEffect(uuid) => {
                     for effect in self.effect_plugin_instances.iter_mut() {
@@ -2989,16 +3408,51 @@ impl TrackBackgroundProcessorHelper {
                             effect.stop_processing();
                             effect.shutdown();
                             self.vst_effect_editors.remove(&effect.uuid().to_string());
+                            self.telemetry.remove_plugin(effect.uuid());
                         }
                     }
                     self.effect_plugin_instances.retain(|effect| {
                         effect.uuid().to_string() != uuid
                     });
+                    self.update_plugin_latency();
                 }
                 TrackBackgroundProcessorInwardEvent::ChangeInstrument(vst24_plugin_loaders, clap_plugin_loaders, uuid, plugin_details) => {
                     let (sub_plugin_id, library_path, plugin_type) = get_plugin_details(plugin_details);
+                    let built_in_plugin_instance = if plugin_type == BUILT_IN {
+                        BackgroundProcessorBuiltInAudioPlugin::new_with_uuid(uuid, library_path.as_str(), self.sample_rate)
+                    }
+                    else {
+                        None
+                    };
+
+                    let plugin_instance: BackgroundProcessorAudioPluginType = if let Some(built_in_plugin_instance) = built_in_plugin_instance {
+                        match self.tx_vst_thread.send(TrackBackgroundProcessorOutwardEvent::InstrumentName(built_in_plugin_instance.name())) {
+                            Ok(_) => info!("Sent instrument name to main processing loop."),
+                            Err(_) => info!("Failed to send instrument name to main processing loop."),
+                        }
+
+                        BackgroundProcessorAudioPluginType::BuiltIn(built_in_plugin_instance)
+                    }
+                    else if let Some(host_executable) = self.plugin_sandbox.host_executable(library_path.as_str()) {
+                        let sandboxed_plugin_instance = BackgroundProcessorSandboxedAudioPlugin::new_with_uuid(
+                            self.track_uuid.clone(),
+                            uuid,
+                            sub_plugin_id,
+                            library_path,
+                            plugin_type,
+                            true,
+                            host_executable,
+                            self.block_size,
+                            self.sample_rate,
+                        );
+                        match self.tx_vst_thread.send(TrackBackgroundProcessorOutwardEvent::InstrumentName(sandboxed_plugin_instance.name())) {
+                            Ok(_) => info!("Sent instrument name to main processing loop."),
+                            Err(_) => info!("Failed to send instrument name to main processing loop."),
+                        }
 
-                    let plugin_instance: BackgroundProcessorAudioPluginType = if plugin_type == VST24 {
+                        BackgroundProcessorAudioPluginType::Sandboxed(sandboxed_plugin_instance)
+                    }
+                    else if plugin_type == VST24 {
                         let vst_plugin_instance = BackgroundProcessorVst24AudioPlugin::new_with_uuid(
                             vst24_plugin_loaders,
                             self.track_uuid.clone(),
@@ -3006,6 +3460,8 @@ impl TrackBackgroundProcessorHelper {
                             sub_plugin_id,
                             library_path,
                             self.vst_host_time_info.clone(),
+                            self.block_size,
+                            self.sample_rate,
                         );
                         let instrument_name = vst_plugin_instance.vst_plugin_instance.get_info().name;
                         match self.tx_vst_thread.send(TrackBackgroundProcessorOutwardEvent::InstrumentName(instrument_name)) {
@@ -3021,7 +3477,9 @@ impl TrackBackgroundProcessorHelper {
                             self.track_uuid.clone(), 
                             uuid, 
                             sub_plugin_id, 
-                            library_path
+                            library_path,
+                            self.block_size,
+                            self.sample_rate,
                         );
                         BackgroundProcessorAudioPluginType::Clap(clap_plugin_instance)
                     }
@@ -3029,9 +3487,14 @@ impl TrackBackgroundProcessorHelper {
                         BackgroundProcessorAudioPluginType::Vst3
                     };
 
+                    for instrument_plugin in self.instrument_plugin_instances.iter() {
+                        self.telemetry.remove_plugin(instrument_plugin.uuid());
+                    }
                     self.instrument_plugin_instances.clear();
+                    self.telemetry.add_plugin(plugin_instance.uuid());
                     self.instrument_plugin_instances.push(plugin_instance);
                     self.handle_request_instrument_plugin_parameters();
+                    self.update_plugin_latency();
                 }
                 TrackBackgroundProcessorInwardEvent::SetPresetData(instrument_preset_data, effect_presets) => {
                     if let Some(instrument_plugin) = self.instrument_plugin_instances.get_mut(0) {
@@ -3047,6 +3510,7 @@ impl TrackBackgroundProcessorHelper {
                         }
                         index += 1;
                     }
+                    self.update_plugin_latency();
                 },
                 TrackBackgroundProcessorInwardEvent::RequestPresetData => {
                     self.request_preset_data = true;
@@ -3157,6 +3621,29 @@ impl TrackBackgroundProcessorHelper {
 
                     self.stop_all_playing_notes();
                 },
+                TrackBackgroundProcessorInwardEvent::SetAudioFormat(block_size, sample_rate) => {
+                    self.block_size = block_size;
+                    self.sample_rate = sample_rate;
+                    if let Some(instrument_plugin) = self.instrument_plugin_instances.get_mut(0) {
+                        instrument_plugin.set_audio_format(block_size, sample_rate);
+                    }
+                    for effect in self.effect_plugin_instances.iter_mut() {
+                        effect.set_audio_format(block_size, sample_rate);
+                    }
+                    self.update_plugin_latency();
+                }
+                TrackBackgroundProcessorInwardEvent::SetDelayCompensation(track_delay_compensator) => {
+                    let replaced_delay_compensator = self.delay_compensator.replace(track_delay_compensator);
+                    if self.tx_vst_thread.try_send(TrackBackgroundProcessorOutwardEvent::RetiredDelayCompensator(replaced_delay_compensator)).is_err() {
+                        error!("Track {} could not hand its replaced delay lines back to be dropped.", self.track_uuid);
+                    }
+                }
+                TrackBackgroundProcessorInwardEvent::SetAutomationRamping(ramping) => {
+                    self.parameter_automation.ramping = ramping;
+                }
+                TrackBackgroundProcessorInwardEvent::SetPluginSandbox(plugin_sandbox) => {
+                    self.plugin_sandbox = plugin_sandbox;
+                }
                 TrackBackgroundProcessorInwardEvent::Volume(volume) => {
                     self.volume = volume;
                 }
@@ -3202,6 +3689,10 @@ impl TrackBackgroundProcessorHelper {
                     self.sample_is_playing = false;
                     self.sample_current_frame = 0;
                 }
+                TrackBackgroundProcessorInwardEvent::SetFrozenAudio(frozen_audio, output_delay) => {
+                    self.frozen_audio = frozen_audio;
+                    self.frozen_audio_output_delay = output_delay;
+                }
                 TrackBackgroundProcessorInwardEvent::SetInstrumentParameter(_param_index, _param_value) => {
                     if let Some(_instrument_plugin) = self.instrument_plugin_instances.get_mut(0) {
                         // let _vst_plugin_instance: &mut PluginInstance = instrument_plugin.vst_plugin_instance_mut();
@@ -3210,6 +3701,7 @@ impl TrackBackgroundProcessorHelper {
                     }
                 }
                 TrackBackgroundProcessorInwardEvent::Tempo(tempo) => {
+                    self.tempo = tempo;
                     if let Some(instrument_plugin) = self.instrument_plugin_instances.get_mut(0) {
                         instrument_plugin.set_tempo(tempo);
                     }
@@ -3237,6 +3729,8 @@ impl TrackBackgroundProcessorHelper {
                                     BackgroundProcessorAudioPluginType::Clap(_) => {
 
                                     }
+                                    BackgroundProcessorAudioPluginType::Sandboxed(_) => {}
+                                    BackgroundProcessorAudioPluginType::BuiltIn(_) => {}
                                 }
                             }
                         }
@@ -3259,6 +3753,8 @@ impl TrackBackgroundProcessorHelper {
                             BackgroundProcessorAudioPluginType::Clap(_) => {
 
                             }
+                            BackgroundProcessorAudioPluginType::Sandboxed(_) => {}
+                            BackgroundProcessorAudioPluginType::BuiltIn(_) => {}
                         }
                     }
                 }
@@ -3273,28 +3769,17 @@ impl TrackBackgroundProcessorHelper {
                 }
                 TrackBackgroundProcessorInwardEvent::UpdateTrackEventReceiveRouting(route_uuid, midi_routing) => {
                     self.track_events_inward_routings.insert(route_uuid, midi_routing);
+                    self.source_track_uuids_changed = true;
                 }
-                TrackBackgroundProcessorInwardEvent::AddAudioSendRouting(audio_routing, ring_buffers, producers) => {
-                    self.audio_outward_ring_buffers.insert(audio_routing.uuid(), ring_buffers);
-                    self.audio_outward_producers.insert(audio_routing.uuid(), producers);
+                TrackBackgroundProcessorInwardEvent::AddAudioSendRouting(audio_routing, audio_bus) => {
+                    self.audio_outward_bus = Some(audio_bus);
                     self.audio_outward_routings.insert(audio_routing.uuid(), audio_routing);
-                    // match &audio_routing.source {
-                    //     AudioRoutingNodeType::Track(_) => {
-                    //         self.audio_outward_ring_buffers.insert(audio_routing.uuid(), ring_buffer);
-                    //         self.audio_outward_producers.insert(audio_routing.uuid(), producer);
-                    //         self.audio_outward_routings.insert(audio_routing.uuid(), audio_routing);
-                    //     }
-                    //     AudioRoutingNodeType::Instrument(_, _, _, _) => {
-                    //     }
-                    //     AudioRoutingNodeType::Effect(_, _, _, _) => {
-                    //         // Not sure if this is actually a reality
-                    //     }
-                    // }
                 }
-                TrackBackgroundProcessorInwardEvent::RemoveAudioSendRouting(_route_uuid) => {
+                TrackBackgroundProcessorInwardEvent::RemoveAudioSendRouting(route_uuid) => {
+                    self.audio_outward_routings.remove(&route_uuid);
                 }
-                TrackBackgroundProcessorInwardEvent::AddAudioReceiveRouting(audio_routing, audio_source) => {
-                    self.add_audio_inward_routing(audio_routing, audio_source);
+                TrackBackgroundProcessorInwardEvent::AddAudioReceiveRouting(audio_routing, audio_bus_receiver) => {
+                    self.add_audio_inward_routing(audio_routing, audio_bus_receiver);
                 }
                 TrackBackgroundProcessorInwardEvent::RemoveAudioReceiveRouting(route_uuid) => {
                     self.remove_audio_inward_routing(route_uuid);
@@ -3304,6 +3789,24 @@ impl TrackBackgroundProcessorHelper {
         }
     }
 
+    /// Collect the latency of the track's plugins and send it on when it has changed so that the delay compensation
+    /// can be worked out again.
+    fn update_plugin_latency(&mut self) {
+        let plugin_latency = TrackPluginLatency {
+            instrument: self.instrument_plugin_instances.get(0).map(|instrument_plugin| instrument_plugin.latency()).unwrap_or(0),
+            effects: self.effect_plugin_instances.iter().map(|effect| (effect.uuid().to_string(), effect.latency())).collect(),
+        };
+
+        if plugin_latency != self.plugin_latency {
+            info!("Track {} plugin latency changed: {} frames", self.track_uuid, plugin_latency.total());
+            self.plugin_latency = plugin_latency.clone();
+            match self.tx_vst_thread.send(TrackBackgroundProcessorOutwardEvent::PluginLatency(plugin_latency)) {
+                Ok(_) => (),
+                Err(_) => info!("Failed to send the plugin latency to the main processing loop."),
+            }
+        }
+    }
+
     fn stop_all_playing_notes(&mut self) {
         if !self.playing_notes.is_empty() {
             if let Some(instrument_plugin) = self.instrument_plugin_instances.get_mut(0) {
@@ -3338,6 +3841,24 @@ impl TrackBackgroundProcessorHelper {
                         info!("Sending note off events to the CLAP instrument: {}", all_note_offs.len());
                         clap_plugin.process_events(&all_note_offs);
                     }
+                    BackgroundProcessorAudioPluginType::Sandboxed(sandboxed_plugin) => {
+                        let all_note_offs: Vec<MidiEvent> = self.playing_notes.iter().map(|note| MidiEvent {
+                            data: [128, *note as u8, 0_u8],
+                            delta_frames: 0,
+                            live: true,
+                            note_length: None,
+                            note_offset: None,
+                            detune: 0,
+                            note_off_velocity: 0,
+                        }).collect();
+                        info!("Sending note off events to the sandboxed instrument: {}", all_note_offs.len());
+                        sandboxed_plugin.queue_midi_events(&all_note_offs);
+                    }
+                    BackgroundProcessorAudioPluginType::BuiltIn(built_in_plugin) => {
+                        let all_note_offs: Vec<TrackEvent> = self.playing_notes.iter().map(|note| TrackEvent::NoteOff(NoteOff::new_with_params(0.0, *note, 0))).collect();
+                        info!("Sending note off events to the built in instrument: {}", all_note_offs.len());
+                        built_in_plugin.process_events(&all_note_offs);
+                    }
                 }
             }
             self.playing_notes.clear();
@@ -3354,6 +3875,11 @@ impl TrackBackgroundProcessorHelper {
                 BackgroundProcessorAudioPluginType::Clap(_) => {
 
                 }
+                BackgroundProcessorAudioPluginType::Sandboxed(sandboxed_plugin) => {
+                    // the sandbox keeps its own editor going - pick up what it has relayed from the plugin
+                    sandboxed_plugin.handle_sandbox_events();
+                }
+                BackgroundProcessorAudioPluginType::BuiltIn(_) => {}
             }
         }
     }
@@ -3368,6 +3894,11 @@ impl TrackBackgroundProcessorHelper {
                 BackgroundProcessorAudioPluginType::Clap(_) => {
 
                 }
+                BackgroundProcessorAudioPluginType::Sandboxed(sandboxed_plugin) => {
+                    // the sandbox keeps its own editor going - pick up what it has relayed from the plugin
+                    sandboxed_plugin.handle_sandbox_events();
+                }
+                BackgroundProcessorAudioPluginType::BuiltIn(_) => {}
             }
         }
     }
@@ -3375,7 +3906,7 @@ impl TrackBackgroundProcessorHelper {
     pub fn handle_host_events_from_plugins(&self) {
         if let Some(instrument_plugin) = self.instrument_plugin_instances.get(0) {
             match instrument_plugin {
-                BackgroundProcessorAudioPluginType::Vst24(_) => {
+                BackgroundProcessorAudioPluginType::Vst24(_) | BackgroundProcessorAudioPluginType::Sandboxed(_) => {
                     match instrument_plugin.rx_from_host().try_recv() {
                         Ok(event) => match event {
                             AudioPluginHostOutwardEvent::Automation(_track_uuid, plugin_uuid, is_instrument, param_index, param_value) => {
@@ -3395,6 +3926,7 @@ impl TrackBackgroundProcessorHelper {
                     }
                 }
                 BackgroundProcessorAudioPluginType::Vst3 => todo!(),
+                BackgroundProcessorAudioPluginType::BuiltIn(_) => {}
                 BackgroundProcessorAudioPluginType::Clap(clap_plugin) => {
                     match clap_plugin.host_receiver.try_recv() {
                         Ok(message) => match message {
@@ -3413,7 +3945,7 @@ impl TrackBackgroundProcessorHelper {
 
         for effect_plugin in self.effect_plugin_instances.iter() {
             match effect_plugin {
-                BackgroundProcessorAudioPluginType::Vst24(_) => {
+                BackgroundProcessorAudioPluginType::Vst24(_) | BackgroundProcessorAudioPluginType::Sandboxed(_) => {
                     match effect_plugin.rx_from_host().try_recv() {
                         Ok(event) => match event {
                             AudioPluginHostOutwardEvent::Automation(_track_uuid, plugin_uuid, is_instrument, param_index, param_value) => {
@@ -3432,7 +3964,7 @@ impl TrackBackgroundProcessorHelper {
                         Err(_) => (),
                     }
                 }
-                BackgroundProcessorAudioPluginType::Vst3 => {}
+                BackgroundProcessorAudioPluginType::Vst3 | BackgroundProcessorAudioPluginType::BuiltIn(_) => {}
                 BackgroundProcessorAudioPluginType::Clap(clap_plugin) => {
                     match clap_plugin.host_receiver.try_recv() {
                         Ok(message) => match message {
@@ -3491,7 +4023,7 @@ impl TrackBackgroundProcessorHelper {
                         plugin_parameters.push((index, self.track_uuid.clone(), instrument_plugin.uuid(), params.get_parameter_name(index), params.get_parameter_label(index), params.get_parameter(index), params.get_parameter_text(index)));
                     }
                 }
-                BackgroundProcessorAudioPluginType::Vst3 => {}
+                BackgroundProcessorAudioPluginType::Vst3 | BackgroundProcessorAudioPluginType::BuiltIn(_) => {}
                 BackgroundProcessorAudioPluginType::Clap(instrument_plugin) => {
                     if let Some(params) = instrument_plugin.plugin.get_extension::<Params>() {
                         if let Ok(info) = params.info(&instrument_plugin.plugin) {
@@ -3510,6 +4042,12 @@ impl TrackBackgroundProcessorHelper {
                         }
                     }
                 }
+                BackgroundProcessorAudioPluginType::Sandboxed(instrument_plugin) => {
+                    let instrument_uuid = instrument_plugin.uuid();
+                    for (index, name, label, value, text) in instrument_plugin.parameters().into_iter() {
+                        plugin_parameters.push((index, self.track_uuid.clone(), instrument_uuid, name, label, value, text));
+                    }
+                }
             }
 
             match self.tx_vst_thread.send(TrackBackgroundProcessorOutwardEvent::InstrumentParameters(plugin_parameters)) {
@@ -3537,10 +4075,15 @@ impl TrackBackgroundProcessorHelper {
                                 plugin_parameters.push((self.request_effect_params_for_uuid.clone(), index, params.get_parameter_name(index), params.get_parameter_label(index), params.get_parameter(index), params.get_parameter_text(index)));
                             }
                         }
-                        BackgroundProcessorAudioPluginType::Vst3 => {}
+                        BackgroundProcessorAudioPluginType::Vst3 | BackgroundProcessorAudioPluginType::BuiltIn(_) => {}
                         BackgroundProcessorAudioPluginType::Clap(_effect) => {
 
                         }
+                        BackgroundProcessorAudioPluginType::Sandboxed(effect) => {
+                            for (index, name, label, value, text) in effect.parameters().into_iter() {
+                                plugin_parameters.push((self.request_effect_params_for_uuid.clone(), index, name, label, value, text));
+                            }
+                        }
                     }
                     break;
                 }
@@ -3555,7 +4098,12 @@ impl TrackBackgroundProcessorHelper {
 
     pub fn process_plugin_events(&mut self) {
         // get the events for this block
-        let (mut events, param_events) = self.process_events();
+        let mut events = self.process_events();
+        self.add_live_midi_track_events(&mut events);
+        self.instrument_vst_midi_events.clear();
+        if self.mute {
+            self.parameter_automation.clear();
+        }
 
         // route outgoing events
         if events.len() > 0 {
@@ -3636,7 +4184,7 @@ impl TrackBackgroundProcessorHelper {
                             }
                         }
                         if !effect_events.is_empty() && !self.mute {
-                            if let Some(effect_plugin) = self.effect_plugin_instances.iter_mut().find(|effect| effect.uuid().to_string() == effect_uuid) {
+                            if let Some(effect_plugin) = Uuid::parse_str(effect_uuid.as_str()).ok().and_then(|effect_uuid| self.effect_plugin_instances.iter_mut().find(|effect| effect.uuid() == effect_uuid)) {
                                 match effect_plugin {
                                     BackgroundProcessorAudioPluginType::Vst24(effect_plugin) => {
                                         let vst_plugin_instance = effect_plugin.vst_plugin_instance_mut();
@@ -3644,8 +4192,14 @@ impl TrackBackgroundProcessorHelper {
                                         vst_plugin_instance.process_events(self.midi_sender.events());
                                     }
                                     BackgroundProcessorAudioPluginType::Vst3 => {}
-                                    BackgroundProcessorAudioPluginType::Clap(_effect_plugin) => {
-
+                                    BackgroundProcessorAudioPluginType::Clap(effect_plugin) => {
+                                        effect_plugin.process_events(&effect_events);
+                                    }
+                                    BackgroundProcessorAudioPluginType::Sandboxed(effect_plugin) => {
+                                        effect_plugin.queue_midi_events(&DAWUtils::convert_events_with_timing_in_frames_to_vst(&effect_events, 0));
+                                    }
+                                    BackgroundProcessorAudioPluginType::BuiltIn(effect_plugin) => {
+                                        effect_plugin.process_events(&effect_events);
                                     }
                                 }
                             }
@@ -3658,69 +4212,45 @@ impl TrackBackgroundProcessorHelper {
         if !events.is_empty() && !self.mute {
             if let Some(instrument_plugin) = self.instrument_plugin_instances.get_mut(0) {
                 match instrument_plugin {
-                    BackgroundProcessorAudioPluginType::Vst24(instrument_plugin) => {
-                        let vst_midi_events = DAWUtils::convert_events_with_timing_in_frames_to_vst(
-                            &events, 
-                            0);
-                        let vst_plugin_instance = instrument_plugin.vst_plugin_instance_mut();
-                        self.midi_sender.store_events(vst_midi_events);
-                        vst_plugin_instance.process_events(self.midi_sender.events());
+                    BackgroundProcessorAudioPluginType::Vst24(_) => {
+                        // handed to the plugin with the sub block they fall in when the instrument is processed
+                        self.instrument_vst_midi_events.extend(DAWUtils::convert_events_with_timing_in_frames_to_vst(&events, 0));
                     }
                     BackgroundProcessorAudioPluginType::Vst3 => {}
                     BackgroundProcessorAudioPluginType::Clap(instrument_plugin) => {
                         instrument_plugin.process_events(&events);
                     }
-                }
-            }
-        }
-
-        if !param_events.is_empty() && !self.mute {
-            if let Some(instrument_plugin) = self.instrument_plugin_instances.get_mut(0) {
-                match instrument_plugin {
-                    BackgroundProcessorAudioPluginType::Vst24(instrument_plugin) => {
-                        let vst_plugin_instance = instrument_plugin.vst_plugin_instance_mut();
-                        let param_object = vst_plugin_instance.get_parameter_object();
-                        // send parameters to the track instrument
-                        for event in param_events.iter() {
-                            if event.plugin_uuid() == instrument_plugin.uuid().to_string() {
-                                param_object.set_parameter(event.index, event.value());
-                            }
-                        }
+                    BackgroundProcessorAudioPluginType::Sandboxed(instrument_plugin) => {
+                        instrument_plugin.queue_midi_events(&DAWUtils::convert_events_with_timing_in_frames_to_vst(&events, 0));
                     }
-                    BackgroundProcessorAudioPluginType::Vst3 => {}
-                    BackgroundProcessorAudioPluginType::Clap(_instrument_plugin) => {
-                        
+                    BackgroundProcessorAudioPluginType::BuiltIn(instrument_plugin) => {
+                        instrument_plugin.process_events(&events);
                     }
                 }
             }
+        }
 
-            // send parameters to the track effects
+        // vst24 parameter changes are made between sub blocks when the plugins are processed
+        if !self.parameter_automation.is_empty() {
+            if let Some(BackgroundProcessorAudioPluginType::Clap(instrument_plugin)) = self.instrument_plugin_instances.get_mut(0) {
+                instrument_plugin.process_parameter_changes(self.parameter_automation.plugin_changes(&instrument_plugin.uuid()));
+            }
             for effect_plugin in self.effect_plugin_instances.iter_mut() {
-                match effect_plugin {
-                    BackgroundProcessorAudioPluginType::Vst24(effect_plugin) => {
-                        let vst_plugin_instance = effect_plugin.vst_plugin_instance_mut();
-                        let param_object = vst_plugin_instance.get_parameter_object();
-                        for event in param_events.iter() {
-                            if event.plugin_uuid() == effect_plugin.uuid().to_string() {
-                                param_object.set_parameter(event.index, event.value());
-                            }
-                        }
-                    }
-                    BackgroundProcessorAudioPluginType::Vst3 => {}
-                    BackgroundProcessorAudioPluginType::Clap(_effect_plugin) => {
-
-                    }
+                if let BackgroundProcessorAudioPluginType::Clap(effect_plugin) = effect_plugin {
+                    effect_plugin.process_parameter_changes(self.parameter_automation.plugin_changes(&effect_plugin.uuid()));
                 }
             }
         }
     }
 
-    fn process_events(&mut self) -> (Vec<TrackEvent>, Vec<PluginParameter>) {
+    /// The track events for this block. The block's plugin parameter changes go to the parameter automation.
+    pub fn process_events(&mut self) -> Vec<TrackEvent> {
         let mut events = vec![];
         let param_event_blocks_ref = &self.param_event_blocks;
-        let mut param_events = vec![];
         let mut transition_happened = false;
 
+        self.parameter_automation.clear();
+
         if self.play {
             match &self.track_event_blocks {
                 Some(event_blocks) => {
@@ -3803,9 +4333,9 @@ impl TrackBackgroundProcessorHelper {
                         }
                         if let Some(param_event_blocks) = param_event_blocks_ref {
                             if let Some(param_event_block) = param_event_blocks.get(param_block_index as usize) {
-                                for event in param_event_block {
-                                    param_events.push(event.clone());
-                                }
+                                // parameter positions are absolute
+                                let block_start_frame = param_block_index as f64 * self.block_size as f64;
+                                self.parameter_automation.set_block_changes(param_event_block, block_start_frame, self.block_size);
                             }
                         }
                     }
@@ -3826,13 +4356,35 @@ impl TrackBackgroundProcessorHelper {
         }
         self.audio_plugin_immediate_events.clear();
 
-        (events, param_events)
+        events
     }
 
-    pub fn process_audio_events(&mut self) {
-        let (events, param_events) = self.process_events();
+    fn read_live_midi_events(&mut self) -> usize {
+        match self.live_midi_consumer.read(&mut self.live_midi_buffer) {
+            Ok(read) => read,
+            Err(_) => 0, // nothing played
+        }
+    }
 
-        if !events.is_empty() && !self.mute {
+    /// Add the live midi in to the block's events at the frame it arrived within the jack period.
+    fn add_live_midi_track_events(&mut self, events: &mut Vec<TrackEvent>) {
+        let read = self.read_live_midi_events();
+        let last_frame = self.block_size.saturating_sub(1) as u32;
+        for (frame, status, data1, data2) in self.live_midi_buffer[..read].iter() {
+            if let Some(event) = track_event_from_midi_bytes((*frame).min(last_frame) as f64, [*status, *data1, *data2]) {
+                events.push(event);
+            }
+        }
+    }
+
+    pub fn process_audio_events(&mut self) {
+        let mut events = self.process_events();
+        self.add_live_midi_track_events(&mut events);
+        if self.mute {
+            self.parameter_automation.clear();
+        }
+
+        if !events.is_empty() && !self.mute {
             // look at the events and determine when to start playing or stop a sample.
             // FIXME this only has block resolution at the moment - will need a start delay and end delay field members to get frame accuracy
             for event in events.iter() {
@@ -3847,23 +4399,11 @@ impl TrackBackgroundProcessorHelper {
             }
         }
 
-        if !param_events.is_empty() && !self.mute {
-            // send parameters to the track effects
+        // vst24 parameter changes are made between sub blocks when the effects are processed
+        if !self.parameter_automation.is_empty() {
             for effect_plugin in self.effect_plugin_instances.iter_mut() {
-                match effect_plugin {
-                    BackgroundProcessorAudioPluginType::Vst24(effect_plugin) => {
-                        let vst_plugin_instance = effect_plugin.vst_plugin_instance_mut();
-                        let param_object = vst_plugin_instance.get_parameter_object();
-                        for event in param_events.iter() {
-                            if event.plugin_uuid() == effect_plugin.uuid().to_string() {
-                                param_object.set_parameter(event.index, event.value());
-                            }
-                        }
-                    }
-                    BackgroundProcessorAudioPluginType::Vst3 => {}
-                    BackgroundProcessorAudioPluginType::Clap(_effect_plugin) => {
-
-                    }
+                if let BackgroundProcessorAudioPluginType::Clap(effect_plugin) = effect_plugin {
+                    effect_plugin.process_parameter_changes(self.parameter_automation.plugin_changes(&effect_plugin.uuid()));
                 }
             }
         }
@@ -3871,7 +4411,7 @@ impl TrackBackgroundProcessorHelper {
 
     pub fn process_jack_midi_out_events(&mut self, producer: &mut Producer<(u32, u8, u8, u8, bool)>) {
         // get the events for this block
-        let (track_events, _) = self.process_events();
+        let track_events = self.process_events();
         let mut jack_events: Vec<(u32, u8, u8, u8, bool)> = vec![];
 
         for event in track_events.iter() {
@@ -3901,6 +4441,13 @@ impl TrackBackgroundProcessorHelper {
         }
         self.jack_midi_out_immediate_events.clear();
 
+        // live midi in is passed straight through - the audio layer has already put it on the track's midi channel
+        let read = self.read_live_midi_events();
+        let last_frame = self.block_size.saturating_sub(1) as u32;
+        for (frame, status, data1, data2) in self.live_midi_buffer[..read].iter() {
+            jack_events.push(((*frame).min(last_frame), *status, *data1, *data2, true));
+        }
+
         // zero the buffer
         for index in 0..self.jack_midi_out_buffer.len() {
             self.jack_midi_out_buffer[index].0 = 0;
@@ -3954,71 +4501,57 @@ impl TrackBackgroundProcessorHelper {
     }
 
     pub fn send_audio_consumer_details_to_jack(&self, audio_consumer_details: AudioConsumerDetails<f32>) {
-        match self.tx_audio.send(AudioLayerInwardEvent::NewAudioConsumer(audio_consumer_details)) {
+        match self.tx_audio.try_send(AudioLayerInwardEvent::NewAudioConsumer(audio_consumer_details)) {
             Ok(_) => (),
-            Err(_) => info!("AudioPlugin could not send audio consumer detail."),
+            Err(_) => error!("AudioPlugin could not send audio consumer detail."),
         }
     }
 
     pub fn send_midi_consumer_details_to_jack(&self, midi_consumer_details: MidiConsumerDetails<(u32, u8, u8, u8, bool)>) {
-        match self.tx_audio.send(AudioLayerInwardEvent::NewMidiConsumer(midi_consumer_details)) {
+        match self.tx_audio.try_send(AudioLayerInwardEvent::NewMidiConsumer(midi_consumer_details)) {
             Ok(_) => info!("Sent midi consumer detail to the audio layer."),
-            Err(_) => info!("AudioPlugin could not send midi consumer detail."),
+            Err(_) => error!("AudioPlugin could not send midi consumer detail."),
         }
     }
 
     pub fn process_sample(&mut self, audio_buffer: &mut AudioBuffer<f32>, block_size: i32, left_pan: f32, right_pan: f32) {
         if self.sample_is_playing {
-            let sample_channels = if let Some(sample) = self.sample() {
-                sample.channels() as usize
-            } else {
-                0
-            };
-            let sample_length = if let Some(sample) = self.sample() {
-                sample.samples().len()
-            } else {
-                0
-            };
-
-            // let mut left_samples: Vec<f32> = vec![];
-            // let mut right_samples: Vec<f32> = vec![];
-            let sample_current_frame = self.sample_current_frame;
+            let sample_current_frame = self.sample_current_frame as usize;
             let volume = self.volume;
             let (_, mut outputs_32) = audio_buffer.split();
             let out_left = outputs_32.get_mut(0);
             let out_right = outputs_32.get_mut(1);
-            if let Some(sample) = self.sample_mut() {
-                for frame in 0..block_size {
-                    let left_channel_sample_index = (frame + sample_current_frame) as usize * sample_channels;
-                    let right_channel_sample_index = left_channel_sample_index + 1;
-
-                    if left_channel_sample_index < sample_length {
-                        if sample.channels() == 1 {
-                            // left_samples.push(*sample.samples().get(left_channel_sample_index).unwrap());
-                            // right_samples.push(*sample.samples().get(left_channel_sample_index).unwrap());
-                            out_left[frame as usize] += *sample.samples().get(left_channel_sample_index).unwrap() * volume * 2.0 * left_pan;
-                            out_right[frame as usize] += *sample.samples().get(left_channel_sample_index).unwrap() * volume * 2.0 * right_pan;
-                        } else {
-                            // left_samples.push(*sample.samples().get(left_channel_sample_index).unwrap());
-                            // right_samples.push(*sample.samples().get(right_channel_sample_index).unwrap());
-                            out_left[frame as usize] += *sample.samples().get(left_channel_sample_index).unwrap() * volume * 2.0 * left_pan;
-                            out_right[frame as usize] += *sample.samples().get(right_channel_sample_index).unwrap() * volume * 2.0 * right_pan;
-                        }
-                    }
-                }
+            if let Some(sample) = self.sample() {
+                let frames = (block_size.max(0) as usize).min(out_left.len()).min(out_right.len());
+                sample.mix_into(sample_current_frame, &mut out_left[..frames], &mut out_right[..frames], volume * 2.0 * left_pan, volume * 2.0 * right_pan);
             }
 
             self.sample_current_frame += block_size;
+        }
+    }
+
+    pub fn frozen(&self) -> bool {
+        self.frozen_audio.is_some()
+    }
 
-            // let mut frame: usize = 0;
-            // let (_, mut outputs_32) = audio_buffer.split();
-            // let out_left = outputs_32.get_mut(0);
-            // let out_right = outputs_32.get_mut(1);
-            // for left_sample in left_samples.iter() {
-            //     out_left[frame] += *left_sample * self.volume * 2.0 * left_pan;
-            //     out_right[frame] += *right_samples.get(frame).unwrap() as f32 * self.volume * 2.0 * right_pan;
-            //     frame += 1;
-            // }
+    /// Play the frozen audio for the given block in place of the instrument and effects. The audio was rendered before
+    /// the volume and pan were applied so those still apply. It was also rendered with the output delay compensation of
+    /// the time so it is read earlier or later to match the track's current output delay.
+    pub fn process_frozen_audio(&mut self, audio_buffer: &mut AudioBuffer<f32>, block_index: i32) {
+        let (_, mut outputs_32) = audio_buffer.split();
+        let out_left = outputs_32.get_mut(0);
+        let out_right = outputs_32.get_mut(1);
+        out_left.fill(0.0);
+        out_right.fill(0.0);
+
+        if self.play && !self.mute && block_index >= 0 {
+            if let Some(frozen_audio) = self.frozen_audio.as_ref() {
+                let frames = self.block_size.min(out_left.len()).min(out_right.len());
+                let start_frame = (block_index as usize * self.block_size + self.frozen_audio_output_delay) as i64 - self.delay_compensator.output.left.delay() as i64;
+                // the part of the block before the start of the frozen audio stays silent
+                let skip = (-start_frame).clamp(0, frames as i64) as usize;
+                frozen_audio.mix_into(start_frame.max(0) as usize, &mut out_left[skip..frames], &mut out_right[skip..frames], 1.0, 1.0);
+            }
         }
     }
 
@@ -4074,300 +4607,565 @@ impl TrackBackgroundProcessorHelper {
     pub fn add_track_event_inward_routing(&mut self, track_event_routing: TrackEventRouting, track_event_source: Consumer<TrackEvent>) {
         self.track_events_inward_consumers.insert(track_event_routing.uuid(), track_event_source);
         self.track_events_inward_routings.insert(track_event_routing.uuid(), track_event_routing);
+        self.source_track_uuids_changed = true;
     }
 
     pub fn remove_track_event_inward_routing(&mut self, route_uuid: String) {
         self.track_events_inward_consumers.remove(&route_uuid);
         self.track_events_inward_routings.remove(&route_uuid);
+        self.source_track_uuids_changed = true;
     }
 
-    pub fn add_audio_inward_routing(&mut self, audio_routing: AudioRouting, audio_sources: (Consumer<f32>, Consumer<f32>)) {
-        self.audio_inward_consumers.insert(audio_routing.uuid(), audio_sources);
+    pub fn add_audio_inward_routing(&mut self, audio_routing: AudioRouting, audio_bus_receiver: AudioBusReceiver) {
+        self.audio_inward_buses.insert(audio_routing.uuid(), audio_bus_receiver);
         self.audio_inward_routings.insert(audio_routing.uuid(), audio_routing);
+        self.source_track_uuids_changed = true;
     }
 
     pub fn remove_audio_inward_routing(&mut self, route_uuid: String) {
-        self.audio_inward_consumers.remove(&route_uuid);
+        self.audio_inward_buses.remove(&route_uuid);
         self.audio_inward_routings.remove(&route_uuid);
+        self.source_track_uuids_changed = true;
     }
-}
 
-#[derive(Default)]
-pub struct InstrumentTrackBackgroundProcessor{
+    pub fn processing_mode(&self) -> TrackBackgroundProcessorMode {
+        match self.track_thread_coast.lock() {
+            Ok(mode) => *mode,
+            Err(_) => TrackBackgroundProcessorMode::AudioOut,
+        }
+    }
+
+    /// Get the uuids of the tracks routing events or audio into this track.
+    pub fn source_track_uuids(&self) -> Vec<String> {
+        let mut source_track_uuids = vec![];
+
+        for track_event_routing in self.track_events_inward_routings.values() {
+            let source_track_uuid = match &track_event_routing.source {
+                TrackEventRoutingNodeType::Track(track_uuid) => track_uuid,
+                TrackEventRoutingNodeType::Instrument(track_uuid, _) => track_uuid,
+                TrackEventRoutingNodeType::Effect(track_uuid, _) => track_uuid,
+            };
+            source_track_uuids.push(source_track_uuid.clone());
+        }
+        for audio_routing in self.audio_inward_routings.values() {
+            let source_track_uuid = match &audio_routing.source {
+                AudioRoutingNodeType::Track(track_uuid) => track_uuid,
+                AudioRoutingNodeType::Instrument(track_uuid, _, _, _) => track_uuid,
+                AudioRoutingNodeType::Effect(track_uuid, _, _, _) => track_uuid,
+            };
+            source_track_uuids.push(source_track_uuid.clone());
+        }
+
+        source_track_uuids
+    }
+
+    pub fn take_source_track_uuids_changed(&mut self) -> bool {
+        std::mem::take(&mut self.source_track_uuids_changed)
+    }
 }
 
-impl InstrumentTrackBackgroundProcessor {
+// plugin instances and editors hold raw pointers - a track's processing is moved to its scheduler worker before its first
+// block and is only ever run on that worker's thread from then on
+unsafe impl Send for TrackBackgroundProcessorHelper {}
 
-    pub fn new() -> Self {
-        InstrumentTrackBackgroundProcessor {
+pub const TRACK_PROCESSING_HOST_BUFFER_CHANNELS: usize = 32;
+const TRACK_PROCESSING_COAST_INTERVAL: Duration = Duration::from_millis(100);
+
+/// Is there less than a block waiting in the ring buffer i.e. does jack need another block soon.
+/// Keeping at most one block queued keeps the latency at one block whatever the ring buffer capacity is.
+fn track_ring_buffer_needs_block(ring_buffer: &SpscRb<f32>, block_size: usize) -> bool {
+    ring_buffer.count() < block_size && ring_buffer.slots_free() >= block_size
+}
+
+/// Has the track got somewhere to put another block of audio for the current mode.
+/// Coasting tracks only process a block every TRACK_PROCESSING_COAST_INTERVAL.
+fn track_processing_ready_for_block(
+    mode: TrackBackgroundProcessorMode,
+    block_size: usize,
+    ring_buffer_left: &SpscRb<f32>,
+    ring_buffer_right: &SpscRb<f32>,
+    render_ring_buffer_left: &SpscRb<f32>,
+    render_ring_buffer_right: &SpscRb<f32>,
+    last_coast_block: &mut Instant,
+) -> bool {
+    match mode {
+        TrackBackgroundProcessorMode::AudioOut =>
+            track_ring_buffer_needs_block(ring_buffer_left, block_size) && track_ring_buffer_needs_block(ring_buffer_right, block_size),
+        TrackBackgroundProcessorMode::Render =>
+            render_ring_buffer_left.slots_free() >= block_size && render_ring_buffer_right.slots_free() >= block_size,
+        TrackBackgroundProcessorMode::Coast => if last_coast_block.elapsed() >= TRACK_PROCESSING_COAST_INTERVAL {
+            *last_coast_block = Instant::now();
+            true
+        }
+        else {
+            false
+        }
+    }
+}
+
+/// Reallocate a track's processing buffers when the block size changes - host buffers bind to whole channel vectors.
+fn resize_track_processing_buffers(
+    block_size: usize,
+    inputs: &mut Vec<Vec<f32>>,
+    outputs: &mut Vec<Vec<f32>>,
+) {
+    if outputs.first().map_or(true, |channel| channel.len() != block_size) {
+        *inputs = vec![vec![0.0; block_size]; TRACK_PROCESSING_HOST_BUFFER_CHANNELS];
+        *outputs = vec![vec![0.0; block_size]; TRACK_PROCESSING_HOST_BUFFER_CHANNELS];
+    }
+}
+
+/// Sum the audio of every routing to the destination into the left and right channels from the source tracks' buses,
+/// each through its own delay compensation. The channels are only cleared, and true returned, if anything is routed to
+/// the destination.
+fn mix_routed_audio<F: Fn(&AudioRoutingNodeType) -> bool>(
+    audio_inward_routings: &HashMap<String, AudioRouting>,
+    audio_inward_buses: &mut HashMap<String, AudioBusReceiver>,
+    routing_delay_lines: &mut HashMap<String, StereoDelayLine>,
+    is_destination: F,
+    left: &mut [f32],
+    right: &mut [f32],
+) -> bool {
+    let mut routed = false;
+    for (audio_route_uuid, audio_routing) in audio_inward_routings.iter() {
+        if !is_destination(&audio_routing.destination) {
+            continue;
+        }
+        if let Some(audio_bus_receiver) = audio_inward_buses.get_mut(audio_route_uuid) {
+            if !routed {
+                left.fill(0.0);
+                right.fill(0.0);
+                routed = true;
+            }
+            audio_bus_receiver.mix_into(left, right, routing_delay_lines.get_mut(audio_route_uuid));
         }
     }
+    routed
+}
 
-    pub fn start_processing(&self,
-                            track_uuid: String,
-                            tx_audio: crossbeam_channel::Sender<AudioLayerInwardEvent>,
-                            rx_vst_thread: Receiver<TrackBackgroundProcessorInwardEvent>,
-                            tx_vst_thread: Sender<TrackBackgroundProcessorOutwardEvent>,
-                            track_thread_coast: Arc<Mutex<TrackBackgroundProcessorMode>>,
-                            volume: f32,
-                            pan: f32,
-                            vst_host_time_info: Arc<parking_lot::RwLock<TimeInfo>>,
-    ) {
-        match ThreadBuilder::default()
-            .name(format!("InstrumentTrackBackgroundProcessor: {}", track_uuid.as_str()))
-            .priority(ThreadPriority::Crossplatform(95.try_into().unwrap()))
-            .spawn(move |result| {
-                match result {
-                    Ok(_) => info!("Thread set to max priority: 95."),
-                    Err(error) => info!("Could not set thread to max priority: {:?}.", error),
+/// Write the track's audio to its bus for the tracks it is routed to - they read it when they next process a block.
+fn write_routed_audio(track_background_processor_helper: &TrackBackgroundProcessorHelper, audio_buffer: &mut AudioBuffer<f32>) {
+    if track_background_processor_helper.audio_outward_routings.is_empty() {
+        return;
+    }
+    if let Some(audio_bus) = track_background_processor_helper.audio_outward_bus.as_ref() {
+        let (_, outputs_32) = audio_buffer.split();
+        audio_bus.write(outputs_32.get(0), outputs_32.get(1));
+    }
+}
+
+/// Process a vst24 plugin in sub blocks split at its parameter changes so that automation lands on the frame it was
+/// written for rather than at the start of the block. Midi events are handed to the plugin with the sub block they fall in.
+pub fn process_vst24_plugin_in_sub_blocks<'a>(
+    vst_plugin_instance: &mut PluginInstance,
+    audio_buffer: &mut AudioBuffer<f32>,
+    parameter_changes: impl Iterator<Item = &'a PluginParameter>,
+    midi_events: &[MidiEvent],
+    midi_sender: &mut SendEventBuffer,
+) {
+    let block_size = audio_buffer.samples();
+    let param_object = vst_plugin_instance.get_parameter_object();
+    let mut parameter_changes = parameter_changes.peekable();
+    let mut start = 0;
+
+    while start < block_size {
+        while let Some(change) = parameter_changes.next_if(|change| change.position() as usize <= start) {
+            param_object.set_parameter(change.index, change.value());
+        }
+        let end = match parameter_changes.peek() {
+            Some(change) => (change.position() as usize).min(block_size),
+            None => block_size,
+        };
+
+        let last_sub_block = end == block_size;
+        if midi_events.iter().any(|event| event.delta_frames as usize >= start && (last_sub_block || (event.delta_frames as usize) < end)) {
+            midi_sender.store_events(midi_events.iter()
+                .filter(|event| event.delta_frames as usize >= start && (last_sub_block || (event.delta_frames as usize) < end))
+                .map(|event| {
+                    let mut event = *event;
+                    event.delta_frames -= start as i32;
+                    event
+                }));
+            vst_plugin_instance.process_events(midi_sender.events());
+        }
+
+        if start == 0 && last_sub_block {
+            vst_plugin_instance.process(audio_buffer);
+        }
+        else {
+            let mut input_pointers = [std::ptr::null::<f32>(); TRACK_PROCESSING_HOST_BUFFER_CHANNELS];
+            let mut output_pointers = [std::ptr::null_mut::<f32>(); TRACK_PROCESSING_HOST_BUFFER_CHANNELS];
+            let (input_count, output_count) = {
+                let (inputs, mut outputs) = audio_buffer.split();
+                let input_count = inputs.len().min(TRACK_PROCESSING_HOST_BUFFER_CHANNELS);
+                let output_count = outputs.len().min(TRACK_PROCESSING_HOST_BUFFER_CHANNELS);
+                for channel in 0..input_count {
+                    input_pointers[channel] = inputs.get(channel)[start..].as_ptr();
+                }
+                for channel in 0..output_count {
+                    output_pointers[channel] = outputs.get_mut(channel)[start..].as_mut_ptr();
                 }
+                (input_count, output_count)
+            };
+            // the pointers are into the host buffer channels which outlive the sub block
+            let mut sub_block = unsafe { AudioBuffer::from_raw(input_count, output_count, input_pointers.as_ptr(), output_pointers.as_mut_ptr(), end - start) };
+            vst_plugin_instance.process(&mut sub_block);
+        }
 
-                const BLOCK_SIZE: usize = 1024;
-                const HOST_BUFFER_CHANNELS: usize = 32;
-
-                let render_ring_buffer_left: SpscRb<f32> = SpscRb::new(BLOCK_SIZE);
-                let render_producer_left = render_ring_buffer_left.producer();
-                let render_consumer_left = render_ring_buffer_left.consumer();
-                let render_ring_buffer_right: SpscRb<f32> = SpscRb::new(BLOCK_SIZE);
-                let render_producer_right = render_ring_buffer_right.producer();
-                let render_consumer_right = render_ring_buffer_right.consumer();
-                let track_render_audio_consumer_details =
-                    AudioConsumerDetails::<f32>::new(track_uuid.clone(), render_consumer_left, render_consumer_right);
-
-                let ring_buffer_left: SpscRb<f32> = SpscRb::new(BLOCK_SIZE);
-                let producer_left = ring_buffer_left.producer();
-                let consumer_left = ring_buffer_left.consumer();
-                let ring_buffer_right: SpscRb<f32> = SpscRb::new(BLOCK_SIZE);
-                let producer_right = ring_buffer_right.producer();
-                let consumer_right = ring_buffer_right.consumer();
-                let audio_consumer_details = AudioConsumerDetails::<f32>::new(track_uuid.clone(), consumer_left, consumer_right);
-
-                let mut host_buffer: HostBuffer<f32> = HostBuffer::new(HOST_BUFFER_CHANNELS, HOST_BUFFER_CHANNELS);
-                let mut host_buffer_swapped: HostBuffer<f32> = HostBuffer::new(HOST_BUFFER_CHANNELS, HOST_BUFFER_CHANNELS);
-                let mut inputs = vec![vec![0.0; 1024]; HOST_BUFFER_CHANNELS];
-                let mut outputs = vec![vec![0.0; 1024]; HOST_BUFFER_CHANNELS];
-                let mut audio_buffer = host_buffer.bind(&inputs, &mut outputs);
-                let mut audio_buffer_swapped = host_buffer_swapped.bind(&outputs, &mut inputs);
-
-                let mut track_background_processor_helper =
-                    TrackBackgroundProcessorHelper::new(
-                        track_uuid.clone(),
-                        tx_audio.clone(),
-                        rx_vst_thread,
-                        tx_vst_thread.clone(),
-                        track_thread_coast.clone(),
-                        volume,
-                        pan,
-                        GeneralTrackType::InstrumentTrack,
-                        vst_host_time_info,
-                    );
-
-                let mut routed_audio_left_buffer: [f32; BLOCK_SIZE] = [0.0; BLOCK_SIZE];
-                let mut routed_audio_right_buffer: [f32; BLOCK_SIZE] = [0.0; BLOCK_SIZE];
-
-
-                track_background_processor_helper.send_render_audio_consumer_details_to_app(track_render_audio_consumer_details);
-                track_background_processor_helper.send_audio_consumer_details_to_jack(audio_consumer_details);
-                // track_background_processor_helper.send_midi_consumer_details_to_jack(midi_consumer_details);
-
-                loop {
-                    track_background_processor_helper.handle_incoming_events();
-                    track_background_processor_helper.refresh_instrument_plugin_editor();
-                    track_background_processor_helper.refresh_effect_plugin_editors();
-                    track_background_processor_helper.handle_host_events_from_plugins();
-                    track_background_processor_helper.handle_request_plugin_preset_data();
-                    track_background_processor_helper.handle_request_effect_plugins_parameters();
-                    // track_background_processor_helper.dump_play_info();
-                    // track_background_processor_helper.process_plugin_events();
-                    track_background_processor_helper.process_plugin_events();
-                    // track_background_processor_helper.process_plugin_audio(); - having problems with life times
-
-                    // couldn't push the following into a member method because of life time issues
-                    let ppq_pos = ((track_background_processor_helper.block_index * 1024) as f64  * 140.0 / (60.0 * 44100.0)) + 1.0;
-                    let sample_position = (track_background_processor_helper.block_index * 1024) as f64;
-
-                    if let Some(instrument_plugin) = track_background_processor_helper.instrument_plugin_instances.get_mut(0) {
-                        match instrument_plugin {
-                            BackgroundProcessorAudioPluginType::Vst24(instrument_plugin) => {
-                                if let Ok(mut vst_host) = instrument_plugin.host_mut().lock() {
-                                    vst_host.set_ppq_pos(ppq_pos);
-                                    vst_host.set_sample_position(sample_position);
-                                }
-                                let vst_plugin_instance = instrument_plugin.vst_plugin_instance_mut();
-                                vst_plugin_instance.process(&mut audio_buffer);
-                            }
-                            BackgroundProcessorAudioPluginType::Vst3 => {}
-                            BackgroundProcessorAudioPluginType::Clap(instrument_plugin) => {
-                                instrument_plugin.process(&mut audio_buffer, false);
+        start = end;
+    }
+}
 
-                                if let Some(_xid) = instrument_plugin.xid() {
-                                    if let Some(timer_support) = instrument_plugin.plugin.get_extension::<TimerSupport>() {
-                                        timer_support.on_timer(&instrument_plugin.plugin, 0);
-                                    }
-                                    if let Some(posix_fd_support) = instrument_plugin.plugin.get_extension::<PosixFDSupport>() {
-                                        posix_fd_support.on_fd(&instrument_plugin.plugin, 0, 0);
-                                    }
-                                }
-                            }
-                        }
-                    }
+/// The per block processing for instrument and audio tracks. They only differ in what feeds the effects: the instrument
+/// plugin or the track's samples and the audio routed into it.
+pub struct PluginTrackProcessingTask {
+    track_background_processor_helper: TrackBackgroundProcessorHelper,
+    host_buffer: HostBuffer<f32>,
+    host_buffer_swapped: HostBuffer<f32>,
+    inputs: Vec<Vec<f32>>,
+    outputs: Vec<Vec<f32>>,
+    ring_buffer_left: SpscRb<f32>,
+    ring_buffer_right: SpscRb<f32>,
+    producer_left: Producer<f32>,
+    producer_right: Producer<f32>,
+    render_ring_buffer_left: SpscRb<f32>,
+    render_ring_buffer_right: SpscRb<f32>,
+    render_producer_left: Producer<f32>,
+    render_producer_right: Producer<f32>,
+    last_coast_block: Instant,
+}
 
-                    let mut swap = true;
-                    for effect in track_background_processor_helper.effect_plugin_instances.iter_mut() {
-                        // handle audio data routed to this effect
-                        for audio_route_uuid in track_background_processor_helper.audio_inward_routings.iter().find(|(_, audio_route)| match &audio_route.destination {
-                            AudioRoutingNodeType::Track(_) => false,
-                            AudioRoutingNodeType::Instrument(_, _, _, _) => false,
-                            AudioRoutingNodeType::Effect(_, effect_uuid, _, _) => effect.uuid().to_string() == effect_uuid.to_string(),
-                        }).map(|(_, audio_routing)| audio_routing.uuid()).iter() {
-                            if let Some((consumer_left, consumer_right)) = track_background_processor_helper.audio_inward_consumers.get_mut(audio_route_uuid) {
-                                let (_, mut outputs_32) = audio_buffer.split();
-
-                                for index in 0..routed_audio_left_buffer.len() {
-                                    routed_audio_left_buffer[index] = 0.0;
-                                    routed_audio_right_buffer[index] = 0.0;
-                                }
+// the host buffers hold pointers into inputs and outputs that are only used while a block is being processed
+unsafe impl Send for PluginTrackProcessingTask {}
 
-                                if let Ok(read) = consumer_left.read(&mut routed_audio_left_buffer) {
-                                    let left_channel = outputs_32.get_mut(2);
+impl PluginTrackProcessingTask {
+    pub fn new(track_background_processor_helper: TrackBackgroundProcessorHelper) -> Self {
+        let render_ring_buffer_left: SpscRb<f32> = SpscRb::new(TRACK_RENDER_RING_BUFFER_CAPACITY);
+        let render_ring_buffer_right: SpscRb<f32> = SpscRb::new(TRACK_RENDER_RING_BUFFER_CAPACITY);
+        let track_render_audio_consumer_details = AudioConsumerDetails::<f32>::new(
+            track_background_processor_helper.track_uuid.clone(), render_ring_buffer_left.consumer(), render_ring_buffer_right.consumer());
 
-                                    for index in 0..read {
-                                        left_channel[index] = routed_audio_left_buffer[index];
-                                    }
-                                }
+        let ring_buffer_left: SpscRb<f32> = SpscRb::new(TRACK_RING_BUFFER_CAPACITY);
+        let ring_buffer_right: SpscRb<f32> = SpscRb::new(TRACK_RING_BUFFER_CAPACITY);
+        let mut audio_consumer_details = AudioConsumerDetails::<f32>::new(
+            track_background_processor_helper.track_uuid.clone(), ring_buffer_left.consumer(), ring_buffer_right.consumer());
+        audio_consumer_details.set_telemetry(Some(track_background_processor_helper.telemetry.track()));
 
-                                if let Ok(read) = consumer_right.read(&mut routed_audio_right_buffer) {
-                                    let right_channel = outputs_32.get_mut(3);
+        track_background_processor_helper.send_render_audio_consumer_details_to_app(track_render_audio_consumer_details);
+        track_background_processor_helper.send_audio_consumer_details_to_jack(audio_consumer_details);
 
-                                    for index in 0..read {
-                                        right_channel[index] = routed_audio_right_buffer[index];
-                                    }
-                                }
-                            }
-                        }
+        Self {
+            track_background_processor_helper,
+            host_buffer: HostBuffer::new(TRACK_PROCESSING_HOST_BUFFER_CHANNELS, TRACK_PROCESSING_HOST_BUFFER_CHANNELS),
+            host_buffer_swapped: HostBuffer::new(TRACK_PROCESSING_HOST_BUFFER_CHANNELS, TRACK_PROCESSING_HOST_BUFFER_CHANNELS),
+            inputs: vec![vec![0.0; DEFAULT_BLOCK_SIZE]; TRACK_PROCESSING_HOST_BUFFER_CHANNELS],
+            outputs: vec![vec![0.0; DEFAULT_BLOCK_SIZE]; TRACK_PROCESSING_HOST_BUFFER_CHANNELS],
+            producer_left: ring_buffer_left.producer(),
+            producer_right: ring_buffer_right.producer(),
+            ring_buffer_left,
+            ring_buffer_right,
+            render_producer_left: render_ring_buffer_left.producer(),
+            render_producer_right: render_ring_buffer_right.producer(),
+            render_ring_buffer_left,
+            render_ring_buffer_right,
+            last_coast_block: Instant::now(),
+        }
+    }
+}
 
-                        let audio_buffer_in_use = if swap {
-                            &mut audio_buffer_swapped
-                        }
-                        else {
-                            &mut audio_buffer
-                        };
-                        swap = !swap;
+impl TrackProcessingTask for PluginTrackProcessingTask {
+    fn track_uuid(&self) -> String {
+        self.track_background_processor_helper.track_uuid.clone()
+    }
 
-                        match effect {
-                            BackgroundProcessorAudioPluginType::Vst24(effect) => {
-                                if let Ok(mut vst_host) = effect.host_mut().lock() {
-                                    vst_host.set_ppq_pos(ppq_pos);
-                                    vst_host.set_sample_position(sample_position);
-                                }
-                                effect.vst_plugin_instance_mut().process(audio_buffer_in_use);
-                            }
-                            BackgroundProcessorAudioPluginType::Vst3 => {}
-                            BackgroundProcessorAudioPluginType::Clap(effect) => {
-                                effect.process(audio_buffer_in_use, true);
+    fn source_track_uuids(&self) -> Vec<String> {
+        self.track_background_processor_helper.source_track_uuids()
+    }
 
-                                if let Some(_xid) = effect.xid() {
-                                    if let Some(timer_support) = effect.plugin.get_extension::<TimerSupport>() {
-                                        timer_support.on_timer(&effect.plugin, 0);
-                                    }
-                                    if let Some(posix_fd_support) = effect.plugin.get_extension::<PosixFDSupport>() {
-                                        posix_fd_support.on_fd(&effect.plugin, 0, 0);
-                                    }
-                                }
-                            }
+    fn source_track_uuids_changed(&mut self) -> bool {
+        self.track_background_processor_helper.take_source_track_uuids_changed()
+    }
+
+    fn keep_alive(&self) -> bool {
+        self.track_background_processor_helper.keep_alive
+    }
+
+    fn process_block(&mut self, cycle: TrackProcessingCycle) -> TrackProcessingTaskStatus {
+        let track_background_processor_helper = &mut self.track_background_processor_helper;
+        let instrument_track = matches!(track_background_processor_helper.track_type, GeneralTrackType::InstrumentTrack);
+
+        track_background_processor_helper.handle_incoming_events();
+        if instrument_track {
+            track_background_processor_helper.refresh_instrument_plugin_editor();
+        }
+        track_background_processor_helper.refresh_effect_plugin_editors();
+        if instrument_track {
+            track_background_processor_helper.handle_host_events_from_plugins();
+        }
+        track_background_processor_helper.handle_request_plugin_preset_data();
+        track_background_processor_helper.handle_request_effect_plugins_parameters();
+
+        let mode = match cycle {
+            TrackProcessingCycle::Offline => TrackBackgroundProcessorMode::Render,
+            TrackProcessingCycle::Live => track_background_processor_helper.processing_mode(),
+        };
+        if mode != TrackBackgroundProcessorMode::Render {
+            track_background_processor_helper.render_waiting_for_play = true;
+        }
+        let block_size = track_background_processor_helper.block_size;
+        if !track_processing_ready_for_block(mode, block_size, &self.ring_buffer_left, &self.ring_buffer_right, &self.render_ring_buffer_left, &self.render_ring_buffer_right, &mut self.last_coast_block) {
+            return TrackProcessingTaskStatus::Idle;
+        }
+        resize_track_processing_buffers(block_size, &mut self.inputs, &mut self.outputs);
+        let block_start = Instant::now();
+
+        let playing_block_index = track_background_processor_helper.block_index;
+        if instrument_track {
+            track_background_processor_helper.process_plugin_events();
+        }
+        else {
+            track_background_processor_helper.process_audio_events();
+        }
+
+        let mut audio_buffer = self.host_buffer.bind(&self.inputs, &mut self.outputs);
+        let mut audio_buffer_swapped = self.host_buffer_swapped.bind(&self.outputs, &mut self.inputs);
+
+        let sample_position = track_background_processor_helper.block_index as f64 * block_size as f64;
+        let ppq_pos = (sample_position * track_background_processor_helper.tempo / (60.0 * track_background_processor_helper.sample_rate)) + 1.0;
+        let (left_pan, right_pan) = DAWUtils::constant_power_stereo_pan(track_background_processor_helper.pan);
+
+        let mut swap = true;
+        if track_background_processor_helper.frozen() {
+            // the instrument and effects are left idle while the track is frozen
+            track_background_processor_helper.process_frozen_audio(&mut audio_buffer, playing_block_index);
+        }
+        else {
+            if !instrument_track {
+                // audio routed to this track plays in place of its samples
+                let use_sample_audio = {
+                    let (_, outputs_32) = audio_buffer.split();
+                    let (mut left_outputs, mut right_outputs) = outputs_32.split_at_mut(1);
+                    !mix_routed_audio(
+                        &track_background_processor_helper.audio_inward_routings,
+                        &mut track_background_processor_helper.audio_inward_buses,
+                        &mut track_background_processor_helper.delay_compensator.routings,
+                        |destination| matches!(destination, AudioRoutingNodeType::Track(_)),
+                        left_outputs.get_mut(0),
+                        right_outputs.get_mut(0))
+                };
+
+                if use_sample_audio {
+                    track_background_processor_helper.process_sample(&mut audio_buffer, block_size as i32, left_pan, right_pan);
+                }
+            }
+            else if let Some(instrument_plugin) = track_background_processor_helper.instrument_plugin_instances.get_mut(0) {
+                let plugin_start = Instant::now();
+                match instrument_plugin {
+                    BackgroundProcessorAudioPluginType::Vst24(instrument_plugin) => {
+                        if let Ok(mut vst_host) = instrument_plugin.host_mut().lock() {
+                            vst_host.set_ppq_pos(ppq_pos);
+                            vst_host.set_sample_position(sample_position);
                         }
+                        let instrument_uuid = instrument_plugin.uuid();
+                        process_vst24_plugin_in_sub_blocks(
+                            instrument_plugin.vst_plugin_instance_mut(),
+                            &mut audio_buffer,
+                            track_background_processor_helper.parameter_automation.plugin_changes(&instrument_uuid),
+                            &track_background_processor_helper.instrument_vst_midi_events,
+                            &mut track_background_processor_helper.midi_sender);
                     }
+                    BackgroundProcessorAudioPluginType::Vst3 => {}
+                    BackgroundProcessorAudioPluginType::Clap(instrument_plugin) => {
+                        instrument_plugin.process(&mut audio_buffer, false);
 
-                    let mode = match track_thread_coast.lock() {
-                        Ok(mode) => match *mode {
-                            TrackBackgroundProcessorMode::AudioOut => TrackBackgroundProcessorMode::AudioOut,
-                            TrackBackgroundProcessorMode::Coast => TrackBackgroundProcessorMode::Coast,
-                            TrackBackgroundProcessorMode::Render => TrackBackgroundProcessorMode::Render,
+                        if let Some(_xid) = instrument_plugin.xid() {
+                            if let Some(timer_support) = instrument_plugin.plugin.get_extension::<TimerSupport>() {
+                                timer_support.on_timer(&instrument_plugin.plugin, 0);
+                            }
+                            if let Some(posix_fd_support) = instrument_plugin.plugin.get_extension::<PosixFDSupport>() {
+                                posix_fd_support.on_fd(&instrument_plugin.plugin, 0, 0);
+                            }
                         }
-                        Err(_) => TrackBackgroundProcessorMode::AudioOut,
-                    };
-
-                    // swap to the last used audio buffer
-                    let (left_pan, right_pan) = DAWUtils::constant_power_stereo_pan(track_background_processor_helper.pan);
-                    let mut left_channel_level: f32 = 0.0;
-                    let mut right_channel_level: f32 = 0.0;
-                    let audio_buffer_in_use = if !swap {
-                        &mut audio_buffer_swapped
                     }
-                    else {
-                        &mut audio_buffer
-                    };
-                    // route to other audio destinations
-                    for (_, (producer_left, producer_right)) in track_background_processor_helper.audio_outward_producers.iter_mut() {
-                        let (_, mut outputs_32) = audio_buffer_in_use.split();
-                        let left_channel = outputs_32.get_mut(0);
-                        let mut index = 0;
-
-                        for index in 0..routed_audio_left_buffer.len() {
-                            routed_audio_left_buffer[index] = 0.0;
-                            routed_audio_right_buffer[index] = 0.0;
-                        }
+                    BackgroundProcessorAudioPluginType::Sandboxed(instrument_plugin) => {
+                        let instrument_uuid = instrument_plugin.uuid();
+                        instrument_plugin.process(
+                            &mut audio_buffer,
+                            track_background_processor_helper.parameter_automation.plugin_changes(&instrument_uuid),
+                            sample_position,
+                            ppq_pos);
+                    }
+                    BackgroundProcessorAudioPluginType::BuiltIn(instrument_plugin) => {
+                        instrument_plugin.process(&mut audio_buffer);
+                    }
+                }
+                track_background_processor_helper.telemetry.record_plugin(instrument_plugin.uuid(), plugin_start.elapsed());
+            }
 
-                        for left_frame in left_channel.iter() {
-                            routed_audio_left_buffer[index] = *left_frame;
-                            index += 1;
-                        }
+            // hold the instrument or sample output back so that it lines up with audio routed into the effects
+            {
+                let (_, mut outputs_32) = audio_buffer.split();
+                track_background_processor_helper.delay_compensator.input.left.process(outputs_32.get_mut(0));
+                track_background_processor_helper.delay_compensator.input.right.process(outputs_32.get_mut(1));
+            }
 
-                        let _ = producer_left.write_blocking(&routed_audio_left_buffer);
+            for effect in track_background_processor_helper.effect_plugin_instances.iter_mut() {
+                // sum the audio routed to this effect into its side chain input
+                {
+                    let (_, outputs_32) = audio_buffer.split();
+                    let (mut left_outputs, mut right_outputs) = outputs_32.split_at_mut(3);
+                    let effect_uuid = effect.uuid();
+                    mix_routed_audio(
+                        &track_background_processor_helper.audio_inward_routings,
+                        &mut track_background_processor_helper.audio_inward_buses,
+                        &mut track_background_processor_helper.delay_compensator.routings,
+                        |destination| match destination {
+                            AudioRoutingNodeType::Effect(_, destination_effect_uuid, _, _) => Uuid::parse_str(destination_effect_uuid).map_or(false, |destination_effect_uuid| effect_uuid == destination_effect_uuid),
+                            _ => false,
+                        },
+                        left_outputs.get_mut(2),
+                        right_outputs.get_mut(0));
+                }
 
-                        index = 0;
-                        let right_channel = outputs_32.get_mut(1);
-                        for right_frame in right_channel.iter() {
-                            routed_audio_right_buffer[index] = *right_frame;
-                            index += 1;
+                let audio_buffer_in_use = if swap {
+                    &mut audio_buffer_swapped
+                }
+                else {
+                    &mut audio_buffer
+                };
+                swap = !swap;
+
+                let plugin_start = Instant::now();
+                match effect {
+                    BackgroundProcessorAudioPluginType::Vst24(effect) => {
+                        if let Ok(mut vst_host) = effect.host_mut().lock() {
+                            vst_host.set_ppq_pos(ppq_pos);
+                            vst_host.set_sample_position(sample_position);
                         }
-
-                        let _ = producer_right.write_blocking(&routed_audio_right_buffer);
+                        let effect_uuid = effect.uuid();
+                        process_vst24_plugin_in_sub_blocks(
+                            effect.vst_plugin_instance_mut(),
+                            audio_buffer_in_use,
+                            track_background_processor_helper.parameter_automation.plugin_changes(&effect_uuid),
+                            &[],
+                            &mut track_background_processor_helper.midi_sender);
                     }
+                    BackgroundProcessorAudioPluginType::Vst3 => {}
+                    BackgroundProcessorAudioPluginType::Clap(effect) => {
+                        effect.process(audio_buffer_in_use, true);
 
-                    // transfer to the ring buffer
-                    if mode == TrackBackgroundProcessorMode::AudioOut {
-                        let (_, mut outputs_32) = audio_buffer_in_use.split();
-                        let left_channel = outputs_32.get_mut(0);
-                        for left_frame in left_channel.iter_mut() {
-                            *left_frame *= track_background_processor_helper.volume;
-                            *left_frame *= left_pan;
-                            if *left_frame > left_channel_level {
-                                left_channel_level = *left_frame;
+                        if let Some(_xid) = effect.xid() {
+                            if let Some(timer_support) = effect.plugin.get_extension::<TimerSupport>() {
+                                timer_support.on_timer(&effect.plugin, 0);
                             }
-                        }
-                        let right_channel = outputs_32.get_mut(1);
-                        for right_frame in right_channel.iter_mut() {
-                            *right_frame *= track_background_processor_helper.volume;
-                            *right_frame *= right_pan;
-                            if *right_frame > right_channel_level {
-                                right_channel_level = *right_frame;
+                            if let Some(posix_fd_support) = effect.plugin.get_extension::<PosixFDSupport>() {
+                                posix_fd_support.on_fd(&effect.plugin, 0, 0);
                             }
                         }
-
-                        producer_left.write_blocking(outputs_32.get_mut(0));
-                        producer_right.write_blocking(outputs_32.get_mut(1));
-                        let _ = tx_vst_thread.send(TrackBackgroundProcessorOutwardEvent::ChannelLevels(track_uuid.clone(), left_channel_level, right_channel_level));
                     }
-                    else if mode == TrackBackgroundProcessorMode::Coast {
-                        thread::sleep(Duration::from_millis(100));
+                    BackgroundProcessorAudioPluginType::Sandboxed(effect) => {
+                        let effect_uuid = effect.uuid();
+                        effect.process(
+                            audio_buffer_in_use,
+                            track_background_processor_helper.parameter_automation.plugin_changes(&effect_uuid),
+                            sample_position,
+                            ppq_pos);
                     }
-                    else if mode == TrackBackgroundProcessorMode::Render {
-                        let (_, mut outputs_32) = audio_buffer_in_use.split();
-                        render_producer_left.write_blocking(outputs_32.get_mut(0));
-                        render_producer_right.write_blocking(outputs_32.get_mut(1));
+                    BackgroundProcessorAudioPluginType::BuiltIn(effect) => {
+                        effect.process(audio_buffer_in_use);
                     }
-                } // end loop
+                }
+                track_background_processor_helper.telemetry.record_plugin(effect.uuid(), plugin_start.elapsed());
+            }
+        }
 
-                info!("#####################Dropped out of Vst loop.")
-            }) {
-            Ok(_) => (),
-            Err(error) => info!("{:?}", error),
+        // swap to the last used audio buffer
+        let audio_buffer_in_use = if !swap {
+            &mut audio_buffer_swapped
         }
+        else {
+            &mut audio_buffer
+        };
+        // route to other audio destinations - written to the bus once however many there are, each destination copies the
+        // block off the bus when it next processes a block as the slot can be overwritten while it is read
+        write_routed_audio(track_background_processor_helper, audio_buffer_in_use);
+
+        // line up with the track with the most latency - after routing so that other tracks are compensated separately,
+        // frozen audio was rendered with this already applied
+        if !track_background_processor_helper.frozen() {
+            let (_, mut outputs_32) = audio_buffer_in_use.split();
+            track_background_processor_helper.delay_compensator.output.left.process(outputs_32.get_mut(0));
+            track_background_processor_helper.delay_compensator.output.right.process(outputs_32.get_mut(1));
+        }
+
+        track_background_processor_helper.telemetry.record_block(block_start.elapsed(), block_size, track_background_processor_helper.sample_rate);
+
+        // transfer to the ring buffer
+        if mode == TrackBackgroundProcessorMode::AudioOut {
+            let (_, mut outputs_32) = audio_buffer_in_use.split();
+            let left_channel_level = dsp::apply_gain_with_peak(outputs_32.get_mut(0), track_background_processor_helper.volume * left_pan);
+            let right_channel_level = dsp::apply_gain_with_peak(outputs_32.get_mut(1), track_background_processor_helper.volume * right_pan);
+
+            let _ = self.producer_left.write(outputs_32.get_mut(0));
+            let _ = self.producer_right.write(outputs_32.get_mut(1));
+            // how far ahead of the jack layer the track is running
+            track_background_processor_helper.telemetry.record_ring_buffer_fill(self.ring_buffer_left.count());
+            let _ = track_background_processor_helper.tx_vst_thread.send(TrackBackgroundProcessorOutwardEvent::ChannelLevels(track_background_processor_helper.track_uuid.clone(), left_channel_level, right_channel_level));
+        }
+        else if mode == TrackBackgroundProcessorMode::Render {
+            if track_background_processor_helper.render_waiting_for_play {
+                return TrackProcessingTaskStatus::Rendered;
+            }
+            let (_, mut outputs_32) = audio_buffer_in_use.split();
+            let _ = self.render_producer_left.write(outputs_32.get_mut(0));
+            let _ = self.render_producer_right.write(outputs_32.get_mut(1));
+            return TrackProcessingTaskStatus::Rendered;
+        }
+
+        TrackProcessingTaskStatus::Processed
+    }
+}
+
+#[derive(Clone, Default)]
+pub struct InstrumentTrackBackgroundProcessor{
+}
+
+impl InstrumentTrackBackgroundProcessor {
+
+    pub fn new() -> Self {
+        InstrumentTrackBackgroundProcessor {
+        }
+    }
+
+    pub fn start_processing(&self,
+                            track_uuid: String,
+                            tx_audio: crossbeam_channel::Sender<AudioLayerInwardEvent>,
+                            rx_vst_thread: Receiver<TrackBackgroundProcessorInwardEvent>,
+                            tx_vst_thread: crossbeam_channel::Sender<TrackBackgroundProcessorOutwardEvent>,
+                            track_thread_coast: Arc<Mutex<TrackBackgroundProcessorMode>>,
+                            volume: f32,
+                            pan: f32,
+                            vst_host_time_info: Arc<parking_lot::RwLock<TimeInfo>>,
+                            track_processing_scheduler: Arc<TrackProcessingScheduler>,
+    ) {
+        let track_background_processor_helper =
+            TrackBackgroundProcessorHelper::new(
+                track_uuid,
+                tx_audio,
+                rx_vst_thread,
+                tx_vst_thread,
+                track_thread_coast,
+                volume,
+                pan,
+                GeneralTrackType::InstrumentTrack,
+                vst_host_time_info,
+            );
+
+        track_processing_scheduler.add_task(Box::new(PluginTrackProcessingTask::new(track_background_processor_helper)));
     }
 }
 
-#[derive(Default)]
+#[derive(Clone, Default)]
 pub struct AudioTrackBackgroundProcessor{
 }
 
@@ -4382,198 +5180,84 @@ impl AudioTrackBackgroundProcessor {
                             track_uuid: String,
                             tx_audio: crossbeam_channel::Sender<AudioLayerInwardEvent>,
                             rx_vst_thread: Receiver<TrackBackgroundProcessorInwardEvent>,
-                            tx_vst_thread: Sender<TrackBackgroundProcessorOutwardEvent>,
+                            tx_vst_thread: crossbeam_channel::Sender<TrackBackgroundProcessorOutwardEvent>,
                             track_thread_coast: Arc<Mutex<TrackBackgroundProcessorMode>>,
                             volume: f32,
                             pan: f32,
                             vst_host_time_info: Arc<parking_lot::RwLock<TimeInfo>>,
+                            track_processing_scheduler: Arc<TrackProcessingScheduler>,
     ) {
-        match ThreadBuilder::default()
-            .name(format!("AudioTrackBackgroundProcessor: {}", track_uuid.as_str()))
-            .priority(ThreadPriority::Crossplatform(95.try_into().unwrap()))
-            .spawn(move |result| {
-                match result {
-                    Ok(_) => info!("Thread set to max priority: 95."),
-                    Err(error) => info!("Could not set thread to max priority: {:?}.", error),
-                }
+        let track_background_processor_helper =
+            TrackBackgroundProcessorHelper::new(
+                track_uuid,
+                tx_audio,
+                rx_vst_thread,
+                tx_vst_thread,
+                track_thread_coast,
+                volume,
+                pan,
+                GeneralTrackType::AudioTrack,
+                vst_host_time_info,
+            );
 
-                const BLOCK_SIZE: usize = 1024;
-                const HOST_BUFFER_CHANNELS: usize = 32;
-
-                let render_ring_buffer_left: SpscRb<f32> = SpscRb::new(BLOCK_SIZE);
-                let (render_producer_left, render_consumer_left) = (render_ring_buffer_left.producer(), render_ring_buffer_left.consumer());
-                let render_ring_buffer_right: SpscRb<f32> = SpscRb::new(BLOCK_SIZE);
-                let (render_producer_right, render_consumer_right) = (render_ring_buffer_right.producer(), render_ring_buffer_right.consumer());
-                let track_render_audio_consumer_details =
-                    AudioConsumerDetails::<f32>::new(track_uuid.clone(), render_consumer_left, render_consumer_right);
-
-                let ring_buffer_left: SpscRb<f32> = SpscRb::new(BLOCK_SIZE);
-                let (producer_left, consumer_left) = (ring_buffer_left.producer(), ring_buffer_left.consumer());
-                let ring_buffer_right: SpscRb<f32> = SpscRb::new(BLOCK_SIZE);
-                let (producer_right, consumer_right) = (ring_buffer_right.producer(), ring_buffer_right.consumer());
-                let audio_consumer_details = AudioConsumerDetails::<f32>::new(track_uuid.clone(), consumer_left, consumer_right);
-
-                let mut host_buffer: HostBuffer<f32> = HostBuffer::new(HOST_BUFFER_CHANNELS, HOST_BUFFER_CHANNELS);
-                let mut host_buffer_swapped: HostBuffer<f32> = HostBuffer::new(HOST_BUFFER_CHANNELS, HOST_BUFFER_CHANNELS);
-                let mut inputs = vec![vec![0.0; 1024]; HOST_BUFFER_CHANNELS];
-                let mut outputs = vec![vec![0.0; 1024]; HOST_BUFFER_CHANNELS];
-                let mut audio_buffer = host_buffer.bind(&inputs, &mut outputs);
-                let mut audio_buffer_swapped = host_buffer_swapped.bind(&outputs, &mut inputs);
-
-                let mut track_background_processor_helper =
-                    TrackBackgroundProcessorHelper::new(
-                        track_uuid.clone(),
-                        tx_audio.clone(),
-                        rx_vst_thread,
-                        tx_vst_thread.clone(),
-                        track_thread_coast.clone(),
-                        volume,
-                        pan,
-                        GeneralTrackType::AudioTrack,
-                        vst_host_time_info,
-                    );
-
-                let mut use_sample_audio = true;
-
-                let mut routed_audio_left_buffer: [f32; BLOCK_SIZE] = [0.0; BLOCK_SIZE];
-                let mut routed_audio_right_buffer: [f32; BLOCK_SIZE] = [0.0; BLOCK_SIZE];
-
-                track_background_processor_helper.send_render_audio_consumer_details_to_app(track_render_audio_consumer_details);
-                track_background_processor_helper.send_audio_consumer_details_to_jack(audio_consumer_details);
-                // track_background_processor_helper.send_midi_consumer_details_to_jack(midi_consumer_details);
-
-                loop {
-                    track_background_processor_helper.handle_incoming_events();
-                    track_background_processor_helper.process_audio_events();
-                    track_background_processor_helper.refresh_effect_plugin_editors();
-                    track_background_processor_helper.handle_request_plugin_preset_data();
-                    track_background_processor_helper.handle_request_effect_plugins_parameters();
-
-                    let (left_pan, right_pan) = DAWUtils::constant_power_stereo_pan(track_background_processor_helper.pan);
-
-                    use_sample_audio = true;
-
-                    // handle audio data routed to this track
-                    for audio_route_uuid in track_background_processor_helper.audio_inward_routings.iter().find(|(_, audio_route)| match &audio_route.destination {
-                        AudioRoutingNodeType::Track(_) => true,
-                        AudioRoutingNodeType::Instrument(_, _, _, _) => false,
-                        AudioRoutingNodeType::Effect(_, _, _, _) => false,
-                    }).map(|(_, audio_routing)| audio_routing.uuid()).iter() {
-                        if let Some((consumer_left, consumer_right)) = track_background_processor_helper.audio_inward_consumers.get_mut(audio_route_uuid) {
-                            let (_, mut outputs_32) = audio_buffer.split();
-
-                            use_sample_audio = false;
-
-                            for index in 0..routed_audio_left_buffer.len() {
-                                routed_audio_left_buffer[index] = 0.0;
-                                routed_audio_right_buffer[index] = 0.0;
-                            }
+        track_processing_scheduler.add_task(Box::new(PluginTrackProcessingTask::new(track_background_processor_helper)));
+    }
+}
 
-                            if let Ok(read) = consumer_left.read(&mut routed_audio_left_buffer) {
-                                let left_channel = outputs_32.get_mut(0);
+pub struct MidiTrackProcessingTask {
+    track_background_processor_helper: TrackBackgroundProcessorHelper,
+    ring_buffer_midi: SpscRb<(u32, u8, u8, u8, bool)>,
+    producer_midi: Producer<(u32, u8, u8, u8, bool)>,
+}
 
-                                for index in 0..read {
-                                    left_channel[index] = routed_audio_left_buffer[index];
-                                }
-                            }
+impl MidiTrackProcessingTask {
+    pub fn new(track_background_processor_helper: TrackBackgroundProcessorHelper) -> Self {
+        // one block's worth of midi events - the same as the jack layer reads each cycle
+        let ring_buffer_midi: SpscRb<(u32, u8, u8, u8, bool)> = SpscRb::new(track_background_processor_helper.jack_midi_out_buffer.len());
+        let midi_consumer_details = MidiConsumerDetails::<(u32, u8, u8, u8, bool)>::new(
+            track_background_processor_helper.track_uuid.clone(), ring_buffer_midi.consumer());
 
-                            if let Ok(read) = consumer_right.read(&mut routed_audio_right_buffer) {
-                                let right_channel = outputs_32.get_mut(1);
+        track_background_processor_helper.send_midi_consumer_details_to_jack(midi_consumer_details);
 
-                                for index in 0..read {
-                                    right_channel[index] = routed_audio_right_buffer[index];
-                                }
-                            }
-                        }
-                    }
+        Self {
+            track_background_processor_helper,
+            producer_midi: ring_buffer_midi.producer(),
+            ring_buffer_midi,
+        }
+    }
+}
 
-                    if use_sample_audio {
-                        track_background_processor_helper.process_sample(&mut audio_buffer, 1024, left_pan, right_pan);
-                    }
+impl TrackProcessingTask for MidiTrackProcessingTask {
+    fn track_uuid(&self) -> String {
+        self.track_background_processor_helper.track_uuid.clone()
+    }
 
-                    let mut swap = true;
-                    for effect in track_background_processor_helper.effect_plugin_instances.iter_mut() {
-                        let audio_buffer_in_use = if swap {
-                            &mut audio_buffer_swapped
-                        }
-                        else {
-                            &mut audio_buffer
-                        };
-                        swap = !swap;
+    fn source_track_uuids(&self) -> Vec<String> {
+        self.track_background_processor_helper.source_track_uuids()
+    }
 
-                        match effect {
-                            BackgroundProcessorAudioPluginType::Vst24(effect) => {
-                                effect.vst_plugin_instance_mut().process(audio_buffer_in_use);
-                            }
-                            BackgroundProcessorAudioPluginType::Vst3 => {}
-                            BackgroundProcessorAudioPluginType::Clap(_effect) => {
+    fn source_track_uuids_changed(&mut self) -> bool {
+        self.track_background_processor_helper.take_source_track_uuids_changed()
+    }
 
-                            }
-                        }
-                    }
+    fn keep_alive(&self) -> bool {
+        self.track_background_processor_helper.keep_alive
+    }
 
-                    let mode = match track_thread_coast.lock() {
-                        Ok(mode) => match *mode {
-                            TrackBackgroundProcessorMode::AudioOut => TrackBackgroundProcessorMode::AudioOut,
-                            TrackBackgroundProcessorMode::Coast => TrackBackgroundProcessorMode::Coast,
-                            TrackBackgroundProcessorMode::Render => TrackBackgroundProcessorMode::Render,
-                        }
-                        Err(_) => TrackBackgroundProcessorMode::AudioOut,
-                    };
+    fn process_block(&mut self, _cycle: TrackProcessingCycle) -> TrackProcessingTaskStatus {
+        self.track_background_processor_helper.handle_incoming_events();
 
-                    // transfer to the ring buffer
-                    let (left_pan, right_pan) = DAWUtils::constant_power_stereo_pan(track_background_processor_helper.pan);
-                    let mut left_channel_level: f32 = 0.0;
-                    let mut right_channel_level: f32 = 0.0;
-                    let audio_buffer_in_use = if !swap {
-                        &mut audio_buffer_swapped
-                    }
-                    else {
-                        &mut audio_buffer
-                    };
-                    if mode == TrackBackgroundProcessorMode::AudioOut {
-                        let (_, mut outputs_32) = audio_buffer_in_use.split();
-                        let left_channel = outputs_32.get_mut(0);
-                        for left_frame in left_channel.iter_mut() {
-                            *left_frame *= track_background_processor_helper.volume;
-                            *left_frame *= left_pan;
-                            if *left_frame > left_channel_level {
-                                left_channel_level = *left_frame;
-                            }
-                        }
-                        let right_channel = outputs_32.get_mut(1);
-                        for right_frame in right_channel.iter_mut() {
-                            *right_frame *= track_background_processor_helper.volume;
-                            *right_frame *= right_pan;
-                            if *right_frame > right_channel_level {
-                                right_channel_level = *right_frame;
-                            }
-                        }
+        if self.ring_buffer_midi.slots_free() < self.track_background_processor_helper.jack_midi_out_buffer.len() {
+            return TrackProcessingTaskStatus::Idle;
+        }
 
-                        producer_left.write_blocking(outputs_32.get_mut(0));
-                        producer_right.write_blocking(outputs_32.get_mut(1));
-                        let _ = tx_vst_thread.send(TrackBackgroundProcessorOutwardEvent::ChannelLevels(track_uuid.clone(), left_channel_level, right_channel_level));
-                    }
-                    else if mode == TrackBackgroundProcessorMode::Coast {
-                        thread::sleep(Duration::from_millis(100));
-                    }
-                    else if mode == TrackBackgroundProcessorMode::Render {
-                        let (_, mut outputs_32) = audio_buffer_in_use.split();
-                        render_producer_left.write_blocking(outputs_32.get_mut(0));
-                        render_producer_right.write_blocking(outputs_32.get_mut(1));
-                    }
-                    
-                } // end loop
+        self.track_background_processor_helper.process_jack_midi_out_events(&mut self.producer_midi);
 
-                info!("#####################Dropped out of Vst loop.")
-            }) {
-            Ok(_) => (),
-            Err(error) => info!("{:?}", error),
-        }
+        TrackProcessingTaskStatus::Processed
     }
 }
 
-#[derive(Default)]
+#[derive(Clone, Default)]
 pub struct MidiTrackBackgroundProcessor{
 }
 
@@ -4588,53 +5272,27 @@ impl MidiTrackBackgroundProcessor {
                             track_uuid: String,
                             tx_audio: crossbeam_channel::Sender<AudioLayerInwardEvent>,
                             rx_vst_thread: Receiver<TrackBackgroundProcessorInwardEvent>,
-                            tx_vst_thread: Sender<TrackBackgroundProcessorOutwardEvent>,
+                            tx_vst_thread: crossbeam_channel::Sender<TrackBackgroundProcessorOutwardEvent>,
                             track_thread_coast: Arc<Mutex<TrackBackgroundProcessorMode>>,
                             volume: f32,
                             pan: f32,
                             vst_host_time_info: Arc<parking_lot::RwLock<TimeInfo>>,
+                            track_processing_scheduler: Arc<TrackProcessingScheduler>,
     ) {
-        match ThreadBuilder::default()
-            .name(format!("MidiTrackBackgroundProcessor: {}", track_uuid.as_str()))
-            .priority(ThreadPriority::Crossplatform(95.try_into().unwrap()))
-            .spawn(move |result| {
-                match result {
-                    Ok(_) => info!("Thread set to max priority: 95."),
-                    Err(error) => info!("Could not set thread to max priority: {:?}.", error),
-                }
+        let track_background_processor_helper =
+            TrackBackgroundProcessorHelper::new(
+                track_uuid,
+                tx_audio,
+                rx_vst_thread,
+                tx_vst_thread,
+                track_thread_coast,
+                volume,
+                pan,
+                GeneralTrackType::MidiTrack,
+                vst_host_time_info,
+            );
 
-                const SIZE: usize = 1024;
-
-                let ring_buffer_midi: SpscRb<(u32, u8, u8, u8, bool)> = SpscRb::new(SIZE);
-                let (mut producer_midi, consumer_midi) = (ring_buffer_midi.producer(), ring_buffer_midi.consumer());
-                let midi_consumer_details = MidiConsumerDetails::<(u32, u8, u8, u8, bool)>::new(track_uuid.clone(), consumer_midi);
-
-                let mut track_background_processor_helper =
-                    TrackBackgroundProcessorHelper::new(
-                        track_uuid.clone(),
-                        tx_audio.clone(),
-                        rx_vst_thread,
-                        tx_vst_thread,
-                        track_thread_coast.clone(),
-                        volume,
-                        pan,
-                        GeneralTrackType::MidiTrack,
-                        vst_host_time_info,
-                    );
-
-                track_background_processor_helper.send_midi_consumer_details_to_jack(midi_consumer_details);
-
-                loop {
-                    track_background_processor_helper.handle_incoming_events();
-                    // track_background_processor_helper.dump_play_info();
-                    track_background_processor_helper.process_jack_midi_out_events(&mut producer_midi);
-                } // end loop
-
-                info!("#####################Dropped out of Midi track background processor loop.")
-            }) {
-            Ok(_) => (),
-            Err(error) => info!("{:?}", error),
-        }
+        track_processing_scheduler.add_task(Box::new(MidiTrackProcessingTask::new(track_background_processor_helper)));
     }
 }
 
@@ -4661,11 +5319,12 @@ pub trait Track {
     fn start_background_processing(&self,
                                    tx_audio: crossbeam_channel::Sender<AudioLayerInwardEvent>,
                                    rx_vst_thread: Receiver<TrackBackgroundProcessorInwardEvent>,
-                                   tx_vst_thread: Sender<TrackBackgroundProcessorOutwardEvent>,
+                                   tx_vst_thread: crossbeam_channel::Sender<TrackBackgroundProcessorOutwardEvent>,
                                    track_thread_coast: Arc<Mutex<TrackBackgroundProcessorMode>>,
                                    volume: f32,
                                    pan: f32,
-                                   vst_host_time_info: Arc<parking_lot::RwLock<TimeInfo>>);
+                                   vst_host_time_info: Arc<parking_lot::RwLock<TimeInfo>>,
+                                   track_processing_scheduler: Arc<TrackProcessingScheduler>);
     fn volume(&self) -> f32;
     fn volume_mut(&mut self) -> f32;
     fn set_volume(&mut self, volume: f32); // 0.0 to 1.0
@@ -4689,7 +5348,38 @@ pub trait AudioEffectTrack {
      fn effects_mut(&mut self) -> &mut Vec<AudioPlugin>;
 }
 
-#[derive(Serialize, Deserialize)]
+/// Where a frozen track's rendered audio is cached and what it was rendered from.
+#[derive(Serialize, Deserialize, Clone, PartialEq, Debug)]
+pub struct FrozenTrack {
+    file_name: String,
+    content_hash: u64, // see InstrumentTrack::content_hash
+    #[serde(default)]
+    output_delay: usize, // the output delay compensation rendered into the audio
+}
+
+impl FrozenTrack {
+    pub fn new(file_name: String, content_hash: u64, output_delay: usize) -> Self {
+        Self {
+            file_name,
+            content_hash,
+            output_delay,
+        }
+    }
+
+    pub fn file_name(&self) -> &str {
+        self.file_name.as_str()
+    }
+
+    pub fn content_hash(&self) -> u64 {
+        self.content_hash
+    }
+
+    pub fn output_delay(&self) -> usize {
+        self.output_delay
+    }
+}
+
+#[derive(Clone, Serialize, Deserialize)]
 pub struct InstrumentTrack {
     uuid: Uuid,
 	name: String,
@@ -4710,6 +5400,8 @@ pub struct InstrumentTrack {
     pan: f32,
     midi_routings: Vec<TrackEventRouting>,
     audio_routings: Vec<AudioRouting>,
+    #[serde(default)]
+    frozen: Option<FrozenTrack>, // None when the instrument and effects play live
 }
 
 impl InstrumentTrack {
@@ -4733,6 +5425,7 @@ impl InstrumentTrack {
             pan: 0.0,
             midi_routings: vec!{},
             audio_routings: vec![],
+            frozen: None,
 		};
 
         track.riffs.push(Riff::new_with_name_and_length(Uuid::new_v4(), "empty".to_string(), 4.0));
@@ -4760,6 +5453,37 @@ impl InstrumentTrack {
     pub fn track_background_processor_mut(&mut self) -> &mut InstrumentTrackBackgroundProcessor {
         &mut self.track_background_processor
     }
+
+    pub fn frozen(&self) -> Option<&FrozenTrack> {
+        self.frozen.as_ref()
+    }
+
+    pub fn set_frozen(&mut self, frozen: Option<FrozenTrack>) {
+        self.frozen = frozen;
+    }
+
+    /// A hash of everything that goes into rendering the track - its riffs, where they are played, its automation and
+    /// the instrument and effect presets - at the given tempo and song length. A frozen track whose hash still
+    /// matches can play its frozen audio. The presets are only as fresh as the last preset data request. The hash is
+    /// saved in the project and the freeze file name so it has to stay the same across builds.
+    pub fn content_hash(&self, tempo: f64, song_length_in_beats: f64) -> u64 {
+        let mut hasher = StableHasher::new();
+        hasher.write(&tempo.to_bits().to_le_bytes());
+        hasher.write(&song_length_in_beats.to_bits().to_le_bytes());
+        for json in [
+            serde_json::to_string(&self.riffs),
+            serde_json::to_string(&self.riff_refs),
+            serde_json::to_string(&self.automation),
+            serde_json::to_string(&self.instrument),
+            serde_json::to_string(&self.effects),
+        ] {
+            match json {
+                Ok(json) => hasher.write_str(json.as_str()),
+                Err(error) => info!("InstrumentTrack.content_hash: could not serialise the track: {:?}", error),
+            }
+        }
+        hasher.finish()
+    }
 }
 
 impl LuaUserData for InstrumentTrack {
@@ -4861,14 +5585,15 @@ impl Track for InstrumentTrack {
     fn start_background_processing(&self,
                                    tx_audio: crossbeam_channel::Sender<AudioLayerInwardEvent>,
                                    rx_vst_thread: Receiver<TrackBackgroundProcessorInwardEvent>,
-                                   tx_vst_thread: Sender<TrackBackgroundProcessorOutwardEvent>,
+                                   tx_vst_thread: crossbeam_channel::Sender<TrackBackgroundProcessorOutwardEvent>,
                                    track_thread_coast: Arc<Mutex<TrackBackgroundProcessorMode>>,
                                    volume: f32,
                                    pan: f32,
                                    vst_host_time_info: Arc<parking_lot::RwLock<TimeInfo>>,
+                                   track_processing_scheduler: Arc<TrackProcessingScheduler>,
     ) {
         self.track_background_processor().start_processing(
-            self.uuid().to_string(), tx_audio, rx_vst_thread, tx_vst_thread, track_thread_coast, volume, pan, vst_host_time_info);
+            self.uuid().to_string(), tx_audio, rx_vst_thread, tx_vst_thread, track_thread_coast, volume, pan, vst_host_time_info, track_processing_scheduler);
     }
 
     fn volume(&self) -> f32 {
@@ -4929,13 +5654,13 @@ impl AudioEffectTrack for InstrumentTrack {
     }
 }
 
-#[derive(Serialize, Deserialize)]
+#[derive(Clone, Serialize, Deserialize)]
 pub enum MidiDeviceType {
     Jack,
     Alsa,
 }
 
-#[derive(Serialize, Deserialize)]
+#[derive(Clone, Serialize, Deserialize)]
 pub struct MidiDevice {
 	name: String,
     midi_device_type: MidiDeviceType,
@@ -4968,7 +5693,7 @@ impl MidiDevice {
     }
 }
 
-#[derive(Serialize, Deserialize)]
+#[derive(Clone, Serialize, Deserialize)]
 pub struct MidiTrack {
     uuid: Uuid,
 	name: String,
@@ -5120,14 +5845,15 @@ impl Track for MidiTrack {
     fn start_background_processing(&self,
                                    tx_audio: crossbeam_channel::Sender<AudioLayerInwardEvent>,
                                    rx_vst_thread: Receiver<TrackBackgroundProcessorInwardEvent>,
-                                   tx_vst_thread: Sender<TrackBackgroundProcessorOutwardEvent>,
+                                   tx_vst_thread: crossbeam_channel::Sender<TrackBackgroundProcessorOutwardEvent>,
                                    track_thread_coast: Arc<Mutex<TrackBackgroundProcessorMode>>,
                                    volume: f32,
                                    pan: f32,
                                    vst_host_time_info: Arc<parking_lot::RwLock<TimeInfo>>,
+                                   track_processing_scheduler: Arc<TrackProcessingScheduler>,
     ) {
         self.track_background_processor().start_processing(
-            self.uuid().to_string(), tx_audio, rx_vst_thread, tx_vst_thread, track_thread_coast, volume, pan, vst_host_time_info);
+            self.uuid().to_string(), tx_audio, rx_vst_thread, tx_vst_thread, track_thread_coast, volume, pan, vst_host_time_info, track_processing_scheduler);
     }
 
     fn volume(&self) -> f32 {
@@ -5171,7 +5897,7 @@ impl Track for MidiTrack {
     }
 }
 
-#[derive(Serialize, Deserialize)]
+#[derive(Clone, Serialize, Deserialize)]
 pub struct AudioTrack {
     uuid: Uuid,
 	name: String,
@@ -5316,11 +6042,12 @@ impl Track for AudioTrack {
         &self,
         _tx_audio: crossbeam_channel::Sender<AudioLayerInwardEvent>,
         _rx_vst_thread: Receiver<TrackBackgroundProcessorInwardEvent>,
-        _tx_vst_thread: Sender<TrackBackgroundProcessorOutwardEvent>,
+        _tx_vst_thread: crossbeam_channel::Sender<TrackBackgroundProcessorOutwardEvent>,
         _track_thread_coast: Arc<Mutex<TrackBackgroundProcessorMode>>,
         _volume: f32,
         _pan: f32,
         _vst_host_time_info: Arc<parking_lot::RwLock<TimeInfo>>,
+        _track_processing_scheduler: Arc<TrackProcessingScheduler>,
     ) {
         // TODO implement
     }
@@ -5383,7 +6110,7 @@ impl AudioEffectTrack for AudioTrack {
     }
 }
 
-#[derive(Serialize, Deserialize)]
+#[derive(Clone, Serialize, Deserialize)]
 pub struct Loop {
     uuid: Uuid,
 	name: String,
@@ -5470,7 +6197,7 @@ impl Loop {
     }
 }
 
-#[derive(Serialize, Deserialize)]
+#[derive(Clone, Serialize, Deserialize)]
 pub struct Song {
 	name: String,
     sample_rate: f64,
@@ -5491,8 +6218,8 @@ impl Song {
 	pub fn new() -> Song {
 		Song {
 			name: String::from("unkown"),
-            sample_rate: 44100.0,
-            block_size: 1024.0,
+            sample_rate: DEFAULT_SAMPLE_RATE,
+            block_size: DEFAULT_BLOCK_SIZE as f64,
 			tempo: 140.0,
             time_signature_numerator: 4.0,
             time_signature_denominator: 4.0,
@@ -5934,7 +6661,7 @@ impl Song {
     }
 }
 
-#[derive(Serialize, Deserialize)]
+#[derive(Clone, Serialize, Deserialize)]
 pub struct Project {
 	song: Song,
 }
@@ -5966,6 +6693,7 @@ pub struct AudioConsumerDetails<T> {
     track_id: String,
     consumer_left: Consumer<T>,
     consumer_right: Consumer<T>,
+    telemetry: Option<Arc<TrackTelemetry>>, // where the jack layer counts the periods the track falls behind in
 }
 
 impl<T> AudioConsumerDetails<T> {
@@ -5973,10 +6701,21 @@ impl<T> AudioConsumerDetails<T> {
         Self {
             track_id,
             consumer_left,
-            consumer_right
+            consumer_right,
+            telemetry: None,
         }
     }
 
+    /// Get a reference to the consumer details track telemetry.
+    pub fn telemetry(&self) -> Option<&Arc<TrackTelemetry>> {
+        self.telemetry.as_ref()
+    }
+
+    /// Set the consumer details track telemetry.
+    pub fn set_telemetry(&mut self, telemetry: Option<Arc<TrackTelemetry>>) {
+        self.telemetry = telemetry;
+    }
+
     /// Get a reference to the consumer details track id.
     pub fn track_id(&self) -> &String {
         &self.track_id
@@ -6065,6 +6804,34 @@ impl<T> MidiConsumerDetails<T> {
     pub fn set_midi_out_port(&mut self, midi_out_port: Option<Port<MidiOut>>) {
         self.midi_out_port = midi_out_port;
     }
+
+    /// Set the midi out port and hand back the previous one.
+    pub fn replace_midi_out_port(&mut self, midi_out_port: Option<Port<MidiOut>>) -> Option<Port<MidiOut>> {
+        std::mem::replace(&mut self.midi_out_port, midi_out_port)
+    }
+}
+
+/// The jack process callback writes live midi in for the track here - (frame within the jack period, midi bytes).
+pub struct LiveMidiProducerDetails {
+    track_uuid: String,
+    producer: Producer<(u32, u8, u8, u8)>,
+}
+
+impl LiveMidiProducerDetails {
+    pub fn new(track_uuid: String, producer: Producer<(u32, u8, u8, u8)>) -> Self {
+        Self {
+            track_uuid,
+            producer,
+        }
+    }
+
+    pub fn track_uuid(&self) -> &String {
+        &self.track_uuid
+    }
+
+    pub fn producer_mut(&mut self) -> &mut Producer<(u32, u8, u8, u8)> {
+        &mut self.producer
+    }
 }
 
 #[derive(Clone, Serialize, Deserialize)]
@@ -6074,6 +6841,12 @@ pub struct DAWConfiguration {
     pub scanned_vst_effect_plugins: ScannedVstPlugins,
     pub midi_input_connections: MidiInputConnections,
     pub midi_output_connections: MidiOutputConnections,
+    #[serde(default)]
+    pub plugin_database: PluginDatabase,
+    #[serde(default)]
+    pub plugin_sandbox: PluginSandboxConfiguration,
+    #[serde(default)]
+    pub telemetry: TelemetryConfiguration,
 }
 
 impl DAWConfiguration {
@@ -6084,6 +6857,9 @@ impl DAWConfiguration {
             scanned_vst_effect_plugins: ScannedVstPlugins::new(),
             midi_input_connections: MidiInputConnections::new(),
             midi_output_connections: MidiOutputConnections::new(),
+            plugin_database: PluginDatabase::default(),
+            plugin_sandbox: PluginSandboxConfiguration::default(),
+            telemetry: TelemetryConfiguration::default(),
         }
     }
 
@@ -6131,13 +6907,16 @@ impl DAWConfiguration {
 pub struct AudioConfiguration {
     pub block_size: i32,
     pub sample_rate: i32,
+    #[serde(default)]
+    pub automation_ramping: bool, // ramp plugin parameters between automation changes
 }
 
 impl AudioConfiguration {
     pub fn new() -> Self {
         Self {
-            block_size: 1024,
-            sample_rate: 44100,
+            block_size: DEFAULT_BLOCK_SIZE as i32,
+            sample_rate: DEFAULT_SAMPLE_RATE as i32,
+            automation_ramping: false,
         }
     }
 }
@@ -6155,6 +6934,55 @@ impl ScannedVstPlugins {
     }
 }
 
+#[derive(Clone, Copy, PartialEq, Eq, Serialize, Deserialize, Debug)]
+pub enum PluginScanStatus {
+    Scanned,     // the checker ran to completion - it may not have found any plugins
+    Crashed,     // the checker exited abnormally without reporting any plugins
+    TimedOut,    // the checker was killed after PLUGIN_SCAN_TIMEOUT_IN_SECONDS
+    Blacklisted, // set by hand in the configuration file - never scanned
+}
+
+/// What was found in a plugin binary. Crashed and timed out binaries are only checked again when they change.
+#[derive(Clone, Serialize, Deserialize, Debug)]
+pub struct PluginDatabaseEntry {
+    pub modified: u64, // seconds since the epoch
+    pub size: u64,
+    pub hash: u64,     // fnv-1a of the file contents
+    pub status: PluginScanStatus,
+    pub instrument_plugins: HashMap<String, String>, // key=id (path:id:type), value=name
+    pub effect_plugins: HashMap<String, String>,     // key=id (path:id:type), value=name
+}
+
+/// The scan results for every plugin binary keyed by path.
+#[derive(Clone, Serialize, Deserialize, Default, Debug)]
+pub struct PluginDatabase {
+    pub entries: HashMap<String, PluginDatabaseEntry>,
+}
+
+/// Which plugins run out of process in a sandbox so that one crashing or hanging only silences itself. A plugin with a
+/// bridge host - e.g. a build of this executable for another architecture - is always sandboxed in that host.
+#[derive(Clone, Serialize, Deserialize, Default, Debug)]
+pub struct PluginSandboxConfiguration {
+    pub sandbox_all_plugins: bool,
+    pub sandboxed_plugins: Vec<String>,        // plugin library paths
+    pub bridge_hosts: HashMap<String, String>, // plugin library path, sandbox host executable
+}
+
+impl PluginSandboxConfiguration {
+    /// The executable to run the plugin's sandbox in or none if the plugin is loaded in process.
+    pub fn host_executable(&self, library_path: &str) -> Option<String> {
+        if let Some(bridge_host) = self.bridge_hosts.get(library_path) {
+            Some(bridge_host.clone())
+        }
+        else if self.sandbox_all_plugins || self.sandboxed_plugins.iter().any(|sandboxed_plugin| sandboxed_plugin == library_path) {
+            std::env::current_exe().ok().and_then(|path| path.to_str().map(|path| path.to_string()))
+        }
+        else {
+            None
+        }
+    }
+}
+
 #[derive(Clone, Serialize, Deserialize)]
 pub struct MidiInputConnections {
     pub midi_input_connections: HashMap<String, String>, // from=name, to=name (DAW input port)
@@ -6188,6 +7016,16 @@ pub enum TrackEventRoutingNodeType {
     Effect(String, String), // track uuid, effect uuid
 }
 
+impl TrackEventRoutingNodeType {
+    pub fn track_uuid(&self) -> &str {
+        match self {
+            TrackEventRoutingNodeType::Track(track_uuid) => track_uuid,
+            TrackEventRoutingNodeType::Instrument(track_uuid, _) => track_uuid,
+            TrackEventRoutingNodeType::Effect(track_uuid, _) => track_uuid,
+        }
+    }
+}
+
 #[derive(Clone, Serialize, Deserialize)]
 pub struct TrackEventRouting{
     uuid: Uuid,
@@ -6259,6 +7097,16 @@ pub enum AudioRoutingNodeType {
     Effect(String, String, i32, i32), // track uuid, effect uuid, left audio input index, right audio input index
 }
 
+impl AudioRoutingNodeType {
+    pub fn track_uuid(&self) -> &str {
+        match self {
+            AudioRoutingNodeType::Track(track_uuid) => track_uuid,
+            AudioRoutingNodeType::Instrument(track_uuid, _, _, _) => track_uuid,
+            AudioRoutingNodeType::Effect(track_uuid, _, _, _) => track_uuid,
+        }
+    }
+}
+
 #[derive(Clone, Serialize, Deserialize)]
 pub struct AudioRouting{
     uuid: Uuid,
@@ -6371,6 +7219,21 @@ mod tests {
         }
     }
 
+    #[test]
+    fn track_content_hash_follows_what_the_track_renders() {
+        let mut track = InstrumentTrack::new();
+        let content_hash = track.content_hash(140.0, 400.0);
+        assert_eq!(content_hash, track.content_hash(140.0, 400.0));
+        assert_ne!(content_hash, track.content_hash(120.0, 400.0));
+
+        // freezing doesn't change what is rendered
+        track.set_frozen(Some(FrozenTrack::new("frozen.wav".to_string(), content_hash, 0)));
+        assert_eq!(content_hash, track.content_hash(140.0, 400.0));
+
+        track.riffs_mut()[0].events_mut().push(TrackEvent::Note(Note::new_with_params(0.0, 60, 127, 1.0)));
+        assert_ne!(content_hash, track.content_hash(140.0, 400.0));
+    }
+
     #[test]
     fn test_transition_between_riff_sets() {
         let bpm = 140.0;
@@ -6380,7 +7243,7 @@ mod tests {
         let (tx_to_audio, _rx_to_audio) = unbounded::<AudioLayerInwardEvent>();
         let (tx_to_vst, rx_to_vst) = channel::<TrackBackgroundProcessorInwardEvent>();
         let _tx_to_vst_ref = tx_to_vst;
-        let (tx_from_vst, _rx_from_vst) = channel::<TrackBackgroundProcessorOutwardEvent>();
+        let (tx_from_vst, _rx_from_vst) = crossbeam_channel::unbounded::<TrackBackgroundProcessorOutwardEvent>();
         let track_thread_coast: Arc<Mutex<TrackBackgroundProcessorMode>> = Arc::new(Mutex::new(TrackBackgroundProcessorMode::AudioOut));
         let _track_uuid = Uuid::new_v4();
         let automation: Vec<TrackEvent> = vec![];
@@ -0,0 +1,545 @@
+use std::sync::atomic::{AtomicU8, Ordering};
+
+/// The instruction set the dsp kernels use - detected once at runtime.
+#[derive(Clone, Copy, PartialEq, Eq, Debug)]
+pub enum SimdLevel {
+    Scalar,
+    Sse,  // x86_64 baseline (sse2)
+    Avx2,
+    Neon, // aarch64 baseline
+}
+
+const SIMD_LEVEL_NOT_DETECTED: u8 = u8::MAX;
+static SIMD_LEVEL: AtomicU8 = AtomicU8::new(SIMD_LEVEL_NOT_DETECTED);
+
+pub fn simd_level() -> SimdLevel {
+    let simd_level = match SIMD_LEVEL.load(Ordering::Relaxed) {
+        SIMD_LEVEL_NOT_DETECTED => {
+            let simd_level = detect_simd_level();
+            SIMD_LEVEL.store(simd_level as u8, Ordering::Relaxed);
+            simd_level as u8
+        }
+        simd_level => simd_level,
+    };
+    match simd_level {
+        1 => SimdLevel::Sse,
+        2 => SimdLevel::Avx2,
+        3 => SimdLevel::Neon,
+        _ => SimdLevel::Scalar,
+    }
+}
+
+#[allow(unreachable_code)]
+fn detect_simd_level() -> SimdLevel {
+    #[cfg(target_arch = "x86_64")]
+    {
+        if is_x86_feature_detected!("avx2") {
+            return SimdLevel::Avx2;
+        }
+        return SimdLevel::Sse;
+    }
+    #[cfg(target_arch = "aarch64")]
+    {
+        return SimdLevel::Neon;
+    }
+    SimdLevel::Scalar
+}
+
+/// destination += source * gain
+pub fn mix_accumulate(destination: &mut [f32], source: &[f32], gain: f32) {
+    let length = destination.len().min(source.len());
+    let (destination, source) = (&mut destination[..length], &source[..length]);
+    match simd_level() {
+        #[cfg(target_arch = "x86_64")]
+        SimdLevel::Avx2 => unsafe { x86::mix_accumulate_avx2(destination, source, gain) },
+        #[cfg(target_arch = "x86_64")]
+        SimdLevel::Sse => unsafe { x86::mix_accumulate_sse(destination, source, gain) },
+        #[cfg(target_arch = "aarch64")]
+        SimdLevel::Neon => unsafe { neon::mix_accumulate(destination, source, gain) },
+        _ => scalar::mix_accumulate(destination, source, gain),
+    }
+}
+
+/// Mix interleaved stereo into separate left and right buffers: left += source left * left gain etc.
+pub fn mix_interleaved_stereo(left: &mut [f32], right: &mut [f32], interleaved: &[f32], left_gain: f32, right_gain: f32) {
+    let frames = left.len().min(right.len()).min(interleaved.len() / 2);
+    let (left, right, interleaved) = (&mut left[..frames], &mut right[..frames], &interleaved[..frames * 2]);
+    match simd_level() {
+        #[cfg(target_arch = "x86_64")]
+        SimdLevel::Avx2 | SimdLevel::Sse => unsafe { x86::mix_interleaved_stereo_sse(left, right, interleaved, left_gain, right_gain) },
+        #[cfg(target_arch = "aarch64")]
+        SimdLevel::Neon => unsafe { neon::mix_interleaved_stereo(left, right, interleaved, left_gain, right_gain) },
+        _ => scalar::mix_interleaved_stereo(left, right, interleaved, left_gain, right_gain),
+    }
+}
+
+/// Scale the buffer by gain (volume and pan combined) and return the resulting absolute peak for metering.
+pub fn apply_gain_with_peak(buffer: &mut [f32], gain: f32) -> f32 {
+    match simd_level() {
+        #[cfg(target_arch = "x86_64")]
+        SimdLevel::Avx2 => unsafe { x86::apply_gain_with_peak_avx2(buffer, gain) },
+        #[cfg(target_arch = "x86_64")]
+        SimdLevel::Sse => unsafe { x86::apply_gain_with_peak_sse(buffer, gain) },
+        #[cfg(target_arch = "aarch64")]
+        SimdLevel::Neon => unsafe { neon::apply_gain_with_peak(buffer, gain) },
+        _ => scalar::apply_gain_with_peak(buffer, gain),
+    }
+}
+
+/// The largest absolute sample value.
+pub fn peak(buffer: &[f32]) -> f32 {
+    match simd_level() {
+        #[cfg(target_arch = "x86_64")]
+        SimdLevel::Avx2 => unsafe { x86::peak_avx2(buffer) },
+        #[cfg(target_arch = "x86_64")]
+        SimdLevel::Sse => unsafe { x86::peak_sse(buffer) },
+        #[cfg(target_arch = "aarch64")]
+        SimdLevel::Neon => unsafe { neon::peak(buffer) },
+        _ => scalar::peak(buffer),
+    }
+}
+
+pub fn rms(buffer: &[f32]) -> f32 {
+    if buffer.is_empty() {
+        return 0.0;
+    }
+    let sum_of_squares = match simd_level() {
+        #[cfg(target_arch = "x86_64")]
+        SimdLevel::Avx2 => unsafe { x86::sum_of_squares_avx2(buffer) },
+        #[cfg(target_arch = "x86_64")]
+        SimdLevel::Sse => unsafe { x86::sum_of_squares_sse(buffer) },
+        #[cfg(target_arch = "aarch64")]
+        SimdLevel::Neon => unsafe { neon::sum_of_squares(buffer) },
+        _ => scalar::sum_of_squares(buffer),
+    };
+    (sum_of_squares / buffer.len() as f32).sqrt()
+}
+
+pub fn interleave(left: &[f32], right: &[f32], interleaved: &mut [f32]) {
+    let frames = left.len().min(right.len()).min(interleaved.len() / 2);
+    let (left, right, interleaved) = (&left[..frames], &right[..frames], &mut interleaved[..frames * 2]);
+    match simd_level() {
+        #[cfg(target_arch = "x86_64")]
+        SimdLevel::Avx2 | SimdLevel::Sse => unsafe { x86::interleave_sse(left, right, interleaved) },
+        #[cfg(target_arch = "aarch64")]
+        SimdLevel::Neon => unsafe { neon::interleave(left, right, interleaved) },
+        _ => scalar::interleave(left, right, interleaved),
+    }
+}
+
+pub fn deinterleave(interleaved: &[f32], left: &mut [f32], right: &mut [f32]) {
+    let frames = left.len().min(right.len()).min(interleaved.len() / 2);
+    let (interleaved, left, right) = (&interleaved[..frames * 2], &mut left[..frames], &mut right[..frames]);
+    match simd_level() {
+        #[cfg(target_arch = "x86_64")]
+        SimdLevel::Avx2 | SimdLevel::Sse => unsafe { x86::deinterleave_sse(interleaved, left, right) },
+        #[cfg(target_arch = "aarch64")]
+        SimdLevel::Neon => unsafe { neon::deinterleave(interleaved, left, right) },
+        _ => scalar::deinterleave(interleaved, left, right),
+    }
+}
+
+/// The reference implementations - also used for the tail of a buffer that doesn't fill a vector.
+mod scalar {
+    pub fn mix_accumulate(destination: &mut [f32], source: &[f32], gain: f32) {
+        for (destination_sample, source_sample) in destination.iter_mut().zip(source.iter()) {
+            *destination_sample += *source_sample * gain;
+        }
+    }
+
+    pub fn mix_interleaved_stereo(left: &mut [f32], right: &mut [f32], interleaved: &[f32], left_gain: f32, right_gain: f32) {
+        for ((left_sample, right_sample), frame) in left.iter_mut().zip(right.iter_mut()).zip(interleaved.chunks_exact(2)) {
+            *left_sample += frame[0] * left_gain;
+            *right_sample += frame[1] * right_gain;
+        }
+    }
+
+    pub fn apply_gain_with_peak(buffer: &mut [f32], gain: f32) -> f32 {
+        let mut peak: f32 = 0.0;
+        for sample in buffer.iter_mut() {
+            *sample *= gain;
+            peak = peak.max(sample.abs());
+        }
+        peak
+    }
+
+    pub fn peak(buffer: &[f32]) -> f32 {
+        buffer.iter().fold(0.0_f32, |peak, sample| peak.max(sample.abs()))
+    }
+
+    pub fn sum_of_squares(buffer: &[f32]) -> f32 {
+        buffer.iter().map(|sample| *sample * *sample).sum()
+    }
+
+    pub fn interleave(left: &[f32], right: &[f32], interleaved: &mut [f32]) {
+        for ((frame, left_sample), right_sample) in interleaved.chunks_exact_mut(2).zip(left.iter()).zip(right.iter()) {
+            frame[0] = *left_sample;
+            frame[1] = *right_sample;
+        }
+    }
+
+    pub fn deinterleave(interleaved: &[f32], left: &mut [f32], right: &mut [f32]) {
+        for ((frame, left_sample), right_sample) in interleaved.chunks_exact(2).zip(left.iter_mut()).zip(right.iter_mut()) {
+            *left_sample = frame[0];
+            *right_sample = frame[1];
+        }
+    }
+}
+
+/// The callers guarantee the slices are the same length (interleaved slices twice the length).
+#[cfg(target_arch = "x86_64")]
+mod x86 {
+    use std::arch::x86_64::*;
+
+    use super::scalar;
+
+    #[target_feature(enable = "sse2")]
+    pub unsafe fn mix_accumulate_sse(destination: &mut [f32], source: &[f32], gain: f32) {
+        let vector_length = destination.len() - destination.len() % 4;
+        let gain_vector = _mm_set1_ps(gain);
+        let mut index = 0;
+        while index < vector_length {
+            let destination_vector = _mm_loadu_ps(destination.as_ptr().add(index));
+            let source_vector = _mm_loadu_ps(source.as_ptr().add(index));
+            _mm_storeu_ps(destination.as_mut_ptr().add(index), _mm_add_ps(destination_vector, _mm_mul_ps(source_vector, gain_vector)));
+            index += 4;
+        }
+        scalar::mix_accumulate(&mut destination[vector_length..], &source[vector_length..], gain);
+    }
+
+    #[target_feature(enable = "avx2")]
+    pub unsafe fn mix_accumulate_avx2(destination: &mut [f32], source: &[f32], gain: f32) {
+        let vector_length = destination.len() - destination.len() % 8;
+        let gain_vector = _mm256_set1_ps(gain);
+        let mut index = 0;
+        while index < vector_length {
+            let destination_vector = _mm256_loadu_ps(destination.as_ptr().add(index));
+            let source_vector = _mm256_loadu_ps(source.as_ptr().add(index));
+            _mm256_storeu_ps(destination.as_mut_ptr().add(index), _mm256_add_ps(destination_vector, _mm256_mul_ps(source_vector, gain_vector)));
+            index += 8;
+        }
+        scalar::mix_accumulate(&mut destination[vector_length..], &source[vector_length..], gain);
+    }
+
+    #[target_feature(enable = "sse2")]
+    pub unsafe fn mix_interleaved_stereo_sse(left: &mut [f32], right: &mut [f32], interleaved: &[f32], left_gain: f32, right_gain: f32) {
+        let vector_length = left.len() - left.len() % 4;
+        let left_gain_vector = _mm_set1_ps(left_gain);
+        let right_gain_vector = _mm_set1_ps(right_gain);
+        let mut index = 0;
+        while index < vector_length {
+            let first = _mm_loadu_ps(interleaved.as_ptr().add(index * 2));
+            let second = _mm_loadu_ps(interleaved.as_ptr().add(index * 2 + 4));
+            let left_source = _mm_shuffle_ps(first, second, 0b10_00_10_00);
+            let right_source = _mm_shuffle_ps(first, second, 0b11_01_11_01);
+            let left_vector = _mm_loadu_ps(left.as_ptr().add(index));
+            let right_vector = _mm_loadu_ps(right.as_ptr().add(index));
+            _mm_storeu_ps(left.as_mut_ptr().add(index), _mm_add_ps(left_vector, _mm_mul_ps(left_source, left_gain_vector)));
+            _mm_storeu_ps(right.as_mut_ptr().add(index), _mm_add_ps(right_vector, _mm_mul_ps(right_source, right_gain_vector)));
+            index += 4;
+        }
+        scalar::mix_interleaved_stereo(&mut left[vector_length..], &mut right[vector_length..], &interleaved[vector_length * 2..], left_gain, right_gain);
+    }
+
+    #[target_feature(enable = "sse2")]
+    pub unsafe fn apply_gain_with_peak_sse(buffer: &mut [f32], gain: f32) -> f32 {
+        let vector_length = buffer.len() - buffer.len() % 4;
+        let gain_vector = _mm_set1_ps(gain);
+        let abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fff_ffff));
+        let mut peak_vector = _mm_setzero_ps();
+        let mut index = 0;
+        while index < vector_length {
+            let vector = _mm_mul_ps(_mm_loadu_ps(buffer.as_ptr().add(index)), gain_vector);
+            _mm_storeu_ps(buffer.as_mut_ptr().add(index), vector);
+            peak_vector = _mm_max_ps(peak_vector, _mm_and_ps(vector, abs_mask));
+            index += 4;
+        }
+        horizontal_max_sse(peak_vector).max(scalar::apply_gain_with_peak(&mut buffer[vector_length..], gain))
+    }
+
+    #[target_feature(enable = "avx2")]
+    pub unsafe fn apply_gain_with_peak_avx2(buffer: &mut [f32], gain: f32) -> f32 {
+        let vector_length = buffer.len() - buffer.len() % 8;
+        let gain_vector = _mm256_set1_ps(gain);
+        let abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fff_ffff));
+        let mut peak_vector = _mm256_setzero_ps();
+        let mut index = 0;
+        while index < vector_length {
+            let vector = _mm256_mul_ps(_mm256_loadu_ps(buffer.as_ptr().add(index)), gain_vector);
+            _mm256_storeu_ps(buffer.as_mut_ptr().add(index), vector);
+            peak_vector = _mm256_max_ps(peak_vector, _mm256_and_ps(vector, abs_mask));
+            index += 8;
+        }
+        horizontal_max_avx2(peak_vector).max(scalar::apply_gain_with_peak(&mut buffer[vector_length..], gain))
+    }
+
+    #[target_feature(enable = "sse2")]
+    pub unsafe fn peak_sse(buffer: &[f32]) -> f32 {
+        let vector_length = buffer.len() - buffer.len() % 4;
+        let abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fff_ffff));
+        let mut peak_vector = _mm_setzero_ps();
+        let mut index = 0;
+        while index < vector_length {
+            peak_vector = _mm_max_ps(peak_vector, _mm_and_ps(_mm_loadu_ps(buffer.as_ptr().add(index)), abs_mask));
+            index += 4;
+        }
+        horizontal_max_sse(peak_vector).max(scalar::peak(&buffer[vector_length..]))
+    }
+
+    #[target_feature(enable = "avx2")]
+    pub unsafe fn peak_avx2(buffer: &[f32]) -> f32 {
+        let vector_length = buffer.len() - buffer.len() % 8;
+        let abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fff_ffff));
+        let mut peak_vector = _mm256_setzero_ps();
+        let mut index = 0;
+        while index < vector_length {
+            peak_vector = _mm256_max_ps(peak_vector, _mm256_and_ps(_mm256_loadu_ps(buffer.as_ptr().add(index)), abs_mask));
+            index += 8;
+        }
+        horizontal_max_avx2(peak_vector).max(scalar::peak(&buffer[vector_length..]))
+    }
+
+    #[target_feature(enable = "sse2")]
+    pub unsafe fn sum_of_squares_sse(buffer: &[f32]) -> f32 {
+        let vector_length = buffer.len() - buffer.len() % 4;
+        let mut sum_vector = _mm_setzero_ps();
+        let mut index = 0;
+        while index < vector_length {
+            let vector = _mm_loadu_ps(buffer.as_ptr().add(index));
+            sum_vector = _mm_add_ps(sum_vector, _mm_mul_ps(vector, vector));
+            index += 4;
+        }
+        let mut sums = [0.0_f32; 4];
+        _mm_storeu_ps(sums.as_mut_ptr(), sum_vector);
+        sums.iter().sum::<f32>() + scalar::sum_of_squares(&buffer[vector_length..])
+    }
+
+    #[target_feature(enable = "avx2")]
+    pub unsafe fn sum_of_squares_avx2(buffer: &[f32]) -> f32 {
+        let vector_length = buffer.len() - buffer.len() % 8;
+        let mut sum_vector = _mm256_setzero_ps();
+        let mut index = 0;
+        while index < vector_length {
+            let vector = _mm256_loadu_ps(buffer.as_ptr().add(index));
+            sum_vector = _mm256_add_ps(sum_vector, _mm256_mul_ps(vector, vector));
+            index += 8;
+        }
+        let mut sums = [0.0_f32; 8];
+        _mm256_storeu_ps(sums.as_mut_ptr(), sum_vector);
+        sums.iter().sum::<f32>() + scalar::sum_of_squares(&buffer[vector_length..])
+    }
+
+    #[target_feature(enable = "sse2")]
+    pub unsafe fn interleave_sse(left: &[f32], right: &[f32], interleaved: &mut [f32]) {
+        let vector_length = left.len() - left.len() % 4;
+        let mut index = 0;
+        while index < vector_length {
+            let left_vector = _mm_loadu_ps(left.as_ptr().add(index));
+            let right_vector = _mm_loadu_ps(right.as_ptr().add(index));
+            _mm_storeu_ps(interleaved.as_mut_ptr().add(index * 2), _mm_unpacklo_ps(left_vector, right_vector));
+            _mm_storeu_ps(interleaved.as_mut_ptr().add(index * 2 + 4), _mm_unpackhi_ps(left_vector, right_vector));
+            index += 4;
+        }
+        scalar::interleave(&left[vector_length..], &right[vector_length..], &mut interleaved[vector_length * 2..]);
+    }
+
+    #[target_feature(enable = "sse2")]
+    pub unsafe fn deinterleave_sse(interleaved: &[f32], left: &mut [f32], right: &mut [f32]) {
+        let vector_length = left.len() - left.len() % 4;
+        let mut index = 0;
+        while index < vector_length {
+            let first = _mm_loadu_ps(interleaved.as_ptr().add(index * 2));
+            let second = _mm_loadu_ps(interleaved.as_ptr().add(index * 2 + 4));
+            _mm_storeu_ps(left.as_mut_ptr().add(index), _mm_shuffle_ps(first, second, 0b10_00_10_00));
+            _mm_storeu_ps(right.as_mut_ptr().add(index), _mm_shuffle_ps(first, second, 0b11_01_11_01));
+            index += 4;
+        }
+        scalar::deinterleave(&interleaved[vector_length * 2..], &mut left[vector_length..], &mut right[vector_length..]);
+    }
+
+    #[target_feature(enable = "sse2")]
+    unsafe fn horizontal_max_sse(vector: __m128) -> f32 {
+        let mut lanes = [0.0_f32; 4];
+        _mm_storeu_ps(lanes.as_mut_ptr(), vector);
+        lanes.iter().fold(0.0_f32, |peak, lane| peak.max(*lane))
+    }
+
+    #[target_feature(enable = "avx2")]
+    unsafe fn horizontal_max_avx2(vector: __m256) -> f32 {
+        let mut lanes = [0.0_f32; 8];
+        _mm256_storeu_ps(lanes.as_mut_ptr(), vector);
+        lanes.iter().fold(0.0_f32, |peak, lane| peak.max(*lane))
+    }
+}
+
+/// The callers guarantee the slices are the same length (interleaved slices twice the length).
+#[cfg(target_arch = "aarch64")]
+mod neon {
+    use std::arch::aarch64::*;
+
+    use super::scalar;
+
+    pub unsafe fn mix_accumulate(destination: &mut [f32], source: &[f32], gain: f32) {
+        let vector_length = destination.len() - destination.len() % 4;
+        let gain_vector = vdupq_n_f32(gain);
+        let mut index = 0;
+        while index < vector_length {
+            let destination_vector = vld1q_f32(destination.as_ptr().add(index));
+            let source_vector = vld1q_f32(source.as_ptr().add(index));
+            vst1q_f32(destination.as_mut_ptr().add(index), vaddq_f32(destination_vector, vmulq_f32(source_vector, gain_vector)));
+            index += 4;
+        }
+        scalar::mix_accumulate(&mut destination[vector_length..], &source[vector_length..], gain);
+    }
+
+    pub unsafe fn mix_interleaved_stereo(left: &mut [f32], right: &mut [f32], interleaved: &[f32], left_gain: f32, right_gain: f32) {
+        let vector_length = left.len() - left.len() % 4;
+        let left_gain_vector = vdupq_n_f32(left_gain);
+        let right_gain_vector = vdupq_n_f32(right_gain);
+        let mut index = 0;
+        while index < vector_length {
+            let first = vld1q_f32(interleaved.as_ptr().add(index * 2));
+            let second = vld1q_f32(interleaved.as_ptr().add(index * 2 + 4));
+            let left_vector = vld1q_f32(left.as_ptr().add(index));
+            let right_vector = vld1q_f32(right.as_ptr().add(index));
+            vst1q_f32(left.as_mut_ptr().add(index), vaddq_f32(left_vector, vmulq_f32(vuzp1q_f32(first, second), left_gain_vector)));
+            vst1q_f32(right.as_mut_ptr().add(index), vaddq_f32(right_vector, vmulq_f32(vuzp2q_f32(first, second), right_gain_vector)));
+            index += 4;
+        }
+        scalar::mix_interleaved_stereo(&mut left[vector_length..], &mut right[vector_length..], &interleaved[vector_length * 2..], left_gain, right_gain);
+    }
+
+    pub unsafe fn apply_gain_with_peak(buffer: &mut [f32], gain: f32) -> f32 {
+        let vector_length = buffer.len() - buffer.len() % 4;
+        let gain_vector = vdupq_n_f32(gain);
+        let mut peak_vector = vdupq_n_f32(0.0);
+        let mut index = 0;
+        while index < vector_length {
+            let vector = vmulq_f32(vld1q_f32(buffer.as_ptr().add(index)), gain_vector);
+            vst1q_f32(buffer.as_mut_ptr().add(index), vector);
+            peak_vector = vmaxq_f32(peak_vector, vabsq_f32(vector));
+            index += 4;
+        }
+        vmaxvq_f32(peak_vector).max(scalar::apply_gain_with_peak(&mut buffer[vector_length..], gain))
+    }
+
+    pub unsafe fn peak(buffer: &[f32]) -> f32 {
+        let vector_length = buffer.len() - buffer.len() % 4;
+        let mut peak_vector = vdupq_n_f32(0.0);
+        let mut index = 0;
+        while index < vector_length {
+            peak_vector = vmaxq_f32(peak_vector, vabsq_f32(vld1q_f32(buffer.as_ptr().add(index))));
+            index += 4;
+        }
+        vmaxvq_f32(peak_vector).max(scalar::peak(&buffer[vector_length..]))
+    }
+
+    pub unsafe fn sum_of_squares(buffer: &[f32]) -> f32 {
+        let vector_length = buffer.len() - buffer.len() % 4;
+        let mut sum_vector = vdupq_n_f32(0.0);
+        let mut index = 0;
+        while index < vector_length {
+            let vector = vld1q_f32(buffer.as_ptr().add(index));
+            sum_vector = vaddq_f32(sum_vector, vmulq_f32(vector, vector));
+            index += 4;
+        }
+        vaddvq_f32(sum_vector) + scalar::sum_of_squares(&buffer[vector_length..])
+    }
+
+    pub unsafe fn interleave(left: &[f32], right: &[f32], interleaved: &mut [f32]) {
+        let vector_length = left.len() - left.len() % 4;
+        let mut index = 0;
+        while index < vector_length {
+            let left_vector = vld1q_f32(left.as_ptr().add(index));
+            let right_vector = vld1q_f32(right.as_ptr().add(index));
+            vst1q_f32(interleaved.as_mut_ptr().add(index * 2), vzip1q_f32(left_vector, right_vector));
+            vst1q_f32(interleaved.as_mut_ptr().add(index * 2 + 4), vzip2q_f32(left_vector, right_vector));
+            index += 4;
+        }
+        scalar::interleave(&left[vector_length..], &right[vector_length..], &mut interleaved[vector_length * 2..]);
+    }
+
+    pub unsafe fn deinterleave(interleaved: &[f32], left: &mut [f32], right: &mut [f32]) {
+        let vector_length = left.len() - left.len() % 4;
+        let mut index = 0;
+        while index < vector_length {
+            let first = vld1q_f32(interleaved.as_ptr().add(index * 2));
+            let second = vld1q_f32(interleaved.as_ptr().add(index * 2 + 4));
+            vst1q_f32(left.as_mut_ptr().add(index), vuzp1q_f32(first, second));
+            vst1q_f32(right.as_mut_ptr().add(index), vuzp2q_f32(first, second));
+            index += 4;
+        }
+        scalar::deinterleave(&interleaved[vector_length * 2..], &mut left[vector_length..], &mut right[vector_length..]);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use crate::dsp::{self, scalar};
+
+    // an odd length so that the scalar tail is exercised as well as the vector loop
+    const TEST_BUFFER_LENGTH: usize = 37;
+
+    fn test_signal(offset: f32) -> Vec<f32> {
+        (0..TEST_BUFFER_LENGTH).map(|index| ((index as f32 + offset) * 0.37).sin()).collect()
+    }
+
+    #[test]
+    fn mix_and_gain_kernels_match_the_scalar_kernels() {
+        let source = test_signal(0.0);
+        let mut destination = test_signal(5.0);
+        let mut expected = destination.clone();
+        dsp::mix_accumulate(&mut destination, &source, 0.7);
+        scalar::mix_accumulate(&mut expected, &source, 0.7);
+        assert_eq!(expected, destination);
+
+        let mut buffer = test_signal(1.0);
+        let mut expected = buffer.clone();
+        let peak = dsp::apply_gain_with_peak(&mut buffer, -1.5);
+        let expected_peak = scalar::apply_gain_with_peak(&mut expected, -1.5);
+        assert_eq!(expected, buffer);
+        assert_eq!(expected_peak, peak);
+        assert_eq!(expected_peak, dsp::peak(&buffer));
+    }
+
+    #[test]
+    fn peak_is_the_largest_absolute_value() {
+        let mut buffer = vec![0.25; TEST_BUFFER_LENGTH];
+        buffer[3] = -0.9; // a negative peak in the vector part
+        assert_eq!(0.9, dsp::peak(&buffer));
+        buffer[TEST_BUFFER_LENGTH - 1] = 0.95; // and in the tail
+        assert_eq!(0.95, dsp::peak(&buffer));
+        assert_eq!(0.0, dsp::peak(&[]));
+    }
+
+    #[test]
+    fn rms_of_a_constant_is_its_magnitude() {
+        assert!((dsp::rms(&[-0.5; TEST_BUFFER_LENGTH]) - 0.5).abs() < 1e-6);
+        assert_eq!(0.0, dsp::rms(&[]));
+    }
+
+    #[test]
+    fn interleave_and_deinterleave_round_trip() {
+        let left = test_signal(0.0);
+        let right = test_signal(3.0);
+        let mut interleaved = vec![0.0; TEST_BUFFER_LENGTH * 2];
+        dsp::interleave(&left, &right, &mut interleaved);
+        assert_eq!(left[TEST_BUFFER_LENGTH - 1], interleaved[TEST_BUFFER_LENGTH * 2 - 2]);
+        assert_eq!(right[1], interleaved[3]);
+
+        let mut deinterleaved_left = vec![0.0; TEST_BUFFER_LENGTH];
+        let mut deinterleaved_right = vec![0.0; TEST_BUFFER_LENGTH];
+        dsp::deinterleave(&interleaved, &mut deinterleaved_left, &mut deinterleaved_right);
+        assert_eq!(left, deinterleaved_left);
+        assert_eq!(right, deinterleaved_right);
+
+        let mut mixed_left = vec![1.0; TEST_BUFFER_LENGTH];
+        let mut mixed_right = vec![1.0; TEST_BUFFER_LENGTH];
+        let mut expected_left = mixed_left.clone();
+        let mut expected_right = mixed_right.clone();
+        dsp::mix_interleaved_stereo(&mut mixed_left, &mut mixed_right, &interleaved, 0.5, 0.25);
+        scalar::mix_interleaved_stereo(&mut expected_left, &mut expected_right, &interleaved, 0.5, 0.25);
+        assert_eq!(expected_left, mixed_left);
+        assert_eq!(expected_right, mixed_right);
+    }
+}
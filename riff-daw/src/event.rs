@@ -10,8 +10,11 @@ use simple_clap_host_helper_lib::plugin::library::PluginLibrary;
 use uuid::Uuid;
 use vst::{event::MidiEvent, host::PluginLoader};
 
-use crate::{MidiConsumerDetails, SampleData, domain::Riff};
-use crate::domain::{AudioConsumerDetails, AudioRouting, NoteExpressionType, PluginParameter, TrackEvent, TrackEventRouting, VstHost};
+use crate::{LiveMidiProducerDetails, MidiConsumerDetails, SampleData, domain::Riff};
+use crate::audio_bus::{AudioBus, AudioBusReceiver};
+use crate::delay_compensation::{TrackDelayCompensator, TrackPluginLatency};
+use crate::domain::{AudioConsumerDetails, AudioRouting, EventBlocks, NoteExpressionType, PluginParameter, PluginSandboxConfiguration, TrackEvent, TrackEventRouting, VstHost};
+use crate::lua_api::ScriptBatch;
 
 #[derive(Clone)]
 pub enum CurrentView {
@@ -160,6 +163,9 @@ pub enum TrackChangeType {
 
     TrackNameChanged(String), // new track name
     CopyTrack,
+    Freeze,
+    Unfreeze,
+    FreezeRendered(String, u64, usize), // freeze file name, content hash, output delay compensation rendered into it
 
     EffectAdded(Uuid, String, String),    // uuid, name, path
     EffectDeleted(String),                // vst effect plugin uuid
@@ -258,9 +264,12 @@ pub enum DAWEvents {
     ExportMidiFile(PathBuf),
     ExportRiffsToMidiFile(PathBuf),
     ExportWaveFile(PathBuf),
+    ExportStems(PathBuf), // directory
     UpdateUI,
+    RebuildUI, // clear the gui and build it again from the state - after tracks have been added or removed outside the gui
     UpdateState,
     HideProgressDialogue,
+    ProgressDialogueFraction(f64), // fraction complete
 
     Undo,
     Redo,
@@ -365,8 +374,11 @@ pub enum DAWEvents {
 
     SampleAdd(String),    // absolute path sample file name
     SampleDelete(String), // uuid
+    WaveformPeaksReady(String), // absolute path sample file name
 
     RunLuaScript(String), // Lua script text
+    LuaScriptOutput(String), // what the script returned or the error it failed with
+    ScriptBatch(ScriptBatch), // the changes a script committed - applied together
 
     TrackDetails(String, bool), // track uuid string, show: true/false
 
@@ -382,26 +394,45 @@ pub enum AudioLayerInwardEvent {
     ExtentsChange(i32),
     Stop,
     Tempo(f64),
-    SampleRate(f64),
-    BlockSize(f64),
     Volume(f32), // volume
     Pan(f32),    // pan
     Shutdown,
     RemoveTrack(String),                           // track uuid
     NewMidiOutPortForTrack(String, Port<MidiOut>), // track uuid, jack midi port
+    NewLiveMidiProducer(LiveMidiProducerDetails),  // where the jack process callback writes live midi in for a track
+    LiveMidiInputTrack(Option<String>, u8),        // selected track uuid, midi channel to play live midi in on
 
-    PreviewSample(String), // absolute path sample file name
+    PreviewSample(SampleData), // sample loaded off the jack thread
+}
+
+// Things the jack process callback is done with. They are shipped to a non real time thread to be dropped
+// so that the callback never frees heap memory itself.
+pub enum AudioLayerRetiredItem {
+    AudioConsumer(AudioConsumerDetails<f32>),
+    MidiConsumer(MidiConsumerDetails<(u32, u8, u8, u8, bool)>),
+    MidiOutPort(Port<MidiOut>),
+    LiveMidiProducer(LiveMidiProducerDetails),
+    Sample(SampleData),
+    TrackUuid(String),
 }
 
 pub enum TrackBackgroundProcessorInwardEvent {
     SetSample(SampleData),
+    SetFrozenAudio(Option<SampleData>, usize), // played in place of the instrument and effects - None to play them live again, the output delay compensation rendered into it
     SetEvents(
         (
-            Vec<Vec<TrackEvent>>,
-            Vec<Vec<PluginParameter>>,
+            EventBlocks<TrackEvent>,
+            EventBlocks<PluginParameter>,
         ),
         bool,
     ), // instrument plugin events, instrument and effect plugin parameters, transition_to
+    ReplaceEventBlocks(
+        usize,
+        (
+            EventBlocks<TrackEvent>,
+            EventBlocks<PluginParameter>,
+        ),
+    ), // start block number, replacement instrument plugin events and instrument and effect plugin parameters for blocks start..start + replacement length
     GotoStart,
     MoveBack,
     Play(i32), // start at block number
@@ -447,6 +478,10 @@ pub enum TrackBackgroundProcessorInwardEvent {
     RequestEffectParameters(String), // uuid
 
     SetBlockPosition(i32), // block position
+    SetAudioFormat(usize, f64), // block size, sample rate
+    SetDelayCompensation(TrackDelayCompensator), // built on the gui side - see TrackDelayCompensator::replace
+    SetAutomationRamping(bool), // ramp between automation changes rather than stepping
+    SetPluginSandbox(PluginSandboxConfiguration), // which plugins to load in a sandbox process
 
     Volume(f32), // volume
     Pan(f32),    // pan
@@ -460,9 +495,9 @@ pub enum TrackBackgroundProcessorInwardEvent {
     RemoveTrackEventReceiveRouting(String), // route uuid
     UpdateTrackEventReceiveRouting(String, TrackEventRouting), // route_uuid, route
 
-    AddAudioSendRouting(AudioRouting, (SpscRb<f32>, SpscRb<f32>), (Producer<f32>, Producer<f32>)), // audio routing, (ring buffer left, ring buffer right), (left producer, right producer)
+    AddAudioSendRouting(AudioRouting, Arc<AudioBus>), // audio routing, the sending track's audio bus - written once per block however many routings it has
     RemoveAudioSendRouting(String), // route uuid
-    AddAudioReceiveRouting(AudioRouting, (Consumer<f32>, Consumer<f32>)), // audio routing, (consumer left, consumer right)
+    AddAudioReceiveRouting(AudioRouting, AudioBusReceiver), // audio routing, the receiving end of the sending track's audio bus
     RemoveAudioReceiveRouting(String), // route uuid
 }
 
@@ -476,6 +511,8 @@ pub enum TrackBackgroundProcessorOutwardEvent {
     Automation(String, String, bool, i32, f32), // track uuid, vst plugin uuid, is instrument, param index, param value - 0.0 to 1.0
     TrackRenderAudioConsumer(AudioConsumerDetails<f32>),
     ChannelLevels(String, f32, f32), // track_uuid, left channel level, right channel_level
+    PluginLatency(TrackPluginLatency), // sent when the latency of the track's plugins changes
+    RetiredDelayCompensator(TrackDelayCompensator), // the delay lines a track replaced - dropped here rather than on its worker
 }
 
 pub enum AudioLayerOutwardEvent {
@@ -486,6 +523,14 @@ pub enum AudioLayerOutwardEvent {
     JackRestartRequired,
     JackConnect(String, String), // from, to
     MasterChannelLevels(f32, f32),
+    AudioFormat(usize, f64), // block size, sample rate
+    Problem(AudioLayerProblem),
+}
+
+/// Problems the jack process callback can't sort out itself - reported to the gui.
+pub enum AudioLayerProblem {
+    NoFreeSlot(AudioLayerRetiredItem), // a track's consumer or producer there was no room for - handed back to be dropped
+    RetiredItemLeaked,                 // the retired item queue and backlog were full so an item was leaked rather than freed on the jack thread
 }
 
 pub enum AudioPluginHostOutwardEvent {
@@ -9,6 +9,9 @@ use strum_macros::Display;
 use uuid::Uuid;
 
 use crate::{domain::*, event::{DAWEvents, LoopChangeType, OperationModeType, TrackChangeType, TranslateDirection, TranslationEntityType, AutomationEditType}, state::DAWState, constants::NOTE_NAMES};
+use crate::grid_cache::{BeatIntervalIndex, CachedLayer, TrackGridIndex, visible_area};
+use crate::project_snapshot::{ProjectSnapshot, SnapshotCell};
+use crate::waveform_peaks::{SampleWaveforms, WaveformPeakCache, WaveformPeaks};
 
 #[derive(Debug)]
 pub enum MouseButton {
@@ -387,6 +390,9 @@ pub struct BeatGrid {
 
     // edit cycle drag move items
     pub edit_drag_cycle: EditDragCycle,
+
+    // canvas width, canvas height, entity height, beat width, zoom horizontal, zoom vertical
+    background_layer: CachedLayer<(f64, f64, f64, f64, f64, f64)>,
 }
 
 impl BeatGrid {
@@ -460,6 +466,8 @@ impl BeatGrid {
             draw_mode_y_end: 0.0,
 
             edit_drag_cycle: EditDragCycle::NotStarted,
+
+            background_layer: CachedLayer::default(),
         }
     }
 
@@ -544,6 +552,8 @@ impl BeatGrid {
             draw_mode_y_end: 0.0,
 
             edit_drag_cycle: EditDragCycle::NotStarted,
+
+            background_layer: CachedLayer::default(),
         }
     }
 
@@ -629,6 +639,8 @@ impl BeatGrid {
             draw_mode_y_end: 0.0,
 
             edit_drag_cycle: EditDragCycle::NotStarted,
+
+            background_layer: CachedLayer::default(),
         }
     }
 
@@ -1079,10 +1091,6 @@ impl Grid for BeatGrid {
         // if self.resize_drawing_area {
         //     drawing_area.set_width_request((self.beat_width_in_pixels * self.zoom) as i32 * 400 * 4);
         // }
-        context.set_source_rgb(1.0, 1.0, 1.0);
-        context.rectangle(0.0, 0.0, drawing_area.width_request() as f64, drawing_area.height_request() as f64);
-        let _ = context.fill();
-
         let height = drawing_area.height_request() as f64;
         let width = drawing_area.width_request() as f64;
 
@@ -1090,8 +1098,18 @@ impl Grid for BeatGrid {
             window.set_cursor(Some(&gdk::Cursor::for_display(&window.display(), gdk::CursorType::Cross)));
         }
 
-        self.paint_vertical_scale(context, height, width, drawing_area);
-        self.paint_horizontal_scale(context, height, width);
+        // the background and scales only change with the size and zoom
+        let background_key = (width, height, self.entity_height_in_pixels, self.beat_width_in_pixels, self.zoom_horizontal, self.zoom_vertical);
+        if let Some(background_context) = self.background_layer.redraw_context(context, background_key, width, height, drawing_area.scale_factor()) {
+            background_context.set_source_rgb(1.0, 1.0, 1.0);
+            background_context.rectangle(0.0, 0.0, width, height);
+            let _ = background_context.fill();
+
+            self.paint_vertical_scale(&background_context, height, width, drawing_area);
+            self.paint_horizontal_scale(&background_context, height, width);
+        }
+        self.background_layer.paint(context);
+
         self.paint_custom(context, height, width, drawing_area.widget_name().to_string(), drawing_area);
         self.paint_loop_markers(context, height, width);
         if self.draw_selection_window {
@@ -1147,26 +1165,29 @@ impl Grid for BeatGrid {
         else {
             context.set_source_rgba(0.9, 0.9, 0.9, 0.5);
             let adjusted_entity_height_in_pixels = self.entity_height_in_pixels * self.zoom_vertical;
+            let (_, visible_y1, _, visible_y2) = visible_area(context);
 
-            let mut current_y = 0.0;
-            while current_y < height {
-                let row_number = current_y / adjusted_entity_height_in_pixels;
-
-                if row_number as i32 % 2 == 0 {
+            let mut row_number = (visible_y1 / adjusted_entity_height_in_pixels).floor().max(0.0) as i32;
+            let mut current_y = row_number as f64 * adjusted_entity_height_in_pixels;
+            while current_y < height && current_y <= visible_y2 {
+                if row_number % 2 == 0 {
                     context.rectangle(0.0, current_y, width, adjusted_entity_height_in_pixels);
                     let _ = context.fill();
                 }
 
                 current_y += adjusted_entity_height_in_pixels;
+                row_number += 1;
             }
         }
     }
 
     fn paint_horizontal_scale(&mut self, context: &Context, height: f64, width: f64) {
-        let mut current_x = 0.0;
         let adjusted_beat_width_in_pixels = self.beat_width_in_pixels * self.zoom_horizontal;
-        let mut beat_in_bar_index = 1;
-        while current_x < width {
+        let (visible_x1, _, visible_x2, _) = visible_area(context);
+        let first_beat = (visible_x1 / adjusted_beat_width_in_pixels).floor().max(0.0);
+        let mut current_x = first_beat * adjusted_beat_width_in_pixels;
+        let mut beat_in_bar_index = first_beat as i64 % 4 + 1;
+        while current_x < width && current_x <= visible_x2 {
             if beat_in_bar_index == 1 {
                 context.set_source_rgba(0.5, 0.5, 0.5, 1.0);
             }
@@ -1928,35 +1949,54 @@ impl Piano {
 }
 
 pub struct PianoRollCustomPainter {
-    state: Arc<Mutex<DAWState>>,
+    project_snapshot: Arc<SnapshotCell<ProjectSnapshot>>,
     pub original_track_event_copy: Option<TrackEvent>,
     pub dragged_track_event: Option<TrackEvent>,
     pub edit_item_handler: EditItemHandler<Note, Note>,
+    // project revision, track uuid, riff uuid, canvas width, canvas height, adjusted beat width, adjusted entity height
+    content_layer: CachedLayer<(u64, String, String, f64, f64, f64, f64)>,
 }
 
 impl PianoRollCustomPainter {
-    pub fn new_with_edit_item_handler(state: Arc<Mutex<DAWState>>, edit_item_handler: EditItemHandler<Note, Note>) -> PianoRollCustomPainter {
+    pub fn new_with_edit_item_handler(project_snapshot: Arc<SnapshotCell<ProjectSnapshot>>, edit_item_handler: EditItemHandler<Note, Note>) -> PianoRollCustomPainter {
         PianoRollCustomPainter {
-            state,
+            project_snapshot,
             original_track_event_copy: None,
             dragged_track_event: None,
             edit_item_handler,
+            content_layer: CachedLayer::default(),
         }
     }
+
+    /// The indices of the riff's notes that overlap the visible area in time and pitch - all of them while a note is
+    /// being edited because the one being dragged may have come from outside it.
+    fn visible_riff_notes(&self, riff: &Riff, visible_area: (f64, f64, f64, f64), canvas_height: f64, adjusted_beat_width_in_pixels: f64, adjusted_entity_height_in_pixels: f64, all_when_editing: bool) -> Vec<usize> {
+        let notes = riff.event_store().notes();
+        if all_when_editing && self.edit_item_handler.original_item.is_some() {
+            return notes.ids.clone();
+        }
+
+        let (visible_x1, visible_y1, visible_x2, visible_y2) = visible_area;
+        let lowest_pitch = ((canvas_height - visible_y2) / adjusted_entity_height_in_pixels - 1.0).floor().max(i32::MIN as f64) as i32;
+        let highest_pitch = ((canvas_height - visible_y1) / adjusted_entity_height_in_pixels).ceil().min(i32::MAX as f64) as i32;
+        notes.overlapping(visible_x1 / adjusted_beat_width_in_pixels, visible_x2 / adjusted_beat_width_in_pixels, lowest_pitch, highest_pitch)
+            .map(|row| notes.ids[row])
+            .collect()
+    }
 }
 
 impl CustomPainter for PianoRollCustomPainter {
-    fn paint_custom(&mut self, 
-                    context: &Context, 
-                    canvas_height: f64, 
-                    _canvas_width: f64, 
+    fn paint_custom(&mut self,
+                    context: &Context,
+                    canvas_height: f64,
+                    canvas_width: f64,
                     entity_height_in_pixels: f64,
-                    beat_width_in_pixels: f64, 
-                    zoom_horizontal: f64, 
-                    zoom_vertical: f64, 
-                    select_window_top_left_x: f64, 
-                    select_window_top_left_y: f64, 
-                    select_window_bottom_right_x: f64, 
+                    beat_width_in_pixels: f64,
+                    zoom_horizontal: f64,
+                    zoom_vertical: f64,
+                    select_window_top_left_x: f64,
+                    select_window_top_left_y: f64,
+                    select_window_bottom_right_x: f64,
                     select_window_bottom_right_y: f64,
                     drawing_area_widget_name: Option<String>,
                     mouse_pointer_x: f64,
@@ -1977,86 +2017,92 @@ impl CustomPainter for PianoRollCustomPainter {
                 ) {
         let adjusted_entity_height_in_pixels = entity_height_in_pixels * zoom_vertical;
 
-        match self.state.lock() {
-            Ok(mut state) => {
-                let adjusted_beat_width_in_pixels = beat_width_in_pixels * zoom_horizontal;
-                // let mut edit_mode = EditMode::Inactive;
+        let snapshot = self.project_snapshot.load();
+        let adjusted_beat_width_in_pixels = beat_width_in_pixels * zoom_horizontal;
+
+        if let Some((track_index, track, riff)) = snapshot.selected_riff() {
+            let track_uuid = track.uuid.clone();
+            let riff_uuid = riff.uuid().to_string();
+            let colour = match riff.colour() {
+                Some((red, green, blue, _)) => (*red, *green, *blue),
+                None => {
+                    let (red, green, blue, _) = track.colour;
+                    (red, green, blue)
+                }
+            };
+            let note_rectangle = |note: &Note| {
+                let note_y_pos_inverted = note.note() as f64 * adjusted_entity_height_in_pixels + adjusted_entity_height_in_pixels;
+                (note.position() * adjusted_beat_width_in_pixels, canvas_height - note_y_pos_inverted, note.length() * adjusted_beat_width_in_pixels)
+            };
+            let note_visible = |y: f64, (_, visible_y1, _, visible_y2): (f64, f64, f64, f64)| y + adjusted_entity_height_in_pixels >= visible_y1 && y <= visible_y2;
+
+            // the notes are only drawn again when the riff changes or a scroll leaves the cached area
+            let content_key = (snapshot.revision, track_uuid.clone(), riff_uuid.clone(), canvas_width, canvas_height, adjusted_beat_width_in_pixels, adjusted_entity_height_in_pixels);
+            if let Some(content_context) = self.content_layer.redraw_context(context, content_key, canvas_width, canvas_height, drawing_area.scale_factor()) {
+                let content_visible_area = visible_area(&content_context);
+                content_context.set_source_rgba(colour.0, colour.1, colour.2, 1.0);
+                for index in self.visible_riff_notes(riff, content_visible_area, canvas_height, adjusted_beat_width_in_pixels, adjusted_entity_height_in_pixels, false) {
+                    if let Some(TrackEvent::Note(note)) = riff.events().get(index) {
+                        let (x, y, width) = note_rectangle(note);
+                        if note_visible(y, content_visible_area) {
+                            content_context.rectangle(x, y, width, adjusted_entity_height_in_pixels);
+                            let _ = content_context.fill();
+                        }
+                    }
+                }
+            }
+            self.content_layer.paint(context);
+
+            // edit handles, dragged notes and the selection are drawn over the cached notes every time
+            let overlay_visible_area = visible_area(context);
+            for index in self.visible_riff_notes(riff, overlay_visible_area, canvas_height, adjusted_beat_width_in_pixels, adjusted_entity_height_in_pixels, true) {
+                if let Some(TrackEvent::Note(note)) = riff.events().get(index) {
+                    let (x, y, width) = note_rectangle(note);
+                    let editing = self.edit_item_handler.original_item.is_some();
+                    if !editing && !note_visible(y, overlay_visible_area) {
+                        continue;
+                    }
 
-                match state.selected_track() {
-                    Some(track_uuid) => match state.selected_riff_uuid(track_uuid.clone()) {
-                        Some(riff_uuid) => match state.project().song().tracks().iter().find(|track| track.uuid().to_string() == track_uuid) {
-                            Some(track) => {
-                                let (red, green, blue, _) = track.colour();
+                    let selected = select_window_top_left_x <= x && (x + width) <= select_window_bottom_right_x &&
+                        select_window_top_left_y <= y && (y + adjusted_entity_height_in_pixels) <= select_window_bottom_right_y;
+                    if selected {
+                        context.set_source_rgb(0.0, 0.0, 1.0);
+                    }
+                    else {
+                        context.set_source_rgba(colour.0, colour.1, colour.2, 1.0);
+                    }
 
-                                if let Some((track_index, _0)) = state.project().song().tracks().iter().find_position(|track| track.uuid().to_string() == track_uuid) {
-                                    for riff in track.riffs().iter() {
-                                        if riff.uuid().to_string() == riff_uuid {
-                                            for track_event in riff.events() {
-                                                if let Some((red, green, blue, _)) = riff.colour() {
-                                                    context.set_source_rgba(*red, *green, *blue, 1.0);
-                                                }
-                                                else {
-                                                    context.set_source_rgba(red, green, blue, 1.0);
-                                                }
-    
-                                                match track_event {
-                                                    TrackEvent::Note(note) => {
-                                                        let note_number = note.note();
-                                                        let note_y_pos_inverted = note_number as f64 * adjusted_entity_height_in_pixels + adjusted_entity_height_in_pixels;
-                                                        let x = note.position() * adjusted_beat_width_in_pixels;
-                                                        // let x_original = x;
-                                                        let y = canvas_height - note_y_pos_inverted;
-                                                        // let y_original = y;
-                                                        let width = note.length() * adjusted_beat_width_in_pixels;
-    
-                                                        if select_window_top_left_x <= x && (x + width) <= select_window_bottom_right_x &&
-                                                            select_window_top_left_y <= y && (y + adjusted_entity_height_in_pixels) <= select_window_bottom_right_y {
-                                                            context.set_source_rgb(0.0, 0.0, 1.0);
-                                                        }
-    
-                                                        self.edit_item_handler.handle_item_edit(
-                                                            context, 
-                                                            note, 
-                                                            operation_mode, 
-                                                            mouse_pointer_x, 
-                                                            mouse_pointer_y, 
-                                                            mouse_pointer_previous_x, 
-                                                            mouse_pointer_previous_y, 
-                                                            adjusted_entity_height_in_pixels, 
-                                                            adjusted_beat_width_in_pixels, 
-                                                            x, 
-                                                            y, 
-                                                            width, 
-                                                            canvas_height, 
-                                                            drawing_area, 
-                                                            edit_drag_cycle, 
-                                                            tx_from_ui.clone(), 
-                                                            true,
-                                                            track_uuid.clone(),
-                                                            note,
-                                                            true,
-                                                            track_index as f64,
-                                                        );
-    
-                                                        context.rectangle(x, y, width, adjusted_entity_height_in_pixels);
-                                                        let _ = context.fill();
-                                            },
-                                                    _ => (),
-                                                }
-                                            }
-                                            break;
-                                        }
-                                    }
-                                }
-                            },
-                            None => (),
-                        },
-                        None => (),
-                    },
-                    None => (),
+                    self.edit_item_handler.handle_item_edit(
+                        context,
+                        note,
+                        operation_mode,
+                        mouse_pointer_x,
+                        mouse_pointer_y,
+                        mouse_pointer_previous_x,
+                        mouse_pointer_previous_y,
+                        adjusted_entity_height_in_pixels,
+                        adjusted_beat_width_in_pixels,
+                        x,
+                        y,
+                        width,
+                        canvas_height,
+                        drawing_area,
+                        edit_drag_cycle,
+                        tx_from_ui.clone(),
+                        true,
+                        track_uuid.clone(),
+                        note,
+                        true,
+                        track_index as f64,
+                    );
+
+                    if selected {
+                        context.set_source_rgb(0.0, 0.0, 1.0);
+                        context.rectangle(x, y, width, adjusted_entity_height_in_pixels);
+                        let _ = context.fill();
+                    }
                 }
-            },
-            Err(_) => info!("Piano Roll custom painter could not get state lock."),
+            }
         }
 
         context.set_source_rgba(0.0, 0.0, 0.0, 1.0);
@@ -2397,6 +2443,15 @@ impl CustomPainter for SampleRollCustomPainter {
                 let adjusted_beat_width_in_pixels = /* beats_per_second * */ beat_width_in_pixels * zoom_horizontal;
                 let adjusted_entity_height_in_pixels = entity_height_in_pixels * zoom_vertical;
 
+                let song = state.project().song();
+                let waveform_peak_cache = state.waveform_peak_cache();
+                let sample_waveforms = SampleWaveforms::new(
+                    song.tempo(),
+                    song.samples().iter().map(|(sample_uuid, sample)| (sample_uuid, sample.file_name())),
+                    &waveform_peak_cache,
+                );
+                let (visible_x1, _, visible_x2, _) = visible_area(context);
+
                 match state.selected_track() {
                     Some(track_uuid) => match state.selected_riff_uuid(track_uuid.clone()) {
                         Some(riff_uuid) => match state.project().song().tracks().iter().find(|track| track.uuid().to_string() == track_uuid) {
@@ -2417,13 +2472,18 @@ impl CustomPainter for SampleRollCustomPainter {
                                                 TrackEvent::Sample(sample) => {
                                                     let sample_y_pos = 0.0;
                                                     let x = sample.position() * adjusted_beat_width_in_pixels;
-                                                    let width = 1.0 * adjusted_beat_width_in_pixels;
+                                                    // a beat wide until the sample's peaks are ready
+                                                    let peaks = sample_waveforms.peaks(sample.sample_ref_uuid().as_str());
+                                                    let width = peaks.map_or(1.0, |peaks| sample_waveforms.length_in_beats(peaks)) * adjusted_beat_width_in_pixels;
                                                     if select_window_top_left_x <= x && (x + width) <= select_window_bottom_right_x &&
                                                         select_window_top_left_y <= sample_y_pos && (sample_y_pos + entity_height_in_pixels) <= select_window_bottom_right_y {
                                                         context.set_source_rgb(0.0, 0.0, 1.0);
                                                     }
                                                     context.rectangle(x, sample_y_pos, width, entity_height_in_pixels);
                                                     let _ = context.fill();
+                                                    if let Some(peaks) = peaks {
+                                                        paint_sample_waveform(context, peaks, sample_waveforms.frames_per_beat(peaks), x, sample_y_pos, entity_height_in_pixels, adjusted_beat_width_in_pixels, visible_x1, visible_x2);
+                                                    }
                                                 }
                                                 _ => (),
                                             }
@@ -2447,6 +2507,50 @@ impl CustomPainter for SampleRollCustomPainter {
     }
 }
 
+/// Paint a sample's waveform starting at x - the range of each pixel with its rms inside it. The peak level is picked
+/// to suit the zoom and only the visible pixels are drawn so a long sample costs no more than a short one.
+fn paint_sample_waveform(
+    context: &Context,
+    peaks: &WaveformPeaks,
+    frames_per_beat: f64,
+    x: f64,
+    y: f64,
+    height: f64,
+    adjusted_beat_width_in_pixels: f64,
+    visible_x1: f64,
+    visible_x2: f64,
+) {
+    let frames_per_pixel = frames_per_beat / adjusted_beat_width_in_pixels;
+    let width = peaks.length_in_frames() as f64 / frames_per_pixel;
+    let first_pixel_x = x.max(visible_x1).floor();
+    let last_pixel_x = (x + width).min(visible_x2).ceil();
+    if last_pixel_x <= first_pixel_x {
+        return;
+    }
+    let start_frame = (first_pixel_x - x) * frames_per_pixel;
+    let pixels = (last_pixel_x - first_pixel_x) as usize;
+    let centre_y = y + height / 2.0;
+    let half_height = height / 2.0;
+
+    context.set_line_width(1.0);
+    context.set_source_rgba(0.0, 0.0, 0.0, 0.5);
+    peaks.for_each_pixel(start_frame, frames_per_pixel, pixels, |pixel, peak| {
+        let pixel_x = first_pixel_x + pixel as f64 + 0.5;
+        context.move_to(pixel_x, centre_y - peak.max.clamp(-1.0, 1.0) as f64 * half_height);
+        context.line_to(pixel_x, centre_y - peak.min.clamp(-1.0, 1.0) as f64 * half_height + 1.0);
+    });
+    let _ = context.stroke();
+
+    context.set_source_rgba(0.0, 0.0, 0.0, 0.9);
+    peaks.for_each_pixel(start_frame, frames_per_pixel, pixels, |pixel, peak| {
+        let pixel_x = first_pixel_x + pixel as f64 + 0.5;
+        let rms = peak.rms.min(1.0) as f64 * half_height;
+        context.move_to(pixel_x, centre_y - rms);
+        context.line_to(pixel_x, centre_y + rms);
+    });
+    let _ = context.stroke();
+}
+
 pub struct RiffSetTrackCustomPainter {
     state: Arc<Mutex<DAWState>>,
 }
@@ -2648,7 +2752,8 @@ impl CustomPainter for PianoRollVerticalScaleCustomPainter {
 
 
 pub struct TrackGridCustomPainter {
-    state: Arc<Mutex<DAWState>>,
+    project_snapshot: Arc<SnapshotCell<ProjectSnapshot>>,
+    waveform_peak_cache: Option<Arc<WaveformPeakCache>>,
     show_automation: bool,
     show_note: bool,
     show_note_velocity: bool,
@@ -2656,12 +2761,16 @@ pub struct TrackGridCustomPainter {
     pub original_riff: Option<Riff>,
     pub dragged_riff: Option<Riff>,
     pub edit_item_handler: EditItemHandler<Riff, RiffReference>,
+    index: TrackGridIndex,
+    // project revision, waveform peak generation, canvas width, canvas height, adjusted beat width, adjusted entity height, show note, show note velocity, show automation
+    content_layer: CachedLayer<(u64, u64, f64, f64, f64, f64, bool, bool, bool)>,
 }
 
 impl TrackGridCustomPainter {
-    pub fn new_with_edit_item_handler(state: Arc<Mutex<DAWState>>, edit_item_handler: EditItemHandler<Riff, RiffReference>) -> TrackGridCustomPainter {
+    pub fn new_with_edit_item_handler(project_snapshot: Arc<SnapshotCell<ProjectSnapshot>>, waveform_peak_cache: Option<Arc<WaveformPeakCache>>, edit_item_handler: EditItemHandler<Riff, RiffReference>) -> TrackGridCustomPainter {
         TrackGridCustomPainter {
-            state,
+            project_snapshot,
+            waveform_peak_cache,
             show_automation: false,
             show_note: true,
             show_note_velocity: false,
@@ -2669,6 +2778,8 @@ impl TrackGridCustomPainter {
             original_riff: None,
             dragged_riff: None,
             edit_item_handler,
+            index: TrackGridIndex::default(),
+            content_layer: CachedLayer::default(),
         }
     }
     pub fn set_show_automation(&mut self, show_automation: bool) {
@@ -2683,20 +2794,144 @@ impl TrackGridCustomPainter {
     pub fn set_show_pan(&mut self, show_pan: bool) {
         self.show_pan = show_pan;
     }
+
+    /// The riff references on the track that overlap the visible area - all of them while one is being edited because
+    /// the one being dragged may have come from outside it.
+    fn visible_riff_refs(&self, track_number: usize, visible_area: (f64, f64, f64, f64), adjusted_beat_width_in_pixels: f64, adjusted_entity_height_in_pixels: f64, all_when_editing: bool) -> Vec<usize> {
+        let (visible_x1, visible_y1, visible_x2, visible_y2) = visible_area;
+        let y = track_number as f64 * adjusted_entity_height_in_pixels;
+        match self.index.riff_refs.get(track_number) {
+            Some(riff_refs) if all_when_editing && self.edit_item_handler.original_item.is_some() => riff_refs.overlapping(f64::MIN, f64::MAX).collect(),
+            Some(riff_refs) if y + adjusted_entity_height_in_pixels >= visible_y1 && y <= visible_y2 => {
+                riff_refs.overlapping((visible_x1 - 1.0) / adjusted_beat_width_in_pixels, (visible_x2 + 1.0) / adjusted_beat_width_in_pixels).collect()
+            }
+            _ => vec![],
+        }
+    }
+}
+
+/// Paint a riff reference and the riff's events using the current source colour for the riff.
+fn paint_track_grid_riff_ref(
+    context: &Context,
+    riff_ref: &RiffReference,
+    riff: &Riff,
+    riff_events: Option<&BeatIntervalIndex>,
+    track_number: f64,
+    adjusted_beat_width_in_pixels: f64,
+    adjusted_entity_height_in_pixels: f64,
+    show_note: bool,
+    show_note_velocity: bool,
+    visible_area: (f64, f64, f64, f64),
+    sample_waveforms: Option<&SampleWaveforms>,
+) {
+    let duration_in_beats = riff.length();
+    let x = riff_ref.position() * adjusted_beat_width_in_pixels;
+    let y = track_number * adjusted_entity_height_in_pixels;
+    let width = duration_in_beats * adjusted_beat_width_in_pixels;
+
+    context.rectangle(x - 1.0, y + 1.0, width - 2.0, adjusted_entity_height_in_pixels - 2.0);
+    let _ = context.fill();
+    context.set_source_rgba(0.0, 0.0, 0.0, 1.0);
+    context.rectangle(x - 1.0, y + 1.0, width - 2.0, adjusted_entity_height_in_pixels - 2.0);
+    context.move_to(x + 5.0, y + 15.0);
+    context.set_font_size(9.0);
+    let mut name = riff.name().to_string();
+    let mut name_fits = false;
+    while !name_fits {
+        if let Ok(text_extents) = context.text_extents(name.as_str()) {
+            if (width - 2.0) < (text_extents.width as f64 + 10.0) {
+                if !name.is_empty() {
+                    name = name.as_str()[0..name.len() - 1].to_string();
+                }
+                else {
+                    name_fits = true;
+                    break;
+                }
+            }
+            else {
+                name_fits = true;
+                break;
+            }
+        }
+    }
+    let _ = context.show_text(name.as_str());
+    context.set_source_rgba(0.0, 0.0, 0.0, 1.0);
+    let _ = context.stroke();
+
+    // draw the visible notes - and samples, which can start well before the visible area
+    let (visible_x1, _, visible_x2, _) = visible_area;
+    let longest_sample_in_beats = sample_waveforms.map_or(0.0, |sample_waveforms| sample_waveforms.longest_in_beats());
+    let visible_event_indices: Vec<usize> = match riff_events {
+        Some(riff_events) => riff_events.overlapping(visible_x1 / adjusted_beat_width_in_pixels - riff_ref.position() - longest_sample_in_beats, visible_x2 / adjusted_beat_width_in_pixels - riff_ref.position()).collect(),
+        None => (0..riff.events().len()).collect(),
+    };
+    for track_event in visible_event_indices.iter().filter_map(|index| riff.events().get(*index)) {
+        match track_event {
+            TrackEvent::ActiveSense => (),
+            TrackEvent::AfterTouch => (),
+            TrackEvent::ProgramChange => (),
+            TrackEvent::Note(note) => {
+                let note_x = (riff_ref.position() + note.position()) * adjusted_beat_width_in_pixels;
+
+                // draw note
+                if show_note {
+                    let note_y = track_number * adjusted_entity_height_in_pixels + adjusted_entity_height_in_pixels - (adjusted_entity_height_in_pixels / 127.0 * note.note() as f64);
+                    context.set_source_rgba(0.0, 0.0, 0.0, 1.0);
+                    context.rectangle(note_x, note_y, note.length() * adjusted_beat_width_in_pixels, adjusted_entity_height_in_pixels / 127.0);
+                    let _ = context.fill();
+                }
+
+                // draw velocity
+                if show_note_velocity {
+                    context.set_source_rgba(0.0, 0.0, 0.0, 1.0);
+                    let velocity_y_start = track_number * adjusted_entity_height_in_pixels + adjusted_entity_height_in_pixels;
+                    context.move_to(note_x, velocity_y_start);
+                    context.line_to(note_x, velocity_y_start - (adjusted_entity_height_in_pixels / 127.0 * note.velocity() as f64));
+                    let _ = context.stroke();
+                }
+            },
+            TrackEvent::NoteOn(_) => (),
+            TrackEvent::NoteOff(_) => (),
+            TrackEvent::Controller(controller) => {
+                let x_position = (riff_ref.position() + controller.position()) * adjusted_beat_width_in_pixels;
+                let y_start = track_number * adjusted_entity_height_in_pixels + adjusted_entity_height_in_pixels;
+
+                context.set_source_rgba(0.0, 0.0, 0.0, 1.0);
+                context.move_to(x_position, y_start);
+                context.line_to(x_position, y_start - (adjusted_entity_height_in_pixels / 127.0 * (controller.value() as f64) as f64));
+                let _ = context.stroke();
+            },
+            TrackEvent::PitchBend(_pitch_bend) => (),
+            TrackEvent::KeyPressure => (),
+            TrackEvent::AudioPluginParameter(_parameter) => (),
+            TrackEvent::Sample(sample) => {
+                if let Some(sample_waveforms) = sample_waveforms {
+                    if let Some(peaks) = sample_waveforms.peaks(sample.sample_ref_uuid().as_str()) {
+                        // clipped to the riff
+                        let sample_x = (riff_ref.position() + sample.position()) * adjusted_beat_width_in_pixels;
+                        let riff_end_x = x + width;
+                        paint_sample_waveform(context, peaks, sample_waveforms.frames_per_beat(peaks), sample_x, y + 1.0, adjusted_entity_height_in_pixels - 2.0, adjusted_beat_width_in_pixels, visible_x1.max(x), visible_x2.min(riff_end_x));
+                    }
+                }
+            },
+            TrackEvent::Measure(_) => {}
+            TrackEvent::NoteExpression(_) => {}
+        }
+    }
 }
 
 impl CustomPainter for TrackGridCustomPainter {
-    fn paint_custom(&mut self, 
-                    context: &Context, 
-                    canvas_height: f64, 
-                    _canvas_width: f64, 
+    fn paint_custom(&mut self,
+                    context: &Context,
+                    canvas_height: f64,
+                    canvas_width: f64,
                     entity_height_in_pixels: f64,
-                    beat_width_in_pixels: f64, 
-                    zoom_horizontal: f64, 
-                    zoom_vertical: f64, 
-                    select_window_top_left_x: f64, 
-                    select_window_top_left_y: f64, 
-                    select_window_bottom_right_x: f64, 
+                    beat_width_in_pixels: f64,
+                    zoom_horizontal: f64,
+                    zoom_vertical: f64,
+                    select_window_top_left_x: f64,
+                    select_window_top_left_y: f64,
+                    select_window_bottom_right_x: f64,
                     select_window_bottom_right_y: f64,
                     _drawing_area_widget_name: Option<String>,
                     mouse_pointer_x: f64,
@@ -2715,190 +2950,152 @@ impl CustomPainter for TrackGridCustomPainter {
                     edit_drag_cycle: &EditDragCycle,
                     tx_from_ui: crossbeam_channel::Sender<DAWEvents>,
                 ) {
-        match self.state.lock() {
-            Ok(mut state) => {
-                let adjusted_beat_width_in_pixels = beat_width_in_pixels * zoom_horizontal;
-                let adjusted_entity_height_in_pixels = entity_height_in_pixels * zoom_vertical;
-
-                let mut track_number = 0.0;
-                for track in state.get_project().song_mut().tracks_mut() {
-                    let riff_refs = track.riff_refs();
-                    let automation = track.automation().events();
-                    let (red, green, blue, alpha) = track.colour();
-
-                    for riff_ref in riff_refs.iter() {
-                        let linked_to_riff_uuid = riff_ref.linked_to();
-
-                        context.set_source_rgba(red, green, blue, alpha);
-
-                        for riff in track.riffs().iter() {
-                            if riff.uuid().to_string() == linked_to_riff_uuid {
-                                if let Some((red, green, blue, alpha)) = riff.colour() {
-                                    context.set_source_rgba(*red, *green, *blue, *alpha);
-                                }
-
-                                let duration_in_beats = riff.length();
-                                let x = riff_ref.position() * adjusted_beat_width_in_pixels;
-                                let y = track_number * adjusted_entity_height_in_pixels;
-                                let width = duration_in_beats * beat_width_in_pixels * zoom_horizontal;
-
-                                if select_window_top_left_x <= x && (x + width) <= select_window_bottom_right_x &&
-                                    select_window_top_left_y <= y && (y + adjusted_entity_height_in_pixels) <= select_window_bottom_right_y {
-                                    context.set_source_rgb(0.0, 0.0, 1.0);
-                                }
-
-                                self.edit_item_handler.handle_item_edit(
-                                    context, 
-                                    riff, 
-                                    operation_mode, 
-                                    mouse_pointer_x, 
-                                    mouse_pointer_y, 
-                                    mouse_pointer_previous_x, 
-                                    mouse_pointer_previous_y, 
-                                    adjusted_entity_height_in_pixels, 
-                                    adjusted_beat_width_in_pixels, 
-                                    x, 
-                                    y, 
-                                    width, 
-                                    canvas_height, 
-                                    drawing_area, 
-                                    edit_drag_cycle, 
-                                    tx_from_ui.clone(), 
-                                    false,
-                                    track.uuid().to_string(),
-                                    riff_ref,
-                                    false,
-                                    track_number,
-                                );
-
-                                context.rectangle(x - 1.0, y + 1.0, width - 2.0, adjusted_entity_height_in_pixels - 2.0);
-                                let _ = context.fill();
-                                context.set_source_rgba(0.0, 0.0, 0.0, 1.0);
-                                context.rectangle(x - 1.0, y + 1.0, width - 2.0, adjusted_entity_height_in_pixels - 2.0);
-                                context.move_to(x + 5.0, y + 15.0);
-                                context.set_font_size(9.0);
-                                let mut name = riff.name().to_string();
-                                let mut name_fits = false;
-                                while !name_fits {
-                                    if let Ok(text_extents) = context.text_extents(name.as_str()) {
-                                        if (width - 2.0) < (text_extents.width as f64 + 10.0) {
-                                            if !name.is_empty() {
-                                                name = name.as_str()[0..name.len() - 1].to_string();
-                                            }
-                                            else {
-                                                name_fits = true;
-                                                break;
-                                            }
-                                        }
-                                        else {
-                                            name_fits = true;
-                                            break;
-                                        }
-                                    }
-                                }
-                                let _ = context.show_text(name.as_str());
-                                context.set_source_rgba(0.0, 0.0, 0.0, 1.0);
-                                let _ = context.stroke();
-
-                                // draw notes
-                                for track_event in riff.events() {
-                                    match track_event {
-                                        TrackEvent::ActiveSense => (),
-                                        TrackEvent::AfterTouch => (),
-                                        TrackEvent::ProgramChange => (),
-                                        TrackEvent::Note(note) => {
-                                            let note_x = (riff_ref.position() + note.position()) * adjusted_beat_width_in_pixels;
-
-                                            // draw note
-                                            if self.show_note {
-                                                let note_y = track_number * adjusted_entity_height_in_pixels + adjusted_entity_height_in_pixels - (adjusted_entity_height_in_pixels / 127.0 * note.note() as f64);
-                                                // info!("Note: x={}, y={}, width={}, height={}", note_x, note_y, note.duration() * adjusted_beat_width_in_pixels, entity_height_in_pixels / 127.0);
-                                                context.set_source_rgba(0.0, 0.0, 0.0, 1.0);
-                                                context.rectangle(note_x, note_y, note.length() * adjusted_beat_width_in_pixels, adjusted_entity_height_in_pixels / 127.0);
-                                                let _ = context.fill();
-                                            }
-
-                                            // draw velocity
-                                            if self.show_note_velocity {
-                                                context.set_source_rgba(0.0, 0.0, 0.0, 1.0);
-                                                let velocity_y_start = track_number * adjusted_entity_height_in_pixels + adjusted_entity_height_in_pixels;
-                                                // info!("Note velocity: x={}, y={}, height={}", note_x, velocity_y_start, velocity_y_start - (entity_height_in_pixels / 127.0 * note.velocity() as f64));
-                                                context.move_to(note_x, velocity_y_start);
-                                                context.line_to(note_x, velocity_y_start - (adjusted_entity_height_in_pixels / 127.0 * note.velocity() as f64));
-                                                let _ = context.stroke();
-                                            }
-                                        },
-                                        TrackEvent::NoteOn(_) => (),
-                                        TrackEvent::NoteOff(_) => (),
-                                        TrackEvent::Controller(controller) => {
-                                            let x_position = (riff_ref.position() + controller.position()) * adjusted_beat_width_in_pixels;
-                                            let y_start = track_number * adjusted_entity_height_in_pixels + adjusted_entity_height_in_pixels;
-
-                                            context.set_source_rgba(0.0, 0.0, 0.0, 1.0);
-                                            context.move_to(x_position, y_start);
-                                            context.line_to(x_position, y_start - (adjusted_entity_height_in_pixels / 127.0 * (controller.value() as f64) as f64));
-                                            let _ = context.stroke();
-                                        },
-                                        TrackEvent::PitchBend(_pitch_bend) => (),
-                                        TrackEvent::KeyPressure => (),
-                                        TrackEvent::AudioPluginParameter(_parameter) => (),
-                                        TrackEvent::Sample(_sample) => (),
-                                        TrackEvent::Measure(_) => {}
-                                        TrackEvent::NoteExpression(_) => {}
-                                    }
-                                }
-                                break;
-                            }
+        let snapshot = self.project_snapshot.load();
+        let adjusted_beat_width_in_pixels = beat_width_in_pixels * zoom_horizontal;
+        let adjusted_entity_height_in_pixels = entity_height_in_pixels * zoom_vertical;
+        let tracks = snapshot.tracks.as_slice();
+        self.index.update(snapshot.revision, tracks);
+
+        let sample_waveforms = self.waveform_peak_cache.as_ref().map(|waveform_peak_cache| SampleWaveforms::new(
+            snapshot.transport.tempo,
+            snapshot.arrangement.samples.iter().map(|(sample_uuid, file_name)| (sample_uuid, file_name.as_str())),
+            waveform_peak_cache,
+        ));
+        let waveform_peak_generation = self.waveform_peak_cache.as_ref().map_or(0, |waveform_peak_cache| waveform_peak_cache.generation());
+
+        // the riffs and their events are only drawn again when the project changes, more waveform peaks are
+        // ready or a scroll leaves the cached area
+        let content_key = (snapshot.revision, waveform_peak_generation, canvas_width, canvas_height, adjusted_beat_width_in_pixels, adjusted_entity_height_in_pixels, self.show_note, self.show_note_velocity, self.show_automation);
+        if let Some(content_context) = self.content_layer.redraw_context(context, content_key, canvas_width, canvas_height, drawing_area.scale_factor()) {
+            let content_visible_area = visible_area(&content_context);
+            for (track_number, track) in tracks.iter().enumerate() {
+                let (red, green, blue, alpha) = track.colour;
+
+                for riff_ref_index in self.visible_riff_refs(track_number, content_visible_area, adjusted_beat_width_in_pixels, adjusted_entity_height_in_pixels, false) {
+                    let riff_ref = &track.riff_refs[riff_ref_index];
+                    if let Some(riff) = self.index.linked_riffs[track_number][riff_ref_index].and_then(|riff_index| track.riffs.get(riff_index)) {
+                        match riff.colour() {
+                            Some((red, green, blue, alpha)) => content_context.set_source_rgba(*red, *green, *blue, *alpha),
+                            None => content_context.set_source_rgba(red, green, blue, alpha),
                         }
+                        paint_track_grid_riff_ref(
+                            &content_context,
+                            riff_ref,
+                            riff,
+                            self.index.riff_events.get(&riff_ref.linked_to()),
+                            track_number as f64,
+                            adjusted_beat_width_in_pixels,
+                            adjusted_entity_height_in_pixels,
+                            self.show_note,
+                            self.show_note_velocity,
+                            content_visible_area,
+                            sample_waveforms.as_ref(),
+                        );
                     }
+                }
 
-                    if self.show_automation {
-                        for track_event in automation.iter() {
-                            let x_position = track_event.position() * adjusted_beat_width_in_pixels;
-
-                            match track_event {
-                                TrackEvent::ActiveSense => (),
-                                TrackEvent::AfterTouch => (),
-                                TrackEvent::ProgramChange => (),
-                                TrackEvent::Note(_) => {},
-                                TrackEvent::NoteOn(_) => (),
-                                TrackEvent::NoteOff(_) => (),
-                                TrackEvent::Controller(controller) => {
-                                    context.set_source_rgba(0.0, 0.0, 0.0, 1.0);
-                                    let y_start = track_number * adjusted_entity_height_in_pixels + adjusted_entity_height_in_pixels;
-                                    context.move_to(x_position, y_start);
-                                    context.line_to(x_position, y_start - (adjusted_entity_height_in_pixels / 127.0 * (controller.value() as f64) as f64));
-                                    let _ = context.stroke();
-                                },
-                                TrackEvent::PitchBend(_pitch_bend) => (),
-                                TrackEvent::KeyPressure => (),
-                                TrackEvent::AudioPluginParameter(_parameter) => (),
-                                TrackEvent::Sample(_sample) => (),
-                                TrackEvent::Measure(_) => {}
-                                TrackEvent::NoteExpression(_) => {}
-                            }
+                if self.show_automation {
+                    let (visible_x1, _, visible_x2, _) = content_visible_area;
+                    let automation = &track.automation;
+                    for track_event in self.index.automation[track_number].overlapping(visible_x1 / adjusted_beat_width_in_pixels, visible_x2 / adjusted_beat_width_in_pixels).filter_map(|index| automation.get(index)) {
+                        let x_position = track_event.position() * adjusted_beat_width_in_pixels;
+
+                        match track_event {
+                            TrackEvent::Controller(controller) => {
+                                content_context.set_source_rgba(0.0, 0.0, 0.0, 1.0);
+                                let y_start = track_number as f64 * adjusted_entity_height_in_pixels + adjusted_entity_height_in_pixels;
+                                content_context.move_to(x_position, y_start);
+                                content_context.line_to(x_position, y_start - (adjusted_entity_height_in_pixels / 127.0 * (controller.value() as f64) as f64));
+                                let _ = content_context.stroke();
+                            },
+                            _ => (),
                         }
                     }
+                }
+            }
+        }
+        self.content_layer.paint(context);
+
+        // edit handles, dragged riffs and the selection are drawn over the cached content every time
+        let overlay_visible_area = visible_area(context);
+        for (track_number, track) in tracks.iter().enumerate() {
+            let (red, green, blue, alpha) = track.colour;
+
+            for riff_ref_index in self.visible_riff_refs(track_number, overlay_visible_area, adjusted_beat_width_in_pixels, adjusted_entity_height_in_pixels, true) {
+                let riff_ref = &track.riff_refs[riff_ref_index];
+                if let Some(riff) = self.index.linked_riffs[track_number][riff_ref_index].and_then(|riff_index| track.riffs.get(riff_index)) {
+                    match riff.colour() {
+                        Some((red, green, blue, alpha)) => context.set_source_rgba(*red, *green, *blue, *alpha),
+                        None => context.set_source_rgba(red, green, blue, alpha),
+                    }
 
-                    track_number += 1.0;
+                    let x = riff_ref.position() * adjusted_beat_width_in_pixels;
+                    let y = track_number as f64 * adjusted_entity_height_in_pixels;
+                    let width = riff.length() * adjusted_beat_width_in_pixels;
+                    let selected = select_window_top_left_x <= x && (x + width) <= select_window_bottom_right_x &&
+                        select_window_top_left_y <= y && (y + adjusted_entity_height_in_pixels) <= select_window_bottom_right_y;
+
+                    if selected {
+                        context.set_source_rgb(0.0, 0.0, 1.0);
+                    }
+
+                    self.edit_item_handler.handle_item_edit(
+                        context,
+                        riff,
+                        operation_mode,
+                        mouse_pointer_x,
+                        mouse_pointer_y,
+                        mouse_pointer_previous_x,
+                        mouse_pointer_previous_y,
+                        adjusted_entity_height_in_pixels,
+                        adjusted_beat_width_in_pixels,
+                        x,
+                        y,
+                        width,
+                        canvas_height,
+                        drawing_area,
+                        edit_drag_cycle,
+                        tx_from_ui.clone(),
+                        false,
+                        track.uuid.clone(),
+                        riff_ref,
+                        false,
+                        track_number as f64,
+                    );
+
+                    if selected {
+                        context.set_source_rgb(0.0, 0.0, 1.0);
+                        paint_track_grid_riff_ref(
+                            context,
+                            riff_ref,
+                            riff,
+                            self.index.riff_events.get(&riff_ref.linked_to()),
+                            track_number as f64,
+                            adjusted_beat_width_in_pixels,
+                            adjusted_entity_height_in_pixels,
+                            self.show_note,
+                            self.show_note_velocity,
+                            overlay_visible_area,
+                            sample_waveforms.as_ref(),
+                        );
+                    }
                 }
+            }
+        }
 
-                if state.looping() {
-                    if let Some(active_loop_uuid) =  state.active_loop() {
-                        if let Some(active_loop) = state.project().song().loops().iter().find(|current_loop| current_loop.uuid().to_string() == active_loop_uuid.to_string()) {
-                            let start_x = active_loop.start_position() * adjusted_beat_width_in_pixels;
-                            let end_x = active_loop.end_position() * adjusted_beat_width_in_pixels;
-                            context.set_source_rgba(0.0, 1.0, 0.0, 0.1);
-                            context.rectangle(start_x, 0.0, end_x - start_x, canvas_height);
-                            match context.fill() {
-                                Ok(_) => (),
-                                Err(_) => (),
-                            }
-                        }
+        if snapshot.transport.looping {
+            if let Some(active_loop_uuid) = snapshot.transport.active_loop {
+                if let Some(active_loop) = snapshot.arrangement.loops.iter().find(|current_loop| current_loop.uuid().to_string() == active_loop_uuid.to_string()) {
+                    let start_x = active_loop.start_position() * adjusted_beat_width_in_pixels;
+                    let end_x = active_loop.end_position() * adjusted_beat_width_in_pixels;
+                    context.set_source_rgba(0.0, 1.0, 0.0, 0.1);
+                    context.rectangle(start_x, 0.0, end_x - start_x, canvas_height);
+                    match context.fill() {
+                        Ok(_) => (),
+                        Err(_) => (),
                     }
                 }
-            },
-            Err(_) => info!("Track grid custom painter could not get state lock."),
+            }
         }
     }
     fn as_any(&mut self) -> &mut dyn Any {
@@ -0,0 +1,193 @@
+use std::collections::HashMap;
+use std::sync::Arc;
+
+use cairo::{Context, Format, ImageSurface};
+use log::*;
+
+use crate::constants::GRID_LAYER_CACHE_MARGIN_IN_PIXELS;
+use crate::domain::{DAWItemLength, DAWItemPosition, Riff};
+use crate::project_snapshot::TrackSnapshot;
+
+/// The part of the canvas the context will actually draw to - x1, y1, x2, y2.
+pub fn visible_area(context: &Context) -> (f64, f64, f64, f64) {
+    match context.clip_extents() {
+        Ok(clip_extents) => clip_extents,
+        Err(_) => (f64::MIN, f64::MIN, f64::MAX, f64::MAX),
+    }
+}
+
+/// Beat intervals ordered by start with the latest end so far alongside so that the intervals overlapping a range can
+/// be found with a binary search and a short scan - a flattened static interval tree.
+#[derive(Default)]
+pub struct BeatIntervalIndex {
+    intervals: Vec<(f64, f64, usize)>, // start, end, item index
+    max_ends: Vec<f64>,
+}
+
+impl BeatIntervalIndex {
+    pub fn new(mut intervals: Vec<(f64, f64, usize)>) -> Self {
+        intervals.sort_by(|a, b| a.0.partial_cmp(&b.0).unwrap_or(std::cmp::Ordering::Equal));
+        let mut max_end = f64::MIN;
+        let max_ends = intervals.iter().map(|(_, end, _)| {
+            max_end = max_end.max(*end);
+            max_end
+        }).collect();
+
+        Self {
+            intervals,
+            max_ends,
+        }
+    }
+
+    pub fn riff_events(riff: &Riff) -> Self {
+        Self::new(riff.events().iter().enumerate().map(|(index, track_event)| (track_event.position(), track_event.position() + track_event.length(), index)).collect())
+    }
+
+    /// The indices of the items overlapping start to end in start order.
+    pub fn overlapping(&self, start: f64, end: f64) -> impl Iterator<Item = usize> + '_ {
+        let first = self.max_ends.partition_point(|max_end| *max_end < start);
+        self.intervals[first..].iter()
+            .take_while(move |(interval_start, _, _)| *interval_start <= end)
+            .filter(move |(_, interval_end, _)| *interval_end >= start)
+            .map(|(_, _, index)| *index)
+    }
+}
+
+/// The track grid's spatial index - rebuilt when the project changes.
+#[derive(Default)]
+pub struct TrackGridIndex {
+    pub project_revision: Option<u64>,
+    pub riff_refs: Vec<BeatIntervalIndex>, // per track - riff reference index
+    pub linked_riffs: Vec<Vec<Option<usize>>>, // per track and riff reference - index of the linked riff
+    pub riff_events: HashMap<String, BeatIntervalIndex>, // riff uuid
+    pub automation: Vec<BeatIntervalIndex>, // per track - automation event index
+}
+
+impl TrackGridIndex {
+    pub fn update(&mut self, project_revision: u64, tracks: &[Arc<TrackSnapshot>]) {
+        if self.project_revision == Some(project_revision) {
+            return;
+        }
+
+        self.riff_refs.clear();
+        self.linked_riffs.clear();
+        self.riff_events.clear();
+        self.automation.clear();
+        for track in tracks.iter() {
+            let riff_indices: HashMap<String, usize> = track.riffs.iter().enumerate().map(|(index, riff)| (riff.uuid().to_string(), index)).collect();
+            let linked_riffs: Vec<Option<usize>> = track.riff_refs.iter().map(|riff_ref| riff_indices.get(&riff_ref.linked_to()).copied()).collect();
+            let riff_ref_intervals = track.riff_refs.iter().enumerate()
+                .filter_map(|(index, riff_ref)| linked_riffs[index].map(|riff_index| (riff_ref.position(), riff_ref.position() + track.riffs[riff_index].length(), index)))
+                .collect();
+
+            self.riff_refs.push(BeatIntervalIndex::new(riff_ref_intervals));
+            self.linked_riffs.push(linked_riffs);
+            for riff in track.riffs.iter() {
+                self.riff_events.insert(riff.uuid().to_string(), BeatIntervalIndex::riff_events(riff));
+            }
+            self.automation.push(BeatIntervalIndex::new(track.automation.iter().enumerate().map(|(index, track_event)| (track_event.position(), track_event.position(), index)).collect()));
+        }
+        self.project_revision = Some(project_revision);
+    }
+}
+
+/// Grid drawing that only changes with the data it shows, kept in an offscreen surface covering the visible part of
+/// the canvas plus a margin. It is drawn again when the key changes or the visible part scrolls out of the surface.
+pub struct CachedLayer<K: PartialEq> {
+    key: Option<K>,
+    surface: Option<ImageSurface>,
+    area: (f64, f64, f64, f64), // x, y, width, height on the canvas
+}
+
+impl<K: PartialEq> Default for CachedLayer<K> {
+    fn default() -> Self {
+        Self {
+            key: None,
+            surface: None,
+            area: (0.0, 0.0, 0.0, 0.0),
+        }
+    }
+}
+
+impl<K: PartialEq> CachedLayer<K> {
+    pub fn invalidate(&mut self) {
+        self.key = None;
+        self.surface = None;
+    }
+
+    /// A context to draw the layer with if it is out of date - drawing is clipped to the surface so visible_area gives
+    /// the part to draw. Falls back to the canvas context if a surface can't be made.
+    pub fn redraw_context(&mut self, context: &Context, key: K, canvas_width: f64, canvas_height: f64, scale_factor: i32) -> Option<Context> {
+        let (visible_x1, visible_y1, visible_x2, visible_y2) = visible_area(context);
+        let (visible_x1, visible_y1) = (visible_x1.max(0.0), visible_y1.max(0.0));
+        let (visible_x2, visible_y2) = (visible_x2.min(canvas_width), visible_y2.min(canvas_height));
+        let (x, y, width, height) = self.area;
+
+        if self.surface.is_some() && self.key.as_ref() == Some(&key) &&
+            x <= visible_x1 && visible_x2 <= x + width && y <= visible_y1 && visible_y2 <= y + height {
+            return None;
+        }
+
+        self.invalidate();
+        let x1 = (visible_x1 - GRID_LAYER_CACHE_MARGIN_IN_PIXELS).max(0.0).floor();
+        let y1 = (visible_y1 - GRID_LAYER_CACHE_MARGIN_IN_PIXELS).max(0.0).floor();
+        let x2 = (visible_x2 + GRID_LAYER_CACHE_MARGIN_IN_PIXELS).min(canvas_width).ceil();
+        let y2 = (visible_y2 + GRID_LAYER_CACHE_MARGIN_IN_PIXELS).min(canvas_height).ceil();
+        if x2 <= x1 || y2 <= y1 {
+            return None;
+        }
+
+        let scale_factor = scale_factor.max(1);
+        match ImageSurface::create(Format::ARgb32, (x2 - x1) as i32 * scale_factor, (y2 - y1) as i32 * scale_factor) {
+            Ok(surface) => {
+                surface.set_device_scale(scale_factor as f64, scale_factor as f64);
+                match Context::new(&surface) {
+                    Ok(layer_context) => {
+                        layer_context.translate(-x1, -y1);
+                        self.key = Some(key);
+                        self.surface = Some(surface);
+                        self.area = (x1, y1, x2 - x1, y2 - y1);
+                        return Some(layer_context);
+                    }
+                    Err(error) => info!("Cached layer could not create a context: {}", error),
+                }
+            }
+            Err(error) => info!("Cached layer could not create a surface: {}", error),
+        }
+
+        Some(context.clone())
+    }
+
+    pub fn paint(&self, context: &Context) {
+        if let Some(surface) = self.surface.as_ref() {
+            let (x, y, width, height) = self.area;
+            let _ = context.save();
+            let _ = context.set_source_surface(surface, x, y);
+            context.rectangle(x, y, width, height);
+            let _ = context.fill();
+            let _ = context.restore();
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use crate::grid_cache::BeatIntervalIndex;
+
+    #[test]
+    fn finds_only_the_overlapping_intervals() {
+        let index = BeatIntervalIndex::new(vec![
+            (8.0, 12.0, 0),
+            (0.0, 4.0, 1),
+            (2.0, 30.0, 2),
+            (16.0, 20.0, 3),
+            (40.0, 40.0, 4),
+        ]);
+
+        assert_eq!(vec![2, 0], index.overlapping(9.0, 10.0).collect::<Vec<usize>>());
+        assert_eq!(vec![1, 2], index.overlapping(0.0, 3.0).collect::<Vec<usize>>());
+        assert_eq!(vec![2, 3], index.overlapping(14.0, 16.0).collect::<Vec<usize>>());
+        assert_eq!(vec![4], index.overlapping(35.0, 45.0).collect::<Vec<usize>>());
+        assert!(index.overlapping(50.0, 60.0).next().is_none());
+    }
+}
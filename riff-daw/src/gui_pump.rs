@@ -0,0 +1,201 @@
+use std::collections::HashMap;
+use std::thread::Thread;
+use std::time::{Duration, Instant};
+
+use crossbeam_channel::{Receiver, Select, Sender, unbounded};
+use gtk::glib;
+use log::*;
+
+use crate::constants::{GUI_PUMP_WATCH_REFRESH_INTERVAL_IN_MILLISECONDS, GUI_PUMP_WATCHER_THREAD_NAME, GUI_REFRESH_INTERVAL_IN_MILLISECONDS};
+use crate::event::{AudioLayerOutwardEvent, DAWEvents, TrackBackgroundProcessorOutwardEvent};
+
+/// The latest of the high rate updates from the audio layer and the tracks. Only the last value matters by the time it
+/// is shown so they are applied once per display refresh rather than once per message.
+#[derive(Default)]
+pub struct CoalescedGuiUpdates {
+    pub play_position_in_frames: Option<u32>,
+    pub master_channel_levels: Option<(f32, f32)>, // left, right
+    pub track_channel_levels: HashMap<String, (f32, f32)>, // track uuid, (left, right)
+    pub last_telemetry_refresh: Option<Instant>, // when the mixer blade dsp loads were last shown - not an update itself
+}
+
+impl CoalescedGuiUpdates {
+    pub fn is_empty(&self) -> bool {
+        self.play_position_in_frames.is_none() && self.master_channel_levels.is_none() && self.track_channel_levels.is_empty()
+    }
+}
+
+/// Wakes the gtk main loop only when one of the channels it reads from has something in it. A watcher thread waits on
+/// the channels without receiving from them, sends a wake and then sleeps until the gui says it has drained them.
+pub struct GuiPump {
+    watcher: Option<Thread>,
+    tx_watch: Sender<Vec<Receiver<TrackBackgroundProcessorOutwardEvent>>>,
+    watched_track_uuids: Vec<String>,
+    tx_wake: glib::Sender<()>,
+    last_refresh: Instant,
+    refresh_scheduled: bool,
+}
+
+impl GuiPump {
+    pub fn start(jack_midi_receiver: Receiver<AudioLayerOutwardEvent>, rx_from_ui: Receiver<DAWEvents>, tx_wake: glib::Sender<()>) -> Self {
+        let (tx_watch, rx_watch) = unbounded::<Vec<Receiver<TrackBackgroundProcessorOutwardEvent>>>();
+        let watcher = {
+            let tx_wake = tx_wake.clone();
+            start_watcher(jack_midi_receiver, rx_from_ui, rx_watch, move || tx_wake.send(()).is_ok())
+        };
+
+        Self {
+            watcher,
+            tx_watch,
+            watched_track_uuids: vec![],
+            tx_wake,
+            last_refresh: Instant::now(),
+            refresh_scheduled: false,
+        }
+    }
+
+    /// The gui has received everything it was woken for - go back to waiting.
+    pub fn drained(&self) {
+        if let Some(watcher) = &self.watcher {
+            watcher.unpark();
+        }
+    }
+
+    /// Watch the track outward receivers as well - only sent to the watcher when tracks have been added or removed.
+    pub fn watch_track_receivers(&mut self, track_receivers: &HashMap<String, Receiver<TrackBackgroundProcessorOutwardEvent>>) {
+        let mut track_uuids: Vec<String> = track_receivers.keys().cloned().collect();
+        track_uuids.sort();
+        if track_uuids != self.watched_track_uuids {
+            match self.tx_watch.send(track_receivers.values().cloned().collect()) {
+                Ok(_) => self.watched_track_uuids = track_uuids,
+                Err(_) => info!("Gui pump: could not send the track receivers to the watcher."),
+            }
+        }
+    }
+
+    /// Whether the coalesced updates should be applied now. If not a wake is scheduled for when they should be.
+    pub fn refresh_due(&mut self) -> bool {
+        let refresh_interval = Duration::from_millis(GUI_REFRESH_INTERVAL_IN_MILLISECONDS);
+        let since_last_refresh = self.last_refresh.elapsed();
+        if since_last_refresh >= refresh_interval {
+            self.last_refresh = Instant::now();
+            self.refresh_scheduled = false;
+            true
+        }
+        else {
+            if !self.refresh_scheduled {
+                let tx_wake = self.tx_wake.clone();
+                glib::timeout_add_local(refresh_interval - since_last_refresh, move || {
+                    let _ = tx_wake.send(());
+                    glib::Continue(false)
+                });
+                self.refresh_scheduled = true;
+            }
+            false
+        }
+    }
+}
+
+/// Waits until one of the channels has something in it, calls wake and parks until unparked. Returns the watcher thread.
+fn start_watcher<F>(
+    jack_midi_receiver: Receiver<AudioLayerOutwardEvent>,
+    rx_from_ui: Receiver<DAWEvents>,
+    rx_watch: Receiver<Vec<Receiver<TrackBackgroundProcessorOutwardEvent>>>,
+    wake: F,
+) -> Option<Thread> where F: Fn() -> bool + Send + 'static {
+    let result = std::thread::Builder::new().name(GUI_PUMP_WATCHER_THREAD_NAME.to_string()).spawn(move || {
+        let mut all_track_receivers: Vec<Receiver<TrackBackgroundProcessorOutwardEvent>> = vec![];
+        let mut track_receivers: Vec<Receiver<TrackBackgroundProcessorOutwardEvent>> = vec![];
+
+        loop {
+            let ready = {
+                let mut select = Select::new();
+                select.recv(&jack_midi_receiver);
+                select.recv(&rx_from_ui);
+                select.recv(&rx_watch);
+                for track_receiver in track_receivers.iter() {
+                    select.recv(track_receiver);
+                }
+                select.ready_timeout(Duration::from_millis(GUI_PUMP_WATCH_REFRESH_INTERVAL_IN_MILLISECONDS))
+            };
+
+            match ready {
+                Ok(2) => match rx_watch.try_recv() {
+                    Ok(receivers) => {
+                        all_track_receivers = receivers;
+                        track_receivers = all_track_receivers.clone();
+                    }
+                    Err(_) => break, // the pump has gone
+                },
+                Ok(index) => {
+                    let empty = match index {
+                        0 => jack_midi_receiver.is_empty(),
+                        1 => rx_from_ui.is_empty(),
+                        _ => track_receivers[index - 3].is_empty(),
+                    };
+                    // ready with nothing in it means every sender has gone - or the gui got there first during a refresh
+                    if empty {
+                        if index < 3 {
+                            std::thread::sleep(Duration::from_millis(GUI_REFRESH_INTERVAL_IN_MILLISECONDS));
+                        }
+                        else {
+                            track_receivers.remove(index - 3);
+                        }
+                    }
+                    else {
+                        if !wake() {
+                            break; // the main loop has gone
+                        }
+                        std::thread::park();
+                    }
+                }
+                // a track that stopped being watched will be watched again if it is still registered
+                Err(_) => if track_receivers.len() != all_track_receivers.len() {
+                    track_receivers = all_track_receivers.clone();
+                },
+            }
+        }
+    });
+
+    match result {
+        Ok(join_handle) => Some(join_handle.thread().clone()),
+        Err(error) => {
+            info!("Gui pump: could not start the watcher thread: {}", error);
+            None
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::time::Duration;
+
+    use crossbeam_channel::unbounded;
+
+    use crate::event::{AudioLayerOutwardEvent, DAWEvents, TrackBackgroundProcessorOutwardEvent};
+    use crate::gui_pump::start_watcher;
+
+    #[test]
+    fn wakes_once_per_drain() {
+        let (_jack_midi_sender, jack_midi_receiver) = unbounded::<AudioLayerOutwardEvent>();
+        let (tx_from_ui, rx_from_ui) = unbounded::<DAWEvents>();
+        let (tx_watch, rx_watch) = unbounded::<Vec<crossbeam_channel::Receiver<TrackBackgroundProcessorOutwardEvent>>>();
+        let (tx_track, rx_track) = unbounded::<TrackBackgroundProcessorOutwardEvent>();
+        let (tx_woken, rx_woken) = unbounded::<()>();
+        let watcher = start_watcher(jack_midi_receiver, rx_from_ui.clone(), rx_watch, move || tx_woken.send(()).is_ok()).unwrap();
+        tx_watch.send(vec![rx_track.clone()]).unwrap();
+
+        let _ = tx_from_ui.send(DAWEvents::Shutdown);
+        let _ = tx_from_ui.send(DAWEvents::Shutdown);
+        assert!(rx_woken.recv_timeout(Duration::from_secs(1)).is_ok());
+        // nothing more until the gui has drained
+        assert!(rx_woken.recv_timeout(Duration::from_millis(50)).is_err());
+
+        while rx_from_ui.try_recv().is_ok() {}
+        watcher.unpark();
+        assert!(rx_woken.recv_timeout(Duration::from_millis(50)).is_err());
+
+        let _ = tx_track.send(TrackBackgroundProcessorOutwardEvent::ChannelLevels("track".to_string(), 0.5, 0.5));
+        assert!(rx_woken.recv_timeout(Duration::from_secs(1)).is_ok());
+    }
+}
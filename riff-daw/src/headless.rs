@@ -0,0 +1,458 @@
+use std::collections::{HashMap, HashSet};
+use std::path::PathBuf;
+use std::sync::{Arc, Mutex};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::thread;
+use std::time::{Duration, Instant};
+
+use crossbeam_channel::{Receiver, RecvTimeoutError, Sender, unbounded};
+use log::*;
+use simple_clap_host_helper_lib::plugin::library::PluginLibrary;
+use vst::api::TimeInfo;
+use vst::host::PluginLoader;
+
+use crate::constants::{DEFAULT_BLOCK_SIZE, DEFAULT_SAMPLE_RATE, HEADLESS_AUDIO_BACKEND_THREAD_NAME, HEADLESS_AUDIO_BACKEND_WAKE_INTERVAL_IN_MILLISECONDS, HEADLESS_RENDER_THREAD_NAME, HEADLESS_RENDER_TRACK_READY_TIMEOUT_IN_SECONDS};
+use crate::domain::{Track, TrackBackgroundProcessorMode, TrackType, VstHost};
+use crate::event::{AudioLayerInwardEvent, DAWEvents, TrackBackgroundProcessorInwardEvent, TrackBackgroundProcessorOutwardEvent};
+use crate::render::render_song_to_wave_files;
+use crate::scheduler::TrackProcessingScheduler;
+use crate::state::DAWState;
+
+pub const HEADLESS_RENDER_USAGE: &str = "usage: riff-daw render <project>... [-o <output>] [--stems] [--range <start beat>:<end beat>] [--jobs <n>] [--block-size <frames>] [--sample-rate <hz>]
+  -o            the wave file to write - a directory when rendering several projects - next to each project if left out
+  --stems       also write each track to its own wave file in a directory named after the output
+  --range       render only the given part of the song in beats rather than all of it
+  --jobs        how many projects to render at the same time - defaults to the number of cores";
+
+/// What to render from the command line - see HEADLESS_RENDER_USAGE.
+#[derive(Debug, PartialEq)]
+pub struct HeadlessRenderOptions {
+    pub project_paths: Vec<PathBuf>,
+    pub output_path: Option<PathBuf>,
+    pub stems: bool,
+    pub range_in_beats: Option<(f64, f64)>, // start, end - the whole song if None
+    pub jobs: usize,
+    pub block_size: usize,
+    pub sample_rate: f64,
+}
+
+/// A project and the files it is rendered to.
+#[derive(Debug, PartialEq)]
+pub struct HeadlessRenderJob {
+    pub project_path: PathBuf,
+    pub output_path: PathBuf,
+    pub stems_directory: Option<PathBuf>,
+}
+
+/// Parse the arguments that follow the render argument.
+pub fn parse_render_arguments(arguments: &[String]) -> Result<HeadlessRenderOptions, String> {
+    let mut options = HeadlessRenderOptions {
+        project_paths: vec![],
+        output_path: None,
+        stems: false,
+        range_in_beats: None,
+        jobs: thread::available_parallelism().map(|cores| cores.get()).unwrap_or(1),
+        block_size: DEFAULT_BLOCK_SIZE,
+        sample_rate: DEFAULT_SAMPLE_RATE,
+    };
+
+    let mut arguments = arguments.iter();
+    while let Some(argument) = arguments.next() {
+        match argument.as_str() {
+            "-o" | "--output" => options.output_path = Some(PathBuf::from(option_value(argument, arguments.next())?)),
+            "--stems" => options.stems = true,
+            "--range" => {
+                let range = option_value(argument, arguments.next())?;
+                let (start, end) = range.split_once(':').ok_or_else(|| format!("--range expects <start beat>:<end beat> but got {}", range))?;
+                let start: f64 = start.trim().parse().map_err(|_| format!("--range start is not a number: {}", start))?;
+                let end: f64 = end.trim().parse().map_err(|_| format!("--range end is not a number: {}", end))?;
+                if start < 0.0 || end <= start {
+                    return Err(format!("--range must start at or after 0 and end after it starts: {}", range));
+                }
+                options.range_in_beats = Some((start, end));
+            }
+            "--jobs" => options.jobs = parse_option_value::<usize>(argument, arguments.next())?.max(1),
+            "--block-size" => options.block_size = parse_option_value(argument, arguments.next())?,
+            "--sample-rate" => options.sample_rate = parse_option_value(argument, arguments.next())?,
+            _ if argument.starts_with('-') => return Err(format!("unknown option: {}", argument)),
+            _ => options.project_paths.push(PathBuf::from(argument)),
+        }
+    }
+
+    if options.project_paths.is_empty() {
+        return Err("no projects to render".to_string());
+    }
+    if options.block_size == 0 || options.sample_rate <= 0.0 {
+        return Err("the block size and sample rate must be greater than 0".to_string());
+    }
+    Ok(options)
+}
+
+fn option_value<'a>(option: &str, value: Option<&'a String>) -> Result<&'a String, String> {
+    value.ok_or_else(|| format!("{} expects a value", option))
+}
+
+fn parse_option_value<T: std::str::FromStr>(option: &str, value: Option<&String>) -> Result<T, String> {
+    let value = option_value(option, value)?;
+    value.parse().map_err(|_| format!("{} expects a number but got {}", option, value))
+}
+
+impl HeadlessRenderOptions {
+    /// Where each project is rendered to. A single project goes to the output path, several go into it as a directory
+    /// named after the projects - numbered by their place on the command line where projects in different directories
+    /// share a name - and without an output path each one goes next to its project. Stems go in a directory named after
+    /// the mixdown.
+    pub fn jobs(&self) -> Vec<HeadlessRenderJob> {
+        let mut projects_by_file_name: HashMap<PathBuf, usize> = HashMap::new();
+        for project_path in self.project_paths.iter() {
+            *projects_by_file_name.entry(PathBuf::from(project_path.with_extension("wav").file_name().unwrap_or_default())).or_default() += 1;
+        }
+
+        self.project_paths.iter().enumerate().map(|(project_index, project_path)| {
+            let output_path = match self.output_path.as_ref() {
+                Some(output_path) if self.project_paths.len() == 1 => output_path.clone(),
+                Some(output_directory) => {
+                    let file_name = PathBuf::from(project_path.with_extension("wav").file_name().unwrap_or_default());
+                    if projects_by_file_name.get(&file_name).map_or(false, |projects| *projects > 1) {
+                        let file_stem = file_name.file_stem().map(|file_stem| file_stem.to_string_lossy().to_string()).unwrap_or_default();
+                        output_directory.join(format!("{} {}.wav", file_stem, project_index + 1))
+                    }
+                    else {
+                        output_directory.join(file_name)
+                    }
+                }
+                None => project_path.with_extension("wav"),
+            };
+            let stems_directory = if self.stems {
+                let file_stem = output_path.file_stem().map(|file_stem| file_stem.to_string_lossy().to_string()).unwrap_or_default();
+                Some(output_path.with_file_name(format!("{} stems", file_stem)))
+            }
+            else {
+                None
+            };
+            HeadlessRenderJob {
+                project_path: project_path.clone(),
+                output_path,
+                stems_directory,
+            }
+        }).collect()
+    }
+}
+
+/// Render the projects to wave files without gtk or jack - up to options.jobs projects at a time, each on its own
+/// thread with its own state and track processing scheduler. The cores are split between the schedulers so that there
+/// are about as many track processing threads as cores however many jobs there are. Returns false if any of the
+/// projects could not be rendered.
+pub fn run_headless_render(options: HeadlessRenderOptions) -> bool {
+    let jobs = options.jobs();
+    let number_of_jobs = jobs.len();
+    let failed = Arc::new(AtomicUsize::new(0));
+    let (tx_job, rx_job) = unbounded::<HeadlessRenderJob>();
+    for job in jobs {
+        let _ = tx_job.send(job);
+    }
+    drop(tx_job);
+
+    let number_of_render_threads = options.jobs.min(number_of_jobs);
+    let number_of_cores = thread::available_parallelism().map(|cores| cores.get()).unwrap_or(1);
+    let track_processing_workers_per_job = (number_of_cores / number_of_render_threads).max(1);
+    let mut render_threads = vec![];
+    for render_thread_number in 0..number_of_render_threads {
+        let rx_job = rx_job.clone();
+        let failed = failed.clone();
+        let block_size = options.block_size;
+        let sample_rate = options.sample_rate;
+        let range_in_beats = options.range_in_beats;
+        match thread::Builder::new().name(format!("{} {}", HEADLESS_RENDER_THREAD_NAME, render_thread_number + 1)).spawn(move || {
+            // the state is reused for each project this thread renders so that there is only ever one scheduler per thread
+            let mut headless_renderer = HeadlessRenderer::new(block_size, sample_rate, track_processing_workers_per_job);
+            while let Ok(job) = rx_job.recv() {
+                let render_start = Instant::now();
+                match headless_renderer.render(&job, range_in_beats) {
+                    Ok(_) => info!("Rendered {:?} to {:?} in {:.1}s.", job.project_path, job.output_path, render_start.elapsed().as_secs_f64()),
+                    Err(error) => {
+                        error!("Could not render {:?}: {}", job.project_path, error);
+                        failed.fetch_add(1, Ordering::Relaxed);
+                    }
+                }
+            }
+        }) {
+            Ok(render_thread) => render_threads.push(render_thread),
+            Err(error) => error!("Could not start a headless render thread: {:?}", error),
+        }
+    }
+
+    if render_threads.is_empty() {
+        return false;
+    }
+    for render_thread in render_threads {
+        if render_thread.join().is_err() {
+            failed.fetch_add(1, Ordering::Relaxed);
+        }
+    }
+
+    let failed = failed.load(Ordering::Relaxed);
+    if failed > 0 {
+        error!("Headless render finished: {} of {} projects could not be rendered.", failed, number_of_jobs);
+        return false;
+    }
+    info!("Headless render finished: {} of {} projects rendered.", number_of_jobs.saturating_sub(failed), number_of_jobs);
+    failed == 0
+}
+
+/// Stands in for the jack layer - takes the events the tracks send to the audio layer and wakes the track processing
+/// scheduler as the jack process callback does, so that the tracks handle what is sent to them. Nothing is played, the
+/// tracks render into their render ring buffers. Ends once every sender has gone.
+fn start_headless_audio_backend(rx_audio: Receiver<AudioLayerInwardEvent>, track_processing_scheduler: Arc<TrackProcessingScheduler>) {
+    let wake_interval = Duration::from_millis(HEADLESS_AUDIO_BACKEND_WAKE_INTERVAL_IN_MILLISECONDS);
+    match thread::Builder::new().name(HEADLESS_AUDIO_BACKEND_THREAD_NAME.to_string()).spawn(move || {
+        loop {
+            match rx_audio.recv_timeout(wake_interval) {
+                Ok(_) => (),
+                Err(RecvTimeoutError::Timeout) => track_processing_scheduler.wake(),
+                Err(RecvTimeoutError::Disconnected) => break,
+            }
+        }
+    }) {
+        Ok(_) => (),
+        Err(error) => error!("Could not start the headless audio backend: {:?}", error),
+    }
+}
+
+/// Loads projects into a state of its own and renders them offline the way exporting from the gui does. One renderer
+/// can render any number of projects one after the other, reusing its track processing scheduler.
+pub struct HeadlessRenderer {
+    state: DAWState,
+    rx_from_state: Receiver<DAWEvents>,
+    tx_audio: Sender<AudioLayerInwardEvent>,
+    track_audio_coast: Arc<Mutex<TrackBackgroundProcessorMode>>,
+    vst_host_time_info: Arc<parking_lot::RwLock<TimeInfo>>,
+    vst24_plugin_loaders: Arc<Mutex<HashMap<String, PluginLoader<VstHost>>>>,
+    clap_plugin_loaders: Arc<Mutex<HashMap<String, PluginLibrary>>>,
+}
+
+impl HeadlessRenderer {
+    pub fn new(block_size: usize, sample_rate: f64, track_processing_workers: usize) -> Self {
+        let (tx_from_state, rx_from_state) = unbounded::<DAWEvents>();
+        let (tx_audio, rx_audio) = unbounded::<AudioLayerInwardEvent>();
+        let mut state = DAWState::with_track_processing_scheduler(tx_from_state, Arc::new(TrackProcessingScheduler::with_workers(track_processing_workers)));
+        state.set_audio_format(block_size, sample_rate);
+        start_headless_audio_backend(rx_audio, state.track_processing_scheduler());
+
+        Self {
+            state,
+            rx_from_state,
+            tx_audio,
+            track_audio_coast: Arc::new(Mutex::new(TrackBackgroundProcessorMode::Coast)),
+            vst_host_time_info: Arc::new(parking_lot::RwLock::new(TimeInfo {
+                sample_pos: 0.0,
+                sample_rate,
+                nanoseconds: 0.0,
+                ppq_pos: 0.0,
+                tempo: 140.0,
+                bar_start_pos: 0.0,
+                cycle_start_pos: 0.0,
+                cycle_end_pos: 0.0,
+                time_sig_numerator: 4,
+                time_sig_denominator: 4,
+                smpte_offset: 0,
+                smpte_frame_rate: vst::api::SmpteFrameRate::Smpte24fps,
+                samples_to_next_clock: 0,
+                flags: 3,
+            })),
+            vst24_plugin_loaders: Arc::new(Mutex::new(HashMap::new())),
+            clap_plugin_loaders: Arc::new(Mutex::new(HashMap::new())),
+        }
+    }
+
+    /// Render the job's project - all of the song or just range_in_beats - to the job's output and stems.
+    pub fn render(&mut self, job: &HeadlessRenderJob, range_in_beats: Option<(f64, f64)>) -> anyhow::Result<()> {
+        self.unload();
+
+        let project_path = job.project_path.to_str().ok_or_else(|| anyhow::anyhow!("the project path is not valid unicode"))?;
+        self.state.load_from_file(self.vst24_plugin_loaders.clone(), self.clap_plugin_loaders.clone(), project_path, self.tx_audio.clone(), self.track_audio_coast.clone(), self.vst_host_time_info.clone())
+            .map_err(|error| anyhow::anyhow!("the project could not be read: {}", error))?;
+
+        // as opening a project in the gui does
+        let tempo = self.state.project().song().tempo();
+        {
+            let mut time_info = self.vst_host_time_info.write();
+            time_info.tempo = tempo;
+            time_info.sample_rate = self.state.project().song().sample_rate();
+            time_info.sample_pos = 0.0;
+        }
+        for track_uuid in Self::audio_producing_track_uuids(&self.state) {
+            self.state.send_to_track_background_processor(track_uuid, TrackBackgroundProcessorInwardEvent::Tempo(tempo));
+        }
+        self.state.update_song_audio_format();
+        self.wait_for_tracks()?;
+
+        let song = self.state.project().song();
+        let block_size = song.block_size();
+        let sample_rate = song.sample_rate();
+        let frames_per_beat = sample_rate * 60.0 / song.tempo();
+        let song_length_in_beats = song.length_in_beats() as f64;
+        // a range running past the end of the song stops with it
+        let (start_in_beats, end_in_beats) = range_in_beats.map_or((0.0, song_length_in_beats), |(start_in_beats, end_in_beats)| (start_in_beats, end_in_beats.min(song_length_in_beats)));
+        let start_block = (start_in_beats * frames_per_beat / block_size) as i32;
+        let end_block = (end_in_beats * frames_per_beat / block_size) as i32;
+        if end_block <= start_block {
+            return Err(anyhow::anyhow!("there is nothing to render between beats {} and {}", start_in_beats, end_in_beats));
+        }
+
+        let stem_paths = match job.stems_directory.as_ref() {
+            Some(stems_directory) => {
+                std::fs::create_dir_all(stems_directory)?;
+                let (stem_paths, tracks_without_stems) = self.state.stem_paths(stems_directory);
+                if !tracks_without_stems.is_empty() {
+                    info!("Rendering {:?}: no stems for tracks that don't render audio: {}", job.project_path, tracks_without_stems.join(", "));
+                }
+                stem_paths
+            }
+            None => HashMap::new(),
+        };
+        if let Some(output_directory) = job.output_path.parent().filter(|output_directory| !output_directory.as_os_str().is_empty()) {
+            std::fs::create_dir_all(output_directory)?;
+        }
+
+        let track_processing_scheduler = self.state.track_processing_scheduler();
+        self.state.set_play_position_in_frames((start_block as f64 * block_size) as u32);
+        track_processing_scheduler.begin_offline_render();
+        self.state.send_song_to_tracks(false);
+
+        let track_render_audio_consumers = self.state.track_render_audio_consumers().clone();
+        let result = match track_render_audio_consumers.lock() {
+            Ok(track_render_audio_consumers) => {
+                let mut next_progress_report = 0.1;
+                render_song_to_wave_files(Some(job.output_path.clone()), stem_paths, end_block - start_block, block_size as usize, sample_rate as u32, &track_render_audio_consumers, &track_processing_scheduler, |fraction| {
+                    if fraction >= next_progress_report {
+                        info!("Rendering {:?}: {:.0}%", job.project_path, fraction * 100.0);
+                        next_progress_report += 0.1;
+                    }
+                })
+            }
+            Err(_) => Err(std::io::Error::new(std::io::ErrorKind::Other, "the render ring buffers are locked")),
+        };
+
+        self.stop();
+        track_processing_scheduler.end_offline_render();
+        Ok(result?)
+    }
+
+    /// Wait for the tracks to load their plugins and presets, picking up their render ring buffers and plugin latencies
+    /// as they come in. A track has handled everything sent to it so far once it answers a preset data request. Fails if
+    /// any track is not ready in time as rendering it would leave it out of the mix.
+    fn wait_for_tracks(&mut self) -> anyhow::Result<()> {
+        let track_uuids = Self::audio_producing_track_uuids(&self.state);
+        for track_uuid in track_uuids.iter() {
+            self.state.send_to_track_background_processor(track_uuid.clone(), TrackBackgroundProcessorInwardEvent::RequestPresetData);
+        }
+
+        let mut waiting_for: HashSet<String> = track_uuids.into_iter().collect();
+        let mut track_render_audio_consumers = HashMap::new();
+        let deadline = Instant::now() + Duration::from_secs(HEADLESS_RENDER_TRACK_READY_TIMEOUT_IN_SECONDS);
+        while !waiting_for.is_empty() && Instant::now() < deadline {
+            let mut track_plugin_latencies = vec![];
+            for (track_uuid, receiver) in self.state.instrument_track_receivers().iter() {
+                while let Ok(event) = receiver.try_recv() {
+                    match event {
+                        TrackBackgroundProcessorOutwardEvent::TrackRenderAudioConsumer(track_render_audio_consumer) => {
+                            track_render_audio_consumers.insert(track_render_audio_consumer.track_id().to_string(), track_render_audio_consumer);
+                        }
+                        TrackBackgroundProcessorOutwardEvent::PluginLatency(plugin_latency) => track_plugin_latencies.push((track_uuid.clone(), plugin_latency)),
+                        TrackBackgroundProcessorOutwardEvent::GetPresetData(_, _) => {
+                            waiting_for.remove(track_uuid);
+                        }
+                        _ => (),
+                    }
+                }
+            }
+            for (track_uuid, plugin_latency) in track_plugin_latencies {
+                self.state.set_track_plugin_latency(track_uuid, plugin_latency);
+            }
+            thread::sleep(Duration::from_millis(HEADLESS_AUDIO_BACKEND_WAKE_INTERVAL_IN_MILLISECONDS));
+        }
+        if !waiting_for.is_empty() {
+            let song = self.state.project().song();
+            let mut track_names: Vec<String> = song.tracks().iter()
+                .filter(|track| waiting_for.contains(track.uuid().to_string().as_str()))
+                .map(|track| track.name().to_string())
+                .collect();
+            track_names.sort();
+            return Err(anyhow::anyhow!("{} tracks did not finish loading within {}s: {}", track_names.len(), HEADLESS_RENDER_TRACK_READY_TIMEOUT_IN_SECONDS, track_names.join(", ")));
+        }
+
+        if let Ok(mut state_track_render_audio_consumers) = self.state.track_render_audio_consumers_mut().lock() {
+            state_track_render_audio_consumers.extend(track_render_audio_consumers);
+        }
+        Ok(())
+    }
+
+    /// Midi tracks don't produce audio so they have nothing to render.
+    fn audio_producing_track_uuids(state: &DAWState) -> Vec<String> {
+        state.project().song().tracks().iter()
+            .filter(|track| !matches!(track, TrackType::MidiTrack(_)))
+            .map(|track| track.uuid().to_string())
+            .collect()
+    }
+
+    fn stop(&mut self) {
+        for track in self.state.project().song().tracks().iter() {
+            self.state.send_to_track_background_processor(track.uuid().to_string(), TrackBackgroundProcessorInwardEvent::Stop);
+        }
+    }
+
+    /// Kill the tracks of the previously rendered project as opening another project in the gui does.
+    fn unload(&mut self) {
+        if let Ok(mut track_render_audio_consumers) = self.state.track_render_audio_consumers_mut().lock() {
+            track_render_audio_consumers.clear();
+        }
+        for track in self.state.project().song().tracks().iter() {
+            self.state.send_to_track_background_processor(track.uuid().to_string(), TrackBackgroundProcessorInwardEvent::Kill);
+        }
+        self.state.instrument_track_receivers_mut().clear();
+        // nothing is shown so what the state has to say is dropped
+        while self.rx_from_state.try_recv().is_ok() {}
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::path::PathBuf;
+
+    use crate::headless::{HeadlessRenderJob, parse_render_arguments};
+
+    fn arguments(arguments: &str) -> Vec<String> {
+        arguments.split_whitespace().map(|argument| argument.to_string()).collect()
+    }
+
+    #[test]
+    fn parses_render_arguments_and_names_the_output_files() {
+        let options = parse_render_arguments(&arguments("song.fdaw -o out.wav --stems --range 4:36 --jobs 2")).unwrap();
+        assert_eq!(Some((4.0, 36.0)), options.range_in_beats);
+        assert_eq!(2, options.jobs);
+        assert_eq!(vec![HeadlessRenderJob {
+            project_path: PathBuf::from("song.fdaw"),
+            output_path: PathBuf::from("out.wav"),
+            stems_directory: Some(PathBuf::from("out stems")),
+        }], options.jobs());
+
+        let options = parse_render_arguments(&arguments("projects/a.fdaw projects/b.fdaw -o renders")).unwrap();
+        let output_paths: Vec<PathBuf> = options.jobs().into_iter().map(|job| job.output_path).collect();
+        assert_eq!(vec![PathBuf::from("renders/a.wav"), PathBuf::from("renders/b.wav")], output_paths);
+
+        let options = parse_render_arguments(&arguments("live/song.fdaw studio/song.fdaw projects/b.fdaw -o renders --stems")).unwrap();
+        let jobs = options.jobs();
+        let output_paths: Vec<PathBuf> = jobs.iter().map(|job| job.output_path.clone()).collect();
+        assert_eq!(vec![PathBuf::from("renders/song 1.wav"), PathBuf::from("renders/song 2.wav"), PathBuf::from("renders/b.wav")], output_paths);
+        assert_eq!(Some(PathBuf::from("renders/song 2 stems")), jobs[1].stems_directory);
+
+        let options = parse_render_arguments(&arguments("projects/a.fdaw")).unwrap();
+        assert_eq!(PathBuf::from("projects/a.wav"), options.jobs()[0].output_path);
+
+        assert!(parse_render_arguments(&arguments("-o out.wav")).is_err());
+        assert!(parse_render_arguments(&arguments("song.fdaw --range 8:4")).is_err());
+        assert!(parse_render_arguments(&arguments("song.fdaw --jobs")).is_err());
+        assert!(parse_render_arguments(&arguments("song.fdaw --loud")).is_err());
+    }
+}
@@ -1,16 +1,36 @@
+use std::collections::VecDeque;
 use std::iter::Iterator;
 use std::sync::{Arc, Mutex, MutexGuard};
+use std::time::{Duration, Instant};
 
 use log::*;
+use uuid::Uuid;
 
-use crate::domain::DAWItemLength;
+use crate::constants::{HISTORY_COALESCE_INTERVAL_IN_MILLISECONDS, HISTORY_MEMORY_CAP_IN_BYTES};
+use crate::domain::{AudioRouting, AudioRoutingNodeType, DAWItemLength, Riff, TrackEventRouting, TrackEventRoutingNodeType};
+use crate::lua_api::{ScriptBatch, TrackRoutingGraph};
+use crate::state::TrackProcessingContext;
 use crate::{DAWItemPosition, DAWState, Note, PlayMode, Track, TrackEvent};
-use crate::event::{TranslateDirection, TranslationEntityType};
+use crate::event::{DAWEvents, TranslateDirection, TranslationEntityType};
 
 pub trait HistoryAction {
     fn execute(&mut self, state: &mut Arc<Mutex<DAWState>>) -> Result<(), String>;
     fn undo(&mut self, state: &mut Arc<Mutex<DAWState>>) -> Result<(), String>;
 
+    /// What the action changed once it has been executed - used to coalesce repeated edits and to account for memory.
+    fn riff_events_diff(&mut self) -> Option<&mut RiffEventsDiff> {
+        None
+    }
+
+    fn size_in_bytes(&mut self) -> usize {
+        std::mem::size_of_val(&*self) + self.riff_events_diff().map_or(0, |diff| diff.size_in_bytes())
+    }
+
+    /// Whether executing the action changed nothing, in which case there is nothing to undo.
+    fn is_empty(&mut self) -> bool {
+        self.riff_events_diff().map_or(false, |diff| diff.is_empty())
+    }
+
     fn get_selected_track_riff_uuid(&self, state: &mut Arc<Mutex<DAWState>>) -> (Option<String>, Option<String>) {
         let mut selected_riff_uuid = None;
         let mut selected_riff_track_uuid = None;
@@ -31,85 +51,563 @@ pub trait HistoryAction {
         };
         (selected_riff_uuid, selected_riff_track_uuid)
     }
+}
+
+/// A change to one event of a riff - the index into the riff's events identifies the event.
+#[derive(Clone, Copy)]
+pub enum RiffEventChange {
+    Insert(usize, TrackEvent), // index, event
+    Remove(usize, TrackEvent), // index, event
+    Replace(usize, TrackEvent, TrackEvent), // index, before, after
+}
+
+impl RiffEventChange {
+    fn inverse(&self) -> Self {
+        match *self {
+            RiffEventChange::Insert(index, event) => RiffEventChange::Remove(index, event),
+            RiffEventChange::Remove(index, event) => RiffEventChange::Insert(index, event),
+            RiffEventChange::Replace(index, before, after) => RiffEventChange::Replace(index, after, before),
+        }
+    }
+
+    fn apply(&self, events: &mut Vec<TrackEvent>) {
+        match *self {
+            RiffEventChange::Insert(index, event) => events.insert(index.min(events.len()), event),
+            RiffEventChange::Remove(index, event) => match Self::find_event(events, index, &event) {
+                Some(index) => {
+                    events.remove(index);
+                }
+                None => info!("History - could not find the event to remove."),
+            },
+            RiffEventChange::Replace(index, before, after) => match Self::find_event(events, index, &before) {
+                Some(index) => events[index] = after,
+                None => info!("History - could not find the event to replace."),
+            },
+        }
+    }
+
+    /// The event at the recorded index or, if the riff has been changed outside the history, the first one like it.
+    fn find_event(events: &[TrackEvent], index: usize, expected: &TrackEvent) -> Option<usize> {
+        match events.get(index) {
+            Some(event) if Self::same_event(event, expected) => Some(index),
+            _ => events.iter().position(|event| Self::same_event(event, expected)),
+        }
+    }
+
+    fn same_event(event: &TrackEvent, other: &TrackEvent) -> bool {
+        match (event, other) {
+            (TrackEvent::Note(note), TrackEvent::Note(other_note)) => note == other_note,
+            _ => std::mem::discriminant(event) == std::mem::discriminant(other) && event.position() == other.position(),
+        }
+    }
+
+    fn events(&self) -> impl Iterator<Item = &TrackEvent> {
+        let (first, second) = match self {
+            RiffEventChange::Insert(_, event) => (event, None),
+            RiffEventChange::Remove(_, event) => (event, None),
+            RiffEventChange::Replace(_, before, after) => (before, Some(after)),
+        };
+        std::iter::once(first).chain(second)
+    }
+}
+
+/// The changes an edit made to one riff's events - only the events it touched are kept. Applied in order to redo and
+/// inverted in reverse order to undo.
+pub struct RiffEventsDiff {
+    track_uuid: String,
+    riff_uuid: String,
+    coalesce_kind: Option<&'static str>, // edits of the same kind to the same notes can be merged
+    changes: Vec<RiffEventChange>,
+}
+
+impl RiffEventsDiff {
+    pub fn new(track_uuid: String, riff_uuid: String, coalesce_kind: Option<&'static str>, changes: Vec<RiffEventChange>) -> Self {
+        Self {
+            track_uuid,
+            riff_uuid,
+            coalesce_kind,
+            changes,
+        }
+    }
 
-    fn check_riff_changed_and_playing(&self, riff_uuid: String, state: &mut MutexGuard<DAWState>, track_uuid: String, playing: bool, play_mode: PlayMode, playing_riff_set: Option<String>, riff_changed: bool) {
-        if riff_changed && playing {
-            self.play_riff_set_update_track(riff_uuid, state, track_uuid, play_mode, playing_riff_set)
+    pub fn is_empty(&self) -> bool {
+        self.changes.is_empty()
+    }
+
+    pub fn apply(&self, events: &mut Vec<TrackEvent>, forward: bool) {
+        if forward {
+            self.changes.iter().for_each(|change| change.apply(events));
+        }
+        else {
+            self.changes.iter().rev().for_each(|change| change.inverse().apply(events));
         }
     }
 
-    fn play_riff_set_update_track(&self, _riff_uuid: String, state: &mut MutexGuard<DAWState>, track_uuid: String, play_mode: PlayMode, playing_riff_set: Option<String>) {
-        match play_mode {
-            PlayMode::Song => {}
+    /// The earliest start and latest end in beats of the events before and after the change.
+    pub fn changed_range_in_beats(&self) -> Option<(f64, f64)> {
+        self.changes.iter().flat_map(|change| change.events()).fold(None, |range, event| {
+            let start = event.position();
+            let end = start + event.length();
+            match range {
+                Some((range_start, range_end)) => Some((start.min(range_start), end.max(range_end))),
+                None => Some((start, end)),
+            }
+        })
+    }
+
+    pub fn size_in_bytes(&self) -> usize {
+        std::mem::size_of::<Self>() + self.track_uuid.capacity() + self.riff_uuid.capacity() + self.changes.capacity() * std::mem::size_of::<RiffEventChange>()
+    }
+
+    /// Merges a later edit of the same kind into this one if both only replaced events - the merged diff goes from the
+    /// events before this edit to the events after the later one.
+    pub fn coalesce(&mut self, later: &RiffEventsDiff) -> bool {
+        let only_replaces = |diff: &RiffEventsDiff| diff.changes.iter().all(|change| matches!(change, RiffEventChange::Replace(..)));
+        if self.coalesce_kind.is_none() || self.coalesce_kind != later.coalesce_kind || self.track_uuid != later.track_uuid ||
+            self.riff_uuid != later.riff_uuid || !only_replaces(&*self) || !only_replaces(later) {
+            return false;
+        }
+
+        for later_change in later.changes.iter() {
+            if let RiffEventChange::Replace(index, later_before, later_after) = *later_change {
+                let earlier_change = self.changes.iter_mut().find(|change| match change {
+                    RiffEventChange::Replace(earlier_index, _, earlier_after) => *earlier_index == index && RiffEventChange::same_event(earlier_after, &later_before),
+                    _ => false,
+                });
+                match earlier_change {
+                    Some(RiffEventChange::Replace(_, _, earlier_after)) => *earlier_after = later_after,
+                    _ => self.changes.push(*later_change),
+                }
+            }
+        }
+        true
+    }
+}
+
+/// Applies the diff to its riff, marks the project as changed and re-sends what the riff plays if it is playing.
+fn apply_riff_events_diff(state: &mut MutexGuard<DAWState>, diff: &RiffEventsDiff, forward: bool) -> Result<(), String> {
+    if diff.is_empty() {
+        return Ok(());
+    }
+
+    let applied = match state.track_mut(&diff.track_uuid) {
+        Some(track) => match track.riffs_mut().iter_mut().find(|riff| riff.uuid().to_string() == diff.riff_uuid) {
+            Some(riff) => {
+                diff.apply(riff.events_mut(), forward);
+                true
+            }
+            None => false,
+        },
+        None => false,
+    };
+    if !applied {
+        return Err("History - could not find the riff the edit was made to.".to_string());
+    }
+
+    state.dirty = true;
+    if state.playing() {
+        match state.play_mode() {
+            PlayMode::Song => {
+                if let Some(changed_range_in_beats) = diff.changed_range_in_beats() {
+                    info!("Song riff updated - now calling state.play_song_update_track_riff_range");
+                    state.play_song_update_track_riff_range(diff.riff_uuid.clone(), diff.track_uuid.clone(), changed_range_in_beats);
+                }
+            }
             PlayMode::RiffSet => {
-                if let Some(playing_riff_set) = playing_riff_set {
+                if let Some(playing_riff_set) = state.playing_riff_set().clone() {
                     info!("RiffSet riff updated - now calling state.play_riff_set_update_track");
-                    state.play_riff_set_update_track(playing_riff_set, track_uuid);
+                    state.play_riff_set_update_track(playing_riff_set, diff.track_uuid.clone());
                 }
             }
             PlayMode::RiffSequence => {}
             PlayMode::RiffArrangement => {}
         }
     }
+    Ok(())
+}
+
+/// Executes a riff edit. The first time the changes are worked out from the riff and recorded - after that, on redo,
+/// the recorded diff is applied again.
+fn execute_riff_edit<F>(
+    state: &mut Arc<Mutex<DAWState>>,
+    diff: &mut Option<RiffEventsDiff>,
+    track_uuid: Option<String>,
+    riff_uuid: Option<String>,
+    coalesce_kind: Option<&'static str>,
+    changes: F,
+) -> Result<(), String> where F: FnOnce(&DAWState, &Riff) -> Vec<RiffEventChange> {
+    match state.lock() {
+        Ok(state) => {
+            let mut state = state;
+
+            if diff.is_none() {
+                match (track_uuid, riff_uuid) {
+                    (Some(track_uuid), Some(riff_uuid)) => {
+                        let riff_changes = state.project().song().tracks().iter()
+                            .find(|track| track.uuid().to_string() == track_uuid)
+                            .and_then(|track| track.riffs().iter().find(|riff| riff.uuid().to_string() == riff_uuid))
+                            .map(|riff| changes(&*state, riff));
+                        match riff_changes {
+                            Some(riff_changes) => *diff = Some(RiffEventsDiff::new(track_uuid, riff_uuid, coalesce_kind, riff_changes)),
+                            None => info!("History - could not find the riff to edit."),
+                        }
+                    }
+                    (None, _) => info!("History - problem getting selected riff track number"),
+                    (_, None) => info!("History - problem getting selected riff index"),
+                }
+            }
+
+            match diff.as_ref() {
+                Some(diff) => apply_riff_events_diff(&mut state, diff, true),
+                None => Ok(()),
+            }
+        },
+        Err(_) => Err("History - could not get lock on state".to_string()),
+    }
+}
+
+fn undo_riff_edit(state: &mut Arc<Mutex<DAWState>>, diff: &Option<RiffEventsDiff>) -> Result<(), String> {
+    match diff.as_ref() {
+        Some(diff) => match state.lock() {
+            Ok(state) => {
+                let mut state = state;
+                apply_riff_events_diff(&mut state, diff, false)
+            },
+            Err(_) => Err("History - could not get lock on state".to_string()),
+        },
+        None => Ok(()),
+    }
+}
+
+/// The event indices of the note store rows in ascending order.
+fn note_ids<R>(riff: &Riff, rows: R) -> Vec<usize> where R: Iterator<Item = usize> {
+    let notes = riff.event_store().notes();
+    let mut ids: Vec<usize> = rows.map(|row| notes.ids[row]).collect();
+    ids.sort_unstable();
+    ids
+}
+
+/// The changes that remove the notes in the store rows - highest index first so that the recorded indices stay valid
+/// when applied in order.
+fn remove_notes<R>(riff: &Riff, rows: R) -> Vec<RiffEventChange> where R: Iterator<Item = usize> {
+    note_ids(riff, rows).into_iter().rev()
+        .map(|index| RiffEventChange::Remove(index, riff.events()[index]))
+        .collect()
+}
+
+/// The changes that replace the notes in the store rows the edit returns a different note for.
+fn replace_notes<R, E>(riff: &Riff, rows: R, mut edit: E) -> Vec<RiffEventChange> where R: Iterator<Item = usize>, E: FnMut(&Note) -> Option<Note> {
+    note_ids(riff, rows).into_iter().filter_map(|index| match riff.events()[index] {
+        TrackEvent::Note(note) => match edit(&note) {
+            Some(edited_note) if edited_note != note => Some(RiffEventChange::Replace(index, TrackEvent::Note(note), TrackEvent::Note(edited_note))),
+            _ => None,
+        },
+        _ => None,
+    }).collect()
+}
+
+/// The changes that make a bulk note edit - notes as they were read from a project snapshot replaced or removed (None)
+/// and notes added. Notes that are replaced in place stay where they are, the rest are removed highest index first
+/// and then the notes that moved or were added are inserted in position order so that the events stay in order.
+fn bulk_note_changes(events: &[TrackEvent], replacements: &[(Note, Option<Note>)], additions: &[Note]) -> Vec<RiffEventChange> {
+    let mut claimed = vec![false; events.len()];
+    let mut removals = vec![];   // index
+    let mut in_place = vec![];   // index, before, after
+    let mut insertions: Vec<Note> = additions.to_vec();
+
+    for (before, after) in replacements.iter() {
+        let expected = TrackEvent::Note(*before);
+        // events are in position order so look near the note's position first
+        let start = events.partition_point(|event| event.position() < before.position());
+        let index = (start..events.len()).take_while(|index| events[*index].position() == before.position())
+            .chain(0..events.len())
+            .find(|index| !claimed[*index] && RiffEventChange::same_event(&events[*index], &expected));
+        match index {
+            Some(index) => {
+                claimed[index] = true;
+                match after {
+                    Some(after) if after == before => (),
+                    Some(after) if after.position() == before.position() => in_place.push((index, expected, TrackEvent::Note(*after))),
+                    Some(after) => {
+                        removals.push(index);
+                        insertions.push(*after);
+                    }
+                    None => removals.push(index),
+                }
+            }
+            None => info!("History - could not find a note to replace - the riff has changed since it was read."),
+        }
+    }
+
+    removals.sort_unstable();
+    let mut changes: Vec<RiffEventChange> = removals.iter().rev().map(|index| RiffEventChange::Remove(*index, events[*index])).collect();
+
+    // the indices once the removals are made - only the notes that are still there are replaced
+    let removed_before = |index: usize| removals.partition_point(|removed| *removed < index);
+    changes.extend(in_place.into_iter().map(|(index, before, after)| RiffEventChange::Replace(index - removed_before(index), before, after)));
+
+    insertions.sort_by(|a, b| a.position().partial_cmp(&b.position()).unwrap_or(std::cmp::Ordering::Equal));
+    let remaining_positions: Vec<f64> = events.iter().enumerate()
+        .filter(|(index, _)| removals.binary_search(index).is_err())
+        .map(|(_, event)| event.position())
+        .collect();
+    let mut remaining_before = 0;
+    for (inserted, note) in insertions.into_iter().enumerate() {
+        while remaining_before < remaining_positions.len() && remaining_positions[remaining_before] <= note.position() {
+            remaining_before += 1;
+        }
+        changes.push(RiffEventChange::Insert(remaining_before + inserted, TrackEvent::Note(note)));
+    }
+
+    changes
+}
+
+/// A bulk note edit to one riff from a script.
+#[derive(Clone)]
+pub struct ScriptRiffNoteEdit {
+    pub track_uuid: String,
+    pub riff_uuid: String,
+    pub replacements: Vec<(Note, Option<Note>)>, // note as read, what it becomes - None removes it
+    pub additions: Vec<Note>,
+}
+
+/// Everything a script batch changed - the tracks, riffs and routings it added and the note edits to every riff it
+/// touched. It is all applied under one state lock and undone and redone together as one edit. The tracks are added
+/// with the uuids the script was given so that the rest of the batch can refer to them as they are.
+pub struct ScriptBatchAction {
+    batch: ScriptBatch,
+    audio_routings: Vec<AudioRouting>,
+    midi_routings: Vec<TrackEventRouting>,
+    track_processing_context: TrackProcessingContext,
+    diffs: Option<Vec<RiffEventsDiff>>, // worked out the first time the action is executed
+}
 
-    fn check_playing(&self, riff_uuid: String, state: &mut MutexGuard<DAWState>, track_uuid: String, playing: bool, play_mode: PlayMode, playing_riff_set: Option<String>) {
-        if playing {
-            self.play_riff_set_update_track(riff_uuid, state, track_uuid, play_mode, playing_riff_set)
+impl ScriptBatchAction {
+    pub fn new(batch: ScriptBatch, track_processing_context: TrackProcessingContext) -> Self {
+        let audio_routings = batch.audio_routings.iter().map(|(source_track_uuid, destination_track_uuid)| AudioRouting::new(
+            "Script".to_string(),
+            AudioRoutingNodeType::Track(source_track_uuid.clone()),
+            AudioRoutingNodeType::Track(destination_track_uuid.clone()),
+        )).collect();
+        let midi_routings = batch.midi_routings.iter().map(|(source_track_uuid, destination_track_uuid)| TrackEventRouting::new(
+            "Script".to_string(),
+            TrackEventRoutingNodeType::Track(source_track_uuid.clone()),
+            TrackEventRoutingNodeType::Track(destination_track_uuid.clone()),
+        )).collect();
+        Self {
+            batch,
+            audio_routings,
+            midi_routings,
+            track_processing_context,
+            diffs: None,
         }
     }
 }
 
+impl HistoryAction for ScriptBatchAction {
+    fn execute(&mut self, state: &mut Arc<Mutex<DAWState>>) -> Result<(), String> {
+        let mut state = match state.lock() {
+            Ok(state) => state,
+            Err(_) => return Err("History - could not get lock on state".to_string()),
+        };
+
+        // the project may have changed since the script read its snapshot
+        let mut routing_graph = TrackRoutingGraph::default();
+        for track in state.project().song().tracks().iter() {
+            routing_graph.add_track(
+                track.uuid().to_string(),
+                track.audio_routings().iter().map(|routing| routing.destination.track_uuid().to_string()).collect(),
+                track.midi_routings().iter().map(|routing| routing.destination.track_uuid().to_string()).collect(),
+            );
+        }
+        self.batch.validate(routing_graph)?;
+
+        for (track_uuid, track_type, name) in self.batch.tracks.iter() {
+            let uuid = Uuid::parse_str(track_uuid).map_err(|error| format!("History - script batch - invalid track uuid: {}", error))?;
+            state.add_new_track(track_type.clone(), Some(uuid), name.clone(), &self.track_processing_context);
+        }
+
+        for (track_uuid, riff_uuid, name, length) in self.batch.riffs.iter() {
+            if let Some(track) = state.track_mut(&*track_uuid) {
+                track.riffs_mut().push(Riff::new_with_name_and_length(*riff_uuid, name.clone(), *length));
+            }
+        }
+
+        for routing in self.midi_routings.iter() {
+            let source_track_uuid = routing.source.track_uuid().to_string();
+            state.send_midi_routing_to_track_background_processors(source_track_uuid.clone(), routing.clone());
+            if let Some(track) = state.track_mut(&source_track_uuid) {
+                track.midi_routings_mut().push(routing.clone());
+            }
+        }
+
+        for routing in self.audio_routings.iter() {
+            let source_track_uuid = routing.source.track_uuid().to_string();
+            state.send_audio_routing_to_track_background_processors(source_track_uuid.clone(), routing.clone());
+            if let Some(track) = state.track_mut(&source_track_uuid) {
+                track.audio_routings_mut().push(routing.clone());
+            }
+        }
+        if !self.audio_routings.is_empty() {
+            state.update_delay_compensation();
+        }
+
+        if self.diffs.is_none() {
+            let mut diffs = vec![];
+            for edit in self.batch.note_edits.drain(..) {
+                let riff_changes = state.project().song().tracks().iter()
+                    .find(|track| track.uuid().to_string() == edit.track_uuid)
+                    .and_then(|track| track.riffs().iter().find(|riff| riff.uuid().to_string() == edit.riff_uuid))
+                    .map(|riff| bulk_note_changes(riff.events(), &edit.replacements, &edit.additions));
+                match riff_changes {
+                    Some(riff_changes) => diffs.push(RiffEventsDiff::new(edit.track_uuid, edit.riff_uuid, None, riff_changes)),
+                    None => info!("History - could not find the riff a script edited."),
+                }
+            }
+            self.diffs = Some(diffs);
+        }
+        for diff in self.diffs.iter().flatten() {
+            apply_riff_events_diff(&mut state, diff, true)?;
+        }
+
+        state.dirty = true;
+        if !self.batch.tracks.is_empty() {
+            state.send_to_gui(DAWEvents::RebuildUI);
+        }
+        Ok(())
+    }
+
+    fn undo(&mut self, state: &mut Arc<Mutex<DAWState>>) -> Result<(), String> {
+        let mut state = match state.lock() {
+            Ok(state) => state,
+            Err(_) => return Err("History - could not get lock on state".to_string()),
+        };
+
+        for diff in self.diffs.iter().flatten().rev() {
+            apply_riff_events_diff(&mut state, diff, false)?;
+        }
+
+        for routing in self.audio_routings.iter().rev() {
+            state.remove_audio_routing(routing.source.track_uuid(), routing.uuid().as_str());
+        }
+        for routing in self.midi_routings.iter().rev() {
+            state.remove_midi_routing(routing.source.track_uuid(), routing.uuid().as_str());
+        }
+
+        for (track_uuid, riff_uuid, _, _) in self.batch.riffs.iter().rev() {
+            if let Some(track) = state.track_mut(&*track_uuid) {
+                track.riffs_mut().retain(|riff| riff.uuid() != *riff_uuid);
+            }
+        }
+
+        for (track_uuid, _, _) in self.batch.tracks.iter().rev() {
+            state.remove_track(track_uuid, &self.track_processing_context.tx_audio);
+        }
+
+        if !self.audio_routings.is_empty() || !self.batch.tracks.is_empty() {
+            state.update_delay_compensation();
+        }
+        state.dirty = true;
+        if !self.batch.tracks.is_empty() {
+            state.send_to_gui(DAWEvents::RebuildUI);
+        }
+        Ok(())
+    }
+
+    fn size_in_bytes(&mut self) -> usize {
+        std::mem::size_of_val(&*self) + self.diffs.iter().flatten().map(|diff| diff.size_in_bytes()).sum::<usize>()
+    }
+
+    fn is_empty(&mut self) -> bool {
+        self.batch.tracks.is_empty() && self.batch.riffs.is_empty() && self.audio_routings.is_empty() && self.midi_routings.is_empty()
+            && self.diffs.iter().flatten().all(|diff| diff.is_empty())
+    }
+}
+
 pub struct HistoryManager {
-    history: Vec<Box<dyn HistoryAction>>,
+    history: VecDeque<Box<dyn HistoryAction>>,
     head_index: i32,
+    size_in_bytes: usize,
+    last_applied: Option<Instant>,
 }
 
 impl HistoryManager {
     pub fn new() -> Self {
         Self {
-            history: vec![],
+            history: VecDeque::new(),
             head_index: -1,
+            size_in_bytes: 0,
+            last_applied: None,
         }
     }
 
     pub fn apply(&mut self, state: &mut Arc<Mutex<DAWState>>, mut action: Box<dyn HistoryAction>) -> Result<(), String> {
-        println!("History - apply: self.history.len()={}, self.head_index={}", self.history.len(), self.head_index);
-        if self.head_index >= 0 && !self.history.is_empty() && (self.head_index as usize) != (self.history.len() - 1) {
-            // delete everything above the head_index
-            for index in (self.history.len() - 1)..(self.head_index as usize) {
-                self.history.remove(index);
+        debug!("History - apply: self.history.len()={}, self.head_index={}", self.history.len(), self.head_index);
+        let result = action.execute(state);
+        if result.is_err() || action.is_empty() {
+            // nothing changed so there is nothing to undo
+            return result;
+        }
+
+        // delete everything above the head_index
+        while self.history.len() > (self.head_index + 1) as usize {
+            if let Some(mut removed_action) = self.history.pop_back() {
+                self.size_in_bytes = self.size_in_bytes.saturating_sub(removed_action.size_in_bytes());
             }
         }
-        let result = action.execute(state);
-        self.history.push(action);
+
+        // repeated nudges and drags of the same notes are kept as one edit
+        let coalesce_interval = Duration::from_millis(HISTORY_COALESCE_INTERVAL_IN_MILLISECONDS);
+        let recent = self.last_applied.map_or(false, |last_applied| last_applied.elapsed() < coalesce_interval);
+        self.last_applied = Some(Instant::now());
+        if recent {
+            if let (Some(head_action), Some(later_diff)) = (self.history.back_mut(), action.riff_events_diff()) {
+                let head_size_in_bytes = head_action.size_in_bytes();
+                if head_action.riff_events_diff().map_or(false, |head_diff| head_diff.coalesce(later_diff)) {
+                    self.size_in_bytes = self.size_in_bytes.saturating_sub(head_size_in_bytes) + head_action.size_in_bytes();
+                    return result;
+                }
+            }
+        }
+
+        self.size_in_bytes += action.size_in_bytes();
+        self.history.push_back(action);
         self.head_index += 1;
+
+        // forget the oldest edits once over the memory cap
+        while self.size_in_bytes > HISTORY_MEMORY_CAP_IN_BYTES && self.history.len() > 1 {
+            if let Some(mut evicted_action) = self.history.pop_front() {
+                self.size_in_bytes = self.size_in_bytes.saturating_sub(evicted_action.size_in_bytes());
+                self.head_index -= 1;
+            }
+        }
         result
     }
 
     pub fn undo(&mut self, state: &mut Arc<Mutex<DAWState>>) -> Result<(), String> {
-        println!("History - undo: self.history.len()={}, self.head_index={}", self.history.len(), self.head_index);
+        debug!("History - undo: self.history.len()={}, self.head_index={}", self.history.len(), self.head_index);
         // decrement the current top of the history
         if self.history.len() > self.head_index as usize && self.head_index >= 0 {
             if let Some(action) = self.history.get_mut(self.head_index as usize ) {
                 self.head_index -= 1;
+                self.last_applied = None;
                 action.undo(state)
             }
             else {
-                println!("Could not find action to undo.");
                 Err("Could not find action to undo.".to_string())
             }
         }
         else {
-            println!("History head index greater than number of history items.");
             Err("History head index greater than number of history items.".to_string())
         }
     }
 
     pub fn redo(&mut self, state: &mut Arc<Mutex<DAWState>>) -> Result<(), String> {
-        println!("History - redo: self.history.len()={}, self.head_index={}", self.history.len(), self.head_index);
+        debug!("History - redo: self.history.len()={}, self.head_index={}", self.history.len(), self.head_index);
         // get the current top of the history
-        if (self.head_index as usize) < (self.history.len() - 1) {
+        if ((self.head_index + 1) as usize) < self.history.len() {
             self.head_index += 1;
+            self.last_applied = None;
             if let Some(action) = self.history.get_mut(self.head_index as usize) {
                 action.execute(state)
             }
@@ -123,12 +621,12 @@ impl HistoryManager {
     }
 }
 
-#[derive(Clone)]
 pub struct RiffAddNoteAction {
     position: f64,
     note: i32,
     velocity: i32,
     duration: f64,
+    diff: Option<RiffEventsDiff>,
 }
 
 impl RiffAddNoteAction {
@@ -143,6 +641,7 @@ impl RiffAddNoteAction {
             note,
             velocity,
             duration,
+            diff: None,
         }
     }
     pub fn position(&self) -> f64 {
@@ -165,122 +664,43 @@ unsafe impl Send for RiffAddNoteAction {
 
 impl HistoryAction for RiffAddNoteAction {
     fn execute(&mut self, state: &mut Arc<Mutex<DAWState>>) -> Result<(), String> {
-        let (selected_riff_uuid, selected_riff_track_uuid) = self.get_selected_track_riff_uuid(state);
-
-        match state.lock() {
-            Ok(state) => {
-                let mut state = state;
+        let (selected_riff_uuid, selected_riff_track_uuid) = if self.diff.is_none() {
+            self.get_selected_track_riff_uuid(state)
+        }
+        else {
+            (None, None)
+        };
+        let (position, note_number, velocity, duration) = (self.position, self.note, self.velocity, self.duration);
 
-                match selected_riff_track_uuid {
-                    Some(track_uuid) => {
-                        let playing = state.playing();
-                        let play_mode = state.play_mode();
-                        let playing_riff_set = state.playing_riff_set().clone();
-                        let mut riff_changed = false;
-
-                        for track in state.get_project().song_mut().tracks_mut().iter_mut() {
-                            if track.uuid().to_string() == track_uuid {
-                                match selected_riff_uuid.clone() {
-                                    Some(riff_uuid) => {
-                                        for riff in track.riffs_mut().iter_mut() {
-                                            if riff.uuid().to_string() == *riff_uuid {
-                                                let overlap_found = riff.events_mut().iter_mut().any(|track_event| {
-                                                    if let TrackEvent::Note(note) = track_event {
-                                                        let new_note_start = self.position();
-                                                        let new_note_end = self.position() + self.duration();
-                                                        let current_note_start = note.position();
-                                                        let current_note_end = note.position() + note.length();
-
-                                                        note.note() == self.note() && (
-                                                            (current_note_start <= new_note_start && new_note_start <= current_note_end) ||
-                                                            (current_note_start <= new_note_end && new_note_end <= current_note_end) ||
-                                                            (new_note_start < current_note_start && current_note_end < new_note_end)
-                                                        )
-                                                    }
-                                                    else {
-                                                        false
-                                                    }
-                                                });
-                                                if !overlap_found {
-                                                    riff.events_mut().push(TrackEvent::Note(Note::new_with_params(self.position(), self.note(), 127, self.duration())));
-                                                    riff.events_mut().sort_by(|a, b| a.position().partial_cmp(&b.position()).unwrap());
-                                                    riff_changed = true;
-                                                }
-                                                break;
-                                            }
-                                        }
-                                        self.check_riff_changed_and_playing(riff_uuid, &mut state, track_uuid, playing, play_mode, playing_riff_set, riff_changed);
-                                    }
-                                    None => info!("problem getting selected riff index"),
-                                }
-
-                                break;
-                            }
-                        }
+        execute_riff_edit(state, &mut self.diff, selected_riff_track_uuid, selected_riff_uuid, None, |_, riff| {
+            let new_note_start = position;
+            let new_note_end = position + duration;
+            let overlap_found = riff.event_store().notes().overlapping(new_note_start, new_note_end, note_number, note_number).next().is_some();
 
-                        if riff_changed {
-                            state.dirty = true;
-                        }
-                    },
-                    None => info!("problem getting selected riff track number"),
-                };
-            },
-            Err(_) => info!("could not get lock on state"),
-        };
-        Ok(())
+            if overlap_found {
+                vec![]
+            }
+            else {
+                // keep the events in position order
+                let index = riff.events().iter().position(|event| event.position() > position).unwrap_or(riff.events().len());
+                vec![RiffEventChange::Insert(index, TrackEvent::Note(Note::new_with_params(position, note_number, velocity, duration)))]
+            }
+        })
     }
 
     fn undo(&mut self, state: &mut Arc<Mutex<DAWState>>) -> Result<(), String> {
-        let (selected_riff_uuid, selected_riff_track_uuid) = self.get_selected_track_riff_uuid(state);
-
-        match state.lock() {
-            Ok(state) => {
-                let mut state = state;
-
-                match selected_riff_track_uuid {
-                    Some(track_uuid) => {
-                        let playing = state.playing();
-                        let play_mode = state.play_mode();
-                        let playing_riff_set = state.playing_riff_set().clone();
-
-                        for track in state.get_project().song_mut().tracks_mut().iter_mut() {
-                            if track.uuid().to_string() == track_uuid {
-                                match selected_riff_uuid.clone() {
-                                    Some(riff_uuid) => {
-                                        for riff in track.riffs_mut().iter_mut() {
-                                            if riff.uuid().to_string() == *riff_uuid {
-                                                riff.events_mut().retain(|event| match event {
-                                                    TrackEvent::Note(note) => !(note.note() == self.note() && note.position() == self.position() && note.velocity() == self.velocity() && note.length() == self.duration()),
-                                                    _ => true,
-                                                });
-
-                                                self.check_playing(riff_uuid, &mut state, track_uuid, playing, play_mode, playing_riff_set);
-                                                break;
-                                            }
-                                        }
-                                    }
-                                    None => info!("problem getting selected riff index"),
-                                }
-                                break;
-                            }
-                        }
+        undo_riff_edit(state, &self.diff)
+    }
 
-                    },
-                    None => info!("problem getting selected riff track number"),
-                };
-            },
-            Err(_) => info!("could not get lock on state"),
-        };
-        Ok(())
+    fn riff_events_diff(&mut self) -> Option<&mut RiffEventsDiff> {
+        self.diff.as_mut()
     }
 }
 
-#[derive(Clone)]
 pub struct RiffDeleteNoteAction {
     position: f64,
     note: i32,
-    velocity: i32,
-    duration: f64,
+    diff: Option<RiffEventsDiff>,
 }
 
 unsafe impl Send for RiffDeleteNoteAction {
@@ -295,8 +715,7 @@ impl RiffDeleteNoteAction {
         Self {
             position,
             note,
-            velocity: 0,
-            duration: 0.0,
+            diff: None,
         }
     }
     pub fn position(&self) -> f64 {
@@ -305,136 +724,98 @@ impl RiffDeleteNoteAction {
     pub fn note(&self) -> i32 {
         self.note
     }
-    pub fn velocity(&self) -> i32 {
-        self.velocity
-    }
-    pub fn duration(&self) -> f64 {
-        self.duration
-    }
 }
 
 impl HistoryAction for RiffDeleteNoteAction {
     fn execute(&mut self, state: &mut Arc<Mutex<DAWState>>) -> Result<(), String> {
-        let (selected_riff_uuid, selected_riff_track_uuid) = self.get_selected_track_riff_uuid(state);
+        let (selected_riff_uuid, selected_riff_track_uuid) = if self.diff.is_none() {
+            self.get_selected_track_riff_uuid(state)
+        }
+        else {
+            (None, None)
+        };
+        let (position, note_number) = (self.position, self.note);
 
-        match state.lock() {
-            Ok(state) => {
-                let mut state = state;
+        execute_riff_edit(state, &mut self.diff, selected_riff_track_uuid, selected_riff_uuid, None, |_, riff| {
+            remove_notes(riff, riff.event_store().notes().overlapping(position, position, note_number, note_number))
+        })
+    }
 
-                match selected_riff_track_uuid {
-                    Some(track_uuid) => {
-                        let playing = state.playing();
-                        let play_mode = state.play_mode();
-                        let playing_riff_set = state.playing_riff_set().clone();
-                        let mut riff_changed = false;
-
-                        for track in state.get_project().song_mut().tracks_mut().iter_mut() {
-                            if track.uuid().to_string() == track_uuid {
-                                match selected_riff_uuid.clone() {
-                                    Some(riff_uuid) => {
-                                        for riff in track.riffs_mut().iter_mut() {
-                                            if riff.uuid().to_string() == *riff_uuid {
-                                                let note = riff.events_mut().iter_mut().find(|event| match event {
-                                                    TrackEvent::Note(note) => note.note() == self.note() && note.position() <= self.position() && self.position() <= (note.position() + note.length()),
-                                                    _ => false,
-                                                });
-                                                if let Some(event) = note {
-                                                    match event {
-                                                        TrackEvent::Note(note) => {
-                                                            println!("delete note: position={}, note={}, velocity={}, duration={}", note.position(), note.note(), note.velocity(), note.length());
-                                                            self.position = note.position();
-                                                            self.velocity = note.velocity();
-                                                            self.duration = note.length();
-                                                            riff_changed = true;
-                                                        }
-                                                        _ => {}
-                                                    }
-                                                }
-                                                riff.events_mut().retain(|event| match event {
-                                                    TrackEvent::Note(note) => !(note.note() == self.note() && note.position() <= self.position() && self.position() <= (note.position() + note.length())),
-                                                    _ => true,
-                                                });
-
-                                                self.check_riff_changed_and_playing(riff_uuid, &mut state, track_uuid, playing, play_mode, playing_riff_set, true);
-                                                break;
-                                            }
-                                        }
-                                    }
-                                    None => info!("problem getting selected riff index"),
-                                }
-
-                                break;
-                            }
-                        }
+    fn undo(&mut self, state: &mut Arc<Mutex<DAWState>>) -> Result<(), String> {
+        undo_riff_edit(state, &self.diff)
+    }
 
-                        if riff_changed {
-                            state.dirty = true;
-                        }
-                    },
-                    None => info!("problem getting selected riff track number"),
-                };
-            },
-            Err(_) => info!("could not get lock on state"),
-        };
-        Ok(())
+    fn riff_events_diff(&mut self) -> Option<&mut RiffEventsDiff> {
+        self.diff.as_mut()
     }
+}
 
-    fn undo(&mut self, state: &mut Arc<Mutex<DAWState>>) -> Result<(), String> {
-        let (selected_riff_uuid, selected_riff_track_uuid) = self.get_selected_track_riff_uuid(state);
+/// A note dragged in the piano roll - moved, or its start or end changed.
+pub struct RiffChangeEventAction {
+    original_event: TrackEvent,
+    changed_event: TrackEvent,
+    track_uuid: Option<String>,
+    riff_uuid: Option<String>,
+    diff: Option<RiffEventsDiff>,
+}
 
-        match state.lock() {
-            Ok(state) => {
-                let mut state = state;
+impl RiffChangeEventAction {
+    pub fn new(
+        track_uuid: Option<String>,
+        riff_uuid: Option<String>,
+        original_event: TrackEvent,
+        changed_event: TrackEvent,
+    ) -> Self {
+        Self {
+            original_event,
+            changed_event,
+            track_uuid,
+            riff_uuid,
+            diff: None,
+        }
+    }
+}
 
-                match selected_riff_track_uuid {
-                    Some(track_uuid) => {
-                        let playing = state.playing();
-                        let play_mode = state.play_mode();
-                        let playing_riff_set = state.playing_riff_set().clone();
-                        let mut riff_changed = false;
-
-                        match selected_riff_uuid.clone() {
-                            Some(riff_uuid) => {
-                                for track in state.get_project().song_mut().tracks_mut().iter_mut() {
-                                    if track.uuid().to_string() == track_uuid {
-                                        for riff in track.riffs_mut().iter_mut() {
-                                            if riff.uuid().to_string() == *riff_uuid {
-                                                riff.events_mut().push(TrackEvent::Note(Note::new_with_params(self.position(), self.note(), 127, self.duration())));
-                                                riff_changed = true;
-                                                self.check_riff_changed_and_playing(riff_uuid, &mut state, track_uuid, playing, play_mode, playing_riff_set, riff_changed);
-                                                break;
-                                            }
-                                        }
-                                        break;
-                                    }
-                                }
-                            }
-                            None => info!("problem getting selected riff index"),
-                        }
+impl HistoryAction for RiffChangeEventAction {
+    fn execute(&mut self, state: &mut Arc<Mutex<DAWState>>) -> Result<(), String> {
+        let (original_event, changed_event) = (self.original_event, self.changed_event);
+
+        execute_riff_edit(state, &mut self.diff, self.track_uuid.clone(), self.riff_uuid.clone(), Some("drag"), |_, riff| {
+            match (original_event, changed_event) {
+                (TrackEvent::Note(original_note), TrackEvent::Note(changed_note)) => {
+                    let notes = riff.event_store().notes();
+                    let original_row = notes.overlapping(original_note.position(), original_note.position(), original_note.note(), original_note.note())
+                        .find(|row| matches!(riff.events()[notes.ids[*row]], TrackEvent::Note(note) if note == original_note));
+                    replace_notes(riff, original_row.into_iter(), |note| {
+                        let mut edited_note = *note;
+                        edited_note.set_position(changed_note.position());
+                        edited_note.set_note(changed_note.note());
+                        edited_note.set_length(changed_note.length());
+                        Some(edited_note)
+                    })
+                }
+                _ => vec![],
+            }
+        })
+    }
 
-                        if riff_changed {
-                            state.dirty = true;
-                        }
-                    },
-                    None => info!("problem getting selected riff track number"),
-                };
-            },
-            Err(_) => info!("could not get lock on state"),
-        };
+    fn undo(&mut self, state: &mut Arc<Mutex<DAWState>>) -> Result<(), String> {
+        undo_riff_edit(state, &self.diff)
+    }
 
-        Ok(())
+    fn riff_events_diff(&mut self) -> Option<&mut RiffEventsDiff> {
+        self.diff.as_mut()
     }
 }
 
-
 pub struct RiffCutSelectedAction {
     x: f64,
     y: i32,
     x2: f64,
     y2: i32,
-    notes: Vec<Note>,
     track_uuid: Option<String>,
     riff_uuid: Option<String>,
+    diff: Option<RiffEventsDiff>,
 }
 
 impl RiffCutSelectedAction {
@@ -451,87 +832,29 @@ impl RiffCutSelectedAction {
             y,
             x2,
             y2,
-            notes: vec![],
             track_uuid,
             riff_uuid,
+            diff: None,
         }
     }
 }
 
 impl HistoryAction for RiffCutSelectedAction {
     fn execute(&mut self, state: &mut Arc<Mutex<DAWState>>) -> Result<(), String> {
-        match state.lock() {
-            Ok(state) => {
-                let mut state = state;
-
-                match self.track_uuid.clone() {
-                    Some(track_uuid) => {
-                        let playing = state.playing();
-                        let play_mode = state.play_mode();
-                        let playing_riff_set = state.playing_riff_set().clone();
-
-                        match state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
-                            Some(track) => {
-                                match self.riff_uuid.clone() {
-                                    Some(riff_uuid) => {
-                                        let mut riff_changed = false;
-
-                                        for riff in track.riffs_mut().iter_mut() {
-                                            if riff.uuid().to_string() == *riff_uuid {
-                                                // store the notes for an undo
-                                                for track_event in riff.events_mut().iter_mut() {
-                                                    if let TrackEvent::Note(note) = track_event {
-                                                        if self.y <= note.note() && note.note() <= self.y2 && self.x <= note.position() && (note.position() + note.length()) <= self.x2 {
-                                                            self.notes.push(note.clone());
-                                                            riff_changed = true;
-                                                        }
-                                                    }
-                                                }
-
-                                                // remove the notes with in the window
-                                                riff.events_mut().retain(|event| match event {
-                                                    TrackEvent::ActiveSense => true,
-                                                    TrackEvent::AfterTouch => true,
-                                                    TrackEvent::ProgramChange => true,
-                                                    TrackEvent::Note(note) => !(self.y <= note.note() && note.note() <= self.y2 && self.x <= note.position() && (note.position() + note.length()) <= self.x2),
-                                                    TrackEvent::NoteOn(_) => true,
-                                                    TrackEvent::NoteOff(_) => true,
-                                                    TrackEvent::Controller(_) => true,
-                                                    TrackEvent::PitchBend(_pitch_bend) => true,
-                                                    TrackEvent::KeyPressure => true,
-                                                    TrackEvent::AudioPluginParameter(_) => true,
-                                                    TrackEvent::Sample(_sample) => true,
-                                                    TrackEvent::Measure(_) => true,
-                                                    TrackEvent::NoteExpression(_) => true,
-                                                });
-                                                break;
-                                            }
-                                        }
-
-                                        self.check_riff_changed_and_playing(riff_uuid, &mut state, track_uuid, playing, play_mode, playing_riff_set, riff_changed);
-
-                                        if riff_changed {
-                                            state.dirty = true;
-                                        }
-                                    },
-                                    None => info!("Main - rx_ui processing loop - riff cut selected notes - problem getting selected riff index"),
-                                }
-                            },
-                            None => ()
-                        }
-                    },
-                    None => info!("Main - rx_ui processing loop - riff cut selected notes  - problem getting selected riff track number"),
-                };
-            },
-            Err(_) => info!("Main - rx_ui processing loop - riff cut selected notes - could not get lock on state"),
-        };
+        let (x, y, x2, y2) = (self.x, self.y, self.x2, self.y2);
 
-        Ok(())
+        // remove the notes with in the window
+        execute_riff_edit(state, &mut self.diff, self.track_uuid.clone(), self.riff_uuid.clone(), None, |_, riff| {
+            remove_notes(riff, riff.event_store().notes().within(x, x2, y, y2))
+        })
     }
 
-    fn undo(&mut self, _state: &mut Arc<Mutex<DAWState>>) -> Result<(), String> {
+    fn undo(&mut self, state: &mut Arc<Mutex<DAWState>>) -> Result<(), String> {
+        undo_riff_edit(state, &self.diff)
+    }
 
-        Ok(())
+    fn riff_events_diff(&mut self) -> Option<&mut RiffEventsDiff> {
+        self.diff.as_mut()
     }
 }
 
@@ -540,12 +863,12 @@ pub struct RiffTranslateSelectedAction {
     y: i32,
     x2: f64,
     y2: i32,
-    track_events: Vec<TrackEvent>,
     track_uuid: Option<String>,
     riff_uuid: Option<String>,
     translation_entity_type: TranslationEntityType,
     translate_direction: TranslateDirection,
     snap_in_beats: f64,
+    diff: Option<RiffEventsDiff>,
 }
 
 impl RiffTranslateSelectedAction {
@@ -565,119 +888,44 @@ impl RiffTranslateSelectedAction {
             y,
             x2,
             y2,
-            track_events: vec![],
             track_uuid,
             riff_uuid,
             translation_entity_type,
             translate_direction,
             snap_in_beats,
+            diff: None,
         }
     }
 }
 
 impl HistoryAction for RiffTranslateSelectedAction {
     fn execute(&mut self, state: &mut Arc<Mutex<DAWState>>) -> Result<(), String> {
-        match state.lock() {
-            Ok(state) => {
-                let tempo = {
-                    state.project().song().tempo()
-                };
-
-                let mut state = state;
-                let snap_position_in_secs = self.snap_in_beats / tempo * 60.0;
-
-                match self.track_uuid.clone() {
-                    Some(track_uuid) => {
-                        let playing = state.playing();
-                        let play_mode = state.play_mode();
-                        let playing_riff_set = state.playing_riff_set().clone();
-                        let mut riff_changed = false;
-
-                        match state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
-                            Some(track) => {
-                                match self.riff_uuid.clone() {
-                                    Some(riff_uuid) => {
-                                        for riff in track.riffs_mut().iter_mut() {
-                                            if riff.uuid().to_string() == *riff_uuid {
-                                                riff.events_mut().iter_mut().for_each(|event| match event {
-                                                    TrackEvent::ActiveSense => {},
-                                                    TrackEvent::AfterTouch => {},
-                                                    TrackEvent::ProgramChange => {},
-                                                    TrackEvent::Note(note) => if self.y <= note.note() && note.note() <= self.y2 && self.x <= note.position() && (note.position() + note.length()) <= self.x2 {
-                                                        let mut note_number = note.note();
-                                                        let mut note_position = note.position();
-
-                                                        match self.translate_direction {
-                                                            TranslateDirection::Up => {
-                                                                note_number += 1;
-                                                                if note_number > 127 {
-                                                                    note_number = 127;
-                                                                }
-                                                                note.set_note(note_number);
-                                                            },
-                                                            TranslateDirection::Down => {
-                                                                note_number -= 1;
-                                                                if note_number < 0 {
-                                                                    note_number = 0;
-                                                                }
-                                                                note.set_note(note_number);
-                                                            },
-                                                            TranslateDirection::Left => {
-                                                                note_position -= snap_position_in_secs;
-                                                                if note_position < 0.0 {
-                                                                    note_position = 0.0;
-                                                                }
-                                                                note.set_position(note_position);
-                                                            },
-                                                            TranslateDirection::Right => {
-                                                                note_position += snap_position_in_secs;
-                                                                if note_position < 0.0 {
-                                                                    note_position = 0.0;
-                                                                }
-                                                                note.set_position(note_position);
-                                                            },
-                                                        }
-
-                                                        riff_changed = true;
-                                                    }
-                                                    TrackEvent::NoteOn(_) => {}
-                                                    TrackEvent::NoteOff(_) => {}
-                                                    TrackEvent::Controller(_) => {}
-                                                    TrackEvent::PitchBend(_pitch_bend) => {}
-                                                    TrackEvent::KeyPressure => {}
-                                                    TrackEvent::AudioPluginParameter(_) => {}
-                                                    TrackEvent::Sample(_sample) => {}
-                                                    TrackEvent::Measure(_) => {}
-                                                    TrackEvent::NoteExpression(_) => {}
-                                                });
-
-                                                self.check_riff_changed_and_playing(riff_uuid, &mut state, track_uuid, playing, play_mode, playing_riff_set, riff_changed);
-                                                break;
-                                            }
-                                        }
-                                    },
-                                    None => info!("Main - rx_ui processing loop - riff translate selected notes - problem getting selected riff index"),
-                                }
-                            },
-                            None => ()
-                        }
-
-                        if riff_changed {
-                            state.dirty = true;
-                        }
-                    },
-                    None => info!("Main - rx_ui processing loop - riff translate selected  - problem getting selected riff track number"),
-                };
-            },
-            Err(_) => info!("Main - rx_ui processing loop - riff translate selected - could not get lock on state"),
-        };
-
-        Ok(())
+        let (x, y, x2, y2) = (self.x, self.y, self.x2, self.y2);
+        let translate_direction = &self.translate_direction;
+        let snap_in_beats = self.snap_in_beats;
+
+        execute_riff_edit(state, &mut self.diff, self.track_uuid.clone(), self.riff_uuid.clone(), Some("translate"), |state, riff| {
+            let snap_position_in_secs = snap_in_beats / state.project().song().tempo() * 60.0;
+
+            replace_notes(riff, riff.event_store().notes().within(x, x2, y, y2), |note| {
+                let mut translated_note = *note;
+                match translate_direction {
+                    TranslateDirection::Up => translated_note.set_note((note.note() + 1).min(127)),
+                    TranslateDirection::Down => translated_note.set_note((note.note() - 1).max(0)),
+                    TranslateDirection::Left => translated_note.set_position((note.position() - snap_position_in_secs).max(0.0)),
+                    TranslateDirection::Right => translated_note.set_position((note.position() + snap_position_in_secs).max(0.0)),
+                }
+                Some(translated_note)
+            })
+        })
     }
 
-    fn undo(&mut self, _state: &mut Arc<Mutex<DAWState>>) -> Result<(), String> {
+    fn undo(&mut self, state: &mut Arc<Mutex<DAWState>>) -> Result<(), String> {
+        undo_riff_edit(state, &self.diff)
+    }
 
-        Ok(())
+    fn riff_events_diff(&mut self) -> Option<&mut RiffEventsDiff> {
+        self.diff.as_mut()
     }
 }
 
@@ -686,11 +934,11 @@ pub struct RiffChangeLengthOfSelectedAction {
     y: i32,
     x2: f64,
     y2: i32,
-    notes: Vec<Note>,
     track_uuid: Option<String>,
     riff_uuid: Option<String>,
     length_increment_in_beats: f64,
     lengthen: bool,
+    diff: Option<RiffEventsDiff>,
 }
 
 impl RiffChangeLengthOfSelectedAction {
@@ -709,92 +957,53 @@ impl RiffChangeLengthOfSelectedAction {
             y,
             x2,
             y2,
-            notes: vec![],
             track_uuid,
             riff_uuid,
             length_increment_in_beats,
             lengthen,
+            diff: None,
         }
     }
 }
 
 impl HistoryAction for RiffChangeLengthOfSelectedAction {
     fn execute(&mut self, state: &mut Arc<Mutex<DAWState>>) -> Result<(), String> {
-        match state.lock() {
-            Ok(state) => {
-                let tempo = {
-                    state.project().song().tempo()
-                };
-
-                let mut state = state;
-                let length_increment_in_secs = self.length_increment_in_beats / tempo * 60.0;
-
-                match self.track_uuid.clone() {
-                    Some(track_uuid) => {
-                        let playing = state.playing();
-                        let play_mode = state.play_mode();
-                        let playing_riff_set = state.playing_riff_set().clone();
-                        let mut riff_changed = false;
-
-                        match state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
-                            Some(track) => {
-                                match self.riff_uuid.clone() {
-                                    Some(riff_uuid) => {
-                                        for riff in track.riffs_mut().iter_mut() {
-                                            if riff.uuid().to_string() == *riff_uuid {
-                                                riff.events_mut().iter_mut().for_each(|event| match event {
-                                                    TrackEvent::Note(note) => if self.y <= note.note() && note.note() <= self.y2 && self.x <= note.position() && (note.position() + note.length()) <= self.x2 {
-                                                        let note_length = note.length();
-
-                                                        if note_length > 0.0 {
-                                                            if self.lengthen {
-                                                                note.set_length(note_length + length_increment_in_secs);
-                                                            }
-                                                            else if (note_length - length_increment_in_secs) > 0.0 {
-                                                                note.set_length(note_length - length_increment_in_secs);
-                                                            }
-                                                        }
-
-                                                        riff_changed = true;
-                                                    },
-                                                    _ => {},
-                                                });
-
-                                                self.check_riff_changed_and_playing(riff_uuid, &mut state, track_uuid, playing, play_mode, playing_riff_set, riff_changed);
-                                                break;
-                                            }
-                                        }
-                                    },
-                                    None => info!("Main - rx_ui processing loop - riff lengthen selected notes - problem getting selected riff index"),
-                                }
-                            },
-                            None => ()
-                        }
-
-                        if riff_changed {
-                            state.dirty = true;
-                        }
-                    },
-                    None => info!("Main - rx_ui processing loop - riff lengthen selected notes - problem getting selected riff track number"),
-                };
-            },
-            Err(_) => info!("Main - rx_ui processing loop - riff lengthen selected notes - could not get lock on state"),
-        };
-
-        Ok(())
+        let (x, y, x2, y2) = (self.x, self.y, self.x2, self.y2);
+        let (length_increment_in_beats, lengthen) = (self.length_increment_in_beats, self.lengthen);
+
+        execute_riff_edit(state, &mut self.diff, self.track_uuid.clone(), self.riff_uuid.clone(), Some("change length"), |state, riff| {
+            let length_increment_in_secs = length_increment_in_beats / state.project().song().tempo() * 60.0;
+
+            replace_notes(riff, riff.event_store().notes().within(x, x2, y, y2), |note| {
+                let note_length = note.length();
+                let mut changed_note = *note;
+                if note_length > 0.0 {
+                    if lengthen {
+                        changed_note.set_length(note_length + length_increment_in_secs);
+                    }
+                    else if (note_length - length_increment_in_secs) > 0.0 {
+                        changed_note.set_length(note_length - length_increment_in_secs);
+                    }
+                }
+                Some(changed_note)
+            })
+        })
     }
 
-    fn undo(&mut self, _state: &mut Arc<Mutex<DAWState>>) -> Result<(), String> {
+    fn undo(&mut self, state: &mut Arc<Mutex<DAWState>>) -> Result<(), String> {
+        undo_riff_edit(state, &self.diff)
+    }
 
-        Ok(())
+    fn riff_events_diff(&mut self) -> Option<&mut RiffEventsDiff> {
+        self.diff.as_mut()
     }
 }
 
 pub struct RiffPasteSelectedAction {
     edit_cursor_position_in_beats: f64,
-    notes: Vec<Note>,
     track_uuid: Option<String>,
     riff_uuid: Option<String>,
+    diff: Option<RiffEventsDiff>,
 }
 
 impl RiffPasteSelectedAction {
@@ -805,100 +1014,43 @@ impl RiffPasteSelectedAction {
     ) -> Self {
         Self {
             edit_cursor_position_in_beats,
-            notes: vec![],
             track_uuid,
             riff_uuid,
+            diff: None,
         }
     }
 }
 
 impl HistoryAction for RiffPasteSelectedAction {
     fn execute(&mut self, state: &mut Arc<Mutex<DAWState>>) -> Result<(), String> {
-        match state.lock() {
-            Ok(state) => {
-                let mut copy_buffer: Vec<TrackEvent> = vec![];
-                let mut pasted_events_buffer: Vec<Note> = vec![];
-
-                if self.notes.is_empty() {
-                    state.track_event_copy_buffer().iter().for_each(|event| copy_buffer.push(event.clone()));
+        let edit_cursor_position_in_beats = self.edit_cursor_position_in_beats;
+
+        execute_riff_edit(state, &mut self.diff, self.track_uuid.clone(), self.riff_uuid.clone(), None, |state, riff| {
+            let mut index = riff.events().len();
+
+            state.track_event_copy_buffer().iter().filter_map(|event| match event {
+                TrackEvent::Note(note) => {
+                    let mut pasted_note = *note;
+                    pasted_note.set_position(note.position() + edit_cursor_position_in_beats);
+                    index += 1;
+                    Some(RiffEventChange::Insert(index - 1, TrackEvent::Note(pasted_note)))
+                },
+                TrackEvent::Measure(_) => None,
+                TrackEvent::NoteExpression(_) => None,
+                _ => {
+                    info!("TrackChangeType::RiffPasteSelectedNotes only notes can be pasted so far!");
+                    None
                 }
-                else {
-                    self.notes.iter().for_each(|event| copy_buffer.push(TrackEvent::Note(event.clone())));
-                }
-
-                let mut state = state;
-
-                match self.track_uuid.as_ref() {
-                    Some(track_uuid) => {
-                        let playing = state.playing();
-                        let play_mode = state.play_mode();
-                        let playing_riff_set = state.playing_riff_set().clone();
-
-                        match state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid.to_string()) {
-                            Some(track) => {
-                                match self.riff_uuid.as_ref() {
-                                    Some(riff_uuid) => {
-                                        let mut riff_changed = false;
-
-                                        for riff in track.riffs_mut().iter_mut() {
-                                            if riff.uuid().to_string() == *riff_uuid {
-                                                copy_buffer.iter_mut().for_each(|event| {
-                                                    let cloned_event = event.clone();
-                                                    match cloned_event {
-                                                        TrackEvent::ActiveSense => info!("TrackChangeType::RiffPasteSelectedNotes ActiveSense not yet implemented!"),
-                                                        TrackEvent::AfterTouch => info!("TrackChangeType::RiffPasteSelectedNotes AfterTouch not yet implemented!"),
-                                                        TrackEvent::ProgramChange => info!("TrackChangeType::RiffPasteSelectedNotes ProgramChange not yet implemented!"),
-                                                        TrackEvent::Note(mut note) => {
-                                                            if self.notes.is_empty() {
-                                                                note.set_position(note.position() + self.edit_cursor_position_in_beats);
-                                                                pasted_events_buffer.push(note.clone());
-                                                            }
-                                                            riff.events_mut().push(TrackEvent::Note(note));
-
-                                                            riff_changed = true;
-                                                        },
-                                                        TrackEvent::NoteOn(_) => info!("TrackChangeType::RiffPasteSelectedNotes NoteOn not yet implemented!"),
-                                                        TrackEvent::NoteOff(_) => info!("TrackChangeType::RiffPasteSelectedNotes NoteOff not yet implemented!"),
-                                                        TrackEvent::Controller(_) => info!("TrackChangeType::RiffPasteSelectedNotes Controller not yet implemented!"),
-                                                        TrackEvent::PitchBend(_pitch_bend) => info!("TrackChangeType::RiffPasteSelectedNotes PitchBend not yet implemented!"),
-                                                        TrackEvent::KeyPressure => info!("TrackChangeType::RiffPasteSelectedNotes KeyPressure not yet implemented!"),
-                                                        TrackEvent::AudioPluginParameter(_) => info!("TrackChangeType::RiffPasteSelectedNotes AudioPluginParameter not yet implemented!"),
-                                                        TrackEvent::Sample(_sample) => info!("TrackChangeType::RiffPasteSelectedNotes Sample not yet implemented!"),
-                                                        TrackEvent::Measure(_) => {}
-                                                        TrackEvent::NoteExpression(_) => {}
-                                                        
-                                                    }
-                                                });
-                                                break;
-                                            }
-                                        }
-
-                                        if riff_changed {
-                                            for note in pasted_events_buffer.iter() {
-                                                self.notes.push(note.clone());
-                                            }
-                                            state.dirty = true;
-                                        }
-
-                                        self.check_riff_changed_and_playing(riff_uuid.to_string(), &mut state, track_uuid.to_string(), playing, play_mode, playing_riff_set, riff_changed);
-                                    },
-                                    None => info!("Main - rx_ui processing loop - riff paste selected - problem getting selected riff index"),
-                                }
-                            },
-                            None => ()
-                        }
-                    },
-                    None => info!("Main - rx_ui processing loop - riff references paste selected  - problem getting selected riff track number"),
-                };
-            },
-            Err(_) => info!("Main - rx_ui processing loop - riff paste selected - could not get lock on state"),
-        };
+            }).collect()
+        })
+    }
 
-        Ok(())
+    fn undo(&mut self, state: &mut Arc<Mutex<DAWState>>) -> Result<(), String> {
+        undo_riff_edit(state, &self.diff)
     }
 
-    fn undo(&mut self, _state: &mut Arc<Mutex<DAWState>>) -> Result<(), String> {
-        Ok(())
+    fn riff_events_diff(&mut self) -> Option<&mut RiffEventsDiff> {
+        self.diff.as_mut()
     }
 }
 
@@ -907,11 +1059,10 @@ pub struct RiffQuantiseSelectedAction {
     y: i32,
     x2: f64,
     y2: i32,
-    original_notes: Vec<Note>,
-    quantised_notes: Vec<Note>,
     track_uuid: Option<String>,
     riff_uuid: Option<String>,
     snap_in_beats: f64,
+    diff: Option<RiffEventsDiff>,
 }
 
 impl RiffQuantiseSelectedAction {
@@ -929,113 +1080,114 @@ impl RiffQuantiseSelectedAction {
             y,
             x2,
             y2,
-            original_notes: vec![],
-            quantised_notes: vec![],
             track_uuid,
             riff_uuid,
             snap_in_beats,
+            diff: None,
         }
     }
 }
 
 impl HistoryAction for RiffQuantiseSelectedAction {
     fn execute(&mut self, state: &mut Arc<Mutex<DAWState>>) -> Result<(), String> {
-        match state.lock() {
-            Ok(state) => {
-                let mut state = state;
+        let (lower_x, upper_x) = (self.x.min(self.x2), self.x.max(self.x2));
+        let (lower_y, upper_y) = (self.y.min(self.y2), self.y.max(self.y2));
+        let snap_in_beats = self.snap_in_beats;
+
+        execute_riff_edit(state, &mut self.diff, self.track_uuid.clone(), self.riff_uuid.clone(), None, |_, riff| {
+            replace_notes(riff, riff.event_store().notes().within(lower_x, upper_x, lower_y, upper_y), |note| {
+                let note_position = note.position();
+                if note_position <= 0.0 {
+                    return None;
+                }
 
-                match self.track_uuid.as_ref() {
-                    Some(track_uuid) => {
-                        let playing = state.playing();
-                        let play_mode = state.play_mode();
-                        let playing_riff_set = state.playing_riff_set().clone();
-
-                        match state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == *track_uuid) {
-                            Some(track) => {
-                                match self.riff_uuid.as_ref() {
-                                    Some(riff_uuid) => {
-                                        let mut riff_changed = false;
-
-                                        for riff in track.riffs_mut().iter_mut() {
-                                            if riff.uuid().to_string() == *riff_uuid {
-                                                riff.events_mut().iter_mut().for_each(|event| match event {
-                                                    TrackEvent::ActiveSense => {},
-                                                    TrackEvent::AfterTouch => {},
-                                                    TrackEvent::ProgramChange => {},
-                                                    TrackEvent::Note(note) => {
-                                                        let lower_y = if self.y < self.y2 {
-                                                            self.y
-                                                        }
-                                                        else {
-                                                            self.y2
-                                                        };
-                                                        let upper_y = if self.y > self.y2 {
-                                                            self.y
-                                                        }
-                                                        else {
-                                                            self.y2
-                                                        };
-                                                        let lower_x = if self.x < self.x2 {
-                                                            self.x
-                                                        }
-                                                        else {
-                                                            self.x2
-                                                        };
-                                                        let upper_x = if self.x > self.x2 {
-                                                            self.x
-                                                        }
-                                                        else {
-                                                            self.x2
-                                                        };
-                                                        if lower_y <= note.note() && note.note() <= upper_y && lower_x <= note.position() && (note.position() + note.length()) <= upper_x {
-                                                            let note_position = note.position();
-
-                                                            if note_position > 0.0 {
-                                                                let snap_delta = note_position % self.snap_in_beats;
-                                                                if (note_position - snap_delta) >= 0.0 {
-                                                                    note.set_position(note_position - snap_delta);
-
-                                                                    riff_changed = true;
-                                                                }
-                                                            }
-                                                        }
-                                                    },
-                                                    TrackEvent::NoteOn(_) => {},
-                                                    TrackEvent::NoteOff(_) => {},
-                                                    TrackEvent::Controller(_) => {},
-                                                    TrackEvent::PitchBend(_pitch_bend) => {},
-                                                    TrackEvent::KeyPressure => {},
-                                                    TrackEvent::AudioPluginParameter(_) => {},
-                                                    TrackEvent::Sample(_sample) => {},
-                                                    TrackEvent::Measure(_) => {}
-                                                    TrackEvent::NoteExpression(_) => {}
-                                                });
-                                                break;
-                                            }
-                                        }
-
-                                        self.check_riff_changed_and_playing(riff_uuid.to_string(), &mut state, track_uuid.to_string(), playing, play_mode, playing_riff_set, riff_changed);
-
-                                        if riff_changed {
-                                            state.dirty = true;
-                                        }
-                                    },
-                                    None => info!("Main - rx_ui processing loop - riff quantise selected event - problem getting selected riff index"),
-                                }
-                            },
-                            None => ()
-                        }
-                    },
-                    None => info!("Main - rx_ui processing loop - riff quantise selected event  - problem getting selected riff track number"),
-                };
-            },
-            Err(_) => info!("Main - rx_ui processing loop - riff quantise selected - could not get lock on state"),
-        };
+                let snap_delta = note_position % snap_in_beats;
+                if (note_position - snap_delta) >= 0.0 {
+                    let mut quantised_note = *note;
+                    quantised_note.set_position(note_position - snap_delta);
+                    Some(quantised_note)
+                }
+                else {
+                    None
+                }
+            })
+        })
+    }
 
-        Ok(())
+    fn undo(&mut self, state: &mut Arc<Mutex<DAWState>>) -> Result<(), String> {
+        undo_riff_edit(state, &self.diff)
     }
 
-    fn undo(&mut self, _state: &mut Arc<Mutex<DAWState>>) -> Result<(), String> {
-        Ok(())
+    fn riff_events_diff(&mut self) -> Option<&mut RiffEventsDiff> {
+        self.diff.as_mut()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use crate::domain::{DAWItemPosition, Note, TrackEvent};
+    use crate::history::{bulk_note_changes, RiffEventChange, RiffEventsDiff};
+
+    fn note(position: f64, note: i32) -> TrackEvent {
+        TrackEvent::Note(Note::new_with_params(position, note, 127, 1.0))
+    }
+
+    fn notes(events: &[TrackEvent]) -> Vec<(f64, i32)> {
+        events.iter().filter_map(|event| match event {
+            TrackEvent::Note(note) => Some((note.position(), note.note())),
+            _ => None,
+        }).collect()
+    }
+
+    #[test]
+    fn diffs_undo_and_redo_and_coalesce() {
+        let original_events = vec![note(0.0, 60), note(1.0, 62), note(2.0, 64), note(3.0, 65)];
+        let mut events = original_events.clone();
+
+        // cut two notes - the highest index first
+        let cut = RiffEventsDiff::new("track".to_string(), "riff".to_string(), None, vec![
+            RiffEventChange::Remove(2, note(2.0, 64)),
+            RiffEventChange::Remove(0, note(0.0, 60)),
+        ]);
+        cut.apply(&mut events, true);
+        assert_eq!(vec![(1.0, 62), (3.0, 65)], notes(&events));
+        cut.apply(&mut events, false);
+        assert_eq!(notes(&original_events), notes(&events));
+        assert_eq!(Some((0.0, 3.0)), cut.changed_range_in_beats());
+
+        // two nudges of the same note become one
+        let mut first_nudge = RiffEventsDiff::new("track".to_string(), "riff".to_string(), Some("translate"), vec![
+            RiffEventChange::Replace(1, note(1.0, 62), note(1.0, 63)),
+        ]);
+        let second_nudge = RiffEventsDiff::new("track".to_string(), "riff".to_string(), Some("translate"), vec![
+            RiffEventChange::Replace(1, note(1.0, 63), note(1.0, 64)),
+        ]);
+        first_nudge.apply(&mut events, true);
+        second_nudge.apply(&mut events, true);
+        assert!(first_nudge.coalesce(&second_nudge));
+        assert!(!first_nudge.coalesce(&cut));
+        first_nudge.apply(&mut events, false);
+        assert_eq!(notes(&original_events), notes(&events));
+        first_nudge.apply(&mut events, true);
+        assert_eq!(vec![(0.0, 60), (1.0, 64), (2.0, 64), (3.0, 65)], notes(&events));
+    }
+
+    #[test]
+    fn bulk_note_changes_keep_the_events_in_order_and_undo() {
+        let original_events = vec![note(0.0, 60), note(1.0, 62), note(2.0, 64), note(3.0, 65)];
+        let mut events = original_events.clone();
+        let as_note = |position: f64, note_number: i32| Note::new_with_params(position, note_number, 127, 1.0);
+
+        let changes = bulk_note_changes(&events, &[
+            (as_note(0.0, 60), Some(as_note(0.0, 72))), // transposed in place
+            (as_note(1.0, 62), Some(as_note(2.5, 62))), // moved
+            (as_note(3.0, 65), None),                   // removed
+        ], &[as_note(0.5, 48), as_note(4.0, 50)]);
+        let diff = RiffEventsDiff::new("track".to_string(), "riff".to_string(), None, changes);
+
+        diff.apply(&mut events, true);
+        assert_eq!(vec![(0.0, 72), (0.5, 48), (2.0, 64), (2.5, 62), (4.0, 50)], notes(&events));
+        diff.apply(&mut events, false);
+        assert_eq!(notes(&original_events), notes(&events));
     }
 }
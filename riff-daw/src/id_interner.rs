@@ -0,0 +1,166 @@
+use std::collections::HashMap;
+
+use uuid::Uuid;
+
+/// A compact stand in for a uuid - an index into the interner that handed it out.
+#[derive(Clone, Copy, Debug, PartialEq, Eq, Hash, PartialOrd, Ord)]
+pub struct IdHandle(u32);
+
+impl IdHandle {
+    pub fn index(&self) -> usize {
+        self.0 as usize
+    }
+}
+
+/// Maps uuids to handles allocated densely from zero so that lookups keyed on them can be plain vector indexing.
+/// Handles are never reused - a project only has so many tracks, riffs and plugins over its lifetime.
+#[derive(Default)]
+pub struct IdInterner {
+    handles: HashMap<Uuid, IdHandle>,
+    uuids: Vec<Uuid>,
+}
+
+impl IdInterner {
+    pub fn intern(&mut self, uuid: Uuid) -> IdHandle {
+        match self.handles.get(&uuid) {
+            Some(handle) => *handle,
+            None => {
+                let handle = IdHandle(self.uuids.len() as u32);
+                self.uuids.push(uuid);
+                self.handles.insert(uuid, handle);
+                handle
+            }
+        }
+    }
+
+    /// Interns a uuid in string form - None if it isn't a uuid.
+    pub fn intern_str(&mut self, uuid: &str) -> Option<IdHandle> {
+        Uuid::parse_str(uuid).ok().map(|uuid| self.intern(uuid))
+    }
+
+    pub fn handle(&self, uuid: &Uuid) -> Option<IdHandle> {
+        self.handles.get(uuid).copied()
+    }
+
+    /// The handle for a uuid in string form without allocating - None if it isn't a uuid or hasn't been interned.
+    pub fn handle_str(&self, uuid: &str) -> Option<IdHandle> {
+        Uuid::parse_str(uuid).ok().and_then(|uuid| self.handle(&uuid))
+    }
+
+    pub fn uuid(&self, handle: IdHandle) -> Option<Uuid> {
+        self.uuids.get(handle.index()).copied()
+    }
+}
+
+/// Values keyed by handle in a vector of slots - lookups are an index rather than a hash of a uuid string.
+pub struct IdSlotMap<T> {
+    slots: Vec<Option<T>>,
+    len: usize,
+}
+
+impl<T> Default for IdSlotMap<T> {
+    fn default() -> Self {
+        Self {
+            slots: vec![],
+            len: 0,
+        }
+    }
+}
+
+impl<T> IdSlotMap<T> {
+    pub fn insert(&mut self, handle: IdHandle, value: T) -> Option<T> {
+        if self.slots.len() <= handle.index() {
+            self.slots.resize_with(handle.index() + 1, || None);
+        }
+        let previous = self.slots[handle.index()].replace(value);
+        if previous.is_none() {
+            self.len += 1;
+        }
+        previous
+    }
+
+    pub fn remove(&mut self, handle: IdHandle) -> Option<T> {
+        let previous = self.slots.get_mut(handle.index()).and_then(|slot| slot.take());
+        if previous.is_some() {
+            self.len -= 1;
+        }
+        previous
+    }
+
+    pub fn get(&self, handle: IdHandle) -> Option<&T> {
+        self.slots.get(handle.index()).and_then(|slot| slot.as_ref())
+    }
+
+    pub fn get_mut(&mut self, handle: IdHandle) -> Option<&mut T> {
+        self.slots.get_mut(handle.index()).and_then(|slot| slot.as_mut())
+    }
+
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+
+    pub fn iter(&self) -> impl Iterator<Item = (IdHandle, &T)> {
+        self.slots.iter().enumerate().filter_map(|(index, slot)| slot.as_ref().map(|value| (IdHandle(index as u32), value)))
+    }
+
+    pub fn values(&self) -> impl Iterator<Item = &T> {
+        self.slots.iter().filter_map(|slot| slot.as_ref())
+    }
+}
+
+/// Items of a list looked up by uuid - built once for a pass over the list so that matching references to them doesn't
+/// stringify and compare uuids for every pair.
+pub struct UuidIndex<'a, T> {
+    items: HashMap<Uuid, &'a T>,
+}
+
+impl<'a, T> UuidIndex<'a, T> {
+    pub fn new<I>(items: I) -> Self where I: Iterator<Item = (Uuid, &'a T)> {
+        Self {
+            items: items.collect(),
+        }
+    }
+
+    pub fn get(&self, uuid: &Uuid) -> Option<&'a T> {
+        self.items.get(uuid).copied()
+    }
+
+    pub fn get_str(&self, uuid: &str) -> Option<&'a T> {
+        Uuid::parse_str(uuid).ok().and_then(|uuid| self.get(&uuid))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use uuid::Uuid;
+
+    use crate::id_interner::{IdInterner, IdSlotMap};
+
+    #[test]
+    fn interns_and_looks_up_by_handle() {
+        let mut interner = IdInterner::default();
+        let track_uuid = Uuid::new_v4();
+        let other_track_uuid = Uuid::new_v4();
+
+        let track = interner.intern(track_uuid);
+        let other_track = interner.intern_str(other_track_uuid.to_string().as_str()).unwrap();
+        assert_eq!(track, interner.intern(track_uuid));
+        assert_ne!(track, other_track);
+        assert_eq!(Some(other_track), interner.handle_str(other_track_uuid.to_string().as_str()));
+        assert_eq!(Some(track_uuid), interner.uuid(track));
+        assert_eq!(None, interner.handle_str("not a uuid"));
+        assert_eq!(None, interner.handle(&Uuid::new_v4()));
+
+        let mut senders = IdSlotMap::default();
+        assert_eq!(None, senders.insert(other_track, "other"));
+        assert_eq!(None, senders.get(track));
+        assert_eq!(Some(&"other"), senders.get(other_track));
+        assert_eq!(1, senders.len());
+        assert_eq!(Some("other"), senders.remove(other_track));
+        assert!(senders.is_empty());
+    }
+}
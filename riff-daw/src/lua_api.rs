@@ -1,21 +1,29 @@
-use std::sync::{Arc, Mutex};
+use std::collections::{HashMap, HashSet};
+use std::sync::Arc;
+use std::thread;
 
-use mlua::{UserData, UserDataMethods};
+use log::*;
+use mlua::{Function, Lua, MultiValue, Table, UserData, UserDataMethods, Value};
+use uuid::Uuid;
 
-use crate::{DAWEvents, DAWState, GeneralTrackType, TrackChangeType};
+use crate::{DAWEvents, GeneralTrackType, TrackChangeType};
+use crate::constants::{LUA_GLOBAL_STATE, LUA_SCRIPT_THREAD_NAME};
+use crate::domain::{DAWItemLength, DAWItemPosition, Note, TrackEvent};
 use crate::DAWEvents::TrackChange;
-use crate::Track;
+use crate::history::ScriptRiffNoteEdit;
+use crate::project_snapshot::{ProjectSnapshot, SnapshotCell};
 
 pub struct LuaState {
-    pub state: Arc<Mutex<DAWState>>,
+    pub project_snapshot: Arc<SnapshotCell<ProjectSnapshot>>,
     pub tx_from_ui: crossbeam_channel::Sender<DAWEvents>,
 }
 
 impl LuaState {
     pub fn get_first_track_name(&self) -> String {
-        match self.state.lock() {
-            Ok(state) => state.project().song().tracks().first().unwrap().name().to_string(),
-            Err(_) => String::from("xxx"),
+        // read from the snapshot so that scripts don't wait on whoever is holding the state lock
+        match self.project_snapshot.load().tracks.first() {
+            Some(track) => track.name.clone(),
+            None => String::from("xxx"),
         }
     }
 }
@@ -32,5 +40,406 @@ impl UserData for LuaState {
             }
             Ok(())
         });
+
+        // queries read the last published project snapshot - a batch's changes show up once the gui has applied them
+        _methods.add_method("tempo", |_, this, ()| Ok(this.project_snapshot.load().transport.tempo));
+        _methods.add_method("tracks", |lua, this, ()| {
+            let snapshot = this.project_snapshot.load();
+            let tracks = lua.create_table()?;
+            for (index, track) in snapshot.tracks.iter().enumerate() {
+                let riffs = lua.create_table()?;
+                for (riff_index, riff) in track.riffs.iter().enumerate() {
+                    let riff_table = lua.create_table()?;
+                    riff_table.set("uuid", riff.uuid().to_string())?;
+                    riff_table.set("name", riff.name())?;
+                    riff_table.set("length", riff.length())?;
+                    riffs.set(riff_index + 1, riff_table)?;
+                }
+                let track_table = lua.create_table()?;
+                track_table.set("uuid", track.uuid.clone())?;
+                track_table.set("name", track.name.clone())?;
+                track_table.set("riffs", riffs)?;
+                tracks.set(index + 1, track_table)?;
+            }
+            Ok(tracks)
+        });
+        _methods.add_method("riff_notes", |lua, this, (track_uuid, riff_uuid): (String, String)| {
+            let notes = lua.create_table()?;
+            for (index, note) in snapshot_riff_notes(&this.project_snapshot.load(), &track_uuid, &riff_uuid)?.iter().enumerate() {
+                notes.set(index + 1, note_to_table(lua, note)?)?;
+            }
+            Ok(notes)
+        });
+        _methods.add_method("batch", |_, this, ()| Ok(LuaBatch {
+            project_snapshot: this.project_snapshot.clone(),
+            tx_from_ui: this.tx_from_ui.clone(),
+            batch: ScriptBatch::default(),
+        }));
+    }
+}
+
+/// Everything a script batch changes - applied by the gui in one go when the script commits it: tracks first, then
+/// riffs, routings and finally the note edits. The whole batch is one undoable edit.
+#[derive(Clone, Default)]
+pub struct ScriptBatch {
+    pub tracks: Vec<(String, GeneralTrackType, Option<String>)>, // provisional track uuid, track type, name
+    pub riffs: Vec<(String, Uuid, String, f64)>,                  // track uuid, riff uuid, name, length in beats
+    pub audio_routings: Vec<(String, String)>,                    // source track uuid, destination track uuid
+    pub midi_routings: Vec<(String, String)>,                     // source track uuid, destination track uuid
+    pub note_edits: Vec<ScriptRiffNoteEdit>,                      // one per riff
+}
+
+impl ScriptBatch {
+    pub fn is_empty(&self) -> bool {
+        self.tracks.is_empty() && self.riffs.is_empty() && self.audio_routings.is_empty() && self.midi_routings.is_empty() && self.note_edits.is_empty()
+    }
+
+    /// Check the batch against the project's tracks and routings: every track it refers to has to be in the project or
+    /// be added by the batch and its routings must not make a routing cycle.
+    pub fn validate(&self, mut routing_graph: TrackRoutingGraph) -> Result<(), String> {
+        for (track_uuid, _, _) in self.tracks.iter() {
+            routing_graph.add_track(track_uuid.clone(), vec![], vec![]);
+        }
+        for (track_uuid, _, name, _) in self.riffs.iter() {
+            if !routing_graph.contains(track_uuid) {
+                return Err(format!("there is no track {} to add riff {} to", track_uuid, name));
+            }
+        }
+        for note_edit in self.note_edits.iter() {
+            if !routing_graph.contains(&note_edit.track_uuid) {
+                return Err(format!("there is no track {} to edit the notes of", note_edit.track_uuid));
+            }
+        }
+        for (source_track_uuid, destination_track_uuid) in self.audio_routings.iter() {
+            routing_graph.route_audio(source_track_uuid, destination_track_uuid)?;
+        }
+        for (source_track_uuid, destination_track_uuid) in self.midi_routings.iter() {
+            routing_graph.route_midi(source_track_uuid, destination_track_uuid)?;
+        }
+        Ok(())
+    }
+
+    /// The note edit for the riff - edits to the same riff are gathered into one.
+    fn note_edit(&mut self, track_uuid: String, riff_uuid: String) -> &mut ScriptRiffNoteEdit {
+        match self.note_edits.iter().position(|edit| edit.track_uuid == track_uuid && edit.riff_uuid == riff_uuid) {
+            Some(index) => &mut self.note_edits[index],
+            None => {
+                self.note_edits.push(ScriptRiffNoteEdit { track_uuid, riff_uuid, replacements: vec![], additions: vec![] });
+                self.note_edits.last_mut().unwrap()
+            }
+        }
+    }
+}
+
+/// The tracks in a project and the tracks each one routes audio and midi to - what a script batch is checked against.
+#[derive(Default)]
+pub struct TrackRoutingGraph {
+    audio: HashMap<String, Vec<String>>, // track uuid, destination track uuids
+    midi: HashMap<String, Vec<String>>,  // track uuid, destination track uuids
+}
+
+impl TrackRoutingGraph {
+    pub fn from_snapshot(project_snapshot: &ProjectSnapshot) -> Self {
+        let mut routing_graph = Self::default();
+        for track in project_snapshot.tracks.iter() {
+            routing_graph.add_track(track.uuid.clone(), track.audio_routing_destinations.clone(), track.midi_routing_destinations.clone());
+        }
+        routing_graph
+    }
+
+    pub fn add_track(&mut self, track_uuid: String, audio_destinations: Vec<String>, midi_destinations: Vec<String>) {
+        self.audio.insert(track_uuid.clone(), audio_destinations);
+        self.midi.insert(track_uuid, midi_destinations);
+    }
+
+    pub fn contains(&self, track_uuid: &str) -> bool {
+        self.audio.contains_key(track_uuid)
+    }
+
+    pub fn route_audio(&mut self, source_track_uuid: &str, destination_track_uuid: &str) -> Result<(), String> {
+        Self::route(&mut self.audio, "audio", source_track_uuid, destination_track_uuid)
+    }
+
+    pub fn route_midi(&mut self, source_track_uuid: &str, destination_track_uuid: &str) -> Result<(), String> {
+        Self::route(&mut self.midi, "midi", source_track_uuid, destination_track_uuid)
+    }
+
+    fn route(routings: &mut HashMap<String, Vec<String>>, kind: &str, source_track_uuid: &str, destination_track_uuid: &str) -> Result<(), String> {
+        for track_uuid in [source_track_uuid, destination_track_uuid] {
+            if !routings.contains_key(track_uuid) {
+                return Err(format!("there is no track {} to route {} between", track_uuid, kind));
+            }
+        }
+        if Self::reaches(routings, destination_track_uuid, source_track_uuid) {
+            return Err(format!("routing {} from {} to {} would make a routing cycle", kind, source_track_uuid, destination_track_uuid));
+        }
+        if let Some(destinations) = routings.get_mut(source_track_uuid) {
+            destinations.push(destination_track_uuid.to_string());
+        }
+        Ok(())
+    }
+
+    /// Whether the track's routings lead, directly or through other tracks, to the target track.
+    fn reaches(routings: &HashMap<String, Vec<String>>, track_uuid: &str, target_track_uuid: &str) -> bool {
+        let mut visited = HashSet::new();
+        let mut to_visit = vec![track_uuid];
+        while let Some(track_uuid) = to_visit.pop() {
+            if track_uuid == target_track_uuid {
+                return true;
+            }
+            if visited.insert(track_uuid) {
+                if let Some(destinations) = routings.get(track_uuid) {
+                    to_visit.extend(destinations.iter().map(|destination| destination.as_str()));
+                }
+            }
+        }
+        false
+    }
+}
+
+/// A batch being built by a script. Nothing is sent to the gui until commit so that a script can generate thousands
+/// of notes without the state being locked for each of them. Tracks added by the batch get provisional uuids that
+/// can be used for riffs and routings in the same batch.
+pub struct LuaBatch {
+    project_snapshot: Arc<SnapshotCell<ProjectSnapshot>>,
+    tx_from_ui: crossbeam_channel::Sender<DAWEvents>,
+    batch: ScriptBatch,
+}
+
+impl UserData for LuaBatch {
+    fn add_methods<'lua, M: UserDataMethods<'lua, Self>>(methods: &mut M) {
+        methods.add_method_mut("add_track", |_, this, (track_type, name): (String, Option<String>)| {
+            let track_type = match track_type.as_str() {
+                "instrument" => GeneralTrackType::InstrumentTrack,
+                "audio" => GeneralTrackType::AudioTrack,
+                "midi" => GeneralTrackType::MidiTrack,
+                _ => return Err(mlua::Error::RuntimeError(format!("unknown track type: {} - expected instrument, audio or midi", track_type))),
+            };
+            let track_uuid = Uuid::new_v4().to_string();
+            this.batch.tracks.push((track_uuid.clone(), track_type, name));
+            Ok(track_uuid)
+        });
+        methods.add_method_mut("add_riff", |_, this, (track_uuid, name, length): (String, String, f64)| {
+            let riff_uuid = Uuid::new_v4();
+            this.batch.riffs.push((track_uuid, riff_uuid, name, length));
+            Ok(riff_uuid.to_string())
+        });
+        methods.add_method_mut("route_audio", |_, this, (source_track_uuid, destination_track_uuid): (String, String)| {
+            this.batch.audio_routings.push((source_track_uuid, destination_track_uuid));
+            Ok(())
+        });
+        methods.add_method_mut("route_midi", |_, this, (source_track_uuid, destination_track_uuid): (String, String)| {
+            this.batch.midi_routings.push((source_track_uuid, destination_track_uuid));
+            Ok(())
+        });
+        // notes are tables of position, note, velocity and length - velocity defaults to 127 and length to a beat
+        methods.add_method_mut("add_notes", |_, this, (track_uuid, riff_uuid, notes): (String, String, Table)| {
+            let notes = notes.sequence_values::<Table>().map(|note| note.and_then(|note| table_to_note(&note, None))).collect::<mlua::Result<Vec<Note>>>()?;
+            let count = notes.len();
+            this.batch.note_edit(track_uuid, riff_uuid).additions.extend(notes);
+            Ok(count)
+        });
+        // calls the function with each of the riff's notes - it returns a changed note table, false to remove the note
+        // or nil to leave it as it is. Returns how many notes were changed or removed.
+        methods.add_method_mut("transform_notes", |lua, this, (track_uuid, riff_uuid, transform): (String, String, Function)| {
+            let notes = snapshot_riff_notes(&this.project_snapshot.load(), &track_uuid, &riff_uuid)?;
+            let mut replacements = vec![];
+            for note in notes.into_iter() {
+                match transform.call::<_, Value>(note_to_table(lua, &note)?)? {
+                    Value::Table(edited_note) => replacements.push((note, Some(table_to_note(&edited_note, Some(&note))?))),
+                    Value::Boolean(false) => replacements.push((note, None)),
+                    _ => (),
+                }
+            }
+            let count = replacements.len();
+            this.batch.note_edit(track_uuid, riff_uuid).replacements.extend(replacements);
+            Ok(count)
+        });
+        // checked against the snapshot here so that the script gets the error - the gui checks again when applying it
+        methods.add_method_mut("commit", |_, this, ()| {
+            let batch = std::mem::take(&mut this.batch);
+            if let Err(error) = batch.validate(TrackRoutingGraph::from_snapshot(&this.project_snapshot.load())) {
+                return Err(mlua::Error::RuntimeError(format!("the batch was not committed: {}", error)));
+            }
+            if !batch.is_empty() {
+                if let Err(error) = this.tx_from_ui.send(DAWEvents::ScriptBatch(batch)) {
+                    return Err(mlua::Error::RuntimeError(format!("could not send the batch: {}", error)));
+                }
+            }
+            Ok(())
+        });
+    }
+}
+
+fn snapshot_riff_notes(project_snapshot: &ProjectSnapshot, track_uuid: &str, riff_uuid: &str) -> mlua::Result<Vec<Note>> {
+    let riff = project_snapshot.tracks.iter()
+        .find(|track| track.uuid == track_uuid)
+        .and_then(|track| track.riffs.iter().find(|riff| riff.uuid().to_string() == riff_uuid));
+    match riff {
+        Some(riff) => Ok(riff.events().iter().filter_map(|event| match event {
+            TrackEvent::Note(note) => Some(*note),
+            _ => None,
+        }).collect()),
+        None => Err(mlua::Error::RuntimeError(format!("no riff {} on track {}", riff_uuid, track_uuid))),
+    }
+}
+
+fn note_to_table<'lua>(lua: &'lua Lua, note: &Note) -> mlua::Result<Table<'lua>> {
+    let table = lua.create_table()?;
+    table.set("position", note.position())?;
+    table.set("note", note.note())?;
+    table.set("velocity", note.velocity())?;
+    table.set("length", note.length())?;
+    Ok(table)
+}
+
+/// A note from a table - anything missing is taken from the original note if there is one.
+fn table_to_note(table: &Table, original: Option<&Note>) -> mlua::Result<Note> {
+    let mut note = original.copied().unwrap_or_else(|| Note::new_with_params(0.0, 60, 127, 1.0));
+    if let Some(position) = table.get::<_, Option<f64>>("position")? {
+        note.set_position(position.max(0.0));
+    }
+    else if original.is_none() {
+        return Err(mlua::Error::RuntimeError("a note needs a position".to_string()));
+    }
+    if let Some(note_number) = table.get::<_, Option<i32>>("note")? {
+        note.set_note(note_number.clamp(0, 127));
+    }
+    if let Some(velocity) = table.get::<_, Option<i32>>("velocity")? {
+        note.set_velocity(velocity.clamp(0, 127));
+    }
+    if let Some(length) = table.get::<_, Option<f64>>("length")? {
+        note.set_length(length.max(0.0));
+    }
+    Ok(note)
+}
+
+pub fn format_lua_values(values: &MultiValue) -> String {
+    values
+        .iter()
+        .map(|value| {
+            match value {
+                Value::Nil => "Nil".to_string(),
+                Value::Boolean(data) => format!("{}", data),
+                Value::LightUserData(_data) => "LightUserData".to_string(),
+                Value::Integer(data) => format!("{}", data),
+                Value::Number(data) => format!("{}", data),
+                Value::String(data) => data.to_str().unwrap_or_default().to_string(),
+                Value::Table(_data) => "Table".to_string(),
+                Value::Function(_data) => "Function".to_string(),
+                Value::Thread(_data) => "Thread".to_string(),
+                Value::UserData(_data) => "AnyUserData".to_string(),
+                Value::Error(data) => format!("{:?}", data),
+                _ => "".to_string(),
+            }
+        })
+        .collect::<Vec<_>>()
+        .join("\t")
+}
+
+/// Runs scripts one at a time on their own thread with their own Lua so that a long script doesn't hold up the gui.
+/// What a script returns, or the error it failed with, comes back as DAWEvents::LuaScriptOutput.
+pub struct LuaScriptRunner {
+    tx_script: crossbeam_channel::Sender<String>,
+}
+
+impl LuaScriptRunner {
+    pub fn new(project_snapshot: Arc<SnapshotCell<ProjectSnapshot>>, tx_from_ui: crossbeam_channel::Sender<DAWEvents>) -> Self {
+        let (tx_script, rx_script) = crossbeam_channel::unbounded::<String>();
+
+        let _ = thread::Builder::new().name(LUA_SCRIPT_THREAD_NAME.to_string()).spawn(move || {
+            let lua = Lua::new();
+            let _ = lua.globals().set(LUA_GLOBAL_STATE, LuaState { project_snapshot, tx_from_ui: tx_from_ui.clone() });
+
+            for script in rx_script.iter() {
+                let output = match lua.load(script.as_str()).eval::<MultiValue>() {
+                    Ok(values) => format_lua_values(&values),
+                    Err(error) => format!("{}", error),
+                };
+                match tx_from_ui.send(DAWEvents::LuaScriptOutput(output)) {
+                    Ok(_) => (),
+                    Err(error) => info!("Lua script runner: could not send the script output: {:?}", error),
+                }
+            }
+        });
+
+        Self {
+            tx_script,
+        }
+    }
+
+    pub fn run(&self, script: String) {
+        match self.tx_script.send(script) {
+            Ok(_) => (),
+            Err(error) => info!("Lua script runner: could not queue the script: {:?}", error),
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::sync::Arc;
+
+    use mlua::Lua;
+
+    use crate::constants::LUA_GLOBAL_STATE;
+    use crate::DAWEvents;
+    use crate::lua_api::LuaState;
+    use crate::project_snapshot::SnapshotCell;
+
+    #[test]
+    fn a_batch_is_sent_as_one_event_when_it_is_committed() {
+        let (tx_from_ui, rx_from_ui) = crossbeam_channel::unbounded();
+        let lua = Lua::new();
+        lua.globals().set(LUA_GLOBAL_STATE, LuaState { project_snapshot: Arc::new(SnapshotCell::default()), tx_from_ui }).unwrap();
+
+        lua.load(r#"
+            local batch = state:batch()
+            local lead = batch:add_track("instrument", "Lead")
+            local riff = batch:add_riff(lead, "Arpeggio", 16)
+            local notes = {}
+            for i = 1, 1000 do
+                notes[i] = { position = (i - 1) * 0.25, note = 60 + i % 12, length = 0.25 }
+            end
+            batch:add_notes(lead, riff, notes)
+            local bus = batch:add_track("audio", "Reverb bus")
+            batch:route_audio(lead, bus)
+            batch:commit()
+        "#).exec().unwrap();
+
+        match rx_from_ui.try_recv() {
+            Ok(DAWEvents::ScriptBatch(batch)) => {
+                assert_eq!(2, batch.tracks.len());
+                assert_eq!(batch.tracks[0].0, batch.riffs[0].0);
+                assert_eq!(1, batch.note_edits.len());
+                assert_eq!(1000, batch.note_edits[0].additions.len());
+                assert_eq!((batch.tracks[0].0.clone(), batch.tracks[1].0.clone()), batch.audio_routings[0]);
+            }
+            _ => panic!("expected the committed batch"),
+        }
+        assert!(rx_from_ui.try_recv().is_err());
+    }
+
+    #[test]
+    fn a_batch_with_unknown_tracks_or_routing_cycles_is_not_committed() {
+        let (tx_from_ui, rx_from_ui) = crossbeam_channel::unbounded();
+        let lua = Lua::new();
+        lua.globals().set(LUA_GLOBAL_STATE, LuaState { project_snapshot: Arc::new(SnapshotCell::default()), tx_from_ui }).unwrap();
+
+        assert!(lua.load(r#"
+            local batch = state:batch()
+            local lead = batch:add_track("instrument", "Lead")
+            batch:route_audio(lead, "reverb bus")
+            batch:commit()
+        "#).exec().is_err());
+        assert!(lua.load(r#"
+            local batch = state:batch()
+            local lead = batch:add_track("instrument", "Lead")
+            local bus = batch:add_track("audio", "Bus")
+            batch:route_audio(lead, bus)
+            batch:route_audio(bus, lead)
+            batch:commit()
+        "#).exec().is_err());
+        assert!(rx_from_ui.try_recv().is_err());
     }
 }
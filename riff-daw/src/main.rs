@@ -1,19 +1,19 @@
-use std::{collections::HashMap, default::Default, sync::{Arc, Mutex}, time::Duration};
+use std::{collections::HashMap, default::Default, sync::{Arc, Mutex}, time::{Duration, Instant}};
 use std::thread;
 
 use apres::MIDI;
-use constants::{TRACK_VIEW_TRACK_PANEL_HEIGHT, LUA_GLOBAL_STATE, VST_PATH_ENVIRONMENT_VARIABLE_NAME, CLAP_PATH_ENVIRONMENT_VARIABLE_NAME, DAW_AUTO_SAVE_THREAD_NAME};
-use crossbeam_channel::{Receiver, Sender, unbounded};
+use constants::{GUI_PUMP_MAX_EVENTS_PER_WAKE, GUI_REFRESH_INTERVAL_IN_MILLISECONDS, PLUGIN_SANDBOX_ARGUMENT, PROGRESS_BAR_PULSE_INTERVAL_IN_MILLISECONDS, TRACK_VIEW_TRACK_PANEL_HEIGHT, VST_PATH_ENVIRONMENT_VARIABLE_NAME, CLAP_PATH_ENVIRONMENT_VARIABLE_NAME, DAW_AUTO_SAVE_THREAD_NAME, AUDIO_LAYER_COMMAND_QUEUE_CAPACITY, AUTOSAVE_INTERVAL_IN_SECONDS, AUTOSAVE_PRESET_DATA_WAIT_IN_SECONDS, MIXER_BLADE_TELEMETRY_REFRESH_INTERVAL_IN_MILLISECONDS, TELEMETRY_EXPORT_THREAD_NAME, HEADLESS_RENDER_ARGUMENT};
+use crossbeam_channel::{bounded, Receiver, Sender, unbounded};
 use flexi_logger::{Logger, FileSpec, WriteMode};
-use gtk::{Adjustment, ButtonsType, ComboBoxText, DrawingArea, Frame, glib, MessageDialog, MessageType, prelude::{ActionableExt, ActionMapExt, AdjustmentExt, ApplicationExt, Cast, ComboBoxExtManual, ComboBoxTextExt, ContainerExt, DialogExt, EntryExt, GtkWindowExt, LabelExt, ProgressBarExt, ScrolledWindowExt, SpinButtonExt, TextBufferExt, TextViewExt, ToggleToolButtonExt, WidgetExt}, SpinButton, Window, WindowType};
+use gtk::{Adjustment, ButtonsType, ComboBoxText, DrawingArea, Frame, glib, Label, MessageDialog, MessageType, prelude::{ActionableExt, ActionMapExt, AdjustmentExt, ApplicationExt, Cast, ComboBoxExtManual, ComboBoxTextExt, ContainerExt, DialogExt, EntryExt, GtkWindowExt, LabelExt, ProgressBarExt, ScrolledWindowExt, SpinButtonExt, TextBufferExt, TextViewExt, ToggleToolButtonExt, WidgetExt}, SpinButton, Window, WindowType};
 use jack::MidiOut;
 use log::*;
-use mlua::{Lua, MultiValue, Value};
 use simple_clap_host_helper_lib::plugin::library::PluginLibrary;
 use uuid::Uuid;
 use vst::host::PluginLoader;
 use vst::api::TimeInfo;
 
+use riff_daw::{audio, audio_plugin_util, constants, domain, dsp, event, headless, history, lua_api, plugin_sandbox, state, telemetry, ui};
 use audio::JackNotificationHandler;
 use audio_plugin_util::*;
 use domain::*;
@@ -23,20 +23,15 @@ use lua_api::*;
 use state::*;
 use ui::*;
 
-use crate::{grid::Grid, utils::DAWUtils};
-use crate::audio::Audio;
-
-mod constants;
-mod domain;
-mod ui;
-mod state;
-mod event;
-mod audio;
-mod grid;
-mod utils;
-mod audio_plugin_util;
-mod history;
-mod lua_api;
+use riff_daw::{grid::Grid, utils::DAWUtils};
+use riff_daw::audio::Audio;
+use riff_daw::autosave::Autosaver;
+use riff_daw::gui_pump::{CoalescedGuiUpdates, GuiPump};
+use riff_daw::telemetry::{telemetry, TelemetryConfiguration};
+
+#[cfg(feature = "rt_alloc_check")]
+#[global_allocator]
+static GLOBAL_ALLOCATOR: riff_daw::rt_alloc_check::RealTimeAllocationCheckAllocator = riff_daw::rt_alloc_check::RealTimeAllocationCheckAllocator;
 
 extern {
     fn gdk_x11_window_get_xid(window: gdk::Window) -> u32;
@@ -62,6 +57,33 @@ fn main() {
         None
     };
 
+    // started to host a sandboxed plugin rather than as the DAW - see plugin_sandbox.rs
+    let arguments: Vec<String> = std::env::args().collect();
+    if arguments.len() == 4 && arguments[1] == PLUGIN_SANDBOX_ARGUMENT {
+        match plugin_sandbox::run_plugin_sandbox(arguments[2].as_str(), arguments[3].as_str()) {
+            Ok(_) => info!("Plugin sandbox finished."),
+            Err(error) => info!("Plugin sandbox failed: {:?}", error),
+        }
+        return;
+    }
+
+    // detect the instruction set for the dsp kernels here rather than on the jack thread
+    info!("DSP kernels using: {:?}", dsp::simd_level());
+    // and create the telemetry so that the jack thread only ever records into it
+    let _ = telemetry();
+
+    // started to render projects from the command line without the gui or jack - see headless.rs
+    if arguments.len() > 1 && arguments[1] == HEADLESS_RENDER_ARGUMENT {
+        let rendered = match headless::parse_render_arguments(&arguments[2..]) {
+            Ok(options) => headless::run_headless_render(options),
+            Err(error) => {
+                eprintln!("{}\n{}", error, headless::HEADLESS_RENDER_USAGE);
+                false
+            }
+        };
+        std::process::exit(if rendered { 0 } else { 1 });
+    }
+
     // VST timing
     let vst_host_time_info = Arc::new(parking_lot::RwLock::new(TimeInfo {
         sample_pos: 0.0,
@@ -81,7 +103,7 @@ fn main() {
     }));
 
     let (tx_from_ui, rx_from_ui) = unbounded::<DAWEvents>();
-    let (tx_to_audio, rx_to_audio) = unbounded::<AudioLayerInwardEvent>();
+    let (tx_to_audio, rx_to_audio) = bounded::<AudioLayerInwardEvent>(AUDIO_LAYER_COMMAND_QUEUE_CAPACITY);
     let (jack_midi_sender, jack_midi_receiver) = unbounded::<AudioLayerOutwardEvent>();
 
     let state = {
@@ -91,8 +113,8 @@ fn main() {
 
     let mut audio_plugin_windows: HashMap<String, Window> = HashMap::new();
 
-    let lua = Lua::new();
-    let _ = lua.globals().set(LUA_GLOBAL_STATE, LuaState {state: state.clone(), tx_from_ui: tx_from_ui.clone()});
+    let project_snapshot = state.lock().map(|state| state.project_snapshot()).unwrap_or_default();
+    let lua_script_runner = LuaScriptRunner::new(project_snapshot, tx_from_ui.clone());
 
     gtk::init().expect("Problem starting up GTK3.");
 
@@ -101,6 +123,9 @@ fn main() {
         let state = state.clone();
         MainWindow::new(tx_from_ui, state)
     };
+    if let Ok(state) = state.lock() {
+        state.publish_project_snapshot();
+    }
 
     if let Some(application) = gui.ui.wnd_main.application() {
         application.connect_startup(build_ui);
@@ -120,48 +145,38 @@ fn main() {
 
     set_up_initial_project_in_ui(&tx_to_audio, &track_audio_coast, &mut gui, tx_from_ui.clone(), state.clone(), vst_host_time_info.clone());
 
-    // scan for audio plugins
+    // scan for audio plugins - only new and changed plugin binaries are checked so this is quick once the database is built
     {
         if let Ok(vst_path) = std::env::var(VST_PATH_ENVIRONMENT_VARIABLE_NAME) {
             if let Ok(clap_path) = std::env::var(CLAP_PATH_ENVIRONMENT_VARIABLE_NAME) {
+                // don't hold the state lock while the checkers run
+                let mut plugin_database = match state.lock() {
+                    Ok(state) => state.configuration.plugin_database.clone(),
+                    Err(_) => PluginDatabase::default(),
+                };
+                let (instruments, effects) = scan_for_audio_plugins(vst_path, clap_path, &mut plugin_database);
+
                 match state.lock() {
                     Ok(mut state) => {
-                        if state.configuration.scanned_vst_instrument_plugins.successfully_scanned.is_empty() && state.configuration.scanned_vst_effect_plugins.successfully_scanned.is_empty() {
-                            let (instruments, effects) = scan_for_audio_plugins(vst_path.clone(), clap_path.clone());
-                            for (key, value) in instruments.iter() {
-                                state.vst_instrument_plugins_mut().insert(key.to_string(), value.to_string());
-                                state.configuration.scanned_vst_instrument_plugins.successfully_scanned.insert(key.to_string(), value.to_string());
-                            }
-                            state.vst_instrument_plugins_mut().sort_by(|_key1, value1: &String, _key2, value2: &String| value1.cmp(value2));
-
-                            for (key, value) in effects.iter() {
-                                state.vst_effect_plugins_mut().insert(key.to_string(), value.to_string());
-                                state.configuration.scanned_vst_effect_plugins.successfully_scanned.insert(key.to_string(), value.to_string());
-                            }
-                            state.vst_effect_plugins_mut().sort_by(|_key1, value1: &String, _key2, value2: &String| value1.cmp(value2));
+                        state.configuration.plugin_database = plugin_database;
+                        state.configuration.scanned_vst_instrument_plugins.successfully_scanned.clear();
+                        state.configuration.scanned_vst_effect_plugins.successfully_scanned.clear();
+                        state.vst_instrument_plugins_mut().clear();
+                        state.vst_effect_plugins_mut().clear();
 
-                            state.configuration.save();
+                        for (key, value) in instruments.iter() {
+                            state.vst_instrument_plugins_mut().insert(key.to_string(), value.to_string());
+                            state.configuration.scanned_vst_instrument_plugins.successfully_scanned.insert(key.to_string(), value.to_string());
                         }
-                        else {
-                            let mut intermediate_map = HashMap::new();
-                            for (key, value) in state.configuration.scanned_vst_instrument_plugins.successfully_scanned.iter() {
-                                intermediate_map.insert(key.to_string(), value.to_string());
-                            }
-                            for (key, value) in intermediate_map.iter() {
-                                state.vst_instrument_plugins_mut().insert(key.to_string(), value.to_string());
-                            }
-                            state.vst_instrument_plugins_mut().sort_by(|_key1, value1: &String, _key2, value2: &String| value1.cmp(value2));
+                        state.vst_instrument_plugins_mut().sort_by(|_key1, value1: &String, _key2, value2: &String| value1.cmp(value2));
 
-                            intermediate_map.clear();
-                            for (key, value) in state.configuration.scanned_vst_effect_plugins.successfully_scanned.iter() {
-                                intermediate_map.insert(key.to_string(), value.to_string());
-                            }
-                            for (key, value) in intermediate_map.iter() {
-                                state.vst_effect_plugins_mut().insert(key.to_string(), value.to_string());
-                            }
-                            state.vst_effect_plugins_mut().sort_by(|_key1, value1: &String, _key2, value2: &String| value1.cmp(value2));
+                        for (key, value) in effects.iter() {
+                            state.vst_effect_plugins_mut().insert(key.to_string(), value.to_string());
+                            state.configuration.scanned_vst_effect_plugins.successfully_scanned.insert(key.to_string(), value.to_string());
                         }
+                        state.vst_effect_plugins_mut().sort_by(|_key1, value1: &String, _key2, value2: &String| value1.cmp(value2));
 
+                        state.configuration.save();
                         gui.update_available_audio_plugins_in_ui(state.vst_instrument_plugins(), state.vst_effect_plugins());
                     }
                     Err(_) => {}
@@ -174,13 +189,31 @@ fn main() {
         let state = state.clone();
         let autosave_keep_alive = autosave_keep_alive.clone();
         let _ = std::thread::Builder::new().name(DAW_AUTO_SAVE_THREAD_NAME.to_string()).spawn(move || {
+            let mut autosaver = Autosaver::new();
             loop {
+                // the presets come back through the gui event pump so the lock is only held to ask for them
                 if let Ok(mut state) = state.lock() {
                     if !state.playing() {
-                        state.autosave();
+                        state.request_presets_from_all_tracks();
+                    }
+                }
+                std::thread::sleep(Duration::from_secs(AUTOSAVE_PRESET_DATA_WAIT_IN_SECONDS));
+                let snapshot = match state.lock() {
+                    Ok(mut state) => if !state.playing() {
+                        Some(state.autosave_snapshot())
+                    } else {
+                        None
+                    },
+                    Err(_) => None,
+                };
+                // serialisation, compression and file io happen without holding the lock
+                if let Some((project_path, project)) = snapshot {
+                    match autosaver.autosave(project_path, &project) {
+                        Ok(_) => (),
+                        Err(error) => info!("Autosave failed: {}", error),
                     }
                 }
-                std::thread::sleep(Duration::from_secs(300));
+                std::thread::sleep(Duration::from_secs(AUTOSAVE_INTERVAL_IN_SECONDS));
                 if let Ok(keep_alive) = autosave_keep_alive.lock() {
                     if !*keep_alive {
                         break;
@@ -190,43 +223,70 @@ fn main() {
         });
     }
 
-    // handle incoming events in the gui thread - lots of ui interaction
+    // write the processing telemetry out for monitoring if asked to
+    {
+        let (telemetry_configuration, project_snapshot) = match state.lock() {
+            Ok(state) => (state.configuration.telemetry.clone(), Some(state.project_snapshot())),
+            Err(_) => (TelemetryConfiguration::default(), None),
+        };
+        if let (Some(export_path), Some(project_snapshot)) = (telemetry_configuration.export_path, project_snapshot) {
+            let export_interval = Duration::from_secs(telemetry_configuration.export_interval_in_seconds.max(1));
+            let _ = std::thread::Builder::new().name(TELEMETRY_EXPORT_THREAD_NAME.to_string()).spawn(move || {
+                loop {
+                    std::thread::sleep(export_interval);
+                    // names come from the published snapshot so the state lock isn't needed
+                    let snapshot = telemetry().snapshot(project_snapshot.load().tracks.as_slice());
+                    match telemetry::export_telemetry(&snapshot, export_path.as_str()) {
+                        Ok(_) => (),
+                        Err(error) => info!("Telemetry export to {} failed: {}", export_path, error),
+                    }
+                }
+            });
+        }
+    }
+
+    // handle incoming events in the gui thread - lots of ui interaction. The main loop is only woken when there is something to handle.
     {
         let mut state = state.clone();
-        let mut delay_count = 0;
-        let mut progress_bar_pulse_delay_count = 0;
         let rx_to_audio = rx_to_audio.clone();
         let jack_midi_sender = jack_midi_sender.clone();
         let vst_host_time_info = vst_host_time_info.clone();
+        let mut live_midi_input_track = None;
+        let mut coalesced_gui_updates = CoalescedGuiUpdates::default();
+        let (tx_gui_wake, rx_gui_wake) = glib::MainContext::channel::<()>(glib::PRIORITY_DEFAULT);
+        let mut gui_pump = GuiPump::start(jack_midi_receiver.clone(), rx_from_ui.clone(), tx_gui_wake);
 
+        start_progress_dialogue_pulse(&gui);
 
-        glib::idle_add_local(move || {
-            process_jack_events(
-                &tx_from_ui,
-                &jack_midi_receiver,
-                &mut state,
-                &tx_to_audio,
-                &rx_to_audio,
-                &jack_midi_sender,
-                &track_audio_coast,
-                &mut gui,
-                &vst_host_time_info,
-                &mut recorded_playing_notes,
-            );
-            process_track_background_processor_events(
-                &mut audio_plugin_windows,
-                &mut state,
-                &mut gui,
-            );
-            do_progress_dialogue_pulse(&mut gui, &mut progress_bar_pulse_delay_count);
-
-            if delay_count > 1000 {
-                delay_count = 0;
-                process_application_events(
+        rx_gui_wake.attach(None, move |_| {
+            let mut events_handled = 0;
+            loop {
+                let mut handled = process_jack_events(
+                    &tx_from_ui,
+                    &jack_midi_receiver,
+                    &mut state,
+                    &tx_to_audio,
+                    &rx_to_audio,
+                    &jack_midi_sender,
+                    &track_audio_coast,
+                    &mut gui,
+                    &vst_host_time_info,
+                    &mut recorded_playing_notes,
+                    &mut coalesced_gui_updates,
+                    &mut live_midi_input_track,
+                );
+                handled |= process_track_background_processor_events(
+                    &mut audio_plugin_windows,
+                    &mut state,
+                    &mut gui,
+                    &mut gui_pump,
+                    &mut coalesced_gui_updates,
+                );
+                handled |= process_application_events(
                     &mut history_manager, 
                     tx_from_ui.clone(),
                     &mut audio_plugin_windows,
-                    &lua,
+                    &lua_script_runner,
                     &mut gui,
                     vst24_plugin_loaders.clone(),
                     clap_plugin_loaders.clone(),
@@ -236,10 +296,21 @@ fn main() {
                     tx_to_audio.clone(),
                     vst_host_time_info.clone(),
                 );
+
+                events_handled += 1;
+                if !handled || events_handled >= GUI_PUMP_MAX_EVENTS_PER_WAKE {
+                    break;
+                }
             }
-            else {
-                delay_count += 1;
+            // the painters read the project from the snapshot rather than taking the state lock
+            if let Ok(state) = state.lock() {
+                state.publish_project_snapshot();
             }
+            update_live_midi_input_track(&state, &tx_to_audio, &mut live_midi_input_track);
+            if !coalesced_gui_updates.is_empty() && gui_pump.refresh_due() {
+                apply_coalesced_gui_updates(&mut gui, &mut state, &mut coalesced_gui_updates);
+            }
+            gui_pump.drained();
 
             glib::Continue(true)
         });
@@ -324,10 +395,52 @@ fn set_up_initial_project_in_ui(tx_to_audio: &Sender<AudioLayerInwardEvent>,
     };
 }
 
+/// Add a track to the state and the gui and start processing it.
+fn add_track(
+    state: &mut DAWState,
+    state_arc: Arc<Mutex<DAWState>>,
+    gui: &mut MainWindow,
+    track_change_track_type: GeneralTrackType,
+    tx_from_ui: Sender<DAWEvents>,
+    track_processing_context: &TrackProcessingContext,
+) {
+    let midi_devices = match track_change_track_type {
+        GeneralTrackType::MidiTrack => Some(state.midi_devices()),
+        _ => None,
+    };
+    if let Some(track_uuid) = state.add_new_track(track_change_track_type.clone(), None, None, track_processing_context) {
+        if let Some(track) = state.project().song().tracks().iter().find(|track| track.uuid().to_string() == track_uuid) {
+            gui.add_track(track.name(), track.uuid(), tx_from_ui, state_arc, track_change_track_type, midi_devices, track.volume(), track.pan(), false, false);
+        }
+        info!("Added a track to the state.");
+    }
+    gui.update_available_audio_plugins_in_ui(state.vst_instrument_plugins(), state.vst_effect_plugins());
+}
+
+/// Apply the changes a script committed as one undoable edit - see ScriptBatchAction. A batch that refers to tracks
+/// that don't exist or that would make a routing cycle is not applied at all and the script console is told why.
+fn apply_script_batch(
+    batch: ScriptBatch,
+    history_manager: &mut Arc<Mutex<HistoryManager>>,
+    state: &mut Arc<Mutex<DAWState>>,
+    tx_from_ui: Sender<DAWEvents>,
+    track_processing_context: TrackProcessingContext,
+) {
+    match history_manager.lock() {
+        Ok(mut history) => {
+            if let Err(error) = history.apply(state, Box::new(ScriptBatchAction::new(batch, track_processing_context))) {
+                error!("Main - script batch - error: {}", error);
+                let _ = tx_from_ui.send(DAWEvents::LuaScriptOutput(format!("The batch was not applied: {}", error)));
+            }
+        }
+        Err(error) => error!("Main - script batch - error getting lock for history manager: {}", error),
+    }
+}
+
 fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                               tx_from_ui: Sender<DAWEvents>,
                               audio_plugin_windows: &mut HashMap<String, Window>,
-                              lua: &Lua,
+                              lua_script_runner: &LuaScriptRunner,
                               gui: &mut MainWindow,
                               vst24_plugin_loaders: Arc<Mutex<HashMap<String, PluginLoader<VstHost>>>>,
                               clap_plugin_loaders: Arc<Mutex<HashMap<String, PluginLibrary>>>,
@@ -336,7 +449,7 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                               state: &mut Arc<Mutex<DAWState>>,
                               tx_to_audio: Sender<AudioLayerInwardEvent>,
                               vst_host_time_info: Arc<parking_lot::RwLock<TimeInfo>>,
-) {
+) -> bool {
     match rx_from_ui.try_recv() {
         Ok(event) => match event {
             DAWEvents::NewFile => {
@@ -359,9 +472,9 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                             state.send_to_track_background_processor(current_track_uuid.to_string(), TrackBackgroundProcessorInwardEvent::Kill);
 
                             // remove the consumer from the audio layer
-                            match tx_to_audio.send(AudioLayerInwardEvent::RemoveTrack(current_track_uuid.to_string())) {
+                            match tx_to_audio.try_send(AudioLayerInwardEvent::RemoveTrack(current_track_uuid.to_string())) {
                                 Ok(_) => (),
-                                Err(error) => info!("Problem using tx_to_audio to send remove track consumer message to jack layer: {}", error),
+                                Err(error) => error!("Problem using tx_to_audio to send remove track consumer message to jack layer: {}", error),
                             }
                         }
 
@@ -403,18 +516,11 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                             }
                         }
                         gui.ui.track_drawing_area.queue_draw();
-                        match tx_to_audio.send(AudioLayerInwardEvent::BlockSize(state.project().song().block_size())) {
-                            Ok(_) => (),
-                            Err(error) => info!("Problem using tx_to_audio to send block size message to jack layer: {}", error),
-                        }
-                        match tx_to_audio.send(AudioLayerInwardEvent::Tempo(state.project().song().tempo())) {
-                            Ok(_) => (),
-                            Err(error) => info!("Problem using tx_to_audio to send tempo message to jack layer: {}", error),
-                        }
-                        match tx_to_audio.send(AudioLayerInwardEvent::SampleRate(state.project().song().sample_rate())) {
+                        match tx_to_audio.try_send(AudioLayerInwardEvent::Tempo(state.project().song().tempo())) {
                             Ok(_) => (),
-                            Err(error) => info!("Problem using tx_to_audio to send sample rate message to jack layer: {}", error),
+                            Err(error) => error!("Problem using tx_to_audio to send tempo message to jack layer: {}", error),
                         }
+                        state.update_song_audio_format();
                     },
                     Err(_) => info!("Main - rx_ui processing loop - New File - could not get lock on state"),
                 }
@@ -432,6 +538,19 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                 let vst24_plugin_loaders = vst24_plugin_loaders;
                 let tx_from_ui = tx_from_ui;
                 thread::spawn(move || {
+                    // read the project before touching the current one - if it can't be read the current project stays
+                    // loaded and is still saved to its own file
+                    let project = match DAWState::read_project_from_file(path.to_str().unwrap()) {
+                        Ok(project) => project,
+                        Err(error) => {
+                            error!("Main - rx_ui processing loop - Open File - could not read {:?}: {:?}", path, error);
+                            let _ = tx_from_ui.send(DAWEvents::Notification(NotificationType::Error, format!("Could not open {}: {}", path.to_string_lossy(), error)));
+                            let _ = tx_from_ui.send(DAWEvents::UpdateUI);
+                            let _ = tx_from_ui.send(DAWEvents::HideProgressDialogue);
+                            return;
+                        }
+                    };
+
                     if let Ok(mut coast) = track_audio_coast.lock() {
                         *coast = TrackBackgroundProcessorMode::Coast;
                     }
@@ -454,14 +573,15 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                                 state.send_to_track_background_processor(current_track_uuid.to_string(), TrackBackgroundProcessorInwardEvent::Kill);
 
                                 // remove the consumer from the audio layer
-                                match tx_to_audio.send(AudioLayerInwardEvent::RemoveTrack(current_track_uuid.to_string())) {
+                                match tx_to_audio.try_send(AudioLayerInwardEvent::RemoveTrack(current_track_uuid.to_string())) {
                                     Ok(_) => (),
-                                    Err(error) => info!("Problem using tx_to_audio to send remove track consumer message to jack layer: {}", error),
+                                    Err(error) => error!("Problem using tx_to_audio to send remove track consumer message to jack layer: {}", error),
                                 }
                             }
 
-                            state.load_from_file(
-                                vst24_plugin_loaders.clone(), clap_plugin_loaders.clone(), path.to_str().unwrap(), tx_to_audio.clone(), track_audio_coast.clone(), vst_host_time_info.clone());
+                            state.load_project(
+                                project, path.to_str().unwrap(), vst24_plugin_loaders.clone(), clap_plugin_loaders.clone(), tx_to_audio.clone(), track_audio_coast.clone(), vst_host_time_info.clone());
+                            state.request_waveform_peaks();
                             
                             let tempo = state.project().song().tempo();
 
@@ -487,18 +607,12 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                                 state.send_to_track_background_processor(track_id.clone(), TrackBackgroundProcessorInwardEvent::Tempo(tempo));
                             }
 
-                            match tx_to_audio.send(AudioLayerInwardEvent::BlockSize(state.project().song().block_size())) {
-                                Ok(_) => (),
-                                Err(error) => info!("Problem using tx_to_audio to send block size message to jack layer: {}", error),
-                            }
-                            match tx_to_audio.send(AudioLayerInwardEvent::Tempo(state.project().song().tempo())) {
+                            match tx_to_audio.try_send(AudioLayerInwardEvent::Tempo(state.project().song().tempo())) {
                                 Ok(_) => (),
-                                Err(error) => info!("Problem using tx_to_audio to send block size message to jack layer: {}", error),
-                            }
-                            match tx_to_audio.send(AudioLayerInwardEvent::SampleRate(state.project().song().sample_rate())) {
-                                Ok(_) => (),
-                                Err(error) => info!("Problem using tx_to_audio to send block size message to jack layer: {}", error),
+                                Err(error) => error!("Problem using tx_to_audio to send block size message to jack layer: {}", error),
                             }
+                            // the loaded song may have been saved at a different block size and sample rate
+                            state.update_song_audio_format();
                         },
                         Err(_) => info!("Main - rx_ui processing loop - Open File - could not get lock on state"),
                     }
@@ -509,9 +623,9 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                             for (track_uuid, _) in midi_tracks {
                                 if let Some(jack_client) = state.jack_client() {
                                     if let Ok(midi_out_port) = jack_client.register_port(track_uuid.as_str(), MidiOut::default()) {
-                                        match tx_to_audio.send(AudioLayerInwardEvent::NewMidiOutPortForTrack(track_uuid.clone(), midi_out_port)) {
+                                        match tx_to_audio.try_send(AudioLayerInwardEvent::NewMidiOutPortForTrack(track_uuid.clone(), midi_out_port)) {
                                             Ok(_) => (),
-                                            Err(error) => info!("Problem using tx_to_audio to send new midi out port message to jack layer: {}", error),
+                                            Err(error) => error!("Problem using tx_to_audio to send new midi out port message to jack layer: {}", error),
                                         }
                                     }
                                 }
@@ -529,6 +643,16 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                 });
             },
             DAWEvents::Save => {
+                // a recovered checkpoint (or a project that has never been saved) has to be saved with Save As
+                let save_as_suggested_path = match state.lock() {
+                    Ok(state) if state.save_as_required() => Some(state.get_current_file_path().clone().unwrap_or_default()),
+                    _ => None,
+                };
+                if let Some(suggested_path) = save_as_suggested_path {
+                    MainWindow::run_save_as_dialogue(gui.ui.get_wnd_main(), &tx_from_ui, if suggested_path.is_empty() { None } else { Some(suggested_path.as_str()) });
+                    return true;
+                }
+
                 gui.ui.dialogue_progress_bar.set_text(Some("Saving..."));
                 gui.ui.progress_dialogue.set_title("Save");
                 gui.ui.progress_dialogue.show_all();
@@ -603,6 +727,7 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                         match state.lock() {
                             Ok(state) => {
                                 let mut state = state;
+                                let track_processing_scheduler = state.track_processing_scheduler();
                                 let tracks = state.get_project().song_mut().tracks_mut();
 
                                 if let Some(file) = path.to_str() {
@@ -784,6 +909,7 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                                                         None,
                                                         None,
                                                         vst_host_time_info.clone(),
+                                                        track_processing_scheduler.clone(),
                                                     );
                                                 }
                                             }
@@ -870,17 +996,27 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                 gui.ui.progress_dialogue.set_title("Export Wav File");
                 gui.ui.progress_dialogue.show_all();
 
-                if let Ok(mut coast) = track_audio_coast.lock() {
-                    *coast = TrackBackgroundProcessorMode::Render;
-                }
                 match state.lock() {
                     Ok(mut state) => {
                         info!("Main - rx_ui processing loop - Export Wave File - attempting to export.");
-                        state.export_to_wave_file(path, tx_to_audio, track_audio_coast, tx_from_ui);
+                        state.export_to_wave_file(path, tx_from_ui);
                     }
                     Err(_) => info!("Main - rx_ui processing loop - Export Wave File - could not get lock on state"),
                 }
             }
+            DAWEvents::ExportStems(directory) => {
+                gui.ui.dialogue_progress_bar.set_text(Some(format!("Exporting stems to {}...", directory.to_str().unwrap()).as_str()));
+                gui.ui.progress_dialogue.set_title("Export Stems");
+                gui.ui.progress_dialogue.show_all();
+
+                match state.lock() {
+                    Ok(mut state) => {
+                        info!("Main - rx_ui processing loop - Export Stems - attempting to export.");
+                        state.export_stems_to_wave_files(directory, tx_from_ui);
+                    }
+                    Err(_) => info!("Main - rx_ui processing loop - Export Stems - could not get lock on state"),
+                }
+            }
             DAWEvents::UpdateUI => {
                 let state_arc = state.clone();
                 match state.lock() {
@@ -895,6 +1031,21 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                 gui.ui.sample_roll_drawing_area.queue_draw();
                 gui.ui.automation_drawing_area.queue_draw();
             }
+            DAWEvents::RebuildUI => {
+                let state_arc = state.clone();
+                match state.lock() {
+                    Ok(mut state) => {
+                        gui.clear_ui();
+                        gui.update_ui_from_state(tx_from_ui, &mut state, state_arc);
+                    }
+                    Err(_) => info!("Main - rx_ui processing loop - Rebuild UI - could not get lock on state"),
+                }
+
+                gui.ui.track_drawing_area.queue_draw();
+                gui.ui.piano_roll_drawing_area.queue_draw();
+                gui.ui.sample_roll_drawing_area.queue_draw();
+                gui.ui.automation_drawing_area.queue_draw();
+            }
             DAWEvents::UpdateState => info!("Event: update state"),
             DAWEvents::Notification(notification_type, message) => {
                 let message_type = match notification_type {
@@ -945,17 +1096,17 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                                     Some(active_loop_uuid) => {
                                         match song.loops().iter().find(|current_loop| current_loop.uuid().to_string() == active_loop_uuid.to_string()) {
                                             Some(active_loop) => {
-                                                start_block = (active_loop.start_position() * 44100.0 / 1024.0) as i32;
-                                                end_block = (active_loop.end_position() * 44100.0 / 1024.0) as i32;
+                                                start_block = DAWUtils::block_number_at_beat(active_loop.start_position(), song.tempo(), song.sample_rate(), song.block_size());
+                                                end_block = DAWUtils::block_number_at_beat(active_loop.end_position(), song.tempo(), song.sample_rate(), song.block_size());
                                             },
                                             None => info!("Could not find the active loop."),
                                         }
                                     },
                                     None => info!("No active loop found to set left position."),
                                 }
-                                match tx_to_audio.send(AudioLayerInwardEvent::ExtentsChange(end_block - start_block)) {
+                                match tx_to_audio.try_send(AudioLayerInwardEvent::ExtentsChange(end_block - start_block)) {
                                     Ok(_) => (),
-                                    Err(error) => info!("Problem using tx_to_audio to send message to jack layer when turning looping on: {}", error),
+                                    Err(error) => error!("Problem using tx_to_audio to send message to jack layer when turning looping on: {}", error),
                                 }
                                 for track in tracks {
                                     state.send_to_track_background_processor(track.uuid().to_string(), TrackBackgroundProcessorInwardEvent::LoopExtents(start_block, end_block));
@@ -998,8 +1149,8 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                                     Some(active_loop_uuid) => {
                                         match song.loops().iter().find(|current_loop| current_loop.uuid().to_string() == active_loop_uuid.to_string()) {
                                             Some(active_loop) => {
-                                                start_block = (active_loop.start_position() * 44100.0 / 1024.0) as i32;
-                                                end_block = (active_loop.end_position() * 44100.0 / 1024.0) as i32;
+                                                start_block = DAWUtils::block_number_at_beat(active_loop.start_position(), song.tempo(), song.sample_rate(), song.block_size());
+                                                end_block = DAWUtils::block_number_at_beat(active_loop.end_position(), song.tempo(), song.sample_rate(), song.block_size());
                                             },
                                             None => info!("Could not find the active loop."),
                                         }
@@ -1027,8 +1178,8 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                                         let tracks = song.tracks();
                                         match song.loops().iter().find(|current_loop| current_loop.uuid().to_string() == active_loop_uuid.to_string()) {
                                             Some(active_loop) => {
-                                                let start_block = (start_position * 44100.0 / 1024.0) as i32;
-                                                let end_block = (active_loop.end_position() * 44100.0 / 1024.0) as i32;
+                                                let start_block = DAWUtils::block_number_at_beat(start_position, song.tempo(), song.sample_rate(), song.block_size());
+                                                let end_block = DAWUtils::block_number_at_beat(active_loop.end_position(), song.tempo(), song.sample_rate(), song.block_size());
                                                 for track in tracks {
                                                     state.send_to_track_background_processor(track.uuid().to_string(), TrackBackgroundProcessorInwardEvent::LoopExtents(start_block, end_block));
                                                 }
@@ -1059,8 +1210,8 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                                         let tracks = song.tracks();
                                         match song.loops().iter().find(|current_loop| current_loop.uuid().to_string() == active_loop_uuid.to_string()) {
                                             Some(active_loop) => {
-                                                let start_block = (active_loop.start_position() * 44100.0 / 1024.0) as i32;
-                                                let end_block = (end_position * 44100.0 / 1024.0) as i32;
+                                                let start_block = DAWUtils::block_number_at_beat(active_loop.start_position(), song.tempo(), song.sample_rate(), song.block_size());
+                                                let end_block = DAWUtils::block_number_at_beat(end_position, song.tempo(), song.sample_rate(), song.block_size());
                                                 for track in tracks {
                                                     state.send_to_track_background_processor(track.uuid().to_string(), TrackBackgroundProcessorInwardEvent::LoopExtents(start_block, end_block));
                                                 }
@@ -1133,96 +1284,10 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
             DAWEvents::TrackChange(track_change_type, track_uuid) => match track_change_type {
                 TrackChangeType::Added(track_change_track_type) => {
                     let state_arc = state.clone();
-                    let mut track_uuid = None;
                     match state.lock() {
                         Ok(mut state) => {
-                            let tx_ui = tx_from_ui;
-                            let mut instrument_track_senders_local = HashMap::new();
-                            let mut instrument_track_receivers_local = HashMap::new();
-
-                            match track_change_track_type {
-                                GeneralTrackType::InstrumentTrack => {
-                                    info!("Adding an instrument track to the state...");
-                                    let track = InstrumentTrack::new();
-                                    track_uuid = Some(track.uuid().to_string());
-                                    gui.add_track(track.name(), track.uuid(), tx_ui, state_arc, track_change_track_type, None, track.volume(), track.pan(), false, false);
-                                    state.get_project().song_mut().add_track(TrackType::InstrumentTrack(track));
-                                    if let Some(track_type) = state.get_project().song_mut().tracks_mut().last_mut() {
-                                        DAWState::init_track(
-                                            vst24_plugin_loaders,
-                                            clap_plugin_loaders,
-                                            tx_to_audio,
-                                            track_audio_coast,
-                                            &mut instrument_track_senders_local,
-                                            &mut instrument_track_receivers_local,
-                                            track_type,
-                                            None,
-                                            None,
-                                            vst_host_time_info,
-                                        );
-                                    }
-                                    info!("Added an instrument track to the state.");
-                                }
-                                GeneralTrackType::AudioTrack => {
-                                    info!("Adding an audio track to the state...");
-                                    let track = AudioTrack::new();
-                                    track_uuid = Some(track.uuid().to_string());
-                                    gui.add_track(track.name(), track.uuid(), tx_ui, state_arc, track_change_track_type, None, track.volume(), track.pan(), false, false);
-                                    state.get_project().song_mut().add_track(TrackType::AudioTrack(track));
-                                    info!("Added an audio track to the state.");
-                                    if let Some(track_type) = state.get_project().song_mut().tracks_mut().last_mut() {
-                                        DAWState::init_track(
-                                            vst24_plugin_loaders,
-                                            clap_plugin_loaders,
-                                            tx_to_audio,
-                                            track_audio_coast,
-                                            &mut instrument_track_senders_local,
-                                            &mut instrument_track_receivers_local,
-                                            track_type,
-                                            None,
-                                            None,
-                                            vst_host_time_info,
-                                        );
-                                    }
-                                }
-                                GeneralTrackType::MidiTrack => {
-                                    info!("Adding a midi track to the state...");
-                                    let track = MidiTrack::new();
-                                    let uuid = track.uuid().to_string();
-
-                                    track_uuid = Some(track.uuid().to_string());
-                                    gui.add_track(track.name(), track.uuid(), tx_ui, state_arc, track_change_track_type, Some(state.midi_devices()), track.volume(), track.pan(), false, false);
-                                    state.get_project().song_mut().add_track(TrackType::MidiTrack(track));
-                                    if let Some(track_type) = state.get_project().song_mut().tracks_mut().last_mut() {
-                                        DAWState::init_track(
-                                            vst24_plugin_loaders,
-                                            clap_plugin_loaders,
-                                            tx_to_audio.clone(),
-                                            track_audio_coast,
-                                            &mut instrument_track_senders_local,
-                                            &mut instrument_track_receivers_local,
-                                            track_type,
-                                            None,
-                                            None,
-                                            vst_host_time_info,
-                                        );
-                                    }
-                                    thread::sleep(Duration::from_secs(1));
-                                    if let Some(jack_client) = state.jack_client() {
-                                        if let Ok(midi_out_port) = jack_client.register_port(uuid.as_str(), MidiOut::default()) {
-                                            match tx_to_audio.send(AudioLayerInwardEvent::NewMidiOutPortForTrack(uuid, midi_out_port)) {
-                                                Ok(_) => (),
-                                                Err(error) => info!("Problem using tx_to_audio to send new midi out port message to jack layer: {}", error),
-                                            }
-                                        }
-                                    }
-                                    info!("Added a midi track to the state.");
-                                }
-                                _ => {}
-                            }
-
-                            state.update_track_senders_and_receivers(instrument_track_senders_local, instrument_track_receivers_local);
-                            gui.update_available_audio_plugins_in_ui(state.vst_instrument_plugins(), state.vst_effect_plugins());
+                            let track_processing_context = TrackProcessingContext { vst24_plugin_loaders, clap_plugin_loaders, tx_audio: tx_to_audio, track_audio_coast, vst_host_time_info };
+                            add_track(&mut state, state_arc, gui, track_change_track_type, tx_from_ui, &track_processing_context);
                         },
                         Err(_) => info!("Main - rx_ui processing loop - Track Added - could not get lock on state"),
                     }
@@ -1235,7 +1300,10 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                             match track_uuid {
                                 Some(track_uuid) => {
                                     gui.delete_track_from_ui(track_uuid.clone());
+                                    telemetry().remove_track(track_uuid.as_str());
+                                    state.track_processing_scheduler().audio_buses().remove_bus(track_uuid.as_str());
                                     state.get_project().song_mut().delete_track(track_uuid);
+                                    state.update_delay_compensation();
                                 },
                                 None => info!("Main - rx_ui processing loop - Track Deleted - could not find track"),
                             }
@@ -1313,7 +1381,7 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                         Ok(state) => {
                             let mut state = state;
                             let track_uuid = track_uuid.unwrap();
-                            match state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
+                            match state.track_mut(&track_uuid) {
                                 Some(track) => track.set_mute(true),
                                 None => (),
                             };
@@ -1327,7 +1395,7 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                         Ok(state) => {
                             let mut state = state;
                             let track_uuid = track_uuid.unwrap();
-                            match state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
+                            match state.track_mut(&track_uuid) {
                                 Some(track) => track.set_mute(false),
                                 None => (),
                             };
@@ -1340,7 +1408,7 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                     let track_uuid = track_uuid.unwrap();
                     match state.lock() {
                         Ok(mut state) => {
-                            let previous_midi_device_name = match state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
+                            let previous_midi_device_name = match state.track_mut(&track_uuid) {
                                 Some(track_type) => match track_type {
                                     TrackType::InstrumentTrack(_) => "".to_string(),
                                     TrackType::AudioTrack(_) => "".to_string(),
@@ -1365,7 +1433,7 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                     let track_uuid = track_uuid.unwrap();
                     match state.lock() {
                         Ok(mut state) => {
-                            match state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
+                            match state.track_mut(&track_uuid) {
                                 Some(track_type) => match track_type {
                                     TrackType::InstrumentTrack(_) => (),
                                     TrackType::AudioTrack(_) => (),
@@ -1386,7 +1454,7 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                             let mut state = state;
                             if let Some(track_uuid) = track_uuid {
                                 // remove the old window
-                                match state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
+                                match state.track_mut(&track_uuid) {
                                     Some(track_type) => match track_type {
                                         TrackType::InstrumentTrack(track) => {
                                             let _track_name = track.name().to_string();
@@ -1413,7 +1481,7 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                     let mut track_uuid = track_uuid.unwrap();
                     match state.lock() {
                         Ok(mut state) => {
-                            match state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
+                            match state.track_mut(&track_uuid) {
                                 Some(track_type) => match track_type {
                                     TrackType::InstrumentTrack(track) => {
                                         let track_name = track.name().to_string();
@@ -1439,7 +1507,8 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
 
                                             let window = win.clone();
                                             {
-                                                glib::idle_add_local(move || {
+                                                // plugin editors draw themselves - just keep the window refreshed at the display rate
+                                                glib::timeout_add_local(Duration::from_millis(GUI_REFRESH_INTERVAL_IN_MILLISECONDS), move || {
                                                     if window.is_visible() {
                                                         window.queue_draw();
                                                     }
@@ -1483,7 +1552,7 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                             let mut state = state;
                             let track_uuid = track_uuid.unwrap();
                             info!("Track name changed: \"{}\", name=\"{}\"", track_name.as_str(), &track_uuid);
-                            match state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
+                            match state.track_mut(&track_uuid) {
                                 Some(track) => {
                                     track.set_name(track_name.clone());
                                     gui.change_track_name(track_uuid.clone(), track_name);
@@ -1501,7 +1570,7 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                                 Some(track_uuid) => {
                                     let track_uuid2 = track_uuid.clone();
                                     state.send_to_track_background_processor(track_uuid, TrackBackgroundProcessorInwardEvent::AddEffect(vst24_plugin_loaders, clap_plugin_loaders, uuid, effect_details.clone()));
-                                    match state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid2) {
+                                    match state.track_mut(&track_uuid2) {
                                         Some(track_type) => match track_type {
                                             TrackType::InstrumentTrack(track) => {
                                                 let (sub_plugin_id, library_path, plugin_type) = get_plugin_details(effect_details.clone());
@@ -1529,7 +1598,7 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                             }
                             if let Some(track_uuid) = track_uuid {
                                 let track_uuid2 = track_uuid;
-                                if let Some(track_type) = state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid2) {
+                                if let Some(track_type) = state.track_mut(&track_uuid2) {
                                     match track_type {
                                         TrackType::InstrumentTrack(track) => {
                                             track.effects_mut().retain(|effect| {
@@ -1564,7 +1633,7 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                                     }
                                     gui.ui.riff_name_dialogue.hide();
 
-                                    match state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
+                                    match state.track_mut(&track_uuid) {
                                         Some(track) => track.riffs_mut().push(Riff::new_with_name_and_length(uuid, name, length)),
                                         None => ()
                                     }
@@ -1597,7 +1666,7 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
 
                                     // get the riff to copy and clone it
 
-                                    match state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
+                                    match state.track_mut(&track_uuid) {
                                         Some(track) => {
                                             if let Some(riff) = track.riffs_mut().iter_mut().find(|riff| riff.uuid().to_string() == uuid_to_copy) {
                                                 let mut new_riff = riff.clone();
@@ -1724,7 +1793,7 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                     if found_info.len() == 0 {
                         if let Ok(mut state) = state.lock() {
                             if let Some(uuid) = track_uuid {
-                                if let Some(track) = state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == uuid) {
+                                if let Some(track) = state.track_mut(&uuid) {
                                     track.riffs_mut().retain(|riff| riff.uuid().to_string() != riff_uuid);
                                     // update the track details dialogue riff choice and edit field
                                     if let Some((_, dialogue)) = gui.track_details_dialogues.iter().find(|(dialogue_track_uuid, _dialogue)| dialogue_track_uuid.to_string() == uuid) {
@@ -1761,7 +1830,7 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                                     state.set_selected_riff_uuid(track_uuid.clone(), riff_uuid.clone());
                                     state.set_selected_riff_ref_uuid(None);
 
-                                    match state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
+                                    match state.track_mut(&track_uuid) {
                                         Some(track) => for riff in track.riffs_mut().iter_mut() {
                                             if riff.uuid().to_string() == riff_uuid {
                                                 riff.set_length(riff_length);
@@ -2439,7 +2508,7 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
 
                     //         match selected_riff_track_uuid {
                     //             Some(track_uuid) => {
-                    //                 match state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
+                    //                 match state.track_mut(&track_uuid) {
                     //                     Some(track) => {
                     //                         match selected_riff_uuid {
                     //                             Some(riff_uuid) => {
@@ -2517,7 +2586,7 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
 
                                 match selected_riff_track_uuid {
                                     Some(track_uuid) => {
-                                        match state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
+                                        match state.track_mut(&track_uuid) {
                                             Some(track) => {
                                                 //info!("Selected track riff ref count: {}", track.riff_refs().len());
                                                 let riffs = {
@@ -2673,7 +2742,7 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
 
                             match selected_riff_track_uuid {
                                 Some(track_uuid) => {
-                                    match state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
+                                    match state.track_mut(&track_uuid) {
                                         Some(track) => {
                                             copy_buffer.iter_mut().for_each(|riff_ref| {
                                                 let mut riff_ref_copy = riff_ref.clone();
@@ -2846,7 +2915,7 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
 
                             match track_uuid {
                                 Some(track_uuid) => {
-                                    match state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
+                                    match state.track_mut(&track_uuid) {
                                         Some(track) => {
                                             for riff in track.riffs_mut().iter_mut() {
                                                 if riff.uuid().to_string() == *riff_uuid {
@@ -3107,7 +3176,7 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                             match track_uuid {
                                 Some(track_uuid) =>
                                     {
-                                        match state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
+                                        match state.track_mut(&track_uuid) {
                                             Some(track_type) => {
                                                 match track_type {
                                                     TrackType::InstrumentTrack(track) => {
@@ -3220,7 +3289,7 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                             let mut xid = 0;
                             match state.lock() {
                                 Ok(mut state) => {
-                                    match state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
+                                    match state.track_mut(&track_uuid) {
                                         Some(track_type) => {
                                             let track_name = track_type.name().to_string();
                                             match track_type {
@@ -3250,7 +3319,8 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
 
                                                                 let window = win.clone();
                                                                 {
-                                                                    glib::idle_add_local(move || {
+                                                                    // plugin editors draw themselves - just keep the window refreshed at the display rate
+                                                                    glib::timeout_add_local(Duration::from_millis(GUI_REFRESH_INTERVAL_IN_MILLISECONDS), move || {
                                                                         if window.is_visible() {
                                                                             window.queue_draw();
                                                                         }
@@ -3454,6 +3524,7 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                                         None,
                                         None,
                                         vst_host_time_info.clone(),
+                                        state.track_processing_scheduler(),
                                     );
 
                                     state.get_project().song_mut().tracks_mut().push(new_track_type);
@@ -3467,6 +3538,41 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                         Err(_) => todo!(),
                     }
                 }
+                TrackChangeType::Freeze => {
+                    gui.ui.dialogue_progress_bar.set_text(Some("Freezing track..."));
+                    gui.ui.progress_dialogue.set_title("Freeze Track");
+                    gui.ui.progress_dialogue.show_all();
+
+                    match state.lock() {
+                        Ok(mut state) => {
+                            if let Some(track_uuid) = track_uuid {
+                                info!("Main - rx_ui processing loop - Freeze Track - attempting to freeze.");
+                                state.freeze_track(track_uuid, tx_from_ui);
+                            }
+                        }
+                        Err(_) => info!("Main - rx_ui processing loop - Freeze Track - could not get lock on state"),
+                    }
+                }
+                TrackChangeType::FreezeRendered(file_name, content_hash, output_delay) => {
+                    match state.lock() {
+                        Ok(mut state) => {
+                            if let Some(track_uuid) = track_uuid {
+                                state.freeze_rendered(track_uuid, FrozenTrack::new(file_name, content_hash, output_delay));
+                            }
+                        }
+                        Err(_) => info!("Main - rx_ui processing loop - Freeze Track - could not get lock on state"),
+                    }
+                }
+                TrackChangeType::Unfreeze => {
+                    match state.lock() {
+                        Ok(mut state) => {
+                            if let Some(track_uuid) = track_uuid {
+                                state.set_track_frozen(track_uuid, None);
+                            }
+                        }
+                        Err(_) => info!("Main - rx_ui processing loop - Unfreeze Track - could not get lock on state"),
+                    }
+                }
                 TrackChangeType::RouteMidiTo(routing) => {
                     match state.lock() {
                         Ok(mut state) => {
@@ -3474,7 +3580,7 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                                 state.send_midi_routing_to_track_background_processors(track_from_uuid.clone(), routing.clone());
 
                                 // add the new routing to the track
-                                if let Some(track) = state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_from_uuid) {
+                                if let Some(track) = state.track_mut(&track_from_uuid) {
                                     track.midi_routings_mut().push(routing);
                                 }
                             }
@@ -3488,38 +3594,7 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                     match state.lock() {
                         Ok(mut state) => {
                             if let Some(track_from_uuid) = track_uuid {
-                                // get the destination track uuid
-                                let destination_track_uuid = if let Some(track) = state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_from_uuid.clone()) {
-                                    'splashdown: {
-                                        for index in 0..track.midi_routings().len() {
-                                            if let Some(route) = track.midi_routings().get(index) {
-                                                if route.uuid() == route_uuid {
-                                                    // extract the track uuid from the destination part of the route
-                                                    let destination_track_uuid = match &route.destination {
-                                                        TrackEventRoutingNodeType::Track(track_uuid) => track_uuid.clone(),
-                                                        TrackEventRoutingNodeType::Instrument(track_uuid, _) => track_uuid.clone(),
-                                                        TrackEventRoutingNodeType::Effect(track_uuid, _) => track_uuid.clone(),
-                                                    };
-                                                    
-                                                    track.midi_routings_mut().remove(index);
-                                                    break 'splashdown Some(destination_track_uuid);
-                                                }
-                                            }
-                                        }
-                                        None
-                                    }
-                                }
-                                else {
-                                    None
-                                };
-                                
-                                // delete the routing from the source track background processor
-                                state.send_to_track_background_processor(track_from_uuid.clone(), TrackBackgroundProcessorInwardEvent::RemoveTrackEventSendRouting(route_uuid.clone()));
-                                
-                                // delete the routing from the destination track
-                                if let Some(destination_track_uuid) = destination_track_uuid {
-                                    state.send_to_track_background_processor(destination_track_uuid, TrackBackgroundProcessorInwardEvent::RemoveTrackEventReceiveRouting(route_uuid.clone()));
-                                }
+                                state.remove_midi_routing(track_from_uuid.as_str(), route_uuid.as_str());
                             }
                         }
                         Err(error) => {
@@ -3532,7 +3607,7 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                         Ok(mut state) => {
                             if let Some(track_from_uuid) = track_uuid {
                                 // get the destination track uuid
-                                let details = if let Some(track) = state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_from_uuid.clone()) {
+                                let details = if let Some(track) = state.track_mut(&track_from_uuid) {
                                     'splashdown: {
                                         for index in 0..track.midi_routings().len() {
                                             if let Some(route) = track.midi_routings_mut().get_mut(index) {
@@ -3579,9 +3654,10 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                                 state.send_audio_routing_to_track_background_processors(track_from_uuid.clone(), routing.clone());
 
                                 // add the new routing to the track
-                                if let Some(track) = state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_from_uuid) {
+                                if let Some(track) = state.track_mut(&track_from_uuid) {
                                     track.audio_routings_mut().push(routing);
                                 }
+                                state.update_delay_compensation();
                             }
                         }
                         Err(error) => {
@@ -3593,38 +3669,8 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                     match state.lock() {
                         Ok(mut state) => {
                             if let Some(track_from_uuid) = track_uuid {
-                                // get the destination track uuid
-                                let destination_track_uuid = if let Some(track) = state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_from_uuid.clone()) {
-                                    'splashdown: {
-                                        for index in 0..track.audio_routings().len() {
-                                            if let Some(route) = track.audio_routings().get(index) {
-                                                if route.uuid() == route_uuid {
-                                                    // extract the track uuid from the destination part of the route
-                                                    let destination_track_uuid = match &route.destination {
-                                                        AudioRoutingNodeType::Track(track_uuid) => track_uuid.clone(),
-                                                        AudioRoutingNodeType::Instrument(track_uuid, _, _, _) => track_uuid.clone(),
-                                                        AudioRoutingNodeType::Effect(track_uuid, _, _, _) => track_uuid.clone(),
-                                                    };
-                                                    
-                                                    track.audio_routings_mut().remove(index);
-                                                    break 'splashdown Some(destination_track_uuid);
-                                                }
-                                            }
-                                        }
-                                        None
-                                    }
-                                }
-                                else {
-                                    None
-                                };
-                                
-                                // delete the routing from the source track background processor
-                                state.send_to_track_background_processor(track_from_uuid.clone(), TrackBackgroundProcessorInwardEvent::RemoveAudioSendRouting(route_uuid.clone()));
-                                
-                                // delete the routing from the destination track
-                                if let Some(destination_track_uuid) = destination_track_uuid {
-                                    state.send_to_track_background_processor(destination_track_uuid, TrackBackgroundProcessorInwardEvent::RemoveAudioReceiveRouting(route_uuid.clone()));
-                                }
+                                state.remove_audio_routing(track_from_uuid.as_str(), route_uuid.as_str());
+                                state.update_delay_compensation();
                             }
                         }
                         Err(error) => {
@@ -3664,33 +3710,20 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                         },
                         Err(_) => info!("Main - rx_ui processing loop - riff translate event - could not get lock on state"),
                     }
-                    if let Some(selected_riff_uuid) = selected_riff_uuid {
-                        if let Some(selected_riff_track_uuid) = selected_riff_track_uuid {
-                            match state.lock() {
-                                Ok(mut state) => {
-                                    match original_event_copy {
-                                        TrackEvent::Note(original_note_copy) => {
-                                            if let Some(track) = state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == selected_riff_track_uuid) {
-                                                if let Some(riff) = track.riffs_mut().iter_mut().find(|riff| riff.uuid().to_string() == selected_riff_uuid) {
-                                                    for event in riff.events_mut().iter_mut() {
-                                                        if let TrackEvent::Note(note) = event {
-                                                            if *note == original_note_copy {
-                                                                if let TrackEvent::Note(translated_event_copy) = changed_event {
-                                                                    note.set_position(translated_event_copy.position());
-                                                                    note.set_note(translated_event_copy.note());
-                                                                    note.set_length(translated_event_copy.length());
-                                                                    break;
-                                                                }
-                                                            }
-                                                        }
-                                                    }
-                                                }
-                                            }
-                                        }
-                                        _ => {}
-                                    }
+                    {
+                        let mut state = state.clone();
+                        match history_manager.lock() {
+                            Ok(mut history) => {
+                                let action = RiffChangeEventAction::new(selected_riff_track_uuid, selected_riff_uuid, original_event_copy, changed_event);
+                                if let Err(error) = history.apply(&mut state, Box::new(action)) {
+                                    error!("Main - rx_ui processing loop - riff translate event - error: {}", error);
+                                } else {
+                                    // refresh UI
+                                    gui.ui.track_drawing_area.queue_draw();
                                 }
-                                Err(error) => println!("Main - rx_ui processing loop - riff translate event - could not get lock on state"),
+                            }
+                            Err(error) => {
+                                error!("Main - rx_ui processing loop - riff translate event - error getting lock for history manager: {}", error);
                             }
                         }
                     }
@@ -3700,7 +3733,7 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                     if let Some(track_uuid) = track_uuid {
                         match state.lock() {
                             Ok(mut state) => {
-                                if let Some(track) = state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
+                                if let Some(track) = state.track_mut(&track_uuid) {
                                     if let Some(riff) = track.riffs_mut().iter_mut().find(|riff| riff.uuid().to_string() == original_riff_copy.uuid().to_string()) {
                                         riff.set_length(changed_riff.length());
                                     }
@@ -3877,9 +3910,9 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                     Err(_) => info!("Main - rx_ui processing loop - transport stop - could not get lock on state"),
                 };
                 let number_of_blocks = (song_length_in_beats / bpm * 60.0 * sample_rate / block_size) as i32;
-                match tx_to_audio.send(AudioLayerInwardEvent::Play(false, number_of_blocks, 0)) {
+                match tx_to_audio.try_send(AudioLayerInwardEvent::Play(false, number_of_blocks, 0)) {
                     Ok(_) => (),
-                    Err(error) => info!("Problem using tx_to_audio to send message to jack layer when stopping play: {}", error),
+                    Err(error) => error!("Problem using tx_to_audio to send message to jack layer when stopping play: {}", error),
                 }
             }
             DAWEvents::TransportPlay => {
@@ -3897,25 +3930,13 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                         } else if track_riffs_stack_visible_name == "Riffs" {
                             let riffs_stack_visible_name = gui.get_riffs_stack_visible_name();
                             if riffs_stack_visible_name == "riff_sets" {
-                                let riff_set_uuid = if let Some(riff_set) = state.get_project().song_mut().riff_sets_mut().get_mut(0) {
-                                    riff_set.uuid()
-                                } else {
-                                    "".to_string()
-                                };
+                                let riff_set_uuid = state.project().song().riff_sets().get(0).map(|riff_set| riff_set.uuid()).unwrap_or_default();
                                 state.play_riff_set(tx_to_audio, riff_set_uuid);
                             } else if riffs_stack_visible_name == "riff_sequences" {
-                                let riff_sequence_uuid = if let Some(riff_sequence) = state.get_project().song_mut().riff_sequences_mut().get_mut(0) {
-                                    riff_sequence.uuid()
-                                } else {
-                                    "".to_string()
-                                };
+                                let riff_sequence_uuid = state.project().song().riff_sequences().get(0).map(|riff_sequence| riff_sequence.uuid()).unwrap_or_default();
                                 state.play_riff_sequence(tx_to_audio, riff_sequence_uuid);
                             } else if riffs_stack_visible_name == "riff_arrangement" {
-                                let riff_arrangement_uuid = if let Some(riff_arrangement) = state.get_project().song_mut().riff_arrangements_mut().get_mut(0) {
-                                    riff_arrangement.uuid()
-                                } else {
-                                    "".to_string()
-                                };
+                                let riff_arrangement_uuid = state.project().song().riff_arrangements().get(0).map(|riff_arrangement| riff_arrangement.uuid()).unwrap_or_default();
                                 state.play_riff_arrangement(tx_to_audio, riff_arrangement_uuid);
                             }
                         }
@@ -4093,9 +4114,9 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                                 grid.set_tempo(state.project().song().tempo());
                             }
                         }
-                        match tx_to_audio.send(AudioLayerInwardEvent::Tempo(state.project().song().tempo())) {
+                        match tx_to_audio.try_send(AudioLayerInwardEvent::Tempo(state.project().song().tempo())) {
                             Ok(_) => (),
-                            Err(error) => info!("Problem using tx_to_audio to send tempo message to jack layer: {}", error),
+                            Err(error) => error!("Problem using tx_to_audio to send tempo message to jack layer: {}", error),
                         }
                         for track in state.project().song().tracks().iter() {
                             state.send_to_track_background_processor(track.uuid().to_string(), TrackBackgroundProcessorInwardEvent::Tempo(tempo));
@@ -4124,16 +4145,16 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                 match channel_change_type {
                     MasterChannelChangeType::VolumeChange(volume) => {
                         info!("Master channel volume change: {}", volume);
-                        match tx_to_audio.send(AudioLayerInwardEvent::Volume(volume as f32)) {
+                        match tx_to_audio.try_send(AudioLayerInwardEvent::Volume(volume as f32)) {
                             Ok(_) => (),
-                            Err(error) => info!("Problem using tx_to_audio to send master volume message to jack layer: {}", error),
+                            Err(error) => error!("Problem using tx_to_audio to send master volume message to jack layer: {}", error),
                         }
                     },
                     MasterChannelChangeType::PanChange(pan) => {
                         info!("Master channel pan change: {}", pan);
-                        match tx_to_audio.send(AudioLayerInwardEvent::Pan(pan as f32)) {
+                        match tx_to_audio.try_send(AudioLayerInwardEvent::Pan(pan as f32)) {
                             Ok(_) => (),
-                            Err(error) => info!("Problem using tx_to_audio to send master pan message to jack layer: {}", error),
+                            Err(error) => error!("Problem using tx_to_audio to send master pan message to jack layer: {}", error),
                         }
                     },
                 }
@@ -4557,9 +4578,9 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                     },
                     Err(_) => info!("Main - rx_ui processing loop - Open File - could not get lock on state"),
                 }
-                match tx_to_audio.send(AudioLayerInwardEvent::Shutdown) {
+                match tx_to_audio.try_send(AudioLayerInwardEvent::Shutdown) {
                     Ok(_) => {}
-                    Err(_) => {}
+                    Err(error) => error!("Problem using tx_to_audio to send shutdown message to jack layer: {}", error),
                 }
             }
             DAWEvents::Undo => {
@@ -4597,8 +4618,15 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                 gui.ui.riff_sequences_box.queue_draw();
             }
             DAWEvents::PreviewSample(file_name) => {
-                match tx_to_audio.send(AudioLayerInwardEvent::PreviewSample(file_name)) {
-                    Ok(_) => {}
+                // open here rather than in the jack process callback
+                match state.lock() {
+                    Ok(state) => {
+                        let sample_rate = state.project().song().sample_rate() as i32;
+                        match tx_to_audio.try_send(AudioLayerInwardEvent::PreviewSample(SampleData::new(file_name, sample_rate, &state.sample_streamer()))) {
+                            Ok(_) => {}
+                            Err(_) => {}
+                        }
+                    }
                     Err(_) => {}
                 }
             }
@@ -4609,6 +4637,7 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                         let sample_data = SampleData::new(
                             file_name.clone(),
                             *state.get_project().song_mut().sample_rate_mut() as i32,
+                            &state.sample_streamer(),
                         );
                         let sample = Sample::new(
                             file_name.clone(),
@@ -4618,6 +4647,7 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
 
                         state.get_project().song_mut().samples_mut().insert(sample.uuid().to_string(), sample.clone());
                         state.sample_data_mut().insert(sample_data.uuid().to_string(), sample_data);
+                        state.waveform_peak_cache().request(sample.file_name());
                         println!("Added sample: id={}, text={}, uuid={}", sample.file_name(), sample.name(), sample.uuid());
 
                         // update the sample roll browser list store
@@ -4627,45 +4657,29 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                 }
             }
             DAWEvents::SampleDelete(_uuid) => {}
-            DAWEvents::RunLuaScript(script) => {
-                match lua.load(script.as_str()).eval::<MultiValue>() {
-                    Ok(values) => {
-                        if let Some(console_output_text_buffer) = gui.ui.scripting_console_output_text_view.buffer() {
-                            let console_output_text = format!("{}\n>> ",
-                                                              values
-                                                                  .iter()
-                                                                  .map(|value| {
-                                                                      match value {
-                                                                          Value::Nil => "Nil".to_string(),
-                                                                          Value::Boolean(data) => format!("{}", data),
-                                                                          Value::LightUserData(_data) => "LightUserData".to_string(),
-                                                                          Value::Integer(data) => format!("{}", data),
-                                                                          Value::Number(data) => format!("{}", data),
-                                                                          Value::String(data) => data.to_str().unwrap().to_string(),
-                                                                          Value::Table(_data) => "Table".to_string(),
-                                                                          Value::Function(_data) => "Function".to_string(),
-                                                                          Value::Thread(_data) => "Thread".to_string(),
-                                                                          Value::UserData(_data) => "AnyUserData".to_string(),
-                                                                          Value::Error(data) => format!("{:?}", data),
-                                                                          _ => "".to_string(),
-                                                                      }
-                                                                  })
-                                                                  .collect::<Vec<_>>()
-                                                                  .join("\t")
-                            );
-                            console_output_text_buffer.insert(&mut console_output_text_buffer.end_iter(), console_output_text.as_str());
-                        }
-                    }
-                    Err(error) => {
-                        if let Some(console_output_text_buffer) = gui.ui.scripting_console_output_text_view.buffer() {
-                            let console_output_text = format!("{}\n>> ", error);
-                            console_output_text_buffer.insert(&mut console_output_text_buffer.end_iter(), console_output_text.as_str());
-                        }
-                    }
+            DAWEvents::WaveformPeaksReady(_file_name) => {
+                gui.ui.track_drawing_area.queue_draw();
+                gui.ui.sample_roll_drawing_area.queue_draw();
+            }
+            DAWEvents::RunLuaScript(script) => lua_script_runner.run(script),
+            DAWEvents::LuaScriptOutput(output) => {
+                if let Some(console_output_text_buffer) = gui.ui.scripting_console_output_text_view.buffer() {
+                    let console_output_text = format!("{}\n>> ", output);
+                    console_output_text_buffer.insert(&mut console_output_text_buffer.end_iter(), console_output_text.as_str());
                 }
             }
+            DAWEvents::ScriptBatch(batch) => {
+                let track_processing_context = TrackProcessingContext { vst24_plugin_loaders, clap_plugin_loaders, tx_audio: tx_to_audio, track_audio_coast, vst_host_time_info };
+                apply_script_batch(batch, history_manager, state, tx_from_ui, track_processing_context);
+                gui.ui.track_drawing_area.queue_draw();
+                gui.ui.piano_roll_drawing_area.queue_draw();
+            }
             DAWEvents::HideProgressDialogue => {
                 gui.ui.progress_dialogue.hide();
+                gui.ui.dialogue_progress_bar.set_fraction(0.0);
+            }
+            DAWEvents::ProgressDialogueFraction(fraction) => {
+                gui.ui.dialogue_progress_bar.set_fraction(fraction);
             }
             DAWEvents::TrackDetails(track_uuid, show) => {
                 if let Some((_, dialogue)) = gui.track_details_dialogues.iter().find(|(dialogue_track_uuid, _dialogue)| dialogue_track_uuid.to_string() == track_uuid) {
@@ -4766,8 +4780,10 @@ fn process_application_events(history_manager: &mut Arc<Mutex<HistoryManager>>,
                 gui.ui.track_drawing_area.queue_draw();
             }
         },
-        Err(_) => (),
+        Err(_) => return false,
     }
+
+    true
 }
 
 fn handle_automation_add(time: f64, value: i32, state: &Arc<Mutex<DAWState>>) {
@@ -4800,7 +4816,7 @@ fn handle_automation_instrument_add(time: f64, value: i32, state: &mut DAWState)
     };
     let automation_edit_type = state.automation_edit_type();
     
-    if let Some(track_type) = state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
+    if let Some(track_type) = state.track_mut(&track_uuid) {
         if let TrackType::InstrumentTrack(instrument_track) = track_type {
             let plugin_uuid = instrument_track.instrument().uuid();
 
@@ -4854,7 +4870,7 @@ fn handle_automation_note_expression_add(time: f64, value: i32, state: &mut DAWS
     let note_expression_channel = state.note_expression_channel() as i16;
     let note_expression_key = state.note_expression_key();
 
-    if let Some(track_type) = state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
+    if let Some(track_type) = state.track_mut(&track_uuid) {
         if let TrackType::InstrumentTrack(instrument_track) = track_type {
             let events = match automation_edit_type {
                 AutomationEditType::Track => {
@@ -4908,7 +4924,7 @@ fn handle_automation_effect_add(time: f64, value: i32, state: &mut DAWState) {
         None
     };
     
-    if let Some(track_type) = state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
+    if let Some(track_type) = state.track_mut(&track_uuid) {
         let appropriate_track_type = match track_type {
             TrackType::InstrumentTrack(_) => true,
             TrackType::AudioTrack(_) => true,
@@ -4963,7 +4979,7 @@ fn handle_automation_controller_add(time: f64, value: i32, state: &mut DAWState)
     };
     let automation_edit_type = state.automation_edit_type();
     
-    if let Some(track_type) = state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
+    if let Some(track_type) = state.track_mut(&track_uuid) {
         let events = match automation_edit_type {
             AutomationEditType::Track => {
                 track_type.automation_mut().events_mut()
@@ -5020,7 +5036,7 @@ fn handle_automation_instrument_delete(time: f64, state: &mut DAWState) {
     };
     let automation_edit_type = state.automation_edit_type();
     
-    if let Some(track_type) = state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
+    if let Some(track_type) = state.track_mut(&track_uuid) {
         if let TrackType::InstrumentTrack(instrument_track) = track_type {
             let plugin_uuid = instrument_track.instrument().uuid();
 
@@ -5073,7 +5089,7 @@ fn handle_automation_note_expression_delete(time: f64, state: &mut DAWState) {
     };
     let automation_edit_type = state.automation_edit_type();
 
-    if let Some(track_type) = state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
+    if let Some(track_type) = state.track_mut(&track_uuid) {
         if let TrackType::InstrumentTrack(instrument_track) = track_type {
             let events = match automation_edit_type {
                 AutomationEditType::Track => {
@@ -5125,7 +5141,7 @@ fn handle_automation_effect_delete(time: f64, state: &mut DAWState) {
         None
     };
     
-    if let Some(track_type) = state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
+    if let Some(track_type) = state.track_mut(&track_uuid) {
         let appropriate_track_type = match track_type {
             TrackType::InstrumentTrack(_) => true,
             TrackType::AudioTrack(_) => true,
@@ -5184,7 +5200,7 @@ fn handle_automation_controller_delete(time: f64, state: &mut DAWState) {
     };
     let automation_edit_type = state.automation_edit_type();
     
-    if let Some(track_type) = state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
+    if let Some(track_type) = state.track_mut(&track_uuid) {
         let events = match automation_edit_type {
             AutomationEditType::Track => {
                 track_type.automation_mut().events_mut()
@@ -5247,7 +5263,7 @@ fn handle_automation_instrument_cut(time_left: f64, _value_top: i32, time_right:
     };
     let automation_edit_type = state.automation_edit_type();
     
-    if let Some(track_type) = state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
+    if let Some(track_type) = state.track_mut(&track_uuid) {
         if let TrackType::InstrumentTrack(instrument_track) = track_type {
             let plugin_uuid = instrument_track.instrument().uuid();
 
@@ -5299,7 +5315,7 @@ fn handle_automation_note_expression_cut(time_left: f64, _value_top: i32, time_r
     };
     let automation_edit_type = state.automation_edit_type();
 
-    if let Some(track_type) = state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
+    if let Some(track_type) = state.track_mut(&track_uuid) {
         if let TrackType::InstrumentTrack(instrument_track) = track_type {
             let events = match automation_edit_type {
                 AutomationEditType::Track => {
@@ -5352,7 +5368,7 @@ fn handle_automation_effect_cut(time_left: f64, _value_top: i32, time_right: f64
         None
     };
     
-    if let Some(track_type) = state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
+    if let Some(track_type) = state.track_mut(&track_uuid) {
         let appropriate_track_type = match track_type {
             TrackType::InstrumentTrack(_) => true,
             TrackType::AudioTrack(_) => true,
@@ -5410,7 +5426,7 @@ fn handle_automation_controller_cut(time_left: f64, value_top: i32, time_right:
     };
     let automation_edit_type = state.automation_edit_type();
     
-    if let Some(track_type) = state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
+    if let Some(track_type) = state.track_mut(&track_uuid) {
         let events = match automation_edit_type {
             AutomationEditType::Track => {
                 track_type.automation_mut().events_mut()
@@ -5448,13 +5464,36 @@ fn handle_automation_controller_cut(time_left: f64, value_top: i32, time_right:
     }
 }
 
-fn do_progress_dialogue_pulse(gui: &mut MainWindow, progress_bar_pulse_delay_count: &mut i32) {
-    if gui.ui.progress_dialogue.is_visible() {
-        if *progress_bar_pulse_delay_count > 10000 {
-            *progress_bar_pulse_delay_count = 0;
-            gui.ui.dialogue_progress_bar.pulse();
-        } else {
-            *progress_bar_pulse_delay_count += 1;
+fn start_progress_dialogue_pulse(gui: &MainWindow) {
+    let progress_bar = gui.ui.dialogue_progress_bar.clone();
+    gui.ui.progress_dialogue.connect_show(move |progress_dialogue| {
+        let progress_dialogue = progress_dialogue.clone();
+        let progress_bar = progress_bar.clone();
+        glib::timeout_add_local(Duration::from_millis(PROGRESS_BAR_PULSE_INTERVAL_IN_MILLISECONDS), move || {
+            // only pulse when the progress is not known
+            if progress_bar.fraction() == 0.0 {
+                progress_bar.pulse();
+            }
+            glib::Continue(progress_dialogue.is_visible())
+        });
+    });
+}
+
+/// Tell the audio layer which track live midi in should be played on whenever the selected track or its midi channel changes.
+fn update_live_midi_input_track(state: &Arc<Mutex<DAWState>>, tx_to_audio: &Sender<AudioLayerInwardEvent>, live_midi_input_track: &mut Option<(Option<String>, u8)>) {
+    let selected_track = match state.lock() {
+        Ok(state) => match state.selected_track().and_then(|track_uuid| state.project().song().tracks().iter().find(|track| track.uuid().to_string() == track_uuid)) {
+            Some(TrackType::MidiTrack(midi_track)) => (Some(midi_track.uuid().to_string()), midi_track.midi_device().midi_channel() as u8),
+            Some(track) => (Some(track.uuid().to_string()), 0),
+            None => (None, 0),
+        },
+        Err(_) => return,
+    };
+
+    if live_midi_input_track.as_ref() != Some(&selected_track) {
+        match tx_to_audio.try_send(AudioLayerInwardEvent::LiveMidiInputTrack(selected_track.0.clone(), selected_track.1)) {
+            Ok(_) => *live_midi_input_track = Some(selected_track),
+            Err(_) => error!("Main - could not send the live midi input track to the audio layer."),
         }
     }
 }
@@ -5469,52 +5508,15 @@ fn process_jack_events(tx_from_ui: &Sender<DAWEvents>,
                        gui: &mut MainWindow,
                        vst_host_time_info: &Arc<parking_lot::RwLock<TimeInfo>>,
                        recorded_playing_notes: &mut HashMap<i32, f64>,
-) {
+                       coalesced_gui_updates: &mut CoalescedGuiUpdates,
+                       live_midi_input_track: &mut Option<(Option<String>, u8)>,
+) -> bool {
     match jack_midi_receiver.try_recv() {
         Ok(audio_layer_outward_event) => {
             match audio_layer_outward_event {
                 AudioLayerOutwardEvent::MidiEvent(jack_midi_event) => {
+                    // the audio layer has already played the event live on the selected track - this is only for recording
                     let midi_msg_type = jack_midi_event.data[0] as i32;
-
-                    match state.lock() {
-                        Ok(state) => {
-                            match state.selected_track() {
-                                Some(track_uuid) => {
-                                    match state.project().song().tracks().iter().find(|track| track.uuid().to_string() == track_uuid) {
-                                        Some(track) => {
-                                            let midi_channel = if let TrackType::MidiTrack(midi_track) = track {
-                                                midi_track.midi_device().midi_channel()
-                                            } else {
-                                                0
-                                            };
-                                            if (144..=159).contains(&midi_msg_type) {
-                                                state.send_to_track_background_processor(track.uuid().to_string(), TrackBackgroundProcessorInwardEvent::PlayNoteImmediate(jack_midi_event.data[1] as i32, midi_channel));
-                                            }
-                                            else if (128..=143).contains(&midi_msg_type) {
-                                                state.send_to_track_background_processor(track.uuid().to_string(), TrackBackgroundProcessorInwardEvent::StopNoteImmediate(jack_midi_event.data[1] as i32, midi_channel));
-                                            }
-                                            else if (176..=191).contains(&midi_msg_type) {
-                                                state.send_to_track_background_processor(track.uuid().to_string(), TrackBackgroundProcessorInwardEvent::PlayControllerImmediate(jack_midi_event.data[1] as i32, jack_midi_event.data[2] as i32, midi_channel));
-                                            }
-                                            else if (224..=239).contains(&midi_msg_type) {
-                                                state.send_to_track_background_processor(track.uuid().to_string(), TrackBackgroundProcessorInwardEvent::PlayPitchBendImmediate(jack_midi_event.data[1] as i32, jack_midi_event.data[2] as i32, midi_channel));
-                                            }
-                                            else {
-                                                print!("Unknown jack midi event: ");
-                                                for event_byte in jack_midi_event.data.iter() {
-                                                    print!(" {}", event_byte);
-                                                }
-                                                println!();
-                                            }
-                                        },
-                                        None => (),
-                                    };
-                                },
-                                None => info!("Play note immediate: no track number given."),
-                            }
-                        },
-                        Err(_) => info!("Main - rx_ui processing loop - play note immediate - could not get lock on state"),
-                    };
                     let mut selected_riff_uuid = None;
                     let mut selected_riff_track_uuid = None;
                     match state.lock() {
@@ -5543,7 +5545,7 @@ fn process_jack_events(tx_from_ui: &Sender<DAWEvents>,
 
                                 match selected_riff_track_uuid {
                                     Some(track_uuid) => {
-                                        match state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == *track_uuid) {
+                                        match state.track_mut(&*track_uuid) {
                                             Some(track_type) => match track_type {
                                                 TrackType::InstrumentTrack(track) => {
                                                     match selected_riff_uuid {
@@ -5619,79 +5621,7 @@ fn process_jack_events(tx_from_ui: &Sender<DAWEvents>,
                     // gui.ui.piano_roll_drawing_area.queue_draw();
                 }
                 AudioLayerOutwardEvent::PlayPositionInFrames(play_position_in_frames) => {
-                    match state.lock() {
-                        Ok(mut state) => {
-                            let bpm = state.get_project().song().tempo();
-                            let time_signature_numerator = state.get_project().song().time_signature_numerator();
-                            let sample_rate = state.get_project().song().sample_rate();
-                            let play_position_in_beats = play_position_in_frames as f64 / sample_rate * bpm / 60.0;
-
-                            let current_bar = play_position_in_beats as i32 / time_signature_numerator as i32 + 1;
-                            let current_beat_in_bar = play_position_in_beats as i32 % time_signature_numerator as i32 + 1;
-
-                            gui.ui.song_position_txt_ctrl.set_label(format!("{:03}:{:03}:000", current_bar, current_beat_in_bar).as_str());
-
-                            // info!("Play position in frames: {}", play_position_in_frames);
-                            state.set_play_position_in_frames(play_position_in_frames);
-                            if let Some(piano_roll_grid) = gui.piano_roll_grid() {
-                                match piano_roll_grid.lock() {
-                                    Ok(mut grid) => grid.set_track_cursor_time_in_beats(play_position_in_beats),
-                                    Err(_) => (),
-                                }
-                            }
-                            if let Some(track_grid) = gui.track_grid() {
-                                match track_grid.lock() {
-                                    Ok(mut grid) => grid.set_track_cursor_time_in_beats(play_position_in_beats),
-                                    Err(_) => (),
-                                }
-                            }
-                            if let Some(sample_roll_grid) = gui.sample_roll_grid() {
-                                match sample_roll_grid.lock() {
-                                    Ok(mut grid) => grid.set_track_cursor_time_in_beats(play_position_in_beats),
-                                    Err(_) => (),
-                                }
-                            }
-                            if let Some(automation_grid) = gui.automation_grid() {
-                                match automation_grid.lock() {
-                                    Ok(mut grid) => grid.set_track_cursor_time_in_beats(play_position_in_beats),
-                                    Err(_) => (),
-                                }
-                            }
-
-                            if state.track_grid_cursor_follow() {
-                                if let Some(track_grid_arc) = gui.track_grid() {
-                                    if let Ok(track_grid) = track_grid_arc.lock() {
-                                        let adjusted_beat_width_in_pixels = track_grid.beat_width_in_pixels() * track_grid.zoom_horizontal();
-                                        let play_position_in_pixels = play_position_in_beats * adjusted_beat_width_in_pixels;
-                                        let track_grid_width = gui.ui.track_drawing_area.width_request() as f64;
-                                        let track_grid_horiz_adj: Adjustment = gui.ui.track_grid_scrolled_window.hadjustment();
-                                        let range_max = track_grid_horiz_adj.upper();
-                                        let track_grid_horiz_scroll_position = play_position_in_pixels / track_grid_width * range_max;
-
-                                        track_grid_horiz_adj.set_value(track_grid_horiz_scroll_position - 300.0);
-                                    }
-                                    else {
-                                        info!("Couldn't lock the track_grid");
-                                    }
-                                }
-                                else {
-                                    info!("Couldn't get the track_grid");
-                                }
-                            }
-
-                            if let Some(riff_set_uuid) = state.playing_riff_set() {
-                                gui.repaint_riff_set_view_riff_set_active_drawing_areas(riff_set_uuid.as_str(), play_position_in_beats);
-                            }
-                            // else {
-                            //     // info!("Not playing riff set");
-                            // }
-                        },
-                        Err(_) => info!("Main - rx_ui processing loop - play position - could not get lock on state"),
-                    }
-                    gui.ui.piano_roll_drawing_area.queue_draw();
-                    gui.ui.sample_roll_drawing_area.queue_draw();
-                    gui.ui.track_drawing_area.queue_draw();
-                    gui.ui.automation_drawing_area.queue_draw();
+                    coalesced_gui_updates.play_position_in_frames = Some(play_position_in_frames);
                 }
                 AudioLayerOutwardEvent::GeneralMMCEvent(mmc_sysex_bytes) => {
                     info!("Midi generic MMC event: ");
@@ -5744,25 +5674,13 @@ fn process_jack_events(tx_from_ui: &Sender<DAWEvents>,
                                 } else if track_riffs_stack_visible_name == "Riffs" {
                                     let riffs_stack_visible_name = gui.get_riffs_stack_visible_name();
                                     if riffs_stack_visible_name == "riff_sets" {
-                                        let riff_set_uuid = if let Some(riff_set) = state.get_project().song_mut().riff_sets_mut().get_mut(riff_thing_index) {
-                                            riff_set.uuid()
-                                        } else {
-                                            "".to_string()
-                                        };
+                                        let riff_set_uuid = state.project().song().riff_sets().get(riff_thing_index).map(|riff_set| riff_set.uuid()).unwrap_or_default();
                                         state.play_riff_set(tx_to_audio.clone(), riff_set_uuid);
                                     } else if riffs_stack_visible_name == "riff_sequences" {
-                                        let riff_sequence_uuid = if let Some(riff_sequence) = state.get_project().song_mut().riff_sequences_mut().get_mut(riff_thing_index) {
-                                            riff_sequence.uuid()
-                                        } else {
-                                            "".to_string()
-                                        };
+                                        let riff_sequence_uuid = state.project().song().riff_sequences().get(riff_thing_index).map(|riff_sequence| riff_sequence.uuid()).unwrap_or_default();
                                         state.play_riff_sequence(tx_to_audio.clone(), riff_sequence_uuid);
                                     } else if riffs_stack_visible_name == "riff_arrangement" {
-                                        let riff_arrangement_uuid = if let Some(riff_arrangement) = state.get_project().song_mut().riff_arrangements_mut().get_mut(riff_thing_index) {
-                                            riff_arrangement.uuid()
-                                        } else {
-                                            "".to_string()
-                                        };
+                                        let riff_arrangement_uuid = state.project().song().riff_arrangements().get(riff_thing_index).map(|riff_arrangement| riff_arrangement.uuid()).unwrap_or_default();
                                         state.play_riff_arrangement(tx_to_audio.clone(), riff_arrangement_uuid);
                                     }
                                 }
@@ -5791,10 +5709,23 @@ fn process_jack_events(tx_from_ui: &Sender<DAWEvents>,
                         Err(_) => {}
                     }
                 }
+                AudioLayerOutwardEvent::AudioFormat(block_size, sample_rate) => {
+                    match state.lock() {
+                        Ok(mut state) => {
+                            if state.set_audio_format(block_size, sample_rate) {
+                                info!("Audio format is now {} frames per block at {}Hz.", block_size, sample_rate);
+                                state.rebuild_playing_event_blocks(tx_to_audio.clone());
+                            }
+                        }
+                        Err(_) => {}
+                    }
+                }
                 AudioLayerOutwardEvent::JackRestartRequired => {
                     match state.lock() {
                         Ok(mut state) => {
                             state.restart_jack(rx_to_audio.clone(), jack_midi_sender.clone(), jack_audio_coast.clone(), vst_host_time_info.clone());
+                            // the restarted audio layer may not know the selected track so it is sent again
+                            *live_midi_input_track = None;
                         }
                         Err(_) => {}
                     }
@@ -5808,62 +5739,61 @@ fn process_jack_events(tx_from_ui: &Sender<DAWEvents>,
                     }
                 }
                 AudioLayerOutwardEvent::MasterChannelLevels(left_channel_level, right_channel_level) => {
-                    if let Some(master_mixer_blade_widget) = gui.ui.mixer_box.children().first() {
-                        if let Some(master_mixer_blade) = master_mixer_blade_widget.dynamic_cast_ref::<Frame>() {
-                            if let Some(master_mixer_blade_box_widget) = master_mixer_blade.children().first() {
-                                if let Some(master_mixer_blade_box) = master_mixer_blade_box_widget.dynamic_cast_ref::<gtk::Box>() {
-                                        for child in master_mixer_blade_box.children().iter() {
-                                            if child.widget_name() == "mixer_blade_volume_box" {
-                                                if let Some(volume_box) = child.dynamic_cast_ref::<gtk::Box>() {
-                                                    if let Some(channel_meter_box_widget) = volume_box.children().get(1) {
-                                                        if let Some(channel_meter_box) = channel_meter_box_widget.dynamic_cast_ref::<gtk::Box>() {
-                                                            if let Some(left_channel_spin_button_widget) = channel_meter_box.children().get_mut(1) {
-                                                                if let Some(left_channel_spin_button) = left_channel_spin_button_widget.dynamic_cast_ref::<SpinButton>() {
-                                                                    left_channel_spin_button.set_value((left_channel_level.abs().log10() * 20.0) as f64);
-                                                                }
-                                                            }
-                                                            if let Some(right_channel_spin_button_widget) = channel_meter_box.children().get_mut(2) {
-                                                                if let Some(right_channel_spin_button) = right_channel_spin_button_widget.dynamic_cast_ref::<SpinButton>() {
-                                                                    right_channel_spin_button.set_value((right_channel_level.abs().log10() * 20.0) as f64);
-                                                                }
-                                                            }
-                                                            if let Some(channel_meter_levels_drawing_area_widget) = channel_meter_box.children().get_mut(0) {
-                                                                if let Some(channel_meter_levels_drawing_area) = channel_meter_levels_drawing_area_widget.dynamic_cast_ref::<DrawingArea>() {
-                                                                    channel_meter_levels_drawing_area.queue_draw();
-                                                                }
-                                                            }
-                                                        }
-                                                    }
-                                                }
-                                                break;
-                                            }
-                                        }
-                                }
-                            }
+                    coalesced_gui_updates.master_channel_levels = Some((left_channel_level, right_channel_level));
+                },
+                AudioLayerOutwardEvent::Problem(problem) => {
+                    let message = match problem {
+                        AudioLayerProblem::NoFreeSlot(rejected_item) => {
+                            let track_uuid = match &rejected_item {
+                                AudioLayerRetiredItem::AudioConsumer(consumer_detail) => consumer_detail.track_id().to_string(),
+                                AudioLayerRetiredItem::MidiConsumer(consumer_detail) => consumer_detail.track_uuid().to_string(),
+                                AudioLayerRetiredItem::LiveMidiProducer(producer_detail) => producer_detail.track_uuid().to_string(),
+                                _ => String::new(),
+                            };
+                            let track_name = match state.lock() {
+                                Ok(state) => state.project().song().tracks().iter()
+                                    .find(|track| track.uuid().to_string() == track_uuid)
+                                    .map_or(track_uuid.clone(), |track| track.name().to_string()),
+                                Err(_) => track_uuid.clone(),
+                            };
+                            format!("Track \"{}\" can't be heard - the audio layer has no room for any more tracks.", track_name)
                         }
-                    }
+                        AudioLayerProblem::RetiredItemLeaked => "The audio layer could not hand everything it had finished with back in time - some memory has been leaked.".to_string(),
+                    };
+                    error!("Main - audio layer problem: {}", message);
+                    let _ = tx_from_ui.send(DAWEvents::Notification(NotificationType::Error, message));
                 },
             }
         },
-        Err(_) => (),
+        Err(_) => return false,
     }
+
+    true
 }
 
 fn process_track_background_processor_events(
     vst_audio_plugin_windows: &mut HashMap<String, Window>,
     state: &mut Arc<Mutex<DAWState>>,
     gui: &mut MainWindow,
-) {
+    gui_pump: &mut GuiPump,
+    coalesced_gui_updates: &mut CoalescedGuiUpdates,
+) -> bool {
+    let mut received = false;
     match state.lock() {
         Ok(mut state) => {
+            gui_pump.watch_track_receivers(state.instrument_track_receivers());
             let mut track_to_plugins_to_plugin_params_map = HashMap::new();
             let mut track_render_audio_consumers = HashMap::new();
             let mut track_instrument_names = HashMap::new();
             let mut automation_event = None;
             let mut automation_track_uuid = "".to_string();
+            let mut track_preset_data = vec![];
+            let mut track_plugin_latencies = vec![];
             state.instrument_track_receivers().iter().for_each(|(track_uuid, receiver)| {
                 let mut plugins_to_plugin_params_map = HashMap::new();
-                match receiver.try_recv() {
+                let event = receiver.try_recv();
+                received |= event.is_ok();
+                match event {
                     Ok(event) => match event {
                         TrackBackgroundProcessorOutwardEvent::InstrumentParameters(instrument_parameters) => {
                             let mut parameter_details = vec![];
@@ -5903,7 +5833,12 @@ fn process_track_background_processor_events(
                             });
                             plugins_to_plugin_params_map.insert(plugin_uuid, parameter_details);
                         },
-                        TrackBackgroundProcessorOutwardEvent::GetPresetData(_, _) => (),
+                        TrackBackgroundProcessorOutwardEvent::GetPresetData(instrument_preset, effect_presets) => {
+                            track_preset_data.push((track_uuid.clone(), instrument_preset, effect_presets));
+                        },
+                        TrackBackgroundProcessorOutwardEvent::PluginLatency(plugin_latency) => {
+                            track_plugin_latencies.push((track_uuid.clone(), plugin_latency));
+                        },
                         TrackBackgroundProcessorOutwardEvent::InstrumentPluginWindowSize(track_uuid, plugin_window_width, plugin_window_height) => {
                             state.project().song().tracks().iter().for_each(|track_type| {
                                 match track_type {
@@ -5955,45 +5890,9 @@ fn process_track_background_processor_events(
                             track_render_audio_consumers.insert(track_render_audio_consumer.track_id().to_string(), track_render_audio_consumer);
                         }
                         TrackBackgroundProcessorOutwardEvent::ChannelLevels(track_uuid, left_channel_level, right_channel_level) => {
-                            // println!("Track: {}, left: {}, left in db: {}, right: {}, right in db: {}", track_uuid.as_str(), left_channel_level, left_channel_level.abs().log10() * 20.0, right_channel_level, right_channel_level.abs().log10() * 20.0);
-                            for mixer_blade_widget in gui.ui.mixer_box.children().iter() {
-                                if mixer_blade_widget.widget_name() == track_uuid.as_str() {
-                                    if let Some(mixer_blade) = mixer_blade_widget.dynamic_cast_ref::<Frame>() {
-                                        if let Some(mixer_blade_box_widget) = mixer_blade.children().first() {
-                                            if let Some(mixer_blade_box) = mixer_blade_box_widget.dynamic_cast_ref::<gtk::Box>() {
-                                                    for child in mixer_blade_box.children().iter() {
-                                                        if child.widget_name() == "mixer_blade_volume_box" {
-                                                            if let Some(volume_box) = child.dynamic_cast_ref::<gtk::Box>() {
-                                                                if let Some(channel_meter_box_widget) = volume_box.children().get(1) {
-                                                                    if let Some(channel_meter_box) = channel_meter_box_widget.dynamic_cast_ref::<gtk::Box>() {
-                                                                        if let Some(left_channel_spin_button_widget) = channel_meter_box.children().get_mut(1) {
-                                                                            if let Some(left_channel_spin_button) = left_channel_spin_button_widget.dynamic_cast_ref::<SpinButton>() {
-                                                                                left_channel_spin_button.set_value((left_channel_level.abs().log10() * 20.0) as f64);
-                                                                            }
-                                                                        }
-                                                                        if let Some(right_channel_spin_button_widget) = channel_meter_box.children().get_mut(2) {
-                                                                            if let Some(right_channel_spin_button) = right_channel_spin_button_widget.dynamic_cast_ref::<SpinButton>() {
-                                                                                right_channel_spin_button.set_value((right_channel_level.abs().log10() * 20.0) as f64);
-                                                                            }
-                                                                        }
-                                                                        if let Some(channel_meter_levels_drawing_area_widget) = channel_meter_box.children().get_mut(0) {
-                                                                            if let Some(channel_meter_levels_drawing_area) = channel_meter_levels_drawing_area_widget.dynamic_cast_ref::<DrawingArea>() {
-                                                                                channel_meter_levels_drawing_area.queue_draw();
-                                                                            }
-                                                                        }
-                                                                    }
-                                                                }
-                                                            }
-                                                            break;
-                                                        }
-                                                    }
-                                            }
-                                        }
-                                    }
-                                    break;
-                                }
-                            }
+                            coalesced_gui_updates.track_channel_levels.insert(track_uuid, (left_channel_level, right_channel_level));
                         },
+                        TrackBackgroundProcessorOutwardEvent::RetiredDelayCompensator(_) => (), // freed here rather than on the track's worker
                     },
                     Err(_) => (),
                 }
@@ -6003,6 +5902,12 @@ fn process_track_background_processor_events(
                 }
             });
             let state = &mut state;
+            for (track_uuid, instrument_preset, effect_presets) in track_preset_data {
+                state.apply_track_preset_data(track_uuid.as_str(), instrument_preset, effect_presets);
+            }
+            for (track_uuid, plugin_latency) in track_plugin_latencies {
+                state.set_track_plugin_latency(track_uuid, plugin_latency);
+            }
             track_to_plugins_to_plugin_params_map.iter_mut().for_each(|(track_uuid, plugins_to_plugin_params_map)| {
                 let mut plugins_to_plugin_params_map_copy = HashMap::new();
                 plugins_to_plugin_params_map.iter().for_each(|(plugin_uuid, plugin_params_orig)| {
@@ -6036,31 +5941,33 @@ fn process_track_background_processor_events(
                 }
             }
 
-            // find the track
-            state.get_project().song_mut().tracks_mut().iter_mut().for_each(|track_type| {
-                match track_type {
-                    TrackType::InstrumentTrack(track) => {
-                        if automation_track_uuid == track.uuid().to_string() {
-                            if let Some(event) = automation_event.clone() {
-                                track.automation_mut().events_mut().push(event);
+            // find the track - only asking for the project mutably if there is something to add so the grids' cached drawing isn't thrown away
+            if automation_event.is_some() {
+                state.get_project().song_mut().tracks_mut().iter_mut().for_each(|track_type| {
+                    match track_type {
+                        TrackType::InstrumentTrack(track) => {
+                            if automation_track_uuid == track.uuid().to_string() {
+                                if let Some(event) = automation_event.clone() {
+                                    track.automation_mut().events_mut().push(event);
+                                }
                             }
                         }
-                    }
-                    TrackType::AudioTrack(track) => {
-                        if automation_track_uuid == track.uuid().to_string() {
-                            if let Some(event) = automation_event.clone() {
-                                track.automation_mut().events_mut().push(event);
+                        TrackType::AudioTrack(track) => {
+                            if automation_track_uuid == track.uuid().to_string() {
+                                if let Some(event) = automation_event.clone() {
+                                    track.automation_mut().events_mut().push(event);
+                                }
                             }
                         }
+                        _ => {}
                     }
-                    _ => {}
-                }
-            });
+                });
+            }
 
             // change the track instrument name
             for (track_uuid, name) in track_instrument_names.iter() {
                 info!("Trying to change instrument name: track={}, instrument name={}", track_uuid.clone(), name);
-                if let Some(track_type) = state.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid.clone()) {
+                if let Some(track_type) = state.track_mut(&track_uuid) {
                     match track_type {
                         TrackType::InstrumentTrack(track) => {
                             track.instrument_mut().set_name(name.clone());
@@ -6072,4 +5979,206 @@ fn process_track_background_processor_events(
         },
         Err(_) => (),
     }
+
+    received
+}
+
+/// Show the latest play position and levels - called at most once per display refresh.
+fn apply_coalesced_gui_updates(gui: &mut MainWindow, state: &mut Arc<Mutex<DAWState>>, coalesced_gui_updates: &mut CoalescedGuiUpdates) {
+    if let Some(play_position_in_frames) = coalesced_gui_updates.play_position_in_frames.take() {
+        update_play_position(gui, state, play_position_in_frames);
+    }
+    if let Some((left_channel_level, right_channel_level)) = coalesced_gui_updates.master_channel_levels.take() {
+        update_master_channel_levels(gui, left_channel_level, right_channel_level);
+    }
+    for (track_uuid, (left_channel_level, right_channel_level)) in coalesced_gui_updates.track_channel_levels.drain() {
+        update_track_channel_levels(gui, track_uuid.as_str(), left_channel_level, right_channel_level);
+    }
+    if coalesced_gui_updates.last_telemetry_refresh.map_or(true, |last_telemetry_refresh| last_telemetry_refresh.elapsed() >= Duration::from_millis(MIXER_BLADE_TELEMETRY_REFRESH_INTERVAL_IN_MILLISECONDS)) {
+        coalesced_gui_updates.last_telemetry_refresh = Some(Instant::now());
+        update_mixer_blade_telemetry(gui);
+    }
+}
+
+/// Show each track's processing load and how often it has fallen behind the jack layer in its mixer blade.
+fn update_mixer_blade_telemetry(gui: &mut MainWindow) {
+    for mixer_blade_widget in gui.ui.mixer_box.children().iter() {
+        if let Some(track_telemetry) = telemetry().find_track(mixer_blade_widget.widget_name().as_str()) {
+            if let Some(mixer_blade) = mixer_blade_widget.dynamic_cast_ref::<Frame>() {
+                if let Some(mixer_blade_box_widget) = mixer_blade.children().first() {
+                    if let Some(mixer_blade_box) = mixer_blade_box_widget.dynamic_cast_ref::<gtk::Box>() {
+                        for child in mixer_blade_box.children().iter() {
+                            if child.widget_name() == "mixer_blade_dsp_load_label" {
+                                if let Some(dsp_load_label) = child.dynamic_cast_ref::<Label>() {
+                                    let underruns = track_telemetry.underruns.load(std::sync::atomic::Ordering::Relaxed);
+                                    let text = if underruns > 0 {
+                                        format!("DSP {:.0}% ({:.0}%)\n{} late", track_telemetry.load() * 100.0, track_telemetry.peak_load() * 100.0, underruns)
+                                    }
+                                    else {
+                                        format!("DSP {:.0}% ({:.0}%)", track_telemetry.load() * 100.0, track_telemetry.peak_load() * 100.0)
+                                    };
+                                    dsp_load_label.set_text(text.as_str());
+                                }
+                                break;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+fn update_play_position(gui: &mut MainWindow, state: &mut Arc<Mutex<DAWState>>, play_position_in_frames: u32) {
+    match state.lock() {
+        Ok(mut state) => {
+            let bpm = state.project().song().tempo();
+            let time_signature_numerator = state.project().song().time_signature_numerator();
+            let sample_rate = state.project().song().sample_rate();
+            let play_position_in_beats = play_position_in_frames as f64 / sample_rate * bpm / 60.0;
+
+            let current_bar = play_position_in_beats as i32 / time_signature_numerator as i32 + 1;
+            let current_beat_in_bar = play_position_in_beats as i32 % time_signature_numerator as i32 + 1;
+
+            gui.ui.song_position_txt_ctrl.set_label(format!("{:03}:{:03}:000", current_bar, current_beat_in_bar).as_str());
+
+            // info!("Play position in frames: {}", play_position_in_frames);
+            state.set_play_position_in_frames(play_position_in_frames);
+            if let Some(piano_roll_grid) = gui.piano_roll_grid() {
+                match piano_roll_grid.lock() {
+                    Ok(mut grid) => grid.set_track_cursor_time_in_beats(play_position_in_beats),
+                    Err(_) => (),
+                }
+            }
+            if let Some(track_grid) = gui.track_grid() {
+                match track_grid.lock() {
+                    Ok(mut grid) => grid.set_track_cursor_time_in_beats(play_position_in_beats),
+                    Err(_) => (),
+                }
+            }
+            if let Some(sample_roll_grid) = gui.sample_roll_grid() {
+                match sample_roll_grid.lock() {
+                    Ok(mut grid) => grid.set_track_cursor_time_in_beats(play_position_in_beats),
+                    Err(_) => (),
+                }
+            }
+            if let Some(automation_grid) = gui.automation_grid() {
+                match automation_grid.lock() {
+                    Ok(mut grid) => grid.set_track_cursor_time_in_beats(play_position_in_beats),
+                    Err(_) => (),
+                }
+            }
+
+            if state.track_grid_cursor_follow() {
+                if let Some(track_grid_arc) = gui.track_grid() {
+                    if let Ok(track_grid) = track_grid_arc.lock() {
+                        let adjusted_beat_width_in_pixels = track_grid.beat_width_in_pixels() * track_grid.zoom_horizontal();
+                        let play_position_in_pixels = play_position_in_beats * adjusted_beat_width_in_pixels;
+                        let track_grid_width = gui.ui.track_drawing_area.width_request() as f64;
+                        let track_grid_horiz_adj: Adjustment = gui.ui.track_grid_scrolled_window.hadjustment();
+                        let range_max = track_grid_horiz_adj.upper();
+                        let track_grid_horiz_scroll_position = play_position_in_pixels / track_grid_width * range_max;
+
+                        track_grid_horiz_adj.set_value(track_grid_horiz_scroll_position - 300.0);
+                    }
+                    else {
+                        info!("Couldn't lock the track_grid");
+                    }
+                }
+                else {
+                    info!("Couldn't get the track_grid");
+                }
+            }
+
+            if let Some(riff_set_uuid) = state.playing_riff_set() {
+                gui.repaint_riff_set_view_riff_set_active_drawing_areas(riff_set_uuid.as_str(), play_position_in_beats);
+            }
+            // else {
+            //     // info!("Not playing riff set");
+            // }
+        },
+        Err(_) => info!("Main - rx_ui processing loop - play position - could not get lock on state"),
+    }
+    gui.ui.piano_roll_drawing_area.queue_draw();
+    gui.ui.sample_roll_drawing_area.queue_draw();
+    gui.ui.track_drawing_area.queue_draw();
+    gui.ui.automation_drawing_area.queue_draw();
+}
+
+fn update_master_channel_levels(gui: &mut MainWindow, left_channel_level: f32, right_channel_level: f32) {
+    if let Some(master_mixer_blade_widget) = gui.ui.mixer_box.children().first() {
+        if let Some(master_mixer_blade) = master_mixer_blade_widget.dynamic_cast_ref::<Frame>() {
+            if let Some(master_mixer_blade_box_widget) = master_mixer_blade.children().first() {
+                if let Some(master_mixer_blade_box) = master_mixer_blade_box_widget.dynamic_cast_ref::<gtk::Box>() {
+                        for child in master_mixer_blade_box.children().iter() {
+                            if child.widget_name() == "mixer_blade_volume_box" {
+                                if let Some(volume_box) = child.dynamic_cast_ref::<gtk::Box>() {
+                                    if let Some(channel_meter_box_widget) = volume_box.children().get(1) {
+                                        if let Some(channel_meter_box) = channel_meter_box_widget.dynamic_cast_ref::<gtk::Box>() {
+                                            if let Some(left_channel_spin_button_widget) = channel_meter_box.children().get_mut(1) {
+                                                if let Some(left_channel_spin_button) = left_channel_spin_button_widget.dynamic_cast_ref::<SpinButton>() {
+                                                    left_channel_spin_button.set_value((left_channel_level.abs().log10() * 20.0) as f64);
+                                                }
+                                            }
+                                            if let Some(right_channel_spin_button_widget) = channel_meter_box.children().get_mut(2) {
+                                                if let Some(right_channel_spin_button) = right_channel_spin_button_widget.dynamic_cast_ref::<SpinButton>() {
+                                                    right_channel_spin_button.set_value((right_channel_level.abs().log10() * 20.0) as f64);
+                                                }
+                                            }
+                                            if let Some(channel_meter_levels_drawing_area_widget) = channel_meter_box.children().get_mut(0) {
+                                                if let Some(channel_meter_levels_drawing_area) = channel_meter_levels_drawing_area_widget.dynamic_cast_ref::<DrawingArea>() {
+                                                    channel_meter_levels_drawing_area.queue_draw();
+                                                }
+                                            }
+                                        }
+                                    }
+                                }
+                                break;
+                            }
+                        }
+                }
+            }
+        }
+    }
+}
+
+fn update_track_channel_levels(gui: &mut MainWindow, track_uuid: &str, left_channel_level: f32, right_channel_level: f32) {
+    // println!("Track: {}, left: {}, left in db: {}, right: {}, right in db: {}", track_uuid, left_channel_level, left_channel_level.abs().log10() * 20.0, right_channel_level, right_channel_level.abs().log10() * 20.0);
+    for mixer_blade_widget in gui.ui.mixer_box.children().iter() {
+        if mixer_blade_widget.widget_name() == track_uuid {
+            if let Some(mixer_blade) = mixer_blade_widget.dynamic_cast_ref::<Frame>() {
+                if let Some(mixer_blade_box_widget) = mixer_blade.children().first() {
+                    if let Some(mixer_blade_box) = mixer_blade_box_widget.dynamic_cast_ref::<gtk::Box>() {
+                            for child in mixer_blade_box.children().iter() {
+                                if child.widget_name() == "mixer_blade_volume_box" {
+                                    if let Some(volume_box) = child.dynamic_cast_ref::<gtk::Box>() {
+                                        if let Some(channel_meter_box_widget) = volume_box.children().get(1) {
+                                            if let Some(channel_meter_box) = channel_meter_box_widget.dynamic_cast_ref::<gtk::Box>() {
+                                                if let Some(left_channel_spin_button_widget) = channel_meter_box.children().get_mut(1) {
+                                                    if let Some(left_channel_spin_button) = left_channel_spin_button_widget.dynamic_cast_ref::<SpinButton>() {
+                                                        left_channel_spin_button.set_value((left_channel_level.abs().log10() * 20.0) as f64);
+                                                    }
+                                                }
+                                                if let Some(right_channel_spin_button_widget) = channel_meter_box.children().get_mut(2) {
+                                                    if let Some(right_channel_spin_button) = right_channel_spin_button_widget.dynamic_cast_ref::<SpinButton>() {
+                                                        right_channel_spin_button.set_value((right_channel_level.abs().log10() * 20.0) as f64);
+                                                    }
+                                                }
+                                                if let Some(channel_meter_levels_drawing_area_widget) = channel_meter_box.children().get_mut(0) {
+                                                    if let Some(channel_meter_levels_drawing_area) = channel_meter_levels_drawing_area_widget.dynamic_cast_ref::<DrawingArea>() {
+                                                        channel_meter_levels_drawing_area.queue_draw();
+                                                    }
+                                                }
+                                            }
+                                        }
+                                    }
+                                    break;
+                                }
+                            }
+                    }
+                }
+            }
+            break;
+        }
+    }
 }
@@ -0,0 +1,169 @@
+use std::collections::{HashMap, HashSet};
+use std::sync::Arc;
+
+use crate::DAWUtils;
+use crate::domain::{EventBlocks, PluginParameter, Riff, RiffReference, TrackEvent};
+
+pub type TrackEventBlocks = (EventBlocks<TrackEvent>, EventBlocks<PluginParameter>);
+
+/// What a track's part of a schedule is compiled from. The riff versions change whenever a riff's events or length
+/// change and each riff set's length depends on the riffs of every track in it, so equal inputs mean the compiled
+/// blocks can be sent again as they are.
+#[derive(Clone, PartialEq)]
+pub struct TrackScheduleInputs {
+    pub tempo: f64,
+    pub sample_rate: f64,
+    pub block_size: f64,
+    pub midi_channel: i32,
+    pub riffs: Vec<Option<(String, u64)>>, // per riff set played in order - riff uuid, riff version
+    pub riff_set_lengths_in_beats: Vec<i32>, // per riff set played in order
+}
+
+/// Where a track's part of a schedule comes from when it is compiled.
+pub enum TrackScheduleSource {
+    Riffs(Vec<Riff>, Vec<RiffReference>), // the riffs played and where
+    Compiled(Option<Arc<TrackEventBlocks>>), // reused from the previous schedule - None if the track plays nothing
+}
+
+pub struct TrackScheduleLayout {
+    pub track_uuid: String,
+    pub inputs: TrackScheduleInputs,
+    pub source: TrackScheduleSource,
+}
+
+/// Everything needed to compile a schedule, detached from the state so that it can be compiled on another thread.
+pub struct PlaybackScheduleLayout {
+    pub length_in_beats: f64,
+    pub tracks: Vec<TrackScheduleLayout>,
+}
+
+impl PlaybackScheduleLayout {
+    pub fn compile(self) -> PlaybackSchedule {
+        let length_in_beats = self.length_in_beats;
+        let tracks = self.tracks.into_iter().map(|track| {
+            let event_blocks = match track.source {
+                TrackScheduleSource::Riffs(riffs, riff_refs) => {
+                    let automation: Vec<TrackEvent> = vec![];
+                    Some(Arc::new(DAWUtils::convert_to_event_blocks(&automation, &riffs, &riff_refs, track.inputs.tempo, track.inputs.block_size, track.inputs.sample_rate, length_in_beats, track.inputs.midi_channel)))
+                }
+                TrackScheduleSource::Compiled(event_blocks) => event_blocks,
+            };
+            TrackSchedule {
+                track_uuid: track.track_uuid,
+                inputs: track.inputs,
+                event_blocks,
+            }
+        }).collect();
+
+        PlaybackSchedule {
+            length_in_beats,
+            tracks,
+        }
+    }
+}
+
+pub struct TrackSchedule {
+    pub track_uuid: String,
+    pub inputs: TrackScheduleInputs,
+    pub event_blocks: Option<Arc<TrackEventBlocks>>, // None if the track plays nothing
+}
+
+/// A riff set, sequence or arrangement compiled into the event blocks each track plays.
+pub struct PlaybackSchedule {
+    pub length_in_beats: f64,
+    pub tracks: Vec<TrackSchedule>,
+}
+
+impl PlaybackSchedule {
+    /// True if the schedule was compiled from the given track inputs.
+    pub fn is_current(&self, inputs: &[(String, TrackScheduleInputs)]) -> bool {
+        self.tracks.len() == inputs.len() &&
+            self.tracks.iter().zip(inputs.iter()).all(|(track, (track_uuid, track_inputs))| track.track_uuid == *track_uuid && track.inputs == *track_inputs)
+    }
+
+    /// The compiled blocks for the track if they were compiled from the given inputs.
+    pub fn reusable_track(&self, track_uuid: &str, inputs: &TrackScheduleInputs) -> Option<Option<Arc<TrackEventBlocks>>> {
+        self.tracks.iter()
+            .find(|track| track.track_uuid == track_uuid && track.inputs == *inputs)
+            .map(|track| track.event_blocks.clone())
+    }
+}
+
+/// Compiled schedules by riff set, sequence or arrangement uuid, so that triggering one only has to send its blocks.
+/// Entries are checked against the current inputs when taken so an edit simply makes the next trigger recompile the
+/// tracks it touched.
+#[derive(Default)]
+pub struct PlaybackScheduleCache {
+    schedules: HashMap<String, Arc<PlaybackSchedule>>,
+    compiling: HashSet<String>, // compiles in progress in the background
+}
+
+impl PlaybackScheduleCache {
+    /// The schedule if there is one - current or not.
+    pub fn get(&self, uuid: &str) -> Option<Arc<PlaybackSchedule>> {
+        self.schedules.get(uuid).cloned()
+    }
+
+    pub fn insert(&mut self, uuid: String, schedule: Arc<PlaybackSchedule>) {
+        self.schedules.insert(uuid, schedule);
+    }
+
+    pub fn clear(&mut self) {
+        self.schedules.clear();
+    }
+
+    /// Marks a background compile of the schedule as started - false if one is already under way.
+    pub fn start_compiling(&mut self, uuid: String) -> bool {
+        self.compiling.insert(uuid)
+    }
+
+    /// Ends a background compile - the schedule is kept if it compiled.
+    pub fn finish_compiling(&mut self, uuid: &str, schedule: Option<Arc<PlaybackSchedule>>) {
+        self.compiling.remove(uuid);
+        if let Some(schedule) = schedule {
+            self.schedules.insert(uuid.to_string(), schedule);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::sync::Arc;
+
+    use crate::playback_schedule::{PlaybackScheduleLayout, TrackScheduleInputs, TrackScheduleLayout, TrackScheduleSource};
+
+    fn inputs(riff_version: u64) -> TrackScheduleInputs {
+        TrackScheduleInputs {
+            tempo: 140.0,
+            sample_rate: 44100.0,
+            block_size: 1024.0,
+            midi_channel: 0,
+            riffs: vec![Some(("riff".to_string(), riff_version))],
+            riff_set_lengths_in_beats: vec![4],
+        }
+    }
+
+    #[test]
+    fn reuses_tracks_compiled_from_the_same_inputs() {
+        let layout = PlaybackScheduleLayout {
+            length_in_beats: 4.0,
+            tracks: vec![
+                TrackScheduleLayout { track_uuid: "track".to_string(), inputs: inputs(1), source: TrackScheduleSource::Riffs(vec![], vec![]) },
+                TrackScheduleLayout { track_uuid: "empty track".to_string(), inputs: inputs(1), source: TrackScheduleSource::Compiled(None) },
+            ],
+        };
+        let schedule = layout.compile();
+
+        assert!(schedule.tracks[0].event_blocks.is_some());
+        assert!(schedule.tracks[1].event_blocks.is_none());
+        assert!(schedule.is_current(&[("track".to_string(), inputs(1)), ("empty track".to_string(), inputs(1))]));
+        assert!(!schedule.is_current(&[("track".to_string(), inputs(2)), ("empty track".to_string(), inputs(1))]));
+
+        let reused = schedule.reusable_track("track", &inputs(1)).unwrap().unwrap();
+        assert!(Arc::ptr_eq(&reused, schedule.tracks[0].event_blocks.as_ref().unwrap()));
+        assert!(schedule.reusable_track("track", &inputs(2)).is_none());
+        let mut longer_riff_set = inputs(1);
+        longer_riff_set.riff_set_lengths_in_beats = vec![8];
+        assert!(schedule.reusable_track("track", &longer_riff_set).is_none());
+    }
+}
@@ -0,0 +1,946 @@
+use std::collections::HashMap;
+use std::ffi::CString;
+use std::process::{Child, Command};
+use std::sync::{Arc, Mutex, mpsc::{channel, Receiver, Sender}};
+use std::sync::atomic::{AtomicU32, Ordering};
+use std::time::{Duration, Instant};
+
+use ipc_channel::ipc::{self, IpcOneShotServer, IpcReceiver, IpcSender};
+use log::*;
+use serde::{Deserialize, Serialize};
+use simple_clap_host_helper_lib::{host::DAWCallback, plugin::{ext::{params::Params, posix_fd_support::PosixFDSupport, timer_support::TimerSupport}, library::PluginLibrary}};
+use uuid::Uuid;
+use vst::{api::TimeInfo, buffer::{AudioBuffer, SendEventBuffer}, event::MidiEvent, host::{HostBuffer, PluginLoader}};
+
+use crate::constants::{CLAP, MAX_BLOCK_SIZE, PLUGIN_SANDBOX_ACCEPT_THREAD_NAME, PLUGIN_SANDBOX_ARGUMENT, PLUGIN_SANDBOX_BLOCK_TIMEOUT_IN_MILLISECONDS, PLUGIN_SANDBOX_IDLE_INTERVAL_IN_MILLISECONDS, PLUGIN_SANDBOX_INPUT_CHANNELS, PLUGIN_SANDBOX_MAX_MIDI_EVENTS, PLUGIN_SANDBOX_MAX_PARAMETER_CHANGES, PLUGIN_SANDBOX_OUTPUT_CHANNELS, PLUGIN_SANDBOX_REQUEST_TIMEOUT_IN_SECONDS, VST24};
+use crate::domain::{BackgroundProcessorAudioPlugin, BackgroundProcessorAudioPluginType, BackgroundProcessorClapAudioPlugin, BackgroundProcessorVst24AudioPlugin, PluginParameter, process_vst24_plugin_in_sub_blocks, TRACK_PROCESSING_HOST_BUFFER_CHANNELS, track_event_from_midi_bytes, TrackEvent, VstHost};
+use crate::event::AudioPluginHostOutwardEvent;
+
+/// Control traffic from the DAW to a plugin sandbox. Audio, midi and parameter changes for each block go through the
+/// shared memory instead.
+#[derive(Serialize, Deserialize, Debug)]
+pub enum PluginSandboxRequest {
+    Load(String, String, Option<String>, String, bool, usize, f64), // plugin uuid, library path, sub plugin id, plugin type, instrument, block size, sample rate
+    SetAudioFormat(usize, f64), // block size, sample rate
+    GetPresetData,
+    SetPresetData(String), // base64 preset data
+    GetParameters,
+    OpenEditor(u32), // xid of the DAW window to embed the editor in
+    Stop,            // not answered
+    Shutdown,        // not answered
+}
+
+/// Control traffic from a plugin sandbox to the DAW.
+#[derive(Serialize, Deserialize, Debug)]
+pub enum PluginSandboxResponse {
+    Loaded(String, usize), // plugin name, latency
+    Failed(String),        // reason
+    Latency(usize),        // latency after an audio format or preset change
+    PresetData(String),    // base64 preset data
+    Parameters(Vec<(i32, String, String, f32, String)>), // param index, param name, param label, param value, param text
+    WindowSize(i32, i32),  // width, height
+
+    // sent by the sandbox whenever the plugin asks for them
+    Automation(i32, f32),   // param index, param value - 0.0 to 1.0
+    ResizeWindow(i32, i32), // width, height
+}
+
+#[repr(C)]
+#[derive(Clone, Copy, Default)]
+struct SandboxMidiEvent {
+    delta_frames: u32,
+    data: [u8; 4], // midi bytes - the 4th is padding
+}
+
+#[repr(C)]
+#[derive(Clone, Copy, Default)]
+struct SandboxParameterChange {
+    frame: u32,
+    index: i32,
+    value: f32,
+}
+
+/// The shared memory each block goes through. The DAW fills in the inputs, bumps request and waits on response, the
+/// sandbox processes the block and sets response to the request. Both words are futexes so neither side spins. Only
+/// fixed size types are used so that a bridge host built for a different architecture sees the same layout.
+#[repr(C)]
+struct SandboxBlock {
+    request: AtomicU32,
+    response: AtomicU32,
+    frames: u32,
+    midi_event_count: u32,
+    parameter_change_count: u32,
+    _reserved: u32, // keeps the f64s 8 byte aligned for 32 bit hosts too
+    tempo: f64,
+    sample_position: f64,
+    ppq_position: f64,
+    inputs: [[f32; MAX_BLOCK_SIZE]; PLUGIN_SANDBOX_INPUT_CHANNELS],
+    outputs: [[f32; MAX_BLOCK_SIZE]; PLUGIN_SANDBOX_OUTPUT_CHANNELS],
+    midi_events: [SandboxMidiEvent; PLUGIN_SANDBOX_MAX_MIDI_EVENTS],
+    parameter_changes: [SandboxParameterChange; PLUGIN_SANDBOX_MAX_PARAMETER_CHANGES],
+}
+
+/// A posix shared memory mapping of a SandboxBlock. The DAW creates it (zero filled) and unlinks it when dropped.
+struct SandboxSharedMemory {
+    name: String,
+    block: *mut SandboxBlock,
+    owner: bool,
+}
+
+// only one side touches the non atomic parts of the block at a time
+unsafe impl Send for SandboxSharedMemory {}
+
+impl SandboxSharedMemory {
+    fn create(name: &str) -> anyhow::Result<Self> {
+        Self::map(name, true)
+    }
+
+    fn open(name: &str) -> anyhow::Result<Self> {
+        Self::map(name, false)
+    }
+
+    fn map(name: &str, create: bool) -> anyhow::Result<Self> {
+        let c_name = CString::new(name)?;
+        let size = std::mem::size_of::<SandboxBlock>();
+
+        unsafe {
+            let flags = if create { libc::O_CREAT | libc::O_EXCL | libc::O_RDWR } else { libc::O_RDWR };
+            let fd = libc::shm_open(c_name.as_ptr(), flags, 0o600);
+            if fd < 0 {
+                return Err(anyhow::anyhow!("could not open shared memory {}: {}", name, std::io::Error::last_os_error()));
+            }
+            if create && libc::ftruncate(fd, size as libc::off_t) != 0 {
+                let error = std::io::Error::last_os_error();
+                libc::close(fd);
+                libc::shm_unlink(c_name.as_ptr());
+                return Err(anyhow::anyhow!("could not size shared memory {}: {}", name, error));
+            }
+
+            let address = libc::mmap(std::ptr::null_mut(), size, libc::PROT_READ | libc::PROT_WRITE, libc::MAP_SHARED, fd, 0);
+            libc::close(fd);
+            if address == libc::MAP_FAILED {
+                let error = std::io::Error::last_os_error();
+                if create {
+                    libc::shm_unlink(c_name.as_ptr());
+                }
+                return Err(anyhow::anyhow!("could not map shared memory {}: {}", name, error));
+            }
+
+            Ok(Self { name: name.to_string(), block: address as *mut SandboxBlock, owner: create })
+        }
+    }
+
+    fn block(&self) -> &SandboxBlock {
+        unsafe { &*self.block }
+    }
+
+    fn block_mut(&mut self) -> &mut SandboxBlock {
+        unsafe { &mut *self.block }
+    }
+}
+
+impl Drop for SandboxSharedMemory {
+    fn drop(&mut self) {
+        unsafe {
+            libc::munmap(self.block as *mut libc::c_void, std::mem::size_of::<SandboxBlock>());
+            if self.owner {
+                if let Ok(c_name) = CString::new(self.name.as_str()) {
+                    libc::shm_unlink(c_name.as_ptr());
+                }
+            }
+        }
+    }
+}
+
+/// Sleep while the word still holds expected. Returns when woken, on the timeout or spuriously so callers re-check the
+/// word. Not a private futex because the word is shared between processes.
+fn futex_wait(word: &AtomicU32, expected: u32, timeout: Duration) {
+    let timeout = libc::timespec {
+        tv_sec: timeout.as_secs() as libc::time_t,
+        tv_nsec: timeout.subsec_nanos() as libc::c_long,
+    };
+    unsafe {
+        libc::syscall(libc::SYS_futex, word as *const AtomicU32, libc::FUTEX_WAIT, expected, &timeout as *const libc::timespec, std::ptr::null::<u32>(), 0);
+    }
+}
+
+fn futex_wake(word: &AtomicU32) {
+    unsafe {
+        libc::syscall(libc::SYS_futex, word as *const AtomicU32, libc::FUTEX_WAKE, i32::MAX, std::ptr::null::<libc::timespec>(), std::ptr::null::<u32>(), 0);
+    }
+}
+
+/// The DAW's end of a running sandbox process.
+struct PluginSandbox {
+    process: Child,
+    shared_memory: SandboxSharedMemory,
+    sender: IpcSender<PluginSandboxRequest>,
+    receiver: IpcReceiver<PluginSandboxResponse>,
+    request: u32,
+    events: Vec<PluginSandboxResponse>, // automation and resize requests received while waiting for a response
+}
+
+impl PluginSandbox {
+    fn start(host_executable: &str) -> anyhow::Result<Self> {
+        let shared_memory_name = format!("/riff-daw-sandbox-{}", Uuid::new_v4());
+        let shared_memory = SandboxSharedMemory::create(shared_memory_name.as_str())?;
+        let (server, server_name) = IpcOneShotServer::<(IpcSender<PluginSandboxRequest>, IpcReceiver<PluginSandboxResponse>)>::new()?;
+        let mut process = Command::new(host_executable)
+            .arg(PLUGIN_SANDBOX_ARGUMENT)
+            .arg(server_name.as_str())
+            .arg(shared_memory_name.as_str())
+            .spawn()?;
+
+        // accept blocks until the sandbox connects so wait for it on another thread in case it never does
+        let (tx_accepted, rx_accepted) = channel();
+        std::thread::Builder::new().name(PLUGIN_SANDBOX_ACCEPT_THREAD_NAME.to_string()).spawn(move || {
+            let _ = tx_accepted.send(server.accept().map(|(_, channels)| channels));
+        })?;
+
+        match rx_accepted.recv_timeout(Duration::from_secs(PLUGIN_SANDBOX_REQUEST_TIMEOUT_IN_SECONDS)) {
+            Ok(Ok((sender, receiver))) => Ok(Self { process, shared_memory, sender, receiver, request: 0, events: vec![] }),
+            Ok(Err(error)) => {
+                let _ = process.kill();
+                let _ = process.wait();
+                Err(anyhow::anyhow!("the plugin sandbox did not connect: {:?}", error))
+            }
+            Err(_) => {
+                let _ = process.kill();
+                let _ = process.wait();
+                // connect to the server ourselves so that the accept thread finishes
+                if let (Ok(bootstrap), Ok((sender, _)), Ok((_, receiver))) = (IpcSender::connect(server_name), ipc::channel::<PluginSandboxRequest>(), ipc::channel::<PluginSandboxResponse>()) {
+                    let _ = bootstrap.send((sender, receiver));
+                }
+                Err(anyhow::anyhow!("the plugin sandbox did not start in time"))
+            }
+        }
+    }
+
+    fn has_exited(&mut self) -> bool {
+        !matches!(self.process.try_wait(), Ok(None))
+    }
+
+    fn send(&mut self, request: PluginSandboxRequest) -> anyhow::Result<()> {
+        self.sender.send(request).map_err(|error| anyhow::anyhow!("could not send to the plugin sandbox: {:?}", error))
+    }
+
+    /// Send a request and wait for its response.
+    fn request(&mut self, request: PluginSandboxRequest) -> anyhow::Result<PluginSandboxResponse> {
+        self.send(request)?;
+        let start = Instant::now();
+        loop {
+            match self.receiver.try_recv() {
+                Ok(PluginSandboxResponse::Failed(reason)) => return Err(anyhow::anyhow!(reason)),
+                Ok(response @ PluginSandboxResponse::Automation(_, _)) | Ok(response @ PluginSandboxResponse::ResizeWindow(_, _)) => self.events.push(response),
+                Ok(response) => return Ok(response),
+                Err(_) => {
+                    if self.has_exited() {
+                        return Err(anyhow::anyhow!("the plugin sandbox exited"));
+                    }
+                    if start.elapsed() > Duration::from_secs(PLUGIN_SANDBOX_REQUEST_TIMEOUT_IN_SECONDS) {
+                        return Err(anyhow::anyhow!("the plugin sandbox did not respond"));
+                    }
+                    std::thread::sleep(Duration::from_millis(1));
+                }
+            }
+        }
+    }
+
+    /// Pick up automation and resize requests sent by the sandbox.
+    fn receive_events(&mut self) {
+        while let Ok(response) = self.receiver.try_recv() {
+            match response {
+                PluginSandboxResponse::Automation(_, _) | PluginSandboxResponse::ResizeWindow(_, _) => self.events.push(response),
+                _ => (),
+            }
+        }
+    }
+
+    /// Hand the block in the shared memory to the sandbox and wait until it has been processed.
+    fn process_block(&mut self) -> anyhow::Result<()> {
+        self.request = self.request.wrapping_add(1);
+        let request = self.request;
+        self.shared_memory.block().request.store(request, Ordering::Release);
+        futex_wake(&self.shared_memory.block().request);
+
+        let timeout = Duration::from_millis(PLUGIN_SANDBOX_BLOCK_TIMEOUT_IN_MILLISECONDS);
+        let start = Instant::now();
+        loop {
+            let response = self.shared_memory.block().response.load(Ordering::Acquire);
+            if response == request {
+                return Ok(());
+            }
+
+            let waited = start.elapsed();
+            if waited > timeout {
+                return Err(anyhow::anyhow!("the plugin sandbox did not process the block in time"));
+            }
+            // wake up now and again to notice a sandbox that has crashed rather than waiting out the timeout
+            futex_wait(&self.shared_memory.block().response, response, (timeout - waited).min(Duration::from_millis(PLUGIN_SANDBOX_IDLE_INTERVAL_IN_MILLISECONDS)));
+            if self.shared_memory.block().response.load(Ordering::Acquire) != request && self.has_exited() {
+                return Err(anyhow::anyhow!("the plugin sandbox exited"));
+            }
+        }
+    }
+
+    fn shutdown(&mut self) {
+        let _ = self.send(PluginSandboxRequest::Shutdown);
+        let start = Instant::now();
+        while !self.has_exited() {
+            if start.elapsed() > Duration::from_secs(PLUGIN_SANDBOX_REQUEST_TIMEOUT_IN_SECONDS) {
+                let _ = self.process.kill();
+                let _ = self.process.wait();
+                break;
+            }
+            std::thread::sleep(Duration::from_millis(PLUGIN_SANDBOX_IDLE_INTERVAL_IN_MILLISECONDS));
+        }
+    }
+
+    fn kill(&mut self) {
+        let _ = self.process.kill();
+        let _ = self.process.wait();
+    }
+}
+
+/// A plugin that runs in its own sandbox process so that it crashing or hanging only silences it rather than taking
+/// the DAW down. It can also run in a bridge host built for a different architecture.
+pub struct BackgroundProcessorSandboxedAudioPlugin {
+    uuid: Uuid,
+    track_uuid: String,
+    instrument: bool,
+    name: String,
+    xid: Option<u32>,
+    window_size: (i32, i32),
+    tempo: f64,
+    sample_rate: f64,
+    block_size: usize,
+    latency: usize,
+    preset_data: String, // the last preset data seen - kept so that a crashed plugin's preset is not lost when saving
+    sandbox: Option<PluginSandbox>, // none once the sandbox has failed
+    tx_from_host: Sender<AudioPluginHostOutwardEvent>,
+    rx_from_host: Receiver<AudioPluginHostOutwardEvent>,
+    pending_midi_events: Vec<SandboxMidiEvent>,
+}
+
+impl BackgroundProcessorAudioPlugin for BackgroundProcessorSandboxedAudioPlugin {
+    fn uuid(&self) -> Uuid {
+        self.uuid
+    }
+
+    fn uuid_mut(&mut self) -> Uuid {
+        self.uuid
+    }
+
+    fn name(&self) -> String {
+        self.name.clone()
+    }
+
+    fn xid(&self) -> Option<u32> {
+        self.xid
+    }
+
+    /// The editor is opened by the sandbox and embedded in the DAW's window.
+    fn set_xid(&mut self, xid: Option<u32>) {
+        self.xid = xid;
+        if let Some(xid) = xid {
+            if let Some(PluginSandboxResponse::WindowSize(width, height)) = self.request(PluginSandboxRequest::OpenEditor(xid)) {
+                self.window_size = (width, height);
+            }
+        }
+    }
+
+    fn xid_mut(&mut self) -> &mut Option<u32> {
+        &mut self.xid
+    }
+
+    fn get_window_size(&self) -> (i32, i32) {
+        self.window_size
+    }
+
+    fn rx_from_host(&self) -> &Receiver<AudioPluginHostOutwardEvent> {
+        &self.rx_from_host
+    }
+
+    fn rx_from_host_mut(&mut self) -> &mut Receiver<AudioPluginHostOutwardEvent> {
+        &mut self.rx_from_host
+    }
+
+    /// Handed to the sandbox with each block.
+    fn set_tempo(&mut self, tempo: f64) {
+        self.tempo = tempo;
+    }
+
+    fn tempo(&self) -> f64 {
+        self.tempo
+    }
+
+    fn stop_processing(&mut self) {
+        if let Some(sandbox) = self.sandbox.as_mut() {
+            let _ = sandbox.send(PluginSandboxRequest::Stop);
+        }
+    }
+
+    fn shutdown(&mut self) {
+        if let Some(mut sandbox) = self.sandbox.take() {
+            sandbox.shutdown();
+        }
+    }
+
+    fn preset_data(&mut self) -> String {
+        if let Some(PluginSandboxResponse::PresetData(preset_data)) = self.request(PluginSandboxRequest::GetPresetData) {
+            self.preset_data = preset_data;
+        }
+        self.preset_data.clone()
+    }
+
+    fn set_preset_data(&mut self, data: String) {
+        self.preset_data = data.clone();
+        if let Some(PluginSandboxResponse::Latency(latency)) = self.request(PluginSandboxRequest::SetPresetData(data)) {
+            self.latency = latency;
+        }
+    }
+
+    fn sample_rate(&self) -> f64 {
+        self.sample_rate
+    }
+
+    fn set_sample_rate(&mut self, sample_rate: f64) {
+        self.set_audio_format(self.block_size, sample_rate);
+    }
+
+    fn set_audio_format(&mut self, block_size: usize, sample_rate: f64) {
+        self.block_size = block_size;
+        self.sample_rate = sample_rate;
+        if let Some(PluginSandboxResponse::Latency(latency)) = self.request(PluginSandboxRequest::SetAudioFormat(block_size, sample_rate)) {
+            self.latency = latency;
+        }
+    }
+
+    fn latency(&self) -> usize {
+        self.latency
+    }
+}
+
+impl BackgroundProcessorSandboxedAudioPlugin {
+    pub fn new_with_uuid(
+        track_uuid: String,
+        uuid: Uuid,
+        sub_plugin_id: Option<String>,
+        library_path: String,
+        plugin_type: String,
+        instrument: bool,
+        host_executable: String,
+        block_size: usize,
+        sample_rate: f64,
+    ) -> Self {
+        let (tx_from_host, rx_from_host) = channel::<AudioPluginHostOutwardEvent>();
+        let mut plugin = Self {
+            uuid,
+            track_uuid,
+            instrument,
+            name: library_path.clone(),
+            xid: None,
+            window_size: (400, 300),
+            tempo: 140.0,
+            sample_rate,
+            block_size,
+            latency: 0,
+            preset_data: String::new(),
+            sandbox: None,
+            tx_from_host,
+            rx_from_host,
+            pending_midi_events: Vec::with_capacity(PLUGIN_SANDBOX_MAX_MIDI_EVENTS),
+        };
+
+        match PluginSandbox::start(host_executable.as_str()) {
+            Ok(sandbox) => {
+                plugin.sandbox = Some(sandbox);
+                if let Some(PluginSandboxResponse::Loaded(name, latency)) = plugin.request(PluginSandboxRequest::Load(uuid.to_string(), library_path.clone(), sub_plugin_id, plugin_type, instrument, block_size, sample_rate)) {
+                    info!("Loaded plugin {} in a sandbox: host={}", library_path, host_executable);
+                    plugin.name = name;
+                    plugin.latency = latency;
+                }
+            }
+            Err(error) => info!("Could not start a plugin sandbox for {}: {:?}", library_path, error),
+        }
+
+        plugin
+    }
+
+    /// Send a request to the sandbox and wait for the response. When the sandbox fails it is shut down and the plugin
+    /// is silent from then on.
+    fn request(&mut self, request: PluginSandboxRequest) -> Option<PluginSandboxResponse> {
+        let result = match self.sandbox.as_mut() {
+            Some(sandbox) => sandbox.request(request),
+            None => return None,
+        };
+        match result {
+            Ok(response) => Some(response),
+            Err(error) => {
+                self.fail(error);
+                None
+            }
+        }
+    }
+
+    fn fail(&mut self, error: anyhow::Error) {
+        info!("Plugin sandbox failed - silencing the plugin: track={}, plugin={}, name={}, error={:?}", self.track_uuid, self.uuid, self.name, error);
+        if let Some(mut sandbox) = self.sandbox.take() {
+            sandbox.kill();
+        }
+    }
+
+    /// Queue midi events to go to the plugin with the next block. Events must be for this block - positions are frames
+    /// into the block.
+    pub fn queue_midi_events(&mut self, midi_events: &[MidiEvent]) {
+        for midi_event in midi_events.iter() {
+            if self.pending_midi_events.len() < PLUGIN_SANDBOX_MAX_MIDI_EVENTS {
+                self.pending_midi_events.push(SandboxMidiEvent {
+                    delta_frames: midi_event.delta_frames.max(0) as u32,
+                    data: [midi_event.data[0], midi_event.data[1], midi_event.data[2], 0],
+                });
+            }
+        }
+    }
+
+    /// Relay automation and resize requests from the sandbox to the track like an in process plugin's host does.
+    pub fn handle_sandbox_events(&mut self) {
+        let events = match self.sandbox.as_mut() {
+            Some(sandbox) => {
+                sandbox.receive_events();
+                std::mem::take(&mut sandbox.events)
+            }
+            None => return,
+        };
+
+        for event in events.into_iter() {
+            let event = match event {
+                PluginSandboxResponse::Automation(param_index, param_value) => {
+                    AudioPluginHostOutwardEvent::Automation(self.track_uuid.clone(), self.uuid.to_string(), self.instrument, param_index, param_value)
+                }
+                PluginSandboxResponse::ResizeWindow(width, height) => {
+                    self.window_size = (width, height);
+                    AudioPluginHostOutwardEvent::SizeWindow(self.track_uuid.clone(), self.uuid.to_string(), self.instrument, width, height)
+                }
+                _ => continue,
+            };
+            match self.tx_from_host.send(event) {
+                Ok(_) => (),
+                Err(error) => info!("Problem relaying plugin sandbox event: {}", error),
+            }
+        }
+    }
+
+    /// The plugin's parameters: param index, param name, param label, param value, param text.
+    pub fn parameters(&mut self) -> Vec<(i32, String, String, f32, String)> {
+        match self.request(PluginSandboxRequest::GetParameters) {
+            Some(PluginSandboxResponse::Parameters(parameters)) => parameters,
+            _ => vec![],
+        }
+    }
+
+    /// Process a block in the sandbox. The main and side chain inputs go in and the main outputs come back. The
+    /// parameter change positions must be relative to the start of the block.
+    pub fn process<'a>(&mut self, audio_buffer: &mut AudioBuffer<f32>, parameter_changes: impl Iterator<Item = &'a PluginParameter>, sample_position: f64, ppq_position: f64) {
+        let frames = audio_buffer.samples().min(MAX_BLOCK_SIZE);
+        let (inputs, mut outputs) = audio_buffer.split();
+
+        let result = match self.sandbox.as_mut() {
+            Some(sandbox) => {
+                let block = sandbox.shared_memory.block_mut();
+                for channel in 0..PLUGIN_SANDBOX_INPUT_CHANNELS.min(inputs.len()) {
+                    block.inputs[channel][..frames].copy_from_slice(&inputs.get(channel)[..frames]);
+                }
+                block.frames = frames as u32;
+                block.tempo = self.tempo;
+                block.sample_position = sample_position;
+                block.ppq_position = ppq_position;
+
+                block.midi_events[..self.pending_midi_events.len()].copy_from_slice(self.pending_midi_events.as_slice());
+                block.midi_event_count = self.pending_midi_events.len() as u32;
+
+                let mut parameter_change_count = 0;
+                for (slot, change) in block.parameter_changes.iter_mut().zip(parameter_changes) {
+                    *slot = SandboxParameterChange { frame: change.position as u32, index: change.index, value: change.value };
+                    parameter_change_count += 1;
+                }
+                block.parameter_change_count = parameter_change_count;
+
+                sandbox.process_block()
+            }
+            None => Err(anyhow::anyhow!("no sandbox")),
+        };
+        self.pending_midi_events.clear();
+
+        match result {
+            Ok(_) => {
+                let block = self.sandbox.as_ref().unwrap().shared_memory.block();
+                for channel in 0..PLUGIN_SANDBOX_OUTPUT_CHANNELS.min(outputs.len()) {
+                    outputs.get_mut(channel)[..frames].copy_from_slice(&block.outputs[channel][..frames]);
+                }
+            }
+            Err(error) => {
+                for channel in 0..PLUGIN_SANDBOX_OUTPUT_CHANNELS.min(outputs.len()) {
+                    outputs.get_mut(channel).fill(0.0);
+                }
+                if self.sandbox.is_some() {
+                    self.fail(error);
+                }
+            }
+        }
+    }
+}
+
+impl Drop for BackgroundProcessorSandboxedAudioPlugin {
+    fn drop(&mut self) {
+        self.shutdown();
+    }
+}
+
+/// The plugin end of a sandbox - loads the plugin in process and processes the blocks handed to it.
+struct SandboxedPluginHost {
+    plugin: Option<BackgroundProcessorAudioPluginType>,
+    instrument: bool,
+    block_size: usize,
+    tempo: f64,
+    response_sender: IpcSender<PluginSandboxResponse>,
+    vst24_plugin_loaders: Arc<Mutex<HashMap<String, PluginLoader<VstHost>>>>,
+    clap_plugin_loaders: Arc<Mutex<HashMap<String, PluginLibrary>>>,
+    vst_host_time_info: Arc<parking_lot::RwLock<TimeInfo>>,
+    host_buffer: HostBuffer<f32>,
+    inputs: Vec<Vec<f32>>,
+    outputs: Vec<Vec<f32>>,
+    midi_sender: SendEventBuffer,
+    midi_events: Vec<MidiEvent>,
+    track_events: Vec<TrackEvent>,
+    parameter_changes: Vec<PluginParameter>,
+}
+
+impl SandboxedPluginHost {
+    fn new(response_sender: IpcSender<PluginSandboxResponse>) -> Self {
+        Self {
+            plugin: None,
+            instrument: false,
+            block_size: 0,
+            tempo: 0.0,
+            response_sender,
+            vst24_plugin_loaders: Arc::new(Mutex::new(HashMap::new())),
+            clap_plugin_loaders: Arc::new(Mutex::new(HashMap::new())),
+            vst_host_time_info: Arc::new(parking_lot::RwLock::new(TimeInfo {
+                sample_pos: 0.0,
+                sample_rate: 44100.0,
+                nanoseconds: 0.0,
+                ppq_pos: 0.0,
+                tempo: 140.0,
+                bar_start_pos: 0.0,
+                cycle_start_pos: 0.0,
+                cycle_end_pos: 0.0,
+                time_sig_numerator: 4,
+                time_sig_denominator: 4,
+                smpte_offset: 0,
+                smpte_frame_rate: vst::api::SmpteFrameRate::Smpte24fps,
+                samples_to_next_clock: 0,
+                flags: 3,
+            })),
+            host_buffer: HostBuffer::new(TRACK_PROCESSING_HOST_BUFFER_CHANNELS, TRACK_PROCESSING_HOST_BUFFER_CHANNELS),
+            inputs: vec![],
+            outputs: vec![],
+            midi_sender: SendEventBuffer::new(PLUGIN_SANDBOX_MAX_MIDI_EVENTS),
+            midi_events: Vec::with_capacity(PLUGIN_SANDBOX_MAX_MIDI_EVENTS),
+            track_events: Vec::with_capacity(PLUGIN_SANDBOX_MAX_MIDI_EVENTS),
+            parameter_changes: Vec::with_capacity(PLUGIN_SANDBOX_MAX_PARAMETER_CHANGES),
+        }
+    }
+
+    fn respond(&self, response: PluginSandboxResponse) {
+        match self.response_sender.send(response) {
+            Ok(_) => (),
+            Err(error) => info!("Plugin sandbox could not respond: {:?}", error),
+        }
+    }
+
+    fn set_block_size(&mut self, block_size: usize) {
+        let block_size = block_size.min(MAX_BLOCK_SIZE);
+        if block_size != self.block_size {
+            self.block_size = block_size;
+            self.inputs = vec![vec![0.0; block_size]; TRACK_PROCESSING_HOST_BUFFER_CHANNELS];
+            self.outputs = vec![vec![0.0; block_size]; TRACK_PROCESSING_HOST_BUFFER_CHANNELS];
+        }
+    }
+
+    fn handle_request(&mut self, request: PluginSandboxRequest) {
+        match request {
+            PluginSandboxRequest::Load(uuid, library_path, sub_plugin_id, plugin_type, instrument, block_size, sample_rate) => {
+                let uuid = Uuid::parse_str(uuid.as_str()).unwrap_or_else(|_| Uuid::new_v4());
+                self.instrument = instrument;
+                self.set_block_size(block_size);
+                let plugin = if plugin_type == VST24 {
+                    Some(BackgroundProcessorAudioPluginType::Vst24(BackgroundProcessorVst24AudioPlugin::new_with_uuid(
+                        self.vst24_plugin_loaders.clone(), String::new(), uuid, sub_plugin_id, library_path, self.vst_host_time_info.clone(), block_size, sample_rate)))
+                }
+                else if plugin_type == CLAP {
+                    Some(BackgroundProcessorAudioPluginType::Clap(BackgroundProcessorClapAudioPlugin::new_with_uuid(
+                        self.clap_plugin_loaders.clone(), String::new(), uuid, sub_plugin_id, library_path, block_size, sample_rate)))
+                }
+                else {
+                    None
+                };
+
+                match plugin.as_ref() {
+                    Some(plugin) => self.respond(PluginSandboxResponse::Loaded(plugin.name(), plugin.latency())),
+                    None => self.respond(PluginSandboxResponse::Failed(format!("plugin type {} can't be sandboxed", plugin_type))),
+                }
+                self.plugin = plugin;
+            }
+            PluginSandboxRequest::SetAudioFormat(block_size, sample_rate) => {
+                self.set_block_size(block_size);
+                let latency = match self.plugin.as_mut() {
+                    Some(plugin) => {
+                        plugin.set_audio_format(block_size, sample_rate);
+                        plugin.latency()
+                    }
+                    None => 0,
+                };
+                self.respond(PluginSandboxResponse::Latency(latency));
+            }
+            PluginSandboxRequest::GetPresetData => {
+                let preset_data = self.plugin.as_mut().map(|plugin| plugin.preset_data()).unwrap_or_default();
+                self.respond(PluginSandboxResponse::PresetData(preset_data));
+            }
+            PluginSandboxRequest::SetPresetData(data) => {
+                let latency = match self.plugin.as_mut() {
+                    Some(plugin) => {
+                        plugin.set_preset_data(data);
+                        plugin.latency()
+                    }
+                    None => 0,
+                };
+                self.respond(PluginSandboxResponse::Latency(latency));
+            }
+            PluginSandboxRequest::GetParameters => {
+                let parameters = self.plugin.as_mut().map(|plugin| plugin_parameters(plugin)).unwrap_or_default();
+                self.respond(PluginSandboxResponse::Parameters(parameters));
+            }
+            PluginSandboxRequest::OpenEditor(xid) => {
+                let window_size = match self.plugin.as_mut() {
+                    Some(plugin) => {
+                        plugin.set_xid(Some(xid));
+                        plugin.get_window_size()
+                    }
+                    None => (400, 300),
+                };
+                self.respond(PluginSandboxResponse::WindowSize(window_size.0, window_size.1));
+            }
+            PluginSandboxRequest::Stop => {
+                if let Some(plugin) = self.plugin.as_mut() {
+                    plugin.stop_processing();
+                }
+            }
+            PluginSandboxRequest::Shutdown => {
+                if let Some(plugin) = self.plugin.as_mut() {
+                    plugin.stop_processing();
+                    plugin.shutdown();
+                }
+            }
+        }
+    }
+
+    /// Keep the editor going and pass on anything the plugin has asked the host for.
+    fn idle(&mut self) {
+        let mut responses = vec![];
+        match self.plugin.as_mut() {
+            Some(BackgroundProcessorAudioPluginType::Vst24(plugin)) => {
+                if plugin.xid().is_some() {
+                    plugin.vst_plugin_instance_mut().editor_idle();
+                }
+                while let Ok(event) = plugin.rx_from_host().try_recv() {
+                    match event {
+                        AudioPluginHostOutwardEvent::Automation(_, _, _, param_index, param_value) => responses.push(PluginSandboxResponse::Automation(param_index, param_value)),
+                        AudioPluginHostOutwardEvent::SizeWindow(_, _, _, width, height) => responses.push(PluginSandboxResponse::ResizeWindow(width, height)),
+                    }
+                }
+            }
+            Some(BackgroundProcessorAudioPluginType::Clap(plugin)) => {
+                if plugin.xid().is_some() {
+                    if let Some(timer_support) = plugin.plugin().get_extension::<TimerSupport>() {
+                        timer_support.on_timer(plugin.plugin(), 0);
+                    }
+                    if let Some(posix_fd_support) = plugin.plugin().get_extension::<PosixFDSupport>() {
+                        posix_fd_support.on_fd(plugin.plugin(), 0, 0);
+                    }
+                }
+                while let Ok(message) = plugin.host_receiver().try_recv() {
+                    match message {
+                        DAWCallback::PluginGuiWindowRequestResize(width, height) => responses.push(PluginSandboxResponse::ResizeWindow(width as i32, height as i32)),
+                    }
+                }
+            }
+            _ => (),
+        }
+        for response in responses.into_iter() {
+            self.respond(response);
+        }
+    }
+
+    fn process_block(&mut self, block: &mut SandboxBlock) {
+        // nothing has been loaded
+        if self.block_size == 0 {
+            return;
+        }
+        let frames = (block.frames as usize).min(self.block_size);
+        for channel in 0..PLUGIN_SANDBOX_INPUT_CHANNELS {
+            self.inputs[channel][..frames].copy_from_slice(&block.inputs[channel][..frames]);
+        }
+        for channel in 0..PLUGIN_SANDBOX_OUTPUT_CHANNELS {
+            self.outputs[channel].fill(0.0);
+        }
+
+        if let Some(plugin) = self.plugin.as_mut() {
+            if block.tempo != self.tempo {
+                self.tempo = block.tempo;
+                plugin.set_tempo(block.tempo);
+            }
+
+            let plugin_uuid = plugin.uuid();
+            self.parameter_changes.clear();
+            for change in block.parameter_changes[..(block.parameter_change_count as usize).min(PLUGIN_SANDBOX_MAX_PARAMETER_CHANGES)].iter() {
+                self.parameter_changes.push(PluginParameter { index: change.index, position: change.frame as f64, value: change.value, instrument: self.instrument, plugin_uuid });
+            }
+            let midi_events = &block.midi_events[..(block.midi_event_count as usize).min(PLUGIN_SANDBOX_MAX_MIDI_EVENTS)];
+
+            let mut audio_buffer = self.host_buffer.bind(&self.inputs, &mut self.outputs);
+            match plugin {
+                BackgroundProcessorAudioPluginType::Vst24(plugin) => {
+                    if let Ok(mut vst_host) = plugin.host_mut().lock() {
+                        vst_host.set_ppq_pos(block.ppq_position);
+                        vst_host.set_sample_position(block.sample_position);
+                    }
+                    self.midi_events.clear();
+                    self.midi_events.extend(midi_events.iter().map(|midi_event| MidiEvent {
+                        data: [midi_event.data[0], midi_event.data[1], midi_event.data[2]],
+                        delta_frames: midi_event.delta_frames as i32,
+                        live: false,
+                        note_length: None,
+                        note_offset: None,
+                        detune: 0,
+                        note_off_velocity: 0,
+                    }));
+                    process_vst24_plugin_in_sub_blocks(plugin.vst_plugin_instance_mut(), &mut audio_buffer, self.parameter_changes.iter(), &self.midi_events, &mut self.midi_sender);
+                }
+                BackgroundProcessorAudioPluginType::Clap(plugin) => {
+                    self.track_events.clear();
+                    self.track_events.extend(midi_events.iter().filter_map(track_event_from_midi));
+                    plugin.process_events(&self.track_events);
+                    plugin.process_parameter_changes(self.parameter_changes.iter());
+                    plugin.process(&mut audio_buffer, !self.instrument);
+                }
+                _ => (),
+            }
+        }
+
+        for channel in 0..PLUGIN_SANDBOX_OUTPUT_CHANNELS {
+            block.outputs[channel][..frames].copy_from_slice(&self.outputs[channel][..frames]);
+        }
+    }
+}
+
+fn plugin_parameters(plugin: &mut BackgroundProcessorAudioPluginType) -> Vec<(i32, String, String, f32, String)> {
+    let mut parameters = vec![];
+    match plugin {
+        BackgroundProcessorAudioPluginType::Vst24(plugin) => {
+            let plugin_info = plugin.vst_plugin_instance().get_info();
+            let params = plugin.vst_plugin_instance_mut().get_parameter_object();
+            for index in 0..plugin_info.parameters {
+                parameters.push((index, params.get_parameter_name(index), params.get_parameter_label(index), params.get_parameter(index), params.get_parameter_text(index)));
+            }
+        }
+        BackgroundProcessorAudioPluginType::Clap(plugin) => {
+            if let Some(params) = plugin.plugin().get_extension::<Params>() {
+                if let Ok(info) = params.info(plugin.plugin()) {
+                    for (param_id, param) in info.iter() {
+                        let value = params.get(plugin.plugin(), *param_id).unwrap_or_default() as f32;
+                        parameters.push((*param_id as i32, param.name.clone(), param.name.clone(), value, "".to_string()));
+                    }
+                }
+            }
+        }
+        _ => (),
+    }
+    parameters
+}
+
+fn track_event_from_midi(midi_event: &SandboxMidiEvent) -> Option<TrackEvent> {
+    let data = midi_event.data;
+    track_event_from_midi_bytes(midi_event.delta_frames as f64, [data[0], data[1], data[2]])
+}
+
+/// Run a plugin sandbox - `riff-daw --plugin-sandbox <ipc server name> <shared memory name>`. Everything the plugin
+/// does happens on this one thread so plugins that expect their editor and processing on the same thread are happy.
+pub fn run_plugin_sandbox(server_name: &str, shared_memory_name: &str) -> anyhow::Result<()> {
+    let daw_process_id = unsafe { libc::getppid() };
+    let (request_sender, request_receiver) = ipc::channel::<PluginSandboxRequest>()?;
+    let (response_sender, response_receiver) = ipc::channel::<PluginSandboxResponse>()?;
+    let bootstrap = IpcSender::connect(server_name.to_string())?;
+    bootstrap.send((request_sender, response_receiver)).map_err(|error| anyhow::anyhow!("{:?}", error))?;
+
+    let mut shared_memory = SandboxSharedMemory::open(shared_memory_name)?;
+    let mut host = SandboxedPluginHost::new(response_sender);
+    let mut last_request = shared_memory.block().request.load(Ordering::Acquire);
+
+    loop {
+        let request = shared_memory.block().request.load(Ordering::Acquire);
+        if request != last_request {
+            last_request = request;
+            host.process_block(shared_memory.block_mut());
+            shared_memory.block().response.store(request, Ordering::Release);
+            futex_wake(&shared_memory.block().response);
+        }
+        else {
+            futex_wait(&shared_memory.block().request, request, Duration::from_millis(PLUGIN_SANDBOX_IDLE_INTERVAL_IN_MILLISECONDS));
+        }
+
+        while let Ok(request) = request_receiver.try_recv() {
+            let shutdown = matches!(request, PluginSandboxRequest::Shutdown);
+            host.handle_request(request);
+            if shutdown {
+                return Ok(());
+            }
+        }
+        host.idle();
+
+        // the DAW has gone
+        if unsafe { libc::getppid() } != daw_process_id {
+            return Ok(());
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use crate::domain::{DAWItemPosition, TrackEvent};
+    use crate::plugin_sandbox::{SandboxBlock, SandboxMidiEvent, track_event_from_midi};
+
+    #[test]
+    fn shared_block_layout_is_the_same_for_32_and_64_bit_hosts() {
+        assert_eq!(24, std::mem::offset_of!(SandboxBlock, tempo));
+        assert_eq!(48, std::mem::offset_of!(SandboxBlock, inputs));
+        assert_eq!(8, std::mem::size_of::<SandboxMidiEvent>());
+    }
+
+    #[test]
+    fn midi_from_the_shared_block_becomes_track_events() {
+        let note_on = SandboxMidiEvent { delta_frames: 16, data: [0x90, 60, 100, 0] };
+        let note_on_without_velocity = SandboxMidiEvent { delta_frames: 32, data: [0x91, 60, 0, 0] };
+        let aftertouch = SandboxMidiEvent { delta_frames: 0, data: [0xD0, 10, 0, 0] };
+
+        match track_event_from_midi(&note_on) {
+            Some(TrackEvent::NoteOn(note_on)) => {
+                assert_eq!(60, note_on.note());
+                assert_eq!(16.0, note_on.position());
+            }
+            _ => panic!("expected a note on"),
+        }
+        assert!(matches!(track_event_from_midi(&note_on_without_velocity), Some(TrackEvent::NoteOff(_))));
+        assert!(track_event_from_midi(&aftertouch).is_none());
+    }
+}
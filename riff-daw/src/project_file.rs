@@ -0,0 +1,269 @@
+use std::fs::File;
+use std::io::{BufWriter, Read, Seek, SeekFrom, Write};
+
+use serde::{Deserialize, Serialize};
+use serde_json::Value;
+
+use crate::domain::Project;
+
+const PROJECT_FILE_MAGIC: &[u8; 8] = b"RDAWPRJ\0";
+const PROJECT_FILE_VERSION: u32 = 1;
+const PROJECT_FILE_HEADER_LENGTH: u64 = 8 + 4 + 8; // magic, version, index offset
+
+#[derive(Serialize, Deserialize, Clone, Copy, PartialEq, Eq, Hash, Debug)]
+pub enum ProjectFileChunkType {
+    Song,       // the song with the track riffs and plugin preset data taken out
+    TrackRiffs, // keyed on track uuid
+    PresetData, // raw preset bytes keyed on plugin uuid
+}
+
+#[derive(Serialize, Deserialize, Clone)]
+struct ProjectFileChunk {
+    chunk_type: ProjectFileChunkType,
+    key: String,
+    offset: u64,
+    length: u64,
+}
+
+/// A chunk's contents.
+#[derive(Clone)]
+pub struct ProjectFileSection {
+    pub chunk_type: ProjectFileChunkType,
+    pub key: String,
+    pub data: Vec<u8>,
+}
+
+/// The binary project file container:
+///
+/// magic | version: u32 | index offset: u64 | chunk data... | index
+///
+/// The index lists every chunk's type, key, offset and length. The song (tracks, riff references, arrangements etc.),
+/// each track's riffs and each plugin preset are separate chunks so that autosaves can tell which of them have changed
+/// and only write those. Presets are stored as raw bytes rather than base64, a quarter smaller than in json. Loading
+/// always reads the whole project as the tracks need their riffs and presets as soon as they start. Numbers are little
+/// endian.
+pub struct ProjectFile<R: Read + Seek = File> {
+    reader: R,
+    chunks: Vec<ProjectFileChunk>,
+}
+
+impl ProjectFile<File> {
+    pub fn is_project_file(path: &str) -> bool {
+        let mut magic = [0_u8; 8];
+        match File::open(path) {
+            Ok(mut file) => file.read_exact(&mut magic).is_ok() && &magic == PROJECT_FILE_MAGIC,
+            Err(_) => false,
+        }
+    }
+
+    /// Write the project to a new file alongside the destination and then move it into place so that a failed write
+    /// does not destroy the previous save.
+    pub fn write(path: &str, project: &Project) -> anyhow::Result<()> {
+        let sections = Self::sections(project)?;
+        let partial_path = format!("{}.partial", path);
+        {
+            let mut writer = BufWriter::new(File::create(partial_path.as_str())?);
+            Self::write_sections(&mut writer, &sections)?;
+            writer.flush()?;
+        }
+        std::fs::rename(partial_path, path)?;
+
+        Ok(())
+    }
+
+    /// Split the project into the sections that are stored as chunks.
+    pub fn sections(project: &Project) -> anyhow::Result<Vec<ProjectFileSection>> {
+        let mut song = serde_json::to_value(project)?;
+        let mut sections = vec![];
+
+        for track in serialised_tracks_mut(&mut song) {
+            let track_uuid = track.get("uuid").and_then(|uuid| uuid.as_str()).unwrap_or_default().to_string();
+
+            if let Some(riffs) = track.get_mut("riffs") {
+                let riffs = riffs.take();
+                sections.push(ProjectFileSection { chunk_type: ProjectFileChunkType::TrackRiffs, key: track_uuid, data: serde_json::to_vec(&riffs)? });
+                track.insert("riffs".to_string(), Value::Array(vec![]));
+            }
+
+            for plugin in serialised_track_plugins_mut(track) {
+                let plugin_uuid = plugin.get("uuid").and_then(|uuid| uuid.as_str()).unwrap_or_default().to_string();
+                if let Some(Value::String(preset_data)) = plugin.get("preset_data") {
+                    // anything that isn't base64 stays where it is
+                    if let Ok(preset_bytes) = base64::decode(preset_data) {
+                        if !preset_bytes.is_empty() {
+                            sections.push(ProjectFileSection { chunk_type: ProjectFileChunkType::PresetData, key: plugin_uuid, data: preset_bytes });
+                            plugin.insert("preset_data".to_string(), Value::String(String::new()));
+                        }
+                    }
+                }
+            }
+        }
+        sections.insert(0, ProjectFileSection { chunk_type: ProjectFileChunkType::Song, key: String::new(), data: serde_json::to_vec(&song)? });
+
+        Ok(sections)
+    }
+
+    pub fn write_sections<W: Write + Seek>(writer: &mut W, sections: &[ProjectFileSection]) -> anyhow::Result<()> {
+        let mut chunks = vec![];
+        let mut offset = PROJECT_FILE_HEADER_LENGTH;
+
+        writer.write_all(PROJECT_FILE_MAGIC)?;
+        writer.write_all(&PROJECT_FILE_VERSION.to_le_bytes())?;
+        writer.write_all(&0_u64.to_le_bytes())?; // index offset - filled in below
+        for section in sections.iter() {
+            writer.write_all(section.data.as_slice())?;
+            chunks.push(ProjectFileChunk { chunk_type: section.chunk_type, key: section.key.clone(), offset, length: section.data.len() as u64 });
+            offset += section.data.len() as u64;
+        }
+        writer.write_all(serde_json::to_vec(&chunks)?.as_slice())?;
+        writer.seek(SeekFrom::Start(PROJECT_FILE_HEADER_LENGTH - 8))?;
+        writer.write_all(&offset.to_le_bytes())?;
+        writer.seek(SeekFrom::End(0))?;
+
+        Ok(())
+    }
+
+    pub fn open(path: &str) -> anyhow::Result<Self> {
+        ProjectFile::from_reader(File::open(path)?)
+    }
+}
+
+impl<R: Read + Seek> ProjectFile<R> {
+    pub fn from_reader(mut reader: R) -> anyhow::Result<Self> {
+        let mut header = [0_u8; PROJECT_FILE_HEADER_LENGTH as usize];
+        reader.read_exact(&mut header)?;
+
+        if &header[0..8] != PROJECT_FILE_MAGIC {
+            return Err(anyhow::anyhow!("not a project file"));
+        }
+        let version = u32::from_le_bytes([header[8], header[9], header[10], header[11]]);
+        if version > PROJECT_FILE_VERSION {
+            return Err(anyhow::anyhow!("saved by a newer version (project file version {})", version));
+        }
+
+        let mut index_offset = [0_u8; 8];
+        index_offset.copy_from_slice(&header[12..20]);
+        reader.seek(SeekFrom::Start(u64::from_le_bytes(index_offset)))?;
+        let mut index = vec![];
+        reader.read_to_end(&mut index)?;
+
+        Ok(Self {
+            reader,
+            chunks: serde_json::from_slice(index.as_slice())?,
+        })
+    }
+
+    /// Every chunk in the file.
+    pub fn read_sections(&mut self) -> anyhow::Result<Vec<ProjectFileSection>> {
+        let mut sections = vec![];
+        for chunk in self.chunks.clone().into_iter() {
+            if let Some(data) = self.read_chunk(chunk.chunk_type, chunk.key.as_str())? {
+                sections.push(ProjectFileSection { chunk_type: chunk.chunk_type, key: chunk.key, data });
+            }
+        }
+        Ok(sections)
+    }
+
+    /// The song without any riffs or plugin preset data.
+    fn read_song(&mut self) -> anyhow::Result<Value> {
+        let data = self.read_chunk(ProjectFileChunkType::Song, "")?.ok_or_else(|| anyhow::anyhow!("project file has no song"))?;
+        Ok(serde_json::from_slice(data.as_slice())?)
+    }
+
+    fn read_track_riffs(&mut self, track_uuid: &str) -> anyhow::Result<Option<Value>> {
+        match self.read_chunk(ProjectFileChunkType::TrackRiffs, track_uuid)? {
+            Some(data) => Ok(Some(serde_json::from_slice(data.as_slice())?)),
+            None => Ok(None),
+        }
+    }
+
+    fn read_preset_data(&mut self, plugin_uuid: &str) -> anyhow::Result<Option<Vec<u8>>> {
+        self.read_chunk(ProjectFileChunkType::PresetData, plugin_uuid)
+    }
+
+    /// Read the whole project, putting the riffs and presets back.
+    pub fn read_project(&mut self) -> anyhow::Result<Project> {
+        let mut song = self.read_song()?;
+
+        for track in serialised_tracks_mut(&mut song) {
+            let track_uuid = track.get("uuid").and_then(|uuid| uuid.as_str()).unwrap_or_default().to_string();
+            if let Some(riffs) = self.read_track_riffs(track_uuid.as_str())? {
+                track.insert("riffs".to_string(), riffs);
+            }
+
+            for plugin in serialised_track_plugins_mut(track) {
+                let plugin_uuid = plugin.get("uuid").and_then(|uuid| uuid.as_str()).unwrap_or_default().to_string();
+                if let Some(preset_bytes) = self.read_preset_data(plugin_uuid.as_str())? {
+                    plugin.insert("preset_data".to_string(), Value::String(base64::encode(preset_bytes)));
+                }
+            }
+        }
+
+        Ok(serde_json::from_value(song)?)
+    }
+
+    fn read_chunk(&mut self, chunk_type: ProjectFileChunkType, key: &str) -> anyhow::Result<Option<Vec<u8>>> {
+        let (offset, length) = match self.chunks.iter().find(|chunk| chunk.chunk_type == chunk_type && chunk.key == key) {
+            Some(chunk) => (chunk.offset, chunk.length),
+            None => return Ok(None),
+        };
+        let mut data = vec![0_u8; length as usize];
+        self.reader.seek(SeekFrom::Start(offset))?;
+        self.reader.read_exact(data.as_mut_slice())?;
+        Ok(Some(data))
+    }
+}
+
+/// The fields of each track in a serialised project - tracks are serialised as { "<track type>": { fields } }.
+fn serialised_tracks_mut(project: &mut Value) -> Vec<&mut serde_json::Map<String, Value>> {
+    match project.pointer_mut("/song/tracks") {
+        Some(Value::Array(tracks)) => tracks.iter_mut()
+            .filter_map(|track| track.as_object_mut().and_then(|track_type| track_type.values_mut().next()))
+            .filter_map(|track| track.as_object_mut())
+            .collect(),
+        _ => vec![],
+    }
+}
+
+fn serialised_track_plugins_mut(track: &mut serde_json::Map<String, Value>) -> Vec<&mut serde_json::Map<String, Value>> {
+    let mut plugins = vec![];
+    for (field, value) in track.iter_mut() {
+        match (field.as_str(), value) {
+            ("instrument", Value::Object(instrument)) => plugins.push(instrument),
+            ("effects", Value::Array(effects)) => plugins.extend(effects.iter_mut().filter_map(|effect| effect.as_object_mut())),
+            _ => (),
+        }
+    }
+    plugins
+}
+
+#[cfg(test)]
+mod tests {
+    use crate::domain::Project;
+    use crate::project_file::ProjectFile;
+
+    #[test]
+    fn project_file_round_trips_a_project() {
+        let json_text = include_str!("../test_data/test.fdaw");
+        let project: Project = serde_json::from_str(json_text).unwrap();
+        let path = std::env::temp_dir().join(format!("riff_daw_project_file_test_{}.fdaw", std::process::id()));
+        let path = path.to_str().unwrap();
+
+        ProjectFile::write(path, &project).unwrap();
+        assert!(ProjectFile::is_project_file(path));
+
+        let mut project_file = ProjectFile::open(path).unwrap();
+        let song = project_file.read_song().unwrap();
+        let read_project = project_file.read_project().unwrap();
+        let file_length = std::fs::metadata(path).unwrap().len() as usize;
+        let _ = std::fs::remove_file(path);
+
+        // the song on its own has no riffs or presets
+        for track in song.pointer("/song/tracks").unwrap().as_array().unwrap().iter() {
+            let track = track.as_object().unwrap().values().next().unwrap();
+            assert_eq!(0, track["riffs"].as_array().unwrap().len());
+        }
+        assert_eq!(serde_json::to_value(&project).unwrap(), serde_json::to_value(&read_project).unwrap());
+        assert!(file_length < json_text.len());
+    }
+}
@@ -0,0 +1,137 @@
+use std::collections::HashMap;
+use std::sync::Arc;
+
+use parking_lot::Mutex;
+use uuid::Uuid;
+
+use crate::domain::{AudioEffectTrack, Loop, Riff, RiffArrangement, RiffReference, RiffSequence, RiffSet, Song, Track, TrackEvent, TrackType};
+
+/// An Arc that can be swapped while readers keep the one they loaded. The lock is only held to clone or replace the
+/// Arc so readers never wait on anyone holding the state lock.
+pub struct SnapshotCell<T> {
+    current: Mutex<Arc<T>>,
+}
+
+impl<T> SnapshotCell<T> {
+    pub fn new(value: T) -> Self {
+        Self {
+            current: Mutex::new(Arc::new(value)),
+        }
+    }
+
+    pub fn load(&self) -> Arc<T> {
+        self.current.lock().clone()
+    }
+
+    pub fn store(&self, value: Arc<T>) {
+        // the previous snapshot is dropped outside the lock
+        let _previous = std::mem::replace(&mut *self.current.lock(), value);
+    }
+}
+
+impl<T: Default> Default for SnapshotCell<T> {
+    fn default() -> Self {
+        Self::new(T::default())
+    }
+}
+
+/// A track's riffs, arrangement on the time line and plugin metadata as of a project revision.
+pub struct TrackSnapshot {
+    pub revision: u64, // the project revision the track last changed at
+    pub uuid: String,
+    pub name: String,
+    pub colour: (f64, f64, f64, f64),
+    pub riffs: Vec<Riff>,
+    pub riff_refs: Vec<RiffReference>,
+    pub automation: Vec<TrackEvent>,
+    pub plugins: Vec<(String, String)>, // plugin uuid, name - the instrument first if there is one
+    pub audio_routing_destinations: Vec<String>, // the track uuids the track routes audio to
+    pub midi_routing_destinations: Vec<String>,  // the track uuids the track routes midi to
+}
+
+impl TrackSnapshot {
+    pub fn new(track: &TrackType, revision: u64) -> Self {
+        let plugins = match track {
+            TrackType::InstrumentTrack(track) => std::iter::once(track.instrument()).chain(track.effects().iter()).map(|plugin| (plugin.uuid().to_string(), plugin.name().to_string())).collect(),
+            TrackType::AudioTrack(track) => track.effects().iter().map(|plugin| (plugin.uuid().to_string(), plugin.name().to_string())).collect(),
+            TrackType::MidiTrack(_) => vec![],
+        };
+
+        Self {
+            revision,
+            uuid: track.uuid().to_string(),
+            name: track.name().to_string(),
+            colour: track.colour(),
+            riffs: track.riffs().clone(),
+            riff_refs: track.riff_refs().clone(),
+            automation: track.automation().events().clone(),
+            plugins,
+            audio_routing_destinations: track.audio_routings().iter().map(|routing| routing.destination.track_uuid().to_string()).collect(),
+            midi_routing_destinations: track.midi_routings().iter().map(|routing| routing.destination.track_uuid().to_string()).collect(),
+        }
+    }
+}
+
+/// The song level arrangement - loops, riff sets, sequences and arrangements.
+#[derive(Default)]
+pub struct ArrangementSnapshot {
+    pub revision: u64, // the project revision it was copied at
+    pub loops: Vec<Loop>,
+    pub riff_sets: Vec<RiffSet>,
+    pub riff_sequences: Vec<RiffSequence>,
+    pub riff_arrangements: Vec<RiffArrangement>,
+    pub samples: HashMap<String, String>, // sample uuid, sample file name
+}
+
+impl ArrangementSnapshot {
+    pub fn new(song: &Song, revision: u64) -> Self {
+        Self {
+            revision,
+            loops: song.loops().to_vec(),
+            riff_sets: song.riff_sets().clone(),
+            riff_sequences: song.riff_sequences().clone(),
+            riff_arrangements: song.riff_arrangements().clone(),
+            samples: song.samples().iter().map(|(sample_uuid, sample)| (sample_uuid.clone(), sample.file_name().to_string())).collect(),
+        }
+    }
+}
+
+#[derive(Clone, PartialEq, Default)]
+pub struct TransportSnapshot {
+    pub tempo: f64,
+    pub sample_rate: f64,
+    pub time_signature_numerator: f64,
+    pub time_signature_denominator: f64,
+    pub playing: bool,
+    pub looping: bool,
+    pub active_loop: Option<Uuid>,
+}
+
+#[derive(Clone, PartialEq, Default)]
+pub struct SelectionSnapshot {
+    pub selected_track: Option<String>,
+    pub selected_riff_uuids: HashMap<String, String>, // track uuid, riff uuid
+}
+
+/// An immutable view of the project for readers that shouldn't hold the state lock - the painters in particular.
+/// Published by DAWState::publish_project_snapshot when something in it has changed. Each track and the arrangement are
+/// only rebuilt when they have changed and are shared with the previous snapshot otherwise.
+#[derive(Default)]
+pub struct ProjectSnapshot {
+    pub revision: u64,
+    pub tracks: Arc<Vec<Arc<TrackSnapshot>>>,
+    pub arrangement: Arc<ArrangementSnapshot>,
+    pub transport: TransportSnapshot,
+    pub selection: SelectionSnapshot,
+}
+
+impl ProjectSnapshot {
+    /// The selected track and its selected riff.
+    pub fn selected_riff(&self) -> Option<(usize, &TrackSnapshot, &Riff)> {
+        let track_uuid = self.selection.selected_track.as_ref()?;
+        let riff_uuid = self.selection.selected_riff_uuids.get(track_uuid)?;
+        let (track_index, track) = self.tracks.iter().map(|track| track.as_ref()).enumerate().find(|(_, track)| track.uuid == *track_uuid)?;
+        let riff = track.riffs.iter().find(|riff| riff.uuid().to_string() == *riff_uuid)?;
+        Some((track_index, track, riff))
+    }
+}
@@ -0,0 +1,322 @@
+use std::collections::HashMap;
+use std::fs::File;
+use std::io::{BufWriter, Seek, SeekFrom, Write};
+use std::path::PathBuf;
+use std::thread::{self, JoinHandle};
+
+use rb::RbConsumer;
+
+use crate::constants::STEM_WRITER_THREAD_NAME;
+use crate::domain::AudioConsumerDetails;
+use crate::dsp;
+use crate::scheduler::TrackProcessingScheduler;
+
+const WAVE_FILE_HEADER_LENGTH: u32 = 44;
+// the riff chunk size is 32 bit - there is no room for more than this after the rest of the header
+const WAVE_FILE_MAX_DATA_LENGTH: u64 = (u32::MAX - (WAVE_FILE_HEADER_LENGTH - 8)) as u64;
+const WAVE_FILE_WRITE_BUFFER_CAPACITY: usize = 1024 * 1024;
+const STEM_WRITER_QUEUE_CAPACITY: usize = 64; // blocks
+
+/// Streams 32 bit float audio to a wave file a block at a time - the sizes in the header are filled in by finish().
+/// Writing more than a wave file's 4 GB limit fails rather than leaving the sizes in the header wrapped around.
+pub struct WaveFileWriter {
+    writer: BufWriter<File>,
+    sample_rate: u32,
+    channels: u16,
+    frames_written: u32,
+    interleaved: Vec<f32>, // reused by write_block
+}
+
+impl WaveFileWriter {
+    pub fn create(path: PathBuf, sample_rate: u32) -> std::io::Result<Self> {
+        Self::create_with_channels(path, sample_rate, 2)
+    }
+
+    pub fn create_with_channels(path: PathBuf, sample_rate: u32, channels: u16) -> std::io::Result<Self> {
+        let mut wave_file_writer = Self {
+            writer: BufWriter::with_capacity(WAVE_FILE_WRITE_BUFFER_CAPACITY, File::create(path)?),
+            sample_rate,
+            channels,
+            frames_written: 0,
+            interleaved: vec![],
+        };
+        wave_file_writer.write_header()?;
+        Ok(wave_file_writer)
+    }
+
+    pub fn write_block(&mut self, left_channel: &[f32], right_channel: &[f32]) -> std::io::Result<()> {
+        let mut interleaved = std::mem::take(&mut self.interleaved);
+        interleaved.resize(left_channel.len().min(right_channel.len()) * 2, 0.0);
+        dsp::interleave(left_channel, right_channel, &mut interleaved);
+        let result = self.write_interleaved(&interleaved);
+        self.interleaved = interleaved;
+        result
+    }
+
+    pub fn write_interleaved(&mut self, samples: &[f32]) -> std::io::Result<()> {
+        let frames = (samples.len() / self.channels.max(1) as usize) as u64;
+        let block_align = self.channels as u64 * 4;
+        if (self.frames_written as u64 + frames) * block_align > WAVE_FILE_MAX_DATA_LENGTH {
+            return Err(std::io::Error::new(std::io::ErrorKind::Other, "the wave file would be larger than the 4 GB a wave file can hold"));
+        }
+
+        for sample in samples.iter() {
+            self.writer.write_all(&sample.to_le_bytes())?;
+        }
+        self.frames_written += frames as u32;
+        Ok(())
+    }
+
+    pub fn finish(mut self) -> std::io::Result<()> {
+        self.writer.seek(SeekFrom::Start(0))?;
+        self.write_header()?;
+        self.writer.flush()
+    }
+
+    fn write_header(&mut self) -> std::io::Result<()> {
+        let channels = self.channels;
+        let bits_per_sample: u16 = 32;
+        let block_align = channels * bits_per_sample / 8;
+        let data_length = self.frames_written * block_align as u32;
+
+        self.writer.write_all(b"RIFF")?;
+        self.writer.write_all(&(WAVE_FILE_HEADER_LENGTH - 8 + data_length).to_le_bytes())?;
+        self.writer.write_all(b"WAVE")?;
+        self.writer.write_all(b"fmt ")?;
+        self.writer.write_all(&16_u32.to_le_bytes())?;
+        self.writer.write_all(&3_u16.to_le_bytes())?; // IEEE float
+        self.writer.write_all(&channels.to_le_bytes())?;
+        self.writer.write_all(&self.sample_rate.to_le_bytes())?;
+        self.writer.write_all(&(self.sample_rate * block_align as u32).to_le_bytes())?;
+        self.writer.write_all(&block_align.to_le_bytes())?;
+        self.writer.write_all(&bits_per_sample.to_le_bytes())?;
+        self.writer.write_all(b"data")?;
+        self.writer.write_all(&data_length.to_le_bytes())
+    }
+}
+
+/// Mixes the tracks' render output down to a wave file - unless mixdown_path is None - and in the same pass writes each
+/// track that has an entry in stem_paths (keyed by track uuid) to its own wave file using a StemWriterPool. Every track
+/// is read either way so that tracks routing audio into the ones being written keep going. The render drives the track
+/// processing scheduler itself - each block every track is processed offline, in parallel where tracks don't depend on
+/// each other, and then read from its render ring buffer - so it goes as fast as the tracks can be processed rather than
+/// at the speed of jack. The scheduler must already be in an offline render - see TrackProcessingScheduler::begin_offline_render.
+/// A track that has nothing for a block, e.g. because its processing panicked, is silent for that block.
+/// Progress is reported as a fraction of the song rendered.
+pub fn render_song_to_wave_files<F: FnMut(f64)>(
+    mixdown_path: Option<PathBuf>,
+    stem_paths: HashMap<String, PathBuf>,
+    number_of_blocks: i32,
+    block_size: usize,
+    sample_rate: u32,
+    track_render_audio_consumers: &HashMap<String, AudioConsumerDetails<f32>>,
+    track_processing_scheduler: &TrackProcessingScheduler,
+    mut progress: F,
+) -> std::io::Result<()> {
+    let mut wave_file_writer = match mixdown_path {
+        Some(mixdown_path) => Some(WaveFileWriter::create(mixdown_path, sample_rate)?),
+        None => None,
+    };
+    let (stem_track_uuids, stem_paths): (Vec<String>, Vec<PathBuf>) = stem_paths.into_iter().unzip();
+    let stem_indexes: HashMap<String, usize> = stem_track_uuids.into_iter().enumerate().map(|(index, track_uuid)| (track_uuid, index)).collect();
+    let mut stem_writer_pool = StemWriterPool::new(stem_paths, sample_rate, block_size)?;
+    let number_of_audio_type_tracks = track_render_audio_consumers.len() as f32;
+    let mut master_left_channel_data: Vec<f32> = vec![0.0; block_size];
+    let mut master_right_channel_data: Vec<f32> = vec![0.0; block_size];
+    let mut left_channel_data: Vec<f32> = vec![0.0; block_size];
+    let mut right_channel_data: Vec<f32> = vec![0.0; block_size];
+    let number_of_blocks = number_of_blocks.max(0) as usize;
+    let progress_interval = (number_of_blocks / 100).max(1);
+
+    for block_number in 0..number_of_blocks {
+        master_left_channel_data.fill(0.0);
+        master_right_channel_data.fill(0.0);
+
+        track_processing_scheduler.process_offline_block();
+        for (track_uuid, track_audio_consumer_details) in track_render_audio_consumers.iter() {
+            read_render_block(track_audio_consumer_details.consumer_left(), &mut left_channel_data);
+            read_render_block(track_audio_consumer_details.consumer_right(), &mut right_channel_data);
+
+            dsp::mix_accumulate(&mut master_left_channel_data, &left_channel_data, 1.0 / number_of_audio_type_tracks);
+            dsp::mix_accumulate(&mut master_right_channel_data, &right_channel_data, 1.0 / number_of_audio_type_tracks);
+
+            if let Some(stem_index) = stem_indexes.get(track_uuid) {
+                stem_writer_pool.write_block(*stem_index, &left_channel_data, &right_channel_data)?;
+            }
+        }
+
+        if let Some(wave_file_writer) = wave_file_writer.as_mut() {
+            wave_file_writer.write_block(&master_left_channel_data, &master_right_channel_data)?;
+        }
+
+        if block_number % progress_interval == 0 {
+            progress(block_number as f64 / number_of_blocks as f64);
+        }
+    }
+
+    if let Some(wave_file_writer) = wave_file_writer {
+        wave_file_writer.finish()?;
+    }
+    stem_writer_pool.finish()?;
+    progress(1.0);
+    Ok(())
+}
+
+struct StemBlock {
+    stem_index: usize,
+    interleaved: Vec<f32>,
+}
+
+/// Writes stem files on a pool of writer threads sized to the number of cores. Each stem is always written by the
+/// same thread so its blocks stay in order. The queues are bounded so a slow disk holds up the render instead of
+/// the rendered audio piling up in memory. The blocks are allocated up front and handed back by the writer threads
+/// once written so writing a block does not allocate.
+pub struct StemWriterPool {
+    senders: Vec<crossbeam_channel::Sender<StemBlock>>,
+    writer_threads: Vec<JoinHandle<std::io::Result<()>>>,
+    rx_written: crossbeam_channel::Receiver<StemBlock>,
+}
+
+impl StemWriterPool {
+    pub fn new(stem_paths: Vec<PathBuf>, sample_rate: u32, block_size: usize) -> std::io::Result<Self> {
+        let number_of_cores = thread::available_parallelism().map(|cores| cores.get()).unwrap_or(1);
+        let number_of_writer_threads = stem_paths.len().min(number_of_cores);
+        let mut thread_wave_file_writers: Vec<HashMap<usize, WaveFileWriter>> = (0..number_of_writer_threads).map(|_| HashMap::new()).collect();
+
+        for (stem_index, stem_path) in stem_paths.into_iter().enumerate() {
+            thread_wave_file_writers[stem_index % number_of_writer_threads].insert(stem_index, WaveFileWriter::create(stem_path, sample_rate)?);
+        }
+
+        // enough for every queue to be full with a block being written and another being filled
+        let (tx_written, rx_written) = crossbeam_channel::unbounded::<StemBlock>();
+        for _ in 0..(number_of_writer_threads * (STEM_WRITER_QUEUE_CAPACITY + 1) + 1) {
+            let _ = tx_written.send(StemBlock { stem_index: 0, interleaved: Vec::with_capacity(block_size * 2) });
+        }
+
+        let mut senders = vec![];
+        let mut writer_threads = vec![];
+        for (thread_number, mut wave_file_writers) in thread_wave_file_writers.into_iter().enumerate() {
+            let (sender, receiver) = crossbeam_channel::bounded::<StemBlock>(STEM_WRITER_QUEUE_CAPACITY);
+            let tx_written = tx_written.clone();
+            let writer_thread = thread::Builder::new()
+                .name(format!("{} {}", STEM_WRITER_THREAD_NAME, thread_number + 1))
+                .spawn(move || {
+                    for stem_block in receiver.iter() {
+                        if let Some(wave_file_writer) = wave_file_writers.get_mut(&stem_block.stem_index) {
+                            wave_file_writer.write_interleaved(&stem_block.interleaved)?;
+                        }
+                        let _ = tx_written.send(stem_block);
+                    }
+                    for (_, wave_file_writer) in wave_file_writers.into_iter() {
+                        wave_file_writer.finish()?;
+                    }
+                    Ok(())
+                })?;
+            senders.push(sender);
+            writer_threads.push(writer_thread);
+        }
+
+        Ok(Self {
+            senders,
+            writer_threads,
+            rx_written,
+        })
+    }
+
+    pub fn write_block(&mut self, stem_index: usize, left_channel: &[f32], right_channel: &[f32]) -> std::io::Result<()> {
+        let mut stem_block = match self.rx_written.try_recv() {
+            Ok(stem_block) => stem_block,
+            Err(_) => StemBlock { stem_index, interleaved: vec![] },
+        };
+        stem_block.stem_index = stem_index;
+        stem_block.interleaved.resize(left_channel.len().min(right_channel.len()) * 2, 0.0);
+        dsp::interleave(left_channel, right_channel, &mut stem_block.interleaved);
+
+        let sender = &self.senders[stem_index % self.senders.len()];
+        match sender.send(stem_block) {
+            Ok(_) => Ok(()),
+            // the writer thread has stopped - finish() reports why
+            Err(_) => Err(std::io::Error::new(std::io::ErrorKind::BrokenPipe, "stem writer thread has stopped")),
+        }
+    }
+
+    /// Flush the queued blocks and complete the stem files.
+    pub fn finish(self) -> std::io::Result<()> {
+        drop(self.senders);
+        for writer_thread in self.writer_threads.into_iter() {
+            match writer_thread.join() {
+                Ok(result) => result?,
+                Err(_) => return Err(std::io::Error::new(std::io::ErrorKind::Other, "stem writer thread panicked")),
+            }
+        }
+        Ok(())
+    }
+}
+
+/// Read the block a track has just rendered from its render ring buffer - whatever it didn't render is silence.
+fn read_render_block(consumer: &rb::Consumer<f32>, block: &mut [f32]) {
+    let frames_read = consumer.read(block).unwrap_or(0);
+    block[frames_read..].fill(0.0);
+}
+
+#[cfg(test)]
+mod tests {
+    use crate::render::{StemWriterPool, WaveFileWriter};
+
+    #[test]
+    fn wave_file_writer_fills_in_the_header_sizes() {
+        let path = std::env::temp_dir().join(format!("riff_daw_wave_file_writer_test_{}.wav", std::process::id()));
+        let mut wave_file_writer = WaveFileWriter::create(path.clone(), 48000).unwrap();
+        wave_file_writer.write_block(&[0.5; 128], &[-0.5; 128]).unwrap();
+        wave_file_writer.write_block(&[0.25; 64], &[-0.25; 64]).unwrap();
+        wave_file_writer.finish().unwrap();
+
+        let bytes = std::fs::read(&path).unwrap();
+        let _ = std::fs::remove_file(&path);
+        let data_length = 192 * 2 * 4;
+
+        assert_eq!(44 + data_length, bytes.len());
+        assert_eq!(&bytes[0..4], b"RIFF");
+        assert_eq!(36 + data_length as u32, u32::from_le_bytes([bytes[4], bytes[5], bytes[6], bytes[7]]));
+        assert_eq!(48000, u32::from_le_bytes([bytes[24], bytes[25], bytes[26], bytes[27]]));
+        assert_eq!(data_length as u32, u32::from_le_bytes([bytes[40], bytes[41], bytes[42], bytes[43]]));
+        assert_eq!(0.5, f32::from_le_bytes([bytes[44], bytes[45], bytes[46], bytes[47]]));
+        assert_eq!(-0.5, f32::from_le_bytes([bytes[48], bytes[49], bytes[50], bytes[51]]));
+    }
+
+    #[test]
+    fn wave_file_writer_fails_rather_than_go_past_the_4_gb_limit() {
+        let path = std::env::temp_dir().join(format!("riff_daw_wave_file_writer_limit_test_{}.wav", std::process::id()));
+        let mut wave_file_writer = WaveFileWriter::create(path.clone(), 48000).unwrap();
+        wave_file_writer.frames_written = ((u32::MAX - 36) / 8) - 64;
+
+        assert!(wave_file_writer.write_block(&[0.5; 64], &[-0.5; 64]).is_ok());
+        assert!(wave_file_writer.write_block(&[0.5; 1], &[-0.5; 1]).is_err());
+        drop(wave_file_writer);
+        let _ = std::fs::remove_file(&path);
+    }
+
+    #[test]
+    fn stem_writer_pool_writes_each_stem_in_order() {
+        let paths: Vec<std::path::PathBuf> = (0..3).map(|stem| std::env::temp_dir().join(format!("riff_daw_stem_writer_pool_test_{}_{}.wav", std::process::id(), stem))).collect();
+        let mut stem_writer_pool = StemWriterPool::new(paths.clone(), 44100, 16).unwrap();
+        for block in 0..10 {
+            for stem in 0..3 {
+                let sample = (stem * 100 + block) as f32;
+                stem_writer_pool.write_block(stem, &[sample; 16], &[-sample; 16]).unwrap();
+            }
+        }
+        stem_writer_pool.finish().unwrap();
+
+        for (stem, path) in paths.iter().enumerate() {
+            let bytes = std::fs::read(path).unwrap();
+            let _ = std::fs::remove_file(path);
+
+            assert_eq!(44 + 10 * 16 * 2 * 4, bytes.len());
+            for block in 0..10 {
+                let offset = 44 + block * 16 * 2 * 4;
+                assert_eq!((stem * 100 + block) as f32, f32::from_le_bytes([bytes[offset], bytes[offset + 1], bytes[offset + 2], bytes[offset + 3]]));
+            }
+        }
+    }
+}
@@ -0,0 +1,160 @@
+use std::cmp::Ordering;
+
+use crate::domain::{DAWItemLength, DAWItemPosition, TrackEvent};
+
+/// A riff's notes in position order with one column per field so that range queries and playback walk contiguous
+/// arrays rather than the mixed event enum. Each row refers back to its event's index in Riff::events - its id.
+#[derive(Clone, Default)]
+pub struct NoteColumns {
+    pub positions: Vec<f64>,
+    pub lengths: Vec<f64>,
+    pub pitches: Vec<i32>,
+    pub velocities: Vec<i32>,
+    pub channels: Vec<u16>,
+    pub ids: Vec<usize>, // index in the riff's events
+    max_ends: Vec<f64>, // the latest end up to and including each row
+}
+
+impl NoteColumns {
+    pub fn len(&self) -> usize {
+        self.ids.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.ids.is_empty()
+    }
+
+    /// The rows of the notes that overlap start to end in beats and are within the pitch range, in position order.
+    pub fn overlapping(&self, start: f64, end: f64, lowest_pitch: i32, highest_pitch: i32) -> impl Iterator<Item = usize> + '_ {
+        let first = self.max_ends.partition_point(|max_end| *max_end < start);
+        (first..self.len())
+            .take_while(move |row| self.positions[*row] <= end)
+            .filter(move |row| self.positions[*row] + self.lengths[*row] >= start && lowest_pitch <= self.pitches[*row] && self.pitches[*row] <= highest_pitch)
+    }
+
+    /// The rows of the notes that lie entirely within start to end in beats and are within the pitch range - the notes a
+    /// selection window picks out.
+    pub fn within(&self, start: f64, end: f64, lowest_pitch: i32, highest_pitch: i32) -> impl Iterator<Item = usize> + '_ {
+        let first = self.positions.partition_point(|position| *position < start);
+        (first..self.len())
+            .take_while(move |row| self.positions[*row] <= end)
+            .filter(move |row| self.positions[*row] + self.lengths[*row] <= end && lowest_pitch <= self.pitches[*row] && self.pitches[*row] <= highest_pitch)
+    }
+}
+
+/// Positions and event ids of one kind of non note event in position order.
+#[derive(Clone, Default)]
+pub struct EventColumns {
+    pub positions: Vec<f64>,
+    pub ids: Vec<usize>, // index in the riff's events
+}
+
+impl EventColumns {
+    fn new(mut rows: Vec<(f64, usize)>) -> Self {
+        rows.sort_by(|a, b| a.0.partial_cmp(&b.0).unwrap_or(Ordering::Equal));
+        Self {
+            positions: rows.iter().map(|(position, _)| *position).collect(),
+            ids: rows.iter().map(|(_, id)| *id).collect(),
+        }
+    }
+
+    /// The rows of the events from start to end in beats.
+    pub fn in_range(&self, start: f64, end: f64) -> std::ops::Range<usize> {
+        let first = self.positions.partition_point(|position| *position < start);
+        let last = self.positions.partition_point(|position| *position <= end);
+        first..last.max(first)
+    }
+}
+
+/// A riff's events split by kind into sorted columns. Derived from Riff::events, which stays the stored form, and
+/// rebuilt the first time it is read after the events change.
+#[derive(Clone, Default)]
+pub struct RiffEventStore {
+    notes: NoteColumns,
+    controllers: EventColumns,
+    pitch_bends: EventColumns,
+    note_expressions: EventColumns,
+}
+
+impl RiffEventStore {
+    pub fn new(events: &[TrackEvent]) -> Self {
+        let mut note_rows = vec![];
+        let mut controller_rows = vec![];
+        let mut pitch_bend_rows = vec![];
+        let mut note_expression_rows = vec![];
+
+        for (id, event) in events.iter().enumerate() {
+            match event {
+                TrackEvent::Note(note) => note_rows.push((note, id)),
+                TrackEvent::Controller(_) => controller_rows.push((event.position(), id)),
+                TrackEvent::PitchBend(_) => pitch_bend_rows.push((event.position(), id)),
+                TrackEvent::NoteExpression(_) => note_expression_rows.push((event.position(), id)),
+                _ => (),
+            }
+        }
+
+        // stable so that notes at the same position keep their event order
+        note_rows.sort_by(|a, b| a.0.position().partial_cmp(&b.0.position()).unwrap_or(Ordering::Equal));
+        let mut notes = NoteColumns::default();
+        let mut max_end = f64::MIN;
+        for (note, id) in note_rows {
+            max_end = max_end.max(note.position() + note.length());
+            notes.positions.push(note.position());
+            notes.lengths.push(note.length());
+            notes.pitches.push(note.note());
+            notes.velocities.push(note.velocity());
+            notes.channels.push(note.channel());
+            notes.ids.push(id);
+            notes.max_ends.push(max_end);
+        }
+
+        Self {
+            notes,
+            controllers: EventColumns::new(controller_rows),
+            pitch_bends: EventColumns::new(pitch_bend_rows),
+            note_expressions: EventColumns::new(note_expression_rows),
+        }
+    }
+
+    pub fn notes(&self) -> &NoteColumns {
+        &self.notes
+    }
+
+    pub fn controllers(&self) -> &EventColumns {
+        &self.controllers
+    }
+
+    pub fn pitch_bends(&self) -> &EventColumns {
+        &self.pitch_bends
+    }
+
+    pub fn note_expressions(&self) -> &EventColumns {
+        &self.note_expressions
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use uuid::Uuid;
+
+    use crate::domain::{Note, Riff, TrackEvent};
+
+    #[test]
+    fn finds_notes_by_time_and_pitch_and_follows_edits() {
+        let mut riff = Riff::new_with_name_and_length(Uuid::new_v4(), "riff".to_string(), 8.0);
+        riff.events_mut().push(TrackEvent::Note(Note::new_with_params(4.0, 60, 127, 1.0)));
+        riff.events_mut().push(TrackEvent::Note(Note::new_with_params(0.0, 64, 100, 6.0)));
+        riff.events_mut().push(TrackEvent::Note(Note::new_with_params(2.0, 67, 90, 0.5)));
+
+        let notes = riff.event_store().notes();
+        assert_eq!(vec![0.0, 2.0, 4.0], notes.positions);
+        assert_eq!(vec![1, 2, 0], notes.ids);
+        assert_eq!(vec![0, 2], notes.overlapping(4.5, 5.0, 0, 127).collect::<Vec<usize>>());
+        assert_eq!(vec![2], notes.overlapping(4.5, 5.0, 0, 63).collect::<Vec<usize>>());
+        assert_eq!(vec![1, 2], notes.within(1.0, 5.0, 0, 127).collect::<Vec<usize>>());
+        assert_eq!(vec![1], notes.within(1.0, 5.0, 65, 70).collect::<Vec<usize>>());
+
+        riff.events_mut().clear();
+        assert!(riff.event_store().notes().is_empty());
+    }
+}
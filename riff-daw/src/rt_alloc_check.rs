@@ -0,0 +1,84 @@
+//! Debug support for catching heap activity on the jack real time thread.
+//!
+//! Build with `--features rt_alloc_check` to install a counting global allocator. Any allocation, reallocation or
+//! free made while a thread is inside a real time section is counted and reported from a non real time thread.
+//! Without the feature the section markers compile away to nothing.
+
+#[cfg(feature = "rt_alloc_check")]
+mod checked {
+    use std::alloc::{GlobalAlloc, Layout, System};
+    use std::cell::Cell;
+    use std::sync::atomic::{AtomicUsize, Ordering};
+
+    thread_local! {
+        static IN_REAL_TIME_SECTION: Cell<bool> = const { Cell::new(false) };
+    }
+
+    static REAL_TIME_ALLOCATIONS: AtomicUsize = AtomicUsize::new(0);
+
+    pub struct RealTimeAllocationCheckAllocator;
+
+    impl RealTimeAllocationCheckAllocator {
+        #[inline]
+        fn record(&self) {
+            // try_with so that allocations made while the thread local is being torn down are not a problem
+            if let Ok(true) = IN_REAL_TIME_SECTION.try_with(|in_real_time_section| in_real_time_section.get()) {
+                REAL_TIME_ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+            }
+        }
+    }
+
+    unsafe impl GlobalAlloc for RealTimeAllocationCheckAllocator {
+        unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+            self.record();
+            System.alloc(layout)
+        }
+
+        unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+            self.record();
+            System.dealloc(ptr, layout)
+        }
+
+        unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
+            self.record();
+            System.alloc_zeroed(layout)
+        }
+
+        unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+            self.record();
+            System.realloc(ptr, layout, new_size)
+        }
+    }
+
+    #[inline]
+    pub fn enter_real_time_section() {
+        IN_REAL_TIME_SECTION.with(|in_real_time_section| in_real_time_section.set(true));
+    }
+
+    #[inline]
+    pub fn exit_real_time_section() {
+        IN_REAL_TIME_SECTION.with(|in_real_time_section| in_real_time_section.set(false));
+    }
+
+    /// Get the number of heap operations made inside real time sections since the last call and reset the count.
+    pub fn take_real_time_allocation_count() -> usize {
+        REAL_TIME_ALLOCATIONS.swap(0, Ordering::Relaxed)
+    }
+}
+
+#[cfg(feature = "rt_alloc_check")]
+pub use checked::*;
+
+#[cfg(not(feature = "rt_alloc_check"))]
+#[inline(always)]
+pub fn enter_real_time_section() {}
+
+#[cfg(not(feature = "rt_alloc_check"))]
+#[inline(always)]
+pub fn exit_real_time_section() {}
+
+#[cfg(not(feature = "rt_alloc_check"))]
+#[inline(always)]
+pub fn take_real_time_allocation_count() -> usize {
+    0
+}
@@ -0,0 +1,569 @@
+use std::collections::{HashMap, VecDeque};
+use std::collections::hash_map::DefaultHasher;
+use std::hash::{Hash, Hasher};
+use std::io::SeekFrom;
+use std::path::PathBuf;
+use std::sync::{Arc, Weak};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::thread;
+
+use log::*;
+use samplerate_rs::{ConverterType, Samplerate};
+use sndfile::*;
+
+use crate::constants::SAMPLE_STREAMER_THREAD_NAME;
+use crate::dsp;
+use crate::render::WaveFileWriter;
+
+const SAMPLE_STREAM_WINDOW_FRAMES: usize = 65536;
+const SAMPLE_STREAM_CACHED_WINDOWS: usize = 4; // as well as the head window which is never evicted
+const SAMPLE_STREAM_PENDING_WINDOWS: usize = 4; // window requests a stream can have queued at once
+const SAMPLE_STREAMER_REQUEST_QUEUE_CAPACITY: usize = 1024;
+const SAMPLE_RESAMPLE_CHUNK_FRAMES: usize = 65536;
+const NO_WINDOW_REQUESTED: usize = usize::MAX;
+
+enum SampleStreamRequest {
+    Prepare(Arc<SampleStream>),
+    Window(Arc<SampleStream>, usize), // stream, window index
+}
+
+struct SampleStreamWindow {
+    index: usize,
+    samples: Vec<f32>, // interleaved
+}
+
+/// A sample file that is streamed from disk in windows of SAMPLE_STREAM_WINDOW_FRAMES rather than held in memory.
+/// The first window is kept loaded so that a sample starts playing straight away, the window after the one being
+/// played is read ahead by the sample streamer thread. Files that are not at the song sample rate are resampled
+/// once to a cache file which is streamed from instead.
+pub struct SampleStream {
+    file_name: String,
+    sample_rate: i32,
+    channels: AtomicUsize,         // zero until the stream has been prepared
+    length_in_frames: AtomicUsize,
+    windows: parking_lot::Mutex<Vec<SampleStreamWindow>>,
+    pending_windows: [AtomicUsize; SAMPLE_STREAM_PENDING_WINDOWS], // requested window indexes or NO_WINDOW_REQUESTED
+    tx_request: crossbeam_channel::Sender<SampleStreamRequest>,
+}
+
+impl SampleStream {
+    pub fn channels(&self) -> usize {
+        self.channels.load(Ordering::Acquire)
+    }
+
+    pub fn length_in_frames(&self) -> usize {
+        self.length_in_frames.load(Ordering::Acquire)
+    }
+
+    /// Calls frame_handler with (frame offset, left, right) for each available frame from start_frame - mono samples
+    /// are sent to both sides. Does not block or allocate so it is safe to call from the jack process callback -
+    /// frames that have not been streamed in yet are skipped and requested from the sample streamer thread.
+    pub fn for_each_stereo_frame<F: FnMut(usize, f32, f32)>(self: &Arc<Self>, start_frame: usize, frames: usize, mut frame_handler: F) {
+        self.for_each_window_run(start_frame, frames, |frame_offset, samples, channels| {
+            for (frame, frame_samples) in samples.chunks_exact(channels).enumerate() {
+                let left = frame_samples[0];
+                let right = if channels == 1 { left } else { frame_samples[1] };
+                frame_handler(frame_offset + frame, left, right);
+            }
+        });
+    }
+
+    /// Mixes the available frames from start_frame into the output buffers scaled by the gains - the same rules as
+    /// for_each_stereo_frame but whole runs of frames are mixed at a time with the dsp kernels.
+    pub fn mix_into(self: &Arc<Self>, start_frame: usize, out_left: &mut [f32], out_right: &mut [f32], left_gain: f32, right_gain: f32) {
+        let frames = out_left.len().min(out_right.len());
+        self.for_each_window_run(start_frame, frames, |frame_offset, samples, channels| {
+            let run_frames = samples.len() / channels;
+            let out_left = &mut out_left[frame_offset..frame_offset + run_frames];
+            let out_right = &mut out_right[frame_offset..frame_offset + run_frames];
+            match channels {
+                1 => {
+                    dsp::mix_accumulate(out_left, samples, left_gain);
+                    dsp::mix_accumulate(out_right, samples, right_gain);
+                }
+                2 => dsp::mix_interleaved_stereo(out_left, out_right, samples, left_gain, right_gain),
+                _ => for ((left, right), frame_samples) in out_left.iter_mut().zip(out_right.iter_mut()).zip(samples.chunks_exact(channels)) {
+                    *left += frame_samples[0] * left_gain;
+                    *right += frame_samples[1] * right_gain;
+                },
+            }
+        });
+    }
+
+    /// Calls run_handler with (frame offset, interleaved samples, channels) for each run of whole frames available
+    /// in the loaded windows.
+    fn for_each_window_run<F: FnMut(usize, &[f32], usize)>(self: &Arc<Self>, start_frame: usize, frames: usize, mut run_handler: F) {
+        let channels = self.channels();
+        if channels == 0 {
+            return;
+        }
+        let length_in_frames = self.length_in_frames();
+        let end_frame = (start_frame + frames).min(length_in_frames);
+
+        if let Some(windows) = self.windows.try_lock() {
+            let mut frame = start_frame;
+            while frame < end_frame {
+                let window_index = frame / SAMPLE_STREAM_WINDOW_FRAMES;
+                let window_start_frame = window_index * SAMPLE_STREAM_WINDOW_FRAMES;
+                let window_end_frame = (window_start_frame + SAMPLE_STREAM_WINDOW_FRAMES).min(end_frame);
+
+                match windows.iter().find(|window| window.index == window_index) {
+                    Some(window) => {
+                        let window_frames = window.samples.len() / channels;
+                        let first_frame = (frame - window_start_frame).min(window_frames);
+                        let last_frame = (window_end_frame - window_start_frame).min(window_frames);
+                        if first_frame < last_frame {
+                            run_handler(frame - start_frame, &window.samples[first_frame * channels..last_frame * channels], channels);
+                        }
+                    }
+                    None => self.request_window(window_index),
+                }
+                frame = window_end_frame;
+            }
+
+            // read the next window ahead once half way through the current one
+            let read_ahead_frame = end_frame + SAMPLE_STREAM_WINDOW_FRAMES / 2;
+            let read_ahead_window_index = read_ahead_frame / SAMPLE_STREAM_WINDOW_FRAMES;
+            if read_ahead_frame < length_in_frames && !windows.iter().any(|window| window.index == read_ahead_window_index) {
+                self.request_window(read_ahead_window_index);
+            }
+        }
+    }
+
+    /// Queues a request for a window unless it is already pending. Each request holds a pending slot until the
+    /// sample streamer thread has loaded the window so concurrent requests for different windows don't replace each
+    /// other - two threads racing for the same window can both queue it, the streamer loads it once.
+    fn request_window(self: &Arc<Self>, window_index: usize) {
+        if self.pending_windows.iter().any(|pending_window| pending_window.load(Ordering::Acquire) == window_index) {
+            return;
+        }
+
+        // if all the slots are taken the window is requested again next time
+        if let Some(pending_window) = self.pending_windows.iter().find(|pending_window|
+            pending_window.compare_exchange(NO_WINDOW_REQUESTED, window_index, Ordering::AcqRel, Ordering::Acquire).is_ok()) {
+            // the request queue is bounded so this does not allocate - if it is full the window is requested again next time
+            if self.tx_request.try_send(SampleStreamRequest::Window(self.clone(), window_index)).is_err() {
+                pending_window.store(NO_WINDOW_REQUESTED, Ordering::Release);
+            }
+        }
+    }
+
+    fn window_request_done(&self, window_index: usize) {
+        for pending_window in self.pending_windows.iter() {
+            let _ = pending_window.compare_exchange(window_index, NO_WINDOW_REQUESTED, Ordering::AcqRel, Ordering::Acquire);
+        }
+    }
+
+    fn has_window(&self, window_index: usize) -> bool {
+        self.windows.lock().iter().any(|window| window.index == window_index)
+    }
+
+    fn add_window(&self, window_index: usize, samples: Vec<f32>) {
+        let evicted = {
+            let mut windows = self.windows.lock();
+            let evicted = if windows.iter().filter(|window| window.index != 0).count() >= SAMPLE_STREAM_CACHED_WINDOWS {
+                // the oldest window that isn't the head
+                windows.iter().position(|window| window.index != 0).map(|position| windows.remove(position))
+            }
+            else {
+                None
+            };
+            windows.push(SampleStreamWindow { index: window_index, samples });
+            evicted
+        };
+        // drop the evicted window outside of the lock
+        drop(evicted);
+    }
+}
+
+/// An open file that a stream reads its windows from - owned by the sample streamer thread.
+struct SampleStreamFile {
+    sample_stream: Weak<SampleStream>,
+    file: SndFile,
+}
+
+/// Resamples a file into the resample cache a chunk at a time so that the sample streamer thread can keep serving
+/// window requests for other streams in between chunks.
+struct SampleResampler {
+    source_file: SndFile,
+    channels: usize,
+    converter: Samplerate,
+    wave_file_writer: WaveFileWriter,
+    chunk: Vec<f32>,
+    partial_path: PathBuf,
+    resampled_path: PathBuf,
+}
+
+impl SampleResampler {
+    fn new(source_file: SndFile, from_sample_rate: u32, to_sample_rate: u32, resampled_path: PathBuf) -> anyhow::Result<Self> {
+        let channels = source_file.get_channels();
+        let partial_path = resampled_path.with_extension("partial");
+        let converter = Samplerate::new(ConverterType::SincBestQuality, from_sample_rate, to_sample_rate, channels)?;
+        let wave_file_writer = WaveFileWriter::create_with_channels(partial_path.clone(), to_sample_rate, channels as u16)?;
+
+        Ok(Self {
+            source_file,
+            channels,
+            converter,
+            wave_file_writer,
+            chunk: vec![0.0_f32; SAMPLE_RESAMPLE_CHUNK_FRAMES * channels],
+            partial_path,
+            resampled_path,
+        })
+    }
+
+    /// Resamples the next chunk of the source file - true once the whole file has been resampled.
+    fn resample_chunk(&mut self) -> anyhow::Result<bool> {
+        let frames_read = self.source_file.read_to_slice(self.chunk.as_mut_slice()).unwrap_or(0);
+        if frames_read == 0 {
+            self.wave_file_writer.write_interleaved(&self.converter.process_last(&[])?)?;
+            return Ok(true);
+        }
+        self.wave_file_writer.write_interleaved(&self.converter.process(&self.chunk[..frames_read * self.channels])?)?;
+        Ok(false)
+    }
+
+    /// Moves the resampled file into the resample cache.
+    fn finish(self) -> anyhow::Result<()> {
+        let partial_path = self.partial_path;
+        let result = self.wave_file_writer.finish().map_err(anyhow::Error::from)
+            .and_then(|_| std::fs::rename(&partial_path, &self.resampled_path).map_err(anyhow::Error::from));
+        if result.is_err() {
+            let _ = std::fs::remove_file(&partial_path);
+        }
+        result
+    }
+
+    fn abandon(self) {
+        let _ = std::fs::remove_file(&self.partial_path);
+    }
+}
+
+/// A resample in progress along with the streams waiting on it.
+struct SampleResampleJob {
+    sample_streams: Vec<Arc<SampleStream>>,
+    resampler: SampleResampler,
+}
+
+/// The sample streamer thread's state - the open stream files and the resamples in progress.
+struct SampleStreamerWorker {
+    rx_request: crossbeam_channel::Receiver<SampleStreamRequest>,
+    stream_files: HashMap<usize, SampleStreamFile>, // keyed on the stream's address
+    resample_jobs: VecDeque<SampleResampleJob>,
+}
+
+impl SampleStreamerWorker {
+    fn run(mut self) {
+        loop {
+            // requests are served first so that playback never waits on a resample - the resamples are worked
+            // through a chunk at a time, round robin, whenever there are no requests
+            let request = if self.resample_jobs.is_empty() {
+                match self.rx_request.recv() {
+                    Ok(request) => request,
+                    Err(_) => break,
+                }
+            }
+            else {
+                match self.rx_request.try_recv() {
+                    Ok(request) => request,
+                    Err(crossbeam_channel::TryRecvError::Empty) => {
+                        self.resample_next_chunk();
+                        continue;
+                    }
+                    Err(crossbeam_channel::TryRecvError::Disconnected) => break,
+                }
+            };
+
+            match request {
+                SampleStreamRequest::Prepare(sample_stream) => self.prepare(sample_stream),
+                SampleStreamRequest::Window(sample_stream, window_index) => self.load_window(&sample_stream, window_index),
+            }
+        }
+    }
+
+    fn prepare(&mut self, sample_stream: Arc<SampleStream>) {
+        self.stream_files.retain(|_, stream_file| stream_file.sample_stream.strong_count() > 0);
+
+        let source_file = match OpenOptions::ReadOnly(ReadOptions::Auto).from_path(sample_stream.file_name.as_str()) {
+            Ok(source_file) => source_file,
+            Err(_) => {
+                info!("Sample streamer: could not open sample file: {}", sample_stream.file_name);
+                return;
+            }
+        };
+        let source_sample_rate = source_file.get_samplerate();
+        if source_sample_rate == sample_stream.sample_rate as usize {
+            self.start_streaming(sample_stream, source_file);
+            return;
+        }
+
+        match SampleStreamer::resample_cache_path(sample_stream.file_name.as_str(), sample_stream.sample_rate) {
+            Some(resampled_path) => if resampled_path.exists() {
+                self.stream_from(sample_stream, resampled_path);
+            }
+            else if let Some(resample_job) = self.resample_jobs.iter_mut().find(|resample_job| resample_job.resampler.resampled_path == resampled_path) {
+                resample_job.sample_streams.push(sample_stream);
+            }
+            else {
+                match SampleResampler::new(source_file, source_sample_rate as u32, sample_stream.sample_rate as u32, resampled_path) {
+                    Ok(resampler) => self.resample_jobs.push_back(SampleResampleJob { sample_streams: vec![sample_stream], resampler }),
+                    Err(error) => {
+                        info!("Sample streamer: could not resample {}: {:?}", sample_stream.file_name, error);
+                        let file_name = PathBuf::from(sample_stream.file_name.as_str());
+                        self.stream_from(sample_stream, file_name);
+                    }
+                }
+            }
+            None => self.start_streaming(sample_stream, source_file),
+        }
+    }
+
+    fn resample_next_chunk(&mut self) {
+        if let Some(mut resample_job) = self.resample_jobs.pop_front() {
+            match resample_job.resampler.resample_chunk() {
+                Ok(false) => self.resample_jobs.push_back(resample_job),
+                Ok(true) => {
+                    let resampled_path = resample_job.resampler.resampled_path.clone();
+                    match resample_job.resampler.finish() {
+                        Ok(_) => for sample_stream in resample_job.sample_streams.into_iter() {
+                            self.stream_from(sample_stream, resampled_path.clone());
+                        }
+                        Err(error) => self.stream_without_resampling(resample_job.sample_streams, error),
+                    }
+                }
+                Err(error) => {
+                    resample_job.resampler.abandon();
+                    self.stream_without_resampling(resample_job.sample_streams, error);
+                }
+            }
+        }
+    }
+
+    fn stream_without_resampling(&mut self, sample_streams: Vec<Arc<SampleStream>>, error: anyhow::Error) {
+        for sample_stream in sample_streams.into_iter() {
+            info!("Sample streamer: could not resample {}: {:?}", sample_stream.file_name, error);
+            let file_name = PathBuf::from(sample_stream.file_name.as_str());
+            self.stream_from(sample_stream, file_name);
+        }
+    }
+
+    fn stream_from(&mut self, sample_stream: Arc<SampleStream>, path: PathBuf) {
+        match OpenOptions::ReadOnly(ReadOptions::Auto).from_path(&path) {
+            Ok(file) => self.start_streaming(sample_stream, file),
+            Err(_) => info!("Sample streamer: could not open sample file: {:?}", path),
+        }
+    }
+
+    /// Loads the head window and keeps the file open for the window requests that follow.
+    fn start_streaming(&mut self, sample_stream: Arc<SampleStream>, mut file: SndFile) {
+        let channels = file.get_channels();
+        let length_in_frames = file.len().unwrap_or(0) as usize;
+
+        if let Some(head) = SampleStreamer::read_window(&mut file, channels, 0) {
+            sample_stream.windows.lock().push(SampleStreamWindow { index: 0, samples: head });
+        }
+        sample_stream.length_in_frames.store(length_in_frames, Ordering::Release);
+        sample_stream.channels.store(channels, Ordering::Release);
+
+        self.stream_files.insert(Arc::as_ptr(&sample_stream) as usize, SampleStreamFile { sample_stream: Arc::downgrade(&sample_stream), file });
+    }
+
+    fn load_window(&mut self, sample_stream: &Arc<SampleStream>, window_index: usize) {
+        let channels = sample_stream.channels();
+        if channels > 0 && !sample_stream.has_window(window_index) {
+            if let Some(stream_file) = self.stream_files.get_mut(&(Arc::as_ptr(sample_stream) as usize)) {
+                if let Some(samples) = SampleStreamer::read_window(&mut stream_file.file, channels, window_index) {
+                    sample_stream.add_window(window_index, samples);
+                }
+            }
+        }
+
+        sample_stream.window_request_done(window_index);
+    }
+}
+
+/// Owns the thread that does all the sample file io - preparing streams, resampling and reading windows ahead of playback.
+pub struct SampleStreamer {
+    tx_request: crossbeam_channel::Sender<SampleStreamRequest>,
+}
+
+impl SampleStreamer {
+    pub fn new() -> Self {
+        let (tx_request, rx_request) = crossbeam_channel::bounded::<SampleStreamRequest>(SAMPLE_STREAMER_REQUEST_QUEUE_CAPACITY);
+
+        let _ = thread::Builder::new().name(SAMPLE_STREAMER_THREAD_NAME.to_string()).spawn(move || {
+            SampleStreamerWorker {
+                rx_request,
+                stream_files: HashMap::new(),
+                resample_jobs: VecDeque::new(),
+            }.run();
+        });
+
+        Self {
+            tx_request,
+        }
+    }
+
+    /// Start streaming a sample file at the given sample rate. The file is opened (and resampled if necessary) by the
+    /// sample streamer thread - the stream plays silence until then.
+    pub fn open(&self, file_name: String, sample_rate: i32) -> Arc<SampleStream> {
+        let sample_stream = Arc::new(SampleStream {
+            file_name,
+            sample_rate,
+            channels: AtomicUsize::new(0),
+            length_in_frames: AtomicUsize::new(0),
+            windows: parking_lot::Mutex::new(vec![]),
+            pending_windows: std::array::from_fn(|_| AtomicUsize::new(NO_WINDOW_REQUESTED)),
+            tx_request: self.tx_request.clone(),
+        });
+
+        match self.tx_request.send(SampleStreamRequest::Prepare(sample_stream.clone())) {
+            Ok(_) => (),
+            Err(error) => info!("Sample streamer: could not request the sample be prepared: {:?}", error),
+        }
+
+        sample_stream
+    }
+
+    fn read_window(stream_file: &mut SndFile, channels: usize, window_index: usize) -> Option<Vec<f32>> {
+        if stream_file.seek(SeekFrom::Start((window_index * SAMPLE_STREAM_WINDOW_FRAMES) as u64)).is_err() {
+            return None;
+        }
+
+        let mut samples = vec![0.0_f32; SAMPLE_STREAM_WINDOW_FRAMES * channels];
+        match stream_file.read_to_slice(samples.as_mut_slice()) {
+            Ok(frames_read) => {
+                samples.truncate(frames_read * channels);
+                Some(samples)
+            }
+            Err(_) => None,
+        }
+    }
+
+    /// Resample a whole file to a wave file at to_sample_rate - the sample streamer thread does the same a chunk at a time.
+    pub fn resample(source_file: SndFile, to_sample_rate: u32, path: PathBuf) -> anyhow::Result<()> {
+        let from_sample_rate = source_file.get_samplerate() as u32;
+        let mut resampler = SampleResampler::new(source_file, from_sample_rate, to_sample_rate, path)?;
+        loop {
+            match resampler.resample_chunk() {
+                Ok(true) => break,
+                Ok(false) => (),
+                Err(error) => {
+                    resampler.abandon();
+                    return Err(error);
+                }
+            }
+        }
+        resampler.finish()
+    }
+
+    /// Cache files are keyed on the source file's path, size and modification time as well as the sample rate.
+    fn resample_cache_path(file_name: &str, sample_rate: i32) -> Option<PathBuf> {
+        let metadata = std::fs::metadata(file_name).ok()?;
+        let mut hasher = DefaultHasher::new();
+        file_name.hash(&mut hasher);
+        metadata.len().hash(&mut hasher);
+        if let Ok(modified) = metadata.modified() {
+            modified.hash(&mut hasher);
+        }
+
+        let mut resample_cache_path = dirs::cache_dir()?;
+        resample_cache_path.push("riff-daw");
+        resample_cache_path.push("resampled");
+        std::fs::create_dir_all(&resample_cache_path).ok()?;
+        resample_cache_path.push(format!("{:016x}_{}.wav", hasher.finish(), sample_rate));
+        Some(resample_cache_path)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::sync::Arc;
+    use std::sync::atomic::AtomicUsize;
+
+    use crate::sample_stream::{NO_WINDOW_REQUESTED, SAMPLE_STREAM_WINDOW_FRAMES, SampleStream, SampleStreamRequest, SampleStreamWindow};
+
+    fn mono_sample_stream(length_in_frames: usize) -> (Arc<SampleStream>, crossbeam_channel::Receiver<SampleStreamRequest>) {
+        let (tx_request, rx_request) = crossbeam_channel::bounded(16);
+        let head = (0..SAMPLE_STREAM_WINDOW_FRAMES).map(|frame| frame as f32).collect();
+        let sample_stream = Arc::new(SampleStream {
+            file_name: "test.wav".to_string(),
+            sample_rate: 44100,
+            channels: AtomicUsize::new(1),
+            length_in_frames: AtomicUsize::new(length_in_frames),
+            windows: parking_lot::Mutex::new(vec![SampleStreamWindow { index: 0, samples: head }]),
+            pending_windows: std::array::from_fn(|_| AtomicUsize::new(NO_WINDOW_REQUESTED)),
+            tx_request,
+        });
+        (sample_stream, rx_request)
+    }
+
+    #[test]
+    fn for_each_stereo_frame_skips_and_requests_windows_not_streamed_in_yet() {
+        let (sample_stream, rx_request) = mono_sample_stream(SAMPLE_STREAM_WINDOW_FRAMES * 2);
+        let start_frame = SAMPLE_STREAM_WINDOW_FRAMES - 4;
+        let mut frames = vec![];
+
+        sample_stream.for_each_stereo_frame(start_frame, 8, |frame, left, right| frames.push((frame, left, right)));
+
+        assert_eq!(4, frames.len());
+        assert_eq!((0, start_frame as f32, start_frame as f32), frames[0]);
+        assert_eq!((3, (start_frame + 3) as f32, (start_frame + 3) as f32), frames[3]);
+        match rx_request.try_recv() {
+            Ok(SampleStreamRequest::Window(_, window_index)) => assert_eq!(1, window_index),
+            _ => panic!("expected the second window to be requested"),
+        }
+        // only requested once
+        assert!(rx_request.try_recv().is_err());
+    }
+
+    #[test]
+    fn mix_into_mixes_mono_to_both_sides_with_gain() {
+        let (sample_stream, _rx_request) = mono_sample_stream(SAMPLE_STREAM_WINDOW_FRAMES * 2);
+        let mut out_left = vec![1.0; 8];
+        let mut out_right = vec![1.0; 8];
+
+        sample_stream.mix_into(10, &mut out_left, &mut out_right, 0.5, 2.0);
+
+        assert_eq!(1.0 + 10.0 * 0.5, out_left[0]);
+        assert_eq!(1.0 + 17.0 * 2.0, out_right[7]);
+    }
+
+    #[test]
+    fn for_each_stereo_frame_reads_ahead_half_way_through_a_window() {
+        let (sample_stream, rx_request) = mono_sample_stream(SAMPLE_STREAM_WINDOW_FRAMES * 2);
+
+        sample_stream.for_each_stereo_frame(0, 1024, |_, _, _| {});
+        assert!(rx_request.try_recv().is_err());
+
+        sample_stream.for_each_stereo_frame(SAMPLE_STREAM_WINDOW_FRAMES / 2, 1024, |_, _, _| {});
+        match rx_request.try_recv() {
+            Ok(SampleStreamRequest::Window(_, window_index)) => assert_eq!(1, window_index),
+            _ => panic!("expected the second window to be read ahead"),
+        }
+    }
+
+    #[test]
+    fn window_requests_stay_pending_until_loaded() {
+        let (sample_stream, rx_request) = mono_sample_stream(SAMPLE_STREAM_WINDOW_FRAMES * 4);
+        let start_frame = SAMPLE_STREAM_WINDOW_FRAMES * 2 - 4;
+
+        // spans windows 1 and 2 - neither request replaces the other
+        sample_stream.for_each_stereo_frame(start_frame, 8, |_, _, _| {});
+        sample_stream.for_each_stereo_frame(start_frame, 8, |_, _, _| {});
+
+        let requested: Vec<usize> = rx_request.try_iter().map(|request| match request {
+            SampleStreamRequest::Window(_, window_index) => window_index,
+            SampleStreamRequest::Prepare(_) => panic!("expected window requests"),
+        }).collect();
+        assert_eq!(vec![1, 2], requested);
+
+        // once a window has been loaded it can be requested again after it is evicted
+        sample_stream.window_request_done(1);
+        sample_stream.for_each_stereo_frame(start_frame, 8, |_, _, _| {});
+        match rx_request.try_recv() {
+            Ok(SampleStreamRequest::Window(_, window_index)) => assert_eq!(1, window_index),
+            _ => panic!("expected the second window to be requested again"),
+        }
+    }
+}
@@ -0,0 +1,600 @@
+use std::collections::{HashMap, HashSet};
+use std::panic::{self, AssertUnwindSafe};
+use std::sync::Arc;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::thread;
+use std::time::Duration;
+
+use log::*;
+use thread_priority::*;
+
+use crate::audio_bus::AudioBuses;
+use crate::constants::{TRACK_PROCESSING_COORDINATOR_THREAD_NAME, TRACK_PROCESSING_WORKER_COMMAND_QUEUE_CAPACITY, TRACK_PROCESSING_WORKER_THREAD_NAME};
+
+/// What happened when a track processing task was asked to process a block.
+#[derive(Clone, Copy, PartialEq, Eq)]
+pub enum TrackProcessingTaskStatus {
+    Processed,
+    Rendered, // processed a block for an offline render - the scheduler will not wait for the next jack period
+    Idle,     // no room downstream for another block
+}
+
+/// What started a processing cycle.
+#[derive(Clone, Copy, PartialEq, Eq)]
+pub enum TrackProcessingCycle {
+    Live,    // the jack period - the tracks process in the mode set by the gui
+    Offline, // an offline render asking for its next block - the tracks render into their render ring buffers
+}
+
+/// A track's per block processing. A task is moved to one of the scheduler's workers when it is added and from then on
+/// it is only ever run on that worker's thread - plugins expect to be processed from the same thread every time.
+pub trait TrackProcessingTask: Send {
+    fn track_uuid(&self) -> String;
+    /// The tracks that route events or audio into this track i.e. the tracks that need to be processed first.
+    fn source_track_uuids(&self) -> Vec<String>;
+    /// Whether the source tracks have changed since this was last asked - the processing order is only worked out again
+    /// when they have.
+    fn source_track_uuids_changed(&mut self) -> bool;
+    fn process_block(&mut self, cycle: TrackProcessingCycle) -> TrackProcessingTaskStatus;
+    fn keep_alive(&self) -> bool;
+}
+
+type TaskId = u64;
+
+/// What the coordinator knows about a task - the task itself lives on the worker it is pinned to.
+struct ScheduledTask {
+    task_id: TaskId,
+    track_uuid: String,
+    source_track_uuids: Vec<String>,
+    worker: usize, // 0 is the coordinator
+}
+
+enum TrackProcessingWorkerCommand {
+    AddTask(TaskId, Box<dyn TrackProcessingTask>),
+    SetLevels(Vec<Vec<TaskId>>), // the worker's tasks in each dependency level
+    ProcessLevel(usize, TrackProcessingCycle),
+    Refresh, // drop the tasks that have finished and report the source tracks of the rest
+}
+
+struct TrackProcessingSchedulerShared {
+    rendered: AtomicBool,
+    offline: AtomicBool, // an offline render is driving the cycles - live cycles are held back
+    tasks_changed: AtomicBool, // a task finished, panicked or had its source tracks change
+}
+
+struct PinnedTrackProcessingTask {
+    task_id: TaskId,
+    task: Box<dyn TrackProcessingTask>,
+    panicked: bool,
+}
+
+/// The tasks pinned to one thread and the order to process them in.
+#[derive(Default)]
+struct TrackProcessingWorker {
+    tasks: Vec<PinnedTrackProcessingTask>,
+    levels: Vec<Vec<usize>>, // indexes into tasks for each dependency level
+}
+
+impl TrackProcessingWorker {
+    fn add_task(&mut self, task_id: TaskId, task: Box<dyn TrackProcessingTask>) {
+        self.tasks.push(PinnedTrackProcessingTask { task_id, task, panicked: false });
+    }
+
+    fn set_levels(&mut self, levels: Vec<Vec<TaskId>>) {
+        let tasks = &self.tasks;
+        self.levels = levels.iter()
+            .map(|level| level.iter().filter_map(|task_id| tasks.iter().position(|task| task.task_id == *task_id)).collect())
+            .collect();
+    }
+
+    /// A task that panics is not run again and the level still completes so that the coordinator is never left waiting.
+    fn process_level(&mut self, level: usize, cycle: TrackProcessingCycle, shared: &TrackProcessingSchedulerShared) {
+        let Self { tasks, levels } = self;
+        if let Some(level) = levels.get(level) {
+            for index in level.iter() {
+                if let Some(pinned_task) = tasks.get_mut(*index) {
+                    if pinned_task.panicked || !pinned_task.task.keep_alive() {
+                        continue;
+                    }
+                    match panic::catch_unwind(AssertUnwindSafe(|| pinned_task.task.process_block(cycle))) {
+                        Ok(TrackProcessingTaskStatus::Rendered) => shared.rendered.store(true, Ordering::Relaxed),
+                        Ok(_) => (),
+                        Err(_) => {
+                            error!("Track processing scheduler: processing track {} panicked - it will not be processed again.", pinned_task.task.track_uuid());
+                            pinned_task.panicked = true;
+                        }
+                    }
+                    if pinned_task.panicked || !pinned_task.task.keep_alive() || pinned_task.task.source_track_uuids_changed() {
+                        shared.tasks_changed.store(true, Ordering::Relaxed);
+                    }
+                }
+            }
+        }
+    }
+
+    /// Drop the tasks that have finished and return the rest along with their source tracks.
+    /// A task that panicked may have left its plugins in any state so it is leaked rather than dropped.
+    fn refresh(&mut self) -> Vec<(TaskId, Vec<String>)> {
+        self.levels.clear();
+        for pinned_task in std::mem::take(&mut self.tasks).into_iter() {
+            if pinned_task.panicked {
+                std::mem::forget(pinned_task);
+            }
+            else if pinned_task.task.keep_alive() {
+                self.tasks.push(pinned_task);
+            }
+        }
+        self.tasks.iter().map(|pinned_task| (pinned_task.task_id, pinned_task.task.source_track_uuids())).collect()
+    }
+}
+
+struct TrackProcessingWorkerHandle {
+    tx_command: crossbeam_channel::Sender<TrackProcessingWorkerCommand>,
+}
+
+/// Processes all the tracks on a fixed pool of worker threads sized to the number of cores instead of a thread per track.
+/// Each track is pinned to the worker with the fewest tracks when it is added. Each cycle processes the tracks in
+/// dependency order - tracks that are routed into other tracks go first - and the workers process their tracks in a level
+/// in parallel. The levels are only worked out again when tracks are added or finish or their routings change.
+/// A cycle is started by the jack process callback calling wake() or, during an offline render, by the render asking
+/// for each block with process_offline_block(). Audio routed between tracks goes through the scheduler's audio buses.
+pub struct TrackProcessingScheduler {
+    tx_new_task: crossbeam_channel::Sender<Box<dyn TrackProcessingTask>>,
+    coordinator: Option<thread::Thread>,
+    audio_buses: AudioBuses,
+    shared: Arc<TrackProcessingSchedulerShared>,
+    tx_offline_block: crossbeam_channel::Sender<()>,
+    rx_offline_block_done: crossbeam_channel::Receiver<()>,
+}
+
+impl TrackProcessingScheduler {
+    pub fn new() -> Self {
+        Self::with_workers(thread::available_parallelism().map(|cores| cores.get()).unwrap_or(1))
+    }
+
+    /// A scheduler with a pool of number_of_workers threads, counting the coordinator - for when several schedulers
+    /// share the cores, as the headless renderer's jobs do.
+    pub fn with_workers(number_of_workers: usize) -> Self {
+        let number_of_cores = number_of_workers.max(1);
+        let (tx_new_task, rx_new_task) = crossbeam_channel::unbounded::<Box<dyn TrackProcessingTask>>();
+        let (tx_level_done, rx_level_done) = crossbeam_channel::bounded::<()>(number_of_cores);
+        let (tx_refreshed, rx_refreshed) = crossbeam_channel::unbounded::<(usize, Vec<(TaskId, Vec<String>)>)>();
+        let (tx_offline_block, rx_offline_block) = crossbeam_channel::bounded::<()>(1);
+        let (tx_offline_block_done, rx_offline_block_done) = crossbeam_channel::bounded::<()>(1);
+        let audio_buses = AudioBuses::default();
+        let shared = Arc::new(TrackProcessingSchedulerShared {
+            rendered: AtomicBool::new(false),
+            offline: AtomicBool::new(false),
+            tasks_changed: AtomicBool::new(false),
+        });
+
+        // the coordinator processes tasks too so it counts as one of the workers
+        let mut workers = vec![];
+        for worker_number in 1..number_of_cores {
+            let shared = shared.clone();
+            let (tx_command, rx_command) = crossbeam_channel::bounded(TRACK_PROCESSING_WORKER_COMMAND_QUEUE_CAPACITY);
+            let tx_level_done = tx_level_done.clone();
+            let tx_refreshed = tx_refreshed.clone();
+            match ThreadBuilder::default()
+                .name(format!("{} {}", TRACK_PROCESSING_WORKER_THREAD_NAME, worker_number))
+                .priority(ThreadPriority::Crossplatform(95.try_into().unwrap()))
+                .spawn(move |result| {
+                    match result {
+                        Ok(_) => info!("Thread set to max priority: 95."),
+                        Err(error) => info!("Could not set thread to max priority: {:?}.", error),
+                    }
+                    Self::run_worker(worker_number, shared, rx_command, tx_level_done, tx_refreshed);
+                }) {
+                Ok(_) => workers.push(TrackProcessingWorkerHandle { tx_command }),
+                Err(error) => info!("{:?}", error),
+            }
+        }
+
+        let coordinator_shared = shared.clone();
+        let coordinator = match ThreadBuilder::default()
+            .name(TRACK_PROCESSING_COORDINATOR_THREAD_NAME.to_string())
+            .priority(ThreadPriority::Crossplatform(95.try_into().unwrap()))
+            .spawn(move |result| {
+                match result {
+                    Ok(_) => info!("Thread set to max priority: 95."),
+                    Err(error) => info!("Could not set thread to max priority: {:?}.", error),
+                }
+                Self::run_coordinator(coordinator_shared, workers, rx_new_task, rx_level_done, rx_refreshed, rx_offline_block, tx_offline_block_done);
+            }) {
+            Ok(join_handle) => Some(join_handle.thread().clone()),
+            Err(error) => {
+                info!("{:?}", error);
+                None
+            }
+        };
+
+        Self {
+            tx_new_task,
+            coordinator,
+            audio_buses,
+            shared,
+            tx_offline_block,
+            rx_offline_block_done,
+        }
+    }
+
+    pub fn audio_buses(&self) -> &AudioBuses {
+        &self.audio_buses
+    }
+
+    /// Hand a track's processing over to the scheduler. It is picked up at the start of the next cycle.
+    pub fn add_task(&self, task: Box<dyn TrackProcessingTask>) {
+        match self.tx_new_task.send(task) {
+            Ok(_) => self.wake(),
+            Err(_) => info!("Track processing scheduler: could not add task."),
+        }
+    }
+
+    /// Start a processing cycle. Safe to call from the jack process callback - it does not lock or allocate.
+    pub fn wake(&self) {
+        if let Some(coordinator) = &self.coordinator {
+            coordinator.unpark();
+        }
+    }
+
+    /// Hand the cycles over to an offline render - from now until end_offline_render() the tracks only process a block
+    /// when process_offline_block() asks for one. Call before sending the tracks anything for the render so that no
+    /// live cycle moves them on first.
+    pub fn begin_offline_render(&self) {
+        self.shared.offline.store(true, Ordering::Release);
+    }
+
+    /// Process every track's next block for an offline render - in dependency order, in parallel where tracks don't
+    /// depend on each other - and wait until they have all been processed.
+    pub fn process_offline_block(&self) {
+        if self.coordinator.is_none() || self.tx_offline_block.send(()).is_err() {
+            return;
+        }
+        self.wake();
+        let _ = self.rx_offline_block_done.recv();
+    }
+
+    /// Give the cycles back to the jack period.
+    pub fn end_offline_render(&self) {
+        self.shared.offline.store(false, Ordering::Release);
+        self.wake();
+    }
+
+    fn run_worker(
+        worker_number: usize,
+        shared: Arc<TrackProcessingSchedulerShared>,
+        rx_command: crossbeam_channel::Receiver<TrackProcessingWorkerCommand>,
+        tx_level_done: crossbeam_channel::Sender<()>,
+        tx_refreshed: crossbeam_channel::Sender<(usize, Vec<(TaskId, Vec<String>)>)>,
+    ) {
+        let mut worker = TrackProcessingWorker::default();
+
+        for command in rx_command.iter() {
+            match command {
+                TrackProcessingWorkerCommand::AddTask(task_id, task) => worker.add_task(task_id, task),
+                TrackProcessingWorkerCommand::SetLevels(levels) => worker.set_levels(levels),
+                TrackProcessingWorkerCommand::ProcessLevel(level, cycle) => {
+                    worker.process_level(level, cycle, &shared);
+                    let _ = tx_level_done.send(());
+                }
+                TrackProcessingWorkerCommand::Refresh => {
+                    let _ = tx_refreshed.send((worker_number, worker.refresh()));
+                }
+            }
+        }
+    }
+
+    fn run_coordinator(
+        shared: Arc<TrackProcessingSchedulerShared>,
+        workers: Vec<TrackProcessingWorkerHandle>,
+        rx_new_task: crossbeam_channel::Receiver<Box<dyn TrackProcessingTask>>,
+        rx_level_done: crossbeam_channel::Receiver<()>,
+        rx_refreshed: crossbeam_channel::Receiver<(usize, Vec<(TaskId, Vec<String>)>)>,
+        rx_offline_block: crossbeam_channel::Receiver<()>,
+        tx_offline_block_done: crossbeam_channel::Sender<()>,
+    ) {
+        let mut own_worker = TrackProcessingWorker::default();
+        let mut scheduled_tasks: Vec<ScheduledTask> = vec![];
+        let mut next_task_id: TaskId = 0;
+        let mut level_workers: Vec<Vec<usize>> = vec![]; // the other workers with tasks in each level
+
+        loop {
+            // woken by the jack period - time out so that coasting tracks still get processed when jack is not running
+            thread::park_timeout(Duration::from_millis(100));
+
+            loop {
+                let cycle = if rx_offline_block.try_recv().is_ok() {
+                    TrackProcessingCycle::Offline
+                }
+                else if shared.offline.load(Ordering::Acquire) {
+                    // the offline render decides when the tracks move on
+                    break;
+                }
+                else {
+                    TrackProcessingCycle::Live
+                };
+
+                let mut tasks_changed = false;
+                while let Ok(task) = rx_new_task.try_recv() {
+                    let mut worker_task_counts = vec![0usize; workers.len() + 1];
+                    for scheduled_task in scheduled_tasks.iter() {
+                        worker_task_counts[scheduled_task.worker] += 1;
+                    }
+                    let worker = (0..worker_task_counts.len()).min_by_key(|worker| worker_task_counts[*worker]).unwrap_or(0);
+                    let task_id = next_task_id;
+                    next_task_id += 1;
+
+                    scheduled_tasks.push(ScheduledTask { task_id, track_uuid: task.track_uuid(), source_track_uuids: task.source_track_uuids(), worker });
+                    if worker == 0 {
+                        own_worker.add_task(task_id, task);
+                    }
+                    else if workers[worker - 1].tx_command.send(TrackProcessingWorkerCommand::AddTask(task_id, task)).is_err() {
+                        info!("Track processing scheduler: could not hand a task to worker {}.", worker);
+                    }
+                    tasks_changed = true;
+                }
+
+                if shared.tasks_changed.swap(false, Ordering::Relaxed) {
+                    let mut remaining_tasks: HashMap<TaskId, Vec<String>> = own_worker.refresh().into_iter().collect();
+                    let mut refreshing = 0;
+                    for worker in workers.iter() {
+                        if worker.tx_command.send(TrackProcessingWorkerCommand::Refresh).is_ok() {
+                            refreshing += 1;
+                        }
+                    }
+                    for _ in 0..refreshing {
+                        match rx_refreshed.recv() {
+                            Ok((_, worker_tasks)) => remaining_tasks.extend(worker_tasks),
+                            Err(_) => break,
+                        }
+                    }
+                    scheduled_tasks.retain_mut(|scheduled_task| match remaining_tasks.remove(&scheduled_task.task_id) {
+                        Some(source_track_uuids) => {
+                            scheduled_task.source_track_uuids = source_track_uuids;
+                            true
+                        }
+                        None => false,
+                    });
+                    tasks_changed = true;
+                }
+
+                if tasks_changed {
+                    level_workers = Self::distribute_levels(&scheduled_tasks, &mut own_worker, &workers);
+                }
+
+                shared.rendered.store(false, Ordering::Relaxed);
+
+                for (level, workers_in_level) in level_workers.iter().enumerate() {
+                    let mut remaining = 0;
+                    for worker in workers_in_level.iter() {
+                        if workers[*worker - 1].tx_command.send(TrackProcessingWorkerCommand::ProcessLevel(level, cycle)).is_ok() {
+                            remaining += 1;
+                        }
+                    }
+
+                    // process this thread's tasks and then wait for the level to complete before starting on the tracks
+                    // that depend on it - workers always report back even if a task panics
+                    own_worker.process_level(level, cycle, &shared);
+                    while remaining > 0 {
+                        if rx_level_done.recv().is_err() {
+                            break;
+                        }
+                        remaining -= 1;
+                    }
+                }
+
+                if cycle == TrackProcessingCycle::Offline {
+                    let _ = tx_offline_block_done.send(());
+                    continue;
+                }
+
+                // when rendering go as fast as possible rather than waiting for jack
+                if !shared.rendered.load(Ordering::Relaxed) {
+                    break;
+                }
+            }
+        }
+    }
+
+    /// Work out the dependency levels and tell each worker which of its tasks are in each level.
+    /// Returns the other workers that have tasks in each level.
+    fn distribute_levels(scheduled_tasks: &[ScheduledTask], own_worker: &mut TrackProcessingWorker, workers: &[TrackProcessingWorkerHandle]) -> Vec<Vec<usize>> {
+        let levels = Self::dependency_levels(scheduled_tasks);
+        let mut worker_levels: Vec<Vec<Vec<TaskId>>> = vec![vec![vec![]; levels.len()]; workers.len() + 1];
+        let mut level_workers: Vec<Vec<usize>> = vec![vec![]; levels.len()];
+        for (level_index, level) in levels.iter().enumerate() {
+            for task in level.iter() {
+                let scheduled_task = &scheduled_tasks[*task];
+                worker_levels[scheduled_task.worker][level_index].push(scheduled_task.task_id);
+                if scheduled_task.worker != 0 && !level_workers[level_index].contains(&scheduled_task.worker) {
+                    level_workers[level_index].push(scheduled_task.worker);
+                }
+            }
+        }
+
+        let mut worker_levels = worker_levels.into_iter();
+        if let Some(levels) = worker_levels.next() {
+            own_worker.set_levels(levels);
+        }
+        for (worker, levels) in workers.iter().zip(worker_levels) {
+            let _ = worker.tx_command.send(TrackProcessingWorkerCommand::SetLevels(levels));
+        }
+        level_workers
+    }
+
+    /// Groups the tasks into levels - every task in a level only depends on tasks in earlier levels.
+    /// Tasks caught in a routing cycle are put in the last level so that they still get processed.
+    fn dependency_levels(tasks: &[ScheduledTask]) -> Vec<Vec<usize>> {
+        let mut task_indexes: HashMap<&str, usize> = HashMap::new();
+        let mut sources: Vec<HashSet<usize>> = vec![];
+
+        for (index, task) in tasks.iter().enumerate() {
+            task_indexes.insert(task.track_uuid.as_str(), index);
+        }
+        for (index, task) in tasks.iter().enumerate() {
+            sources.push(task.source_track_uuids.iter()
+                .filter_map(|source_track_uuid| task_indexes.get(source_track_uuid.as_str()).copied())
+                .filter(|source_index| *source_index != index)
+                .collect());
+        }
+
+        let mut levels: Vec<Vec<usize>> = vec![];
+        let mut scheduled: HashSet<usize> = HashSet::new();
+        while scheduled.len() < tasks.len() {
+            let level: Vec<usize> = (0..tasks.len())
+                .filter(|index| !scheduled.contains(index) && sources[*index].iter().all(|source| scheduled.contains(source)))
+                .collect();
+
+            if level.is_empty() {
+                levels.push((0..tasks.len()).filter(|index| !scheduled.contains(index)).collect());
+                break;
+            }
+
+            for index in level.iter() {
+                scheduled.insert(*index);
+            }
+            levels.push(level);
+        }
+        levels
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::sync::Arc;
+    use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+
+    use crate::scheduler::{ScheduledTask, TrackProcessingCycle, TrackProcessingScheduler, TrackProcessingSchedulerShared, TrackProcessingTask, TrackProcessingTaskStatus, TrackProcessingWorker};
+
+    struct TestTask {
+        track_uuid: String,
+        panics: bool,
+    }
+
+    impl TrackProcessingTask for TestTask {
+        fn track_uuid(&self) -> String {
+            self.track_uuid.clone()
+        }
+
+        fn source_track_uuids(&self) -> Vec<String> {
+            vec![]
+        }
+
+        fn source_track_uuids_changed(&mut self) -> bool {
+            false
+        }
+
+        fn process_block(&mut self, _cycle: TrackProcessingCycle) -> TrackProcessingTaskStatus {
+            if self.panics {
+                panic!("plugin crashed");
+            }
+            TrackProcessingTaskStatus::Rendered
+        }
+
+        fn keep_alive(&self) -> bool {
+            true
+        }
+    }
+
+    struct OfflineCountingTask {
+        track_uuid: String,
+        offline_blocks: Arc<AtomicUsize>,
+    }
+
+    impl TrackProcessingTask for OfflineCountingTask {
+        fn track_uuid(&self) -> String {
+            self.track_uuid.clone()
+        }
+
+        fn source_track_uuids(&self) -> Vec<String> {
+            vec![]
+        }
+
+        fn source_track_uuids_changed(&mut self) -> bool {
+            false
+        }
+
+        fn process_block(&mut self, cycle: TrackProcessingCycle) -> TrackProcessingTaskStatus {
+            if cycle == TrackProcessingCycle::Offline {
+                self.offline_blocks.fetch_add(1, Ordering::SeqCst);
+            }
+            TrackProcessingTaskStatus::Idle
+        }
+
+        fn keep_alive(&self) -> bool {
+            true
+        }
+    }
+
+    fn task(track_uuid: &str, source_track_uuids: &[&str]) -> ScheduledTask {
+        ScheduledTask {
+            task_id: 0,
+            track_uuid: track_uuid.to_string(),
+            source_track_uuids: source_track_uuids.iter().map(|source_track_uuid| source_track_uuid.to_string()).collect(),
+            worker: 0,
+        }
+    }
+
+    #[test]
+    fn dependency_levels_process_source_tracks_first() {
+        let tasks = vec![
+            task("bus", &["lead", "pad"]),
+            task("lead", &[]),
+            task("pad", &["lead"]),
+            task("drums", &["deleted track"]),
+        ];
+
+        let levels = TrackProcessingScheduler::dependency_levels(&tasks);
+
+        assert_eq!(vec![vec![1, 3], vec![2], vec![0]], levels);
+    }
+
+    #[test]
+    fn dependency_levels_still_schedule_routing_cycles() {
+        let tasks = vec![
+            task("a", &["b"]),
+            task("b", &["a"]),
+            task("c", &[]),
+        ];
+
+        let levels = TrackProcessingScheduler::dependency_levels(&tasks);
+
+        assert_eq!(vec![vec![2], vec![0, 1]], levels);
+    }
+
+    #[test]
+    fn a_panicking_task_does_not_stop_the_level_and_is_removed() {
+        let shared = TrackProcessingSchedulerShared { rendered: AtomicBool::new(false), offline: AtomicBool::new(false), tasks_changed: AtomicBool::new(false) };
+        let mut worker = TrackProcessingWorker::default();
+        worker.add_task(1, Box::new(TestTask { track_uuid: "crashing".to_string(), panics: true }));
+        worker.add_task(2, Box::new(TestTask { track_uuid: "lead".to_string(), panics: false }));
+        worker.set_levels(vec![vec![1, 2]]);
+
+        worker.process_level(0, TrackProcessingCycle::Live, &shared);
+
+        // the task after the one that panicked was still processed
+        assert!(shared.rendered.load(Ordering::Relaxed));
+        assert!(shared.tasks_changed.load(Ordering::Relaxed));
+        let remaining_tasks: Vec<u64> = worker.refresh().into_iter().map(|(task_id, _)| task_id).collect();
+        assert_eq!(vec![2], remaining_tasks);
+    }
+
+    #[test]
+    fn an_offline_block_is_processed_once_by_every_task_before_it_returns() {
+        let scheduler = TrackProcessingScheduler::with_workers(2);
+        let offline_blocks: Vec<Arc<AtomicUsize>> = (0..3).map(|_| Arc::new(AtomicUsize::new(0))).collect();
+        for (index, offline_blocks) in offline_blocks.iter().enumerate() {
+            scheduler.add_task(Box::new(OfflineCountingTask { track_uuid: format!("track {}", index), offline_blocks: offline_blocks.clone() }));
+        }
+
+        scheduler.begin_offline_render();
+        for _ in 0..4 {
+            scheduler.process_offline_block();
+        }
+        scheduler.end_offline_render();
+
+        for offline_blocks in offline_blocks.iter() {
+            assert_eq!(4, offline_blocks.load(Ordering::SeqCst));
+        }
+    }
+}
@@ -1,6 +1,6 @@
 extern crate factor;
 
-use std::{collections::HashMap, sync::{Arc, mpsc::{channel, Receiver, Sender}, Mutex}, time::Duration};
+use std::{collections::HashMap, sync::{Arc, atomic::{AtomicUsize, Ordering}, mpsc::{channel, Sender}, Mutex}, time::Duration};
 use std::collections::HashSet;
 use std::thread;
 
@@ -9,7 +9,7 @@ use apres::MIDIEvent::{InstrumentName, TrackName};
 use factor::factor_include::factor_include;
 use indexmap::IndexMap;
 use itertools::Itertools;
-use jack::{AsyncClient, Client, ClientOptions, PortFlags};
+use jack::{AsyncClient, Client, ClientOptions, MidiOut, PortFlags};
 use log::*;
 use rb::{RB, RbConsumer, SpscRb};
 use simple_clap_host_helper_lib::plugin::library::PluginLibrary;
@@ -17,7 +17,7 @@ use uuid::Uuid;
 use vst::api::TimeInfo;
 use vst::host::PluginLoader;
 
-use crate::{Audio, AudioLayerOutwardEvent, DAWUtils, domain::*, event::{AudioLayerInwardEvent, CurrentView, DAWEvents, TrackBackgroundProcessorInwardEvent, TrackBackgroundProcessorOutwardEvent, AutomationEditType}, GeneralTrackType, JackNotificationHandler};
+use crate::{Audio, AudioLayerOutwardEvent, audio_bus::AudioBusReceiver, autosave::Autosaver, delay_compensation::{calculate_delay_compensation, TrackDelayCompensation, TrackDelayCompensator, TrackPluginLatency}, constants::{BUILT_IN, DEFAULT_BLOCK_SIZE, DEFAULT_SAMPLE_RATE, PLAYBACK_SCHEDULE_COMPILER_THREAD_NAME, RIFF_SEQUENCE_LENGTH_IN_BEATS}, DAWUtils, domain::*, event::{AudioLayerInwardEvent, CurrentView, DAWEvents, NotificationType, TrackBackgroundProcessorInwardEvent, TrackChangeType, TrackBackgroundProcessorOutwardEvent, AutomationEditType}, GeneralTrackType, JackNotificationHandler, id_interner::{IdInterner, IdSlotMap}, playback_schedule::{PlaybackSchedule, PlaybackScheduleCache, PlaybackScheduleLayout, TrackScheduleInputs, TrackScheduleLayout, TrackScheduleSource}, project_file::ProjectFile, project_snapshot::{ArrangementSnapshot, ProjectSnapshot, SelectionSnapshot, SnapshotCell, TrackSnapshot, TransportSnapshot}, render::render_song_to_wave_files, sample_stream::SampleStreamer, scheduler::TrackProcessingScheduler, telemetry::telemetry, waveform_peaks::WaveformPeakCache};
 use crate::TrackType;
 
 extern {
@@ -32,6 +32,16 @@ pub enum AutomationViewMode {
     NoteExpression,
 }
 
+/// What starting a track's processing needs - see DAWState::init_track.
+#[derive(Clone)]
+pub struct TrackProcessingContext {
+    pub vst24_plugin_loaders: Arc<Mutex<HashMap<String, PluginLoader<VstHost>>>>,
+    pub clap_plugin_loaders: Arc<Mutex<HashMap<String, PluginLibrary>>>,
+    pub tx_audio: crossbeam_channel::Sender<AudioLayerInwardEvent>,
+    pub track_audio_coast: Arc<Mutex<TrackBackgroundProcessorMode>>,
+    pub vst_host_time_info: Arc<parking_lot::RwLock<TimeInfo>>,
+}
+
 pub struct DAWState {
     pub configuration: DAWConfiguration,
     project: Project,
@@ -39,9 +49,11 @@ pub struct DAWState {
     selected_riff_uuid_map: HashMap<String, String>,
     selected_riff_ref_uuid: Option<String>,
     current_file_path: Option<String>,
+    save_as_required: bool, // the project was recovered from an autosave checkpoint - Save must not write over either file
     sender: crossbeam_channel::Sender<DAWEvents>,
-    pub instrument_track_senders: HashMap<String, Sender<TrackBackgroundProcessorInwardEvent>>,
-    pub instrument_track_receivers: HashMap<String, Receiver<TrackBackgroundProcessorOutwardEvent>>,
+    pub id_interner: IdInterner, // track and plugin uuids to handles for the hot lookups
+    pub instrument_track_senders: IdSlotMap<Sender<TrackBackgroundProcessorInwardEvent>>, // track handle
+    pub instrument_track_receivers: HashMap<String, crossbeam_channel::Receiver<TrackBackgroundProcessorOutwardEvent>>,
     pub audio_plugin_parameters: HashMap<String, HashMap<String, Vec<PluginParameterDetail>>>,
     active_loop: Option<Uuid>,
     looping: bool,
@@ -49,6 +61,7 @@ pub struct DAWState {
     playing: bool,
     play_mode: PlayMode,
     playing_riff_set: Option<String>,
+    playing_riff_sequence_or_arrangement: Option<String>, // uuid - what the tracks were last sent in those play modes
     play_position_in_frames: u32,
     track_event_copy_buffer: Vec<TrackEvent>,
     riff_references_copy_buffer: Vec<RiffReference>,
@@ -66,6 +79,7 @@ pub struct DAWState {
     jack_client: Vec<AsyncClient<JackNotificationHandler, Audio>>,
     jack_connections: HashMap<String, String>,
     sample_data: HashMap<String, SampleData>,
+    frozen_track_audio: HashMap<String, (SampleData, usize)>, // by track uuid - frozen audio, output delay compensation rendered into it
     track_render_audio_consumers: Arc<Mutex<HashMap<String, AudioConsumerDetails<f32>>>>,
     centre_split_pane_position: i32,
     vst_instrument_plugins: IndexMap<String, String>,
@@ -73,19 +87,39 @@ pub struct DAWState {
     track_grid_cursor_follow: bool,
     pub current_view: CurrentView,
     pub dirty: bool,
+    track_processing_scheduler: Arc<TrackProcessingScheduler>,
+    sample_streamer: Arc<SampleStreamer>,
+    waveform_peak_cache: Arc<WaveformPeakCache>,
+    audio_block_size: usize,
+    audio_sample_rate: f64,
+    track_plugin_latencies: HashMap<String, TrackPluginLatency>,
+    delay_compensation_latency: Arc<AtomicUsize>, // shared with the jack notification handler, which reports it to jack
+    project_revision: u64,
+    song_revision: u64, // the project revision when anything other than a single track may have last changed
+    track_revisions: HashMap<String, u64>, // track uuid, the project revision when the track was last changed through track_mut
+    project_snapshot: Arc<SnapshotCell<ProjectSnapshot>>,
+    playback_schedules: Arc<parking_lot::Mutex<PlaybackScheduleCache>>, // riff set, sequence or arrangement uuid
 }
 
 impl DAWState {
     pub fn new(sender: crossbeam_channel::Sender<DAWEvents>) -> Self {
+        Self::with_track_processing_scheduler(sender, Arc::new(TrackProcessingScheduler::new()))
+    }
+
+    /// A state whose tracks are processed by the given scheduler rather than one sized to all the cores.
+    pub fn with_track_processing_scheduler(sender: crossbeam_channel::Sender<DAWEvents>, track_processing_scheduler: Arc<TrackProcessingScheduler>) -> Self {
         Self {
             configuration: DAWConfiguration::load_config(),
             project: Project::new(),
             current_file_path: None,
+            save_as_required: false,
+            waveform_peak_cache: Arc::new(WaveformPeakCache::new(sender.clone())),
             sender,
             selected_track: None,
             selected_riff_uuid_map: HashMap::new(),
             selected_riff_ref_uuid: None,
-            instrument_track_senders: HashMap::new(),
+            id_interner: IdInterner::default(),
+            instrument_track_senders: IdSlotMap::default(),
             instrument_track_receivers: HashMap::new(),
             audio_plugin_parameters: HashMap::new(),
             active_loop: None,
@@ -94,6 +128,7 @@ impl DAWState {
             playing: false,
             play_mode: PlayMode::Song,
             playing_riff_set: None,
+            playing_riff_sequence_or_arrangement: None,
             play_position_in_frames: 0,
             track_event_copy_buffer: vec![],
             riff_references_copy_buffer: vec![],
@@ -110,6 +145,7 @@ impl DAWState {
             jack_client: vec![],
             jack_connections: HashMap::new(),
             sample_data: HashMap::new(),
+            frozen_track_audio: HashMap::new(),
             track_render_audio_consumers: Arc::new(Mutex::new(HashMap::new())),
             centre_split_pane_position: 600,
             vst_instrument_plugins: IndexMap::new(),
@@ -118,9 +154,21 @@ impl DAWState {
             current_view: CurrentView::Track,
             selected_riff_arrangement_uuid: None,
             dirty: false,
+            track_processing_scheduler,
+            sample_streamer: Arc::new(SampleStreamer::new()),
+            audio_block_size: DEFAULT_BLOCK_SIZE,
+            audio_sample_rate: DEFAULT_SAMPLE_RATE,
+            track_plugin_latencies: HashMap::new(),
+            delay_compensation_latency: Arc::new(AtomicUsize::new(0)),
+            project_revision: 1, // the empty snapshot is revision 0
+            song_revision: 1,
+            track_revisions: HashMap::new(),
+            project_snapshot: Arc::new(SnapshotCell::default()),
+            playback_schedules: Arc::new(parking_lot::Mutex::new(PlaybackScheduleCache::default())),
         }
     }
 
+    /// Load a project and start its tracks - false if the project could not be read.
     pub fn load_from_file(&mut self,
                             vst24_plugin_loaders: Arc<Mutex<HashMap<String, PluginLoader<VstHost>>>>,
                             clap_plugin_loaders: Arc<Mutex<HashMap<String, PluginLibrary>>>,
@@ -128,26 +176,54 @@ impl DAWState {
                             tx_audio: crossbeam_channel::Sender<AudioLayerInwardEvent>,
                             track_audio_coast: Arc<Mutex<TrackBackgroundProcessorMode>>,
                             vst_host_time_info: Arc<parking_lot::RwLock<TimeInfo>>,
+    ) -> anyhow::Result<()> {
+        let project = DAWState::read_project_from_file(path)?;
+        self.load_project(project, path, vst24_plugin_loaders, clap_plugin_loaders, tx_audio, track_audio_coast, vst_host_time_info);
+        Ok(())
+    }
+
+    /// Replace the current project with one already read from path. Reading is kept separate so that a project that
+    /// can't be read leaves the current project (and the file it is saved to) untouched.
+    pub fn load_project(&mut self,
+                        project: Project,
+                        path: &str,
+                        vst24_plugin_loaders: Arc<Mutex<HashMap<String, PluginLoader<VstHost>>>>,
+                        clap_plugin_loaders: Arc<Mutex<HashMap<String, PluginLibrary>>>,
+                        tx_audio: crossbeam_channel::Sender<AudioLayerInwardEvent>,
+                        track_audio_coast: Arc<Mutex<TrackBackgroundProcessorMode>>,
+                        vst_host_time_info: Arc<parking_lot::RwLock<TimeInfo>>,
     ) {
-        self.current_file_path = Some(path.to_string());
-        let json_text = std::fs::read_to_string(path).unwrap();
-        let project: Project = serde_json::from_str(&json_text).unwrap();
         let mut instrument_track_senders2 = HashMap::new();
         let mut instrument_track_receivers2 = HashMap::new();
 
         self.project = project;
+        // a recovered checkpoint stands in for its project file - autosaves go next to that file again and saving
+        // needs a Save As so that neither the checkpoint nor the project file is overwritten by accident
+        if Autosaver::is_checkpoint(path) {
+            self.current_file_path = Autosaver::project_path_for_checkpoint(path);
+            self.save_as_required = true;
+        }
+        else {
+            self.current_file_path = Some(path.to_string());
+            self.save_as_required = false;
+        }
+        self.bump_project_revision();
+        self.song_revision = self.project_revision;
+        self.track_revisions.clear();
+        self.playback_schedules.lock().clear();
 
         // let mut song_length_in_beats: u64 = 0;
 
-        // load all the samples - create the sample data objects
-        let sample_rate = self.get_project().song_mut().sample_rate();
+        // open all the samples at the jack sample rate - they are streamed from disk so this does not read them
+        let sample_rate = self.audio_sample_rate;
+        let sample_streamer = self.sample_streamer();
         let mut sample_references = HashMap::new();
         let mut samples_data = HashMap::new();
         for (_sample_uuid, sample) in self.get_project().song_mut().samples_mut().iter_mut() {
             let sample_data_uuid = sample.sample_data_uuid();
             let sample_file_name = sample.file_name();
 
-            let sample_data = SampleData::new_with_uuid(sample_data_uuid.to_string(), sample_file_name.to_string(), sample_rate as i32);
+            let sample_data = SampleData::new_with_uuid(sample_data_uuid.to_string(), sample_file_name.to_string(), sample_rate as i32, &sample_streamer);
             samples_data.insert(sample_data_uuid.to_string(), sample_data);
             sample_references.insert(sample.uuid().to_string(), sample_data_uuid.to_string());
         }
@@ -158,6 +234,7 @@ impl DAWState {
         info!("state.load_from_file() - number of riff sequences={}", self.project().song().riff_sequences().len());
 
         {
+            let track_processing_scheduler = self.track_processing_scheduler.clone();
             for track in self.get_project().song_mut().tracks_mut().iter_mut() {
                 // Self::add_track(vst_plugin_loaders.clone(), tx_audio.clone(), track_audio_coast.clone(), &mut instrument_track_senders2, &mut instrument_track_receivers2, track_type)
                 Self::init_track(
@@ -171,6 +248,7 @@ impl DAWState {
                     Some(&sample_references),
                     Some(&samples_data),
                     vst_host_time_info.clone(),
+                    track_processing_scheduler.clone(),
                 );
             }
         }
@@ -186,13 +264,87 @@ impl DAWState {
                 }
             }
         }
+
+        self.restore_frozen_tracks();
+    }
+
+    /// Play the frozen audio of the frozen tracks in a newly loaded project. Tracks that have changed since they were
+    /// frozen or whose freeze file has gone are unfrozen and play live instead.
+    fn restore_frozen_tracks(&mut self) {
+        self.frozen_track_audio.clear();
+        let (frozen_tracks, stale_tracks) = self.frozen_tracks_by_staleness();
+        self.unfreeze_stale_tracks(stale_tracks);
+        for (track_uuid, frozen) in frozen_tracks {
+            self.set_track_frozen(track_uuid, Some(frozen));
+        }
+    }
+
+    /// Unfreeze the frozen tracks that have been edited since they were frozen - their frozen audio is no longer what
+    /// their instrument and effects would play. Checked whenever the song is about to be played or rendered as the
+    /// tracks can be edited in many places while frozen.
+    pub fn unfreeze_changed_tracks(&mut self) {
+        let (_, stale_tracks) = self.frozen_tracks_by_staleness();
+        self.unfreeze_stale_tracks(stale_tracks);
     }
 
-    pub fn update_track_senders_and_receivers(&mut self, instrument_track_senders2: HashMap<Option<String>, Sender<TrackBackgroundProcessorInwardEvent>>, instrument_track_receivers2: HashMap<Option<String>, Receiver<TrackBackgroundProcessorOutwardEvent>>) {
+    fn unfreeze_stale_tracks(&mut self, stale_tracks: Vec<(String, String)>) {
+        if stale_tracks.is_empty() {
+            return;
+        }
+        let mut track_names = vec![];
+        for (track_uuid, track_name) in stale_tracks {
+            info!("state.unfreeze_stale_tracks: track {} has changed since it was frozen - unfreezing.", track_name);
+            self.set_track_frozen(track_uuid, None);
+            track_names.push(track_name);
+        }
+        let _ = self.sender.send(DAWEvents::Notification(NotificationType::Warning, format!("Unfroze tracks that have changed since they were frozen: {}", track_names.join(", "))));
+    }
+
+    /// The frozen tracks whose freeze is still current - track uuid and freeze - and the stale ones - track uuid and name.
+    fn frozen_tracks_by_staleness(&self) -> (Vec<(String, FrozenTrack)>, Vec<(String, String)>) {
+        let song = self.project().song();
+        let tempo = song.tempo();
+        let song_length_in_beats = song.length_in_beats() as f64;
+        let mut frozen_tracks = vec![];
+        let mut stale_tracks = vec![];
+        for track in song.tracks().iter() {
+            if let TrackType::InstrumentTrack(instrument_track) = track {
+                if let Some(frozen) = instrument_track.frozen() {
+                    if frozen.content_hash() == instrument_track.content_hash(tempo, song_length_in_beats) && std::path::Path::new(frozen.file_name()).exists() {
+                        frozen_tracks.push((track.uuid().to_string(), frozen.clone()));
+                    }
+                    else {
+                        stale_tracks.push((track.uuid().to_string(), track.name().to_string()));
+                    }
+                }
+            }
+        }
+        (frozen_tracks, stale_tracks)
+    }
+
+    pub fn update_track_senders_and_receivers(&mut self, instrument_track_senders2: HashMap<Option<String>, Sender<TrackBackgroundProcessorInwardEvent>>, instrument_track_receivers2: HashMap<Option<String>, crossbeam_channel::Receiver<TrackBackgroundProcessorOutwardEvent>>) {
         for (uuid, sender) in instrument_track_senders2 {
             match uuid {
                 Some(uuid) => {
-                    self.instrument_track_senders_mut().insert(uuid, sender);
+                    // new tracks start with the default audio format so tell them what jack is running at
+                    match sender.send(TrackBackgroundProcessorInwardEvent::SetAudioFormat(self.audio_block_size, self.audio_sample_rate)) {
+                        Ok(_) => (),
+                        Err(error) => info!("{:?}", error),
+                    }
+                    match sender.send(TrackBackgroundProcessorInwardEvent::SetAutomationRamping(self.configuration.audio.automation_ramping)) {
+                        Ok(_) => (),
+                        Err(error) => info!("{:?}", error),
+                    }
+                    match sender.send(TrackBackgroundProcessorInwardEvent::SetPluginSandbox(self.configuration.plugin_sandbox.clone())) {
+                        Ok(_) => (),
+                        Err(error) => info!("{:?}", error),
+                    }
+                    match self.id_interner.intern_str(uuid.as_str()) {
+                        Some(track_handle) => {
+                            self.instrument_track_senders_mut().insert(track_handle, sender);
+                        }
+                        None => info!("Track uuid is not a uuid: {}", uuid),
+                    }
                 },
                 None => info!("Entry did not contain a uuid."),
             }
@@ -214,15 +366,16 @@ impl DAWState {
         tx_audio: crossbeam_channel::Sender<AudioLayerInwardEvent>,
         track_audio_coast: Arc<Mutex<TrackBackgroundProcessorMode>>,
         instrument_track_senders2: &mut HashMap<Option<String>, Sender<TrackBackgroundProcessorInwardEvent>>,
-        instrument_track_receivers2: &mut HashMap<Option<String>, Receiver<TrackBackgroundProcessorOutwardEvent>>,
+        instrument_track_receivers2: &mut HashMap<Option<String>, crossbeam_channel::Receiver<TrackBackgroundProcessorOutwardEvent>>,
         track_type: &mut TrackType,
         sample_references: Option<&HashMap<String, String>>,
         samples_data: Option<&HashMap<String, SampleData>>,
         vst_host_time_info: Arc<parking_lot::RwLock<TimeInfo>>,
+        track_processing_scheduler: Arc<TrackProcessingScheduler>,
     ) {
         let (tx_to_vst, rx_to_vst) = channel::<TrackBackgroundProcessorInwardEvent>();
         let tx_to_vst_ref = tx_to_vst.clone();
-        let (tx_from_vst, rx_from_vst) = channel::<TrackBackgroundProcessorOutwardEvent>();
+        let (tx_from_vst, rx_from_vst) = crossbeam_channel::unbounded::<TrackBackgroundProcessorOutwardEvent>();
         let mut track_uuid = None;
         let volume = track_type.volume_mut();
         let pan = track_type.pan_mut();
@@ -244,6 +397,7 @@ impl DAWState {
                         volume,
                         pan,
                         vst_host_time_info,
+                        track_processing_scheduler,
                     );
 
                     let mut effect_presets = vec![];
@@ -285,7 +439,7 @@ impl DAWState {
                     instrument_details.push(':');
                     instrument_details.push_str(instrument.plugin_type());
 
-                    if instrument_details.contains(".so") || instrument_details.contains(".clap") {
+                    if instrument_details.contains(".so") || instrument_details.contains(".clap") || instrument_details.ends_with(BUILT_IN) {
                         match track_uuid {
                             Some(_) => {
                                 match tx_to_vst_ref.send(TrackBackgroundProcessorInwardEvent::ChangeInstrument(
@@ -349,6 +503,7 @@ impl DAWState {
                     volume,
                     pan,
                     vst_host_time_info,
+                    track_processing_scheduler,
                 );
             },
             TrackType::MidiTrack(track) => {
@@ -366,6 +521,7 @@ impl DAWState {
                     volume,
                     pan,
                     vst_host_time_info,
+                    track_processing_scheduler,
                 );
             },
         }
@@ -378,22 +534,40 @@ impl DAWState {
                                                      vst_host_time_info: Arc<parking_lot::RwLock<TimeInfo>>,
     ) {
         let (tx_to_vst, rx_to_vst) = channel::<TrackBackgroundProcessorInwardEvent>();
-        let (tx_from_vst, rx_from_vst) = channel::<TrackBackgroundProcessorOutwardEvent>();
+        let (tx_from_vst, rx_from_vst) = crossbeam_channel::unbounded::<TrackBackgroundProcessorOutwardEvent>();
         let mut instrument_track_senders2 = HashMap::new();
         let mut instrument_track_receivers2 = HashMap::new();
+        let track_processing_scheduler = self.track_processing_scheduler.clone();
 
-        match self.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
+        match self.track_mut(&track_uuid) {
             Some(track) => {
                 let track_uuid_string = track.uuid().to_string();
                 instrument_track_senders2.insert(track_uuid_string.clone(), tx_to_vst);
                 instrument_track_receivers2.insert(track_uuid_string, rx_from_vst);
-                track.start_background_processing(tx_audio, rx_to_vst, tx_from_vst, track_audio_coast, track.volume(), track.pan(), vst_host_time_info);
+                track.start_background_processing(tx_audio, rx_to_vst, tx_from_vst, track_audio_coast, track.volume(), track.pan(), vst_host_time_info, track_processing_scheduler);
             },
             None => {}
         }
 
         for (uuid, sender) in instrument_track_senders2 {
-            self.instrument_track_senders_mut().insert(uuid, sender);
+            match sender.send(TrackBackgroundProcessorInwardEvent::SetAudioFormat(self.audio_block_size, self.audio_sample_rate)) {
+                Ok(_) => (),
+                Err(error) => info!("{:?}", error),
+            }
+            match sender.send(TrackBackgroundProcessorInwardEvent::SetAutomationRamping(self.configuration.audio.automation_ramping)) {
+                Ok(_) => (),
+                Err(error) => info!("{:?}", error),
+            }
+            match sender.send(TrackBackgroundProcessorInwardEvent::SetPluginSandbox(self.configuration.plugin_sandbox.clone())) {
+                Ok(_) => (),
+                Err(error) => info!("{:?}", error),
+            }
+            match self.id_interner.intern_str(uuid.as_str()) {
+                Some(track_handle) => {
+                    self.instrument_track_senders_mut().insert(track_handle, sender);
+                }
+                None => info!("Track uuid is not a uuid: {}", uuid),
+            }
         }
 
         for (uuid, receiver) in instrument_track_receivers2 {
@@ -419,9 +593,9 @@ impl DAWState {
                     instrument.set_sub_plugin_id(sub_plugin_id);
                     instrument.set_plugin_type(plugin_type);
 
-                    if instrument_details.contains(".so") || instrument_details.contains(".clap") {
+                    if instrument_details.contains(".so") || instrument_details.contains(".clap") || instrument_details.ends_with(BUILT_IN) {
                         // instrument.load(vst_plugin_loaders, track_uuid.clone(), instrument_details, tx_audio.clone(), rx_vst, tx_from_vst, track_audio_coast);
-                        match self.instrument_track_senders_mut().get_mut(&track_uuid) {
+                        match self.track_sender(track_uuid.as_str()) {
                             Some(sender) => {
                                 match sender.send(TrackBackgroundProcessorInwardEvent::ChangeInstrument(
                                     vst24_plugin_loaders, clap_plugin_loaders, instrument_uuid, instrument_details)) {
@@ -448,7 +622,7 @@ impl DAWState {
     }
 
     pub fn send_to_track_background_processor(&self, track_hash: String, message: TrackBackgroundProcessorInwardEvent) {
-        match self.instrument_track_senders().get(&track_hash) {
+        match self.track_sender(track_hash.as_str()) {
             Some(sender) => {
                 match sender.send(message) {
                     Ok(_) => (),
@@ -459,6 +633,111 @@ impl DAWState {
         };
     }
 
+    /// Add a new track to the project and start processing it - the gui adds the track's panels separately. A midi
+    /// track also gets its jack midi out port. Returns the new track's uuid.
+    pub fn add_new_track(&mut self, track_type: GeneralTrackType, uuid: Option<Uuid>, name: Option<String>, context: &TrackProcessingContext) -> Option<String> {
+        let mut track = match track_type {
+            GeneralTrackType::InstrumentTrack => TrackType::InstrumentTrack(InstrumentTrack::new()),
+            GeneralTrackType::AudioTrack => TrackType::AudioTrack(AudioTrack::new()),
+            GeneralTrackType::MidiTrack => TrackType::MidiTrack(MidiTrack::new()),
+            _ => return None,
+        };
+        if let Some(uuid) = uuid {
+            track.set_uuid(uuid);
+        }
+        if let Some(name) = name {
+            track.set_name(name);
+        }
+        let track_uuid = track.uuid().to_string();
+        info!("Adding a track to the state: {}", track_uuid);
+
+        let mut instrument_track_senders_local = HashMap::new();
+        let mut instrument_track_receivers_local = HashMap::new();
+        self.get_project().song_mut().add_track(track);
+        let track_processing_scheduler = self.track_processing_scheduler();
+        if let Some(track) = self.get_project().song_mut().tracks_mut().last_mut() {
+            DAWState::init_track(
+                context.vst24_plugin_loaders.clone(),
+                context.clap_plugin_loaders.clone(),
+                context.tx_audio.clone(),
+                context.track_audio_coast.clone(),
+                &mut instrument_track_senders_local,
+                &mut instrument_track_receivers_local,
+                track,
+                None,
+                None,
+                context.vst_host_time_info.clone(),
+                track_processing_scheduler,
+            );
+        }
+        self.update_track_senders_and_receivers(instrument_track_senders_local, instrument_track_receivers_local);
+
+        // the port is handed to the track's midi consumer in the audio layer - which init_track has already sent
+        if let GeneralTrackType::MidiTrack = track_type {
+            if let Some(jack_client) = self.jack_client() {
+                if let Ok(midi_out_port) = jack_client.register_port(track_uuid.as_str(), MidiOut::default()) {
+                    match context.tx_audio.try_send(AudioLayerInwardEvent::NewMidiOutPortForTrack(track_uuid.clone(), midi_out_port)) {
+                        Ok(_) => (),
+                        Err(error) => error!("Problem using tx_to_audio to send new midi out port message to jack layer: {}", error),
+                    }
+                }
+            }
+        }
+
+        Some(track_uuid)
+    }
+
+    /// Stop processing a track and remove it from the project - the gui removes the track's panels separately.
+    pub fn remove_track(&mut self, track_uuid: &str, tx_audio: &crossbeam_channel::Sender<AudioLayerInwardEvent>) {
+        self.send_to_track_background_processor(track_uuid.to_string(), TrackBackgroundProcessorInwardEvent::Kill);
+        match tx_audio.try_send(AudioLayerInwardEvent::RemoveTrack(track_uuid.to_string())) {
+            Ok(_) => (),
+            Err(error) => error!("Problem using tx_to_audio to send remove track consumer message to jack layer: {}", error),
+        }
+        telemetry().remove_track(track_uuid);
+        self.track_processing_scheduler.audio_buses().remove_bus(track_uuid);
+        self.get_project().song_mut().delete_track(track_uuid.to_string());
+        self.update_delay_compensation();
+    }
+
+    /// Remove a midi routing from its source track and from the source and destination background processors.
+    pub fn remove_midi_routing(&mut self, track_from_uuid: &str, route_uuid: &str) {
+        let destination_track_uuid = self.get_project().song_mut().tracks_mut().iter_mut()
+            .find(|track| track.uuid().to_string() == track_from_uuid)
+            .and_then(|track| {
+                let index = track.midi_routings().iter().position(|route| route.uuid() == route_uuid)?;
+                Some(track.midi_routings_mut().remove(index).destination.track_uuid().to_string())
+            });
+
+        self.send_to_track_background_processor(track_from_uuid.to_string(), TrackBackgroundProcessorInwardEvent::RemoveTrackEventSendRouting(route_uuid.to_string()));
+        if let Some(destination_track_uuid) = destination_track_uuid {
+            self.send_to_track_background_processor(destination_track_uuid, TrackBackgroundProcessorInwardEvent::RemoveTrackEventReceiveRouting(route_uuid.to_string()));
+        }
+    }
+
+    /// Remove an audio routing from its source track and from the source and destination background processors.
+    pub fn remove_audio_routing(&mut self, track_from_uuid: &str, route_uuid: &str) {
+        let destination_track_uuid = self.get_project().song_mut().tracks_mut().iter_mut()
+            .find(|track| track.uuid().to_string() == track_from_uuid)
+            .and_then(|track| {
+                let index = track.audio_routings().iter().position(|route| route.uuid() == route_uuid)?;
+                Some(track.audio_routings_mut().remove(index).destination.track_uuid().to_string())
+            });
+
+        self.send_to_track_background_processor(track_from_uuid.to_string(), TrackBackgroundProcessorInwardEvent::RemoveAudioSendRouting(route_uuid.to_string()));
+        if let Some(destination_track_uuid) = destination_track_uuid {
+            self.send_to_track_background_processor(destination_track_uuid, TrackBackgroundProcessorInwardEvent::RemoveAudioReceiveRouting(route_uuid.to_string()));
+        }
+    }
+
+    /// Send an event to the gui.
+    pub fn send_to_gui(&self, event: DAWEvents) {
+        match self.sender.send(event) {
+            Ok(_) => (),
+            Err(error) => info!("state.send_to_gui: could not send the event: {:?}", error),
+        }
+    }
+
     pub fn send_midi_routing_to_track_background_processors(&self, track_from_uuid: String, routing: TrackEventRouting) {
         // create the consumer producer pair
         let track_event_ring_buffer: SpscRb<TrackEvent> = SpscRb::new(1024);
@@ -485,22 +764,14 @@ impl DAWState {
     }
 
     pub fn send_audio_routing_to_track_background_processors(&self, track_from_uuid: String, routing: AudioRouting) {
-        // create the consumer producer pair
-        let audio_ring_buffer_left: SpscRb<f32> = SpscRb::new(1024);
-        let audio_producer_left = audio_ring_buffer_left.producer();
-        let audio_consumer_left = audio_ring_buffer_left.consumer();    
-        let audio_ring_buffer_right: SpscRb<f32> = SpscRb::new(1024);
-        let audio_producer_right = audio_ring_buffer_right.producer();
-        let audio_consumer_right = audio_ring_buffer_right.consumer();    
+        // the originating track writes its audio to its bus and the destination track reads it from there
+        let audio_bus = self.track_processing_scheduler.audio_buses().bus(track_from_uuid.as_str());
 
-        // send the producer to the originating track
         self.send_to_track_background_processor(
             track_from_uuid.clone(), 
-            TrackBackgroundProcessorInwardEvent::AddAudioSendRouting(
-                routing.clone(), (audio_ring_buffer_left, audio_ring_buffer_right), (audio_producer_left, audio_producer_right))
+            TrackBackgroundProcessorInwardEvent::AddAudioSendRouting(routing.clone(), audio_bus.clone())
         );
 
-        // send the consumer to the destination track
         let destination_track_uuid = match &routing.destination {
             AudioRoutingNodeType::Track(track_uuid) => track_uuid.clone(),
             AudioRoutingNodeType::Instrument(track_uuid, _, _, _) => track_uuid.clone(),
@@ -509,11 +780,11 @@ impl DAWState {
 
         self.send_to_track_background_processor(
             destination_track_uuid, 
-            TrackBackgroundProcessorInwardEvent::AddAudioReceiveRouting(routing.clone(), (audio_consumer_left, audio_consumer_right))
+            TrackBackgroundProcessorInwardEvent::AddAudioReceiveRouting(routing.clone(), AudioBusReceiver::new(audio_bus))
         );
     }
 
-    fn request_presets_from_all_tracks(&mut self) {
+    pub fn request_presets_from_all_tracks(&mut self) {
         info!("Entering request_presets_from_all_tracks...");
         let mut uuids = vec![];
         {
@@ -536,7 +807,7 @@ impl DAWState {
         {
             for uuid in uuids {
                 info!("Found uuid in vector: {}", &uuid);
-                match self.instrument_track_senders_mut().get(&uuid) {
+                match self.track_sender(uuid.as_str()) {
                     Some(sender) => {
                         info!("State: requesting preset data from track with uuid: {}", uuid.clone());
                         match sender.send(TrackBackgroundProcessorInwardEvent::RequestPresetData) {
@@ -590,47 +861,107 @@ impl DAWState {
             }
         }
 
-        {
-            for (uuid, preset_data) in presets {
-                for track_type in self.get_project().song_mut().tracks_mut() {
-                    match track_type {
-                        TrackType::InstrumentTrack(track) => {
-                            if track.uuid().to_string().as_str() == uuid.as_str() {
-                                if let TrackBackgroundProcessorOutwardEvent::GetPresetData(instrument_preset, effect_presets)  = preset_data {
-                                    track.instrument_mut().set_preset_data(instrument_preset);
-                                    let mut index = 0;
-                                    for effect_preset in effect_presets {
-                                        match track.effects_mut().get_mut(index) {
-                                            Some(effect) => effect.set_preset_data(effect_preset),
-                                            None => info!("Effect could not be found for effect preset data at index: {}", index),
-                                        }
-                                        index += 1;
-                                    }
-                                }
-                                break;
+        for (uuid, preset_data) in presets {
+            if let TrackBackgroundProcessorOutwardEvent::GetPresetData(instrument_preset, effect_presets) = preset_data {
+                self.apply_track_preset_data(uuid.as_str(), instrument_preset, effect_presets);
+            }
+        }
+        info!("Exiting save_presets_for_all_tracks...");
+    }
+
+    /// Ask one track's background processor for its presets and wait for them - see save_presets_for_all_tracks.
+    fn refresh_track_preset_data(&mut self, track_uuid: &str) {
+        match self.track_sender(track_uuid) {
+            Some(sender) => if let Err(error) = sender.send(TrackBackgroundProcessorInwardEvent::RequestPresetData) {
+                info!("Problem requesting vst preset data for track: {}", error);
+                return;
+            }
+            None => return,
+        }
+        let preset_data = match self.instrument_track_receivers.get(track_uuid) {
+            Some(vst_outward_receiver) => vst_outward_receiver.recv_timeout(Duration::from_secs(1)),
+            None => return,
+        };
+        match preset_data {
+            Ok(TrackBackgroundProcessorOutwardEvent::GetPresetData(instrument_preset, effect_presets)) => self.apply_track_preset_data(track_uuid, instrument_preset, effect_presets),
+            Ok(_) => (),
+            Err(error) => info!("Problem receiving vst thread preset data for track uuid: {} {}", track_uuid, error),
+        }
+    }
+
+    /// Store the preset data a track's background processor sent back after a preset data request.
+    pub fn apply_track_preset_data(&mut self, track_uuid: &str, instrument_preset: String, effect_presets: Vec<String>) {
+        for track_type in self.get_project().song_mut().tracks_mut() {
+            match track_type {
+                TrackType::InstrumentTrack(track) => {
+                    if track.uuid().to_string().as_str() == track_uuid {
+                        track.instrument_mut().set_preset_data(instrument_preset);
+                        let mut index = 0;
+                        for effect_preset in effect_presets {
+                            match track.effects_mut().get_mut(index) {
+                                Some(effect) => effect.set_preset_data(effect_preset),
+                                None => info!("Effect could not be found for effect preset data at index: {}", index),
                             }
-                        },
-                        TrackType::AudioTrack(track) => {
-                            if track.uuid().to_string().as_str() == uuid.as_str() {
-                                if let TrackBackgroundProcessorOutwardEvent::GetPresetData(_instrument_preset, effect_presets)  = preset_data {
-                                    let mut index = 0;
-                                    for effect_preset in effect_presets {
-                                        match track.effects_mut().get_mut(index) {
-                                            Some(effect) => effect.set_preset_data(effect_preset),
-                                            None => info!("Effect could not be found for effect preset data at index: {}", index),
-                                        }
-                                        index += 1;
-                                    }
-                                }
-                                break;
+                            index += 1;
+                        }
+                        break;
+                    }
+                },
+                TrackType::AudioTrack(track) => {
+                    if track.uuid().to_string().as_str() == track_uuid {
+                        let mut index = 0;
+                        for effect_preset in effect_presets {
+                            match track.effects_mut().get_mut(index) {
+                                Some(effect) => effect.set_preset_data(effect_preset),
+                                None => info!("Effect could not be found for effect preset data at index: {}", index),
                             }
-                        },
-                        TrackType::MidiTrack(_) => (),
+                            index += 1;
+                        }
+                        break;
                     }
+                },
+                TrackType::MidiTrack(_) => (),
+            }
+        }
+    }
+
+    /// Record the plugin latency a track's background processor reported and recalculate the delay compensation.
+    pub fn set_track_plugin_latency(&mut self, track_uuid: String, plugin_latency: TrackPluginLatency) {
+        if self.track_plugin_latencies.get(&track_uuid) != Some(&plugin_latency) {
+            self.track_plugin_latencies.insert(track_uuid, plugin_latency);
+            self.update_delay_compensation();
+        }
+    }
+
+    /// The overall latency and each track's delay compensation for the plugin latencies reported so far.
+    fn track_delay_compensation(&self) -> (usize, HashMap<String, TrackDelayCompensation>) {
+        let track_uuids: Vec<String> = self.project.song().tracks().iter().map(|track| track.uuid().to_string()).collect();
+        let audio_routings: Vec<AudioRouting> = self.project.song().tracks().iter().flat_map(|track| track.audio_routings().iter().cloned()).collect();
+        calculate_delay_compensation(&track_uuids, &self.track_plugin_latencies, &audio_routings)
+    }
+
+    /// Recalculate the delay compensation for all tracks and send it to the track background processors.
+    pub fn update_delay_compensation(&mut self) {
+        let track_uuids: Vec<String> = self.project.song().tracks().iter().map(|track| track.uuid().to_string()).collect();
+        self.track_plugin_latencies.retain(|track_uuid, _| track_uuids.contains(track_uuid));
+
+        let (latency, track_delay_compensation) = self.track_delay_compensation();
+        for (track_uuid, delay_compensation) in track_delay_compensation.into_iter() {
+            // the delay lines are built here as the track's worker must not allocate
+            self.send_to_track_background_processor(track_uuid, TrackBackgroundProcessorInwardEvent::SetDelayCompensation(TrackDelayCompensator::new(&delay_compensation)));
+        }
+
+        if latency != self.delay_compensation_latency.swap(latency, Ordering::Relaxed) {
+            info!("Delay compensation latency: {} frames", latency);
+
+            // jack asks for the added latency on the master outputs in its latency callback - see JackNotificationHandler
+            if let Some(jack_client) = self.jack_client() {
+                // not wrapped by the jack crate
+                if unsafe { jack_sys::jack_recompute_total_latencies(jack_client.raw()) } != 0 {
+                    error!("Jack could not recompute the port latencies.");
                 }
             }
         }
-        info!("Exiting save_presets_for_all_tracks...");
     }
 
     pub fn save(&mut self) {
@@ -642,63 +973,57 @@ impl DAWState {
 
         info!("state.save() - number of riff sequences={}", self.project().song().riff_sequences().len());
 
-        match serde_json::to_string_pretty(self.get_project()) {
-            Ok(json_text) => {
-                match self.get_current_file_path() {
-                    Some(path) => {
-                        match std::fs::write(path.clone(), json_text) {
-                            Err(error) => info!("save failure writing to file: {}", error),
-                            _ => {
-                                info!("saved to file: {}", path);
-                                self.dirty = false;
-                            }
-                        };
-                    },
-                    None => info!("No file path."),
-                }
+        if self.save_as_required {
+            info!("state.save() - the project was recovered from a checkpoint and needs to be saved with Save As.");
+            return;
+        }
+
+        match self.get_current_file_path().clone() {
+            Some(path) => {
+                match DAWState::write_project_to_file(path.as_str(), self.project()) {
+                    Err(error) => info!("save failure writing to file: {}", error),
+                    _ => {
+                        info!("saved to file: {}", path);
+                        self.dirty = false;
+                    }
+                };
             },
-            Err(error) => {
-                info!("can_serialise failure: {}",error);
-            }
-        };
+            None => info!("No file path."),
+        }
         info!("Exited save.");
     }
 
-    pub fn autosave(&mut self) {
-        info!("Entering autosave...");
-        self.request_presets_from_all_tracks();
-        self.save_presets_for_all_tracks();
+    /// Projects are saved in the binary project file format unless the file name ends in .json.
+    pub fn write_project_to_file(path: &str, project: &Project) -> anyhow::Result<()> {
+        if path.ends_with(".json") {
+            std::fs::write(path, serde_json::to_string_pretty(project)?)?;
+            Ok(())
+        }
+        else {
+            ProjectFile::write(path, project)
+        }
+    }
 
-        self.get_project().song_mut().recalculate_song_length();
+    /// Reads either format - the binary project file format or json - or recovers an autosave checkpoint.
+    pub fn read_project_from_file(path: &str) -> anyhow::Result<Project> {
+        if Autosaver::is_checkpoint(path) {
+            Autosaver::recover(path)
+        }
+        else if ProjectFile::is_project_file(path) {
+            ProjectFile::open(path)?.read_project()
+        }
+        else {
+            Ok(serde_json::from_str(std::fs::read_to_string(path)?.as_str())?)
+        }
+    }
 
-        match serde_json::to_string_pretty(self.get_project()) {
-            Ok(json_text) => {
-                match self.get_current_file_path() {
-                    Some(path) => {
-                        let autosave_path = format!("{}_{}.fdaw.xz", path, chrono::offset::Local::now().to_string());
-                        if let Ok(compressed) = lzma::compress(json_text.as_bytes(), 6) {
-                            match std::fs::write(autosave_path.clone(), compressed) {
-                                Err(error) => info!("save failure writing to file: {}", error),
-                                _ => info!("saved to file: {}", autosave_path)
-                            };
-                        }
-                    }
-                    None => {
-                        let path = format!("/tmp/unknown_{}.fdaw.xz", chrono::offset::Local::now().to_string());
-                        if let Ok(compressed) = lzma::compress(json_text.as_bytes(), 6) {
-                            match std::fs::write(path.clone(), compressed) {
-                                Err(error) => info!("save failure writing to file: {}", error),
-                                _ => info!("saved to file: {}", path)
-                            }
-                        }
-                    }
-                }
-            }
-            Err(error) => {
-                info!("autosave can't serialise project to JSON failure: {}",error);
-            }
-        };
-        info!("Exited autosave.");
+    /// Capture what the autosave thread needs to write the project: the current file path and a copy of the project.
+    /// Copying is the only part of an autosave done while holding the state lock - the autosave thread serialises the
+    /// copy. Preset data is requested separately via request_presets_from_all_tracks and arrives through the gui event
+    /// pump.
+    pub fn autosave_snapshot(&mut self) -> (Option<String>, Project) {
+        self.get_project().song_mut().recalculate_song_length();
+        (self.get_current_file_path().clone(), self.project().clone())
     }
 
     pub fn save_as(&mut self, path: &str) {
@@ -706,25 +1031,109 @@ impl DAWState {
         self.save_presets_for_all_tracks();
 
         self.current_file_path = Some(path.to_string());
-        match serde_json::to_string_pretty(self.get_project()) {
-            Ok(json_text) => {
-                match std::fs::write(path, json_text) {
-                    Err(error) => info!("save as failure writing to file: {}", error),
-                    _ => {
-                        self.dirty = false;
-                    }
-                };
-            },
-            Err(error) => {
-                info!("can_serialise failure: {}",error);
+        match DAWState::write_project_to_file(path, self.project()) {
+            Err(error) => info!("save as failure writing to file: {}", error),
+            _ => {
+                self.dirty = false;
+                self.save_as_required = false;
             }
         };
     }
 
+    /// Anything in the project may be changed through this so everything cached from it is rebuilt - use project() to
+    /// read and track_mut() to change a single track.
     pub fn get_project(&mut self) -> &mut Project {
+        self.bump_project_revision();
+        self.song_revision = self.project_revision;
         &mut self.project
     }
 
+    /// Change a single track - only that track is copied into the next project snapshot.
+    pub fn track_mut(&mut self, track_uuid: &str) -> Option<&mut TrackType> {
+        self.bump_project_revision();
+        let project_revision = self.project_revision;
+        let track = self.project.song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid)?;
+        self.track_revisions.insert(track_uuid.to_string(), project_revision);
+        Some(track)
+    }
+
+    fn bump_project_revision(&mut self) {
+        self.project_revision = self.project_revision.wrapping_add(1);
+    }
+
+    /// Changes whenever the project may have been changed - anything cached from the project is stale when it does.
+    pub fn project_revision(&self) -> u64 {
+        self.project_revision
+    }
+
+    /// The project revision the track last changed at.
+    fn track_revision(&self, track_uuid: &str) -> u64 {
+        self.track_revisions.get(track_uuid).copied().unwrap_or(0).max(self.song_revision)
+    }
+
+    /// The shared handle the latest project snapshot is published through.
+    pub fn project_snapshot(&self) -> Arc<SnapshotCell<ProjectSnapshot>> {
+        self.project_snapshot.clone()
+    }
+
+    /// Publish a new project snapshot if the project, transport or selection have changed since the last one. Only the
+    /// tracks that have changed since the last snapshot are copied - the rest are shared with it - and the arrangement
+    /// is only copied when more than single tracks have changed.
+    pub fn publish_project_snapshot(&self) {
+        let current = self.project_snapshot.load();
+        let song = self.project.song();
+        let transport = TransportSnapshot {
+            tempo: song.tempo(),
+            sample_rate: song.sample_rate(),
+            time_signature_numerator: song.time_signature_numerator(),
+            time_signature_denominator: song.time_signature_denominator(),
+            playing: self.playing,
+            looping: self.looping,
+            active_loop: self.active_loop,
+        };
+        let selection = SelectionSnapshot {
+            selected_track: self.selected_track.clone(),
+            selected_riff_uuids: self.selected_riff_uuid_map.clone(),
+        };
+
+        if current.revision == self.project_revision {
+            if current.transport != transport || current.selection != selection {
+                self.project_snapshot.store(Arc::new(ProjectSnapshot {
+                    revision: current.revision,
+                    tracks: current.tracks.clone(),
+                    arrangement: current.arrangement.clone(),
+                    transport,
+                    selection,
+                }));
+            }
+        }
+        else {
+            let current_tracks: HashMap<&str, &Arc<TrackSnapshot>> = current.tracks.iter().map(|track| (track.uuid.as_str(), track)).collect();
+            let tracks = song.tracks().iter().map(|track| {
+                let track_uuid = track.uuid().to_string();
+                let track_revision = self.track_revision(track_uuid.as_str());
+                match current_tracks.get(track_uuid.as_str()) {
+                    Some(current_track) if current_track.revision == track_revision => (*current_track).clone(),
+                    _ => Arc::new(TrackSnapshot::new(track, track_revision)),
+                }
+            }).collect();
+            let arrangement = if current.arrangement.revision == self.song_revision {
+                current.arrangement.clone()
+            }
+            else {
+                Arc::new(ArrangementSnapshot::new(song, self.song_revision))
+            };
+
+            self.project_snapshot.store(Arc::new(ProjectSnapshot {
+                revision: self.project_revision,
+                tracks: Arc::new(tracks),
+                arrangement,
+                transport,
+                selection,
+            }));
+        }
+    }
+
     pub fn get_current_file_path(&self) -> &Option<String> {
         // let boris = self.current_file_path.clone().unwrap();
         // let mick = String::from(&boris[0..boris.len()]);
@@ -734,10 +1143,21 @@ impl DAWState {
 
     pub fn set_project(&mut self, project: Project) {
         self.project = project;
+        self.bump_project_revision();
+        self.song_revision = self.project_revision;
+        self.track_revisions.clear();
+        self.playback_schedules.lock().clear();
+        self.frozen_track_audio.clear();
     }
 
     pub fn set_current_file_path(&mut self, current_file_path: Option<String>) {
         self.current_file_path = current_file_path;
+        self.save_as_required = false;
+    }
+
+    /// True when Save has to go through Save As - there is no file yet or the project was recovered from a checkpoint.
+    pub fn save_as_required(&self) -> bool {
+        self.save_as_required || self.current_file_path.is_none()
     }
 
     /// Set the freedom daw state's selected track.
@@ -781,22 +1201,27 @@ impl DAWState {
     }
 
     /// Get a mutable reference to the freedom daw state's instrument track senders.
-    pub fn instrument_track_senders_mut(&mut self) -> &mut HashMap<String, Sender<TrackBackgroundProcessorInwardEvent>> {
+    pub fn instrument_track_senders_mut(&mut self) -> &mut IdSlotMap<Sender<TrackBackgroundProcessorInwardEvent>> {
         &mut self.instrument_track_senders
     }
 
     /// Get a mutable reference to the freedom daw state's instrument track receivers.
-    pub fn instrument_track_receivers_mut(&mut self) -> &mut HashMap<String, Receiver<TrackBackgroundProcessorOutwardEvent>> {
+    pub fn instrument_track_receivers_mut(&mut self) -> &mut HashMap<String, crossbeam_channel::Receiver<TrackBackgroundProcessorOutwardEvent>> {
         &mut self.instrument_track_receivers
     }
 
     /// Get a reference to the freedom daw state's instrument track senders.
-    pub fn instrument_track_senders(&self) -> &HashMap<String, Sender<TrackBackgroundProcessorInwardEvent>> {
+    pub fn instrument_track_senders(&self) -> &IdSlotMap<Sender<TrackBackgroundProcessorInwardEvent>> {
         &self.instrument_track_senders
     }
 
+    /// The sender to a track's background processor - found by the track's interned handle rather than hashing its uuid string.
+    pub fn track_sender(&self, track_uuid: &str) -> Option<&Sender<TrackBackgroundProcessorInwardEvent>> {
+        self.id_interner.handle_str(track_uuid).and_then(|track_handle| self.instrument_track_senders.get(track_handle))
+    }
+
     /// Get a reference to the freedom daw state's instrument track receivers.
-    pub fn instrument_track_receivers(&self) -> &HashMap<String, Receiver<TrackBackgroundProcessorOutwardEvent>> {
+    pub fn instrument_track_receivers(&self) -> &HashMap<String, crossbeam_channel::Receiver<TrackBackgroundProcessorOutwardEvent>> {
         &self.instrument_track_receivers
     }
 
@@ -976,6 +1401,22 @@ impl DAWState {
     }
 
     pub fn play_song(&mut self, tx_to_audio: crossbeam_channel::Sender<AudioLayerInwardEvent>) -> i32 {
+        self.set_playing(true);
+        self.set_play_mode(PlayMode::Song);
+
+        self.unfreeze_changed_tracks();
+        let (start_block, number_of_blocks) = self.send_song_to_tracks(self.looping);
+        match tx_to_audio.try_send(AudioLayerInwardEvent::Play(true, number_of_blocks, start_block)) {
+                Ok(_) => (),
+                Err(error) => error!("Problem using tx_to_audio to send message to jack layer when turning play on: {}", error),
+        }
+
+        number_of_blocks
+    }
+
+    /// Send the song's events to the tracks and start them at the play position - looping the active loop if looping.
+    /// Returns the start block and the number of blocks in the song.
+    pub fn send_song_to_tracks(&self, looping: bool) -> (i32, i32) {
         let mut bpm = 140.0;
         let mut sample_rate = 44100.0;
         let mut block_size = 1024.0;
@@ -984,9 +1425,7 @@ impl DAWState {
         let mut end_block = 0;
         let mut found_active_loop = false;
 
-        song_length_in_beats = *self.get_project().song_mut().length_in_beats_mut() as f64;
-        self.set_playing(true);
-        self.set_play_mode(PlayMode::Song);
+        song_length_in_beats = self.project().song().length_in_beats() as f64;
 
         let song = self.project().song();
         bpm = song.tempo();
@@ -996,7 +1435,7 @@ impl DAWState {
         start_block = (play_position_in_frames as f64 / block_size) as i32;
 
 
-        if self.looping {
+        if looping {
             if  let Some(loop_uuid) = &self.active_loop {
                 let song: &Song = self.project().song();
                 if let Some(active_loop) = song.loops().iter().find(|current_loop| current_loop.uuid().to_string() == loop_uuid.to_string()) {
@@ -1021,6 +1460,7 @@ impl DAWState {
             };
             let vst_event_blocks = DAWUtils::convert_to_event_blocks(track.automation().events(), track.riffs(), track.riff_refs(), bpm, block_size, sample_rate, song_length_in_beats, midi_channel);
             self.send_to_track_background_processor(track.uuid().to_string(), TrackBackgroundProcessorInwardEvent::SetEvents(vst_event_blocks, false));
+            self.send_frozen_audio(track.uuid().to_string(), true);
 
             if found_active_loop {
                 self.send_to_track_background_processor(track.uuid().to_string(), TrackBackgroundProcessorInwardEvent::Loop(true));
@@ -1035,12 +1475,7 @@ impl DAWState {
         }
 
         let number_of_blocks = (song_length_in_beats / bpm * 60.0 * sample_rate / block_size) as i32;
-        match tx_to_audio.send(AudioLayerInwardEvent::Play(true, number_of_blocks, start_block)) {
-                Ok(_) => (),
-                Err(error) => info!("Problem using tx_to_audio to send message to jack layer when turning play on: {}", error),
-        }
-
-        number_of_blocks
+        (start_block, number_of_blocks)
     }
 
     pub fn play_riff_set(&mut self, tx_to_audio: crossbeam_channel::Sender<AudioLayerInwardEvent>, riff_set_uuid: String) {
@@ -1059,63 +1494,21 @@ impl DAWState {
         let sample_rate = song.sample_rate();
         let block_size = song.block_size();
         let start_block = (play_position_in_frames as f64 / block_size) as i32;
-        let mut lowest_common_factor_in_beats = 400;
-
-        if let Some(riff_set) = self.project().song().riff_set(riff_set_uuid.clone()) {
-            let mut riff_lengths = vec![];
-            info!("Found riff set: uuid={}, name={}", riff_set_uuid.as_str(), riff_set.name());
 
-            // get the number of repeats
-            for track in self.project().song().tracks().iter() {
-                // get the riff_ref
-                if let Some(riff_ref) = riff_set.get_riff_ref_for_track(track.uuid().to_string()) {
-                    // get the riff
-                    if let Some(riff) = track.riffs().iter().find(|riff| riff.uuid().to_string() == riff_ref.linked_to()) {
-                        riff_lengths.push(riff.length() as i32);
-                    }
+        // normally already compiled - only the blocks are copied out to the tracks
+        let schedule = self.playback_schedule(riff_set_uuid.clone(), PlayMode::RiffSet);
+        for track_schedule in schedule.tracks.iter() {
+            self.send_frozen_audio(track_schedule.track_uuid.clone(), false);
+            match track_schedule.event_blocks.as_ref() {
+                Some(track_event_blocks) => {
+                    info!("Riff set # of blocks: {}", track_event_blocks.0.len());
+                    self.send_to_track_background_processor(track_schedule.track_uuid.clone(), TrackBackgroundProcessorInwardEvent::LoopExtents(0, track_event_blocks.0.len() as i32));
+                    self.send_to_track_background_processor(track_schedule.track_uuid.clone(), TrackBackgroundProcessorInwardEvent::SetEvents((**track_event_blocks).clone(), true));
+                    self.send_to_track_background_processor(track_schedule.track_uuid.clone(), TrackBackgroundProcessorInwardEvent::Loop(true));
                 }
-            }
-
-            let (product, unique_riff_lengths) = DAWState::get_length_product(riff_lengths);
-
-            lowest_common_factor_in_beats = DAWState::get_lowest_common_factor(unique_riff_lengths, product);
-
-            for track in self.project().song().tracks().iter() {
-                let mut riff_refs = vec![];
-                let midi_channel = if let TrackType::MidiTrack(midi_track) = track {
-                    midi_track.midi_device().midi_channel()
-                }
-                else {
-                    0
-                };
-
-                // get the riff_ref
-                if let Some(riff_ref) = riff_set.get_riff_ref_for_track(track.uuid().to_string()) {
-                    // get the riff
-                    if let Some(riff) = track.riffs().iter().find(|riff| riff.uuid().to_string() == riff_ref.linked_to()) {
-                        for repeat in 0..(lowest_common_factor_in_beats / (riff.length() as i32)) {
-                            // clone the riff set and set its position
-                            let mut riff_reference = riff_ref.clone();
-                            riff_reference.set_position(riff.length() * repeat as f64);
-                            riff_refs.push(riff_reference);
-                        }
-                        let mut riffs = vec![];
-                        riffs.push(riff.clone());
-                        let automation: Vec<TrackEvent> = vec![];
-                        let track_event_blocks = DAWUtils::convert_to_event_blocks(&automation, &riffs, &riff_refs, bpm, block_size, sample_rate, lowest_common_factor_in_beats as f64, midi_channel);
-                        info!("Riff set # of blocks: {}", track_event_blocks.0.len());
-                        self.send_to_track_background_processor(track.uuid().to_string(), TrackBackgroundProcessorInwardEvent::LoopExtents(0, track_event_blocks.0.len() as i32));
-                        self.send_to_track_background_processor(track.uuid().to_string(), TrackBackgroundProcessorInwardEvent::SetEvents(track_event_blocks, true));
-                        self.send_to_track_background_processor(track.uuid().to_string(), TrackBackgroundProcessorInwardEvent::Loop(true));
-                    }
-                    else {
-                        let track_event_blocks = (vec![], vec![]);
-                        self.send_to_track_background_processor(track.uuid().to_string(), TrackBackgroundProcessorInwardEvent::SetEvents(track_event_blocks, true));
-                    }
-                }
-                else {
-                    let track_event_blocks = (vec![], vec![]);
-                    self.send_to_track_background_processor(track.uuid().to_string(), TrackBackgroundProcessorInwardEvent::SetEvents(track_event_blocks, true));
+                None => {
+                    let track_event_blocks = (EventBlocks::default(), EventBlocks::default());
+                    self.send_to_track_background_processor(track_schedule.track_uuid.clone(), TrackBackgroundProcessorInwardEvent::SetEvents(track_event_blocks, true));
                 }
             }
         }
@@ -1126,82 +1519,74 @@ impl DAWState {
             }
         }
 
-        let number_of_blocks = (lowest_common_factor_in_beats as f64 / bpm * 60.0 * sample_rate / block_size) as i32;
-        match tx_to_audio.send(AudioLayerInwardEvent::Play(true, number_of_blocks, start_block)) {
+        let number_of_blocks = (schedule.length_in_beats / bpm * 60.0 * sample_rate / block_size) as i32;
+        match tx_to_audio.try_send(AudioLayerInwardEvent::Play(true, number_of_blocks, start_block)) {
                 Ok(_) => (),
-                Err(error) => info!("Problem using tx_to_audio to send message to jack layer when turning play riff set on: {}", error),
+                Err(error) => error!("Problem using tx_to_audio to send message to jack layer when turning play riff set on: {}", error),
         }
+
+        self.precompile_next_riff_set(riff_set_uuid.as_str());
     }
 
 
 
     pub fn play_riff_set_update_track(&self, riff_set_uuid: String, track_uuid: String) {
+        // only the tracks whose riffs have changed are compiled again
+        let schedule = self.playback_schedule(riff_set_uuid, PlayMode::RiffSet);
+        if let Some(track_schedule) = schedule.tracks.iter().find(|track_schedule| track_schedule.track_uuid == track_uuid) {
+            info!("state.play_riff_set_update_track: found track");
+            let vst_event_blocks = match track_schedule.event_blocks.as_ref() {
+                Some(track_event_blocks) => {
+                    info!("state.play_riff_set_update_track: sending message to vst - set events with data");
+                    (**track_event_blocks).clone()
+                }
+                None => {
+                    info!("state.play_riff_set_update_track: sending message to vst - set events without data");
+                    (EventBlocks::default(), EventBlocks::default())
+                }
+            };
+            self.send_to_track_background_processor(track_uuid, TrackBackgroundProcessorInwardEvent::SetEvents(vst_event_blocks, true));
+        }
+    }
+
+    /// Re-sends the blocks the riff plays in after an edit that may have changed any of it. The riff's extent before the
+    /// edit - see DAWUtils::riff_extent_in_beats - is needed so that blocks it no longer reaches are cleared too.
+    pub fn play_song_update_track_riff(&self, riff_uuid: String, track_uuid: String, pre_edit_extent_in_beats: f64) {
+        self.play_song_replace_track_riff_blocks(riff_uuid, track_uuid, |riff, riff_refs, bpm, block_size, sample_rate, number_of_blocks|
+            DAWUtils::get_riff_dirty_block_ranges(riff, pre_edit_extent_in_beats, riff_refs, bpm, block_size, sample_rate, number_of_blocks));
+    }
+
+    /// Re-sends the blocks that the changed part of the riff plays in - the range covers the changed events both before
+    /// and after the change.
+    pub fn play_song_update_track_riff_range(&self, riff_uuid: String, track_uuid: String, changed_range_in_beats: (f64, f64)) {
+        self.play_song_replace_track_riff_blocks(riff_uuid, track_uuid, |riff, riff_refs, bpm, block_size, sample_rate, number_of_blocks|
+            DAWUtils::get_riff_range_dirty_block_ranges(riff.uuid().to_string(), changed_range_in_beats, riff_refs, bpm, block_size, sample_rate, number_of_blocks));
+    }
+
+    fn play_song_replace_track_riff_blocks<F>(&self, riff_uuid: String, track_uuid: String, dirty_block_ranges: F)
+        where F: FnOnce(&Riff, &Vec<RiffReference>, f64, f64, f64, usize) -> Vec<(usize, usize)>
+    {
         let song = self.project().song();
         let bpm = song.tempo();
         let sample_rate = song.sample_rate();
         let block_size = song.block_size();
-        let mut lowest_common_factor_in_beats = 400;
-
-
-        if let Some(riff_set) = self.project().song().riff_set(riff_set_uuid) {
-            info!("state.play_riff_set_update_track: found riff set");
-            let mut riff_lengths = vec![];
+        let song_length_in_beats = song.length_in_beats() as f64;
+        let number_of_blocks = DAWUtils::number_of_blocks(block_size, song_length_in_beats / bpm * 60.0 * sample_rate);
 
-            // get the number of repeats
-            for track in self.project().song().tracks().iter() {
-                // get the riff_ref
-                if let Some(riff_ref) = riff_set.get_riff_ref_for_track(track.uuid().to_string()) {
-                    // get the riff
-                    if let Some(riff) = track.riffs().iter().find(|riff| riff.uuid().to_string() == riff_ref.linked_to()) {
-                        riff_lengths.push(riff.length() as i32);
-                    }
+        if let Some(track) = song.tracks().iter().find(|track| track.uuid().to_string() == track_uuid) {
+            if let Some(riff) = track.riffs().iter().find(|riff| riff.uuid().to_string() == riff_uuid) {
+                let midi_channel = if let TrackType::MidiTrack(midi_track) = track {
+                    midi_track.midi_device().midi_channel()
                 }
-            }
-
-            let (product, unique_riff_lengths) = DAWState::get_length_product(riff_lengths);
-
-            lowest_common_factor_in_beats = DAWState::get_lowest_common_factor(unique_riff_lengths, product);
-
-            for track in self.project().song().tracks().iter() {
-                if track.uuid().to_string() == track_uuid {
-                    info!("state.play_riff_set_update_track: found track");
-                    let mut riff_refs = vec![];
-                    let midi_channel = if let TrackType::MidiTrack(midi_track) = track {
-                        midi_track.midi_device().midi_channel()
-                    }
-                    else {
-                        0
-                    };
+                else {
+                    0
+                };
 
-                    // get the riff_ref
-                    if let Some(riff_ref) = riff_set.get_riff_ref_for_track(track.uuid().to_string()) {
-                        // get the riff
-                        if let Some(riff) = track.riffs().iter().find(|riff| riff.uuid().to_string() == riff_ref.linked_to()) {
-                            for repeat in 0..(lowest_common_factor_in_beats / (riff.length() as i32)) {
-                                // clone the riff set and set its position
-                                let mut riff_reference = riff_ref.clone();
-                                riff_reference.set_position(riff.length() * repeat as f64);
-                                riff_refs.push(riff_reference);
-                            }
-                            let mut riffs = vec![];
-                            riffs.push(riff.clone());
-                            let automation: Vec<TrackEvent> = vec![];
-                            let vst_event_blocks = DAWUtils::convert_to_event_blocks(&automation, &riffs, &riff_refs, bpm, block_size, sample_rate, lowest_common_factor_in_beats as f64, midi_channel);
-                            info!("state.play_riff_set_update_track: sending message to vst - set events with data");
-                            self.send_to_track_background_processor(track.uuid().to_string(), TrackBackgroundProcessorInwardEvent::SetEvents(vst_event_blocks, true));
-                        }
-                        else {
-                            let vst_event_blocks = (vec![], vec![]);
-                            info!("state.play_riff_set_update_track: sending message to vst - set events without data");
-                            self.send_to_track_background_processor(track.uuid().to_string(), TrackBackgroundProcessorInwardEvent::SetEvents(vst_event_blocks, true));
-                        }
-                    }
-                    else {
-                        let vst_event_blocks = (vec![], vec![]);
-                        info!("state.play_riff_set_update_track: sending message to vst - set events without data");
-                        self.send_to_track_background_processor(track.uuid().to_string(), TrackBackgroundProcessorInwardEvent::SetEvents(vst_event_blocks, true));
-                    }
-                    break;
+                // only rebuild the blocks covered by the riff refs that link to the changed riff
+                for (start_block, end_block) in dirty_block_ranges(riff, track.riff_refs(), bpm, block_size, sample_rate, number_of_blocks) {
+                    info!("state.play_song_update_track_riff: replacing blocks {}..{}", start_block, end_block);
+                    let replacement_event_blocks = DAWUtils::convert_to_event_blocks_for_block_range(track.automation().events(), track.riffs(), track.riff_refs(), bpm, block_size, sample_rate, start_block, end_block, midi_channel);
+                    self.send_to_track_background_processor(track.uuid().to_string(), TrackBackgroundProcessorInwardEvent::ReplaceEventBlocks(start_block, replacement_event_blocks));
                 }
             }
         }
@@ -1276,9 +1661,9 @@ impl DAWState {
 
 
     pub fn play_riff_sequence(&mut self, tx_to_audio: crossbeam_channel::Sender<AudioLayerInwardEvent>, riff_sequence_uuid: String) {
-        let song_length_in_beats = 400.0;
         self.set_playing(true);
         self.set_play_mode(PlayMode::RiffSequence);
+        self.playing_riff_sequence_or_arrangement = Some(riff_sequence_uuid.clone());
         let song = self.project().song();
         let play_position_in_frames = 0;
         let bpm = song.tempo();
@@ -1286,44 +1671,8 @@ impl DAWState {
         let block_size = song.block_size();
         let start_block = (play_position_in_frames as f64 / block_size) as i32;
 
-        // get the riff sequence
-        if let Some(riff_sequence) = song.riff_sequence(riff_sequence_uuid) {
-            let mut track_riff_refs_map = HashMap::new();
-            let mut track_running_position = HashMap::new();
-
-            // setup
-            for track in self.project().song().tracks().iter() {
-                let track_riff_refs: Vec<RiffReference> = vec![];
-                track_riff_refs_map.insert(track.uuid().to_string(), track_riff_refs);
-                track_running_position.insert(track.uuid().to_string(), 0.0);
-            }
-
-            self.get_riff_sequence_play_events(riff_sequence, &mut track_riff_refs_map, &mut track_running_position);
-
-            // convert and send events
-            for track in self.project().song().tracks().iter() {
-                info!("Track: uuid={} - ", track.uuid().to_string());
-
-                let midi_channel = if let TrackType::MidiTrack(midi_track) = track {
-                    midi_track.midi_device().midi_channel()
-                }
-                else {
-                    0
-                };
-                // get the riff refs
-                let riff_refs= match track_riff_refs_map.remove(track.uuid().to_string().as_str()) {
-                    None => Vec::<RiffReference>::new(),
-                    Some(riff_refs) => riff_refs,
-                };
-                for riff_ref in riff_refs.iter() {
-                    info!("Riff ref: uuid={}, position={}, length={} - ", riff_ref.uuid().to_string(), riff_ref.position(), riff_ref.linked_to());
-                }
-                info!("");
-                let automation: Vec<TrackEvent> = vec![];
-                let vst_event_blocks = DAWUtils::convert_to_event_blocks(&automation, track.riffs(), &riff_refs, bpm, block_size, sample_rate, song_length_in_beats, midi_channel);
-                self.send_to_track_background_processor(track.uuid().to_string(), TrackBackgroundProcessorInwardEvent::SetEvents(vst_event_blocks, false));
-            }
-        }
+        let schedule = self.playback_schedule(riff_sequence_uuid, PlayMode::RiffSequence);
+        self.send_playback_schedule(&schedule);
 
         // tell each track audio to play
         for track in self.project().song().tracks() {
@@ -1331,10 +1680,10 @@ impl DAWState {
         }
 
         // set the start block and the number of blocks in the jack audio layer
-        let number_of_blocks = (song_length_in_beats / bpm * 60.0 * sample_rate / block_size) as i32;
-        match tx_to_audio.send(AudioLayerInwardEvent::Play(true, number_of_blocks, start_block)) {
+        let number_of_blocks = (schedule.length_in_beats / bpm * 60.0 * sample_rate / block_size) as i32;
+        match tx_to_audio.try_send(AudioLayerInwardEvent::Play(true, number_of_blocks, start_block)) {
                 Ok(_) => (),
-                Err(error) => info!("Problem using tx_to_audio to send message to jack layer when turning play riff sequence on: {}", error),
+                Err(error) => error!("Problem using tx_to_audio to send message to jack layer when turning play riff sequence on: {}", error),
         }
     }
 
@@ -1351,7 +1700,8 @@ impl DAWState {
 
 
 
-    pub fn get_riff_set_play_events(&self, riff_set: &RiffSet, track_riff_refs_map: &mut HashMap<String, Vec<RiffReference>>, track_running_position: &mut HashMap<String, f64>) {
+    /// The length a riff set plays for before it repeats - the lowest common multiple of its riffs' lengths.
+    pub fn riff_set_length_in_beats(&self, riff_set: &RiffSet) -> i32 {
         let mut riff_lengths = vec![];
 
         // get the track riff_lengths
@@ -1359,7 +1709,7 @@ impl DAWState {
             // get the riff_ref
             if let Some(riff_ref) = riff_set.get_riff_ref_for_track(track.uuid().to_string()) {
                 // get the riff
-                if let Some(riff) = track.riffs().iter().find(|riff| riff.uuid().to_string() == riff_ref.linked_to()) {
+                if let Some(riff) = Self::linked_riff(track, riff_ref) {
                     riff_lengths.push(riff.length() as i32);
                 }
             }
@@ -1367,7 +1717,16 @@ impl DAWState {
 
         let (product, unique_riff_lengths) = DAWState::get_length_product(riff_lengths);
 
-        let lowest_common_factor_in_beats = DAWState::get_lowest_common_factor(unique_riff_lengths, product);
+        DAWState::get_lowest_common_factor(unique_riff_lengths, product)
+    }
+
+    fn linked_riff<'a>(track: &'a TrackType, riff_ref: &RiffReference) -> Option<&'a Riff> {
+        let riff_uuid = Uuid::parse_str(riff_ref.linked_to_str()).ok()?;
+        track.riffs().iter().find(|riff| riff.uuid() == riff_uuid)
+    }
+
+    pub fn get_riff_set_play_events(&self, riff_set: &RiffSet, track_riff_refs_map: &mut HashMap<String, Vec<RiffReference>>, track_running_position: &mut HashMap<String, f64>) {
+        let lowest_common_factor_in_beats = self.riff_set_length_in_beats(riff_set);
 
         for (track_uuid, riff_ref) in riff_set.riff_refs() {
             if let None = track_running_position.get(&track_uuid.clone()) {
@@ -1404,77 +1763,221 @@ impl DAWState {
 
 
 
-    pub fn play_riff_arrangement(&mut self, tx_to_audio: crossbeam_channel::Sender<AudioLayerInwardEvent>, riff_arrangement_uuid: String) {
-        let song_length_in_beats = 400.0;
-        self.set_playing(true);
-        self.set_play_mode(PlayMode::RiffArrangement);
+    /// The riff sets a riff set, sequence or arrangement plays in order.
+    fn playback_schedule_riff_set_uuids(&self, schedule_uuid: &str, play_mode: &PlayMode) -> Vec<String> {
         let song = self.project().song();
-        let play_position_in_frames = 0;
-        let tracks = song.tracks();
-        let bpm = song.tempo();
-        let sample_rate = song.sample_rate();
-        let block_size = song.block_size();
-        let start_block = (play_position_in_frames as f64 / block_size) as i32;
+        let riff_sequence_riff_set_uuids = |riff_sequence: &RiffSequence| riff_sequence.riff_sets().iter().map(|riff_set_reference| riff_set_reference.item_uuid().to_string()).collect::<Vec<String>>();
 
-        // get the riff arrangement
-        if let Some(riff_arrangement) = song.riff_arrangement(riff_arrangement_uuid) {
-            let mut track_riff_refs_map = HashMap::new();
-            let mut track_running_position = HashMap::new();
+        match play_mode {
+            PlayMode::RiffSet => vec![schedule_uuid.to_string()],
+            PlayMode::RiffSequence => match song.riff_sequence(schedule_uuid.to_string()) {
+                Some(riff_sequence) => riff_sequence_riff_set_uuids(riff_sequence),
+                None => vec![],
+            },
+            PlayMode::RiffArrangement => match song.riff_arrangement(schedule_uuid.to_string()) {
+                Some(riff_arrangement) => riff_arrangement.items().iter().flat_map(|item| match item.item_type() {
+                    RiffItemType::RiffSet => vec![item.item_uuid().to_string()],
+                    RiffItemType::RiffSequence => match song.riff_sequences().iter().find(|riff_sequence| riff_sequence.uuid() == item.item_uuid()) {
+                        Some(riff_sequence) => riff_sequence_riff_set_uuids(riff_sequence),
+                        None => vec![],
+                    },
+                }).collect(),
+                None => vec![],
+            },
+            PlayMode::Song => vec![],
+        }
+    }
 
-            // setup
-            for track in self.project().song().tracks().iter() {
-                let track_riff_refs: Vec<RiffReference> = vec![];
-                track_riff_refs_map.insert(track.uuid().to_string(), track_riff_refs);
-                track_running_position.insert(track.uuid().to_string(), 0.0);
-            }
+    /// What each track's part of a schedule playing the riff sets in order is compiled from.
+    fn playback_schedule_inputs(&self, riff_set_uuids: &[String]) -> Vec<(String, TrackScheduleInputs)> {
+        let song = self.project().song();
+        let riff_sets: Vec<Option<&RiffSet>> = riff_set_uuids.iter().map(|riff_set_uuid| song.riff_set(riff_set_uuid.clone())).collect();
+        let riff_set_lengths_in_beats: Vec<i32> = riff_sets.iter().map(|riff_set| riff_set.map_or(0, |riff_set| self.riff_set_length_in_beats(riff_set))).collect();
+
+        song.tracks().iter().map(|track| {
+            let track_uuid = track.uuid().to_string();
+            let riffs = riff_sets.iter().map(|riff_set| riff_set
+                .and_then(|riff_set| riff_set.get_riff_ref_for_track(track_uuid.clone()))
+                .and_then(|riff_ref| Self::linked_riff(track, riff_ref))
+                .map(|riff| (riff.uuid().to_string(), riff.version()))).collect();
+            let inputs = TrackScheduleInputs {
+                tempo: song.tempo(),
+                sample_rate: song.sample_rate(),
+                block_size: song.block_size(),
+                midi_channel: Self::track_midi_channel(track),
+                riffs,
+                riff_set_lengths_in_beats: riff_set_lengths_in_beats.clone(),
+            };
+            (track_uuid, inputs)
+        }).collect()
+    }
 
-            // process all the items in the arrangement
-            for item in riff_arrangement.items().iter() {
-                match item.item_type() {
-                    RiffItemType::RiffSet => {
-                        // find the riff set and process its events
-                        if let Some(riff_set) = self.project().song().riff_sets().iter().find(|current_riff_set| current_riff_set.uuid() == item.item_uuid()) {
-                            self.get_riff_set_play_events(riff_set, &mut track_riff_refs_map, &mut track_running_position);
-                        }
-                    }
-                    RiffItemType::RiffSequence => {
-                        // find the riff sequence and process its events
-                        if let Some(riff_sequence) = self.project().song().riff_sequences().iter().find(|current_riff_sequence| current_riff_sequence.uuid() == item.item_uuid()) {
-                            self.get_riff_sequence_play_events(riff_sequence, &mut track_riff_refs_map, &mut track_running_position);
+    fn track_midi_channel(track: &TrackType) -> i32 {
+        if let TrackType::MidiTrack(midi_track) = track {
+            midi_track.midi_device().midi_channel()
+        }
+        else {
+            0
+        }
+    }
+
+    /// Lays the riff sets out for compiling - a riff set on its own repeats each riff up to the riff set's length and
+    /// loops, otherwise the riff sets play one after the other. Tracks whose inputs match the previous schedule reuse
+    /// its blocks and aren't laid out again.
+    fn playback_schedule_layout(&self, riff_set_uuids: &[String], looped: bool, inputs: Vec<(String, TrackScheduleInputs)>, previous: Option<&PlaybackSchedule>) -> PlaybackScheduleLayout {
+        let song = self.project().song();
+        let reusable_track = |track_uuid: &str, inputs: &TrackScheduleInputs| previous.and_then(|previous| previous.reusable_track(track_uuid, inputs));
+
+        if looped {
+            let riff_set = match riff_set_uuids.first().and_then(|riff_set_uuid| song.riff_set(riff_set_uuid.clone())) {
+                Some(riff_set) => riff_set,
+                None => return PlaybackScheduleLayout { length_in_beats: RIFF_SEQUENCE_LENGTH_IN_BEATS, tracks: vec![] },
+            };
+            let length_in_beats = inputs.first().and_then(|(_, inputs)| inputs.riff_set_lengths_in_beats.first().copied()).unwrap_or(0);
+            let tracks = song.tracks().iter().zip(inputs.into_iter()).map(|(track, (track_uuid, inputs))| {
+                let source = match reusable_track(track_uuid.as_str(), &inputs) {
+                    Some(event_blocks) => TrackScheduleSource::Compiled(event_blocks),
+                    None => match riff_set.get_riff_ref_for_track(track_uuid.clone()).and_then(|riff_ref| Self::linked_riff(track, riff_ref).map(|riff| (riff_ref, riff))) {
+                        Some((riff_ref, riff)) => {
+                            let riff_refs = (0..(length_in_beats / (riff.length() as i32))).map(|repeat| {
+                                let mut riff_reference = riff_ref.clone();
+                                riff_reference.set_position(riff.length() * repeat as f64);
+                                riff_reference
+                            }).collect();
+                            TrackScheduleSource::Riffs(vec![riff.clone()], riff_refs)
                         }
-                    }
+                        None => TrackScheduleSource::Compiled(None),
+                    },
+                };
+                TrackScheduleLayout { track_uuid, inputs, source }
+            }).collect();
+
+            PlaybackScheduleLayout { length_in_beats: length_in_beats as f64, tracks }
+        }
+        else {
+            let mut track_riff_refs_map = HashMap::new();
+            let mut track_running_position = HashMap::new();
+            for (track_uuid, _) in inputs.iter() {
+                track_riff_refs_map.insert(track_uuid.clone(), Vec::<RiffReference>::new());
+                track_running_position.insert(track_uuid.clone(), 0.0);
+            }
+            for riff_set_uuid in riff_set_uuids.iter() {
+                if let Some(riff_set) = song.riff_set(riff_set_uuid.clone()) {
+                    info!("state.playback_schedule_layout: riff set name={}", riff_set.name());
+                    self.get_riff_set_play_events(riff_set, &mut track_riff_refs_map, &mut track_running_position);
                 }
             }
 
-            // convert and send events
-            for track in self.project().song().tracks().iter() {
-                let midi_channel = if let TrackType::MidiTrack(midi_track) = track {
-                    midi_track.midi_device().midi_channel()
-                }
-                else {
-                    0
-                };
-                // get the riff refs
-                let riff_refs= match track_riff_refs_map.remove(track.uuid().to_string().as_str()) {
-                    None => Vec::<RiffReference>::new(),
-                    Some(riff_refs) => riff_refs,
+            let tracks = song.tracks().iter().zip(inputs.into_iter()).map(|(track, (track_uuid, inputs))| {
+                let source = match reusable_track(track_uuid.as_str(), &inputs) {
+                    Some(event_blocks) => TrackScheduleSource::Compiled(event_blocks),
+                    None => {
+                        let riff_refs = track_riff_refs_map.remove(&track_uuid).unwrap_or_default();
+                        let riffs = track.riffs().iter().filter(|riff| riff_refs.iter().any(|riff_ref| riff_ref.linked_to_str() == riff.uuid().to_string())).cloned().collect();
+                        TrackScheduleSource::Riffs(riffs, riff_refs)
+                    }
                 };
-                let automation: Vec<TrackEvent> = vec![];
-                let vst_event_blocks = DAWUtils::convert_to_event_blocks(&automation, track.riffs(), &riff_refs, bpm, block_size, sample_rate, song_length_in_beats, midi_channel);
-                self.send_to_track_background_processor(track.uuid().to_string(), TrackBackgroundProcessorInwardEvent::SetEvents(vst_event_blocks, false));
+                TrackScheduleLayout { track_uuid, inputs, source }
+            }).collect();
+
+            PlaybackScheduleLayout { length_in_beats: RIFF_SEQUENCE_LENGTH_IN_BEATS, tracks }
+        }
+    }
+
+    /// The compiled schedule for a riff set, sequence or arrangement - taken from the cache if nothing it plays has
+    /// changed, otherwise compiled again reusing the tracks that haven't changed.
+    fn playback_schedule(&self, schedule_uuid: String, play_mode: PlayMode) -> Arc<PlaybackSchedule> {
+        let riff_set_uuids = self.playback_schedule_riff_set_uuids(schedule_uuid.as_str(), &play_mode);
+        let inputs = self.playback_schedule_inputs(&riff_set_uuids);
+        let previous = self.playback_schedules.lock().get(schedule_uuid.as_str());
+        if let Some(previous) = previous.as_ref() {
+            if previous.is_current(&inputs) {
+                return previous.clone();
             }
         }
 
+        let schedule = Arc::new(self.playback_schedule_layout(&riff_set_uuids, play_mode == PlayMode::RiffSet, inputs, previous.as_deref()).compile());
+        self.playback_schedules.lock().insert(schedule_uuid, schedule.clone());
+        schedule
+    }
+
+    /// Compiles the riff set after the given one on another thread so that it is ready if it is triggered next.
+    fn precompile_next_riff_set(&self, riff_set_uuid: &str) {
+        let riff_sets = self.project().song().riff_sets();
+        let next_riff_set_uuid = match riff_sets.iter().position(|riff_set| riff_set.uuid() == riff_set_uuid).and_then(|index| riff_sets.get(index + 1)) {
+            Some(next_riff_set) => next_riff_set.uuid(),
+            None => return,
+        };
+
+        let riff_set_uuids = vec![next_riff_set_uuid.clone()];
+        let inputs = self.playback_schedule_inputs(&riff_set_uuids);
+        let previous = self.playback_schedules.lock().get(next_riff_set_uuid.as_str());
+        if previous.as_ref().map_or(false, |previous| previous.is_current(&inputs)) || !self.playback_schedules.lock().start_compiling(next_riff_set_uuid.clone()) {
+            return;
+        }
+
+        // the layout holds copies of the riffs so compiling doesn't need the state
+        let layout = self.playback_schedule_layout(&riff_set_uuids, true, inputs, previous.as_deref());
+        let playback_schedules = self.playback_schedules.clone();
+        let compiled_riff_set_uuid = next_riff_set_uuid.clone();
+        let spawned = thread::Builder::new().name(PLAYBACK_SCHEDULE_COMPILER_THREAD_NAME.to_string()).spawn(move || {
+            let schedule = Arc::new(layout.compile());
+            playback_schedules.lock().finish_compiling(compiled_riff_set_uuid.as_str(), Some(schedule));
+        });
+        if let Err(error) = spawned {
+            info!("state.precompile_next_riff_set: could not start compiling: {}", error);
+            self.playback_schedules.lock().finish_compiling(next_riff_set_uuid.as_str(), None);
+        }
+    }
+
+    /// Sends each track its part of a schedule that plays through once.
+    fn send_playback_schedule(&self, schedule: &PlaybackSchedule) {
+        for track_schedule in schedule.tracks.iter() {
+            let vst_event_blocks = match track_schedule.event_blocks.as_ref() {
+                Some(track_event_blocks) => (**track_event_blocks).clone(),
+                None => (EventBlocks::default(), EventBlocks::default()),
+            };
+            self.send_frozen_audio(track_schedule.track_uuid.clone(), false);
+            self.send_to_track_background_processor(track_schedule.track_uuid.clone(), TrackBackgroundProcessorInwardEvent::SetEvents(vst_event_blocks, false));
+        }
+    }
+
+    /// The frozen audio is a render of the song so frozen tracks only play it when the song is played - riff sets,
+    /// sequences and arrangements are played through the live instrument and effects.
+    fn send_frozen_audio(&self, track_uuid: String, playing_song: bool) {
+        if let Some((frozen_audio, output_delay)) = self.frozen_track_audio.get(&track_uuid) {
+            let frozen_audio = if playing_song { Some(frozen_audio.clone()) } else { None };
+            self.send_to_track_background_processor(track_uuid, TrackBackgroundProcessorInwardEvent::SetFrozenAudio(frozen_audio, *output_delay));
+        }
+    }
+
+
+
+    pub fn play_riff_arrangement(&mut self, tx_to_audio: crossbeam_channel::Sender<AudioLayerInwardEvent>, riff_arrangement_uuid: String) {
+        self.set_playing(true);
+        self.set_play_mode(PlayMode::RiffArrangement);
+        self.playing_riff_sequence_or_arrangement = Some(riff_arrangement_uuid.clone());
+        let song = self.project().song();
+        let play_position_in_frames = 0;
+        let tracks = song.tracks();
+        let bpm = song.tempo();
+        let sample_rate = song.sample_rate();
+        let block_size = song.block_size();
+        let start_block = (play_position_in_frames as f64 / block_size) as i32;
+
+        let schedule = self.playback_schedule(riff_arrangement_uuid, PlayMode::RiffArrangement);
+        self.send_playback_schedule(&schedule);
+
         // tell each track audio to play
         for track in tracks {
             self.send_to_track_background_processor(track.uuid().to_string(), TrackBackgroundProcessorInwardEvent::Play(start_block));
         }
 
         // set the start block and the number of blocks in the jack audio layer
-        let number_of_blocks = (song_length_in_beats / bpm * 60.0 * sample_rate / block_size) as i32;
-        match tx_to_audio.send(AudioLayerInwardEvent::Play(true, number_of_blocks, start_block)) {
+        let number_of_blocks = (schedule.length_in_beats / bpm * 60.0 * sample_rate / block_size) as i32;
+        match tx_to_audio.try_send(AudioLayerInwardEvent::Play(true, number_of_blocks, start_block)) {
                 Ok(_) => (),
-                Err(error) => info!("Problem using tx_to_audio to send message to jack layer when turning play riff arrangement on: {}", error),
+                Err(error) => error!("Problem using tx_to_audio to send message to jack layer when turning play riff arrangement on: {}", error),
         }
     }
 
@@ -1483,9 +1986,9 @@ impl DAWState {
     pub fn riff_set_increment_riff_for_track(&mut self, riff_set_uuid: String, track_uuid: String) {
         info!("state.riff_set_increment_riff_for_track: {}, {}", riff_set_uuid.as_str(), track_uuid.as_str());
         // get the track
-        let riff_uuids: Vec<String> = match self.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
+        let riff_uuids: Vec<String> = match self.project().song().tracks().iter().find(|track| track.uuid().to_string() == track_uuid) {
             Some(track) => {
-                track.riffs_mut().iter().map(|riff| riff.uuid().to_string()).collect_vec()
+                track.riffs().iter().map(|riff| riff.uuid().to_string()).collect_vec()
             },
             None => vec![],
         };
@@ -1557,8 +2060,8 @@ impl DAWState {
     ) {
         let (jack_client, _status) =
             Client::new("DAW", ClientOptions::NO_START_SERVER).unwrap();
-        let audio = Audio::new(&jack_client, rx_to_audio, jack_midi_sender.clone(), coast, vst_host_time_info);
-        let notifications = JackNotificationHandler::new(jack_midi_sender);
+        let audio = Audio::new(&jack_client, rx_to_audio, jack_midi_sender.clone(), coast, vst_host_time_info, self.track_processing_scheduler.clone());
+        let notifications = JackNotificationHandler::new(jack_midi_sender, self.delay_compensation_latency.clone());
         let jack_async_client = jack_client.activate_async(notifications, audio).unwrap();
 
         // these should come from configuration and be selected from a menu and dialogue
@@ -1581,6 +2084,8 @@ impl DAWState {
             match async_client.deactivate() {
                 Ok((_client, _notification_handler, mut process_handler)) => {
                     let consumers = process_handler.get_all_audio_consumers();
+                    let live_midi_producers = process_handler.get_all_live_midi_producers();
+                    let live_midi_input_track = process_handler.take_live_midi_input_track();
                     let (jack_client, _status) =
                         Client::new("DAW", ClientOptions::NO_START_SERVER).unwrap();
                     let audio = Audio::new_with_consumers(
@@ -1590,9 +2095,12 @@ impl DAWState {
                         coast,
                         consumers,
                         vec![],
+                        live_midi_producers,
+                        live_midi_input_track,
                         vst_host_time_info,
+                        self.track_processing_scheduler.clone(),
                     );
-                    let notifications = JackNotificationHandler::new(jack_midi_sender);
+                    let notifications = JackNotificationHandler::new(jack_midi_sender, self.delay_compensation_latency.clone());
                     let jack_async_client = jack_client.activate_async(notifications, audio).unwrap();
                     for (from_name, to_name) in self.jack_connections.iter() {
                         let _ = jack_async_client.as_client().connect_ports_by_name(from_name.as_str(), to_name.as_str());
@@ -1651,68 +2159,185 @@ impl DAWState {
 
     pub fn export_to_wave_file(&mut self,
                                path: std::path::PathBuf,
-                               tx_to_audio: crossbeam_channel::Sender<AudioLayerInwardEvent>,
-                               track_audio_coast: Arc<Mutex<TrackBackgroundProcessorMode>>,
                                tx_from_ui: crossbeam_channel::Sender<DAWEvents>
     ) {
-        let number_of_blocks = self.play_song(tx_to_audio);
+        self.render_to_wave_files(Some(path), HashMap::new(), tx_from_ui, None);
+    }
+
+    /// Render the mixdown and every track that renders audio to its own wave file in the given directory in a single pass.
+    pub fn export_stems_to_wave_files(&mut self,
+                                      directory: std::path::PathBuf,
+                                      tx_from_ui: crossbeam_channel::Sender<DAWEvents>
+    ) {
+        let (stem_paths, tracks_without_stems) = self.stem_paths(&directory);
+        if !tracks_without_stems.is_empty() {
+            let _ = tx_from_ui.send(DAWEvents::Notification(NotificationType::Warning, format!("No stems for tracks that don't render audio: {}", tracks_without_stems.join(", "))));
+        }
+        self.render_to_wave_files(Some(directory.join("mixdown.wav")), stem_paths, tx_from_ui, None);
+    }
+
+    /// The wave file each track's stem is written to in the given directory by track uuid, along with the names of the
+    /// tracks that get no stem as they have no render ring buffer to render from e.g. midi tracks.
+    pub fn stem_paths(&self, directory: &std::path::Path) -> (HashMap<String, std::path::PathBuf>, Vec<String>) {
+        let mut stem_paths = HashMap::new();
+        let mut tracks_without_stems = vec![];
+        let track_render_audio_consumers = match self.track_render_audio_consumers.lock() {
+            Ok(track_render_audio_consumers) => track_render_audio_consumers.keys().cloned().collect(),
+            Err(_) => std::collections::HashSet::new(),
+        };
+        for (index, track) in self.project().song().tracks().iter().enumerate() {
+            if !track_render_audio_consumers.contains(track.uuid().to_string().as_str()) {
+                tracks_without_stems.push(track.name().to_string());
+                continue;
+            }
+            // number the files so that tracks with the same name don't overwrite each other
+            let file_name: String = track.name().chars().map(|character| if character.is_alphanumeric() || character == ' ' || character == '-' { character } else { '_' }).collect();
+            stem_paths.insert(track.uuid().to_string(), directory.join(format!("{:02} {}.wav", index + 1, file_name)));
+        }
+        (stem_paths, tracks_without_stems)
+    }
+
+    /// Freeze an instrument track - render the song through its instrument and effects to a wave file in the cache
+    /// and play that in place of them. The file is named after the track's content hash so freezing a track that
+    /// hasn't changed since it was last frozen uses the file already rendered. Expects the progress dialogue to be showing.
+    pub fn freeze_track(&mut self,
+                        track_uuid: String,
+                        tx_from_ui: crossbeam_channel::Sender<DAWEvents>
+    ) {
+        // the presets in the project are from the last save - plugin changes since then have to be in the hash
+        self.refresh_track_preset_data(track_uuid.as_str());
+
+        let song = self.project().song();
+        let content_hash = match song.tracks().iter().find(|track| track.uuid().to_string() == track_uuid) {
+            Some(TrackType::InstrumentTrack(instrument_track)) => instrument_track.content_hash(song.tempo(), song.length_in_beats() as f64),
+            _ => {
+                info!("state.freeze_track: only instrument tracks can be frozen.");
+                let _ = tx_from_ui.send(DAWEvents::HideProgressDialogue);
+                return;
+            }
+        };
+        let freeze_path = match Self::track_freeze_path(track_uuid.as_str(), content_hash) {
+            Some(freeze_path) => freeze_path,
+            None => {
+                let _ = tx_from_ui.send(DAWEvents::HideProgressDialogue);
+                let _ = tx_from_ui.send(DAWEvents::Notification(NotificationType::Error, "Could not create the track freeze cache.".to_string()));
+                return;
+            }
+        };
+        let file_name = freeze_path.to_string_lossy().to_string();
+        let output_delay = self.track_delay_compensation().1.get(&track_uuid).map(|compensation| compensation.output_delay).unwrap_or(0);
+
+        if freeze_path.exists() {
+            self.set_track_frozen(track_uuid, Some(FrozenTrack::new(file_name, content_hash, output_delay)));
+            let _ = tx_from_ui.send(DAWEvents::HideProgressDialogue);
+            return;
+        }
+
+        // rendered to a partial file that is only renamed to the freeze file once the render has finished so that a
+        // failed or interrupted render is never taken for a freeze
+        let partial_freeze_path = Self::partial_track_freeze_path(&freeze_path);
+        let _ = std::fs::remove_file(&partial_freeze_path);
+
+        // the track has to be processed to be rendered - the whole song is rendered from the start
+        self.set_track_frozen(track_uuid.clone(), None);
+        let play_position_in_frames = self.play_position_in_frames();
+        let looping = self.looping();
+        self.set_play_position_in_frames(0);
+        self.set_looping(false);
+
+        let mut stem_paths = HashMap::new();
+        stem_paths.insert(track_uuid.clone(), partial_freeze_path);
+        let rendered = DAWEvents::TrackChange(TrackChangeType::FreezeRendered(file_name, content_hash, output_delay), Some(track_uuid));
+        self.render_to_wave_files(None, stem_paths, tx_from_ui, Some(rendered));
+
+        self.set_play_position_in_frames(play_position_in_frames);
+        self.set_looping(looping);
+    }
+
+    /// Finish freezing a track once its freeze render has been written - the partial file becomes the freeze file.
+    pub fn freeze_rendered(&mut self, track_uuid: String, frozen: FrozenTrack) {
+        let freeze_path = std::path::PathBuf::from(frozen.file_name());
+        match std::fs::rename(Self::partial_track_freeze_path(&freeze_path), &freeze_path) {
+            Ok(_) => self.set_track_frozen(track_uuid, Some(frozen)),
+            Err(error) => {
+                info!("state.freeze_rendered: could not rename the rendered freeze file: {:?}", error);
+                let _ = self.sender.send(DAWEvents::Notification(NotificationType::Error, "Could not freeze the track.".to_string()));
+            }
+        }
+    }
+
+    /// Freeze a track using an already rendered freeze file or unfreeze it with None.
+    pub fn set_track_frozen(&mut self, track_uuid: String, frozen: Option<FrozenTrack>) {
+        let frozen_audio = frozen.as_ref().map(|frozen| SampleData::new(frozen.file_name().to_string(), self.audio_sample_rate as i32, &self.sample_streamer));
+        let output_delay = frozen.as_ref().map(|frozen| frozen.output_delay()).unwrap_or(0);
+        if let Some(TrackType::InstrumentTrack(instrument_track)) = self.track_mut(&track_uuid) {
+            instrument_track.set_frozen(frozen);
+        }
+
+        match frozen_audio.as_ref() {
+            Some(frozen_audio) => self.frozen_track_audio.insert(track_uuid.clone(), (frozen_audio.clone(), output_delay)),
+            None => self.frozen_track_audio.remove(&track_uuid),
+        };
+        self.send_to_track_background_processor(track_uuid, TrackBackgroundProcessorInwardEvent::SetFrozenAudio(frozen_audio, output_delay));
+    }
+
+    fn partial_track_freeze_path(freeze_path: &std::path::Path) -> std::path::PathBuf {
+        freeze_path.with_extension("wav.partial")
+    }
+
+    /// The freeze file for a track's content hash - see InstrumentTrack::content_hash.
+    fn track_freeze_path(track_uuid: &str, content_hash: u64) -> Option<std::path::PathBuf> {
+        let mut track_freeze_path = dirs::cache_dir()?;
+        track_freeze_path.push("riff-daw");
+        track_freeze_path.push("frozen");
+        std::fs::create_dir_all(&track_freeze_path).ok()?;
+        track_freeze_path.push(format!("{}_{:016x}.wav", track_uuid, content_hash));
+        Some(track_freeze_path)
+    }
+
+    /// Render offline from the play position on a background thread - rendered is sent once the files have been written.
+    /// The song is not played through jack - the render drives the tracks itself and stops them once it is done.
+    fn render_to_wave_files(&mut self,
+                            mixdown_path: Option<std::path::PathBuf>,
+                            stem_paths: HashMap<String, std::path::PathBuf>,
+                            tx_from_ui: crossbeam_channel::Sender<DAWEvents>,
+                            rendered: Option<DAWEvents>,
+    ) {
+        let track_processing_scheduler = self.track_processing_scheduler();
+        // before the tracks are sent the song so that no live cycle starts them playing it
+        track_processing_scheduler.begin_offline_render();
+        self.unfreeze_changed_tracks();
+        let (_, number_of_blocks) = self.send_song_to_tracks(false);
+        let track_senders: Vec<Sender<TrackBackgroundProcessorInwardEvent>> = self.instrument_track_senders.values().cloned().collect();
         let track_render_audio_consumers = self.track_render_audio_consumers.clone();
+        let block_size = self.project().song().block_size() as usize;
+        let sample_rate = self.project().song().sample_rate() as u32;
 
         thread::spawn(move || {
             match track_render_audio_consumers.lock() {
-                Ok(track_render_audio_consumers) => if let Ok(mut export_wave_file) = std::fs::File::create(path) {
-                    let number_of_audio_type_tracks = track_render_audio_consumers.len() as f32;
-                    let mut master_left_channel_data: [f32; 1024] = [0.0; 1024];
-                    let mut master_right_channel_data: [f32; 1024] = [0.0; 1024];
-                    let mut left_channel_data: [f32; 1024] = [0.0; 1024];
-                    let mut right_channel_data: [f32; 1024] = [0.0; 1024];
-                    let mut left_sample_count: u32 = 0;
-                    let mut right_sample_count: u32 = 0;
-                    let mut sample_data = vec![];
-
-                    for _block_number in 0..number_of_blocks {
-                        // reset the master block
-                        for index in 0..1024_usize {
-                            master_left_channel_data[index] = 0.0;
-                            master_right_channel_data[index] = 0.0;
-                        }
-
-                        for (_track_uuid, track_audio_consumer_details) in track_render_audio_consumers.iter() {
-                            if let Some(left_bytes_read) = track_audio_consumer_details.consumer_left().read_blocking(&mut left_channel_data) {
-                                // info!("State.export_to_wave_file: track_uuid={}, channel=left, byes_read={}", track_uuid.as_str(), left_bytes_read);
-                                // copy the track channel data to the the master channels
-                                for index in 0..left_bytes_read as usize {
-                                    master_left_channel_data[index] += left_channel_data[index] / number_of_audio_type_tracks;
-                                    left_sample_count += 1;
-                                }
-                            }
-                            if let Some(right_bytes_read) = track_audio_consumer_details.consumer_right().read_blocking(&mut right_channel_data) {
-                                // info!("State.export_to_wave_file: track_uuid={}, channel=right, byes_read={}", track_uuid.as_str(), right_bytes_read);
-                                // copy the track channel data to the the master channels
-                                for index in 0..right_bytes_read as usize {
-                                    master_right_channel_data[index] += right_channel_data[index] / number_of_audio_type_tracks;
-                                    right_sample_count += 1;
-                                }
-                            }
+                Ok(track_render_audio_consumers) => {
+                    let tx_progress = tx_from_ui.clone();
+                    let result = render_song_to_wave_files(mixdown_path, stem_paths, number_of_blocks, block_size, sample_rate, &track_render_audio_consumers, &track_processing_scheduler, |fraction| {
+                        let _ = tx_progress.send(DAWEvents::ProgressDialogueFraction(fraction));
+                    });
+                    match result {
+                        Ok(_) => if let Some(rendered) = rendered {
+                            let _ = tx_from_ui.send(rendered);
                         }
-
-                        // write the master block out
-                        for index in 0..1024_usize {
-                            sample_data.push(master_left_channel_data[index]);
-                            sample_data.push(master_right_channel_data[index]);
+                        Err(error) => {
+                            info!("State.render_to_wave_files: could not write the wave files: {:?}", error);
+                            let _ = tx_from_ui.send(DAWEvents::Notification(NotificationType::Error, "Could not export wave file.".to_string()));
                         }
                     }
-
-                    // write the file
-                    let wav_header = wav_io::new_header(44100, 32, true, false);
-                    let _ = wav_io::write_to_file(&mut export_wave_file, &wav_header, &sample_data);
                 }
                 Err(_) => {}
             }
 
-            if let Ok(mut coast) = track_audio_coast.lock() {
-                *coast = TrackBackgroundProcessorMode::AudioOut;
+            // stopped before the cycles go back to jack so that the tracks don't carry on playing the song from where the render ended
+            for track_sender in track_senders.iter() {
+                let _ = track_sender.send(TrackBackgroundProcessorInwardEvent::Stop);
             }
+            track_processing_scheduler.end_offline_render();
 
             let _ = tx_from_ui.send(DAWEvents::HideProgressDialogue);
         });
@@ -1950,7 +2575,7 @@ impl DAWState {
                         None
                     }
                 },
-                _ => if let Some(track) = self.get_project().song_mut().tracks_mut().iter_mut().find(|track| track.uuid().to_string() == track_uuid) {
+                _ => if let Some(track) = self.track_mut(&track_uuid) {
                     Some(track.automation_mut())
                 }
                 else {
@@ -1975,6 +2600,84 @@ impl DAWState {
         self.dirty = dirty;
     }
 
+    pub fn track_processing_scheduler(&self) -> Arc<TrackProcessingScheduler> {
+        self.track_processing_scheduler.clone()
+    }
+
+    pub fn sample_streamer(&self) -> Arc<SampleStreamer> {
+        self.sample_streamer.clone()
+    }
+
+    pub fn waveform_peak_cache(&self) -> Arc<WaveformPeakCache> {
+        self.waveform_peak_cache.clone()
+    }
+
+    /// Load or build the waveform peaks of all the song's samples in the background - the headless renderer never
+    /// draws them so this is left to the gui after a project is loaded.
+    pub fn request_waveform_peaks(&self) {
+        for sample in self.project.song().samples().values() {
+            self.waveform_peak_cache.request(sample.file_name());
+        }
+    }
+
+    pub fn audio_block_size(&self) -> usize {
+        self.audio_block_size
+    }
+
+    pub fn audio_sample_rate(&self) -> f64 {
+        self.audio_sample_rate
+    }
+
+    /// Jack has reported a new block size and/or sample rate - or a headless render has picked its own. Returns true if
+    /// either changed.
+    pub fn set_audio_format(&mut self, block_size: usize, sample_rate: f64) -> bool {
+        let changed = block_size != self.audio_block_size || sample_rate != self.audio_sample_rate;
+        self.audio_block_size = block_size;
+        self.audio_sample_rate = sample_rate;
+        self.update_song_audio_format();
+        changed
+    }
+
+    /// The tracks hold what they are playing as event blocks of the old block size and sample rate, so after a change
+    /// whatever is playing is built and sent again. The song carries on from the play position, riff sets, sequences
+    /// and arrangements start again as they do whenever they are played.
+    pub fn rebuild_playing_event_blocks(&mut self, tx_to_audio: crossbeam_channel::Sender<AudioLayerInwardEvent>) {
+        if !self.playing() {
+            return;
+        }
+        match self.play_mode() {
+            PlayMode::Song => {
+                self.play_song(tx_to_audio);
+            }
+            PlayMode::RiffSet => if let Some(riff_set_uuid) = self.playing_riff_set().clone() {
+                self.play_riff_set(tx_to_audio, riff_set_uuid);
+            }
+            PlayMode::RiffSequence => if let Some(riff_sequence_uuid) = self.playing_riff_sequence_or_arrangement.clone() {
+                self.play_riff_sequence(tx_to_audio, riff_sequence_uuid);
+            }
+            PlayMode::RiffArrangement => if let Some(riff_arrangement_uuid) = self.playing_riff_sequence_or_arrangement.clone() {
+                self.play_riff_arrangement(tx_to_audio, riff_arrangement_uuid);
+            }
+        }
+    }
+
+    /// Make the song and the track background processors use the current block size and sample rate - the values saved
+    /// with the song are only a record of what it was last run at.
+    pub fn update_song_audio_format(&mut self) {
+        let block_size = self.audio_block_size;
+        let sample_rate = self.audio_sample_rate;
+
+        self.get_project().song_mut().set_block_size(block_size as f64);
+        self.get_project().song_mut().set_sample_rate(sample_rate);
+
+        for sender in self.instrument_track_senders().values() {
+            match sender.send(TrackBackgroundProcessorInwardEvent::SetAudioFormat(block_size, sample_rate)) {
+                Ok(_) => (),
+                Err(error) => info!("{:?}", error),
+            }
+        }
+    }
+
     pub fn note_expression_id(&self) -> i32 {
         self.note_expression_id
     }
@@ -0,0 +1,591 @@
+use std::collections::HashMap;
+use std::fmt::Write;
+use std::path::PathBuf;
+use std::sync::{Arc, OnceLock};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::{Duration, SystemTime, UNIX_EPOCH};
+
+use serde::{Deserialize, Serialize};
+use uuid::Uuid;
+
+use crate::project_snapshot::TrackSnapshot;
+
+const HISTOGRAM_BUCKETS: usize = 40; // bucket n counts values below 2^n - ~18 minutes of nanoseconds
+const XRUN_LOG_CAPACITY: usize = 64;
+const LOAD_AVERAGE_WEIGHT: f64 = 0.05; // weight of the latest block in a track's moving average processing time
+const DEFAULT_TELEMETRY_EXPORT_INTERVAL_IN_SECONDS: u64 = 10;
+
+/// A histogram that any thread can record into without locking or allocating - safe to use from the jack process
+/// callback. Bucket 0 counts zeros and bucket n counts the values from 2^(n-1) up to 2^n - 1, so the upper bound it
+/// gives for a quantile is never more than twice the real value.
+pub struct Histogram {
+    buckets: [AtomicU64; HISTOGRAM_BUCKETS],
+    count: AtomicU64,
+    sum: AtomicU64,
+    max: AtomicU64,
+}
+
+impl Histogram {
+    pub fn new() -> Self {
+        Self {
+            buckets: std::array::from_fn(|_| AtomicU64::new(0)),
+            count: AtomicU64::new(0),
+            sum: AtomicU64::new(0),
+            max: AtomicU64::new(0),
+        }
+    }
+
+    pub fn record(&self, value: u64) {
+        let bucket = ((u64::BITS - value.leading_zeros()) as usize).min(HISTOGRAM_BUCKETS - 1);
+        self.buckets[bucket].fetch_add(1, Ordering::Relaxed);
+        self.count.fetch_add(1, Ordering::Relaxed);
+        self.sum.fetch_add(value, Ordering::Relaxed);
+        self.max.fetch_max(value, Ordering::Relaxed);
+    }
+
+    pub fn record_duration(&self, duration: Duration) {
+        self.record(duration.as_nanos().min(u64::MAX as u128) as u64);
+    }
+
+    /// A copy of the counts - recording can carry on while it is taken so the totals may be a value or two apart.
+    pub fn snapshot(&self) -> HistogramSnapshot {
+        HistogramSnapshot {
+            buckets: self.buckets.iter().map(|bucket| bucket.load(Ordering::Relaxed)).collect(),
+            count: self.count.load(Ordering::Relaxed),
+            sum: self.sum.load(Ordering::Relaxed),
+            max: self.max.load(Ordering::Relaxed),
+        }
+    }
+}
+
+impl Default for Histogram {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+#[derive(Clone, Default, Serialize, Deserialize, PartialEq, Debug)]
+pub struct HistogramSnapshot {
+    pub buckets: Vec<u64>,
+    pub count: u64,
+    pub sum: u64,
+    pub max: u64,
+}
+
+impl HistogramSnapshot {
+    pub fn mean(&self) -> f64 {
+        if self.count == 0 {
+            0.0
+        }
+        else {
+            self.sum as f64 / self.count as f64
+        }
+    }
+
+    /// An upper bound for the value that the given fraction of the recorded values are at or below.
+    pub fn quantile(&self, fraction: f64) -> u64 {
+        let target = ((fraction.clamp(0.0, 1.0) * self.count as f64).ceil() as u64).max(1);
+        let mut cumulative_count = 0;
+        for (bucket, count) in self.buckets.iter().enumerate() {
+            cumulative_count += count;
+            if cumulative_count >= target {
+                return bucket_upper_bound(bucket).min(self.max);
+            }
+        }
+        self.max
+    }
+}
+
+/// The largest value counted in a bucket - the last bucket takes everything too big for the others.
+fn bucket_upper_bound(bucket: usize) -> u64 {
+    if bucket == 0 {
+        0
+    }
+    else if bucket >= HISTOGRAM_BUCKETS - 1 {
+        u64::MAX
+    }
+    else {
+        (1_u64 << bucket) - 1
+    }
+}
+
+/// How long a plugin's process call takes on a track.
+pub struct PluginTelemetry {
+    pub plugin_uuid: Uuid,
+    pub process_time: Histogram, // nanoseconds per block
+}
+
+/// What processing a track costs and whether it keeps up with the audio layer.
+pub struct TrackTelemetry {
+    pub track_uuid: String,
+    pub block_time: Histogram,       // nanoseconds to process each block
+    pub ring_buffer_fill: Histogram, // frames waiting for the audio layer after each block
+    pub underruns: AtomicU64,        // jack periods in which the track had less than a period of audio ready
+    block_budget: AtomicU64,         // nanoseconds of audio in a block
+    average_block_time: AtomicU64,   // f64 bits - moving average of the block time in nanoseconds
+    plugins: parking_lot::Mutex<Vec<Arc<PluginTelemetry>>>,
+}
+
+impl TrackTelemetry {
+    fn new(track_uuid: String) -> Self {
+        Self {
+            track_uuid,
+            block_time: Histogram::new(),
+            ring_buffer_fill: Histogram::new(),
+            underruns: AtomicU64::new(0),
+            block_budget: AtomicU64::new(0),
+            average_block_time: AtomicU64::new(0.0_f64.to_bits()),
+            plugins: parking_lot::Mutex::new(vec![]),
+        }
+    }
+
+    /// The plugin's entry - added if it doesn't have one yet.
+    pub fn plugin(&self, plugin_uuid: Uuid) -> Arc<PluginTelemetry> {
+        let mut plugins = self.plugins.lock();
+        match plugins.iter().find(|plugin| plugin.plugin_uuid == plugin_uuid) {
+            Some(plugin) => plugin.clone(),
+            None => {
+                let plugin = Arc::new(PluginTelemetry { plugin_uuid, process_time: Histogram::new() });
+                plugins.push(plugin.clone());
+                plugin
+            }
+        }
+    }
+
+    pub fn remove_plugin(&self, plugin_uuid: Uuid) {
+        self.plugins.lock().retain(|plugin| plugin.plugin_uuid != plugin_uuid);
+    }
+
+    /// Only the track's own processing task records blocks so the moving average doesn't need a compare and swap.
+    pub fn record_block(&self, elapsed: Duration, block_size: usize, sample_rate: f64) {
+        self.block_time.record_duration(elapsed);
+        if sample_rate > 0.0 {
+            self.block_budget.store((block_size as f64 / sample_rate * 1_000_000_000.0) as u64, Ordering::Relaxed);
+        }
+        let average_block_time = f64::from_bits(self.average_block_time.load(Ordering::Relaxed));
+        let average_block_time = average_block_time + (elapsed.as_nanos() as f64 - average_block_time) * LOAD_AVERAGE_WEIGHT;
+        self.average_block_time.store(average_block_time.to_bits(), Ordering::Relaxed);
+    }
+
+    pub fn block_budget(&self) -> u64 {
+        self.block_budget.load(Ordering::Relaxed)
+    }
+
+    /// The recent processing time as a fraction of how long the audio in a block lasts - 1.0 or more can't keep up.
+    pub fn load(&self) -> f64 {
+        let block_budget = self.block_budget();
+        if block_budget == 0 {
+            0.0
+        }
+        else {
+            f64::from_bits(self.average_block_time.load(Ordering::Relaxed)) / block_budget as f64
+        }
+    }
+
+    /// The slowest block as a fraction of how long the audio in a block lasts.
+    pub fn peak_load(&self) -> f64 {
+        let block_budget = self.block_budget();
+        if block_budget == 0 {
+            0.0
+        }
+        else {
+            self.block_time.max.load(Ordering::Relaxed) as f64 / block_budget as f64
+        }
+    }
+
+    fn snapshot(&self, track: Option<&TrackSnapshot>) -> TrackTelemetrySnapshot {
+        let plugins = self.plugins.lock().iter().map(|plugin| {
+            let plugin_uuid = plugin.plugin_uuid.to_string();
+            let name = track.and_then(|track| track.plugins.iter().find(|(uuid, _)| *uuid == plugin_uuid)).map(|(_, name)| name.clone()).unwrap_or_default();
+            PluginTelemetrySnapshot {
+                plugin_uuid,
+                name,
+                process_time: plugin.process_time.snapshot(),
+            }
+        }).collect();
+
+        TrackTelemetrySnapshot {
+            track_uuid: self.track_uuid.clone(),
+            name: track.map(|track| track.name.clone()).unwrap_or_default(),
+            block_time: self.block_time.snapshot(),
+            block_budget: self.block_budget(),
+            ring_buffer_fill: self.ring_buffer_fill.snapshot(),
+            underruns: self.underruns.load(Ordering::Relaxed),
+            plugins,
+        }
+    }
+}
+
+/// A track processing task's handle on its telemetry - keeps the entries of the track's plugins so that recording a
+/// plugin's process time doesn't have to look it up. Plugins are added and removed as the track loads and drops them,
+/// never from the processing path, so recording neither locks nor allocates.
+pub struct TrackTelemetryRecorder {
+    track: Arc<TrackTelemetry>,
+    plugins: Vec<Arc<PluginTelemetry>>,
+}
+
+impl TrackTelemetryRecorder {
+    pub fn new(track_uuid: &str) -> Self {
+        Self {
+            track: telemetry().track(track_uuid),
+            plugins: vec![],
+        }
+    }
+
+    pub fn track(&self) -> Arc<TrackTelemetry> {
+        self.track.clone()
+    }
+
+    pub fn add_plugin(&mut self, plugin_uuid: Uuid) {
+        if !self.plugins.iter().any(|plugin| plugin.plugin_uuid == plugin_uuid) {
+            self.plugins.push(self.track.plugin(plugin_uuid));
+        }
+    }
+
+    pub fn remove_plugin(&mut self, plugin_uuid: Uuid) {
+        self.plugins.retain(|plugin| plugin.plugin_uuid != plugin_uuid);
+        self.track.remove_plugin(plugin_uuid);
+    }
+
+    /// Plugins that were never added are not recorded.
+    pub fn record_plugin(&self, plugin_uuid: Uuid, elapsed: Duration) {
+        if let Some(plugin) = self.plugins.iter().find(|plugin| plugin.plugin_uuid == plugin_uuid) {
+            plugin.process_time.record_duration(elapsed);
+        }
+    }
+
+    pub fn record_block(&self, elapsed: Duration, block_size: usize, sample_rate: f64) {
+        self.track.record_block(elapsed, block_size, sample_rate);
+    }
+
+    pub fn record_ring_buffer_fill(&self, frames: usize) {
+        self.track.ring_buffer_fill.record(frames as u64);
+    }
+}
+
+/// The times of the most recent xruns along with how many there have been.
+pub struct XrunLog {
+    count: AtomicU64,
+    timestamps: [AtomicU64; XRUN_LOG_CAPACITY], // milliseconds since the unix epoch, indexed by xrun number
+}
+
+impl XrunLog {
+    fn new() -> Self {
+        Self {
+            count: AtomicU64::new(0),
+            timestamps: std::array::from_fn(|_| AtomicU64::new(0)),
+        }
+    }
+
+    pub fn record(&self) {
+        let xrun_number = self.count.fetch_add(1, Ordering::Relaxed);
+        self.timestamps[xrun_number as usize % XRUN_LOG_CAPACITY].store(milliseconds_since_epoch(), Ordering::Relaxed);
+    }
+
+    pub fn count(&self) -> u64 {
+        self.count.load(Ordering::Relaxed)
+    }
+
+    /// The timestamps of up to the last XRUN_LOG_CAPACITY xruns, oldest first.
+    pub fn recent(&self) -> Vec<u64> {
+        let count = self.count();
+        let first = count.saturating_sub(XRUN_LOG_CAPACITY as u64);
+        (first..count).map(|xrun_number| self.timestamps[xrun_number as usize % XRUN_LOG_CAPACITY].load(Ordering::Relaxed)).collect()
+    }
+}
+
+/// Process wide processing metrics - the jack callback, xruns and each track and its plugins. Recording never locks so
+/// it can be done from the jack and track processing threads, the track entries are only looked up when a track
+/// processing task starts.
+pub struct Telemetry {
+    pub jack_callback_time: Histogram, // nanoseconds per jack period
+    jack_period: AtomicU64,            // nanoseconds of audio in a jack period
+    pub xruns: XrunLog,
+    tracks: parking_lot::Mutex<HashMap<String, Arc<TrackTelemetry>>>,
+}
+
+impl Telemetry {
+    fn new() -> Self {
+        Self {
+            jack_callback_time: Histogram::new(),
+            jack_period: AtomicU64::new(0),
+            xruns: XrunLog::new(),
+            tracks: parking_lot::Mutex::new(HashMap::new()),
+        }
+    }
+
+    /// The track's entry - added if it doesn't have one yet.
+    pub fn track(&self, track_uuid: &str) -> Arc<TrackTelemetry> {
+        self.tracks.lock().entry(track_uuid.to_string()).or_insert_with(|| Arc::new(TrackTelemetry::new(track_uuid.to_string()))).clone()
+    }
+
+    /// The track's entry if it has one, without adding one.
+    pub fn find_track(&self, track_uuid: &str) -> Option<Arc<TrackTelemetry>> {
+        self.tracks.lock().get(track_uuid).cloned()
+    }
+
+    pub fn remove_track(&self, track_uuid: &str) {
+        self.tracks.lock().remove(track_uuid);
+    }
+
+    pub fn record_jack_callback(&self, elapsed: Duration, frames: u32, sample_rate: f64) {
+        self.jack_callback_time.record_duration(elapsed);
+        if sample_rate > 0.0 {
+            self.jack_period.store((frames as f64 / sample_rate * 1_000_000_000.0) as u64, Ordering::Relaxed);
+        }
+    }
+
+    /// Everything recorded so far with the track and plugin names taken from the project snapshot's tracks.
+    pub fn snapshot(&self, tracks: &[Arc<TrackSnapshot>]) -> TelemetrySnapshot {
+        let mut track_snapshots: Vec<TrackTelemetrySnapshot> = self.tracks.lock().values()
+            .map(|track_telemetry| track_telemetry.snapshot(tracks.iter().find(|track| track.uuid == track_telemetry.track_uuid)))
+            .collect();
+        // in the project's track order
+        track_snapshots.sort_by_key(|track_snapshot| tracks.iter().position(|track| track.uuid == track_snapshot.track_uuid).unwrap_or(usize::MAX));
+
+        TelemetrySnapshot {
+            timestamp: milliseconds_since_epoch(),
+            jack_callback_time: self.jack_callback_time.snapshot(),
+            jack_period: self.jack_period.load(Ordering::Relaxed),
+            xrun_count: self.xruns.count(),
+            recent_xruns: self.xruns.recent(),
+            tracks: track_snapshots,
+        }
+    }
+}
+
+/// The process wide telemetry - call once before the jack client is activated so the jack thread never creates it.
+pub fn telemetry() -> &'static Telemetry {
+    static TELEMETRY: OnceLock<Telemetry> = OnceLock::new();
+    TELEMETRY.get_or_init(Telemetry::new)
+}
+
+fn milliseconds_since_epoch() -> u64 {
+    SystemTime::now().duration_since(UNIX_EPOCH).map(|since_epoch| since_epoch.as_millis() as u64).unwrap_or(0)
+}
+
+#[derive(Clone, Serialize, Deserialize, Debug)]
+pub struct PluginTelemetrySnapshot {
+    pub plugin_uuid: String,
+    pub name: String,
+    pub process_time: HistogramSnapshot, // nanoseconds
+}
+
+#[derive(Clone, Serialize, Deserialize, Debug)]
+pub struct TrackTelemetrySnapshot {
+    pub track_uuid: String,
+    pub name: String,
+    pub block_time: HistogramSnapshot,       // nanoseconds
+    pub block_budget: u64,                   // nanoseconds
+    pub ring_buffer_fill: HistogramSnapshot, // frames
+    pub underruns: u64,
+    pub plugins: Vec<PluginTelemetrySnapshot>,
+}
+
+#[derive(Clone, Serialize, Deserialize, Debug)]
+pub struct TelemetrySnapshot {
+    pub timestamp: u64,                        // milliseconds since the unix epoch
+    pub jack_callback_time: HistogramSnapshot, // nanoseconds
+    pub jack_period: u64,                      // nanoseconds
+    pub xrun_count: u64,
+    pub recent_xruns: Vec<u64>,                // milliseconds since the unix epoch
+    pub tracks: Vec<TrackTelemetrySnapshot>,
+}
+
+impl TelemetrySnapshot {
+    pub fn to_json(&self) -> serde_json::Result<String> {
+        serde_json::to_string_pretty(self)
+    }
+
+    /// The snapshot in the prometheus text exposition format - times in seconds.
+    pub fn to_prometheus_text(&self) -> String {
+        let mut text = String::new();
+
+        write_prometheus_histogram(&mut text, "riff_daw_jack_callback_seconds", "Time taken by the jack process callback.", &[("", &self.jack_callback_time)], 1.0e-9);
+        write_prometheus_gauge(&mut text, "riff_daw_jack_period_seconds", "Length of a jack period.", &[("", self.jack_period as f64 * 1.0e-9)]);
+        let _ = writeln!(text, "# HELP riff_daw_xruns_total Number of jack xruns.\n# TYPE riff_daw_xruns_total counter\nriff_daw_xruns_total {}", self.xrun_count);
+
+        let track_labels: Vec<String> = self.tracks.iter().map(|track| format!("track=\"{}\",track_uuid=\"{}\"", escape_label_value(&track.name), track.track_uuid)).collect();
+        let block_times: Vec<(&str, &HistogramSnapshot)> = self.tracks.iter().zip(track_labels.iter()).map(|(track, labels)| (labels.as_str(), &track.block_time)).collect();
+        write_prometheus_histogram(&mut text, "riff_daw_track_block_seconds", "Time taken to process a block of a track.", &block_times, 1.0e-9);
+        let ring_buffer_fills: Vec<(&str, &HistogramSnapshot)> = self.tracks.iter().zip(track_labels.iter()).map(|(track, labels)| (labels.as_str(), &track.ring_buffer_fill)).collect();
+        write_prometheus_histogram(&mut text, "riff_daw_track_ring_buffer_fill_frames", "Frames queued for the audio layer after a track block.", &ring_buffer_fills, 1.0);
+        let block_budgets: Vec<(&str, f64)> = self.tracks.iter().zip(track_labels.iter()).map(|(track, labels)| (labels.as_str(), track.block_budget as f64 * 1.0e-9)).collect();
+        write_prometheus_gauge(&mut text, "riff_daw_track_block_budget_seconds", "Length of the audio in a track block.", &block_budgets);
+        let _ = writeln!(text, "# HELP riff_daw_track_underruns_total Jack periods where a track had too little audio ready.\n# TYPE riff_daw_track_underruns_total counter");
+        for (track, labels) in self.tracks.iter().zip(track_labels.iter()) {
+            let _ = writeln!(text, "riff_daw_track_underruns_total{{{}}} {}", labels, track.underruns);
+        }
+
+        let plugin_labels: Vec<String> = self.tracks.iter().zip(track_labels.iter())
+            .flat_map(|(track, labels)| track.plugins.iter().map(move |plugin| format!("{},plugin=\"{}\",plugin_uuid=\"{}\"", labels, escape_label_value(&plugin.name), plugin.plugin_uuid)))
+            .collect();
+        let process_times: Vec<(&str, &HistogramSnapshot)> = self.tracks.iter().flat_map(|track| track.plugins.iter())
+            .zip(plugin_labels.iter())
+            .map(|(plugin, labels)| (labels.as_str(), &plugin.process_time))
+            .collect();
+        write_prometheus_histogram(&mut text, "riff_daw_plugin_process_seconds", "Time taken by a plugin to process a block.", &process_times, 1.0e-9);
+
+        text
+    }
+}
+
+/// Writes a histogram family - each series is its labels and histogram, with the recorded values multiplied by scale.
+fn write_prometheus_histogram(text: &mut String, name: &str, help: &str, series: &[(&str, &HistogramSnapshot)], scale: f64) {
+    let _ = writeln!(text, "# HELP {} {}\n# TYPE {} histogram", name, help, name);
+    for (labels, histogram) in series.iter() {
+        let separator = if labels.is_empty() { "" } else { "," };
+        let mut cumulative_count = 0;
+        for (bucket, count) in histogram.buckets.iter().enumerate().take(HISTOGRAM_BUCKETS - 1) {
+            cumulative_count += count;
+            let _ = writeln!(text, "{}_bucket{{{}{}le=\"{}\"}} {}", name, labels, separator, bucket_upper_bound(bucket) as f64 * scale, cumulative_count);
+        }
+        let _ = writeln!(text, "{}_bucket{{{}{}le=\"+Inf\"}} {}", name, labels, separator, histogram.count);
+        let braced_labels = if labels.is_empty() { "".to_string() } else { format!("{{{}}}", labels) };
+        let _ = writeln!(text, "{}_sum{} {}", name, braced_labels, histogram.sum as f64 * scale);
+        let _ = writeln!(text, "{}_count{} {}", name, braced_labels, histogram.count);
+    }
+}
+
+fn write_prometheus_gauge(text: &mut String, name: &str, help: &str, series: &[(&str, f64)]) {
+    let _ = writeln!(text, "# HELP {} {}\n# TYPE {} gauge", name, help, name);
+    for (labels, value) in series.iter() {
+        if labels.is_empty() {
+            let _ = writeln!(text, "{} {}", name, value);
+        }
+        else {
+            let _ = writeln!(text, "{}{{{}}} {}", name, labels, value);
+        }
+    }
+}
+
+fn escape_label_value(value: &str) -> String {
+    value.replace('\\', "\\\\").replace('"', "\\\"").replace('\n', "\\n")
+}
+
+/// Where and how often the telemetry is written out - a path ending in .prom gets the prometheus text format (for the
+/// node exporter's textfile collector), anything else gets json. Not exported when there is no path.
+#[derive(Clone, Serialize, Deserialize)]
+pub struct TelemetryConfiguration {
+    #[serde(default)]
+    pub export_path: Option<String>,
+    #[serde(default = "TelemetryConfiguration::default_export_interval_in_seconds")]
+    pub export_interval_in_seconds: u64,
+}
+
+impl TelemetryConfiguration {
+    fn default_export_interval_in_seconds() -> u64 {
+        DEFAULT_TELEMETRY_EXPORT_INTERVAL_IN_SECONDS
+    }
+}
+
+impl Default for TelemetryConfiguration {
+    fn default() -> Self {
+        Self {
+            export_path: None,
+            export_interval_in_seconds: DEFAULT_TELEMETRY_EXPORT_INTERVAL_IN_SECONDS,
+        }
+    }
+}
+
+/// Write the snapshot to the path in the format its extension asks for. The file is written alongside and renamed
+/// into place so a reader never sees half of it.
+pub fn export_telemetry(snapshot: &TelemetrySnapshot, path: &str) -> std::io::Result<()> {
+    let path = PathBuf::from(path);
+    let text = if path.extension().map_or(false, |extension| extension == "prom") {
+        snapshot.to_prometheus_text()
+    }
+    else {
+        snapshot.to_json().map_err(|error| std::io::Error::new(std::io::ErrorKind::InvalidData, error))?
+    };
+
+    let mut temporary_path = path.clone().into_os_string();
+    temporary_path.push(".tmp");
+    std::fs::write(&temporary_path, text)?;
+    std::fs::rename(&temporary_path, &path)
+}
+
+#[cfg(test)]
+mod tests {
+    use std::sync::Arc;
+    use std::time::Duration;
+
+    use uuid::Uuid;
+
+    use crate::project_snapshot::TrackSnapshot;
+    use crate::telemetry::{Histogram, Telemetry, TrackTelemetryRecorder};
+
+    #[test]
+    fn histogram_quantiles_are_bounded_by_their_buckets() {
+        let histogram = Histogram::new();
+        for value in 1..=100 {
+            histogram.record(value);
+        }
+        histogram.record(10_000);
+
+        let snapshot = histogram.snapshot();
+        assert_eq!(101, snapshot.count);
+        assert_eq!(10_000, snapshot.max);
+        assert_eq!(5050 + 10_000, snapshot.sum);
+        // 50 is in the 32..63 bucket, 100 in the 64..127 bucket
+        assert_eq!(63, snapshot.quantile(0.5));
+        assert_eq!(127, snapshot.quantile(0.99));
+        assert_eq!(10_000, snapshot.quantile(1.0));
+    }
+
+    #[test]
+    fn snapshot_names_tracks_and_plugins_and_exports() {
+        let telemetry = Telemetry::new();
+        let track_uuid = Uuid::new_v4().to_string();
+        let plugin_uuid = Uuid::new_v4();
+        let track_telemetry = telemetry.track(track_uuid.as_str());
+        track_telemetry.record_block(Duration::from_micros(500), 1024, 44100.0);
+        track_telemetry.plugin(plugin_uuid).process_time.record_duration(Duration::from_micros(400));
+        track_telemetry.underruns.fetch_add(2, std::sync::atomic::Ordering::Relaxed);
+        telemetry.xruns.record();
+        assert!(track_telemetry.load() > 0.0 && track_telemetry.load() < track_telemetry.peak_load());
+
+        let tracks = vec![Arc::new(TrackSnapshot {
+            revision: 0,
+            uuid: track_uuid.clone(),
+            name: "Bass \"sub\"".to_string(),
+            colour: (0.0, 0.0, 0.0, 1.0),
+            riffs: vec![],
+            riff_refs: vec![],
+            automation: vec![],
+            plugins: vec![(plugin_uuid.to_string(), "Synth".to_string())],
+            audio_routing_destinations: vec![],
+            midi_routing_destinations: vec![],
+        })];
+        let snapshot = telemetry.snapshot(&tracks);
+        assert_eq!(1, snapshot.xrun_count);
+        assert_eq!(1, snapshot.recent_xruns.len());
+        assert_eq!("Synth", snapshot.tracks[0].plugins[0].name);
+        assert_eq!(2, snapshot.tracks[0].underruns);
+
+        let prometheus_text = snapshot.to_prometheus_text();
+        assert!(prometheus_text.contains(format!("riff_daw_track_underruns_total{{track=\"Bass \\\"sub\\\"\",track_uuid=\"{}\"}} 2", track_uuid).as_str()));
+        assert!(prometheus_text.contains("riff_daw_plugin_process_seconds_count{"));
+        assert!(prometheus_text.contains("riff_daw_xruns_total 1"));
+        assert!(snapshot.to_json().unwrap().contains("\"Synth\""));
+    }
+
+    #[test]
+    fn recorder_only_records_plugins_added_to_it() {
+        let track_uuid = Uuid::new_v4().to_string();
+        let plugin_uuid = Uuid::new_v4();
+        let mut recorder = TrackTelemetryRecorder::new(track_uuid.as_str());
+        recorder.record_plugin(plugin_uuid, Duration::from_micros(100));
+        assert!(recorder.track().plugins.lock().is_empty());
+
+        recorder.add_plugin(plugin_uuid);
+        recorder.add_plugin(plugin_uuid);
+        recorder.record_plugin(plugin_uuid, Duration::from_micros(100));
+        recorder.record_plugin(plugin_uuid, Duration::from_micros(200));
+        assert_eq!(1, recorder.track().plugins.lock().len());
+        assert_eq!(2, recorder.track().plugin(plugin_uuid).process_time.snapshot().count);
+
+        recorder.remove_plugin(plugin_uuid);
+        assert!(recorder.track().plugins.lock().is_empty());
+    }
+}
@@ -72,6 +72,7 @@ pub struct Ui {
     pub menu_item_export_midi: MenuItem,
     pub menu_item_export_midi_riffs: MenuItem,
     pub menu_item_export_wave: MenuItem,
+    pub menu_item_export_stems: MenuItem,
     pub menu_item_quit: MenuItem,
 
     // edit menu
@@ -380,6 +381,7 @@ pub struct TrackPanel {
     pub record_toggle_btn: ToggleButton,
     pub track_instrument_window_visibility_toggle_btn: Button,
     pub track_panel_copy_track_button: Button,
+    pub freeze_toggle_btn: ToggleButton,
 }
 
 #[derive(Gladis, Clone)]
@@ -437,6 +439,7 @@ pub struct MixerBlade {
     pub mixer_blade_right_channel_level_spin_button: SpinButton,
     pub mixer_blade_left_channel_level_spin_button: SpinButton,
     pub mixer_blade_channel_level_drawing_area: DrawingArea,
+    pub mixer_blade_dsp_load_label: Label,
 }
 
 #[derive(Gladis, Clone)]
@@ -1470,9 +1473,11 @@ impl MainWindow {
         match general_track_type {
             GeneralTrackType::AudioTrack => {
                 track_panel.track_instrument_window_visibility_toggle_btn.set_sensitive(false);
+                track_panel.freeze_toggle_btn.set_sensitive(false);
             }
             GeneralTrackType::MidiTrack => {
                 track_panel.track_instrument_window_visibility_toggle_btn.set_sensitive(false);
+                track_panel.freeze_toggle_btn.set_sensitive(false);
             }
             _ => {}
         }
@@ -1595,6 +1600,17 @@ impl MainWindow {
             });
         }
 
+        {
+            let tx_from_ui = tx_from_ui.clone();
+            track_panel.freeze_toggle_btn.connect_clicked(move |freeze_toggle_btn| {
+                let track_change_type = if freeze_toggle_btn.is_active() { TrackChangeType::Freeze } else { TrackChangeType::Unfreeze };
+                match tx_from_ui.send(DAWEvents::TrackChange(track_change_type, Some(track_uuid.to_string()))) {
+                    Err(_) => info!("Problem sending message with tx from ui lock when freezing track"),
+                    _ => (),
+                }
+            });
+        }
+
         (track_panel.track_name_text_ctrl.buffer(),
         track_panel.mute_toggle_btn,
         track_panel.solo_toggle_btn)
@@ -1615,6 +1631,9 @@ impl MainWindow {
         riff_set_track_panel.track_panel.set_widget_name(track_uuid.to_string().as_str());
 
         let track_panel: Frame = riff_set_track_panel.track_panel.clone();
+        // tracks are frozen from the track view
+        riff_set_track_panel.freeze_toggle_btn.set_no_show_all(true);
+        riff_set_track_panel.freeze_toggle_btn.set_visible(false);
         track_panel.set_height_request(RIFF_SET_VIEW_TRACK_PANEL_HEIGHT);
 
         self.ui.riff_sets_track_panel.pack_start(&riff_set_track_panel.track_panel, false, false, 0);
@@ -1718,6 +1737,9 @@ impl MainWindow {
             info!("First delete button clicked.");
         });
         let track_panel: Frame = riff_sequence_track_panel.track_panel.clone();
+        // tracks are frozen from the track view
+        riff_sequence_track_panel.freeze_toggle_btn.set_no_show_all(true);
+        riff_sequence_track_panel.freeze_toggle_btn.set_visible(false);
         track_panel.set_height_request(RIFF_SEQUENCE_VIEW_TRACK_PANEL_HEIGHT);
         self.ui.riff_sequences_track_panel.pack_start(&riff_sequence_track_panel.track_panel, false, false, 0);
         let track_number_label_txt = format!("   {}", self.ui.riff_sequences_track_panel.children().len());
@@ -1824,6 +1846,9 @@ impl MainWindow {
             info!("First delete button clicked.");
         });
         let track_panel: Frame = riff_arrangement_track_panel.track_panel.clone();
+        // tracks are frozen from the track view
+        riff_arrangement_track_panel.freeze_toggle_btn.set_no_show_all(true);
+        riff_arrangement_track_panel.freeze_toggle_btn.set_visible(false);
         track_panel.set_height_request(RIFF_ARRANGEMENT_VIEW_TRACK_PANEL_HEIGHT);
         self.ui.riff_arrangement_track_panel.pack_start(&riff_arrangement_track_panel.track_panel, false, true, 0);
         let track_number_label_txt = format!("   {}", self.ui.riff_arrangement_track_panel.children().len());
@@ -2880,6 +2905,35 @@ impl MainWindow {
         track_audio_routing_dialogue
     }
 
+    /// Ask for a file name to save the project as and send SaveAs with it.
+    pub fn run_save_as_dialogue(window: &ApplicationWindow, tx_from_ui: &crossbeam_channel::Sender<DAWEvents>, suggested_path: Option<&str>) {
+        let dialog = FileChooserDialog::new(Some("DAW save as project file"),     Some(window), FileChooserAction::Save);
+        let filter = FileFilter::new();
+        filter.set_name(Some("DAW project file"));
+        filter.add_pattern("*.fdaw");
+        dialog.add_filter(&filter);
+        let json_filter = FileFilter::new();
+        json_filter.add_mime_type("application/json");
+        json_filter.set_name(Some("DAW project file (json)"));
+        json_filter.add_pattern("*.json");
+        dialog.add_filter(&json_filter);
+        dialog.add_button("Cancel", gtk::ResponseType::Cancel);
+        dialog.add_button("Ok", gtk::ResponseType::Ok);
+        if let Some(suggested_path) = suggested_path {
+            dialog.set_filename(suggested_path);
+        }
+        let result = dialog.run();
+        if result == gtk::ResponseType::Ok {
+            if let Some(filename) = dialog.filename() {
+                if let Some(filename_display) = filename.to_str() {
+                    window.set_title(format!("DAW - {}", filename_display).as_str());
+                }
+                let _ = tx_from_ui.send(DAWEvents::SaveAs(filename));
+            }
+        }
+        dialog.hide();
+    }
+
     pub fn setup_menus(
         &mut self,
         tx_from_ui: crossbeam_channel::Sender<DAWEvents>,
@@ -2901,10 +2955,14 @@ impl MainWindow {
             self.ui.menu_item_open.connect_button_press_event(move |_, _|{
                 let dialog = FileChooserDialog::new(Some("DAW project file"),     Some(&window), FileChooserAction::Open);
                 let filter = FileFilter::new();
-                filter.add_mime_type("application/json");
                 filter.set_name(Some("DAW project file"));
                 filter.add_pattern("*.fdaw");
                 dialog.add_filter(&filter);
+                let json_filter = FileFilter::new();
+                json_filter.add_mime_type("application/json");
+                json_filter.set_name(Some("DAW project file (json)"));
+                json_filter.add_pattern("*.json");
+                dialog.add_filter(&json_filter);
                 dialog.add_button("Cancel", gtk::ResponseType::Cancel);
                 dialog.add_button("Ok", gtk::ResponseType::Ok);
                 let result = dialog.run();
@@ -2936,24 +2994,7 @@ impl MainWindow {
             let window = self.ui.get_wnd_main().clone();
             self.ui.menu_item_save_as.connect_button_press_event(move |_menu_item, _btn| {
                 info!("Menu item save as clicked!");
-                let dialog = FileChooserDialog::new(Some("DAW save as project file"),     Some(&window), FileChooserAction::Save);
-                let filter = FileFilter::new();
-                filter.add_mime_type("application/json");
-                filter.set_name(Some("DAW project file"));
-                filter.add_pattern("*.fdaw");
-                dialog.add_filter(&filter);
-                dialog.add_button("Cancel", gtk::ResponseType::Cancel);
-                dialog.add_button("Ok", gtk::ResponseType::Ok);
-                let result = dialog.run();
-                if result == gtk::ResponseType::Ok {
-                    if let Some(filename) = dialog.filename() {
-                        if let Some(filename_display) = filename.to_str() {
-                            window.set_title(format!("DAW - {}", filename_display).as_str());
-                        }
-                        let _ = tx_from_ui.send(DAWEvents::SaveAs(filename));
-                    }
-                }
-                dialog.hide();
+                MainWindow::run_save_as_dialogue(&window, &tx_from_ui, None);
 
                 Inhibit(true)
             });
@@ -3028,6 +3069,25 @@ impl MainWindow {
             });
         }
 
+        {
+            let tx_from_ui = tx_from_ui.clone();
+            let window = self.ui.get_wnd_main().clone();
+            self.ui.menu_item_export_stems.connect_button_press_event(move |_menu_item, _btn|{
+                let dialog = FileChooserDialog::new(Some("Export stems to folder..."),     Some(&window), FileChooserAction::SelectFolder);
+                dialog.add_button("Cancel", gtk::ResponseType::Cancel);
+                dialog.add_button("Ok", gtk::ResponseType::Ok);
+                let result = dialog.run();
+                if result == gtk::ResponseType::Ok {
+                    if let Some(directory) = dialog.filename() {
+                        let _ = tx_from_ui.send(DAWEvents::ExportStems(directory));
+                    }
+                }
+                dialog.hide();
+
+                Inhibit(true)
+            });
+        }
+
         {
             let tx_from_ui = tx_from_ui;
             let window = self.ui.get_wnd_main().clone();
@@ -3302,7 +3362,11 @@ impl MainWindow {
         let event_sender = std::boxed::Box::new(|original_riff: Riff, changed_riff: Riff, track_uuid: String, tx_from_ui: Sender<DAWEvents>| {
             let _ = tx_from_ui.send(DAWEvents::TrackChange(TrackChangeType::RiffReferenceChange(original_riff, changed_riff), Some(track_uuid)));
         });
-        let track_grid_custom_painter = TrackGridCustomPainter::new_with_edit_item_handler(state.clone(), EditItemHandler::new(event_sender));
+        let (project_snapshot, waveform_peak_cache) = match state.lock() {
+            Ok(state) => (state.project_snapshot(), Some(state.waveform_peak_cache())),
+            Err(_) => (Arc::default(), None),
+        };
+        let track_grid_custom_painter = TrackGridCustomPainter::new_with_edit_item_handler(project_snapshot, waveform_peak_cache, EditItemHandler::new(event_sender));
         let track_grid = BeatGrid::new_with_custom(
             0.04,
             1.0,
@@ -4572,7 +4636,8 @@ impl MainWindow {
             let event_sender = std::boxed::Box::new(|original_note: Note, changed_note: Note, track_uuid: String, tx_from_ui: Sender<DAWEvents>| {
                     let _ = tx_from_ui.send(DAWEvents::TrackChange(TrackChangeType::RiffEventChange(TrackEvent::Note(original_note), TrackEvent::Note(changed_note)), Some(track_uuid)));
             });
-            let piano_roll_custom_painter: PianoRollCustomPainter = PianoRollCustomPainter::new_with_edit_item_handler(state.clone(), EditItemHandler::new(event_sender));
+            let project_snapshot = state.lock().map(|state| state.project_snapshot()).unwrap_or_default();
+            let piano_roll_custom_painter: PianoRollCustomPainter = PianoRollCustomPainter::new_with_edit_item_handler(project_snapshot, EditItemHandler::new(event_sender));
             let piano_roll_custom_vertical_scale_painter = PianoRollVerticalScaleCustomPainter::new(state);
             let piano_roll_grid = BeatGrid::new_with_painters(
                 2.0,
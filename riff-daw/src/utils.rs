@@ -1,11 +1,12 @@
 use std::cmp::Ordering;
 use std::sync::{Arc, Mutex};
 
-use clap_sys::events::{CLAP_CORE_EVENT_SPACE_ID, clap_event_header, CLAP_EVENT_MIDI, clap_event_midi, clap_event_note, clap_event_note_expression, CLAP_EVENT_NOTE_EXPRESSION, CLAP_EVENT_NOTE_OFF, CLAP_EVENT_NOTE_ON, CLAP_NOTE_EXPRESSION_BRIGHTNESS, CLAP_NOTE_EXPRESSION_EXPRESSION, CLAP_NOTE_EXPRESSION_PAN, CLAP_NOTE_EXPRESSION_PRESSURE, CLAP_NOTE_EXPRESSION_TUNING, CLAP_NOTE_EXPRESSION_VIBRATO, CLAP_NOTE_EXPRESSION_VOLUME};
+use clap_sys::events::{CLAP_CORE_EVENT_SPACE_ID, clap_event_header, CLAP_EVENT_MIDI, clap_event_midi, clap_event_note, clap_event_note_expression, CLAP_EVENT_NOTE_EXPRESSION, CLAP_EVENT_NOTE_OFF, CLAP_EVENT_NOTE_ON, CLAP_EVENT_PARAM_VALUE, clap_event_param_value, CLAP_NOTE_EXPRESSION_BRIGHTNESS, CLAP_NOTE_EXPRESSION_EXPRESSION, CLAP_NOTE_EXPRESSION_PAN, CLAP_NOTE_EXPRESSION_PRESSURE, CLAP_NOTE_EXPRESSION_TUNING, CLAP_NOTE_EXPRESSION_VIBRATO, CLAP_NOTE_EXPRESSION_VOLUME};
 use vst::event::*;
 
-use crate::domain::{AudioRouting, AudioRoutingNodeType, Controller, DAWItemPosition, Measure, NoteOff, NoteOn, PitchBend, PluginParameter, Riff, RiffItemType, RiffReference, Track, TrackEvent, TrackEventRouting, TrackEventRoutingNodeType, DAWItemLength};
+use crate::domain::{AudioRouting, AudioRoutingNodeType, Controller, DAWItemPosition, EventBlocks, Measure, NoteOff, NoteOn, PitchBend, PluginParameter, Riff, RiffItemType, RiffReference, Track, TrackEvent, TrackEventRouting, TrackEventRoutingNodeType, DAWItemLength};
 use crate::DAWState;
+use crate::id_interner::UuidIndex;
 
 pub struct DAWUtils;
 
@@ -142,7 +143,7 @@ impl DAWUtils {
         sample_rate: f64,
         passage_length_in_beats: f64,
         midi_channel: i32,
-    ) -> (Vec<Vec<TrackEvent>>, Vec<Vec<PluginParameter>>) {
+    ) -> (EventBlocks<TrackEvent>, EventBlocks<PluginParameter>) {
         // TODO need to make sure that this doesn't cross over into the next measure
         // let passage_length_in_frames = passage_length_in_beats / bpm * 60.0 * sample_rate - 1024.0; 
         let passage_length_in_frames = passage_length_in_beats / bpm * 60.0 * sample_rate; 
@@ -151,36 +152,130 @@ impl DAWUtils {
 
         let mut track_events: Vec<TrackEvent> = Self::extract_riff_ref_events(riffs, riff_refs, bpm, sample_rate, midi_channel);
         println!("Number of riff ref events extracted for track: {}", track_events.len());
-        let plugin_parameter_events = Self::convert_automation_events(automation, bpm, sample_rate, &mut track_events, midi_channel);
+        let mut plugin_parameter_events = Self::convert_automation_events(automation, bpm, sample_rate, &mut track_events, midi_channel);
 
-        let event_blocks = Self::create_track_event_blocks(block_size_in_samples, passage_length_in_frames, &mut track_events);
-        let param_event_blocks = Self::create_plugin_parameter_blocks(block_size_in_samples, passage_length_in_frames, &plugin_parameter_events);
+        let number_of_blocks = Self::number_of_blocks(block_size_in_samples, passage_length_in_frames);
+        let event_blocks = Self::create_track_event_blocks(block_size_in_samples, 0, number_of_blocks, &mut track_events);
+        let param_event_blocks = Self::create_plugin_parameter_blocks(block_size_in_samples, 0, number_of_blocks, &mut plugin_parameter_events);
 
         (event_blocks, param_event_blocks)
     }
 
-    fn create_plugin_parameter_blocks(block_size_in_samples: f64, passage_length_in_frames: f64, plugin_parameter_events: &Vec<PluginParameter>) -> Vec<Vec<PluginParameter>> {
-        let mut param_event_blocks = vec![];
-        for current_start_frame in (0..passage_length_in_frames as i32).step_by(block_size_in_samples as usize) {
-            let mut param_event_block: Vec<PluginParameter> = Vec::new();
-            let current_end_frame = current_start_frame + block_size_in_samples as i32;
+    /// Converts just the blocks in start_block..end_block. Only the riff refs that can have events inside the range are extracted.
+    /// Returns blocks suitable for patching into a full set of event blocks via EventBlocks::replace_blocks.
+    pub fn convert_to_event_blocks_for_block_range(
+        automation: &Vec<TrackEvent>,
+        riffs: &Vec<Riff>,
+        riff_refs: &Vec<RiffReference>,
+        bpm: f64,
+        block_size_in_samples: f64,
+        sample_rate: f64,
+        start_block: usize,
+        end_block: usize,
+        midi_channel: i32,
+    ) -> (EventBlocks<TrackEvent>, EventBlocks<PluginParameter>) {
+        let number_of_blocks = if end_block > start_block { end_block - start_block } else { 0 };
+        let range_start_frame = start_block as f64 * block_size_in_samples;
+        let range_end_frame = end_block as f64 * block_size_in_samples;
+
+        let riffs_by_uuid = UuidIndex::new(riffs.iter().map(|riff| (riff.uuid(), riff)));
+        let overlapping_riff_refs: Vec<RiffReference> = riff_refs.iter().filter(|riff_ref| {
+            if let Some(riff) = riffs_by_uuid.get_str(riff_ref.linked_to_str()) {
+                let riff_ref_start_frame = riff_ref.position() / bpm * 60.0 * sample_rate;
+                let riff_ref_end_frame = (riff_ref.position() + Self::riff_extent_in_beats(riff)) / bpm * 60.0 * sample_rate;
+                riff_ref_start_frame < range_end_frame && riff_ref_end_frame >= range_start_frame
+            }
+            else {
+                false
+            }
+        }).cloned().collect();
 
-            // loop through param events
-            // only start processing when events are in range
-            for event in plugin_parameter_events.iter() {
-                let absolute_position_in_frames = event.position() as i32;
-                if current_start_frame <= absolute_position_in_frames && absolute_position_in_frames < current_end_frame {
-                    param_event_block.push(event.clone());
-                }
+        let mut track_events: Vec<TrackEvent> = Self::extract_riff_ref_events(riffs, &overlapping_riff_refs, bpm, sample_rate, midi_channel);
+        let mut plugin_parameter_events = Self::convert_automation_events(automation, bpm, sample_rate, &mut track_events, midi_channel);
 
-                if absolute_position_in_frames >= current_end_frame {
-                    break;
+        let event_blocks = Self::create_track_event_blocks(block_size_in_samples, start_block, number_of_blocks, &mut track_events);
+        let param_event_blocks = Self::create_plugin_parameter_blocks(block_size_in_samples, start_block, number_of_blocks, &mut plugin_parameter_events);
+
+        (event_blocks, param_event_blocks)
+    }
+
+    /// Works out which blocks the riff refs linked to the given riff cover before and after an edit - the riff's extent
+    /// before the edit is passed in as the riff is already edited - so that blocks an edit that shortened the riff no
+    /// longer reaches are rebuilt too. Overlapping and adjacent ranges are merged. Each range is start block inclusive,
+    /// end block exclusive and clamped to number_of_blocks.
+    pub fn get_riff_dirty_block_ranges(riff: &Riff, pre_edit_extent_in_beats: f64, riff_refs: &Vec<RiffReference>, bpm: f64, block_size_in_samples: f64, sample_rate: f64, number_of_blocks: usize) -> Vec<(usize, usize)> {
+        let extent_in_beats = Self::riff_extent_in_beats(riff).max(pre_edit_extent_in_beats);
+        Self::get_riff_range_dirty_block_ranges(riff.uuid().to_string(), (0.0, extent_in_beats), riff_refs, bpm, block_size_in_samples, sample_rate, number_of_blocks)
+    }
+
+    /// As get_riff_dirty_block_ranges but only for the part of the riff between the given start and end in beats - an
+    /// edit that touched a few notes only needs the blocks those notes play in rebuilt.
+    pub fn get_riff_range_dirty_block_ranges(riff_uuid: String, changed_range_in_beats: (f64, f64), riff_refs: &Vec<RiffReference>, bpm: f64, block_size_in_samples: f64, sample_rate: f64, number_of_blocks: usize) -> Vec<(usize, usize)> {
+        let (changed_start_in_beats, changed_end_in_beats) = changed_range_in_beats;
+        let mut dirty_block_ranges: Vec<(usize, usize)> = riff_refs.iter()
+            .filter(|riff_ref| riff_ref.linked_to_str() == riff_uuid)
+            .map(|riff_ref| {
+                let start_frame = ((riff_ref.position() + changed_start_in_beats) / bpm * 60.0 * sample_rate).max(0.0);
+                let end_frame = ((riff_ref.position() + changed_end_in_beats) / bpm * 60.0 * sample_rate).max(0.0);
+                let start_block = ((start_frame / block_size_in_samples) as usize).min(number_of_blocks);
+                let end_block = ((end_frame / block_size_in_samples) as usize + 1).min(number_of_blocks);
+                (start_block, end_block)
+            })
+            .filter(|(start_block, end_block)| start_block < end_block)
+            .collect();
+
+        dirty_block_ranges.sort_by_key(|(start_block, _)| *start_block);
+
+        let mut merged_block_ranges: Vec<(usize, usize)> = vec![];
+        for (start_block, end_block) in dirty_block_ranges {
+            if let Some(last_range) = merged_block_ranges.last_mut() {
+                if start_block <= last_range.1 {
+                    last_range.1 = last_range.1.max(end_block);
+                    continue;
                 }
             }
+            merged_block_ranges.push((start_block, end_block));
+        }
+        merged_block_ranges
+    }
+
+    /// The length of the riff or the end of its last event, whichever is later, in beats.
+    pub fn riff_extent_in_beats(riff: &Riff) -> f64 {
+        let mut extent = riff.length();
+        for event in riff.events().iter() {
+            let event_end = if let TrackEvent::Note(note) = event {
+                note.position() + note.length()
+            }
+            else {
+                event.position()
+            };
+            if event_end > extent {
+                extent = event_end;
+            }
+        }
+        extent
+    }
+
+    /// The block that a position in beats falls in.
+    pub fn block_number_at_beat(position_in_beats: f64, bpm: f64, sample_rate: f64, block_size: f64) -> i32 {
+        (position_in_beats / bpm * 60.0 * sample_rate / block_size) as i32
+    }
 
-            param_event_blocks.push(param_event_block);
+    /// The number of blocks needed to cover the passage - a partial block at the end counts as a whole one.
+    pub fn number_of_blocks(block_size_in_samples: f64, passage_length_in_frames: f64) -> usize {
+        let block_size = block_size_in_samples as i32;
+        let passage_length = passage_length_in_frames as i32;
+        if block_size > 0 && passage_length > 0 {
+            ((passage_length - 1) / block_size + 1) as usize
+        }
+        else {
+            0
         }
-        param_event_blocks
+    }
+
+    fn create_plugin_parameter_blocks(block_size_in_samples: f64, start_block: usize, number_of_blocks: usize, plugin_parameter_events: &mut Vec<PluginParameter>) -> EventBlocks<PluginParameter> {
+        // plugin parameter positions stay absolute
+        Self::create_event_blocks(block_size_in_samples, start_block, number_of_blocks, plugin_parameter_events, false)
     }
 
     fn create_midi_event_blocks(block_size_in_samples: f64, passage_length_in_frames: f64, midi_events: &mut Vec<MidiEvent>) -> Vec<Vec<MidiEvent>> {
@@ -210,33 +305,47 @@ impl DAWUtils {
         event_blocks
     }
 
-    fn create_track_event_blocks(block_size_in_samples: f64, passage_length_in_frames: f64, track_events: &mut Vec<TrackEvent>) -> Vec<Vec<TrackEvent>> {
-        let mut event_blocks = vec![];
-        for current_start_frame in (0..passage_length_in_frames as i32).step_by(block_size_in_samples as usize) {
-            let mut event_block: Vec<TrackEvent> = Vec::new();
-            let current_end_frame = current_start_frame + block_size_in_samples as i32;
+    fn create_track_event_blocks(block_size_in_samples: f64, start_block: usize, number_of_blocks: usize, track_events: &mut Vec<TrackEvent>) -> EventBlocks<TrackEvent> {
+        // adjust the delta frames back from absolute frames to block relative delta frames
+        Self::create_event_blocks(block_size_in_samples, start_block, number_of_blocks, track_events, true)
+    }
 
-            // loop through events
-            // only start processing when events are in range
-            // adjust the delta frames back from absolute frames to block relative delta frames
-            for event in track_events.iter() {
-                let absolute_delta_frames = event.position() as i32;
-                // println!("create_track_event_blocks: event position={}, current_start_frame={}, current_end_frame={}", event.position(), current_start_frame, current_end_frame);
-                if current_start_frame <= absolute_delta_frames && absolute_delta_frames < current_end_frame {
-                    let mut adjusted_event = event.clone();
-                    adjusted_event.set_position((absolute_delta_frames - current_start_frame) as f64);
-                    event_block.push(adjusted_event);
-                }
+    /// Sorts the events by position once and then buckets them into blocks in a single linear sweep.
+    /// Blocks start at start_block and events positioned outside of the blocks are dropped.
+    fn create_event_blocks<T: DAWItemPosition + Clone>(block_size_in_samples: f64, start_block: usize, number_of_blocks: usize, events: &mut Vec<T>, block_relative_positions: bool) -> EventBlocks<T> {
+        let block_size = block_size_in_samples as i32;
 
+        // stable sort so events at the same position keep their relative order
+        events.sort_by(|a, b| a.position().partial_cmp(&b.position()).unwrap_or(Ordering::Equal));
+
+        let mut blocked_events: Vec<T> = Vec::with_capacity(events.len());
+        let mut block_ranges: Vec<(usize, usize)> = Vec::with_capacity(number_of_blocks);
+        let mut event_iterator = events.iter().peekable();
+
+        for block_number in start_block..(start_block + number_of_blocks) {
+            let current_start_frame = block_number as i32 * block_size;
+            let current_end_frame = current_start_frame + block_size;
+            let block_start = blocked_events.len();
+
+            while let Some(event) = event_iterator.peek() {
+                let absolute_delta_frames = event.position() as i32;
                 if absolute_delta_frames >= current_end_frame {
                     break;
                 }
+                if current_start_frame <= absolute_delta_frames {
+                    let mut adjusted_event = (*event).clone();
+                    if block_relative_positions {
+                        adjusted_event.set_position((absolute_delta_frames - current_start_frame) as f64);
+                    }
+                    blocked_events.push(adjusted_event);
+                }
+                event_iterator.next();
             }
 
-            // println!("Created track event block length: {}", event_block.len());
-            event_blocks.push(event_block);
+            block_ranges.push((block_start, blocked_events.len()));
         }
-        event_blocks
+
+        EventBlocks::new(blocked_events, block_ranges)
     }
 
     fn convert_automation_events_to_vst(automation: &Vec<TrackEvent>, bpm: f64, sample_rate: f64, events_all: &mut Vec<MidiEvent>, midi_channel: i32) -> Vec<PluginParameter> {
@@ -656,47 +765,69 @@ impl DAWUtils {
         events_all
     }
 
-    fn extract_riff_ref_events(riffs: &Vec<Riff>, riff_refs: &Vec<RiffReference>, bpm: f64, sample_rate: f64, _midi_channel: i32) -> Vec<TrackEvent> {
-        let mut events_all: Vec<TrackEvent> = Vec::new();
+    /// Plugin parameter changes positioned in frames from the start of the block as clap param value events.
+    /// The parameter index is the clap parameter id and the value is the plain value.
+    pub fn convert_parameter_changes_to_clap<'a>(changes: impl Iterator<Item = &'a PluginParameter>) -> Vec<simple_clap_host_helper_lib::plugin::instance::process::Event> {
+        changes.map(|change| simple_clap_host_helper_lib::plugin::instance::process::Event::ParamValue(clap_event_param_value {
+            header: clap_event_header {
+                size: std::mem::size_of::<clap_event_param_value>() as u32,
+                time: change.position() as u32,
+                space_id: CLAP_CORE_EVENT_SPACE_ID,
+                type_: CLAP_EVENT_PARAM_VALUE,
+                flags: 0,
+            },
+            param_id: change.index as u32,
+            cookie: std::ptr::null_mut(),
+            note_id: -1,
+            port_index: -1,
+            channel: -1,
+            key: -1,
+            value: change.value() as f64,
+        })).collect()
+    }
 
-        for riff_ref in riff_refs {
-            for riff in riffs.iter() {
-                if riff.uuid().to_string() == riff_ref.linked_to() {
-                    println!("util-extract_riff_ref_events: riff name={}", riff.name());
-                    for event in riff.events().iter() {
-                        if let TrackEvent::Note(note) = event {
-                            // create a note on and a note off event
-                            let note_on = NoteOn::new_with_params(
-                                (riff_ref.position() + note.position()) / bpm * 60.0 * sample_rate, 
-                                note.note(), 
-                                note.velocity());
-                            events_all.push(TrackEvent::NoteOn(note_on));
-                            let note_off = NoteOff::new_with_params(
-                                (riff_ref.position() + note.position() + note.length()) / bpm * 60.0 * sample_rate, 
-                                note.note(), 
-                                note.velocity());
-                            events_all.push(TrackEvent::NoteOff(note_off));
-                        }
-                        else {
-                            let mut cloned_track_event = event.clone();
-                            cloned_track_event.set_position((riff_ref.position() + event.position()) / bpm * 60.0 * sample_rate);
-                            events_all.push(cloned_track_event);
-                        }
-                    }
+    /// The frame offset within the block of the clap events this host sends.
+    pub fn clap_event_time(event: &simple_clap_host_helper_lib::plugin::instance::process::Event) -> u32 {
+        match event {
+            simple_clap_host_helper_lib::plugin::instance::process::Event::Note(event) => event.header.time,
+            simple_clap_host_helper_lib::plugin::instance::process::Event::NoteExpression(event) => event.header.time,
+            simple_clap_host_helper_lib::plugin::instance::process::Event::ParamValue(event) => event.header.time,
+            simple_clap_host_helper_lib::plugin::instance::process::Event::Midi(event) => event.header.time,
+            _ => 0,
+        }
+    }
 
-                    // add the measure boundary markers
-                    let number_of_measures = (riff.length() / 4.0) as i32; // TODO need to pass through the beats per bar
-                    for measure_number in 0..number_of_measures {
-                        let measure_boundary_marker = Measure::new((riff_ref.position() + ((measure_number + 1) * 4) as f64) / bpm * 60.0 * sample_rate);
-                        events_all.push(TrackEvent::Measure(measure_boundary_marker));
-                        println!("^^^^^^^^^^^^^^^^^^^^^^ added a measure boundary");
-                    }
+    pub fn extract_riff_ref_events(riffs: &Vec<Riff>, riff_refs: &Vec<RiffReference>, bpm: f64, sample_rate: f64, _midi_channel: i32) -> Vec<TrackEvent> {
+        let mut events_all: Vec<TrackEvent> = Vec::new();
+        let riffs_by_uuid = UuidIndex::new(riffs.iter().map(|riff| (riff.uuid(), riff)));
 
-                    // somehow add the full play out loop point marker
+        for riff_ref in riff_refs {
+            if let Some(riff) = riffs_by_uuid.get_str(riff_ref.linked_to_str()) {
+                println!("util-extract_riff_ref_events: riff name={}", riff.name());
+                // create a note on and a note off event for each note straight from the riff's note columns
+                let notes = riff.event_store().notes();
+                events_all.reserve(notes.len() * 2);
+                for row in 0..notes.len() {
+                    let note_position = riff_ref.position() + notes.positions[row];
+                    events_all.push(TrackEvent::NoteOn(NoteOn::new_with_params(note_position / bpm * 60.0 * sample_rate, notes.pitches[row], notes.velocities[row])));
+                    events_all.push(TrackEvent::NoteOff(NoteOff::new_with_params((note_position + notes.lengths[row]) / bpm * 60.0 * sample_rate, notes.pitches[row], notes.velocities[row])));
+                }
 
+                for event in riff.events().iter().filter(|event| !matches!(event, TrackEvent::Note(_))) {
+                    let mut cloned_track_event = event.clone();
+                    cloned_track_event.set_position((riff_ref.position() + event.position()) / bpm * 60.0 * sample_rate);
+                    events_all.push(cloned_track_event);
+                }
 
-                    break;
+                // add the measure boundary markers
+                let number_of_measures = (riff.length() / 4.0) as i32; // TODO need to pass through the beats per bar
+                for measure_number in 0..number_of_measures {
+                    let measure_boundary_marker = Measure::new((riff_ref.position() + ((measure_number + 1) * 4) as f64) / bpm * 60.0 * sample_rate);
+                    events_all.push(TrackEvent::Measure(measure_boundary_marker));
+                    println!("^^^^^^^^^^^^^^^^^^^^^^ added a measure boundary");
                 }
+
+                // somehow add the full play out loop point marker
             }
         }
 
@@ -932,14 +1063,44 @@ impl DAWUtils {
     }
 }
 
+/// 64 bit FNV-1a. Unlike DefaultHasher its output doesn't change between Rust versions (or runs) so it can be saved in
+/// project files and used in cache file names. Feed it bytes with a fixed byte order.
+pub struct StableHasher {
+    hash: u64,
+}
+
+impl StableHasher {
+    pub fn new() -> Self {
+        Self { hash: 0xcbf2_9ce4_8422_2325 }
+    }
+
+    pub fn write(&mut self, bytes: &[u8]) {
+        for byte in bytes.iter() {
+            self.hash ^= *byte as u64;
+            self.hash = self.hash.wrapping_mul(0x0000_0100_0000_01b3);
+        }
+    }
+
+    /// Length prefixed so that consecutive fields can't run into each other.
+    pub fn write_str(&mut self, value: &str) {
+        self.write(&(value.len() as u64).to_le_bytes());
+        self.write(value.as_bytes());
+    }
+
+    pub fn finish(&self) -> u64 {
+        self.hash
+    }
+}
+
 
 #[cfg(test)]
 mod tests {
     use uuid::Uuid;
 
     use crate::DAWUtils;
+    use crate::utils::StableHasher;
     // use {DAWEventPosition, Riff, RiffReference, Track, TrackEvent, VstPluginParameter};
-    use crate::domain::{DAWItemPosition, Note, Riff, RiffReference, TrackEvent};
+    use crate::domain::{Controller, DAWItemPosition, Note, Riff, RiffReference, TrackEvent};
 
     #[test]
     fn riff_sequence_convert_to_vst_events_one_measure_gap_before_first_note() {
@@ -1005,6 +1166,110 @@ mod tests {
         assert_eq!(8 + 1 /* measure end */, number_of_found_events);
     }
 
+    #[test]
+    fn convert_to_event_blocks_buckets_automation_interleaved_with_riff_events() {
+        let bpm = 140.0;
+        let sample_rate = 44100.0;
+        let block_size = 1024.0;
+        let song_length_in_beats = 8.0;
+        let mut riffs: Vec<Riff> = vec![];
+        let mut riff_refs: Vec<RiffReference> = vec![];
+
+        // a one bar riff with a note on every beat
+        let mut riff = Riff::new_with_name_and_length(Uuid::new_v4(), "test".to_string(), 4.0);
+        for position in 0..4 {
+            let note = Note::new_with_params(position as f64, 60, 127, 0.5);
+            riff.events_mut().push(TrackEvent::Note(note));
+        }
+        let mut riff_ref = RiffReference::new(Uuid::new_v4().to_string(), 0.0);
+        riff_ref.set_linked_to(riff.uuid().to_string());
+        riffs.push(riff);
+        riff_refs.push(riff_ref);
+
+        // automation that lands between and after the riff events
+        let automation: Vec<TrackEvent> = vec![
+            TrackEvent::Controller(Controller::new(6.0, 1, 64)),
+            TrackEvent::Controller(Controller::new(1.5, 1, 32)),
+        ];
+
+        let (event_blocks, _param_event_blocks) =
+            DAWUtils::convert_to_event_blocks(&automation, &riffs, &riff_refs, bpm, block_size, sample_rate, song_length_in_beats, 0);
+
+        // 8 note on/offs + 1 measure + 2 controllers
+        assert_eq!(11, event_blocks.event_count());
+        assert_eq!(event_blocks.event_count(), event_blocks.iter().map(|block| block.len()).sum::<usize>());
+
+        for (position_in_beats, value) in [(1.5, 32), (6.0, 64)] {
+            let position_in_frames = (position_in_beats / bpm * 60.0 * sample_rate) as i32;
+            let block = event_blocks.get((position_in_frames / block_size as i32) as usize).unwrap();
+            let found = block.iter().any(|event| match event {
+                TrackEvent::Controller(controller) => controller.value() == value && controller.position() as i32 == position_in_frames % block_size as i32,
+                _ => false,
+            });
+            assert!(found);
+        }
+    }
+
+    #[test]
+    fn replace_dirty_blocks_matches_full_rebuild_after_riff_edit() {
+        let bpm = 140.0;
+        let sample_rate = 44100.0;
+        let block_size = 1024.0;
+        let song_length_in_beats = 32.0;
+        let automation: Vec<TrackEvent> = vec![];
+        let mut riffs: Vec<Riff> = vec![];
+        let mut riff_refs: Vec<RiffReference> = vec![];
+
+        let mut edited_riff = Riff::new_with_name_and_length(Uuid::new_v4(), "edited".to_string(), 4.0);
+        edited_riff.events_mut().push(TrackEvent::Note(Note::new_with_params(0.0, 60, 127, 1.0)));
+        let mut other_riff = Riff::new_with_name_and_length(Uuid::new_v4(), "other".to_string(), 4.0);
+        other_riff.events_mut().push(TrackEvent::Note(Note::new_with_params(2.0, 64, 127, 1.0)));
+
+        for (position, riff) in [(0.0, &edited_riff), (4.0, &other_riff), (16.0, &edited_riff), (18.0, &other_riff)] {
+            let mut riff_ref = RiffReference::new(Uuid::new_v4().to_string(), position);
+            riff_ref.set_linked_to(riff.uuid().to_string());
+            riff_refs.push(riff_ref);
+        }
+        riffs.push(edited_riff);
+        riffs.push(other_riff);
+
+        let (mut event_blocks, mut param_event_blocks) =
+            DAWUtils::convert_to_event_blocks(&automation, &riffs, &riff_refs, bpm, block_size, sample_rate, song_length_in_beats, 0);
+
+        // edit the riff - a note that runs past the end of the riff and then, taking it out again, one that shortens it
+        for edit in 0..2 {
+            let pre_edit_extent_in_beats = DAWUtils::riff_extent_in_beats(riffs.get(0).unwrap());
+            if edit == 0 {
+                riffs.get_mut(0).unwrap().events_mut().push(TrackEvent::Note(Note::new_with_params(3.0, 67, 127, 2.5)));
+            }
+            else {
+                riffs.get_mut(0).unwrap().events_mut().pop();
+            }
+
+            let dirty_block_ranges = DAWUtils::get_riff_dirty_block_ranges(riffs.get(0).unwrap(), pre_edit_extent_in_beats, &riff_refs, bpm, block_size, sample_rate, event_blocks.len());
+            assert_eq!(2, dirty_block_ranges.len());
+
+            for (start_block, end_block) in dirty_block_ranges {
+                let (replacement_event_blocks, replacement_param_event_blocks) =
+                    DAWUtils::convert_to_event_blocks_for_block_range(&automation, &riffs, &riff_refs, bpm, block_size, sample_rate, start_block, end_block, 0);
+                event_blocks.replace_blocks(start_block, replacement_event_blocks);
+                param_event_blocks.replace_blocks(start_block, replacement_param_event_blocks);
+            }
+
+            let (expected_event_blocks, _expected_param_event_blocks) =
+                DAWUtils::convert_to_event_blocks(&automation, &riffs, &riff_refs, bpm, block_size, sample_rate, song_length_in_beats, 0);
+
+            assert_eq!(expected_event_blocks.len(), event_blocks.len());
+            assert_eq!(expected_event_blocks.event_count(), event_blocks.event_count());
+            for (expected_block, block) in expected_event_blocks.iter().zip(event_blocks.iter()) {
+                assert_eq!(expected_block.len(), block.len());
+                for (expected_event, event) in expected_block.iter().zip(block.iter()) {
+                    assert_eq!(expected_event.position() as i32, event.position() as i32);
+                }
+            }
+        }
+    }
+
     #[test]
     fn convert_riff_ref_events_to_vst_events_one_measure_gap_before_first_note() {
         let bpm = 140.0;
@@ -1092,4 +1357,20 @@ mod tests {
 
         assert_eq!(0, midi_events.get(0_usize).unwrap().delta_frames);
     }
+
+    #[test]
+    fn block_number_at_beat_follows_block_size_and_sample_rate() {
+        // 2 beats at 120 bpm is 1 second
+        assert_eq!(43, DAWUtils::block_number_at_beat(2.0, 120.0, 44100.0, 1024.0));
+        assert_eq!(375, DAWUtils::block_number_at_beat(2.0, 120.0, 48000.0, 128.0));
+        assert_eq!(0, DAWUtils::block_number_at_beat(0.0, 140.0, 96000.0, 256.0));
+    }
+
+    #[test]
+    fn stable_hasher_is_fnv_1a() {
+        let mut hasher = StableHasher::new();
+        assert_eq!(0xcbf2_9ce4_8422_2325, hasher.finish());
+        hasher.write(b"a");
+        assert_eq!(0xaf63_dc4c_8601_ec8c, hasher.finish());
+    }
 }
\ No newline at end of file
@@ -0,0 +1,371 @@
+use std::collections::HashMap;
+use std::fs::File;
+use std::io::{BufReader, BufWriter, Read, Write};
+use std::path::PathBuf;
+use std::sync::Arc;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::thread;
+use std::time::UNIX_EPOCH;
+
+use log::*;
+use sndfile::*;
+
+use crate::constants::WAVEFORM_PEAK_BUILDER_THREAD_NAME;
+use crate::event::DAWEvents;
+
+const WAVEFORM_PEAK_BASE_FRAMES_PER_PEAK: usize = 256;
+const WAVEFORM_PEAK_LEVEL_FACTOR: usize = 4; // each level has a peak for every 4 of the level below
+const WAVEFORM_PEAK_READ_CHUNK_FRAMES: usize = 65536;
+const WAVEFORM_PEAK_FILE_EXTENSION: &str = "peaks";
+const WAVEFORM_PEAK_FILE_MAGIC: &[u8; 8] = b"RDAWPK01";
+
+/// The range and loudness of a run of frames across all the channels.
+#[derive(Clone, Copy, PartialEq, Debug)]
+pub struct WaveformPeak {
+    pub min: f32,
+    pub max: f32,
+    pub rms: f32,
+}
+
+impl WaveformPeak {
+    /// One peak covering all of the given peaks - they are assumed to cover the same number of frames each.
+    fn combine(peaks: &[WaveformPeak]) -> WaveformPeak {
+        let mut combined = WaveformPeak { min: 0.0, max: 0.0, rms: 0.0 };
+        let mut sum_of_squares = 0.0;
+        for peak in peaks.iter() {
+            combined.min = combined.min.min(peak.min);
+            combined.max = combined.max.max(peak.max);
+            sum_of_squares += peak.rms * peak.rms;
+        }
+        if !peaks.is_empty() {
+            combined.rms = (sum_of_squares / peaks.len() as f32).sqrt();
+        }
+        combined
+    }
+}
+
+struct WaveformPeakLevel {
+    frames_per_peak: usize,
+    peaks: Vec<WaveformPeak>,
+}
+
+/// A min/max/rms overview of a sample file at several resolutions - WAVEFORM_PEAK_BASE_FRAMES_PER_PEAK frames per peak
+/// for the finest level, WAVEFORM_PEAK_LEVEL_FACTOR times as many for each level after that. Drawing a waveform picks
+/// the level that suits the zoom so it costs about the same however long the sample is.
+pub struct WaveformPeaks {
+    sample_rate: u32,
+    length_in_frames: usize,
+    levels: Vec<WaveformPeakLevel>, // finest first
+}
+
+impl WaveformPeaks {
+    /// The source file's sample rate - not the song's.
+    pub fn sample_rate(&self) -> u32 {
+        self.sample_rate
+    }
+
+    pub fn length_in_frames(&self) -> usize {
+        self.length_in_frames
+    }
+
+    fn from_base_level(sample_rate: u32, length_in_frames: usize, base_peaks: Vec<WaveformPeak>) -> Self {
+        let mut levels = vec![WaveformPeakLevel { frames_per_peak: WAVEFORM_PEAK_BASE_FRAMES_PER_PEAK, peaks: base_peaks }];
+        while let Some(level) = levels.last().filter(|level| level.peaks.len() > 1) {
+            let peaks = level.peaks.chunks(WAVEFORM_PEAK_LEVEL_FACTOR).map(WaveformPeak::combine).collect();
+            let frames_per_peak = level.frames_per_peak * WAVEFORM_PEAK_LEVEL_FACTOR;
+            levels.push(WaveformPeakLevel { frames_per_peak, peaks });
+        }
+
+        Self {
+            sample_rate,
+            length_in_frames,
+            levels,
+        }
+    }
+
+    /// The coarsest level that still has at least one peak per pixel.
+    fn level(&self, frames_per_pixel: f64) -> &WaveformPeakLevel {
+        self.levels.iter().rev()
+            .find(|level| level.frames_per_peak as f64 <= frames_per_pixel)
+            .unwrap_or(&self.levels[0])
+    }
+
+    /// Calls pixel_handler with (pixel, peak) for each of the pixels from start_frame that has any of the sample in it.
+    pub fn for_each_pixel<F: FnMut(usize, WaveformPeak)>(&self, start_frame: f64, frames_per_pixel: f64, pixels: usize, mut pixel_handler: F) {
+        if frames_per_pixel <= 0.0 {
+            return;
+        }
+        let level = self.level(frames_per_pixel);
+        let frames_per_peak = level.frames_per_peak as f64;
+
+        for pixel in 0..pixels {
+            let pixel_start_frame = (start_frame + pixel as f64 * frames_per_pixel).max(0.0);
+            let first_peak = (pixel_start_frame / frames_per_peak) as usize;
+            if first_peak >= level.peaks.len() {
+                break;
+            }
+            let last_peak = (((pixel_start_frame + frames_per_pixel) / frames_per_peak).ceil() as usize).clamp(first_peak + 1, level.peaks.len());
+            pixel_handler(pixel, WaveformPeak::combine(&level.peaks[first_peak..last_peak]));
+        }
+    }
+
+    /// Read the whole sample file and work out its peaks.
+    pub fn build(file_name: &str) -> Option<Self> {
+        let mut sample_file = OpenOptions::ReadOnly(ReadOptions::Auto).from_path(file_name).ok()?;
+        let channels = sample_file.get_channels();
+        let sample_rate = sample_file.get_samplerate() as u32;
+        if channels == 0 {
+            return None;
+        }
+
+        let mut chunk = vec![0.0_f32; WAVEFORM_PEAK_READ_CHUNK_FRAMES * channels];
+        let mut base_peaks = vec![];
+        let mut peak = WaveformPeak { min: 0.0, max: 0.0, rms: 0.0 };
+        let mut sum_of_squares = 0.0_f64;
+        let mut frames_in_peak = 0;
+        let mut length_in_frames = 0;
+
+        loop {
+            let frames_read = sample_file.read_to_slice(chunk.as_mut_slice()).unwrap_or(0);
+            if frames_read == 0 {
+                break;
+            }
+            for frame_samples in chunk[..frames_read * channels].chunks_exact(channels) {
+                for sample in frame_samples.iter() {
+                    peak.min = peak.min.min(*sample);
+                    peak.max = peak.max.max(*sample);
+                    sum_of_squares += (*sample as f64) * (*sample as f64);
+                }
+                frames_in_peak += 1;
+                if frames_in_peak == WAVEFORM_PEAK_BASE_FRAMES_PER_PEAK {
+                    peak.rms = (sum_of_squares / (frames_in_peak * channels) as f64).sqrt() as f32;
+                    base_peaks.push(peak);
+                    peak = WaveformPeak { min: 0.0, max: 0.0, rms: 0.0 };
+                    sum_of_squares = 0.0;
+                    frames_in_peak = 0;
+                }
+            }
+            length_in_frames += frames_read;
+        }
+        if frames_in_peak > 0 {
+            peak.rms = (sum_of_squares / (frames_in_peak * channels) as f64).sqrt() as f32;
+            base_peaks.push(peak);
+        }
+
+        Some(Self::from_base_level(sample_rate, length_in_frames, base_peaks))
+    }
+
+    /// The peaks from the sample's peak file if it is up to date, otherwise built from the sample and saved to the peak
+    /// file for next time.
+    pub fn load_or_build(file_name: &str) -> Option<Self> {
+        let source_key = Self::source_key(file_name)?;
+        let peak_file_path = Self::peak_file_path(file_name);
+
+        if let Some(peaks) = Self::read(&peak_file_path, source_key) {
+            return Some(peaks);
+        }
+
+        let peaks = Self::build(file_name)?;
+        match peaks.write(&peak_file_path, source_key) {
+            Ok(_) => (),
+            Err(error) => info!("Waveform peaks: could not save the peak file for {}: {:?}", file_name, error),
+        }
+        Some(peaks)
+    }
+
+    /// Peak files sit next to the sample - kick.wav has kick.wav.peaks.
+    pub fn peak_file_path(file_name: &str) -> PathBuf {
+        PathBuf::from(format!("{}.{}", file_name, WAVEFORM_PEAK_FILE_EXTENSION))
+    }
+
+    /// A peak file is only used if the sample's size and modification time are what they were when it was written.
+    fn source_key(file_name: &str) -> Option<(u64, u64)> {
+        let metadata = std::fs::metadata(file_name).ok()?;
+        let modified = metadata.modified().ok()
+            .and_then(|modified| modified.duration_since(UNIX_EPOCH).ok())
+            .map_or(0, |modified| modified.as_nanos() as u64);
+        Some((metadata.len(), modified))
+    }
+
+    fn write(&self, path: &PathBuf, source_key: (u64, u64)) -> std::io::Result<()> {
+        let partial_path = path.with_extension("partial");
+        {
+            let mut writer = BufWriter::new(File::create(&partial_path)?);
+            writer.write_all(WAVEFORM_PEAK_FILE_MAGIC)?;
+            writer.write_all(&source_key.0.to_le_bytes())?;
+            writer.write_all(&source_key.1.to_le_bytes())?;
+            writer.write_all(&self.sample_rate.to_le_bytes())?;
+            writer.write_all(&(self.length_in_frames as u64).to_le_bytes())?;
+            writer.write_all(&(self.levels[0].peaks.len() as u64).to_le_bytes())?;
+            // only the finest level is saved - the rest are quick to work out from it
+            for peak in self.levels[0].peaks.iter() {
+                writer.write_all(&peak.min.to_le_bytes())?;
+                writer.write_all(&peak.max.to_le_bytes())?;
+                writer.write_all(&peak.rms.to_le_bytes())?;
+            }
+            writer.flush()?;
+        }
+        std::fs::rename(&partial_path, path)
+    }
+
+    fn read(path: &PathBuf, source_key: (u64, u64)) -> Option<Self> {
+        let mut reader = BufReader::new(File::open(path).ok()?);
+        let mut magic = [0_u8; 8];
+        reader.read_exact(&mut magic).ok()?;
+        if &magic != WAVEFORM_PEAK_FILE_MAGIC || read_u64(&mut reader)? != source_key.0 || read_u64(&mut reader)? != source_key.1 {
+            return None;
+        }
+        let sample_rate = read_u32(&mut reader)?;
+        let length_in_frames = read_u64(&mut reader)? as usize;
+        let peak_count = read_u64(&mut reader)? as usize;
+        if peak_count != (length_in_frames + WAVEFORM_PEAK_BASE_FRAMES_PER_PEAK - 1) / WAVEFORM_PEAK_BASE_FRAMES_PER_PEAK {
+            return None;
+        }
+
+        let mut base_peaks = Vec::with_capacity(peak_count);
+        for _ in 0..peak_count {
+            let min = f32::from_bits(read_u32(&mut reader)?);
+            let max = f32::from_bits(read_u32(&mut reader)?);
+            let rms = f32::from_bits(read_u32(&mut reader)?);
+            base_peaks.push(WaveformPeak { min, max, rms });
+        }
+
+        Some(Self::from_base_level(sample_rate, length_in_frames, base_peaks))
+    }
+}
+
+fn read_u32<R: Read>(reader: &mut R) -> Option<u32> {
+    let mut bytes = [0_u8; 4];
+    reader.read_exact(&mut bytes).ok()?;
+    Some(u32::from_le_bytes(bytes))
+}
+
+fn read_u64<R: Read>(reader: &mut R) -> Option<u64> {
+    let mut bytes = [0_u8; 8];
+    reader.read_exact(&mut bytes).ok()?;
+    Some(u64::from_le_bytes(bytes))
+}
+
+/// The waveform peaks of the samples in use, by sample file name. Peaks are loaded or built by the waveform peak builder
+/// thread when a sample is added or a project is loaded - the painters only ever look them up.
+pub struct WaveformPeakCache {
+    peaks: Arc<parking_lot::Mutex<HashMap<String, Option<Arc<WaveformPeaks>>>>>, // None while being built
+    generation: Arc<AtomicU64>, // changes whenever peaks are added
+    tx_request: crossbeam_channel::Sender<String>,
+}
+
+impl WaveformPeakCache {
+    /// Sends DAWEvents::WaveformPeaksReady on the sender whenever a sample's peaks are ready to be drawn.
+    pub fn new(sender: crossbeam_channel::Sender<DAWEvents>) -> Self {
+        let (tx_request, rx_request) = crossbeam_channel::unbounded::<String>();
+        let peaks = Arc::new(parking_lot::Mutex::new(HashMap::new()));
+        let generation = Arc::new(AtomicU64::new(0));
+        let builder_peaks = peaks.clone();
+        let builder_generation = generation.clone();
+
+        let _ = thread::Builder::new().name(WAVEFORM_PEAK_BUILDER_THREAD_NAME.to_string()).spawn(move || {
+            for file_name in rx_request.iter() {
+                match WaveformPeaks::load_or_build(file_name.as_str()) {
+                    Some(waveform_peaks) => {
+                        builder_peaks.lock().insert(file_name.clone(), Some(Arc::new(waveform_peaks)));
+                        builder_generation.fetch_add(1, Ordering::AcqRel);
+                        let _ = sender.send(DAWEvents::WaveformPeaksReady(file_name));
+                    }
+                    None => {
+                        info!("Waveform peaks: could not read sample file: {}", file_name);
+                        // so that it can be asked for again
+                        builder_peaks.lock().remove(&file_name);
+                    }
+                }
+            }
+        });
+
+        Self {
+            peaks,
+            generation,
+            tx_request,
+        }
+    }
+
+    /// Load or build the sample's peaks in the background unless they are already there or on their way.
+    pub fn request(&self, file_name: &str) {
+        let mut peaks = self.peaks.lock();
+        if !peaks.contains_key(file_name) {
+            peaks.insert(file_name.to_string(), None);
+            match self.tx_request.send(file_name.to_string()) {
+                Ok(_) => (),
+                Err(error) => info!("Waveform peaks: could not request the peaks be built: {:?}", error),
+            }
+        }
+    }
+
+    pub fn peaks(&self, file_name: &str) -> Option<Arc<WaveformPeaks>> {
+        self.peaks.lock().get(file_name).cloned().flatten()
+    }
+
+    pub fn generation(&self) -> u64 {
+        self.generation.load(Ordering::Acquire)
+    }
+}
+
+/// The peaks of a song's samples that are ready to draw, by sample uuid, with what is needed to place them in beats.
+pub struct SampleWaveforms {
+    frames_per_beat_factor: f64, // 60 / tempo - times a sample rate for frames per beat
+    peaks: HashMap<String, Arc<WaveformPeaks>>,
+}
+
+impl SampleWaveforms {
+    /// samples are (sample uuid, sample file name).
+    pub fn new<'a, I: Iterator<Item = (&'a String, &'a str)>>(tempo: f64, samples: I, waveform_peak_cache: &WaveformPeakCache) -> Self {
+        Self {
+            frames_per_beat_factor: 60.0 / tempo.max(1.0),
+            peaks: samples.filter_map(|(sample_uuid, file_name)| waveform_peak_cache.peaks(file_name).map(|peaks| (sample_uuid.clone(), peaks))).collect(),
+        }
+    }
+
+    pub fn peaks(&self, sample_uuid: &str) -> Option<&Arc<WaveformPeaks>> {
+        self.peaks.get(sample_uuid)
+    }
+
+    /// Source frames per beat at the song tempo.
+    pub fn frames_per_beat(&self, peaks: &WaveformPeaks) -> f64 {
+        peaks.sample_rate() as f64 * self.frames_per_beat_factor
+    }
+
+    pub fn length_in_beats(&self, peaks: &WaveformPeaks) -> f64 {
+        peaks.length_in_frames() as f64 / self.frames_per_beat(peaks)
+    }
+
+    /// How far before the visible area a sample can start and still be seen.
+    pub fn longest_in_beats(&self) -> f64 {
+        self.peaks.values().map(|peaks| self.length_in_beats(peaks)).fold(0.0, f64::max)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use crate::waveform_peaks::{WAVEFORM_PEAK_BASE_FRAMES_PER_PEAK, WaveformPeak, WaveformPeaks};
+
+    #[test]
+    fn picks_the_coarsest_level_with_a_peak_per_pixel() {
+        // 64 base peaks - the loud one is the 40th
+        let base_peaks = (0..64).map(|index| if index == 40 {
+            WaveformPeak { min: -1.0, max: 1.0, rms: 0.5 }
+        }
+        else {
+            WaveformPeak { min: -0.1, max: 0.1, rms: 0.05 }
+        }).collect();
+        let peaks = WaveformPeaks::from_base_level(44100, 64 * WAVEFORM_PEAK_BASE_FRAMES_PER_PEAK, base_peaks);
+        assert_eq!(vec![256, 1024, 4096, 16384], peaks.levels.iter().map(|level| level.frames_per_peak).collect::<Vec<usize>>());
+        assert_eq!(1024, peaks.level(2000.0).frames_per_peak);
+        assert_eq!(256, peaks.level(10.0).frames_per_peak);
+
+        // the whole sample in 4 pixels - each pixel is one peak from the top level
+        let mut pixels = vec![];
+        peaks.for_each_pixel(0.0, 4096.0, 8, |pixel, peak| pixels.push((pixel, peak)));
+        assert_eq!(4, pixels.len());
+        assert_eq!(1.0, pixels[2].1.max);
+        assert_eq!(0.1, pixels[1].1.max);
+        assert!(pixels[2].1.rms > 0.05 && pixels[2].1.rms < 0.5);
+    }
+}